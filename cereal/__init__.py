@@ -5,5 +5,7 @@ import capnp
 CEREAL_PATH = os.path.dirname(os.path.abspath(__file__))
 capnp.remove_import_hook()
 
+# parsed at import, the manager imports this before it forks the python daemons so they
+# start with the schemas, see selfdrive/debug/cereal_import_time.py
 log = capnp.load(os.path.join(CEREAL_PATH, "log.capnp"))
 car = capnp.load(os.path.join(CEREAL_PATH, "car.capnp"))
@@ -1,9 +1,11 @@
 # must be build with scons
 from .messaging_pyx import Context, Poller, SubSocket, PubSocket  # pylint: disable=no-name-in-module, import-error
+from .messaging_pyx import SubMaster as NativeSubMaster  # pylint: disable=no-name-in-module, import-error
 from .messaging_pyx import MultiplePublishersError, MessagingError  # pylint: disable=no-name-in-module, import-error
 import capnp
 
-from typing import Optional, List, Union
+from collections.abc import Mapping
+from typing import Callable, Optional, List, Union
 
 from cereal import log
 from cereal.services import service_list
@@ -21,6 +23,9 @@ except ImportError:
 
 context = Context()
 
+# messages received by drain_sock_raw in one call
+DRAIN_BATCH = 1024
+
 def new_message(service: Optional[str] = None, size: Optional[int] = None) -> capnp.lib.capnp._DynamicStructBuilder:
   dat = log.Event.new_message()
   dat.logMonoTime = int(sec_since_boot() * 1e9)
@@ -54,16 +59,12 @@ def drain_sock_raw(sock: SubSocket, wait_for_one: bool = False) -> List[bytes]:
   """Receive all message currently available on the queue"""
   ret: List[bytes] = []
   while 1:
-    if wait_for_one and len(ret) == 0:
-      dat = sock.receive()
-    else:
-      dat = sock.receive(non_blocking=True)
-
-    if dat is None:
+    # in batches, see SubSocket.receive_all to skip the bytes per message too
+    dat, offsets = sock.receive_all(DRAIN_BATCH, wait_for_one and len(ret) == 0)
+    ret.extend(dat[offsets[i]:offsets[i + 1]] for i in range(len(offsets) - 1))
+    if len(offsets) - 1 < DRAIN_BATCH:
       break
 
-    ret.append(dat)
-
   return ret
 
 def drain_sock(sock: SubSocket, wait_for_one: bool = False) -> List[capnp.lib.capnp._DynamicStructReader]:
@@ -124,9 +125,59 @@ def recv_one_retry(sock: SubSocket) -> capnp.lib.capnp._DynamicStructReader:
     if dat is not None:
       return log.Event.from_bytes(dat)
 
+class ServiceView(Mapping):
+  """A read only dict of the services, looked up in the native SubMaster when they're read"""
+  def __init__(self, services: List[str], get: Callable):
+    self._services = services
+    self._get = get
+
+  def __getitem__(self, s):
+    if s not in self._services:
+      raise KeyError(s)
+    return self._get(s)
+
+  def __iter__(self):
+    return iter(self._services)
+
+  def __len__(self):
+    return len(self._services)
+
+
+def default_message(s: str) -> capnp.lib.capnp._DynamicStructBuilder:
+  try:
+    return new_message(s)
+  except capnp.lib.capnp.KjException:  # pylint: disable=c-extension-no-member
+    return new_message(s, 0) # lists
+
+
 class SubMaster():
   def __init__(self, services: List[str], poll: Optional[List[str]] = None,
                ignore_alive: Optional[List[str]] = None, addr:str ="127.0.0.1"):
+    if ignore_alive is not None:
+      self.ignore_alive = ignore_alive
+    else:
+      self.ignore_alive = []
+
+    # Receiving, timing and the bookkeeping are done by the C++ SubMaster, a message is only
+    # decoded when it's read. Without an address the messages are given to update_msgs instead
+    self.native = None
+    if addr is not None:
+      self.native = NativeSubMaster(list(services), list(poll or []), self.ignore_alive, addr.encode('utf8'), 5.)
+      self.frame = -1
+      self.freq = {s: service_list[s].frequency for s in services}
+      self.sock = {s: self.native.socket(s) for s in services}
+      self.updated = ServiceView(services, self.native.updated)
+      self.alive = ServiceView(services, self.native.alive)
+      self.rcv_time = ServiceView(services, lambda s: self.native.rcv_time(s) * 1e-9)
+      self.rcv_frame = ServiceView(services, lambda s: max(self.native.rcv_frame(s) - 1, 0))
+      self.logMonoTime = ServiceView(services, self.native.logMonoTime)
+      # valid until a message says otherwise
+      self.valid = ServiceView(services, lambda s: self.native.valid(s) if self.native.rcv_frame(s) else True)
+      self.data = ServiceView(services, self._decode)
+      # service: (rcv_frame, data), dropped once there's a newer message
+      self._decoded = {}
+      return
+
     self.frame = -1
     self.updated = {s: False for s in services}
     self.rcv_time = {s: 0. for s in services}
@@ -138,26 +189,9 @@ class SubMaster():
     self.valid = {}
     self.logMonoTime = {}
 
-    self.poller = Poller()
-    self.non_polled_services = [s for s in services if poll is not None and
-                                len(poll) and s not in poll]
-
-    if ignore_alive is not None:
-      self.ignore_alive = ignore_alive
-    else:
-      self.ignore_alive = []
-
     for s in services:
-      if addr is not None:
-        p = self.poller if s not in self.non_polled_services else None
-        self.sock[s] = sub_sock(s, poller=p, addr=addr, conflate=True)
       self.freq[s] = service_list[s].frequency
-
-      try:
-        data = new_message(s)
-      except capnp.lib.capnp.KjException:  # pylint: disable=c-extension-no-member
-        data = new_message(s, 0) # lists
-
+      data = default_message(s)
       self.data[s] = getattr(data, s)
       self.logMonoTime[s] = 0
       self.valid[s] = data.valid
@@ -165,15 +199,18 @@ class SubMaster():
   def __getitem__(self, s: str) -> capnp.lib.capnp._DynamicStructReader:
     return self.data[s]
 
+  def _decode(self, s: str) -> capnp.lib.capnp._DynamicStructReader:
+    rcv_frame = self.native.rcv_frame(s)
+    cached = self._decoded.get(s)
+    if cached is None or cached[0] != rcv_frame:
+      dat = self.native.raw(s)
+      msg = default_message(s) if dat is None else log.Event.from_bytes(dat)
+      cached = self._decoded[s] = (rcv_frame, getattr(msg, s))
+    return cached[1]
+
   def update(self, timeout: int = 1000) -> None:
-    msgs = []
-    for sock in self.poller.poll(timeout):
-      msgs.append(recv_one_or_none(sock))
-
-    # non-blocking receive for non-polled sockets
-    for s in self.non_polled_services:
-      msgs.append(recv_one_or_none(self.sock[s]))
-    self.update_msgs(sec_since_boot(), msgs)
+    self.native.update(timeout)
+    self.frame = self.native.frame - 1
 
   def update_msgs(self, cur_time: float, msgs: List[capnp.lib.capnp._DynamicStructReader]) -> None:
     self.frame += 1
@@ -1,8 +1,19 @@
 #include <iostream>
 #include <string>
+#include <algorithm>
 #include <cassert>
 #include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
 #include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include <getopt.h>
+#include <lz4.h>
+#include <zstd.h>
 
 typedef void (*sighandler_t)(int sig);
 
@@ -11,28 +22,100 @@ typedef void (*sighandler_t)(int sig);
 #include "impl_msgq.hpp"
 #include "impl_zmq.hpp"
 
+// Framing used in batch mode. Every packet carries the messages of one service
+// that arrived during one window: a header, the service name, and a payload of
+// [uint32 size][data] records that is optionally compressed as a whole.
+#define BRIDGE_MAGIC 0x47445242 // "BRDG"
+#define BRIDGE_DEFAULT_PORT "8099"
+#define BRIDGE_MAX_BATCH_SIZE (4 * 1024 * 1024)
+#define BRIDGE_MAX_BATCH_COUNT 0xffff
+
+enum BridgeCompression : uint8_t {
+  COMPRESSION_NONE = 0,
+  COMPRESSION_LZ4 = 1,
+  COMPRESSION_ZSTD = 2,
+};
+
+struct __attribute__((packed)) BridgeHeader {
+  uint32_t magic;
+  uint8_t compression;
+  uint8_t name_len;
+  uint16_t count;
+  uint32_t raw_size;
+};
+
+struct Batch {
+  std::string name;
+  std::vector<char> raw;
+  uint16_t count = 0;
+  uint64_t seen = 0;
+  std::chrono::steady_clock::time_point start;
+};
+
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
   std::cout << "SIGPIPE received" << std::endl;
 }
 
-static std::vector<std::string> get_services() {
+static std::vector<std::string> get_services(const std::set<std::string> &allowlist) {
   std::vector<std::string> name_list;
 
   for (const auto& it : services) {
     std::string name = it.name;
     if (name == "plusFrame" || name == "uiLayoutState") continue;
+    if (!allowlist.empty() && allowlist.count(name) == 0) continue;
     name_list.push_back(name);
   }
 
   return name_list;
 }
 
+static std::set<std::string> split(const std::string &s) {
+  std::set<std::string> ret;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) ret.insert(item);
+  }
+  return ret;
+}
 
-int main(void){
-  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
+static void flush_batch(Batch &batch, PubSocket *pub_sock, BridgeCompression compression, std::vector<char> &packet) {
+  if (batch.count == 0) return;
+
+  size_t bound = batch.raw.size();
+  if (compression == COMPRESSION_LZ4) {
+    bound = LZ4_compressBound(batch.raw.size());
+  } else if (compression == COMPRESSION_ZSTD) {
+    bound = ZSTD_compressBound(batch.raw.size());
+  }
+  packet.resize(sizeof(BridgeHeader) + batch.name.size() + bound);
 
-  auto endpoints = get_services();
+  BridgeHeader hdr = {BRIDGE_MAGIC, compression, (uint8_t)batch.name.size(), batch.count, (uint32_t)batch.raw.size()};
+  memcpy(packet.data(), &hdr, sizeof(hdr));
+  memcpy(packet.data() + sizeof(hdr), batch.name.data(), batch.name.size());
+
+  char *payload = packet.data() + sizeof(hdr) + batch.name.size();
+  size_t payload_size = batch.raw.size();
+  if (compression == COMPRESSION_LZ4) {
+    int rc = LZ4_compress_default(batch.raw.data(), payload, batch.raw.size(), bound);
+    assert(rc > 0);
+    payload_size = rc;
+  } else if (compression == COMPRESSION_ZSTD) {
+    size_t rc = ZSTD_compress(payload, bound, batch.raw.data(), batch.raw.size(), 1);
+    assert(!ZSTD_isError(rc));
+    payload_size = rc;
+  } else {
+    memcpy(payload, batch.raw.data(), batch.raw.size());
+  }
+
+  pub_sock->send(packet.data(), sizeof(hdr) + batch.name.size() + payload_size);
+  batch.raw.clear();
+  batch.count = 0;
+}
+
+static void run_forward() {
+  auto endpoints = get_services({});
 
   std::map<SubSocket*, PubSocket*> sub2pub;
 
@@ -60,5 +143,226 @@ int main(void){
       delete msg;
     }
   }
+}
+
+static void run_batch(const std::set<std::string> &allowlist, int window_ms, int decimation,
+                      BridgeCompression compression, const std::string &port) {
+  auto endpoints = get_services(allowlist);
+
+  std::map<SubSocket*, Batch> batches;
+
+  Context *zmq_context = new ZMQContext();
+  Context *msgq_context = new MSGQContext();
+  Poller *poller = new MSGQPoller();
+
+  PubSocket * zmq_sock = new ZMQPubSocket();
+  if (zmq_sock->connect(zmq_context, port, false) != 0){
+    std::cerr << "bridge: failed to bind port " << port << std::endl;
+    exit(1);
+  }
+
+  for (auto endpoint: endpoints){
+    SubSocket * msgq_sock = new MSGQSubSocket();
+    msgq_sock->connect(msgq_context, endpoint, "127.0.0.1", false);
+    poller->registerSocket(msgq_sock);
+    batches[msgq_sock].name = endpoint;
+  }
+
+  std::vector<SubSocket*> ready;
+  std::vector<char> packet;
+  const auto window = std::chrono::milliseconds(window_ms);
+
+  while (true){
+    // Wake up in time for the oldest pending batch
+    int timeout = window_ms;
+    auto now = std::chrono::steady_clock::now();
+    for (auto &it : batches){
+      if (it.second.count > 0){
+        auto due = std::chrono::duration_cast<std::chrono::milliseconds>(it.second.start + window - now).count();
+        timeout = std::max(0, std::min(timeout, (int)due));
+      }
+    }
+
+    poller->poll(timeout, ready);
+    now = std::chrono::steady_clock::now();
+
+    for (auto sub_sock : ready){
+      Batch &batch = batches[sub_sock];
+
+      char *data;
+      size_t size;
+      while ((size = sub_sock->receiveView(&data)) > 0){
+        if ((batch.seen++ % decimation) != 0){
+          sub_sock->releaseView();
+          continue;
+        }
+
+        if (batch.raw.size() + sizeof(uint32_t) + size > BRIDGE_MAX_BATCH_SIZE || batch.count == BRIDGE_MAX_BATCH_COUNT){
+          flush_batch(batch, zmq_sock, compression, packet);
+        }
+        if (batch.count == 0){
+          batch.start = now;
+        }
+
+        // Copy straight from the ring, drop the record again if it was overwritten while copying
+        size_t offset = batch.raw.size();
+        uint32_t record_size = size;
+        batch.raw.resize(offset + sizeof(record_size) + size);
+        memcpy(batch.raw.data() + offset, &record_size, sizeof(record_size));
+        memcpy(batch.raw.data() + offset + sizeof(record_size), data, size);
+
+        if (sub_sock->releaseView()){
+          batch.count++;
+        } else {
+          batch.raw.resize(offset);
+        }
+      }
+    }
+
+    for (auto &it : batches){
+      if (it.second.count > 0 && now - it.second.start >= window){
+        flush_batch(it.second, zmq_sock, compression, packet);
+      }
+    }
+  }
+}
+
+// Validates and decompresses a packet, msgs points into raw afterwards
+static bool unpack_batch(char *packet, size_t packet_size, std::string &name, std::vector<char> &raw,
+                         std::vector<char *> &msgs, std::vector<size_t> &sizes) {
+  BridgeHeader hdr;
+  if (packet_size < sizeof(hdr)) return false;
+  memcpy(&hdr, packet, sizeof(hdr));
+  if (hdr.magic != BRIDGE_MAGIC || packet_size < sizeof(hdr) + hdr.name_len || hdr.raw_size > BRIDGE_MAX_BATCH_SIZE) return false;
+
+  name.assign(packet + sizeof(hdr), hdr.name_len);
+  char *payload = packet + sizeof(hdr) + hdr.name_len;
+  size_t payload_size = packet_size - sizeof(hdr) - hdr.name_len;
+
+  raw.resize(hdr.raw_size);
+  if (hdr.compression == COMPRESSION_LZ4) {
+    if (LZ4_decompress_safe(payload, raw.data(), payload_size, hdr.raw_size) != (int)hdr.raw_size) return false;
+  } else if (hdr.compression == COMPRESSION_ZSTD) {
+    if (ZSTD_decompress(raw.data(), hdr.raw_size, payload, payload_size) != hdr.raw_size) return false;
+  } else if (hdr.compression == COMPRESSION_NONE && payload_size == hdr.raw_size) {
+    memcpy(raw.data(), payload, payload_size);
+  } else {
+    return false;
+  }
+
+  msgs.clear();
+  sizes.clear();
+  size_t offset = 0;
+  for (int i = 0; i < hdr.count; i++){
+    uint32_t size;
+    if (offset + sizeof(size) > raw.size()) return false;
+    memcpy(&size, raw.data() + offset, sizeof(size));
+    offset += sizeof(size);
+    if (offset + size > raw.size()) return false;
+    msgs.push_back(raw.data() + offset);
+    sizes.push_back(size);
+    offset += size;
+  }
+  return true;
+}
+
+static void run_receive(const std::string &address, const std::string &port) {
+  std::map<std::string, PubSocket*> pub_socks;
+
+  Context *zmq_context = new ZMQContext();
+  Context *msgq_context = new MSGQContext();
+
+  SubSocket * zmq_sock = new ZMQSubSocket();
+  if (zmq_sock->connect(zmq_context, port, address, false, false) != 0){
+    std::cerr << "bridge: failed to connect to " << address << ":" << port << std::endl;
+    exit(1);
+  }
+
+  std::string name;
+  std::vector<char> raw;
+  std::vector<char *> msgs;
+  std::vector<size_t> sizes;
+
+  while (true){
+    Message * msg = zmq_sock->receive();
+    if (msg == NULL) continue;
+
+    if (!unpack_batch(msg->getData(), msg->getSize(), name, raw, msgs, sizes)){
+      std::cerr << "bridge: dropping invalid packet of " << msg->getSize() << " bytes" << std::endl;
+      delete msg;
+      continue;
+    }
+    delete msg;
+
+    PubSocket *&pub_sock = pub_socks[name];
+    if (pub_sock == NULL){
+      pub_sock = new MSGQPubSocket();
+      if (pub_sock->connect(msgq_context, name) != 0){
+        std::cerr << "bridge: unknown service " << name << std::endl;
+        delete pub_sock;
+        pub_sock = NULL;
+        continue;
+      }
+    }
+    pub_sock->sendBatch(msgs.data(), sizes.data(), msgs.size());
+  }
+}
+
+static void usage() {
+  std::cerr << "usage: bridge [--batch] [--window MS] [--compress none|lz4|zstd] [--services a,b,...]" << std::endl
+            << "              [--decimation N] [--port PORT]" << std::endl
+            << "       bridge --receive ADDRESS [--port PORT]" << std::endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]){
+  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
+
+  bool batch = false;
+  std::string receive_address;
+  std::set<std::string> allowlist;
+  int window_ms = 50;
+  int decimation = 1;
+  BridgeCompression compression = COMPRESSION_NONE;
+  std::string port = BRIDGE_DEFAULT_PORT;
+
+  static struct option long_options[] = {
+    {"batch", no_argument, NULL, 'b'},
+    {"window", required_argument, NULL, 'w'},
+    {"compress", required_argument, NULL, 'c'},
+    {"services", required_argument, NULL, 's'},
+    {"decimation", required_argument, NULL, 'd'},
+    {"port", required_argument, NULL, 'p'},
+    {"receive", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+    switch (opt){
+      case 'b': batch = true; break;
+      case 'w': window_ms = atoi(optarg); break;
+      case 's': allowlist = split(optarg); break;
+      case 'd': decimation = atoi(optarg); break;
+      case 'p': port = optarg; break;
+      case 'r': receive_address = optarg; break;
+      case 'c':
+        if (strcmp(optarg, "none") == 0) compression = COMPRESSION_NONE;
+        else if (strcmp(optarg, "lz4") == 0) compression = COMPRESSION_LZ4;
+        else if (strcmp(optarg, "zstd") == 0) compression = COMPRESSION_ZSTD;
+        else usage();
+        break;
+      default: usage();
+    }
+  }
+  if (window_ms <= 0 || decimation <= 0) usage();
+
+  if (!receive_address.empty()){
+    run_receive(receive_address, port);
+  } else if (batch){
+    run_batch(allowlist, window_ms, decimation, compression, port);
+  } else {
+    run_forward();
+  }
   return 0;
 }
@@ -0,0 +1,209 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+#include "services.h"
+#include "impl_fake.hpp"
+
+namespace {
+
+struct Waiter {
+  std::vector<FakeQueue*> queues;
+  bool woken = false;
+};
+
+// the subscribers of every endpoint, and who's waiting on them
+struct FakeBus {
+  std::mutex lock;
+  std::condition_variable cv;
+  std::map<std::string, std::vector<FakeQueue*>> subscribers;
+  std::vector<Waiter*> waiting;
+  bool exiting = false;
+};
+
+FakeBus &bus() {
+  static FakeBus b;
+  return b;
+}
+
+bool service_exists(const std::string &path) {
+  for (const auto& it : services) {
+    if (it.name == path) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// with the lock held, until a send to one of w's queues or the shutdown
+void wait(Waiter &w, std::unique_lock<std::mutex> &lk) {
+  FakeBus &b = bus();
+  b.waiting.push_back(&w);
+  b.cv.notify_all();
+  b.cv.wait(lk, [&]() { return w.woken || b.exiting; });
+  b.waiting.erase(std::remove(b.waiting.begin(), b.waiting.end(), &w), b.waiting.end());
+}
+
+}  // namespace
+
+void fake_msgq_wait_idle(int threads) {
+  FakeBus &b = bus();
+  std::unique_lock lk(b.lock);
+  b.cv.wait(lk, [&]() { return (int)b.waiting.size() >= threads || b.exiting; });
+}
+
+void fake_msgq_shutdown() {
+  FakeBus &b = bus();
+  {
+    std::lock_guard lk(b.lock);
+    b.exiting = true;
+  }
+  b.cv.notify_all();
+}
+
+void FakeMessage::init(size_t sz) {
+  close();
+  size = sz;
+  data = new char[size];
+}
+
+void FakeMessage::init(char * d, size_t sz) {
+  init(sz);
+  memcpy(data, d, size);
+}
+
+void FakeMessage::close() {
+  delete[] data;
+  data = NULL;
+  size = 0;
+}
+
+FakeMessage::~FakeMessage() {
+  this->close();
+}
+
+int FakeSubSocket::connect(Context *context, std::string endpoint, std::string address, bool conflate, bool check_endpoint){
+  assert(context);
+
+  if (check_endpoint && !service_exists(endpoint)){
+    std::cout << "Warning, " << endpoint << " is not in service list." << std::endl;
+  }
+
+  q = new FakeQueue;
+  q->endpoint = endpoint;
+  q->conflate = conflate;
+
+  FakeBus &b = bus();
+  std::lock_guard lk(b.lock);
+  b.subscribers[endpoint].push_back(q);
+  return 0;
+}
+
+Message * FakeSubSocket::receive(bool non_blocking){
+  FakeBus &b = bus();
+  std::unique_lock lk(b.lock);
+
+  Waiter w = {{q}};
+  while (q->msgs.empty() && !non_blocking && !b.exiting) {
+    w.woken = false;
+    wait(w, lk);
+  }
+
+  errno = (q->msgs.empty() && b.exiting) ? EINTR : 0;
+  if (q->msgs.empty()) {
+    return NULL;
+  }
+  Message *msg = q->msgs.front();
+  q->msgs.pop_front();
+  return msg;
+}
+
+FakeSubSocket::~FakeSubSocket(){
+  if (q != NULL){
+    FakeBus &b = bus();
+    {
+      std::lock_guard lk(b.lock);
+      auto &subs = b.subscribers[q->endpoint];
+      subs.erase(std::remove(subs.begin(), subs.end(), q), subs.end());
+    }
+    for (auto msg : q->msgs) delete msg;
+    delete q;
+  }
+}
+
+int FakePubSocket::connect(Context *context, std::string endpoint_, bool check_endpoint){
+  assert(context);
+
+  if (check_endpoint && !service_exists(endpoint_)){
+    std::cout << "Warning, " << endpoint_ << " is not in service list." << std::endl;
+  }
+
+  endpoint = endpoint_;
+  return 0;
+}
+
+int FakePubSocket::sendMessage(Message *message){
+  return send(message->getData(), message->getSize());
+}
+
+int FakePubSocket::send(char *data, size_t size){
+  FakeBus &b = bus();
+  {
+    std::lock_guard lk(b.lock);
+    for (auto q : b.subscribers[endpoint]) {
+      if (q->conflate) {
+        for (auto msg : q->msgs) delete msg;
+        q->msgs.clear();
+      }
+      FakeMessage *msg = new FakeMessage;
+      msg->init(data, size);
+      q->msgs.push_back(msg);
+
+      // whoever waits on it is busy from here, before it wakes up
+      for (auto w : b.waiting) {
+        if (std::find(w->queues.begin(), w->queues.end(), q) != w->queues.end()) w->woken = true;
+      }
+      b.waiting.erase(std::remove_if(b.waiting.begin(), b.waiting.end(), [](Waiter *w) { return w->woken; }), b.waiting.end());
+    }
+  }
+  b.cv.notify_all();
+  return size;
+}
+
+void FakePoller::registerSocket(SubSocket * socket){
+  sockets.push_back(socket);
+}
+
+std::vector<SubSocket*> FakePoller::poll(int timeout){
+  std::vector<SubSocket*> r;
+  poll(timeout, r);
+  return r;
+}
+
+void FakePoller::poll(int timeout, std::vector<SubSocket*> &ready){
+  ready.clear();
+
+  FakeBus &b = bus();
+  std::unique_lock lk(b.lock);
+
+  Waiter w;
+  for (auto s : sockets) w.queues.push_back((FakeQueue*)s->getRawSocket());
+
+  while (true) {
+    for (size_t i = 0; i < sockets.size(); i++){
+      if (!w.queues[i]->msgs.empty()){
+        ready.push_back(sockets[i]);
+      }
+    }
+    if (!ready.empty() || timeout == 0 || b.exiting){
+      return;
+    }
+    w.woken = false;
+    wait(w, lk);
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "messaging.hpp"
+#include <deque>
+#include <string>
+
+// In process sockets for replaying logs through a process deterministically, selected with
+// FAKE_MSGQ. A send is in every subscriber's queue when it returns, and a blocking receive
+// or poll waits for a send however long it takes, timeouts aren't used.
+
+// Blocks until threads threads are waiting in a receive or poll with nothing for them,
+// so everything sent before has been handled
+void fake_msgq_wait_idle(int threads);
+// Every waiting receive returns NULL with errno EINTR, and every poll nothing, from now on
+void fake_msgq_shutdown();
+
+class FakeContext : public Context {
+public:
+  void * getRawContext() {return NULL;}
+};
+
+class FakeMessage : public Message {
+private:
+  char * data = NULL;
+  size_t size = 0;
+public:
+  void init(size_t size);
+  void init(char *data, size_t size);
+  size_t getSize(){return size;}
+  char * getData(){return data;}
+  void close();
+  ~FakeMessage();
+};
+
+struct FakeQueue {
+  std::string endpoint;
+  bool conflate = false;
+  std::deque<Message*> msgs;
+};
+
+class FakeSubSocket : public SubSocket {
+private:
+  FakeQueue * q = NULL;
+public:
+  int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
+  void setTimeout(int timeout) {}
+  void * getRawSocket() {return (void*)q;}
+  Message *receive(bool non_blocking=false);
+  ~FakeSubSocket();
+};
+
+class FakePubSocket : public PubSocket {
+private:
+  std::string endpoint;
+public:
+  int connect(Context *context, std::string endpoint, bool check_endpoint=true);
+  int sendMessage(Message *message);
+  int send(char *data, size_t size);
+};
+
+class FakePoller : public Poller {
+private:
+  std::vector<SubSocket*> sockets;
+
+public:
+  void registerSocket(SubSocket *socket);
+  std::vector<SubSocket*> poll(int timeout);
+  void poll(int timeout, std::vector<SubSocket*> &ready);
+  ~FakePoller(){};
+};
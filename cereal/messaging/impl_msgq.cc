@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <csignal>
 #include <cerrno>
+#include <algorithm>
 
 #include "services.h"
 #include "impl_msgq.hpp"
@@ -25,14 +26,22 @@ static bool service_exists(std::string path){
   return false;
 }
 
-static size_t get_size(std::string endpoint){
-  size_t sz = DEFAULT_SEGMENT_SIZE;
-
-  if (endpoint == "frame" || endpoint == "frontFrame" || endpoint == "wideFrame"){
-    sz *= 10;
+static size_t get_num_readers(std::string endpoint){
+  for (const auto& it : services) {
+    if (it.name == endpoint && it.readers > 0) {
+      return std::min(it.readers, MAX_READERS);
+    }
   }
+  return NUM_READERS;
+}
 
-  return sz;
+static size_t get_size(std::string endpoint){
+  for (const auto& it : services) {
+    if (it.name == endpoint && it.segment_size > 0) {
+      return it.segment_size;
+    }
+  }
+  return DEFAULT_SEGMENT_SIZE;
 }
 
 
@@ -78,7 +87,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_num_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -140,6 +149,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
   errno = msgq_do_exit ? EINTR : 0;
 
   if (rc > 0){
+    updateStats();
     if (msgq_do_exit){
       msgq_msg_close(&msg); // Free unused message on exit
     } else {
@@ -151,6 +161,44 @@ Message * MSGQSubSocket::receive(bool non_blocking){
   return (Message*)r;
 }
 
+size_t MSGQSubSocket::receiveView(char **data){
+  msgq_msg_t msg;
+  int rc = msgq_msg_recv_view(&msg, q);
+  if (rc <= 0){
+    return 0;
+  }
+  *data = msg.data;
+  return msg.size;
+}
+
+bool MSGQSubSocket::releaseView(){
+  bool valid = msgq_msg_release_view(q);
+  if (valid){
+    updateStats();
+  }
+  return valid;
+}
+
+void MSGQSubSocket::updateStats(){
+  // From the message that was just received, nothing is kept without a frame header
+  if (q->view_header.seq == 0){
+    return;
+  }
+  stats.received++;
+  stats.dropped = q->read_dropped;
+
+  uint64_t us = q->read_latency_ns / 1000;
+  int bucket = 0;
+  while (bucket < TRANSPORT_LATENCY_BUCKETS - 1 && us >= (1ULL << bucket)){
+    bucket++;
+  }
+  stats.latency_us[bucket]++;
+}
+
+const TransportStats *MSGQSubSocket::getStats(){
+  return stats.received > 0 ? &stats : nullptr;
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -170,7 +218,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_num_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -196,6 +244,31 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+int MSGQPubSocket::sendBatch(char **data, size_t *sizes, size_t n){
+  std::vector<msgq_msg_t> msgs(n);
+  for (size_t i = 0; i < n; i++){
+    msgs[i].data = data[i];
+    msgs[i].size = sizes[i];
+  }
+
+  return msgq_msg_send_batch(msgs.data(), n, q);
+}
+
+char * MSGQPubSocket::reserve(size_t size){
+  char *p = msgq_msg_reserve(q, size);
+
+  // Not the active publisher anymore, hand out a scratch buffer and fail on commit
+  return (p != NULL) ? p : PubSocket::reserve(size);
+}
+
+int MSGQPubSocket::commit(size_t size){
+  if (!q->reserve_active){
+    errno = EADDRINUSE;
+    return -1;
+  }
+  return msgq_msg_commit(q, size);
+}
+
 MSGQPubSocket::~MSGQPubSocket(){
   if (q != NULL){
     msgq_close_queue(q);
@@ -205,22 +278,25 @@ MSGQPubSocket::~MSGQPubSocket(){
 
 
 void MSGQPoller::registerSocket(SubSocket * socket){
-  assert(num_polls + 1 < MAX_POLLERS);
-  polls[num_polls].q = (msgq_queue_t*)socket->getRawSocket();
+  assert(sockets.size() + 1 < MAX_POLLERS);
+  msgq_poller_add(&poller, (msgq_queue_t*)socket->getRawSocket());
 
   sockets.push_back(socket);
-  num_polls++;
 }
 
 std::vector<SubSocket*> MSGQPoller::poll(int timeout){
   std::vector<SubSocket*> r;
+  poll(timeout, r);
+  return r;
+}
+
+void MSGQPoller::poll(int timeout, std::vector<SubSocket*> &ready){
+  ready.clear();
 
-  msgq_poll(polls, num_polls, timeout);
-  for (size_t i = 0; i < num_polls; i++){
-    if (polls[i].revents){
-      r.push_back(sockets[i]);
+  msgq_poller_poll(&poller, timeout);
+  for (size_t i = 0; i < sockets.size(); i++){
+    if (poller.items[i].revents){
+      ready.push_back(sockets[i]);
     }
   }
-
-  return r;
 }
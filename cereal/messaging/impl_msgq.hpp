@@ -33,11 +33,16 @@ class MSGQSubSocket : public SubSocket {
 private:
   msgq_queue_t * q = NULL;
   int timeout;
+  TransportStats stats;
+  void updateStats();
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
   Message *receive(bool non_blocking=false);
+  size_t receiveView(char **data);
+  bool releaseView();
+  const TransportStats *getStats();
   ~MSGQSubSocket();
 };
 
@@ -48,17 +53,20 @@ public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  int sendBatch(char **data, size_t *sizes, size_t n);
+  char *reserve(size_t size);
+  int commit(size_t size);
   ~MSGQPubSocket();
 };
 
 class MSGQPoller : public Poller {
 private:
   std::vector<SubSocket*> sockets;
-  msgq_pollitem_t polls[MAX_POLLERS];
-  size_t num_polls = 0;
+  msgq_poller_t poller;
 
 public:
   void registerSocket(SubSocket *socket);
   std::vector<SubSocket*> poll(int timeout);
+  void poll(int timeout, std::vector<SubSocket*> &ready);
   ~MSGQPoller(){};
 };
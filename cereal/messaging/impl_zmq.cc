@@ -3,6 +3,8 @@
 #include <iostream>
 #include <cstdlib>
 #include <cerrno>
+#include <map>
+#include <mutex>
 
 #include <zmq.h>
 
@@ -23,6 +25,31 @@ static int get_port(std::string endpoint) {
   return port;
 }
 
+static int get_mux_port() {
+  const char *port = std::getenv("ZMQ_MUX_PORT");
+  return port ? atoi(port) : -1;
+}
+
+static ZMQMuxPrefix get_mux_prefix(std::string endpoint) {
+  for (size_t i = 0; i < sizeof(services) / sizeof(services[0]); i++) {
+    if (endpoint == services[i].name) {
+      return i;
+    }
+  }
+  assert(false);
+  return 0;
+}
+
+// The publishers of a context share the socket bound to ZMQ_MUX_PORT, ZMQ sockets
+// can't be used from several threads at once
+struct ZMQMuxSocket {
+  void * sock = NULL;
+  int refs = 0;
+  std::mutex lock;
+};
+static std::mutex mux_lock;
+static std::map<void *, ZMQMuxSocket *> mux_socks;
+
 ZMQContext::ZMQContext() {
   context = zmq_ctx_new();
 }
@@ -42,8 +69,28 @@ void ZMQMessage::init(char * d, size_t sz) {
   memcpy(data, d, size);
 }
 
+void ZMQMessage::init(zmq_msg_t *m, size_t skip) {
+  zmq_msg_init(&msg);
+  zmq_msg_move(&msg, m);
+  zero_copy = true;
+  data = (char*)zmq_msg_data(&msg) + skip;
+  size = zmq_msg_size(&msg) - skip;
+
+  // capnp reads the words in place
+  if ((uintptr_t)data % sizeof(uint64_t) != 0){
+    char *received = data;
+    data = new char[size];
+    memcpy(data, received, size);
+    zmq_msg_close(&msg);
+    zero_copy = false;
+  }
+}
+
 void ZMQMessage::close() {
-  if (size > 0){
+  if (zero_copy){
+    zmq_msg_close(&msg);
+    zero_copy = false;
+  } else if (size > 0){
     delete[] data;
   }
   size = 0;
@@ -60,7 +107,13 @@ int ZMQSubSocket::connect(Context *context, std::string endpoint, std::string ad
     return -1;
   }
 
-  zmq_setsockopt(sock, ZMQ_SUBSCRIBE, "", 0);
+  mux = check_endpoint && get_mux_port() >= 0;
+  if (mux){
+    ZMQMuxPrefix prefix = get_mux_prefix(endpoint);
+    zmq_setsockopt(sock, ZMQ_SUBSCRIBE, &prefix, sizeof(prefix));
+  } else {
+    zmq_setsockopt(sock, ZMQ_SUBSCRIBE, "", 0);
+  }
 
   if (conflate){
     int arg = 1;
@@ -71,7 +124,9 @@ int ZMQSubSocket::connect(Context *context, std::string endpoint, std::string ad
   zmq_setsockopt(sock, ZMQ_RECONNECT_IVL_MAX, &reconnect_ivl, sizeof(reconnect_ivl));
 
   full_endpoint = "tcp://" + address + ":";
-  if (check_endpoint){
+  if (mux){
+    full_endpoint += std::to_string(get_mux_port());
+  } else if (check_endpoint){
     full_endpoint += std::to_string(get_port(endpoint));
   } else {
     full_endpoint += endpoint;
@@ -89,10 +144,10 @@ Message * ZMQSubSocket::receive(bool non_blocking){
   int rc = zmq_msg_recv(&msg, sock, flags);
   Message *r = NULL;
 
-  if (rc >= 0){
-    // Make a copy to ensure the data is aligned
+  size_t skip = mux ? sizeof(ZMQMuxPrefix) : 0;
+  if (rc >= 0 && zmq_msg_size(&msg) >= skip){
     r = new ZMQMessage;
-    r->init((char*)zmq_msg_data(&msg), zmq_msg_size(&msg));
+    ((ZMQMessage*)r)->init(&msg, skip);
   }
 
   zmq_msg_close(&msg);
@@ -108,6 +163,28 @@ ZMQSubSocket::~ZMQSubSocket(){
 }
 
 int ZMQPubSocket::connect(Context *context, std::string endpoint, bool check_endpoint){
+  if (check_endpoint && get_mux_port() >= 0){
+    mux_prefix = get_mux_prefix(endpoint);
+    full_endpoint = "tcp://*:" + std::to_string(get_mux_port());
+
+    std::lock_guard<std::mutex> lk(mux_lock);
+    ZMQMuxSocket *&m = mux_socks[context->getRawContext()];
+    if (m == NULL){
+      m = new ZMQMuxSocket;
+      m->sock = zmq_socket(context->getRawContext(), ZMQ_PUB);
+      if (m->sock == NULL || zmq_bind(m->sock, full_endpoint.c_str()) != 0){
+        if (m->sock != NULL) zmq_close(m->sock);
+        delete m;
+        mux_socks.erase(context->getRawContext());
+        return -1;
+      }
+    }
+    m->refs++;
+    mux = m;
+    sock = m->sock;
+    return 0;
+  }
+
   sock = zmq_socket(context->getRawContext(), ZMQ_PUB);
   if (sock == NULL){
     return -1;
@@ -124,15 +201,80 @@ int ZMQPubSocket::connect(Context *context, std::string endpoint, bool check_end
 }
 
 int ZMQPubSocket::sendMessage(Message *message){
-  return zmq_send(sock, message->getData(), message->getSize(), ZMQ_DONTWAIT);
+  return send(message->getData(), message->getSize());
 }
 
 int ZMQPubSocket::send(char *data, size_t size){
-  return zmq_send(sock, data, size, ZMQ_DONTWAIT);
+  if (mux == NULL){
+    return zmq_send(sock, data, size, ZMQ_DONTWAIT);
+  }
+
+  zmq_msg_t msg;
+  zmq_msg_init_size(&msg, sizeof(mux_prefix) + size);
+  memcpy(zmq_msg_data(&msg), &mux_prefix, sizeof(mux_prefix));
+  memcpy((char*)zmq_msg_data(&msg) + sizeof(mux_prefix), data, size);
+
+  std::lock_guard<std::mutex> lk(mux->lock);
+  int rc = zmq_msg_send(&msg, sock, ZMQ_DONTWAIT);
+  if (rc < 0){
+    zmq_msg_close(&msg);
+    return rc;
+  }
+  return size;
+}
+
+char * ZMQPubSocket::reserve(size_t size){
+  // ZMQ owns the last buffer once it's committed, a new one is needed every time
+  free(reserve_buf);
+  reserve_buf = (char*)malloc(sizeof(mux_prefix) + size);
+  reserve_size = size;
+  memcpy(reserve_buf, &mux_prefix, sizeof(mux_prefix));
+  return reserve_buf + sizeof(mux_prefix);
+}
+
+int ZMQPubSocket::commit(size_t size){
+  assert(reserve_buf != NULL && size <= reserve_size);
+  char *buf = reserve_buf;
+  reserve_buf = NULL;
+  return sendZeroCopy(buf, size);
+}
+
+int ZMQPubSocket::sendZeroCopy(char *buf, size_t size){
+  // The prefix is only sent over the multiplexed port
+  size_t skip = mux ? 0 : sizeof(mux_prefix);
+  zmq_msg_t msg;
+  zmq_msg_init_data(&msg, buf + skip, sizeof(mux_prefix) + size - skip, [](void *data, void *hint) { free(hint); }, buf);
+
+  std::unique_lock<std::mutex> lk;
+  if (mux != NULL){
+    lk = std::unique_lock<std::mutex>(mux->lock);
+  }
+  int rc = zmq_msg_send(&msg, sock, ZMQ_DONTWAIT);
+  if (rc < 0){
+    zmq_msg_close(&msg);
+    return rc;
+  }
+  return size;
 }
 
 ZMQPubSocket::~ZMQPubSocket(){
-  zmq_close(sock);
+  free(reserve_buf);
+  if (mux == NULL){
+    zmq_close(sock);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lk(mux_lock);
+  if (--mux->refs == 0){
+    zmq_close(mux->sock);
+    for (auto it = mux_socks.begin(); it != mux_socks.end(); ++it){
+      if (it->second == mux){
+        mux_socks.erase(it);
+        break;
+      }
+    }
+    delete mux;
+  }
 }
 
 
@@ -147,17 +289,21 @@ void ZMQPoller::registerSocket(SubSocket * socket){
 
 std::vector<SubSocket*> ZMQPoller::poll(int timeout){
   std::vector<SubSocket*> r;
+  poll(timeout, r);
+  return r;
+}
+
+void ZMQPoller::poll(int timeout, std::vector<SubSocket*> &ready){
+  ready.clear();
 
   int rc = zmq_poll(polls, num_polls, timeout);
   if (rc < 0){
-    return r;
+    return;
   }
 
   for (size_t i = 0; i < num_polls; i++){
     if (polls[i].revents){
-      r.push_back(sockets[i]);
+      ready.push_back(sockets[i]);
     }
   }
-
-  return r;
 }
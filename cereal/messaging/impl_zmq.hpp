@@ -5,6 +5,11 @@
 
 #define MAX_POLLERS 128
 
+// With ZMQ_MUX_PORT set, every service goes over that one port instead of its own. Each message
+// starts with this prefix, the id of its service, which subscribers filter on
+typedef uint64_t ZMQMuxPrefix;
+struct ZMQMuxSocket;
+
 class ZMQContext : public Context {
 private:
   void * context = NULL;
@@ -18,9 +23,15 @@ class ZMQMessage : public Message {
 private:
   char * data;
   size_t size;
+  // set when data points into a received message instead of a copy
+  bool zero_copy = false;
+  zmq_msg_t msg;
 public:
   void init(size_t size);
   void init(char *data, size_t size);
+  // Takes the received message, and makes a copy only when the data past the first skip
+  // bytes isn't word aligned
+  void init(zmq_msg_t *msg, size_t skip);
   size_t getSize(){return size;}
   char * getData(){return data;}
   void close();
@@ -31,6 +42,7 @@ class ZMQSubSocket : public SubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  bool mux = false;
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
@@ -43,10 +55,19 @@ class ZMQPubSocket : public PubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  ZMQMuxSocket * mux = NULL;
+  ZMQMuxPrefix mux_prefix = 0;
+  // handed to ZMQ on commit, with room for the prefix in front
+  char * reserve_buf = NULL;
+  size_t reserve_size = 0;
+  int sendZeroCopy(char *buf, size_t size);
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  // The buffer is sent without a copy, ZMQ frees it once it's on the wire
+  char *reserve(size_t size);
+  int commit(size_t size);
   ~ZMQPubSocket();
 };
 
@@ -59,5 +80,6 @@ private:
 public:
   void registerSocket(SubSocket *socket);
   std::vector<SubSocket*> poll(int timeout);
+  void poll(int timeout, std::vector<SubSocket*> &ready);
   ~ZMQPoller(){};
 };
@@ -1,6 +1,13 @@
+#include <cassert>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "messaging.hpp"
 #include "impl_zmq.hpp"
 #include "impl_msgq.hpp"
+#include "impl_fake.hpp"
 
 #ifdef __APPLE__
 const bool MUST_USE_ZMQ = true;
@@ -12,9 +19,36 @@ bool messaging_use_zmq(){
   return std::getenv("ZMQ") || MUST_USE_ZMQ;
 }
 
+bool messaging_use_fake(){
+  return std::getenv("FAKE_MSGQ");
+}
+
+static const volatile uint64_t *simulated_clock(){
+  static const volatile uint64_t *clock = [](){
+    const char *path = std::getenv("SIMULATED_CLOCK");
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd < 0) return (const volatile uint64_t *)NULL;
+    void *p = mmap(NULL, sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? (const volatile uint64_t *)NULL : (const volatile uint64_t *)p;
+  }();
+  return clock;
+}
+
+uint64_t messaging_nanos_since_boot(){
+  if (const volatile uint64_t *sim = simulated_clock()){
+    return __atomic_load_n(sim, __ATOMIC_ACQUIRE);
+  }
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
 Context * Context::create(){
   Context * c;
-  if (messaging_use_zmq()){
+  if (messaging_use_fake()){
+    c = new FakeContext();
+  } else if (messaging_use_zmq()){
     c = new ZMQContext();
   } else {
     c = new MSGQContext();
@@ -24,7 +58,9 @@ Context * Context::create(){
 
 SubSocket * SubSocket::create(){
   SubSocket * s;
-  if (messaging_use_zmq()){
+  if (messaging_use_fake()){
+    s = new FakeSubSocket();
+  } else if (messaging_use_zmq()){
     s = new ZMQSubSocket();
   } else {
     s = new MSGQSubSocket();
@@ -44,9 +80,49 @@ SubSocket * SubSocket::create(Context * context, std::string endpoint, std::stri
   }
 }
 
+size_t SubSocket::receiveView(char **data){
+  assert(view_msg == nullptr);
+  view_msg = receive(true);
+  if (view_msg == nullptr){
+    return 0;
+  }
+  *data = view_msg->getData();
+  return view_msg->getSize();
+}
+
+bool SubSocket::releaseView(){
+  delete view_msg;
+  view_msg = nullptr;
+  return true;
+}
+
+int PubSocket::sendBatch(char **data, size_t *sizes, size_t n){
+  for (size_t i = 0; i < n; i++){
+    if (send(data[i], sizes[i]) < 0){
+      return -1;
+    }
+  }
+  return n;
+}
+
+char * PubSocket::reserve(size_t size){
+  const size_t words = (size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+  if (reserve_buf.size() < words){
+    reserve_buf = kj::heapArray<capnp::word>(words);
+  }
+  return (char *)reserve_buf.begin();
+}
+
+int PubSocket::commit(size_t size){
+  assert(size <= reserve_buf.size() * sizeof(capnp::word));
+  return send((char *)reserve_buf.begin(), size);
+}
+
 PubSocket * PubSocket::create(){
   PubSocket * s;
-  if (messaging_use_zmq()){
+  if (messaging_use_fake()){
+    s = new FakePubSocket();
+  } else if (messaging_use_zmq()){
     s = new ZMQPubSocket();
   } else {
     s = new MSGQPubSocket();
@@ -68,7 +144,9 @@ PubSocket * PubSocket::create(Context * context, std::string endpoint, bool chec
 
 Poller * Poller::create(){
   Poller * p;
-  if (messaging_use_zmq()){
+  if (messaging_use_fake()){
+    p = new FakePoller();
+  } else if (messaging_use_zmq()){
     p = new ZMQPoller();
   } else {
     p = new MSGQPoller();
@@ -1,4 +1,5 @@
 #pragma once
+#include <cassert>
 #include <cstddef>
 #include <map>
 #include <string>
@@ -11,8 +12,17 @@
 #endif
 
 #define MSG_MULTIPLE_PUBLISHERS 100
+#define TRANSPORT_LATENCY_BUCKETS 20
+
+// Index into the services table, the values are generated in services.h
+enum class ServiceId : int;
 
 bool messaging_use_zmq();
+// in process sockets from impl_fake.hpp, for deterministic replays
+bool messaging_use_fake();
+// CLOCK_BOOTTIME, or the nanoseconds in the SIMULATED_CLOCK file a replay moves forward,
+// like nanos_since_boot in selfdrive/common/timing.h
+uint64_t messaging_nanos_since_boot();
 
 class Context {
 public:
@@ -32,15 +42,33 @@ public:
 };
 
 
+// Kept by a SubSocket whose transport numbers and times its messages, msgq with MSGQ_FRAME_HEADER
+struct TransportStats {
+  uint64_t received = 0;
+  // sent, but overwritten before they were read or passed over by conflate
+  uint64_t dropped = 0;
+  // publish to receive, latency_us[i] counts those under 2^i us, the last one also all longer
+  uint64_t latency_us[TRANSPORT_LATENCY_BUCKETS] = {};
+};
+
 class SubSocket {
 public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Non-blocking receive without copying out of the transport, returns 0 if no message is available.
+  // The data is only valid until releaseView(), which returns false if it was overwritten in the meantime.
+  virtual size_t receiveView(char **data);
+  virtual bool releaseView();
+  // NULL if the transport doesn't keep them, or none of the messages so far were numbered
+  virtual const TransportStats *getStats() { return nullptr; }
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
-  virtual ~SubSocket(){};
+  virtual ~SubSocket(){ delete view_msg; };
+
+private:
+  Message *view_msg = nullptr;
 };
 
 class PubSocket {
@@ -48,16 +76,27 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Send multiple messages with a single publish, returns the number of messages sent or -1 on error
+  virtual int sendBatch(char **data, size_t *sizes, size_t n);
+  // Get a word aligned buffer of up to size bytes to build a message in, and send the first
+  // size bytes of it with commit(). Any other send drops an outstanding reservation.
+  virtual char *reserve(size_t size);
+  virtual int commit(size_t size);
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
   static PubSocket * create(Context * context, std::string endpoint, int port, bool check_endpoint=true);
   virtual ~PubSocket(){};
+
+private:
+  kj::Array<capnp::word> reserve_buf;
 };
 
 class Poller {
 public:
   virtual void registerSocket(SubSocket *socket) = 0;
   virtual std::vector<SubSocket*> poll(int timeout) = 0;
+  // Fills a caller owned vector, so polling in a loop doesn't allocate
+  virtual void poll(int timeout, std::vector<SubSocket*> &ready) = 0;
   static Poller * create();
   static Poller * create(std::vector<SubSocket*> sockets);
   virtual ~Poller(){};
@@ -66,8 +105,16 @@ public:
 class SubMaster {
 public:
   SubMaster(const std::initializer_list<const char *> &service_list,
-            const char *address = nullptr, const std::initializer_list<const char *> &ignore_alive = {});
+            const char *address = nullptr, const std::initializer_list<const char *> &ignore_alive = {})
+    : SubMaster(std::vector<const char *>(service_list), {}, std::vector<const char *>(ignore_alive), address) {}
+  // Like the python SubMaster, the services not in poll, if it isn't empty, are only received
+  // when one of the others wakes update() up
+  SubMaster(const std::vector<const char *> &service_list, const std::vector<const char *> &poll,
+            const std::vector<const char *> &ignore_alive, const char *address = nullptr);
   int update(int timeout = 1000);
+  // Waits only for trigger, then receives whatever the other services have without waiting,
+  // so a loop runs once per trigger message however often the rest arrive
+  int update_on(const char *trigger, int timeout = 1000);
   inline bool allAlive(const std::initializer_list<const char *> &service_list = {}) { return all_(service_list, false, true); }
   inline bool allValid(const std::initializer_list<const char *> &service_list = {}) { return all_(service_list, true, false); }
   inline bool allAliveAndValid(const std::initializer_list<const char *> &service_list = {}) { return all_(service_list, true, true); }
@@ -75,28 +122,53 @@ public:
   ~SubMaster();
 
   uint64_t frame = 0;
+  // Number of buffer allocations done by update(), stays constant once message sizes are stable
+  inline uint64_t allocations() const { return allocations_; }
   bool updated(const char *name) const;
   uint64_t rcv_frame(const char *name) const;
   cereal::Event::Reader &operator[](const char *name);
+  // of the service's socket, see SubSocket::getStats
+  const TransportStats *stats(const char *name) const;
+  bool alive(const char *name) const;
+  bool valid(const char *name) const;
+  // by messaging_nanos_since_boot, 0 before the first message
+  uint64_t rcv_time(const char *name) const;
+  uint64_t logMonoTime(const char *name) const;
+  // The bytes of the last message, 0 before the first. They're valid until the service is updated again
+  size_t raw(const char *name, const char **data) const;
+  SubSocket *socket(const char *name) const;
+  // periods of a service's frequency without a message before it isn't alive
+  float alive_periods = 10.0;
+
+  // Lookups by id skip the string compare and map walk
+  bool updated(ServiceId id) const;
+  uint64_t rcv_frame(ServiceId id) const;
+  cereal::Event::Reader &operator[](ServiceId id);
+  const TransportStats *stats(ServiceId id) const;
 
 private:
   bool all_(const std::initializer_list<const char *> &service_list, bool valid, bool alive);
+  int receive_();
   Poller *poller_ = nullptr;
+  // by update_on's trigger, each polling only its socket
+  std::map<SubSocket *, Poller *> trigger_pollers_;
+  std::vector<SubSocket *> ready_;
+  std::vector<SubSocket *> non_polled_;
+  uint64_t allocations_ = 0;
   struct SubMessage;
   std::map<SubSocket *, SubMessage *> messages_;
   std::map<std::string, SubMessage *> services_;
+  std::vector<SubMessage *> ids_;  // indexed by ServiceId, nullptr if not subscribed
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
 public:
   MessageBuilder() = default;
+  MessageBuilder(kj::ArrayPtr<capnp::word> firstSegment) : capnp::MallocMessageBuilder(firstSegment) {}
 
   cereal::Event::Builder initEvent(bool valid = true) {
     cereal::Event::Builder event = initRoot<cereal::Event>();
-    struct timespec t;
-    clock_gettime(CLOCK_BOOTTIME, &t);
-    uint64_t current_time = t.tv_sec * 1000000000ULL + t.tv_nsec;
-    event.setLogMonoTime(current_time);
+    event.setLogMonoTime(messaging_nanos_since_boot());
     event.setValid(valid);
     return event;
   }
@@ -115,8 +187,32 @@ public:
   PubMaster(const std::initializer_list<const char *> &service_list);
   inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
   int send(const char *name, MessageBuilder &msg);
+  inline int send(ServiceId id, capnp::byte *data, size_t size) {
+    assert(ids_[(int)id]);
+    return ids_[(int)id]->send((char *)data, size);
+  }
+  int send(ServiceId id, MessageBuilder &msg);
   ~PubMaster();
 
 private:
+  friend class InPlaceMessageBuilder;
   std::map<std::string, PubSocket *> sockets_;
+  std::vector<PubSocket *> ids_;  // indexed by ServiceId, nullptr if not published
+};
+
+// Builds the message straight into the publisher's buffer, which saves the allocation
+// and copy of toBytes(). Nothing is sent until commit(), and the builder can't be used after.
+// Messages that don't fit in max_size are still sent, but through the regular copying path.
+class InPlaceMessageBuilder : public MessageBuilder {
+public:
+  InPlaceMessageBuilder(PubMaster &pm, const char *name, size_t max_size)
+    : InPlaceMessageBuilder(pm.sockets_.at(name), max_size) {}
+  int commit();
+
+private:
+  InPlaceMessageBuilder(PubSocket *socket, size_t max_size)
+    : MessageBuilder(reserveSegment(socket, max_size)), socket_(socket) {}
+  static kj::ArrayPtr<capnp::word> reserveSegment(PubSocket *socket, size_t max_size);
+
+  PubSocket *socket_;
 };
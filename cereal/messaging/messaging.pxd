@@ -4,6 +4,7 @@
 from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp cimport bool
+from libc.stdint cimport uint64_t
 
 
 cdef extern from "messaging.hpp":
@@ -23,6 +24,8 @@ cdef extern from "messaging.hpp":
     SubSocket * create()
     int connect(Context *, string, string, bool)
     Message * receive(bool)
+    size_t receiveView(char **) nogil
+    bool releaseView() nogil
     void setTimeout(int)
 
   cdef cppclass PubSocket:
@@ -37,3 +40,17 @@ cdef extern from "messaging.hpp":
     Poller * create()
     void registerSocket(SubSocket *)
     vector[SubSocket*] poll(int) nogil
+
+  cdef cppclass SubMaster:
+    SubMaster(vector[const char *], vector[const char *], vector[const char *], const char *)
+    int update(int) nogil
+    uint64_t frame
+    float alive_periods
+    bool updated(const char *)
+    uint64_t rcv_frame(const char *)
+    bool alive(const char *)
+    bool valid(const char *)
+    uint64_t rcv_time(const char *)
+    uint64_t logMonoTime(const char *)
+    size_t raw(const char *, const char **)
+    SubSocket * socket(const char *)
@@ -0,0 +1,301 @@
+// Sweeps msgq and ZMQ over message size, reader count, conflate and poller size. Every
+// configuration is run twice, paced at --rate for the latency percentiles, and as fast as the
+// publisher goes for the rate the readers keep up with. The publisher and every reader
+// are pinned to their own core, starting at --cpu. --json writes the results to a file, to
+// compare releases and devices (--label).
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "impl_msgq.hpp"
+#include "impl_zmq.hpp"
+
+// the ZMQ ports are counted from here, one per poller socket
+#define BENCH_ZMQ_PORT 8700
+// to let ZMQ subscribers connect before anything is sent
+#define BENCH_CONNECT_MS 200
+// how long readers get to take what's left once the publisher is done
+#define BENCH_DRAIN_MS 100
+
+enum BenchPhase : uint32_t {
+  PHASE_LATENCY = 0,
+  PHASE_THROUGHPUT = 1,
+};
+
+// in front of every message
+struct BenchHeader {
+  uint64_t sent_ns;
+  uint32_t phase;
+};
+
+struct BenchConfig {
+  bool zmq;
+  size_t size;
+  int readers;
+  bool conflate;
+  int pollers;
+};
+
+struct BenchResult {
+  BenchConfig config;
+  uint64_t sent = 0;
+  // per reader
+  double received = 0;
+  double msgs_per_s = 0;
+  double p50_us = 0, p99_us = 0, p999_us = 0;
+};
+
+struct BenchReader {
+  std::vector<SubSocket *> socks;
+  Poller *poller = nullptr;
+  std::vector<uint64_t> latencies_ns;
+  uint64_t received[2] = {};
+};
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void pin_to(int cpu) {
+#ifdef __linux__
+  if (cpu < 0) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN)), &set);
+  sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+static std::vector<size_t> parse_list(const char *s) {
+  std::vector<size_t> r;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) r.push_back(strtoull(item.c_str(), NULL, 10));
+  }
+  return r;
+}
+
+static double percentile_us(const std::vector<uint64_t> &sorted, double q) {
+  if (sorted.empty()) return 0;
+  size_t i = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+  return sorted[i] / 1000.0;
+}
+
+static std::string endpoint(const BenchConfig &c, int i) {
+  return c.zmq ? std::to_string(BENCH_ZMQ_PORT + i) : "messaging_bench_" + std::to_string(i);
+}
+
+static void reader_thread(BenchReader *r, int cpu, std::atomic<bool> *stop) {
+  pin_to(cpu);
+  std::vector<SubSocket *> ready;
+  while (!*stop) {
+    r->poller->poll(10, ready);
+    for (auto s : ready) {
+      while (Message *msg = s->receive(true)) {
+        BenchHeader h;
+        memcpy(&h, msg->getData(), sizeof(h));
+        if (h.phase == PHASE_LATENCY) r->latencies_ns.push_back(now_ns() - h.sent_ns);
+        r->received[h.phase]++;
+        delete msg;
+      }
+    }
+  }
+}
+
+// Sends count messages round robin over the sockets, interval_ns apart or back to back, and
+// returns how long that took
+static uint64_t publish(std::vector<PubSocket *> &pubs, std::vector<char> &buf, BenchPhase phase, uint64_t count, uint64_t interval_ns) {
+  const uint64_t start = now_ns();
+  for (uint64_t i = 0; i < count; i++) {
+    if (interval_ns) {
+      while (now_ns() < start + i * interval_ns) {}
+    }
+    BenchHeader h = {now_ns(), phase};
+    memcpy(buf.data(), &h, sizeof(h));
+    pubs[i % pubs.size()]->send(buf.data(), buf.size());
+  }
+  return now_ns() - start;
+}
+
+static BenchResult run(const BenchConfig &c, uint64_t count, double rate, int cpu) {
+  BenchResult res;
+  res.config = c;
+
+  Context *ctx = c.zmq ? (Context *)new ZMQContext() : (Context *)new MSGQContext();
+  std::vector<PubSocket *> pubs;
+  for (int i = 0; i < c.pollers; i++) {
+    PubSocket *p = c.zmq ? (PubSocket *)new ZMQPubSocket() : (PubSocket *)new MSGQPubSocket();
+    if (p->connect(ctx, endpoint(c, i), false) != 0) {
+      printf("can't publish %s\n", endpoint(c, i).c_str());
+      exit(1);
+    }
+    pubs.push_back(p);
+  }
+
+  std::vector<BenchReader> readers(c.readers);
+  for (auto &r : readers) {
+    r.poller = c.zmq ? (Poller *)new ZMQPoller() : (Poller *)new MSGQPoller();
+    for (int i = 0; i < c.pollers; i++) {
+      SubSocket *s = c.zmq ? (SubSocket *)new ZMQSubSocket() : (SubSocket *)new MSGQSubSocket();
+      if (s->connect(ctx, endpoint(c, i), "127.0.0.1", c.conflate, false) != 0) {
+        printf("can't subscribe to %s\n", endpoint(c, i).c_str());
+        exit(1);
+      }
+      r.socks.push_back(s);
+      r.poller->registerSocket(s);
+    }
+    r.latencies_ns.reserve(count);
+  }
+
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < c.readers; i++) {
+    threads.emplace_back(reader_thread, &readers[i], cpu < 0 ? -1 : cpu + 1 + i, &stop);
+  }
+  pin_to(cpu);
+  std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_CONNECT_MS));
+
+  std::vector<char> buf(std::max(c.size, sizeof(BenchHeader)));
+  publish(pubs, buf, PHASE_LATENCY, count, rate > 0 ? (uint64_t)(1e9 / rate) : 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_DRAIN_MS));
+  const uint64_t duration_ns = publish(pubs, buf, PHASE_THROUGHPUT, count, 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_DRAIN_MS));
+  stop = true;
+  for (auto &t : threads) t.join();
+
+  std::vector<uint64_t> latencies;
+  uint64_t received = 0;
+  for (auto &r : readers) {
+    latencies.insert(latencies.end(), r.latencies_ns.begin(), r.latencies_ns.end());
+    received += r.received[PHASE_THROUGHPUT];
+  }
+  std::sort(latencies.begin(), latencies.end());
+  res.sent = count;
+  res.received = (double)received / c.readers;
+  res.msgs_per_s = res.received / (duration_ns * 1e-9);
+  res.p50_us = percentile_us(latencies, 0.5);
+  res.p99_us = percentile_us(latencies, 0.99);
+  res.p999_us = percentile_us(latencies, 0.999);
+
+  for (auto &r : readers) {
+    delete r.poller;
+    for (auto s : r.socks) delete s;
+  }
+  for (auto p : pubs) delete p;
+  delete ctx;
+  if (!c.zmq) {
+    for (int i = 0; i < c.pollers; i++) unlink(("/dev/shm/" + endpoint(c, i)).c_str());
+  }
+  return res;
+}
+
+static void write_json(FILE *f, const char *label, const std::vector<BenchResult> &results) {
+  fprintf(f, "{\n  \"label\": \"%s\",\n  \"results\": [\n", label);
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    fprintf(f, "    {\"transport\": \"%s\", \"size\": %zu, \"readers\": %d, \"conflate\": %s, \"pollers\": %d, "
+               "\"sent\": %lu, \"received\": %.1f, \"msgs_per_s\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}%s\n",
+            r.config.zmq ? "zmq" : "msgq", r.config.size, r.config.readers, r.config.conflate ? "true" : "false", r.config.pollers,
+            (unsigned long)r.sent, r.received, r.msgs_per_s, r.p50_us, r.p99_us, r.p999_us, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+static void usage() {
+  printf("usage: messaging_bench [--transport msgq,zmq] [--sizes 64,4096,262144] [--readers 1,4] [--pollers 1,16]\n"
+         "                       [--conflate 0,1] [--count 2000] [--rate 1000] [--cpu 0] [--label NAME] [--json FILE]\n"
+         "  --rate 0 sends the latency run back to back too, --cpu -1 doesn't pin\n");
+}
+
+int main(int argc, char **argv) {
+  std::vector<bool> transports = {false, true};
+  std::vector<size_t> sizes = {64, 4096, 262144}, readers = {1, 4}, pollers = {1, 16}, conflates = {0, 1};
+  uint64_t count = 2000;
+  double rate = 1000;
+  int cpu = 0;
+  std::string label = "", json;
+
+  const struct option opts[] = {
+    {"transport", required_argument, NULL, 't'},
+    {"sizes", required_argument, NULL, 's'},
+    {"readers", required_argument, NULL, 'r'},
+    {"pollers", required_argument, NULL, 'p'},
+    {"conflate", required_argument, NULL, 'f'},
+    {"count", required_argument, NULL, 'n'},
+    {"rate", required_argument, NULL, 'z'},
+    {"cpu", required_argument, NULL, 'c'},
+    {"label", required_argument, NULL, 'l'},
+    {"json", required_argument, NULL, 'j'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (opt) {
+      case 't':
+        transports.clear();
+        if (strstr(optarg, "msgq")) transports.push_back(false);
+        if (strstr(optarg, "zmq")) transports.push_back(true);
+        break;
+      case 's': sizes = parse_list(optarg); break;
+      case 'r': readers = parse_list(optarg); break;
+      case 'p': pollers = parse_list(optarg); break;
+      case 'f': conflates = parse_list(optarg); break;
+      case 'n': count = strtoull(optarg, NULL, 10); break;
+      case 'z': rate = atof(optarg); break;
+      case 'c': cpu = atoi(optarg); break;
+      case 'l': label = optarg; break;
+      case 'j': json = optarg; break;
+      default: usage(); return opt == 'h' ? 0 : 1;
+    }
+  }
+  // the size of the queues bounds the messages msgq can take
+  sizes.erase(std::remove_if(sizes.begin(), sizes.end(), [](size_t s) { return 3 * (s + 32) > DEFAULT_SEGMENT_SIZE; }), sizes.end());
+  if (transports.empty() || sizes.empty() || readers.empty() || pollers.empty() || conflates.empty() || count == 0) {
+    usage();
+    return 1;
+  }
+
+  std::vector<BenchResult> results;
+  printf("%-9s %8s %7s %8s %7s %12s %12s %10s %10s %10s\n", "transport", "size", "readers", "conflate", "pollers",
+         "received", "msgs/s", "p50 us", "p99 us", "p99.9 us");
+  for (bool zmq : transports) {
+    for (size_t size : sizes) {
+      for (size_t r : readers) {
+        for (size_t conflate : conflates) {
+          for (size_t p : pollers) {
+            BenchConfig c = {zmq, size, std::max<int>(1, r), conflate != 0, std::max<int>(1, p)};
+            BenchResult res = run(c, count, rate, cpu);
+            printf("%-9s %8zu %7d %8s %7d %12.1f %12.1f %10.2f %10.2f %10.2f\n", zmq ? "zmq" : "msgq", c.size, c.readers,
+                   c.conflate ? "yes" : "no", c.pollers, res.received, res.msgs_per_s, res.p50_us, res.p99_us, res.p999_us);
+            fflush(stdout);
+            results.push_back(res);
+          }
+        }
+      }
+    }
+  }
+
+  if (!json.empty()) {
+    FILE *f = fopen(json.c_str(), "w");
+    if (!f) {
+      printf("can't write %s\n", json.c_str());
+      return 1;
+    }
+    write_json(f, label.c_str(), results);
+    fclose(f);
+  }
+  return 0;
+}
@@ -2,9 +2,12 @@
 # cython: c_string_encoding=ascii, language_level=3
 
 import sys
+from array import array
 from libcpp.string cimport string
 from libcpp cimport bool
+from libcpp.vector cimport vector
 from libc cimport errno
+from libc.stdint cimport uint64_t
 
 
 from .messaging cimport Context as cppContext
@@ -12,6 +15,7 @@ from .messaging cimport SubSocket as cppSubSocket
 from .messaging cimport PubSocket as cppPubSocket
 from .messaging cimport Poller as cppPoller
 from .messaging cimport Message as cppMessage
+from .messaging cimport SubMaster as cppSubMaster
 
 
 class MessagingError(Exception):
@@ -119,6 +123,37 @@ cdef class SubSocket:
 
       return m
 
+  def receive_all(self, size_t max_msgs=1024, bool wait_for_one=False):
+    """Up to max_msgs of the messages queued up, as (data, offsets) with message i being
+    data[offsets[i]:offsets[i + 1]], copied into one buffer in a single call"""
+    cdef string buf
+    cdef vector[uint64_t] offsets
+    cdef char *data
+    cdef size_t sz
+
+    offsets.push_back(0)
+    if wait_for_one and max_msgs > 0:
+      m = self.receive()
+      if m is not None:
+        buf = m
+        offsets.push_back(buf.size())
+
+    with nogil:
+      while offsets.size() <= max_msgs:
+        sz = self.socket.receiveView(&data)
+        if sz == 0:
+          break
+        buf.append(data, sz)
+        if self.socket.releaseView():
+          offsets.push_back(buf.size())
+        else:
+          # overwritten while it was copied
+          buf.resize(offsets.back())
+
+    offsets_arr = array('Q')
+    offsets_arr.frombytes((<char *>offsets.data())[:offsets.size() * sizeof(uint64_t)])
+    return buf.data()[:buf.size()], offsets_arr
+
 
 cdef class PubSocket:
   cdef cppPubSocket * socket
@@ -149,3 +184,67 @@ cdef class PubSocket:
         raise MultiplePublishersError
       else:
         raise MessagingError
+
+
+cdef class SubMaster:
+  cdef cppSubMaster * sm
+
+  def __cinit__(self, list services, list poll, list ignore_alive, bytes address, float alive_periods=10.):
+    cdef vector[const char *] c_services, c_poll, c_ignore_alive
+    # the names only have to outlive the constructor
+    services_b = [s.encode() for s in services]
+    poll_b = [s.encode() for s in poll]
+    ignore_alive_b = [s.encode() for s in ignore_alive]
+    for s in services_b:
+      c_services.push_back(s)
+    for s in poll_b:
+      c_poll.push_back(s)
+    for s in ignore_alive_b:
+      c_ignore_alive.push_back(s)
+
+    self.sm = new cppSubMaster(c_services, c_poll, c_ignore_alive, address)
+    self.sm.alive_periods = alive_periods
+
+  def __dealloc__(self):
+    del self.sm
+
+  def update(self, int timeout):
+    cdef int updated
+    with nogil:
+      updated = self.sm.update(timeout)
+    return updated
+
+  @property
+  def frame(self):
+    return self.sm.frame
+
+  def updated(self, string name):
+    return self.sm.updated(name.c_str())
+
+  def rcv_frame(self, string name):
+    return self.sm.rcv_frame(name.c_str())
+
+  def alive(self, string name):
+    return self.sm.alive(name.c_str())
+
+  def valid(self, string name):
+    return self.sm.valid(name.c_str())
+
+  def rcv_time(self, string name):
+    return self.sm.rcv_time(name.c_str())
+
+  def logMonoTime(self, string name):
+    return self.sm.logMonoTime(name.c_str())
+
+  def raw(self, string name):
+    cdef const char *data
+    cdef size_t sz = self.sm.raw(name.c_str(), &data)
+    if sz == 0:
+      return None
+    return data[:sz]
+
+  def socket(self, string name):
+    # owned by the SubMaster
+    socket = SubSocket()
+    socket.setPtr(self.sm.socket(name.c_str()))
+    return socket
@@ -5,10 +5,13 @@
 #include <cstring>
 #include <cstdint>
 #include <chrono>
+#include <ctime>
 #include <algorithm>
 #include <cstdlib>
 #include <csignal>
+#include <climits>
 #include <random>
+#include <mutex>
 
 #include <poll.h>
 #include <sys/ioctl.h>
@@ -19,9 +22,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifndef __APPLE__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "msgq.hpp"
+#include "trace.hpp"
 
 void sigusr2_handler(int signal) {
   assert(signal == SIGUSR2);
@@ -41,6 +49,114 @@ uint64_t msgq_get_uid(void){
   return uid;
 }
 
+static msgq_wakeup_t * msgq_wakeup_table(){
+  // A single table of futex words shared by all queues. Every process claims one slot,
+  // so one poll can block on a single word for any number of queues.
+  static msgq_wakeup_t * table = [](){
+    msgq_wakeup_t * t = NULL;
+  #ifndef __APPLE__
+    const size_t size = NUM_WAKEUP_SLOTS * sizeof(msgq_wakeup_t);
+    auto fd = open("/dev/shm/msgq_wakeup", O_RDWR | O_CREAT, 0777);
+    if (fd < 0) {
+      std::cout << "Warning, could not open wakeup table, using signals" << std::endl;
+      return t;
+    }
+
+    if (ftruncate(fd, size) == 0){
+      void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mem != MAP_FAILED){
+        t = reinterpret_cast<msgq_wakeup_t*>(mem);
+      }
+    }
+    close(fd);
+  #endif
+    return t;
+  }();
+
+  return table;
+}
+
+static std::atomic<uint32_t> * msgq_wakeup_seq(uint32_t slot){
+  return reinterpret_cast<std::atomic<uint32_t>*>(&msgq_wakeup_table()[slot].seq);
+}
+
+static std::atomic<uint64_t> * msgq_wakeup_dirty(uint32_t slot, int word){
+  return reinterpret_cast<std::atomic<uint64_t>*>(&msgq_wakeup_table()[slot].dirty[word]);
+}
+
+static bool msgq_thread_alive(int tid){
+  if (tid <= 0){
+    return false;
+  }
+  // Signal 0 only checks if the thread exists
+  return (kill(tid, 0) == 0) || (errno == EPERM);
+}
+
+static int msgq_claim_wakeup_slot(){
+  // The slot is exclusive to this process, so nobody else clears our dirty bits.
+  // Slots of processes that no longer exist are reused.
+  static std::mutex lock;
+  static pid_t slot_pid = 0;
+  static int slot = -1;
+
+  std::lock_guard<std::mutex> guard(lock);
+  pid_t pid = getpid();
+  if (slot_pid == pid){
+    return slot;
+  }
+
+  slot = -1;
+  for (uint32_t n = 0; n < NUM_WAKEUP_SLOTS && slot < 0; n++){
+    uint32_t i = (pid + n) % NUM_WAKEUP_SLOTS;
+    auto owner = reinterpret_cast<std::atomic<uint32_t>*>(&msgq_wakeup_table()[i].owner);
+
+    uint32_t cur = *owner;
+    if (cur == (uint32_t)pid || cur == 0 || !msgq_thread_alive(cur)){
+      if (std::atomic_compare_exchange_strong(owner, &cur, (uint32_t)pid)){
+        slot = i;
+      }
+    }
+  }
+
+  slot_pid = pid;
+  return slot;
+}
+
+static std::mutex dirty_bits_lock;
+static uint64_t dirty_bits_used[NUM_DIRTY_WORDS];
+
+static int msgq_alloc_dirty_bit(){
+  std::lock_guard<std::mutex> guard(dirty_bits_lock);
+  for (int i = 0; i < NUM_DIRTY_WORDS * 64; i++){
+    if (!(dirty_bits_used[i / 64] & (1ULL << (i % 64)))){
+      dirty_bits_used[i / 64] |= (1ULL << (i % 64));
+      return i;
+    }
+  }
+  // Out of bits, the poller will check this queue on every poll
+  return -1;
+}
+
+static void msgq_free_dirty_bit(int bit){
+  std::lock_guard<std::mutex> guard(dirty_bits_lock);
+  dirty_bits_used[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+static void futex_wake(std::atomic<uint32_t> * word){
+  #ifndef __APPLE__
+    // The table is shared between processes, so this can't be a private futex
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  #endif
+}
+
+static void futex_wait(std::atomic<uint32_t> * word, uint32_t val, const struct timespec * ts){
+  #ifndef __APPLE__
+    syscall(SYS_futex, word, FUTEX_WAIT, val, ts, NULL, 0);
+  #else
+    nanosleep(ts, NULL);
+  #endif
+}
+
 int msgq_msg_init_size(msgq_msg_t * msg, size_t size){
   msg->size = size;
   msg->data = new(std::nothrow) char[size];
@@ -82,8 +198,9 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 }
 
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
+  assert(max_readers > 0 && max_readers <= MAX_READERS);
   std::signal(SIGUSR2, sigusr2_handler);
 
   const char * prefix = "/dev/shm/";
@@ -99,12 +216,12 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   delete[] full_path;
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
+  int rc = ftruncate(fd, size + MSGQ_HEADER_SIZE);
   if (rc < 0){
     close(fd);
     return -1;
   }
-  char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  char * mem = (char*)mmap(NULL, size + MSGQ_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   close(fd);
 
   if (mem == NULL){
@@ -112,32 +229,95 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   q->mmap_p = mem;
 
-  msgq_header_t *header = (msgq_header_t *)mem;
+  // Agree on the header layout, a fresh queue is all zeros
+  uint64_t version = 0;
+  uint64_t preferred = std::getenv("MSGQ_PACKED_HEADER") ? MSGQ_VERSION_PACKED : MSGQ_VERSION_ALIGNED;
+  if (std::atomic_compare_exchange_strong(reinterpret_cast<std::atomic<uint64_t>*>(mem), &version, preferred)){
+    version = preferred;
+  }
 
   // Setup pointers to header segment
-  q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
-  q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
-  q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
-
-  for (size_t i = 0; i < NUM_READERS; i++){
-    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
-    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
-    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+  if (version == MSGQ_VERSION_ALIGNED){
+    msgq_header_aligned_t *header = (msgq_header_aligned_t *)mem;
+    q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
+    q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
+    q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
+    q->high_water = reinterpret_cast<std::atomic<uint64_t>*>(&header->high_water);
+    q->max_msg_size = reinterpret_cast<std::atomic<uint64_t>*>(&header->max_msg_size);
+    q->write_seq = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_seq);
+    q->last_msg = reinterpret_cast<std::atomic<uint64_t>*>(&header->last_msg);
+
+    for (size_t i = 0; i < MAX_READERS; i++){
+      q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->readers[i].read_pointer);
+      q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->readers[i].read_valid);
+      q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->readers[i].read_uid);
+      q->read_wakeups[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->readers[i].read_wakeup);
+    }
+  } else if (version == MSGQ_VERSION_PACKED){
+    msgq_header_t *header = (msgq_header_t *)mem;
+    q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
+    q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
+    q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
+    q->high_water = reinterpret_cast<std::atomic<uint64_t>*>(&header->high_water);
+    q->max_msg_size = reinterpret_cast<std::atomic<uint64_t>*>(&header->max_msg_size);
+    q->write_seq = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_seq);
+    q->last_msg = reinterpret_cast<std::atomic<uint64_t>*>(&header->last_msg);
+
+    for (size_t i = 0; i < MAX_READERS; i++){
+      q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
+      q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
+      q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+      q->read_wakeups[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_wakeups[i]);
+    }
+  } else {
+    std::cout << "Warning, incompatible msgq header version " << std::hex << version << std::dec << ": " << path << std::endl;
+    munmap(mem, size + MSGQ_HEADER_SIZE);
+    q->mmap_p = NULL;
+    errno = EPROTO;
+    return -1;
   }
 
-  q->data = mem + sizeof(msgq_header_t);
+  q->data = mem + MSGQ_HEADER_SIZE;
   q->size = size;
+  q->max_readers = max_readers;
   q->reader_id = -1;
 
   q->endpoint = path;
   q->read_conflate = false;
+  q->reserve_cycles = 0;
+  q->reserve_pointer = 0;
+  q->reserve_active = false;
+  q->view_read_pointer = 0;
+  q->view_active = false;
+  q->view_header = {};
+  q->last_msg_local = 0;
+  q->frame_header = std::getenv("MSGQ_FRAME_HEADER") != NULL;
+  q->read_seq = 0;
+  q->read_dropped = 0;
+  q->read_latency_ns = 0;
+
+  int wakeup_slot = (msgq_wakeup_table() != NULL) ? msgq_claim_wakeup_slot() : -1;
+  q->wakeup_futex = (wakeup_slot >= 0) && (std::getenv("MSGQ_SIGNAL_WAKEUP") == NULL);
+  q->wakeup_slot = q->wakeup_futex ? wakeup_slot : 0;
+  q->wakeup_bit = -1;
 
   return 0;
 }
 
 void msgq_close_queue(msgq_queue_t *q){
+  // Give up our reader slot so it can be reused without evicting anyone
+  if (q->mmap_p != NULL && q->reader_id >= 0){
+    uint64_t uid = q->read_uid_local;
+    std::atomic_compare_exchange_strong(q->read_uids[q->reader_id], &uid, (uint64_t)0);
+  }
+
+  if (q->wakeup_bit >= 0){
+    msgq_free_dirty_bit(q->wakeup_bit);
+    q->wakeup_bit = -1;
+  }
+
   if (q->mmap_p != NULL){
-    munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+    munmap(q->mmap_p, q->size + MSGQ_HEADER_SIZE);
   }
 }
 
@@ -149,9 +329,10 @@ void msgq_init_publisher(msgq_queue_t * q) {
   *q->write_uid = uid;
   *q->num_readers = 0;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
+  for (size_t i = 0; i < MAX_READERS; i++){
     *q->read_valids[i] = false;
     *q->read_uids[i] = 0;
+    *q->read_wakeups[i] = 0;
   }
 
   q->write_uid_local = uid;
@@ -166,6 +347,68 @@ static void thread_signal(uint32_t tid) {
   #endif
 }
 
+static void msgq_wake_reader(uint64_t uid, uint64_t wakeup){
+  // The wakeup packs (dirty bit + 1) << 32 | (wakeup slot + 1), 0 means the reader expects a signal
+  uint32_t slot = wakeup & 0xFFFFFFFF;
+  uint32_t bit = wakeup >> 32;
+
+  if (slot == 0 || slot > NUM_WAKEUP_SLOTS || msgq_wakeup_table() == NULL){
+    thread_signal(uid & 0xFFFFFFFF);
+    return;
+  }
+
+  if (bit > 0 && bit <= NUM_DIRTY_WORDS * 64){
+    msgq_wakeup_dirty(slot - 1, (bit - 1) / 64)->fetch_or(1ULL << ((bit - 1) % 64));
+  }
+
+  std::atomic<uint32_t> * seq = msgq_wakeup_seq(slot - 1);
+  seq->fetch_add(1);
+  futex_wake(seq);
+}
+
+static bool msgq_reader_alive(uint64_t uid){
+  return msgq_thread_alive(uid & 0xFFFFFFFF);
+}
+
+static void msgq_claim_reader(msgq_queue_t * q, int id, uint64_t uid){
+  q->reader_id = id;
+  q->read_uid_local = uid;
+
+  // We start with read_valid = false,
+  // on the first read the read pointer will be synchronized with the write pointer
+  *q->read_valids[id] = false;
+  *q->read_pointers[id] = 0;
+  *q->read_uids[id] = uid;
+
+  uint64_t wakeup = 0;
+  if (q->wakeup_futex){
+    if (q->wakeup_bit < 0){
+      q->wakeup_bit = msgq_alloc_dirty_bit();
+    }
+    wakeup = ((uint64_t)(q->wakeup_bit + 1) << 32) | (q->wakeup_slot + 1);
+  }
+  *q->read_wakeups[id] = wakeup;
+}
+
+static int msgq_reclaim_reader(msgq_queue_t * q, uint64_t uid){
+  uint64_t num_readers = std::min((uint64_t)q->max_readers, (uint64_t)*q->num_readers);
+
+  // Reuse a slot that was released on close, or that belongs to a reader that no longer exists
+  for (uint64_t i = 0; i < num_readers; i++){
+    uint64_t old_uid = *q->read_uids[i];
+    if (old_uid != 0 && msgq_reader_alive(old_uid)){
+      continue;
+    }
+
+    // Use atomic compare and swap in case another subscriber is reclaiming the same slot
+    if (std::atomic_compare_exchange_strong(q->read_uids[i], &old_uid, uid)){
+      return i;
+    }
+  }
+
+  return -1;
+}
+
 void msgq_init_subscriber(msgq_queue_t * q) {
   assert(q != NULL);
   assert(q->num_readers != NULL);
@@ -177,19 +420,28 @@ void msgq_init_subscriber(msgq_queue_t * q) {
     uint64_t cur_num_readers = *q->num_readers;
     uint64_t new_num_readers = cur_num_readers + 1;
 
-    // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
+    if (new_num_readers > q->max_readers){
+      int id = msgq_reclaim_reader(q, uid);
+      if (id >= 0){
+        msgq_claim_reader(q, id, uid);
+        break;
+      }
+
+      // No more slots available and all readers are alive. Reset all subscribers as a last resort
       std::cout << "Warning, evicting all subscribers!" << std::endl;
       *q->num_readers = 0;
 
-      for (size_t i = 0; i < NUM_READERS; i++){
+      for (size_t i = 0; i < MAX_READERS; i++){
         *q->read_valids[i] = false;
 
         uint64_t old_uid = *q->read_uids[i];
+        uint64_t old_wakeup = *q->read_wakeups[i];
         *q->read_uids[i] = 0;
 
         // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+        if (old_uid != 0){
+          msgq_wake_reader(old_uid, old_wakeup);
+        }
       }
 
       continue;
@@ -200,14 +452,7 @@ void msgq_init_subscriber(msgq_queue_t * q) {
     if (std::atomic_compare_exchange_strong(q->num_readers,
                                             &cur_num_readers,
                                             new_num_readers)){
-      q->reader_id = cur_num_readers;
-      q->read_uid_local = uid;
-
-      // We start with read_valid = false,
-      // on the first read the read pointer will be synchronized with the write pointer
-      *q->read_valids[cur_num_readers] = false;
-      *q->read_pointers[cur_num_readers] = 0;
-      *q->read_uids[cur_num_readers] = uid;
+      msgq_claim_reader(q, cur_num_readers, uid);
       break;
     }
   }
@@ -216,30 +461,81 @@ void msgq_init_subscriber(msgq_queue_t * q) {
   msgq_reset_reader(q);
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+static bool msgq_check_publisher(msgq_queue_t *q){
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
     errno = EADDRINUSE;
-    return -1;
+    return false;
+  }
+  return true;
+}
+
+static void msgq_overrun_reader(msgq_queue_t *q, uint64_t i){
+  // A live reader that still had the data was as far behind as it can be
+  if (q->read_valids[i]->exchange(false) && *q->read_uids[i] != 0){
+    *q->high_water = q->size;
+  }
+}
+
+static void msgq_update_high_water(msgq_queue_t *q, uint64_t num_readers, uint32_t write_cycles, uint32_t write_pointer){
+  uint64_t high_water = *q->high_water;
+  for (uint64_t i = 0; i < num_readers; i++){
+    if (*q->read_uids[i] == 0 || !*q->read_valids[i]){
+      continue;
+    }
+
+    uint32_t read_cycles, read_pointer;
+    UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+
+    uint64_t behind = 0;
+    if (read_cycles == write_cycles){
+      behind = write_pointer - read_pointer;
+    } else if (read_cycles + 1 == write_cycles){
+      behind = q->size - read_pointer + write_pointer;
+    }
+    high_water = std::max(high_water, behind);
+  }
+  *q->high_water = high_water;
+}
+
+static uint64_t msgq_nanos(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static size_t msgq_prefix_size(const msgq_queue_t *q){
+  return sizeof(int64_t) + (q->frame_header ? sizeof(msgq_frame_header_t) : 0);
+}
+
+static void msgq_stamp(msgq_queue_t *q, char *data){
+  // Numbers and times a message with a frame header, as it's about to be published
+  if (q->frame_header){
+    msgq_frame_header_t *header = (msgq_frame_header_t *)(data - sizeof(msgq_frame_header_t));
+    header->seq = ++*q->write_seq;
+    header->publish_ns = msgq_nanos();
   }
+}
 
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+static char * msgq_reserve(msgq_queue_t *q, size_t size, uint64_t num_readers, uint32_t *write_cycles, uint32_t *write_pointer){
+  // Makes room for a message of the given size at the local write pointer and returns
+  // where its data goes. The write pointer is advanced locally, but not published.
+  uint64_t total_msg_size = ALIGN(size + msgq_prefix_size(q));
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
   assert(3 * total_msg_size <= q->size);
 
-  uint64_t num_readers = *q->num_readers;
-
-  uint32_t write_cycles, write_pointer;
-  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+  if (size > *q->max_msg_size){
+    *q->max_msg_size = size;
+  }
 
-  char *p = q->data + write_pointer; // add base offset
+  char *p = q->data + *write_pointer; // add base offset
 
   // Check remaining space
   // Always leave space for a wraparound tag for the next message, including alignment
-  int64_t remaining_space = q->size - write_pointer - total_msg_size - sizeof(int64_t);
+  int64_t remaining_space = q->size - *write_pointer - total_msg_size - sizeof(int64_t);
   if (remaining_space <= 0){
     // Write -1 size tag indicating wraparound
     *(int64_t*)p = -1;
@@ -251,55 +547,153 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
       uint64_t read_cycles = read_pointer >> 32;
       read_pointer &= 0xFFFFFFFF;
 
-      if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
-        *q->read_valids[i] = false;
+      if ((read_pointer > *write_pointer) && (read_cycles != *write_cycles)) {
+        msgq_overrun_reader(q, i);
       }
     }
 
     // Update global and local copies of write pointer and write_cycles
-    write_pointer = 0;
-    write_cycles = write_cycles + 1;
-    PACK64(*q->write_pointer, write_cycles, write_pointer);
+    *write_pointer = 0;
+    *write_cycles = *write_cycles + 1;
+    PACK64(*q->write_pointer, *write_cycles, *write_pointer);
 
     // Set actual pointer to the beginning of the data segment
     p = q->data;
   }
 
   // Invalidate readers that are in the area that will be written
-  uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
+  uint64_t start = *write_pointer;
+  uint64_t end = ALIGN(start + msgq_prefix_size(q) + size);
 
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
     UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
 
-    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
-      *q->read_valids[i] = false;
+    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != *write_cycles)) {
+      msgq_overrun_reader(q, i);
     }
   }
 
+  PACK64(q->last_msg_local, *write_cycles, start);
 
   // Write size tag
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
-  *size_p = msg->size;
+  *size_p = q->frame_header ? (size | MSGQ_FRAME_HEADER_FLAG) : size;
 
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
+  *write_pointer = end;
+  return p + msgq_prefix_size(q);
+}
+
+static void msgq_publish(msgq_queue_t *q, uint64_t num_readers, uint32_t write_cycles, uint32_t write_pointer){
   __sync_synchronize();
 
-  // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
-  PACK64(*q->write_pointer, write_cycles, new_ptr);
+  // Update write pointer, and where the newest message starts before it
+  *q->last_msg = q->last_msg_local;
+  PACK64(*q->write_pointer, write_cycles, write_pointer);
+  msgq_update_high_water(q, num_readers, write_cycles, write_pointer);
 
   // Notify readers
   for (uint64_t i = 0; i < num_readers; i++){
     uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    if (reader_uid != 0){
+      msgq_wake_reader(reader_uid, *q->read_wakeups[i]);
+    }
+  }
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  TRACE_SCOPE("msgq_msg_send");
+  if (!msgq_check_publisher(q)){
+    return -1;
   }
+  q->reserve_active = false; // An outstanding reservation is overwritten
+
+  uint64_t num_readers = std::min((uint64_t)MAX_READERS, (uint64_t)*q->num_readers);
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  // Copy data
+  char *p = msgq_reserve(q, msg->size, num_readers, &write_cycles, &write_pointer);
+  memcpy(p, msg->data, msg->size);
+  msgq_stamp(q, p);
 
+  msgq_publish(q, num_readers, write_cycles, write_pointer);
   return msg->size;
 }
 
+int msgq_msg_send_batch(msgq_msg_t * msgs, size_t nmsgs, msgq_queue_t *q){
+  if (!msgq_check_publisher(q)){
+    return -1;
+  }
+  q->reserve_active = false; // An outstanding reservation is overwritten
+
+  uint64_t num_readers = std::min((uint64_t)MAX_READERS, (uint64_t)*q->num_readers);
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  // All messages are copied in before the write pointer is published and readers are notified once.
+  // Large batches are published in parts, so a batch can never overwrite itself before it's visible.
+  uint64_t unpublished = 0;
+  for (size_t i = 0; i < nmsgs; i++){
+    uint64_t total_msg_size = ALIGN(msgs[i].size + msgq_prefix_size(q));
+    if (unpublished > 0 && unpublished + total_msg_size > q->size / 2){
+      msgq_publish(q, num_readers, write_cycles, write_pointer);
+      unpublished = 0;
+    }
+
+    char *p = msgq_reserve(q, msgs[i].size, num_readers, &write_cycles, &write_pointer);
+    memcpy(p, msgs[i].data, msgs[i].size);
+    msgq_stamp(q, p);
+    unpublished += total_msg_size;
+  }
+
+  msgq_publish(q, num_readers, write_cycles, write_pointer);
+  return nmsgs;
+}
+
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size){
+  // Hand out a slot in the ring buffer that the caller writes into directly. Readers
+  // can't advance past the published write pointer, so nothing is visible until commit.
+  if (!msgq_check_publisher(q)){
+    return NULL;
+  }
+
+  uint64_t num_readers = std::min((uint64_t)MAX_READERS, (uint64_t)*q->num_readers);
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  char *p = msgq_reserve(q, size, num_readers, &write_cycles, &write_pointer);
+
+  q->reserve_cycles = write_cycles;
+  q->reserve_pointer = (p - msgq_prefix_size(q)) - q->data;
+  q->reserve_active = true;
+  return p;
+}
+
+int msgq_msg_commit(msgq_queue_t *q, size_t size){
+  // Publish the reserved slot, size can be smaller than what was reserved
+  assert(q->reserve_active);
+  q->reserve_active = false;
+
+  if (!msgq_check_publisher(q)){
+    return -1;
+  }
+
+  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(q->data + q->reserve_pointer);
+  int64_t flags = *size_p & MSGQ_FRAME_HEADER_FLAG;
+  assert(size > 0 && (int64_t)size <= (*size_p & ~flags));
+  *size_p = size | flags;
+  msgq_stamp(q, q->data + q->reserve_pointer + msgq_prefix_size(q));
+
+  uint64_t num_readers = std::min((uint64_t)MAX_READERS, (uint64_t)*q->num_readers);
+  PACK64(q->last_msg_local, q->reserve_cycles, q->reserve_pointer);
+  msgq_publish(q, num_readers, q->reserve_cycles, ALIGN(q->reserve_pointer + msgq_prefix_size(q) + size));
+  return size;
+}
+
 
 int msgq_msg_ready(msgq_queue_t * q){
  start:
@@ -328,7 +722,11 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+int msgq_msg_recv_view(msgq_msg_t * msg, msgq_queue_t * q){
+  TRACE_SCOPE("msgq_msg_recv_view");
+  // Only one view can be outstanding, the read pointer is not advanced until it's released
+  assert(!q->view_active);
+
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
@@ -359,6 +757,29 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     return 0;
   }
 
+  // A conflating reader skips straight to the newest message, when it's in the writer's
+  // current cycle. Once our read pointer is there the writer invalidates us before it
+  // overwrites it, which it can only do after wrapping around.
+  if (q->read_conflate){
+    uint32_t last_cycles, last_pointer;
+    UNPACK64(last_cycles, last_pointer, *q->last_msg);
+
+    if (last_cycles == write_cycles && (last_cycles != read_cycles || last_pointer > read_pointer)){
+      PACK64(*q->read_pointers[id], last_cycles, last_pointer);
+
+      uint32_t new_write_cycles, new_write_pointer;
+      UNPACK64(new_write_cycles, new_write_pointer, *q->write_pointer);
+      if (new_write_cycles != last_cycles){
+        // It could have been overwritten before we got there
+        msgq_reset_reader(q);
+        goto start;
+      }
+      read_cycles = last_cycles;
+      read_pointer = last_pointer;
+      p = q->data + read_pointer;
+    }
+  }
+
   // Read potential message size
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
   std::int64_t size = *size_p;
@@ -376,12 +797,19 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     goto start;
   }
 
+  // A frame header is in front of the data when the publisher added one
+  size_t prefix = sizeof(int64_t);
+  if (size & MSGQ_FRAME_HEADER_FLAG){
+    size &= ~MSGQ_FRAME_HEADER_FLAG;
+    prefix += sizeof(msgq_frame_header_t);
+  }
+
   // crashing is better than passing garbage data to the consumer
   // the size will have weird value if it was overwritten by data accidentally
   assert((uint64_t)size < q->size);
   assert(size > 0);
 
-  uint32_t new_read_pointer = ALIGN(read_pointer + sizeof(std::int64_t) + size);
+  uint32_t new_read_pointer = ALIGN(read_pointer + prefix + size);
 
   // If conflate is true, check if this is the latest message, else start over
   if (q->read_conflate){
@@ -392,31 +820,138 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     }
   }
 
-  // Copy message
-  if (msgq_msg_init_size(msg, size) < 0)
-    return -1;
-
+  // Point into the ring buffer. The read pointer stays at the start of the message
+  // so a writer that overwrites it will clear our validity flag.
   __sync_synchronize();
-  memcpy(msg->data, p + sizeof(int64_t), size);
+  msg->data = p + prefix;
+  msg->size = size;
+  if (prefix > sizeof(int64_t)){
+    memcpy(&q->view_header, p + sizeof(int64_t), sizeof(msgq_frame_header_t));
+  } else {
+    q->view_header = {};
+  }
+
+  PACK64(q->view_read_pointer, read_cycles, new_read_pointer);
+  q->view_active = true;
+
+  return msg->size;
+}
+
+bool msgq_msg_release_view(msgq_queue_t * q){
+  assert(q->view_active);
+  q->view_active = false;
+
   __sync_synchronize();
 
-  // Update read pointer
-  PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+  // We might have been evicted and our slot handed to another reader, don't touch it
+  int id = q->reader_id;
+  if (q->read_uid_local != *q->read_uids[id]){
+    return false;
+  }
 
-  // Check if the actual data that was copied is valid
+  // Check if the data that was accessed through the view is still valid
   if (!*q->read_valids[id]){
-    msgq_msg_close(msg);
     msgq_reset_reader(q);
-    goto start;
+    return false;
   }
 
+  // Update read pointer
+  *q->read_pointers[id] = q->view_read_pointer;
 
-  return msg->size;
+  if (q->view_header.seq != 0){
+    // Numbers going back mean the queue was created again, that's not a drop
+    if (q->read_seq != 0 && q->view_header.seq > q->read_seq + 1){
+      q->read_dropped += q->view_header.seq - q->read_seq - 1;
+    }
+    q->read_seq = q->view_header.seq;
+    q->read_latency_ns = msgq_nanos() - q->view_header.publish_ns;
+  } else {
+    q->read_latency_ns = 0;
+  }
+  return true;
 }
 
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  TRACE_SCOPE("msgq_msg_recv");
+  while (true){
+    msgq_msg_t view;
+    int rc = msgq_msg_recv_view(&view, q);
+    if (rc <= 0){
+      msg->size = 0;
+      return rc;
+    }
+
+    // Copy message
+    if (msgq_msg_init_size(msg, view.size) < 0){
+      q->view_active = false;
+      return -1;
+    }
+    memcpy(msg->data, view.data, view.size);
+
+    // Check if the actual data that was copied is valid, otherwise start over
+    if (msgq_msg_release_view(q)){
+      return msg->size;
+    }
+    msgq_msg_close(msg);
+  }
+}
+
+
 
+static int msgq_poll_futex(msgq_pollitem_t * items, size_t nitems, int timeout){
+  std::atomic<uint32_t> * word = msgq_wakeup_seq(items[0].q->wakeup_slot);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  int num = 0;
+  for (size_t i = 0; i < nitems; i++) {
+    items[i].revents = 0;
+  }
+
+  while (true) {
+    // Sample the futex before checking the queues, a write that happens
+    // in between changes the value and the wait returns immediately
+    uint32_t seq = *word;
+
+    for (size_t i = 0; i < nitems; i++) {
+      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
+        num += 1;
+        items[i].revents = 1;
+      }
+    }
+
+    if (num > 0) {
+      break;
+    }
+
+    int64_t ms = 100;
+    if (timeout != -1) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0) {
+        break;
+      }
+      ms = remaining.count();
+    }
+
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+    futex_wait(word, seq, &ts);
+  }
+
+  return num;
+}
 
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
+  // Block on the shared futex if all readers are woken that way
+  bool use_futex = nitems > 0;
+  for (size_t i = 0; i < nitems; i++) {
+    use_futex = use_futex && items[i].q->wakeup_futex;
+  }
+
+  if (use_futex) {
+    return msgq_poll_futex(items, nitems, timeout);
+  }
+
   int num = 0;
 
   // Check if messages ready
@@ -452,3 +987,105 @@ int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
 
   return num;
 }
+
+static uint64_t msgq_millis(){
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void msgq_poller_add(msgq_poller_t * poller, msgq_queue_t * q){
+  msgq_pollitem_t item;
+  item.q = q;
+  item.revents = 0;
+
+  poller->items.push_back(item);
+  poller->pending.push_back(true);
+  poller->last_scan = 0;
+}
+
+int msgq_poller_poll(msgq_poller_t * poller, int timeout){
+  // Only checks queues that were written to since the last poll, or that still had
+  // messages left last time. Everything is rescanned every 100 ms to pick up
+  // readers that were reset by a new publisher and therefore don't get notified.
+  std::vector<msgq_pollitem_t> &items = poller->items;
+  const size_t nitems = items.size();
+
+  bool use_futex = nitems > 0;
+  for (size_t i = 0; i < nitems; i++) {
+    use_futex = use_futex && items[i].q->wakeup_futex;
+  }
+
+  if (!use_futex) {
+    return msgq_poll(items.data(), nitems, timeout);
+  }
+
+  const uint32_t slot = items[0].q->wakeup_slot;
+  std::atomic<uint32_t> * word = msgq_wakeup_seq(slot);
+
+  // Dirty bits can change when a subscriber reconnects, so build the mask every time
+  for (int w = 0; w < NUM_DIRTY_WORDS; w++){
+    poller->dirty_mask[w] = 0;
+  }
+  for (size_t i = 0; i < nitems; i++) {
+    int bit = items[i].q->wakeup_bit;
+    if (bit >= 0){
+      poller->dirty_mask[bit / 64] |= (1ULL << (bit % 64));
+    }
+    items[i].revents = 0;
+  }
+
+  uint64_t deadline = msgq_millis() + timeout;
+  int num = 0;
+
+  while (true) {
+    // Sample the futex before checking the queues, a write that happens
+    // in between changes the value and the wait returns immediately
+    uint32_t seq = *word;
+
+    uint64_t dirty[NUM_DIRTY_WORDS] = {};
+    for (int w = 0; w < NUM_DIRTY_WORDS; w++){
+      if (poller->dirty_mask[w]){
+        dirty[w] = msgq_wakeup_dirty(slot, w)->fetch_and(~poller->dirty_mask[w]) & poller->dirty_mask[w];
+      }
+    }
+
+    uint64_t now = msgq_millis();
+    bool full_scan = (now - poller->last_scan) >= 100;
+    if (full_scan){
+      poller->last_scan = now;
+    }
+
+    for (size_t i = 0; i < nitems; i++) {
+      int bit = items[i].q->wakeup_bit;
+      bool written = (bit < 0) || (dirty[bit / 64] & (1ULL << (bit % 64)));
+
+      if (items[i].revents == 0 && (full_scan || written || poller->pending[i])){
+        bool ready = msgq_msg_ready(items[i].q);
+        poller->pending[i] = ready;
+        if (ready){
+          items[i].revents = 1;
+          num++;
+        }
+      }
+    }
+
+    if (num > 0) {
+      break;
+    }
+
+    int64_t ms = 100;
+    if (timeout != -1) {
+      now = msgq_millis();
+      if (now >= deadline) {
+        break;
+      }
+      ms = std::min((uint64_t)100, deadline - now);
+    }
+
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+    futex_wait(word, seq, &ts);
+  }
+
+  return num;
+}
@@ -3,36 +3,127 @@
 #include <cstring>
 #include <string>
 #include <atomic>
+#include <vector>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 8
+#define NUM_READERS 8 // default number of reader slots per queue
+#define MAX_READERS 32
+#define NUM_WAKEUP_SLOTS 1024
+#define NUM_DIRTY_WORDS 4 // 256 subscribers per process can be tracked by the poller
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
 
+#define MSGQ_CACHE_LINE 64
+#define MSGQ_VERSION_PACKED 0x4d53475100000001ULL
+#define MSGQ_VERSION_ALIGNED 0x4d53475100000002ULL
+
+// Set in the size tag of a message that is preceded by a msgq_frame_header_t
+#define MSGQ_FRAME_HEADER_FLAG (1ULL << 62)
+
+// The first word of every queue is the layout version. Whoever opens the queue first
+// picks the layout, everybody else follows it or refuses to connect on a mismatch.
+
+// Packed layout, all readers share cache lines with each other and with the writer
 struct  msgq_header_t {
+  uint64_t version;
   uint64_t num_readers;
   uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint64_t read_pointers[MAX_READERS];
+  uint64_t read_valids[MAX_READERS];
+  uint64_t read_uids[MAX_READERS];
+  uint64_t read_wakeups[MAX_READERS];
+  uint64_t high_water;
+  uint64_t max_msg_size;
+  uint64_t write_seq;
+  uint64_t last_msg;
+};
+
+struct alignas(MSGQ_CACHE_LINE) msgq_reader_state_t {
+  uint64_t read_pointer;
+  uint64_t read_valid;
+  uint64_t read_uid;
+  uint64_t read_wakeup;
+};
+
+// Default layout, the writer and every reader update their own cache line
+struct msgq_header_aligned_t {
+  uint64_t version;
+  alignas(MSGQ_CACHE_LINE) uint64_t num_readers;
+  uint64_t write_pointer;
+  uint64_t write_uid;
+  uint64_t high_water;
+  uint64_t max_msg_size;
+  uint64_t write_seq;
+  uint64_t last_msg;
+  msgq_reader_state_t readers[MAX_READERS];
+};
+
+// high_water is the most bytes a valid reader was ever behind the writer, the size when one
+// was overrun. max_msg_size is the largest message written. Both are kept by the writer for
+// sizing the queue and survive new publishers. write_seq is the sequence number of the last
+// message with a frame header. last_msg points at the newest published message, for conflating
+// readers to skip to.
+
+// Written between the size tag and the data by a publisher with MSGQ_FRAME_HEADER set
+struct msgq_frame_header_t {
+  uint64_t seq;
+  uint64_t publish_ns; // CLOCK_MONOTONIC
+};
+
+// Space reserved in front of the data for either header
+#define MSGQ_HEADER_SIZE (sizeof(msgq_header_aligned_t) > sizeof(msgq_header_t) ? sizeof(msgq_header_aligned_t) : sizeof(msgq_header_t))
+
+struct msgq_wakeup_t {
+  uint32_t seq; // futex, incremented on every write to one of the queues of the owner
+  uint32_t owner; // pid of the process that claimed this slot
+  uint64_t dirty[NUM_DIRTY_WORDS]; // one bit per subscriber of the owner, set on write
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *high_water;
+  std::atomic<uint64_t> *max_msg_size;
+  std::atomic<uint64_t> *write_seq;
+  std::atomic<uint64_t> *last_msg;
+  std::atomic<uint64_t> *read_pointers[MAX_READERS];
+  std::atomic<uint64_t> *read_valids[MAX_READERS];
+  std::atomic<uint64_t> *read_uids[MAX_READERS];
+  std::atomic<uint64_t> *read_wakeups[MAX_READERS];
   char * mmap_p;
   char * data;
   size_t size;
+  size_t max_readers;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
+  uint64_t last_msg_local; // the last message reserved, published with it
+  bool frame_header; // messages written get a msgq_frame_header_t
+
+  // Readers are woken through a futex in the shared wakeup table, or with SIGUSR2 when disabled
+  bool wakeup_futex;
+  uint32_t wakeup_slot;
+  int wakeup_bit; // dirty bit of this subscriber, -1 if none
+
+  // Location of the slot handed out by msgq_msg_reserve
+  uint32_t reserve_cycles;
+  uint32_t reserve_pointer;
+  bool reserve_active;
+
+  // Read pointer to commit when the outstanding view is released
+  uint64_t view_read_pointer;
+  bool view_active;
+  msgq_frame_header_t view_header;
+
+  // Of the messages with a frame header that were received. read_dropped counts the ones
+  // skipped by the sequence numbers, overwritten before they were read or passed over by conflate
+  uint64_t read_seq;
+  uint64_t read_dropped;
+  uint64_t read_latency_ns; // publish to release of the last one, 0 without a frame header
 
   bool read_conflate;
   std::string endpoint;
@@ -48,6 +139,13 @@ struct msgq_pollitem_t {
   int revents;
 };
 
+struct msgq_poller_t {
+  std::vector<msgq_pollitem_t> items;
+  std::vector<bool> pending; // still ready after the last poll, checked again even without a write
+  uint64_t dirty_mask[NUM_DIRTY_WORDS] = {};
+  uint64_t last_scan = 0;
+};
+
 void msgq_wait_for_subscriber(msgq_queue_t *q);
 void msgq_reset_reader(msgq_queue_t *q);
 
@@ -55,12 +153,20 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers=NUM_READERS);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_send_batch(msgq_msg_t *msgs, size_t nmsgs, msgq_queue_t *q);
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size);
+int msgq_msg_commit(msgq_queue_t *q, size_t size);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_recv_view(msgq_msg_t *msg, msgq_queue_t *q);
+bool msgq_msg_release_view(msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
+
+void msgq_poller_add(msgq_poller_t * poller, msgq_queue_t * q);
+int msgq_poller_poll(msgq_poller_t * poller, int timeout);
@@ -0,0 +1,41 @@
+// Reports how full every msgq queue on this device got, to tune their sizes in service_list.yaml
+//   msgq_stats [buffer seconds, default 2]
+// The suggested size holds the buffer seconds of the largest message at the service's frequency,
+// twice the high water mark, and the three messages a queue needs to fit at least.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "services.h"
+#include "msgq.hpp"
+
+#define MB (1024.0 * 1024.0)
+
+int main(int argc, char **argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+
+  printf("%-24s %10s %10s %6s %10s %10s\n", "service", "size MB", "high MB", "%", "max msg", "suggest MB");
+  for (const auto &it : services) {
+    std::string path = std::string("/dev/shm/") + it.name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || (size_t)st.st_size <= MSGQ_HEADER_SIZE) continue;
+
+    // opened at the size it has, so nothing is resized or created
+    msgq_queue_t q;
+    size_t size = st.st_size - MSGQ_HEADER_SIZE;
+    if (msgq_new_queue(&q, it.name, size) != 0) continue;
+    uint64_t high_water = *q.high_water, max_msg_size = *q.max_msg_size;
+    msgq_close_queue(&q);
+
+    double needed = std::max({it.frequency * max_msg_size * seconds,
+                              2.0 * high_water,
+                              3.0 * ALIGN(max_msg_size + sizeof(int64_t)) + sizeof(int64_t)});
+    printf("%-24s %10.2f %10.2f %6.1f %10lu %10.0f\n", it.name, size / MB, high_water / MB,
+           100.0 * high_water / size, (unsigned long)max_msg_size, std::max(1.0, std::ceil(needed / MB)));
+  }
+  return 0;
+}
@@ -1,3 +1,11 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
 #include "catch2/catch.hpp"
 #include "msgq.hpp"
 
@@ -165,6 +173,90 @@ TEST_CASE("msgq_msg_recv test wraparound"){
   msgq_msg_close(&msg1);
 }
 
+TEST_CASE("msgq_msg_send_batch"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q_pub, q_sub;
+  msgq_new_queue(&q_pub, "test_queue", 1024);
+  msgq_new_queue(&q_sub, "test_queue", 1024);
+
+  msgq_init_publisher(&q_pub);
+  msgq_init_subscriber(&q_sub);
+
+  // Enough messages to wrap around and publish in parts
+  const size_t n = 40;
+  uint64_t values[n];
+  msgq_msg_t msgs[n];
+  for (size_t i = 0; i < n; i++){
+    values[i] = i;
+    msgs[i].data = (char*)&values[i];
+    msgs[i].size = sizeof(uint64_t);
+  }
+
+  for (size_t i = 0; i < n; i++){
+    REQUIRE(msgq_msg_send_batch(&msgs[i], 1, &q_pub) == 1);
+
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &q_sub) == sizeof(uint64_t));
+    REQUIRE(*(uint64_t*)msg.data == i);
+    msgq_msg_close(&msg);
+  }
+
+  REQUIRE(msgq_msg_send_batch(msgs, n, &q_pub) == n);
+  for (size_t i = 0; i < n; i++){
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &q_sub) == sizeof(uint64_t));
+    REQUIRE(*(uint64_t*)msg.data == i);
+    msgq_msg_close(&msg);
+  }
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv(&msg, &q_sub) == 0);
+}
+
+TEST_CASE("msgq_msg_reserve"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q_pub, q_sub;
+  msgq_new_queue(&q_pub, "test_queue", 1024);
+  msgq_new_queue(&q_sub, "test_queue", 1024);
+
+  msgq_init_publisher(&q_pub);
+  msgq_init_subscriber(&q_sub);
+
+  char * p = msgq_msg_reserve(&q_pub, 128);
+  REQUIRE(p == q_pub.data + sizeof(int64_t));
+
+  // Nothing is visible before commit
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv(&msg, &q_sub) == 0);
+
+  for (size_t i = 0; i < 64; i++){
+    p[i] = i;
+  }
+
+  SECTION("Commit"){
+    REQUIRE(msgq_msg_commit(&q_pub, 64) == 64);
+    REQUIRE(*q_pub.write_pointer == 64 + sizeof(int64_t));
+
+    REQUIRE(msgq_msg_recv(&msg, &q_sub) == 64);
+    for (size_t i = 0; i < 64; i++){
+      REQUIRE(msg.data[i] == (char)i);
+    }
+    msgq_msg_close(&msg);
+  }
+  SECTION("Send drops reservation"){
+    uint64_t value = 1234;
+    msgq_msg_t outgoing_msg;
+    msgq_msg_init_data(&outgoing_msg, (char*)&value, sizeof(value));
+    msgq_msg_send(&outgoing_msg, &q_pub);
+    msgq_msg_close(&outgoing_msg);
+    REQUIRE(q_pub.reserve_active == false);
+
+    REQUIRE(msgq_msg_recv(&msg, &q_sub) == sizeof(value));
+    REQUIRE(*(uint64_t*)msg.data == value);
+    msgq_msg_close(&msg);
+  }
+}
+
 TEST_CASE("msgq_msg_send test invalidation"){
   remove("/dev/shm/test_queue");
   msgq_queue_t q_pub, q_sub;
@@ -197,6 +289,207 @@ TEST_CASE("msgq_msg_send test invalidation"){
   msgq_msg_close(&msg);
 }
 
+TEST_CASE("msgq_msg_recv_view"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q_pub, q_sub;
+  msgq_new_queue(&q_pub, "test_queue", 1024);
+  msgq_new_queue(&q_sub, "test_queue", 1024);
+
+  msgq_init_publisher(&q_pub);
+  msgq_init_subscriber(&q_sub);
+
+  const size_t msg_size = 120;
+  msgq_msg_t outgoing_msg;
+  msgq_msg_init_size(&outgoing_msg, msg_size);
+  for (size_t i = 0; i < msg_size; i++){
+    outgoing_msg.data[i] = i;
+  }
+  msgq_msg_send(&outgoing_msg, &q_pub);
+
+  msgq_msg_t view;
+  REQUIRE(msgq_msg_recv_view(&view, &q_sub) == msg_size);
+  REQUIRE(view.data == q_sub.data + sizeof(int64_t)); // Points into the ring buffer
+  REQUIRE(memcmp(view.data, outgoing_msg.data, msg_size) == 0);
+
+  SECTION("Release without overwrite"){
+    REQUIRE((*q_sub.read_pointers[0] & 0xFFFFFFFF) == 0); // Not advanced while view is held
+    REQUIRE(msgq_msg_release_view(&q_sub));
+    REQUIRE((*q_sub.read_pointers[0] & 0xFFFFFFFF) == msg_size + sizeof(int64_t));
+    REQUIRE(msgq_msg_recv_view(&view, &q_sub) == 0);
+  }
+  SECTION("Release after overwrite"){
+    for (int i = 0; i < 8; i++) {
+      msgq_msg_send(&outgoing_msg, &q_pub);
+    }
+    REQUIRE(msgq_msg_release_view(&q_sub) == false);
+  }
+
+  msgq_msg_close(&outgoing_msg);
+}
+
+TEST_CASE("msgq_msg_recv conflate skips to the newest message"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q_pub, q_sub;
+  msgq_new_queue(&q_pub, "test_queue", 1024);
+  msgq_new_queue(&q_sub, "test_queue", 1024);
+
+  msgq_init_publisher(&q_pub);
+  msgq_init_subscriber(&q_sub);
+  q_sub.read_conflate = true;
+
+  for (uint64_t i = 0; i < 4; i++){
+    msgq_msg_t msg;
+    msgq_msg_init_data(&msg, (char*)&i, sizeof(i));
+    msgq_msg_send(&msg, &q_pub);
+    msgq_msg_close(&msg);
+  }
+  const uint64_t slot = ALIGN(sizeof(int64_t) + sizeof(uint64_t));
+  REQUIRE(*q_pub.last_msg == 3 * slot);
+
+  // The tags in between aren't read
+  *(int64_t*)(q_sub.data + slot) = 0;
+
+  msgq_msg_t incoming;
+  REQUIRE(msgq_msg_recv(&incoming, &q_sub) == sizeof(uint64_t));
+  REQUIRE(*(uint64_t*)incoming.data == 3);
+  msgq_msg_close(&incoming);
+  REQUIRE(msgq_msg_recv(&incoming, &q_sub) == 0);
+
+  SECTION("After the writer wrapped around"){
+    // The last one goes to the start of the buffer, just short of the reader
+    for (uint64_t i = 0; i < 60; i++){
+      msgq_msg_t msg;
+      msgq_msg_init_data(&msg, (char*)&i, sizeof(i));
+      msgq_msg_send(&msg, &q_pub);
+      msgq_msg_close(&msg);
+    }
+    REQUIRE(*q_pub.last_msg == ((uint64_t)1 << 32));
+    REQUIRE(msgq_msg_recv(&incoming, &q_sub) == sizeof(uint64_t));
+    REQUIRE(*(uint64_t*)incoming.data == 59);
+    msgq_msg_close(&incoming);
+  }
+}
+
+TEST_CASE("msgq high water"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q_pub, q_sub;
+  msgq_new_queue(&q_pub, "test_queue", 1024);
+  msgq_new_queue(&q_sub, "test_queue", 1024);
+
+  msgq_init_publisher(&q_pub);
+  msgq_init_subscriber(&q_sub);
+
+  msgq_msg_t msg;
+  msgq_msg_init_size(&msg, 120);
+  msgq_msg_send(&msg, &q_pub);
+  msgq_msg_send(&msg, &q_pub);
+  REQUIRE(*q_pub.max_msg_size == 120);
+  REQUIRE(*q_pub.high_water == 2 * (120 + sizeof(int64_t)));
+
+  SECTION("Kept while the reader catches up"){
+    msgq_msg_t incoming;
+    msgq_msg_recv(&incoming, &q_sub);
+    msgq_msg_recv(&incoming, &q_sub);
+    msgq_msg_close(&incoming);
+    msgq_msg_send(&msg, &q_pub);
+    REQUIRE(*q_pub.high_water == 2 * (120 + sizeof(int64_t)));
+  }
+  SECTION("Full size once the reader is overrun"){
+    for (int i = 0; i < 8; i++) {
+      msgq_msg_send(&msg, &q_pub);
+    }
+    REQUIRE(*q_sub.read_valids[0] == false);
+    REQUIRE(*q_pub.high_water == 1024);
+  }
+
+  msgq_msg_close(&msg);
+}
+
+TEST_CASE("msgq frame header"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q_pub, q_sub;
+  setenv("MSGQ_FRAME_HEADER", "1", 1);
+  msgq_new_queue(&q_pub, "test_queue", 1024);
+  unsetenv("MSGQ_FRAME_HEADER");
+  msgq_new_queue(&q_sub, "test_queue", 1024);
+
+  msgq_init_publisher(&q_pub);
+  msgq_init_subscriber(&q_sub);
+
+  const size_t msg_size = 40;
+  msgq_msg_t msg, incoming;
+  msgq_msg_init_size(&msg, msg_size);
+  for (size_t i = 0; i < msg_size; i++){
+    msg.data[i] = i;
+  }
+
+  msgq_msg_send(&msg, &q_pub);
+  REQUIRE(msgq_msg_recv(&incoming, &q_sub) == msg_size);
+  REQUIRE(memcmp(incoming.data, msg.data, msg_size) == 0);
+  msgq_msg_close(&incoming);
+  REQUIRE(q_sub.read_seq == 1);
+  REQUIRE(q_sub.read_dropped == 0);
+  REQUIRE(q_sub.read_latency_ns > 0);
+  REQUIRE((*q_sub.read_pointers[0] & 0xFFFFFFFF) == ALIGN(sizeof(int64_t) + sizeof(msgq_frame_header_t) + msg_size));
+
+  SECTION("Counts the messages that were overwritten"){
+    for (int i = 0; i < 20; i++) {
+      msgq_msg_send(&msg, &q_pub);
+    }
+    REQUIRE(msgq_msg_recv(&incoming, &q_sub) == 0); // Reset to the writer
+
+    msgq_msg_send(&msg, &q_pub);
+    REQUIRE(msgq_msg_recv(&incoming, &q_sub) == msg_size);
+    msgq_msg_close(&incoming);
+    REQUIRE(q_sub.read_seq == 22);
+    REQUIRE(q_sub.read_dropped == 20);
+  }
+  SECTION("Numbers a reservation when it's committed"){
+    REQUIRE(msgq_msg_reserve(&q_pub, 100) != NULL);
+    msgq_msg_send(&msg, &q_pub);
+    char *p = msgq_msg_reserve(&q_pub, 100);
+    memcpy(p, msg.data, msg_size);
+    msgq_msg_commit(&q_pub, msg_size);
+
+    for (int i = 0; i < 2; i++){
+      REQUIRE(msgq_msg_recv(&incoming, &q_sub) == msg_size);
+      REQUIRE(memcmp(incoming.data, msg.data, msg_size) == 0);
+      msgq_msg_close(&incoming);
+    }
+    REQUIRE(q_sub.read_seq == 3);
+    REQUIRE(q_sub.read_dropped == 0);
+  }
+
+  msgq_msg_close(&msg);
+}
+
+TEST_CASE("msgq_new_queue header version"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q1, q2;
+
+  SECTION("Follows existing layout"){
+    setenv("MSGQ_PACKED_HEADER", "1", 1);
+    REQUIRE(msgq_new_queue(&q1, "test_queue", 1024) == 0);
+    unsetenv("MSGQ_PACKED_HEADER");
+    REQUIRE(msgq_new_queue(&q2, "test_queue", 1024) == 0);
+
+    REQUIRE(*(uint64_t*)q2.mmap_p == MSGQ_VERSION_PACKED);
+    REQUIRE(q1.read_pointers[1] == (void*)(q1.mmap_p + offsetof(msgq_header_t, read_pointers[1])));
+    REQUIRE((char*)q2.read_pointers[1] - q2.mmap_p == (char*)q1.read_pointers[1] - q1.mmap_p);
+  }
+  SECTION("Readers on separate cache lines"){
+    REQUIRE(msgq_new_queue(&q1, "test_queue", 1024) == 0);
+    REQUIRE(*(uint64_t*)q1.mmap_p == MSGQ_VERSION_ALIGNED);
+    REQUIRE(((char*)q1.read_pointers[1] - (char*)q1.read_pointers[0]) == MSGQ_CACHE_LINE);
+    REQUIRE(((uintptr_t)q1.read_pointers[0] / MSGQ_CACHE_LINE) != ((uintptr_t)q1.write_pointer / MSGQ_CACHE_LINE));
+  }
+  SECTION("Refuses unknown layout"){
+    REQUIRE(msgq_new_queue(&q1, "test_queue", 1024) == 0);
+    *(uint64_t*)q1.mmap_p = 3; // e.g. num_readers of a queue created by an older version
+    REQUIRE(msgq_new_queue(&q2, "test_queue", 1024) == -1);
+  }
+}
+
 TEST_CASE("msgq_init_subscriber init 2 subscribers"){
   remove("/dev/shm/test_queue");
   msgq_queue_t q1, q2;
@@ -220,6 +513,81 @@ TEST_CASE("msgq_init_subscriber init 2 subscribers"){
 }
 
 
+TEST_CASE("msgq_init_subscriber reclaim slots"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t q1, q2, q3;
+  msgq_new_queue(&q1, "test_queue", 1024, 2);
+  msgq_new_queue(&q2, "test_queue", 1024, 2);
+  msgq_new_queue(&q3, "test_queue", 1024, 2);
+  msgq_init_publisher(&q1);
+
+  msgq_init_subscriber(&q1);
+  msgq_init_subscriber(&q2);
+  REQUIRE(*q1.num_readers == 2);
+
+  SECTION("Reuse slot of dead reader"){
+    *q1.read_uids[0] = ((uint64_t)1 << 32) | 0x7FFFFFFF; // tid that can't exist
+  }
+  SECTION("Reuse slot released on close"){
+    msgq_close_queue(&q1);
+  }
+
+  msgq_init_subscriber(&q3);
+  REQUIRE(q3.reader_id == 0);
+  REQUIRE(*q3.num_readers == 2);
+
+  // The other reader was not evicted
+  REQUIRE(*q2.read_uids[1] == q2.read_uid_local);
+  REQUIRE(*q2.read_valids[1] == true);
+}
+
+TEST_CASE("msgq_poller_poll"){
+  remove("/dev/shm/test_queue");
+  remove("/dev/shm/test_queue2");
+  msgq_queue_t writer1, writer2, reader1, reader2;
+  msgq_new_queue(&writer1, "test_queue", 1024);
+  msgq_new_queue(&writer2, "test_queue2", 1024);
+  msgq_new_queue(&reader1, "test_queue", 1024);
+  msgq_new_queue(&reader2, "test_queue2", 1024);
+
+  msgq_init_publisher(&writer1);
+  msgq_init_publisher(&writer2);
+  msgq_init_subscriber(&reader1);
+  msgq_init_subscriber(&reader2);
+
+  msgq_poller_t poller;
+  msgq_poller_add(&poller, &reader1);
+  msgq_poller_add(&poller, &reader2);
+
+  REQUIRE(msgq_poller_poll(&poller, 0) == 0);
+
+  uint64_t value = 1;
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, (char*)&value, sizeof(value));
+  msgq_msg_send(&msg, &writer2);
+  msgq_msg_close(&msg);
+
+  REQUIRE(msgq_poller_poll(&poller, 0) == 1);
+  REQUIRE(poller.items[0].revents == 0);
+  REQUIRE(poller.items[1].revents == 1);
+
+  // Not read yet, so still reported without a new write
+  REQUIRE(msgq_poller_poll(&poller, 0) == 1);
+  REQUIRE(poller.items[1].revents == 1);
+
+  msgq_msg_recv(&msg, &reader2);
+  msgq_msg_close(&msg);
+  REQUIRE(msgq_poller_poll(&poller, 0) == 0);
+
+  // Blocks until timeout without writes
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(msgq_poller_poll(&poller, 50) == 0);
+  REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50));
+
+  msgq_close_queue(&reader1);
+  msgq_close_queue(&reader2);
+}
+
 TEST_CASE("Write 1 msg, read 1 msg", "[integration]"){
   remove("/dev/shm/test_queue");
   const size_t msg_size = 128;
@@ -393,3 +761,133 @@ TEST_CASE("1 publisher, 2 subscribers", "[integration]"){
     msgq_msg_close(&msg2);
   }
 }
+
+static uint64_t nanos_monotonic(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<uint64_t> measure_wakeup_latency(bool wakeup_futex, int n){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t writer;
+  msgq_new_queue(&writer, "test_queue", 1024 * 1024);
+  msgq_init_publisher(&writer);
+
+  std::atomic<bool> ready(false);
+  std::vector<uint64_t> latencies;
+
+  // The reader needs its own thread, signals are delivered to the tid that subscribed
+  std::thread reader_thread([&](){
+    msgq_queue_t reader;
+    msgq_new_queue(&reader, "test_queue", 1024 * 1024);
+    reader.wakeup_futex = wakeup_futex;
+    msgq_init_subscriber(&reader);
+    ready = true;
+
+    while (latencies.size() < (size_t)n){
+      msgq_pollitem_t item;
+      item.q = &reader;
+      if (msgq_poll(&item, 1, -1) == 0) continue;
+
+      uint64_t t = nanos_monotonic();
+      msgq_msg_t msg;
+      if (msgq_msg_recv(&msg, &reader) > 0){
+        latencies.push_back(t - *(uint64_t*)msg.data);
+        msgq_msg_close(&msg);
+      }
+    }
+    msgq_close_queue(&reader);
+  });
+
+  while (!ready){
+    std::this_thread::yield();
+  }
+
+  for (int i = 0; i < n; i++){
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    uint64_t t = nanos_monotonic();
+    msgq_msg_t msg;
+    msgq_msg_init_data(&msg, (char*)&t, sizeof(t));
+    msgq_msg_send(&msg, &writer);
+    msgq_msg_close(&msg);
+  }
+
+  reader_thread.join();
+  msgq_close_queue(&writer);
+
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+TEST_CASE("Wakeup latency futex vs signal", "[.][benchmark]"){
+  const int n = 1000;
+  for (bool wakeup_futex : {false, true}){
+    auto latencies = measure_wakeup_latency(wakeup_futex, n);
+    REQUIRE(latencies.size() == n);
+
+    printf("%s wakeup latency: p50 %.1f us, p99 %.1f us\n", wakeup_futex ? "futex" : "signal",
+           latencies[n / 2] / 1e3, latencies[n * 99 / 100] / 1e3);
+  }
+}
+
+static double measure_contention_throughput(bool packed, int num_readers, int n){
+  if (packed){
+    setenv("MSGQ_PACKED_HEADER", "1", 1);
+  }
+  remove("/dev/shm/test_queue");
+  msgq_queue_t writer;
+  msgq_new_queue(&writer, "test_queue", 1024 * 1024);
+  msgq_init_publisher(&writer);
+  unsetenv("MSGQ_PACKED_HEADER");
+
+  std::atomic<bool> done(false);
+  std::atomic<int> ready(0);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < num_readers; r++){
+    readers.emplace_back([&](){
+      msgq_queue_t reader;
+      msgq_new_queue(&reader, "test_queue", 1024 * 1024);
+      msgq_init_subscriber(&reader);
+      ready++;
+
+      // Spin on the queue, every read updates the read pointer
+      while (!done){
+        msgq_msg_t msg;
+        if (msgq_msg_recv(&msg, &reader) > 0){
+          msgq_msg_close(&msg);
+        }
+      }
+      msgq_close_queue(&reader);
+    });
+  }
+
+  while (ready < num_readers){
+    std::this_thread::yield();
+  }
+
+  char data[64] = {};
+  msgq_msg_t msg;
+  msg.data = data;
+  msg.size = sizeof(data);
+
+  uint64_t start = nanos_monotonic();
+  for (int i = 0; i < n; i++){
+    msgq_msg_send(&msg, &writer);
+  }
+  double elapsed = (nanos_monotonic() - start) / 1e9;
+
+  done = true;
+  for (auto &t : readers){
+    t.join();
+  }
+  msgq_close_queue(&writer);
+  return n / elapsed;
+}
+
+TEST_CASE("Multi reader contention packed vs aligned header", "[.][benchmark]"){
+  const int n = 200000;
+  const int num_readers = std::max(1U, std::thread::hardware_concurrency() - 1);
+  for (bool packed : {true, false}){
+    double throughput = measure_contention_throughput(packed, num_readers, n);
+    printf("%s header, %d readers: %.0f msgs/s\n", packed ? "packed" : "aligned", num_readers, throughput);
+  }
+}
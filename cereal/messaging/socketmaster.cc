@@ -1,13 +1,9 @@
 #include <assert.h>
 #include <time.h>
+#include <algorithm>
 #include "messaging.hpp"
 #include "services.h"
-
-static inline uint64_t nanos_since_boot() {
-  struct timespec t;
-  clock_gettime(CLOCK_BOOTTIME, &t);
-  return t.tv_sec * 1000000000ULL + t.tv_nsec;
-}
+#include "trace.hpp"
 
 static const service *get_service(const char *name) {
   for (const auto &it : services) {
@@ -23,6 +19,13 @@ static inline bool inList(const std::initializer_list<const char *> &list, const
   return false;
 }
 
+static inline bool inList(const std::vector<const char *> &list, const char *value) {
+  for (auto &v : list) {
+    if (strcmp(value, v) == 0) return true;
+  }
+  return false;
+}
+
 class MessageContext {
 public:
   MessageContext() { ctx_ = Context::create(); }
@@ -34,53 +37,94 @@ MessageContext ctx;
 struct SubMaster::SubMessage {
   std::string name;
   SubSocket *socket = nullptr;
-  int freq = 0;
+  float freq = 0;
   bool updated = false, alive = false, valid = false, ignore_alive;
   uint64_t rcv_time = 0, rcv_frame = 0;
+  size_t size = 0;
   void *allocated_msg_reader = nullptr;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  kj::Array<capnp::word> buf;
+  kj::Array<capnp::word> buf, back_buf;
   cereal::Event::Reader event;
 };
 
-SubMaster::SubMaster(const std::initializer_list<const char *> &service_list, const char *address,
-                     const std::initializer_list<const char *> &ignore_alive) {
+SubMaster::SubMaster(const std::vector<const char *> &service_list, const std::vector<const char *> &poll,
+                     const std::vector<const char *> &ignore_alive, const char *address) {
   poller_ = Poller::create();
+  ids_.resize(NUM_SERVICES, nullptr);
   for (auto name : service_list) {
     const service *serv = get_service(name);
     assert(serv != nullptr);
     SubSocket *socket = SubSocket::create(ctx.ctx_, name, address ? address : "127.0.0.1", true);
     assert(socket != 0);
-    poller_->registerSocket(socket);
+    if (poll.empty() || inList(poll, name)) {
+      poller_->registerSocket(socket);
+    } else {
+      non_polled_.push_back(socket);
+    }
     SubMessage *m = new SubMessage{
+      .name = name,
       .socket = socket,
       .freq = serv->frequency,
       .ignore_alive = inList(ignore_alive, name),
       .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader)),
-      .buf = kj::heapArray<capnp::word>(1024)};
+      .buf = kj::heapArray<capnp::word>(1024),
+      .back_buf = kj::heapArray<capnp::word>(1024)};
     messages_[socket] = m;
     services_[name] = m;
+    ids_[serv - services] = m;
   }
 }
 
 int SubMaster::update(int timeout) {
+  poller_->poll(timeout, ready_);
+  ready_.insert(ready_.end(), non_polled_.begin(), non_polled_.end());
+  return receive_();
+}
+
+int SubMaster::update_on(const char *trigger, int timeout) {
+  SubSocket *trigger_socket = services_.at(trigger)->socket;
+  Poller *&poller = trigger_pollers_[trigger_socket];
+  if (poller == nullptr) {
+    poller = Poller::create();
+    poller->registerSocket(trigger_socket);
+  }
+
+  poller->poll(timeout, ready_);
+  for (auto &kv : messages_) {
+    if (kv.first != trigger_socket) ready_.push_back(kv.first);
+  }
+  return receive_();
+}
+
+// receives from the sockets in ready_
+int SubMaster::receive_() {
   if (++frame == UINT64_MAX) frame = 1;
   for (auto &kv : messages_) kv.second->updated = false;
 
   int updated = 0;
-  auto sockets = poller_->poll(timeout);
-  uint64_t current_time = nanos_since_boot();
-  for (auto s : sockets) {
-    Message *msg = s->receive(true);
-    if (msg == nullptr) continue;
+  // the receiving and parsing, not the wait
+  TRACE_SCOPE("SubMaster::update");
+  uint64_t current_time = messaging_nanos_since_boot();
+  for (auto s : ready_) {
+    char *data = nullptr;
+    size_t msg_size = s->receiveView(&data);
+    if (msg_size == 0) continue;
 
+    // Copy straight out of the transport into the back buffer, the current
+    // event stays intact if the data turns out to be overwritten
     SubMessage *m = messages_.at(s);
-    const size_t size = (msg->getSize() / sizeof(capnp::word)) + 1;
-    if (m->buf.size() < size) {
-      m->buf = kj::heapArray<capnp::word>(size);
+    const size_t size = (msg_size / sizeof(capnp::word)) + 1;
+    if (m->back_buf.size() < size) {
+      // Grow in powers of two from the largest buffer so far, both buffers
+      // end up the same size and the steady state doesn't allocate
+      size_t capacity = std::max(m->buf.size(), m->back_buf.size());
+      while (capacity < size) capacity *= 2;
+      m->back_buf = kj::heapArray<capnp::word>(capacity);
+      ++allocations_;
     }
-    memcpy(m->buf.begin(), msg->getData(), msg->getSize());
-    delete msg;
+    memcpy(m->back_buf.begin(), data, msg_size);
+    if (!s->releaseView()) continue;
+    std::swap(m->buf, m->back_buf);
 
     if (m->msg_reader) {
       m->msg_reader->~FlatArrayMessageReader();
@@ -90,6 +134,7 @@ int SubMaster::update(int timeout) {
     m->updated = true;
     m->rcv_time = current_time;
     m->rcv_frame = frame;
+    m->size = msg_size;
     m->valid = m->event.getValid();
 
     ++updated;
@@ -97,7 +142,7 @@ int SubMaster::update(int timeout) {
 
   for (auto &kv : messages_) {
     SubMessage *m = kv.second;
-    m->alive = (m->freq <= (1e-5) || ((current_time - m->rcv_time) * (1e-9)) < (10.0 / m->freq));
+    m->alive = (m->freq <= (1e-5) || ((current_time - m->rcv_time) * (1e-9)) < (alive_periods / m->freq));
   }
   return updated;
 }
@@ -115,11 +160,11 @@ bool SubMaster::all_(const std::initializer_list<const char *> &service_list, bo
 
 void SubMaster::drain() {
   while (true) {
-    auto polls = poller_->poll(0);
-    if (polls.size() == 0)
+    poller_->poll(0, ready_);
+    if (ready_.size() == 0)
       break;
 
-    for (auto sock : polls) {
+    for (auto sock : ready_) {
       Message *msg = sock->receive(true);
       delete msg;
     }
@@ -138,8 +183,60 @@ cereal::Event::Reader &SubMaster::operator[](const char *name) {
   return services_.at(name)->event;
 };
 
+const TransportStats *SubMaster::stats(const char *name) const {
+  return services_.at(name)->socket->getStats();
+}
+
+bool SubMaster::alive(const char *name) const {
+  return services_.at(name)->alive;
+}
+
+bool SubMaster::valid(const char *name) const {
+  return services_.at(name)->valid;
+}
+
+uint64_t SubMaster::rcv_time(const char *name) const {
+  return services_.at(name)->rcv_time;
+}
+
+uint64_t SubMaster::logMonoTime(const char *name) const {
+  const SubMessage *m = services_.at(name);
+  return m->size ? m->event.getLogMonoTime() : 0;
+}
+
+size_t SubMaster::raw(const char *name, const char **data) const {
+  const SubMessage *m = services_.at(name);
+  *data = (const char *)m->buf.begin();
+  return m->size;
+}
+
+SubSocket *SubMaster::socket(const char *name) const {
+  return services_.at(name)->socket;
+}
+
+bool SubMaster::updated(ServiceId id) const {
+  assert(ids_[(int)id]);
+  return ids_[(int)id]->updated;
+}
+
+uint64_t SubMaster::rcv_frame(ServiceId id) const {
+  assert(ids_[(int)id]);
+  return ids_[(int)id]->rcv_frame;
+}
+
+cereal::Event::Reader &SubMaster::operator[](ServiceId id) {
+  assert(ids_[(int)id]);
+  return ids_[(int)id]->event;
+}
+
+const TransportStats *SubMaster::stats(ServiceId id) const {
+  assert(ids_[(int)id]);
+  return ids_[(int)id]->socket->getStats();
+}
+
 SubMaster::~SubMaster() {
   delete poller_;
+  for (auto &kv : trigger_pollers_) delete kv.second;
   for (auto &kv : messages_) {
     SubMessage *m = kv.second;
     if (m->msg_reader) {
@@ -152,11 +249,14 @@ SubMaster::~SubMaster() {
 }
 
 PubMaster::PubMaster(const std::initializer_list<const char *> &service_list) {
+  ids_.resize(NUM_SERVICES, nullptr);
   for (auto name : service_list) {
-    assert(get_service(name) != nullptr);
+    const service *serv = get_service(name);
+    assert(serv != nullptr);
     PubSocket *socket = PubSocket::create(ctx.ctx_, name);
     assert(socket);
     sockets_[name] = socket;
+    ids_[serv - services] = socket;
   }
 }
 
@@ -165,6 +265,36 @@ int PubMaster::send(const char *name, MessageBuilder &msg) {
   return send(name, bytes.begin(), bytes.size());
 }
 
+int PubMaster::send(ServiceId id, MessageBuilder &msg) {
+  auto bytes = msg.toBytes();
+  return send(id, bytes.begin(), bytes.size());
+}
+
+kj::ArrayPtr<capnp::word> InPlaceMessageBuilder::reserveSegment(PubSocket *socket, size_t max_size) {
+  const size_t words = max_size / sizeof(capnp::word);
+  assert(words > 1);
+
+  // capnp requires the first segment to be zeroed, the first word is left for the segment table
+  capnp::word *buf = (capnp::word *)socket->reserve(words * sizeof(capnp::word));
+  memset(buf, 0, words * sizeof(capnp::word));
+  return kj::ArrayPtr<capnp::word>(buf + 1, words - 1);
+}
+
+int InPlaceMessageBuilder::commit() {
+  auto segments = getSegmentsForOutput();
+  if (segments.size() != 1) {
+    // Message outgrew the reserved segment, send a flat copy instead
+    auto bytes = capnp::messageToFlatArray(segments);
+    return socket_->send((char *)bytes.asBytes().begin(), bytes.asBytes().size());
+  }
+
+  // Fill in the segment table in front of the segment, the buffer is now a flat array message
+  uint32_t *table = (uint32_t *)(segments[0].begin() - 1);
+  table[0] = 0;  // segment count - 1
+  table[1] = segments[0].size();
+  return socket_->commit((segments[0].size() + 1) * sizeof(capnp::word));
+}
+
 PubMaster::~PubMaster() {
   for (auto s : sockets_) delete s.second;
 }
@@ -0,0 +1,35 @@
+#include "catch2/catch.hpp"
+#include "messaging.hpp"
+
+// Sends a carState and updates until it's received, zmq drops what's sent before its subscriber joins
+static void send_and_receive(PubMaster &pm, SubMaster &sm){
+  for (int i = 0; i < 100; i++){
+    MessageBuilder msg;
+    auto cs = msg.initEvent().initCarState();
+    cs.setVEgo(20.0);
+    cs.setSteeringAngle(1.5);
+    pm.send("carState", msg);
+
+    sm.update(100);
+    if (sm.updated("carState")) return;
+  }
+  FAIL("carState wasn't received");
+}
+
+TEST_CASE("SubMaster_no_allocations_once_sizes_are_stable"){
+  SubMaster sm({"carState"});
+  PubMaster pm({"carState"});
+
+  // the first messages size both buffers
+  for (int i = 0; i < 10; i++){
+    send_and_receive(pm, sm);
+  }
+  const uint64_t warm = sm.allocations();
+  REQUIRE(warm > 0);
+
+  for (int i = 0; i < 1000; i++){
+    send_and_receive(pm, sm);
+  }
+  REQUIRE(sm.allocations() == warm);
+  REQUIRE(sm["carState"].getCarState().getVEgo() == 20.0);
+}
@@ -91,6 +91,27 @@ class TestPubSubSockets(unittest.TestCase):
           # TODO: compare actual data
           self.assertEqual(len(recvd_msgs), len(sent_msgs))
 
+  def test_receive_all(self):
+    sock = random_sock()
+    pub_sock = messaging.pub_sock(sock)
+    sub_sock = messaging.sub_sock(sock, conflate=False, timeout=100)
+    zmq_sleep()
+
+    dat, offsets = sub_sock.receive_all()
+    self.assertEqual((dat, list(offsets)), (b"", [0]))
+
+    sent_msgs = [random_bytes() for _ in range(100)]
+    for msg in sent_msgs:
+      pub_sock.send(msg)
+    time.sleep(0.1)
+
+    dat, offsets = sub_sock.receive_all(max_msgs=60)
+    self.assertEqual(len(offsets), 61)
+    dat2, offsets2 = sub_sock.receive_all()
+    recvd_msgs = [dat[offsets[i]:offsets[i + 1]] for i in range(len(offsets) - 1)]
+    recvd_msgs += [dat2[offsets2[i]:offsets2[i + 1]] for i in range(len(offsets2) - 1)]
+    self.assertEqual(recvd_msgs, sent_msgs)
+
   def test_receive_timeout(self):
     sock = random_sock()
     for _ in range(10):
@@ -61,6 +61,23 @@ class TestSubMaster(unittest.TestCase):
       self.assertEqual(sm.frame, i)
       self.assertTrue(all(sm.updated.values()))
 
+  def test_data_decoded_once(self):
+    sock = "carState"
+    pub_sock = messaging.pub_sock(sock)
+    sm = messaging.SubMaster([sock,])
+    zmq_sleep()
+
+    pub_sock.send(random_carstate().to_bytes())
+    sm.update(1000)
+    first = sm[sock]
+    self.assertIs(first, sm[sock])
+
+    msg = random_carstate()
+    pub_sock.send(msg.to_bytes())
+    sm.update(1000)
+    self.assertIsNot(first, sm[sock])
+    assert_carstate(msg.carState, sm[sock])
+
   def test_update_timeout(self):
     sock = random_sock()
     sm = messaging.SubMaster([sock,])
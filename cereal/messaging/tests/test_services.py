@@ -15,6 +15,8 @@ class TestServices(unittest.TestCase):
     service = service_list[s]
     self.assertTrue(service.port > 8000)
     self.assertTrue(service.frequency <= 100)
+    if service.segment_size is not None:
+      self.assertTrue(0 < service.segment_size < 0xFFFFFFFF)
 
   def test_no_duplicate_port(self):
     ports = {}
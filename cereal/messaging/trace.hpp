@@ -0,0 +1,13 @@
+#pragma once
+
+// Spans from selfdrive/common/trace.h when cereal is built in the openpilot tree, nothing otherwise
+#if defined(__has_include)
+#if __has_include("selfdrive/common/trace.h")
+#include "selfdrive/common/trace.h"
+#define MSGQ_HAS_TRACE
+#endif
+#endif
+
+#ifndef MSGQ_HAS_TRACE
+#define TRACE_SCOPE(name)
+#endif
@@ -4,11 +4,13 @@ import yaml
 
 
 class Service():
-  def __init__(self, port, should_log, frequency, decimation=None):
+  def __init__(self, port, should_log, frequency, decimation=None, readers=None, segment_size=None):
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.readers = readers
+    self.segment_size = segment_size
 
 
 service_list_path = os.path.join(os.path.dirname(__file__), "service_list.yaml")
@@ -17,18 +19,33 @@ service_list = {}
 with open(service_list_path, "r") as f:
   for k, v in yaml.safe_load(f).items():
     decimation = None
-    if len(v) == 4:
+    if len(v) >= 4:
       decimation = v[3]
 
-    service_list[k] = Service(v[0], v[1], v[2], decimation)
+    readers = None
+    if len(v) >= 5:
+      readers = v[4]
+
+    # given in MB, kept in bytes
+    segment_size = None
+    if len(v) >= 6 and v[5] is not None:
+      segment_size = int(v[5] * 1024 * 1024)
+
+    service_list[k] = Service(v[0], v[1], v[2], decimation, readers, segment_size)
 
 if __name__ == "__main__":
   print("/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT service_list.yaml */")
   print("#ifndef __SERVICES_H")
   print("#define __SERVICES_H")
-  print("struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };")
-  print("static struct service services[] = {")
+  print("struct service { char name[0x100]; int port; bool should_log; float frequency; int decimation; int readers; int segment_size; };")
+  # unused so the header can be included just for the service ids
+  print("static struct service services[] __attribute__((unused)) = {")
   for k, v in service_list.items():
-    print('  { .name = "%s", .port = %d, .should_log = %s, .frequency = %d, .decimation = %d },' % (k, v.port, "true" if v.should_log else "false", v.frequency, -1 if v.decimation is None else v.decimation))
+    print('  { .name = "%s", .port = %d, .should_log = %s, .frequency = %g, .decimation = %d, .readers = %d, .segment_size = %d },' % (k, v.port, "true" if v.should_log else "false", v.frequency, -1 if v.decimation is None else v.decimation, -1 if v.readers is None else v.readers, -1 if v.segment_size is None else v.segment_size))
+  print("};")
+  print("enum class ServiceId : int {")
+  for i, k in enumerate(service_list.keys()):
+    print("  %s = %d," % (k, i))
   print("};")
+  print("static const int NUM_SERVICES = %d;" % len(service_list))
   print("#endif")
@@ -0,0 +1 @@
+from .visionipc_pyx import VisionIpcServer, VisionBuf, VisionStreamType  # pylint: disable=no-name-in-module, import-error
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
 #include "visionbuf.h"
 
 #define ALIGN(x, align) (((x) + (align)-1) & ~((align)-1))
@@ -22,7 +26,64 @@ void visionbuf_compute_aligned_width_and_height(int width, int height, int *alig
 #endif
 }
 
+static const char *stream_names[VISION_STREAM_MAX] = {
+  [VISION_STREAM_RGB_BACK] = "rgb_back",
+  [VISION_STREAM_RGB_FRONT] = "rgb_front",
+  [VISION_STREAM_RGB_WIDE] = "rgb_wide",
+  [VISION_STREAM_YUV_BACK] = "yuv_back",
+  [VISION_STREAM_YUV_FRONT] = "yuv_front",
+  [VISION_STREAM_YUV_WIDE] = "yuv_wide",
+  [VISION_STREAM_YUV_BACK_HALF] = "yuv_back_half",
+  [VISION_STREAM_YUV_FRONT_HALF] = "yuv_front_half",
+  [VISION_STREAM_YUV_WIDE_HALF] = "yuv_wide_half",
+  [VISION_STREAM_YUV_BACK_QUARTER] = "yuv_back_quarter",
+  [VISION_STREAM_YUV_FRONT_QUARTER] = "yuv_front_quarter",
+  [VISION_STREAM_YUV_WIDE_QUARTER] = "yuv_wide_quarter",
+  [VISION_STREAM_YUV_BACK_VENUS] = "yuv_back_venus",
+  [VISION_STREAM_YUV_FRONT_VENUS] = "yuv_front_venus",
+  [VISION_STREAM_YUV_WIDE_VENUS] = "yuv_wide_venus",
+};
+
+const char *visionipc_stream_name(VisionStreamType type) {
+  assert(type >= 0 && type < VISION_STREAM_MAX);
+  return stream_names[type];
+}
+
+VisionStreamType visionipc_stream_type(const char *name) {
+  for (int i = 0; i < VISION_STREAM_MAX; i++) {
+    if (strcmp(stream_names[i], name) == 0) return (VisionStreamType)i;
+  }
+  return VISION_STREAM_MAX;
+}
+
+// COLOR_FMT_NV12 of msm_media_info.h: rows aligned to 128 bytes, the y plane to 32 rows and the uv
+// plane to 16, with room for the encoder's extradata after them
+#define VENUS_NV12_STRIDE(w) ALIGN((w), 128)
+#define VENUS_NV12_Y_SCANLINES(h) ALIGN((h), 32)
+#define VENUS_NV12_UV_SCANLINES(h) ALIGN((h) / 2, 16)
+#define VENUS_EXTRADATA_SIZE (16 * 1024)
+
+static size_t venus_nv12_size(size_t width, size_t height) {
+  const size_t stride = VENUS_NV12_STRIDE(width);
+  const size_t y_plane = stride * VENUS_NV12_Y_SCANLINES(height);
+  const size_t uv_plane = stride * VENUS_NV12_UV_SCANLINES(height) + 4096;
+  return ALIGN(y_plane + uv_plane + std::max<size_t>(VENUS_EXTRADATA_SIZE, 8 * stride), 4096);
+}
+
+size_t visionbuf_size(VisionBufFormat format, size_t width, size_t height, size_t stride, size_t planes) {
+  switch (format) {
+    case VISIONBUF_FORMAT_RGB: return stride * height;
+    case VISIONBUF_FORMAT_I420:
+    case VISIONBUF_FORMAT_NV12: return width * height * 3 / 2;
+    case VISIONBUF_FORMAT_FLOAT: return width * height * planes * sizeof(float);
+    case VISIONBUF_FORMAT_NV12_VENUS: return venus_nv12_size(width, height);
+  }
+  assert(false);
+  return 0;
+}
+
 void VisionBuf::init_rgb(size_t width, size_t height, size_t stride) {
+  this->format = VISIONBUF_FORMAT_RGB;
   this->rgb = true;
   this->width = width;
   this->height = height;
@@ -30,6 +91,7 @@ void VisionBuf::init_rgb(size_t width, size_t height, size_t stride) {
 }
 
 void VisionBuf::init_yuv(size_t width, size_t height){
+  this->format = VISIONBUF_FORMAT_I420;
   this->rgb = false;
   this->width = width;
   this->height = height;
@@ -38,3 +100,81 @@ void VisionBuf::init_yuv(size_t width, size_t height){
   this->u = this->y + (width * height);
   this->v = this->u + (width / 2 * height / 2);
 }
+
+void VisionBuf::init_nv12(size_t width, size_t height){
+  this->format = VISIONBUF_FORMAT_NV12;
+  this->rgb = false;
+  this->width = width;
+  this->height = height;
+
+  this->y = (uint8_t *)this->addr;
+  this->u = this->y + (width * height);
+  this->v = nullptr;
+}
+
+void VisionBuf::init_nv12_venus(size_t width, size_t height){
+  this->format = VISIONBUF_FORMAT_NV12_VENUS;
+  this->rgb = false;
+  this->width = width;
+  this->height = height;
+  this->stride = VENUS_NV12_STRIDE(width);
+
+  this->y = (uint8_t *)this->addr;
+  this->u = this->y + this->stride * VENUS_NV12_Y_SCANLINES(height);
+  this->v = nullptr;
+}
+
+void VisionBuf::init_float(size_t width, size_t height, size_t planes){
+  this->format = VISIONBUF_FORMAT_FLOAT;
+  this->rgb = false;
+  this->width = width;
+  this->height = height;
+  this->planes = planes;
+}
+
+VisionBufPlane VisionBuf::plane(size_t i) const {
+  switch (this->format) {
+    case VISIONBUF_FORMAT_RGB:
+      assert(i == 0);
+      return {0, this->stride, this->height};
+    case VISIONBUF_FORMAT_I420:
+      assert(i < 3);
+      if (i == 0) return {0, this->width, this->height};
+      return {this->width * this->height + (i - 1) * (this->width / 2 * this->height / 2), this->width / 2, this->height / 2};
+    case VISIONBUF_FORMAT_NV12:
+      assert(i < 2);
+      return {i == 0 ? 0 : this->width * this->height, this->width, i == 0 ? this->height : this->height / 2};
+    case VISIONBUF_FORMAT_NV12_VENUS:
+      assert(i < 2);
+      return {i == 0 ? 0 : (size_t)(this->u - this->y), this->stride, i == 0 ? this->height : this->height / 2};
+    case VISIONBUF_FORMAT_FLOAT:
+      assert(i < this->planes);
+      return {i * this->width * this->height * sizeof(float), this->width * sizeof(float), this->height};
+  }
+  assert(false);
+  return {};
+}
+
+void VisionBuf::sync(int dir) {
+  sync(dir, 0, this->len);
+}
+
+void VisionBuf::sync_plane(int dir, size_t plane) {
+  sync_rows(dir, plane, 0, this->plane(plane).rows);
+}
+
+void VisionBuf::sync_rows(int dir, size_t plane, size_t first_row, size_t rows) {
+  const VisionBufPlane p = this->plane(plane);
+  assert(first_row + rows <= p.rows);
+  sync(dir, p.offset + first_row * p.stride, rows * p.stride);
+}
+
+void VisionBuf::init(VisionBufFormat format, size_t width, size_t height, size_t stride, size_t planes){
+  switch (format) {
+    case VISIONBUF_FORMAT_RGB: init_rgb(width, height, stride); break;
+    case VISIONBUF_FORMAT_I420: init_yuv(width, height); break;
+    case VISIONBUF_FORMAT_NV12: init_nv12(width, height); break;
+    case VISIONBUF_FORMAT_FLOAT: init_float(width, height, planes); break;
+    case VISIONBUF_FORMAT_NV12_VENUS: init_nv12_venus(width, height); break;
+  }
+}
@@ -18,9 +18,41 @@ enum VisionStreamType {
   VISION_STREAM_YUV_BACK,
   VISION_STREAM_YUV_FRONT,
   VISION_STREAM_YUV_WIDE,
+  // Downscaled copies of the YUV streams
+  VISION_STREAM_YUV_BACK_HALF,
+  VISION_STREAM_YUV_FRONT_HALF,
+  VISION_STREAM_YUV_WIDE_HALF,
+  VISION_STREAM_YUV_BACK_QUARTER,
+  VISION_STREAM_YUV_FRONT_QUARTER,
+  VISION_STREAM_YUV_WIDE_QUARTER,
+  // Copies of the YUV streams in the layout the hardware encoder takes
+  VISION_STREAM_YUV_BACK_VENUS,
+  VISION_STREAM_YUV_FRONT_VENUS,
+  VISION_STREAM_YUV_WIDE_VENUS,
   VISION_STREAM_MAX,
 };
 
+// Streams are identified by name, the enum above only covers the ones camerad produces.
+// Other producers can register their own names with VisionIpcServer::create_buffers.
+constexpr int VISIONIPC_MAX_STREAM_NAME = 32;
+const char *visionipc_stream_name(VisionStreamType type);
+VisionStreamType visionipc_stream_type(const char *name); // VISION_STREAM_MAX if not a builtin stream
+
+enum VisionBufFormat {
+  VISIONBUF_FORMAT_RGB,   // packed 24 bit BGR, rows of stride bytes
+  VISIONBUF_FORMAT_I420,  // Y plane, followed by quarter size U and V planes
+  VISIONBUF_FORMAT_NV12,  // Y plane, followed by an interleaved quarter size UV plane
+  VISIONBUF_FORMAT_FLOAT, // planes of width x height 32 bit floats
+  VISIONBUF_FORMAT_NV12_VENUS, // NV12 with the Venus encoder's stride and scanline alignment, rows of stride bytes
+};
+
+// Where a plane's rows are in a buffer
+struct VisionBufPlane {
+  size_t offset;
+  size_t stride;
+  size_t rows;
+};
+
 class VisionBuf {
  public:
   size_t len = 0;
@@ -28,12 +60,14 @@ class VisionBuf {
   void * addr = nullptr;
   int fd = 0;
 
+  VisionBufFormat format = VISIONBUF_FORMAT_I420;
   bool rgb = false;
   size_t width = 0;
   size_t height = 0;
   size_t stride = 0;
+  size_t planes = 0; // Only used for float
 
-  // YUV
+  // YUV, v is unused for NV12
   uint8_t * y = nullptr;
   uint8_t * u = nullptr;
   uint8_t * v = nullptr;
@@ -41,7 +75,7 @@ class VisionBuf {
   // Visionipc
   uint64_t server_id = 0;
   size_t idx = 0;
-  VisionStreamType type;
+  char stream[VISIONIPC_MAX_STREAM_NAME] = {};
 
   // OpenCL
   cl_mem buf_cl = nullptr;
@@ -51,13 +85,28 @@ class VisionBuf {
   int handle = 0;
   bool owner = false;
 
+  // bytes this process synced, cache lines maintained on the ion buffers
+  uint64_t sync_bytes = 0;
+
   void allocate(size_t len);
   void import();
   void init_cl(cl_device_id device_id, cl_context ctx);
   void init_rgb(size_t width, size_t height, size_t stride);
   void init_yuv(size_t width, size_t height);
+  void init_nv12(size_t width, size_t height);
+  void init_nv12_venus(size_t width, size_t height);
+  void init_float(size_t width, size_t height, size_t planes);
+  void init(VisionBufFormat format, size_t width, size_t height, size_t stride, size_t planes=1);
+  // Plane 0 is the Y plane, or the whole image of an rgb buffer. 1 is U, or the UV plane of NV12, and 2 is V.
+  // Float buffers have one per plane
+  VisionBufPlane plane(size_t i) const;
+  void sync(int dir, size_t offset, size_t length);
   void sync(int dir);
+  // Only the parts of the buffer the cpu or device touches, like the Y plane or the rows of a crop
+  void sync_plane(int dir, size_t plane);
+  void sync_rows(int dir, size_t plane, size_t first_row, size_t rows);
   void free();
 };
 
 void visionbuf_compute_aligned_width_and_height(int width, int height, int *aligned_w, int *aligned_h);
+size_t visionbuf_size(VisionBufFormat format, size_t width, size_t height, size_t stride, size_t planes=1);
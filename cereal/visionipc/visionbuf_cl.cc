@@ -1,6 +1,7 @@
 #include "visionbuf.h"
 
 #include <atomic>
+#include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -9,35 +10,52 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 
+// OpenCL implementations only use a host pointer in place, instead of keeping a copy of it on the
+// device, when it's page aligned and its size a multiple of a cache line. Mappings are page aligned
+#define HOST_PTR_ALIGN 4096
+
 std::atomic<int> offset = 0;
 
-static void *malloc_with_fd(size_t len, int *fd) {
-  char full_path[0x100];
+static int shared_fd(size_t len) {
+  int fd = -1;
+#ifndef __APPLE__
+  // Sealed to its size, a client can't truncate it and take the mapping away from the others
+  fd = memfd_create("visionbuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd >= 0) {
+    int err = ftruncate(fd, len);
+    assert(err == 0);
+    err = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    assert(err == 0);
+    return fd;
+  }
+  assert(errno == ENOSYS);
+#endif
 
+  char full_path[0x100];
 #ifdef __APPLE__
   snprintf(full_path, sizeof(full_path)-1, "/tmp/visionbuf_%d_%d", getpid(), offset++);
 #else
   snprintf(full_path, sizeof(full_path)-1, "/dev/shm/visionbuf_%d_%d", getpid(), offset++);
 #endif
 
-  *fd = open(full_path, O_RDWR | O_CREAT, 0777);
-  assert(*fd >= 0);
+  fd = open(full_path, O_RDWR | O_CREAT, 0777);
+  assert(fd >= 0);
 
   unlink(full_path);
 
-  ftruncate(*fd, len);
-  void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
-  assert(addr != MAP_FAILED);
-
-  return addr;
+  int err = ftruncate(fd, len);
+  assert(err == 0);
+  return fd;
 }
 
 void VisionBuf::allocate(size_t len) {
-  int fd;
-  void *addr = malloc_with_fd(len, &fd);
+  const size_t mmap_len = (len + HOST_PTR_ALIGN - 1) / HOST_PTR_ALIGN * HOST_PTR_ALIGN;
+  int fd = shared_fd(mmap_len);
+  void *addr = mmap(NULL, mmap_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(addr != MAP_FAILED);
 
   this->len = len;
-  this->mmap_len = len;
+  this->mmap_len = mmap_len;
   this->addr = addr;
   this->fd = fd;
 }
@@ -48,7 +66,8 @@ void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx){
   this->copy_q = clCreateCommandQueue(ctx, device_id, 0, &err);
   assert(err == 0);
 
-  this->buf_cl = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, this->len, this->addr, &err);
+  // the whole mapping, so the device can use the shared memory itself
+  this->buf_cl = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, this->mmap_len, this->addr, &err);
   assert(err == 0);
 }
 
@@ -60,17 +79,23 @@ void VisionBuf::import(){
 }
 
 
-void VisionBuf::sync(int dir) {
+// The buffer is the shared memory, a map and unmap of it only copies where the device keeps its own
+// copy, a discrete gpu does, and is a cache flush where it doesn't. FROM_DEVICE leaves the device's
+// writes in addr. TO_DEVICE hands what's in addr to the device, the map doesn't read the device's
+// copy back over it first
+void VisionBuf::sync(int dir, size_t offset, size_t length) {
   int err = 0;
-  if (!this->buf_cl) return;
+  assert(offset + length <= this->len);
+  if (!this->buf_cl || length == 0) return;
 
-  if (dir == VISIONBUF_SYNC_FROM_DEVICE) {
-    err = clEnqueueReadBuffer(this->copy_q, this->buf_cl, CL_FALSE, 0, this->len, this->addr, 0, NULL, NULL);
-  } else {
-    err = clEnqueueWriteBuffer(this->copy_q, this->buf_cl, CL_FALSE, 0, this->len, this->addr, 0, NULL, NULL);
-  }
+  const cl_map_flags flags = dir == VISIONBUF_SYNC_FROM_DEVICE ? CL_MAP_READ : CL_MAP_WRITE_INVALIDATE_REGION;
+  void *ptr = clEnqueueMapBuffer(this->copy_q, this->buf_cl, CL_TRUE, flags, offset, length, 0, NULL, NULL, &err);
+  assert(err == 0);
+  assert(ptr == (uint8_t *)this->addr + offset);
+  err = clEnqueueUnmapMemObject(this->copy_q, this->buf_cl, ptr, 0, NULL, NULL);
   assert(err == 0);
   clFinish(this->copy_q);
+  this->sync_bytes += length;
 }
 
 void VisionBuf::free() {
@@ -81,6 +106,6 @@ void VisionBuf::free() {
     clReleaseCommandQueue(this->copy_q);
   }
 
-  munmap(this->addr, this->len);
+  munmap(this->addr, this->mmap_len);
   close(this->fd);
 }
@@ -106,14 +106,17 @@ void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx) {
 }
 
 
-void VisionBuf::sync(int dir) {
+void VisionBuf::sync(int dir, size_t offset, size_t length) {
   int err;
+  assert(offset + length <= this->len);
+  if (length == 0) return;
 
+  // the lines the range only partly covers are maintained whole
   struct ion_flush_data flush_data = {0};
   flush_data.handle = this->handle;
   flush_data.vaddr = this->addr;
-  flush_data.offset = 0;
-  flush_data.length = this->len;
+  flush_data.offset = offset;
+  flush_data.length = length;
 
   // ION_IOC_INV_CACHES ~= DMA_FROM_DEVICE
   // ION_IOC_CLEAN_CACHES ~= DMA_TO_DEVICE
@@ -128,6 +131,7 @@ void VisionBuf::sync(int dir) {
   custom_data.arg = (unsigned long)&flush_data;
   err = ioctl(ion_fd, ION_IOC_CUSTOM, &custom_data);
   assert(err == 0);
+  this->sync_bytes += length;
 }
 
 void VisionBuf::free() {
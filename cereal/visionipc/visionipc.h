@@ -1,18 +1,53 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
+#include <time.h>
 
 constexpr int VISIONIPC_MAX_FDS = 64;
 
+// Buffer leases, one bit per client. The top bit is held by the server while it writes a buffer
+constexpr int VISIONIPC_MAX_CLIENTS = 63;
+constexpr uint64_t VISIONIPC_LEASE_WRITER = 1ULL << VISIONIPC_MAX_CLIENTS;
+
 struct VisionIpcBufExtra {
   uint32_t frame_id;
   uint64_t timestamp_sof;
   uint64_t timestamp_eof;
+  // stamped by the server in send and by the client when it takes the buffer
+  uint64_t timestamp_sent;
+  uint64_t timestamp_received;
 };
 
+// the clock of the timestamps, nanos_since_boot in selfdrive
+static inline uint64_t visionipc_boottime_ns(){
+  struct timespec t;
+#ifdef __APPLE__
+  clock_gettime(CLOCK_MONOTONIC, &t);
+#else
+  clock_gettime(CLOCK_BOOTTIME, &t);
+#endif
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
 struct VisionIpcPacket {
   uint64_t server_id;
   size_t idx;
+  uint64_t generation;
   struct VisionIpcBufExtra extra;
 };
+
+struct VisionIpcBufState {
+  std::atomic<uint64_t> leases;
+  std::atomic<uint64_t> generation; // incremented every time the server reuses the buffer
+  std::atomic<uint64_t> ready;      // generation whose contents are complete, lags behind while a fence is pending
+};
+
+// Shared between the server and all clients of one stream, passed as the last fd on connect
+struct VisionIpcStreamState {
+  std::atomic<int32_t> clients[VISIONIPC_MAX_CLIENTS]; // pid owning each lease bit
+  std::atomic<uint64_t> skipped;     // buffers skipped by the server because a client still held them
+  std::atomic<uint64_t> overwritten; // buffers reused while a client still held them
+  VisionIpcBufState bufs[VISIONIPC_MAX_FDS];
+};
@@ -0,0 +1,48 @@
+# distutils: language = c++
+#cython: language_level=3
+
+from libcpp.string cimport string
+from libcpp cimport bool
+from libc.stdint cimport uint32_t, uint64_t
+
+
+cdef extern from "visionbuf.h":
+  enum VisionStreamType:
+    VISION_STREAM_RGB_BACK
+    VISION_STREAM_RGB_FRONT
+    VISION_STREAM_RGB_WIDE
+    VISION_STREAM_YUV_BACK
+    VISION_STREAM_YUV_FRONT
+    VISION_STREAM_YUV_WIDE
+
+  cdef struct VisionBufPlane:
+    size_t offset
+    size_t stride
+    size_t rows
+
+  cdef cppclass VisionBuf:
+    void * addr
+    size_t len
+    size_t width
+    size_t height
+    size_t stride
+    size_t idx
+    VisionBufPlane plane(size_t)
+
+
+cdef extern from "visionipc.h":
+  struct VisionIpcBufExtra:
+    uint32_t frame_id
+    uint64_t timestamp_sof
+    uint64_t timestamp_eof
+    uint64_t timestamp_sent
+    uint64_t timestamp_received
+
+
+cdef extern from "visionipc_server.h":
+  cdef cppclass VisionIpcServer:
+    VisionIpcServer(string)
+    void create_buffers(VisionStreamType, size_t, bool, size_t, size_t)
+    VisionBuf * get_buffer(VisionStreamType)
+    void send(VisionBuf *, VisionIpcBufExtra *, bool) nogil
+    void start_listener()
@@ -1,31 +1,55 @@
+#include <algorithm>
 #include <chrono>
 #include <cassert>
+#include <deque>
+#include <cstring>
 #include <iostream>
 #include <thread>
 
+#include <sys/mman.h>
+#include <time.h>
+
 #include "ipc.h"
 #include "visionipc_client.h"
 #include "visionipc_server.h"
 
-VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id, cl_context ctx) : name(name), type(type), device_id(device_id), ctx(ctx) {
+VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id, cl_context ctx)
+  : VisionIpcClient(name, visionipc_stream_name(type), conflate, device_id, ctx) {}
+
+VisionIpcClient::VisionIpcClient(std::string name, std::string stream, bool conflate, cl_device_id device_id, cl_context ctx) : name(name), stream(stream), device_id(device_id), ctx(ctx) {
+  assert(stream.size() < VISIONIPC_MAX_STREAM_NAME);
   msg_ctx = Context::create();
-  sock = SubSocket::create(msg_ctx, get_endpoint_name(name, type), "127.0.0.1", conflate, false);
+  sock = SubSocket::create(msg_ctx, get_endpoint_name(name, stream), "127.0.0.1", conflate, false);
 
   poller = Poller::create();
   poller->registerSocket(sock);
 }
 
-// Connect is not thread safe. Do not use the buffers while calling connect
-bool VisionIpcClient::connect(bool blocking){
-  connected = false;
+void VisionIpcClient::disconnect(){
+  release();
+  for (size_t i = 0; i < num_buffers; i++){
+    release(&buffers[i]);
+  }
+
+  if (state){
+    if (client_slot >= 0){
+      state->clients[client_slot] = 0;
+      client_slot = -1;
+    }
+    munmap(state, sizeof(VisionIpcStreamState));
+    close(state_fd);
+    state = nullptr;
+  }
 
-  // Cleanup old buffers on reconnect
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i].free();
   }
   num_buffers = 0;
+}
 
-  // Connect to server socket and ask for all FDs of type
+// Asks the server for the buffers of the stream from first_buf on, followed by the lease state fd.
+// Returns the number of fds, 0 when the server isn't there or doesn't have the stream (yet)
+int VisionIpcClient::request_buffers(uint32_t first_buf, VisionBuf *bufs, int *fds, bool blocking){
   std::string path = "/tmp/visionipc_" + name;
 
   int socket_fd = -1;
@@ -37,83 +61,344 @@ bool VisionIpcClient::connect(bool blocking){
         std::cout << "VisionIpcClient connecting" << std::endl;
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
       } else {
-        return false;
+        return 0;
       }
     }
   }
 
-  // Send stream type to server to request FDs
-  int r = ipc_sendrecv_with_fds(true, socket_fd, &type, sizeof(type), nullptr, 0, nullptr);
-  assert(r == sizeof(type));
+  VisionIpcRequest request = {};
+  strncpy(request.stream, stream.c_str(), sizeof(request.stream) - 1);
+  request.first_buf = first_buf;
+  int r = ipc_sendrecv_with_fds(true, socket_fd, &request, sizeof(request), nullptr, 0, nullptr);
+  assert(r == sizeof(request));
+
+  int num_fds = 0;
+  r = ipc_sendrecv_with_fds(false, socket_fd, bufs, sizeof(VisionBuf) * VISIONIPC_MAX_FDS, fds, VISIONIPC_MAX_FDS, &num_fds);
+  close(socket_fd);
+
+  // The server hangs up when the stream doesn't exist (yet)
+  if (r <= 0 || num_fds < 2){
+    for (int i = 0; i < num_fds; i++){
+      close(fds[i]);
+    }
+    return 0;
+  }
+  assert(r == sizeof(VisionBuf) * (num_fds - 1));
+  return num_fds;
+}
+
+void VisionIpcClient::import_buffers(const VisionBuf *bufs, const int *fds, int first, int n){
+  for (int i = 0; i < n; i++){
+    VisionBuf &buf = buffers[first + i];
+    buf = bufs[i];
+    buf.fd = fds[i];
+    buf.sync_bytes = 0;
+    buf.import();
+    buf.init(buf.format, buf.width, buf.height, buf.stride, buf.planes);
+
+    if (device_id) buf.init_cl(device_id, ctx);
+  }
+}
+
+// Connect is not thread safe. Do not use the buffers while calling connect
+bool VisionIpcClient::connect(bool blocking){
+  connected = false;
+
+  // Cleanup old buffers on reconnect
+  disconnect();
+  have_frame_id = false;
 
-  // Get FDs
   int fds[VISIONIPC_MAX_FDS];
   VisionBuf bufs[VISIONIPC_MAX_FDS];
-  r = ipc_sendrecv_with_fds(false, socket_fd, &bufs, sizeof(bufs), fds, VISIONIPC_MAX_FDS, &num_buffers);
+  int num_fds = 0;
+  while ((num_fds = request_buffers(0, bufs, fds, blocking)) == 0){
+    if (!blocking) return false;
+    std::cout << "VisionIpcClient waiting for stream " << stream << std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
 
+  // The last fd holds the lease state
+  num_buffers = num_fds - 1;
   assert(num_buffers > 0);
-  assert(r == sizeof(VisionBuf) * num_buffers);
 
-  // Import buffers
-  for (size_t i = 0; i < num_buffers; i++){
-    buffers[i] = bufs[i];
-    buffers[i].fd = fds[i];
-    buffers[i].import();
-    if (buffers[i].rgb) {
-      buffers[i].init_rgb(buffers[i].width, buffers[i].height, buffers[i].stride);
-    } else {
-      buffers[i].init_yuv(buffers[i].width, buffers[i].height);
-    }
+  state_fd = fds[num_buffers];
+  state = (VisionIpcStreamState *)mmap(NULL, sizeof(VisionIpcStreamState), PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+  assert(state != MAP_FAILED);
 
-    if (device_id) buffers[i].init_cl(device_id, ctx);
+  // Without a free slot this client reads unleased, like before
+  for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+    int32_t expected = 0;
+    if (state->clients[i].compare_exchange_strong(expected, getpid())){
+      client_slot = i;
+      break;
+    }
   }
+  if (client_slot < 0){
+    std::cout << "VisionIpcClient no free lease slot" << std::endl;
+  }
+
+  import_buffers(bufs, fds, 0, num_buffers);
 
   connected = true;
   return true;
 }
 
-VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms){
-  auto p = poller->poll(timeout_ms);
+// The stream grew, the buffers it has stay where they are so held ones are still valid
+bool VisionIpcClient::add_buffers(){
+  int fds[VISIONIPC_MAX_FDS];
+  VisionBuf bufs[VISIONIPC_MAX_FDS];
+  int num_fds = request_buffers(num_buffers, bufs, fds, false);
+  if (num_fds == 0) return false;
 
-  if (!p.size()){
-    return nullptr;
+  // the lease state is the one this client has mapped already
+  close(fds[num_fds - 1]);
+  int n = std::min(num_fds - 1, VISIONIPC_MAX_FDS - 1 - num_buffers);
+  import_buffers(bufs, fds, num_buffers, n);
+  for (int i = n; i < num_fds - 1; i++){
+    close(fds[i]);
   }
+  num_buffers += n;
+  return true;
+}
 
+// Non blocking, also keeps track of gaps in the frame ids
+bool VisionIpcClient::next_packet(VisionIpcPacket *packet){
   Message * r = sock->receive(true);
   if (r == nullptr){
-    return nullptr;
+    return false;
   }
 
-  // Get buffer
   assert(r->getSize() == sizeof(VisionIpcPacket));
-  VisionIpcPacket *packet = (VisionIpcPacket*)r->getData();
-
-  assert(packet->idx < num_buffers);
-  VisionBuf * buf = &buffers[packet->idx];
+  *packet = *(VisionIpcPacket*)r->getData();
+  delete r;
 
-  if (buf->server_id != packet->server_id){
+  if (packet->idx >= num_buffers && (!add_buffers() || packet->idx >= num_buffers)){
+    return false;
+  }
+  if (buffers[packet->idx].server_id != packet->server_id){
     connected = false;
-    delete r;
+    return false;
+  }
+
+  uint32_t frame_id = packet->extra.frame_id;
+  if (have_frame_id && frame_id > last_frame_id + 1){
+    stats.gaps += frame_id - last_frame_id - 1;
+  }
+  have_frame_id = true;
+  last_frame_id = frame_id;
+  return true;
+}
+
+VisionBuf * VisionIpcClient::take(const VisionIpcPacket &packet, VisionIpcBufExtra *extra, const int timeout_ms, bool wait_ready){
+  VisionBuf * buf = &buffers[packet.idx];
+
+  if (!lease(buf, packet.generation)){
+    stats.dropped++;
     return nullptr;
   }
 
   if (extra) {
-    *extra = packet->extra;
+    *extra = packet.extra;
+    extra->timestamp_received = visionipc_boottime_ns();
   }
 
-  buf->sync(VISIONBUF_SYNC_TO_DEVICE);
-  delete r;
+  received_generation[buf->idx] = packet.generation;
+
+  if (wait_ready && !wait(buf, timeout_ms)){
+    stats.dropped++;
+    return nullptr;
+  }
+
+  stats.received++;
+  if (packet.extra.timestamp_eof){
+    stats.latency_ms = (double)(int64_t)(visionipc_boottime_ns() - packet.extra.timestamp_eof) / 1e6;
+    stats.max_latency_ms = std::max(stats.max_latency_ms, stats.latency_ms);
+  }
   return buf;
 }
 
+VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms, bool wait_ready){
+  auto p = poller->poll(timeout_ms);
 
+  if (!p.size()){
+    return nullptr;
+  }
 
-VisionIpcClient::~VisionIpcClient(){
-  for (size_t i = 0; i < num_buffers; i++){
-    buffers[i].free();
+  VisionIpcPacket packet;
+  if (!next_packet(&packet)){
+    return nullptr;
   }
 
+  release();
+  return take(packet, extra, timeout_ms, wait_ready);
+}
+
+VisionBuf * VisionIpcClient::recv_latest(VisionIpcBufExtra * extra, const int timeout_ms, bool wait_ready){
+  if (timeout_ms > 0 && !poller->poll(timeout_ms).size()){
+    return nullptr;
+  }
+
+  VisionIpcPacket packet, next;
+  int count = 0;
+  while (next_packet(&next)){
+    packet = next;
+    count++;
+  }
+  if (count == 0){
+    return nullptr;
+  }
+
+  stats.conflated += count - 1;
+  release();
+  return take(packet, extra, 100, wait_ready);
+}
+
+int VisionIpcClient::recv_batch(VisionBuf ** bufs, VisionIpcBufExtra * extras, int max_frames){
+  assert(max_frames > 0);
+  std::deque<VisionIpcPacket> packets;
+  VisionIpcPacket packet;
+  while (next_packet(&packet)){
+    packets.push_back(packet);
+    if ((int)packets.size() > max_frames){
+      packets.pop_front();
+      stats.conflated++;
+    }
+  }
+
+  release();
+  int n = 0;
+  for (auto &p : packets){
+    VisionBuf * buf = take(p, extras ? &extras[n] : nullptr, 100, true);
+    if (buf != nullptr){
+      bufs[n++] = buf;
+    }
+  }
+  return n;
+}
+
+bool VisionIpcClient::wait(VisionBuf * buf, const int timeout_ms){
+  if (!visionipc_wait_ready(&state->bufs[buf->idx], received_generation[buf->idx], timeout_ms)){
+    return false;
+  }
+
+  if (!lazy_sync) buf->sync(VISIONBUF_SYNC_TO_DEVICE);
+  return true;
+}
+
+uint64_t VisionIpcClient::sync_bytes() const {
+  uint64_t bytes = 0;
+  for (int i = 0; i < num_buffers; i++){
+    bytes += buffers[i].sync_bytes;
+  }
+  return bytes;
+}
+
+bool VisionIpcClient::lease(VisionBuf *buf, uint64_t generation){
+  if (client_slot < 0) return true;
+  if (leased[buf->idx] || held[buf->idx]) return false;
+
+  // The server won't pick a leased buffer, so after taking the lease it only has to be unchanged
+  VisionIpcBufState &buf_state = state->bufs[buf->idx];
+  uint64_t old = buf_state.leases.fetch_or(1ULL << client_slot);
+  if ((old & VISIONIPC_LEASE_WRITER) || buf_state.generation != generation){
+    buf_state.leases &= ~(1ULL << client_slot);
+    return false;
+  }
+
+  leased[buf->idx] = true;
+  return true;
+}
+
+bool VisionIpcClient::release(){
+  if (client_slot < 0) return true;
+
+  bool intact = true;
+  for (int i = 0; i < num_buffers; i++){
+    if (!leased[i]) continue;
+
+    VisionIpcBufState &buf_state = state->bufs[i];
+    if (buf_state.generation != received_generation[i]){
+      stats.overwritten++;
+      intact = false;
+    }
+    buf_state.leases &= ~(1ULL << client_slot);
+    leased[i] = false;
+  }
+  return intact;
+}
+
+void VisionIpcClient::hold(VisionBuf * buf){
+  if (client_slot < 0 || !leased[buf->idx]) return;
+
+  held[buf->idx] = true;
+  leased[buf->idx] = false;
+}
+
+bool VisionIpcClient::release(VisionBuf * buf){
+  if (client_slot < 0 || !held[buf->idx].exchange(false)) return true;
+
+  // The server doesn't reuse it while it's held, so nothing else touches received_generation. Not
+  // counted in stats, which belong to the receiving thread, the server counts its overwrites itself
+  VisionIpcBufState &buf_state = state->bufs[buf->idx];
+  bool intact = buf_state.generation == received_generation[buf->idx];
+  buf_state.leases &= ~(1ULL << client_slot);
+  return intact;
+}
+
+VisionIpcClient::~VisionIpcClient(){
+  disconnect();
+
   delete sock;
   delete poller;
   delete msg_ctx;
 }
+
+VisionIpcSyncClient::VisionIpcSyncClient(std::string name, const std::vector<VisionStreamType> &types, uint64_t tolerance_ns, cl_device_id device_id, cl_context ctx) : tolerance_ns(tolerance_ns){
+  for (auto type : types){
+    clients.push_back(std::make_unique<VisionIpcClient>(name, type, false, device_id, ctx));
+  }
+}
+
+bool VisionIpcSyncClient::connect(bool blocking){
+  for (auto &client : clients){
+    if (!client->connected && !client->connect(blocking)) return false;
+  }
+  return true;
+}
+
+bool VisionIpcSyncClient::recv(VisionBuf ** bufs, VisionIpcBufExtra * extras, const int timeout_ms){
+  auto glass = [](const VisionIpcBufExtra &e){ return e.timestamp_sof ? e.timestamp_sof : e.timestamp_eof; };
+  const uint64_t deadline = visionipc_boottime_ns() + timeout_ms * 1000000ULL;
+  std::vector<bool> have(clients.size(), false);
+
+  while (true){
+    for (size_t i = 0; i < clients.size(); i++){
+      while (!have[i]){
+        const uint64_t now = visionipc_boottime_ns();
+        if (now >= deadline) return false;
+        bufs[i] = clients[i]->recv(&extras[i], std::max<int>((deadline - now) / 1000000, 1));
+        have[i] = bufs[i] != nullptr;
+      }
+    }
+
+    uint64_t newest = 0, oldest = UINT64_MAX;
+    for (size_t i = 0; i < clients.size(); i++){
+      newest = std::max(newest, glass(extras[i]));
+      oldest = std::min(oldest, glass(extras[i]));
+    }
+    if (newest - oldest <= tolerance_ns) return true;
+
+    // the streams behind the newest frame move on to their next one
+    for (size_t i = 0; i < clients.size(); i++){
+      if (newest - glass(extras[i]) > tolerance_ns) have[i] = false;
+    }
+  }
+}
+
+bool VisionIpcSyncClient::release(){
+  bool intact = true;
+  for (auto &client : clients){
+    intact &= client->release();
+  }
+  return intact;
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <string>
 #include <unistd.h>
@@ -7,6 +9,20 @@
 #include "visionipc.h"
 #include "visionbuf.h"
 
+struct VisionIpcClientStats {
+  uint64_t received = 0;    // frames handed to the caller
+  uint64_t conflated = 0;   // frames passed over for a newer one by recv_latest and recv_batch
+  uint64_t gaps = 0;        // frame ids that never arrived, the server or msgq dropped them
+  uint64_t dropped = 0;     // frames that were already reused by the server when received
+  uint64_t overwritten = 0; // frames that were reused while this client held them
+  double latency_ms = 0;    // timestamp_eof to recv of the last frame
+  double max_latency_ms = 0;
+
+  uint64_t torn() const { return dropped + overwritten; }
+  // Every frame the caller didn't get to see intact
+  uint64_t missed() const { return conflated + gaps + torn(); }
+};
+
 class VisionIpcClient {
 private:
   std::string name;
@@ -14,19 +30,74 @@ private:
   SubSocket * sock;
   Poller * poller;
 
-  VisionStreamType type;
+  std::string stream;
 
   cl_device_id device_id = nullptr;
   cl_context ctx = nullptr;
 
+  VisionIpcStreamState *state = nullptr;
+  int state_fd = -1;
+  int client_slot = -1;
+  bool leased[VISIONIPC_MAX_FDS] = {};
+  // leases kept past the next recv by hold, given back by release(buf) from any thread
+  std::atomic<bool> held[VISIONIPC_MAX_FDS] = {};
+  uint64_t received_generation[VISIONIPC_MAX_FDS] = {};
+
+  bool have_frame_id = false;
+  uint32_t last_frame_id = 0;
+
   void init_msgq(bool conflate);
+  int request_buffers(uint32_t first_buf, VisionBuf *bufs, int *fds, bool blocking);
+  void import_buffers(const VisionBuf *bufs, const int *fds, int first, int n);
+  bool add_buffers();
+  bool next_packet(VisionIpcPacket *packet);
+  VisionBuf * take(const VisionIpcPacket &packet, VisionIpcBufExtra *extra, const int timeout_ms, bool wait_ready);
+  bool lease(VisionBuf *buf, uint64_t generation);
+  void disconnect();
 
 public:
   bool connected = false;
   int num_buffers = 0;
   VisionBuf buffers[VISIONIPC_MAX_FDS];
+  VisionIpcClientStats stats;
+  // wait leaves the buffer unsynced, for a reader that syncs only the planes or rows it uses with
+  // VisionBuf::sync_plane or sync_rows before handing them to its device
+  bool lazy_sync = false;
   VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
+  VisionIpcClient(std::string name, std::string stream, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcClient();
-  VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
+  // Without wait_ready the buffer may still be written by the GPU, call wait before touching it
+  VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100, bool wait_ready=true);
+  bool wait(VisionBuf * buf, const int timeout_ms=100);
+  // Returns the newest frame that arrived and passes over the ones before it. Only blocks with a timeout
+  VisionBuf * recv_latest(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=0, bool wait_ready=true);
+  // Non blocking, fills in up to max_frames of the newest frames, oldest first. All of them stay leased until the next recv
+  int recv_batch(VisionBuf ** bufs, VisionIpcBufExtra * extras, int max_frames);
+  bool connect(bool blocking=true);
+  // Received buffers stay leased until the next recv or release. Returns false if one was overwritten in the meantime
+  bool release();
+  // Keeps the lease on a received buffer past the next recv, for a reader that's done with it later
+  // like a hardware encoder. Don't connect while buffers are held
+  void hold(VisionBuf * buf);
+  // Gives back a held buffer, thread safe. False if it was overwritten in the meantime
+  bool release(VisionBuf * buf);
+  // bytes this client synced, over all its buffers
+  uint64_t sync_bytes() const;
+};
+
+// Receives one frame of every stream, the ones taken together. Frames are matched by timestamp_sof,
+// or timestamp_eof where the camera has no sof, within tolerance_ns of each other
+class VisionIpcSyncClient {
+private:
+  uint64_t tolerance_ns;
+
+public:
+  std::vector<std::unique_ptr<VisionIpcClient>> clients;
+  VisionIpcSyncClient(std::string name, const std::vector<VisionStreamType> &types, uint64_t tolerance_ns, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   bool connect(bool blocking=true);
+  // Fills bufs and extras in the order of types. Frames without a match in the other streams are
+  // passed over, false if no full set came within timeout_ms. The set stays leased until the next recv
+  bool recv(VisionBuf ** bufs, VisionIpcBufExtra * extras, const int timeout_ms=100);
+  // False if any buffer of the set was overwritten while it was held
+  bool release();
 };
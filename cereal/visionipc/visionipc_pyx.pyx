@@ -0,0 +1,83 @@
+# distutils: language = c++
+# cython: c_string_encoding=ascii, language_level=3
+
+from libcpp.string cimport string
+from libcpp cimport bool
+from libc.stdint cimport uint8_t, uint32_t, uint64_t
+
+from . cimport visionipc as cpp
+from .visionipc cimport VisionIpcServer as cppVisionIpcServer
+from .visionipc cimport VisionBuf as cppVisionBuf
+from .visionipc cimport VisionIpcBufExtra
+
+
+class VisionStreamType:
+  VISION_STREAM_RGB_BACK = cpp.VISION_STREAM_RGB_BACK
+  VISION_STREAM_RGB_FRONT = cpp.VISION_STREAM_RGB_FRONT
+  VISION_STREAM_RGB_WIDE = cpp.VISION_STREAM_RGB_WIDE
+  VISION_STREAM_YUV_BACK = cpp.VISION_STREAM_YUV_BACK
+  VISION_STREAM_YUV_FRONT = cpp.VISION_STREAM_YUV_FRONT
+  VISION_STREAM_YUV_WIDE = cpp.VISION_STREAM_YUV_WIDE
+
+
+cdef class VisionBuf:
+  cdef cppVisionBuf * buf
+  # the server owns the buffer
+  cdef object server
+
+  @property
+  def data(self):
+    # writable without a copy, np.asarray(buf.data) to fill it from numpy
+    return <uint8_t[:self.buf.len]>(<uint8_t *>self.buf.addr)
+
+  @property
+  def width(self):
+    return self.buf.width
+
+  @property
+  def height(self):
+    return self.buf.height
+
+  @property
+  def stride(self):
+    return self.buf.stride
+
+  @property
+  def idx(self):
+    return self.buf.idx
+
+  def plane(self, size_t i):
+    # offset, stride and rows, 0 is the Y plane or the whole rgb image
+    p = self.buf.plane(i)
+    return p.offset, p.stride, p.rows
+
+
+cdef class VisionIpcServer:
+  cdef cppVisionIpcServer * server
+
+  def __init__(self, string name):
+    self.server = new cppVisionIpcServer(name)
+
+  def __dealloc__(self):
+    del self.server
+
+  def create_buffers(self, int tp, size_t num_buffers, bool rgb, size_t width, size_t height):
+    self.server.create_buffers(<cpp.VisionStreamType>tp, num_buffers, rgb, width, height)
+
+  def start_listener(self):
+    self.server.start_listener()
+
+  def get_buffer(self, int tp):
+    # the next free buffer of the stream, fill it and pass it to send
+    buf = VisionBuf()
+    buf.buf = self.server.get_buffer(<cpp.VisionStreamType>tp)
+    buf.server = self
+    return buf
+
+  def send(self, VisionBuf buf, uint32_t frame_id=0, uint64_t timestamp_sof=0, uint64_t timestamp_eof=0):
+    cdef VisionIpcBufExtra extra
+    extra.frame_id = frame_id
+    extra.timestamp_sof = timestamp_sof
+    extra.timestamp_eof = timestamp_eof
+    with nogil:
+      self.server.send(buf.buf, &extra, True)
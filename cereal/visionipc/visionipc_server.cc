@@ -1,9 +1,15 @@
+#include <algorithm>
 #include <iostream>
 #include <chrono>
+#include <cstring>
 #include <cassert>
 #include <random>
+#include <thread>
 
+#include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -11,12 +17,60 @@
 #include "ipc.h"
 #include "visionipc_server.h"
 
-std::string get_endpoint_name(std::string name, VisionStreamType type){
+std::string get_endpoint_name(std::string name, std::string stream){
   if (messaging_use_zmq()){
+    // Only the builtin streams have a fixed port
     assert(name == "camerad");
+    VisionStreamType type = visionipc_stream_type(stream.c_str());
+    assert(type != VISION_STREAM_MAX);
     return std::to_string(9000 + static_cast<int>(type));
   } else {
-    return "visionipc_" + name + "_" + std::to_string(type);
+    return "visionipc_" + name + "_" + stream;
+  }
+}
+
+bool visionipc_wait_ready(VisionIpcBufState *buf_state, uint64_t generation, int timeout_ms){
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (buf_state->ready != generation){
+    if (buf_state->generation != generation) return false;
+    if (std::chrono::steady_clock::now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  return true;
+}
+
+static VisionIpcStreamState * create_stream_state(int *fd){
+  char full_path[0x100];
+  static std::atomic<int> offset = 0;
+
+#ifdef __APPLE__
+  snprintf(full_path, sizeof(full_path)-1, "/tmp/visionipc_state_%d_%d", getpid(), offset++);
+#else
+  snprintf(full_path, sizeof(full_path)-1, "/dev/shm/visionipc_state_%d_%d", getpid(), offset++);
+#endif
+
+  *fd = open(full_path, O_RDWR | O_CREAT, 0777);
+  assert(*fd >= 0);
+  unlink(full_path);
+
+  // Zero filled, which is a valid initial state
+  int err = ftruncate(*fd, sizeof(VisionIpcStreamState));
+  assert(err == 0);
+  void *addr = mmap(NULL, sizeof(VisionIpcStreamState), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  assert(addr != MAP_FAILED);
+  return (VisionIpcStreamState *)addr;
+}
+
+// Drop the leases of clients that exited without releasing them
+static void release_dead_clients(VisionIpcStreamState *state){
+  for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+    int32_t pid = state->clients[i];
+    if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) continue;
+
+    for (auto &b : state->bufs){
+      b.leases &= ~(1ULL << i);
+    }
+    state->clients[i].compare_exchange_strong(pid, 0);
   }
 }
 
@@ -28,42 +82,55 @@ VisionIpcServer::VisionIpcServer(std::string name, cl_device_id device_id, cl_co
   server_id = distribution(rd);
 }
 
-void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height){
-  // TODO: assert that this type is not created yet
-  assert(num_buffers < VISIONIPC_MAX_FDS);
+void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height, size_t max_buffers){
+  create_buffers(visionipc_stream_name(type), num_buffers, rgb ? VISIONBUF_FORMAT_RGB : VISIONBUF_FORMAT_I420, width, height, 1, max_buffers);
+}
+
+VisionBuf * VisionIpcServer::allocate_buffer(const std::string &stream, const StreamConfig &config, size_t idx){
+  VisionBuf* buf = new VisionBuf();
+  buf->allocate(config.size);
+  buf->idx = idx;
+  strncpy(buf->stream, stream.c_str(), sizeof(buf->stream) - 1);
+
+  if (device_id) buf->init_cl(device_id, ctx);
+
+  buf->init(config.format, config.width, config.height, config.stride, config.planes);
+  return buf;
+}
+
+void VisionIpcServer::create_buffers(const std::string &stream, size_t num_buffers, VisionBufFormat format, size_t width, size_t height, size_t planes, size_t max_buffers){
+  max_buffers = std::max(num_buffers, max_buffers);
+  // one fd of a connect goes to the lease state
+  assert(max_buffers < VISIONIPC_MAX_FDS);
+  assert(stream.size() < VISIONIPC_MAX_STREAM_NAME);
   int aligned_w = 0, aligned_h = 0;
 
   size_t size = 0;
   size_t stride = 0; // Only used for RGB
 
-  if (rgb) {
+  if (format == VISIONBUF_FORMAT_RGB) {
     visionbuf_compute_aligned_width_and_height(width, height, &aligned_w, &aligned_h);
-    size = (size_t)aligned_w * (size_t)aligned_h * 3;
     stride = aligned_w * 3;
+    size = visionbuf_size(format, width, aligned_h, stride);
   } else {
-    size = width * height * 3 / 2;
+    size = visionbuf_size(format, width, height, stride, planes);
   }
 
-
-  // Create map + alloc requested buffers
+  const StreamConfig config = {format, width, height, stride, planes, size, max_buffers};
+  std::vector<VisionBuf*> bufs;
   for (size_t i = 0; i < num_buffers; i++){
-    VisionBuf* buf = new VisionBuf();
-    buf->allocate(size);
-    buf->idx = i;
-    buf->type = type;
-
-    if (device_id) buf->init_cl(device_id, ctx);
-
-    rgb ? buf->init_rgb(width, height, stride) : buf->init_yuv(width, height);
-
-    buffers[type].push_back(buf);
+    bufs.push_back(allocate_buffer(stream, config, i));
   }
 
-  cur_idx[type] = 0;
+  std::lock_guard<std::mutex> lk(streams_lock);
+  assert(buffers.count(stream) == 0);
+  buffers[stream] = bufs;
+  configs[stream] = config;
+  cur_idx[stream] = 0;
+  states[stream] = create_stream_state(&state_fds[stream]);
 
-  // Create msgq publisher for each of the `name` + type combos
-  // TODO: compute port number directly if using zmq
-  sockets[type] = PubSocket::create(msg_ctx, get_endpoint_name(name, type), false);
+  // Create msgq publisher for each of the `name` + stream combos
+  sockets[stream] = PubSocket::create(msg_ctx, get_endpoint_name(name, stream), false);
 }
 
 
@@ -101,22 +168,30 @@ void VisionIpcServer::listener(){
     int fd = accept(sock, NULL, NULL);
     assert(fd >= 0);
 
-    VisionStreamType type = VisionStreamType::VISION_STREAM_MAX;
-    int r = ipc_sendrecv_with_fds(false, fd, &type, sizeof(type), nullptr, 0, nullptr);
-    assert(r == sizeof(type));
-    if (buffers.count(type) <= 0) {
-      std::cout << "got request for invalid buffer type: " << type << std::endl;
+    VisionIpcRequest request = {};
+    int r = ipc_sendrecv_with_fds(false, fd, &request, sizeof(request), nullptr, 0, nullptr);
+    assert(r == sizeof(request));
+    request.stream[sizeof(request.stream) - 1] = '\0';
+    const std::string stream = request.stream;
+
+    std::unique_lock<std::mutex> lk(streams_lock);
+    if (buffers.count(stream) <= 0) {
+      lk.unlock();
+      std::cout << "got request for invalid stream: " << stream << std::endl;
       close(fd);
       continue;
     }
 
+    // The buffers carry the stream format, so clients need no knowledge of the stream up front
     int fds[VISIONIPC_MAX_FDS];
-    int num_fds = buffers[type].size();
+    const auto &stream_bufs = buffers[stream];
+    int first = std::min<size_t>(request.first_buf, stream_bufs.size());
+    int num_fds = stream_bufs.size() - first;
     VisionBuf bufs[VISIONIPC_MAX_FDS];
 
     for (int i = 0; i < num_fds; i++){
-      fds[i] = buffers[type][i]->fd;
-      bufs[i] = *buffers[type][i];
+      fds[i] = stream_bufs[first + i]->fd;
+      bufs[i] = *stream_bufs[first + i];
 
       // Remove some private openCL/ion metadata
       bufs[i].buf_cl = 0;
@@ -127,7 +202,11 @@ void VisionIpcServer::listener(){
       bufs[i].server_id = server_id;
     }
 
-    r = ipc_sendrecv_with_fds(true, fd, &bufs, sizeof(VisionBuf) * num_fds, fds, num_fds, nullptr);
+    // The lease state goes along as the last fd
+    fds[num_fds] = state_fds[stream];
+    lk.unlock();
+
+    r = ipc_sendrecv_with_fds(true, fd, &bufs, sizeof(VisionBuf) * num_fds, fds, num_fds + 1, nullptr);
 
     close(fd);
   }
@@ -139,40 +218,214 @@ void VisionIpcServer::listener(){
 
 
 VisionBuf * VisionIpcServer::get_buffer(VisionStreamType type){
-  // Do we want to keep track if the buffer has been sent out yet and warn user?
-  assert(buffers.count(type));
-  auto b = buffers[type];
-  return b[cur_idx[type]++ % b.size()];
+  return get_buffer(visionipc_stream_name(type));
+}
+
+VisionBuf * VisionIpcServer::get_buffer(const std::string &stream){
+  std::unique_lock<std::mutex> lk(streams_lock);
+  assert(buffers.count(stream));
+  // only the producer of a stream adds to its buffers
+  auto &b = buffers[stream];
+  const StreamConfig &config = configs[stream];
+  std::atomic<size_t> &idx = cur_idx[stream];
+  VisionIpcStreamState *state = states[stream];
+  lk.unlock();
+
+  // Take the next buffer that no client holds a lease on
+  for (int attempt = 0; attempt < 2; attempt++){
+    for (size_t i = 0; i < b.size(); i++){
+      VisionBuf *buf = b[idx++ % b.size()];
+      VisionIpcBufState &buf_state = state->bufs[buf->idx];
+
+      uint64_t leases = buf_state.leases;
+      if ((leases & ~VISIONIPC_LEASE_WRITER) == 0 && buf_state.leases.compare_exchange_strong(leases, VISIONIPC_LEASE_WRITER)){
+        buf_state.generation++;
+        return buf;
+      }
+      state->skipped++;
+    }
+    release_dead_clients(state);
+  }
+
+  // Every buffer is in use, the stream grows while it can
+  if (b.size() < config.max_buffers){
+    VisionBuf *buf = allocate_buffer(stream, config, b.size());
+    state->bufs[buf->idx].leases = VISIONIPC_LEASE_WRITER;
+    state->bufs[buf->idx].generation++;
+    lk.lock();
+    b.push_back(buf);
+    lk.unlock();
+    std::cout << "visionipc " << stream << " grew to " << b.size() << " buffers" << std::endl;
+    return buf;
+  }
+
+  // and when it can't the next one is overwritten anyway
+  VisionBuf *buf = b[idx++ % b.size()];
+  state->bufs[buf->idx].leases |= VISIONIPC_LEASE_WRITER;
+  state->bufs[buf->idx].generation++;
+  state->overwritten++;
+  return buf;
 }
 
-void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
-  if (sync) buf->sync(VISIONBUF_SYNC_FROM_DEVICE);
-  assert(buffers.count(buf->type));
-  assert(buf->idx < buffers[buf->type].size());
+VisionIpcBufState * VisionIpcServer::get_buf_state(VisionBuf * buf){
+  std::lock_guard<std::mutex> lk(streams_lock);
+  assert(buffers.count(buf->stream));
+  assert(buf->idx < buffers[buf->stream].size());
+  return &states[buf->stream]->bufs[buf->idx];
+}
+
+void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync, cl_event fence){
+  VisionIpcBufState &buf_state = *get_buf_state(buf);
+
+  if (fence){
+    std::lock_guard<std::mutex> lk(fence_lock);
+    if (!fence_thread.joinable()) fence_thread = std::thread(&VisionIpcServer::fence_waiter, this);
+    fences.push_back({buf, &buf_state, buf_state.generation, fence, sync});
+    fence_cv.notify_one();
+  } else {
+    if (sync) buf->sync(VISIONBUF_SYNC_FROM_DEVICE);
+    buf_state.ready = buf_state.generation.load();
+  }
+
+  std::unique_lock<std::mutex> lk(streams_lock);
+  PubSocket *sock = sockets[buf->stream];
+  lk.unlock();
+
+  // Done writing, clients can take a lease from now on
+  buf_state.leases &= ~VISIONIPC_LEASE_WRITER;
 
   // Send over correct msgq socket
   VisionIpcPacket packet = {0};
   packet.server_id = server_id;
   packet.idx = buf->idx;
+  packet.generation = buf_state.generation;
+  extra->timestamp_sent = visionipc_boottime_ns();
   packet.extra = *extra;
 
-  sockets[buf->type]->send((char*)&packet, sizeof(packet));
+  sock->send((char*)&packet, sizeof(packet));
+}
+
+bool VisionIpcServer::wait(VisionBuf * buf, int timeout_ms){
+  VisionIpcBufState *buf_state = get_buf_state(buf);
+  return visionipc_wait_ready(buf_state, buf_state->generation, timeout_ms);
+}
+
+bool VisionIpcServer::hold(VisionBuf * buf){
+  std::unique_lock<std::mutex> lk(streams_lock);
+  assert(states.count(buf->stream));
+  VisionIpcStreamState *state = states[buf->stream];
+  auto slot = hold_slots.find(buf->stream);
+  if (slot == hold_slots.end()){
+    int free_slot = -1;
+    for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+      int32_t expected = 0;
+      if (state->clients[i].compare_exchange_strong(expected, getpid())){
+        free_slot = i;
+        break;
+      }
+    }
+    if (free_slot < 0) return false;
+    slot = hold_slots.emplace(buf->stream, free_slot).first;
+  }
+  VisionIpcBufState &buf_state = state->bufs[buf->idx];
+  lk.unlock();
+
+  buf_state.leases |= 1ULL << slot->second;
+  return true;
+}
+
+void VisionIpcServer::release(VisionBuf * buf){
+  std::unique_lock<std::mutex> lk(streams_lock);
+  assert(hold_slots.count(buf->stream));
+  uint64_t lease = 1ULL << hold_slots[buf->stream];
+  VisionIpcBufState &buf_state = states[buf->stream]->bufs[buf->idx];
+  lk.unlock();
+
+  buf_state.leases &= ~lease;
+}
+
+void VisionIpcServer::fence_waiter(){
+  std::unique_lock<std::mutex> lk(fence_lock);
+  while (true){
+    fence_cv.wait(lk, [this]{ return should_exit || !fences.empty(); });
+    if (fences.empty()) break;
+
+    VisionIpcFence f = fences.front();
+    fences.pop_front();
+    lk.unlock();
+
+    // Fences are queued in submission order, so waiting on them one by one doesn't delay later ones
+    int err = clWaitForEvents(1, &f.event);
+    assert(err == 0);
+    clReleaseEvent(f.event);
+    if (f.sync) f.buf->sync(VISIONBUF_SYNC_FROM_DEVICE);
+    f.buf_state->ready = f.generation;
+
+    lk.lock();
+  }
+}
+
+uint64_t VisionIpcServer::get_skipped(VisionStreamType type){
+  std::lock_guard<std::mutex> lk(streams_lock);
+  assert(states.count(visionipc_stream_name(type)));
+  return states[visionipc_stream_name(type)]->skipped;
+}
+
+uint64_t VisionIpcServer::get_overwritten(VisionStreamType type){
+  std::lock_guard<std::mutex> lk(streams_lock);
+  assert(states.count(visionipc_stream_name(type)));
+  return states[visionipc_stream_name(type)]->overwritten;
+}
+
+bool VisionIpcServer::has_clients(VisionStreamType type){
+  std::unique_lock<std::mutex> lk(streams_lock);
+  assert(states.count(visionipc_stream_name(type)));
+  VisionIpcStreamState *state = states[visionipc_stream_name(type)];
+  lk.unlock();
+
+  release_dead_clients(state);
+  for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+    if (state->clients[i] != 0) return true;
+  }
+  return false;
+}
+
+std::map<std::string, VisionIpcStreamMemory> VisionIpcServer::memory_usage(){
+  std::lock_guard<std::mutex> lk(streams_lock);
+  std::map<std::string, VisionIpcStreamMemory> usage;
+  for (auto const& [stream, bufs] : buffers) {
+    const StreamConfig &config = configs[stream];
+    uint64_t sync_bytes = 0;
+    for (const VisionBuf *b : bufs) sync_bytes += b->sync_bytes;
+    usage[stream] = {bufs.size(), config.max_buffers, bufs.size() * config.size, sync_bytes};
+  }
+  return usage;
 }
 
 VisionIpcServer::~VisionIpcServer(){
-  should_exit = true;
-  listener_thread.join();
+  {
+    std::lock_guard<std::mutex> lk(fence_lock);
+    should_exit = true;
+  }
+  fence_cv.notify_one();
+  if (fence_thread.joinable()) fence_thread.join();
+  if (listener_thread.joinable()) listener_thread.join();
 
   // VisionBuf cleanup
-  for( auto const& [type, buf] : buffers ) {
+  for( auto const& [stream, buf] : buffers ) {
     for (VisionBuf* b : buf){
       b->free();
       delete b;
     }
   }
 
+  for( auto const& [stream, state] : states ) {
+    munmap(state, sizeof(VisionIpcStreamState));
+    close(state_fds[stream]);
+  }
+
   // Messaging cleanup
-  for( auto const& [type, sock] : sockets ) {
+  for( auto const& [stream, sock] : sockets ) {
     delete sock;
   }
   delete msg_ctx;
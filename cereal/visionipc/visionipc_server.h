@@ -4,12 +4,38 @@
 #include <thread>
 #include <atomic>
 #include <map>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
 
 #include "messaging.hpp"
 #include "visionipc.h"
 #include "visionbuf.h"
 
-std::string get_endpoint_name(std::string name, VisionStreamType type);
+std::string get_endpoint_name(std::string name, std::string stream);
+// Waits until the contents of a buffer generation are complete. Returns false on timeout or when the buffer was reused
+bool visionipc_wait_ready(VisionIpcBufState *buf_state, uint64_t generation, int timeout_ms);
+
+// What a client asks the listener for, the buffers of a stream from first_buf on. A client picks up
+// the buffers a stream grew by without touching the ones it has
+struct VisionIpcRequest {
+  char stream[VISIONIPC_MAX_STREAM_NAME];
+  uint32_t first_buf;
+};
+
+struct VisionIpcStreamMemory {
+  size_t buffers, max_buffers;
+  size_t bytes;  // of the buffers allocated
+  uint64_t sync_bytes;  // synced by the server, read while the fence thread adds to it
+};
+
+struct VisionIpcFence {
+  VisionBuf *buf;
+  VisionIpcBufState *buf_state;
+  uint64_t generation;
+  cl_event event;
+  bool sync;
+};
 
 class VisionIpcServer {
  private:
@@ -21,22 +47,67 @@ class VisionIpcServer {
   std::string name;
   std::thread listener_thread;
 
-  std::map<VisionStreamType, std::atomic<size_t> > cur_idx;
-  std::map<VisionStreamType, std::vector<VisionBuf*> > buffers;
-  std::map<VisionStreamType, std::map<VisionBuf*, size_t> > idxs;
+  // Streams can be created while the listener is running
+  std::mutex streams_lock;
+  std::map<std::string, std::atomic<size_t> > cur_idx;
+  std::map<std::string, std::vector<VisionBuf*> > buffers;
+  // What a stream's buffers are allocated with, for the ones it grows by
+  struct StreamConfig {
+    VisionBufFormat format;
+    size_t width, height, stride, planes;
+    size_t size;
+    size_t max_buffers;
+  };
+  std::map<std::string, StreamConfig> configs;
+  std::map<std::string, std::map<VisionBuf*, size_t> > idxs;
+  std::map<std::string, VisionIpcStreamState*> states;
+  std::map<std::string, int> state_fds;
+  // The client slot hold leases with, per stream
+  std::map<std::string, int> hold_slots;
 
   Context * msg_ctx;
-  std::map<VisionStreamType, PubSocket*> sockets;
+  std::map<std::string, PubSocket*> sockets;
+
+  // Buffers sent ahead of their GPU work, marked ready by the fence thread once it completes
+  std::thread fence_thread;
+  std::mutex fence_lock;
+  std::condition_variable fence_cv;
+  std::deque<VisionIpcFence> fences;
 
   void listener(void);
+  void fence_waiter(void);
+  VisionIpcBufState * get_buf_state(VisionBuf * buf);
+  VisionBuf * allocate_buffer(const std::string &stream, const StreamConfig &config, size_t idx);
 
  public:
   VisionIpcServer(std::string name, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcServer();
 
   VisionBuf * get_buffer(VisionStreamType type);
+  VisionBuf * get_buffer(const std::string &stream);
 
-  void create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height);
-  void send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync=true);
+  // A stream starts with num_buffers. When its clients hold all of them get_buffer allocates another,
+  // up to max_buffers, rather than overwrite a held one. Clients pick the new ones up as they come
+  void create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height, size_t max_buffers=0);
+  // Registers a named stream, the format is passed on to clients when they connect
+  void create_buffers(const std::string &stream, size_t num_buffers, VisionBufFormat format, size_t width, size_t height, size_t planes=1, size_t max_buffers=0);
+  // With a fence the packet goes out right away and clients wait for the event before touching the buffer.
+  // The server takes ownership of the event. Sets extra's timestamp_sent
+  void send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync=true, cl_event fence=nullptr);
+  // Blocks until a buffer passed to send is complete, for readers in the server process
+  bool wait(VisionBuf * buf, int timeout_ms=100);
+  // Leases a sent buffer like a client does, so get_buffer passes over it until release. For
+  // readers in the server process that outlive the frame. False when the stream has no free slot
+  bool hold(VisionBuf * buf);
+  void release(VisionBuf * buf);
   void start_listener();
+
+  // Buffers passed over because a client held them, and buffers reused while still held
+  uint64_t get_skipped(VisionStreamType type);
+  uint64_t get_overwritten(VisionStreamType type);
+  // Whether a live client is connected to the stream, so a producer can skip work nobody reads.
+  // A stream the server holds buffers of counts itself
+  bool has_clients(VisionStreamType type);
+  // The buffers every stream has and their size
+  std::map<std::string, VisionIpcStreamMemory> memory_usage();
 };
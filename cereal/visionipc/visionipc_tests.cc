@@ -1,5 +1,9 @@
 #include <thread>
 #include <chrono>
+#include <vector>
+
+#include <string.h>
+#include <unistd.h>
 
 #include "catch2/catch.hpp"
 #include "visionipc_server.h"
@@ -37,6 +41,46 @@ TEST_CASE("Check buffers"){
   REQUIRE(client.num_buffers == num_buffers);
 }
 
+TEST_CASE("Clients map the server's memory"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+
+  VisionBuf *buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  memset(buf->addr, 0x5a, buf->len);
+  REQUIRE(client.buffers[0].mmap_len >= client.buffers[0].len);
+  REQUIRE(((uint8_t *)client.buffers[0].addr)[client.buffers[0].len - 1] == 0x5a);
+#ifndef __APPLE__
+  // sealed to its size
+  REQUIRE(ftruncate(client.buffers[0].fd, 0) != 0);
+#endif
+}
+
+TEST_CASE("Planes of the formats"){
+  VisionIpcServer server("camerad");
+  server.create_buffers("i420", 1, VISIONBUF_FORMAT_I420, 100, 60);
+  server.create_buffers("nv12", 1, VISIONBUF_FORMAT_NV12, 100, 60);
+  server.create_buffers("float", 1, VISIONBUF_FORMAT_FLOAT, 100, 60, 2);
+
+  VisionBuf *i420 = server.get_buffer("i420");
+  REQUIRE(i420->plane(0).offset == 0);
+  REQUIRE(i420->plane(1).offset == (size_t)(i420->u - i420->y));
+  REQUIRE(i420->plane(2).offset == (size_t)(i420->v - i420->y));
+  REQUIRE(i420->plane(2).offset + i420->plane(2).stride * i420->plane(2).rows == i420->len);
+
+  VisionBuf *nv12 = server.get_buffer("nv12");
+  REQUIRE(nv12->plane(1).offset == (size_t)(nv12->u - nv12->y));
+  REQUIRE(nv12->plane(1).stride == 100);
+  REQUIRE(nv12->plane(1).offset + nv12->plane(1).stride * nv12->plane(1).rows == nv12->len);
+
+  VisionBuf *f = server.get_buffer("float");
+  REQUIRE(f->plane(1).offset == 100 * 60 * sizeof(float));
+  REQUIRE(f->plane(1).offset + f->plane(1).stride * f->plane(1).rows == f->len);
+}
+
 TEST_CASE("Check yuv/rgb"){
   VisionIpcServer server("camerad");
   server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
@@ -133,3 +177,316 @@ TEST_CASE("Test conflate"){
   recv_buf = client.recv(&extra_recv);
   REQUIRE(recv_buf == nullptr);
 }
+
+TEST_CASE("Leased buffers are skipped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(recv_buf->idx == buf->idx);
+
+  // The client still holds the first buffer
+  for (int i = 0; i < 4; i++){
+    VisionBuf * next_buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(next_buf->idx != buf->idx);
+    server.send(next_buf, &extra);
+  }
+  REQUIRE(server.get_skipped(VISION_STREAM_YUV_BACK) > 0);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 0);
+  REQUIRE(client.release());
+}
+
+TEST_CASE("Held buffers are skipped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+  REQUIRE(server.hold(buf));
+
+  for (int i = 0; i < 4; i++){
+    VisionBuf * next_buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(next_buf->idx != buf->idx);
+    server.send(next_buf, &extra);
+  }
+
+  server.release(buf);
+  bool reused = false;
+  for (int i = 0; i < 2; i++){
+    VisionBuf * next_buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    reused |= next_buf->idx == buf->idx;
+    server.send(next_buf, &extra);
+  }
+  REQUIRE(reused);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 0);
+}
+
+TEST_CASE("Buffers held by a client outlive the next recv"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 3, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+  VisionBuf * held_buf = client.recv();
+  REQUIRE(held_buf != nullptr);
+  client.hold(held_buf);
+
+  // Received and given back by the next recv, the held one is passed over all along
+  for (int i = 0; i < 4; i++){
+    VisionBuf * next_buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(next_buf->idx != buf->idx);
+    server.send(next_buf, &extra);
+    REQUIRE(client.recv() != nullptr);
+  }
+  REQUIRE(client.release());
+
+  REQUIRE(client.release(held_buf));
+  bool reused = false;
+  for (int i = 0; i < 3; i++){
+    VisionBuf * next_buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    reused |= next_buf->idx == buf->idx;
+    server.send(next_buf, &extra);
+  }
+  REQUIRE(reused);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 0);
+}
+
+TEST_CASE("Overwritten buffers are counted"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+
+  SECTION("while held"){
+    REQUIRE(client.recv() != nullptr);
+    server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 1);
+    REQUIRE_FALSE(client.release());
+    REQUIRE(client.stats.overwritten == 1);
+  }
+  SECTION("before received"){
+    server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(client.recv() == nullptr);
+    REQUIRE(client.stats.dropped == 1);
+  }
+}
+
+TEST_CASE("Latest and batched recv"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  auto send_frame = [&](uint32_t frame_id){
+    VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = frame_id;
+    server.send(buf, &extra);
+  };
+
+  REQUIRE(client.recv_latest() == nullptr);
+
+  send_frame(1);
+  send_frame(2);
+  send_frame(3);
+  zmq_sleep(100);
+
+  VisionIpcBufExtra extra_recv = {0};
+  REQUIRE(client.recv_latest(&extra_recv) != nullptr);
+  REQUIRE(extra_recv.frame_id == 3);
+  REQUIRE(client.stats.conflated == 2);
+
+  // Frame 4 never makes it out
+  send_frame(5);
+  send_frame(6);
+  send_frame(7);
+  zmq_sleep(100);
+
+  VisionBuf * bufs[2];
+  VisionIpcBufExtra extras[2];
+  REQUIRE(client.recv_batch(bufs, extras, 2) == 2);
+  REQUIRE(extras[0].frame_id == 6);
+  REQUIRE(extras[1].frame_id == 7);
+  REQUIRE(bufs[0] != bufs[1]);
+
+  REQUIRE(client.stats.received == 3);
+  REQUIRE(client.stats.conflated == 3);
+  REQUIRE(client.stats.gaps == 1);
+  REQUIRE(client.stats.missed() == 4);
+  REQUIRE(client.release());
+}
+
+TEST_CASE("Synced recv"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcSyncClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, 10);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  auto send = [&](VisionStreamType type, uint32_t frame_id, uint64_t sof){
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = frame_id;
+    extra.timestamp_sof = sof;
+    server.send(server.get_buffer(type), &extra);
+  };
+  // the first wide frame has no road frame to go with
+  send(VISION_STREAM_YUV_WIDE, 1, 1000);
+  send(VISION_STREAM_YUV_BACK, 2, 2000);
+  send(VISION_STREAM_YUV_WIDE, 2, 2005);
+
+  VisionBuf * bufs[2];
+  VisionIpcBufExtra extras[2];
+  REQUIRE(client.recv(bufs, extras));
+  REQUIRE(extras[0].frame_id == 2);
+  REQUIRE(extras[1].frame_id == 2);
+  REQUIRE(client.release());
+
+  REQUIRE_FALSE(client.recv(bufs, extras, 10));
+}
+
+TEST_CASE("Named streams"){
+  // Only the builtin streams have a zmq port
+  if (messaging_use_zmq()) return;
+
+  VisionIpcServer server("camerad");
+  server.start_listener();
+
+  // Registered after the listener is already running
+  server.create_buffers("debug_nv12", 2, VISIONBUF_FORMAT_NV12, 100, 100);
+  server.create_buffers("debug_tensor", 2, VISIONBUF_FORMAT_FLOAT, 64, 32, 6);
+
+  VisionIpcClient client_nv12 = VisionIpcClient("camerad", "debug_nv12", false);
+  VisionIpcClient client_tensor = VisionIpcClient("camerad", "debug_tensor", false);
+  REQUIRE(client_nv12.connect());
+  REQUIRE(client_tensor.connect());
+
+  REQUIRE(client_nv12.buffers[0].format == VISIONBUF_FORMAT_NV12);
+  REQUIRE(client_nv12.buffers[0].u == client_nv12.buffers[0].y + 100 * 100);
+  REQUIRE(client_tensor.buffers[0].format == VISIONBUF_FORMAT_FLOAT);
+  REQUIRE(client_tensor.buffers[0].planes == 6);
+  REQUIRE(client_tensor.buffers[0].len == 64 * 32 * 6 * sizeof(float));
+
+  // VENUS_Y_STRIDE, VENUS_Y_SCANLINES and VENUS_BUFFER_SIZE of COLOR_FMT_NV12
+  server.create_buffers("debug_venus", 2, VISIONBUF_FORMAT_NV12_VENUS, 1164, 874);
+  VisionIpcClient client_venus = VisionIpcClient("camerad", "debug_venus", false);
+  REQUIRE(client_venus.connect());
+  REQUIRE(client_venus.buffers[0].stride == 1280);
+  REQUIRE(client_venus.buffers[0].u == client_venus.buffers[0].y + 1280 * 896);
+  REQUIRE(client_venus.buffers[0].len == 1740800);
+
+  VisionIpcClient client_missing = VisionIpcClient("camerad", "missing", false);
+  REQUIRE_FALSE(client_missing.connect(false));
+}
+
+TEST_CASE("Fenced send"){
+  cl_platform_id platform_id;
+  cl_device_id device_id;
+  REQUIRE(clGetPlatformIDs(1, &platform_id, NULL) == CL_SUCCESS);
+  REQUIRE(clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_DEFAULT, 1, &device_id, NULL) == CL_SUCCESS);
+  cl_int err;
+  cl_context ctx = clCreateContext(NULL, 1, &device_id, NULL, NULL, &err);
+  REQUIRE(err == CL_SUCCESS);
+
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  // Stands in for the last kernel writing the buffer
+  cl_event fence = clCreateUserEvent(ctx, &err);
+  REQUIRE(err == CL_SUCCESS);
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 42;
+  clRetainEvent(fence); // the server releases its reference once the fence completes
+  server.send(buf, &extra, false, fence);
+
+  VisionIpcBufExtra extra_recv = {0};
+  VisionBuf * recv_buf = client.recv(&extra_recv, 100, false);
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(extra_recv.frame_id == extra.frame_id);
+  REQUIRE_FALSE(client.wait(recv_buf, 10));
+
+  *((uint64_t*)buf->addr) = 1234;
+  REQUIRE(clSetUserEventStatus(fence, CL_COMPLETE) == CL_SUCCESS);
+  REQUIRE(client.wait(recv_buf));
+  REQUIRE(*(uint64_t*)recv_buf->addr == 1234);
+  REQUIRE(server.wait(buf));
+
+  clReleaseEvent(fence);
+  clReleaseContext(ctx);
+}
+
+TEST_CASE("Streams grow when their buffers are held"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100, 3);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  REQUIRE(client.num_buffers == 1);
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  std::vector<VisionBuf *> held;
+  for (int i = 0; i < 3; i++){
+    VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(buf->idx == i);
+    *((uint64_t*)buf->addr) = 1000 + i;
+    server.send(buf, &extra);
+
+    // the client picks up the new buffer with the frame in it, the ones it holds stay valid
+    VisionBuf * recv_buf = client.recv();
+    REQUIRE(recv_buf != nullptr);
+    REQUIRE(client.num_buffers == i + 1);
+    REQUIRE(*(uint64_t*)recv_buf->addr == 1000 + i);
+    client.hold(recv_buf);
+    held.push_back(recv_buf);
+  }
+  for (int i = 0; i < 3; i++){
+    REQUIRE(*(uint64_t*)held[i]->addr == 1000 + i);
+  }
+
+  // at its cap it overwrites like a fixed stream
+  server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(server.get_overwritten(VISION_STREAM_YUV_BACK) == 1);
+
+  auto usage = server.memory_usage()[visionipc_stream_name(VISION_STREAM_YUV_BACK)];
+  REQUIRE(usage.buffers == 3);
+  REQUIRE(usage.max_buffers == 3);
+  REQUIRE(usage.bytes == 3 * held[0]->len);
+}
@@ -1,6 +1,11 @@
 # distutils: language = c++
 # cython: language_level = 3
 from posix.time cimport clock_gettime, timespec, CLOCK_MONOTONIC_RAW, clockid_t
+from posix.fcntl cimport open as c_open, O_RDONLY
+from posix.unistd cimport close
+from posix.mman cimport mmap, PROT_READ, MAP_SHARED, MAP_FAILED
+from libc.stdint cimport uint64_t
+import os
 
 IF UNAME_SYSNAME == "Darwin":
   # Darwin doesn't have a CLOCK_BOOTTIME
@@ -16,9 +21,29 @@ cdef double readclock(clockid_t clock_id):
   current = ts.tv_sec + (ts.tv_nsec / 1000000000.)
   return current
 
+# the uint64 nanoseconds in the SIMULATED_CLOCK file is the time since boot, like
+# nanos_since_boot in selfdrive/common/timing.h
+cdef uint64_t *sim_clock = NULL
+
+cdef uint64_t *map_simulated_clock(path):
+  cdef int fd = c_open(path.encode(), O_RDONLY)
+  if fd < 0:
+    return NULL
+  cdef void *p = mmap(NULL, sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0)
+  close(fd)
+  return NULL if p == MAP_FAILED else <uint64_t *>p
+
+if "SIMULATED_CLOCK" in os.environ:
+  sim_clock = map_simulated_clock(os.environ["SIMULATED_CLOCK"])
+
 def monotonic_time():
   return readclock(CLOCK_MONOTONIC_RAW)
 
 def sec_since_boot():
+  if sim_clock != NULL:
+    return sim_clock[0] / 1000000000.
   return readclock(CLOCK_BOOTTIME)
 
+def simulated_clock():
+  return sim_clock != NULL
+
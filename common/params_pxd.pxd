@@ -8,9 +8,15 @@ cdef extern from "selfdrive/common/util.cc":
   pass
 
 cdef extern from "selfdrive/common/params.h":
+  cdef cppclass ParamsTransaction:
+    ParamsTransaction(const ParamsTransaction&)
+    void put(string, string)
+    int commit()
+
   cdef cppclass Params:
     Params(bool)
     Params(string)
     string get(string, bool) nogil
     int delete_db_value(string)
     int write_db_value(string, string)
+    ParamsTransaction transaction()
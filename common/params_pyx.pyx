@@ -2,7 +2,7 @@
 # cython: language_level = 3
 from libcpp cimport bool
 from libcpp.string cimport string
-from common.params_pxd cimport Params as c_Params
+from common.params_pxd cimport Params as c_Params, ParamsTransaction as c_ParamsTransaction
 
 import os
 import threading
@@ -30,6 +30,7 @@ keys = {
   b"GitBranch": [TxType.PERSISTENT],
   b"GitCommit": [TxType.PERSISTENT],
   b"GitRemote": [TxType.PERSISTENT],
+  b"GnssDatabase": [TxType.PERSISTENT],
   b"GithubSshKeys": [TxType.PERSISTENT],
   b"HardwareSerial": [TxType.PERSISTENT],
   b"HasAcceptedTerms": [TxType.PERSISTENT],
@@ -44,6 +45,7 @@ keys = {
   b"IsUpdateAvailable": [TxType.CLEAR_ON_MANAGER_START],
   b"IsUploadRawEnabled": [TxType.PERSISTENT],
   b"LastAthenaPingTime": [TxType.PERSISTENT],
+  b"LastGpsPosition": [TxType.PERSISTENT],
   b"LastUpdateTime": [TxType.PERSISTENT],
   b"LastUpdateException": [TxType.PERSISTENT],
   b"LiveParameters": [TxType.PERSISTENT],
@@ -53,6 +55,7 @@ keys = {
   b"PandaFirmwareHex": [TxType.CLEAR_ON_MANAGER_START, TxType.CLEAR_ON_PANDA_DISCONNECT],
   b"PandaDongleId": [TxType.CLEAR_ON_MANAGER_START, TxType.CLEAR_ON_PANDA_DISCONNECT],
   b"Passive": [TxType.PERSISTENT],
+  b"RecordClipsOnly": [TxType.PERSISTENT],
   b"RecordFront": [TxType.PERSISTENT],
   b"ReleaseNotes": [TxType.PERSISTENT],
   b"ShouldDoUpdate": [TxType.CLEAR_ON_MANAGER_START],
@@ -149,6 +152,24 @@ cdef class Params:
 
     self.p.write_db_value(key, dat)
 
+  def put_many(self, entries):
+    """
+    Writes each (key, dat) pair, with a single lock and directory fsync.
+    Blocks until they're on disk, like put.
+    """
+    entries = [(ensure_bytes(k), ensure_bytes(v)) for k, v in entries]
+    for key, _ in entries:
+      if key not in keys:
+        raise UnknownKeyName(key)
+
+    cdef c_ParamsTransaction *t = new c_ParamsTransaction(self.p.transaction())
+    try:
+      for key, dat in entries:
+        t.put(key, dat)
+      t.commit()
+    finally:
+      del t
+
   def delete(self, key):
     key = ensure_bytes(key)
     self.p.delete_db_value(key)
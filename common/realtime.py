@@ -4,7 +4,7 @@ import os
 import time
 import multiprocessing
 
-from common.clock import sec_since_boot  # pylint: disable=no-name-in-module, import-error
+from common.clock import sec_since_boot, simulated_clock  # pylint: disable=no-name-in-module, import-error
 from selfdrive.hardware import PC, TICI
 
 
@@ -13,6 +13,9 @@ DT_CTRL = 0.01  # controlsd
 DT_MDL = 0.05  # model
 DT_TRML = 0.5  # thermald and manager
 
+# how often a sleep checks a simulated clock, as in selfdrive/common/timing.h
+SIMULATED_CLOCK_POLL = 0.0002
+
 # driver monitoring
 if TICI:
   DT_DMON = 0.05
@@ -69,7 +72,13 @@ class Ratekeeper():
   def keep_time(self):
     lagged = self.monitor_time()
     if self._remaining > 0:
-      time.sleep(self._remaining)
+      if simulated_clock():
+        # however fast the replay moves it
+        target = self._next_frame_time - self._interval
+        while sec_since_boot() < target:
+          time.sleep(SIMULATED_CLOCK_POLL)
+      else:
+        time.sleep(self._remaining)
     return lagged
 
   # this only monitor the cumulative lag, but does not enforce a rate
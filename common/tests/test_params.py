@@ -47,6 +47,33 @@ class TestParams(unittest.TestCase):
     assert self.params.get("CarParams") is None
     assert self.params.get("DongleId") is not None
 
+  def test_params_big_value(self):
+    st = b"\x01" * 10000
+    self.params.put("CarParams", st)
+    assert Params(self.tmpdir).get("CarParams") == st
+    self.params.delete("CarParams")
+    assert Params(self.tmpdir).get("CarParams") is None
+
+  def test_params_put_seen_by_other_instance(self):
+    q = Params(self.tmpdir)
+    assert q.get("DongleId") is None
+    self.params.put("DongleId", "bob")
+    assert q.get("DongleId") == b"bob"
+    self.params.put("DongleId", "alice")
+    assert q.get("DongleId") == b"alice"
+
+  def test_params_put_many(self):
+    self.params.put("DongleId", "bob")
+    self.params.put_many([("DongleId", "alice"), ("AthenadPid", "123"), ("CarParams", b"\xe1\x90")])
+    assert self.params.get("DongleId") == b"alice"
+    assert self.params.get("AthenadPid") == b"123"
+    assert self.params.get("CarParams") == b"\xe1\x90"
+
+  def test_params_put_many_unknown_key_fails(self):
+    with self.assertRaises(UnknownKeyName):
+      self.params.put_many([("DongleId", "bob"), ("swag", "1")])
+    assert self.params.get("DongleId") is None
+
   def test_params_two_things(self):
     self.params.put("DongleId", "bob")
     self.params.put("AthenadPid", "123")
@@ -0,0 +1,26 @@
+import os
+import struct
+import unittest
+
+from common.simulated_clock import SimulatedClock
+
+
+class TestSimulatedClock(unittest.TestCase):
+  def test_readers_see_it(self):
+    with SimulatedClock(start_ns=1000) as clock:
+      self.assertEqual(clock.env({})["SIMULATED_CLOCK"], clock.path)
+      clock.advance(500)
+      with open(clock.path, "rb") as f:
+        self.assertEqual(struct.unpack("<Q", f.read(8))[0], 1500)
+      clock.set(10**15)
+      self.assertEqual(clock.nanos, 10**15)
+    self.assertFalse(os.path.exists(clock.path))
+
+  def test_no_going_back(self):
+    with SimulatedClock(start_ns=1000) as clock:
+      with self.assertRaises(AssertionError):
+        clock.set(999)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -1,12 +1,26 @@
 #include "common.h"
 
+// sums of the nibbles and bytes of d, the partial sums stay in their lanes so one multiply adds them up
+static inline unsigned int nibble_sum(uint64_t d) {
+  d = (d & 0x0F0F0F0F0F0F0F0FULL) + ((d >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+  return (d * 0x0101010101010101ULL) >> 56;
+}
+
+static inline unsigned int byte_sum(uint64_t d) {
+  d = (d & 0x00FF00FF00FF00FFULL) + ((d >> 8) & 0x00FF00FF00FF00FFULL);
+  return (d * 0x0001000100010001ULL) >> 48;
+}
+
+// the n low bytes of d
+static inline uint64_t low_bytes(uint64_t d, int n) {
+  return n > 0 ? d & (~0ULL >> (64 - n*8)) : 0;
+}
+
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 4; // remove checksum
 
-  int s = 0;
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
+  unsigned int s = nibble_sum(address) + nibble_sum(d);
   s = 8-s;
   s &= 0xF;
 
@@ -17,9 +31,7 @@ unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  unsigned int s = l;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  while (d) { s += d & 0xFF; d >>= 8; }
+  unsigned int s = l + byte_sum(address) + byte_sum(d);
 
   return s & 0xFF;
 }
@@ -27,49 +39,21 @@ unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
 unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
 
-  unsigned int s = 0;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  l -= 1; // checksum is first byte
-  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
+  // checksum is first byte
+  unsigned int s = byte_sum(address) + byte_sum(low_bytes(d, l - 1));
 
   return s & 0xFF;
 }
 
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
-  /* This function does not want the checksum byte in the input data.
-  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
-  uint8_t checksum = 0xFF;
-  for (int j = 0; j < (l - 1); j++) {
-    uint8_t shift = 0x80;
-    uint8_t curr = (d >> 8*j) & 0xFF;
-    for (int i=0; i<8; i++) {
-      uint8_t bit_sum = curr & shift;
-      uint8_t temp_chk = checksum & 0x80U;
-      if (bit_sum != 0U) {
-        bit_sum = 0x1C;
-        if (temp_chk != 0U) {
-          bit_sum = 1;
-        }
-        checksum = checksum << 1;
-        temp_chk = checksum | 1U;
-        bit_sum ^= temp_chk;
-      } else {
-        if (temp_chk != 0U) {
-          bit_sum = 0x1D;
-        }
-        checksum = checksum << 1;
-        bit_sum ^= checksum;
-      }
-      checksum = bit_sum;
-      shift = shift >> 1;
-    }
-  }
-  return ~checksum & 0xFF;
-}
-
 // Static lookup table for fast computation of CRC8 poly 0x2F, aka 8H2F/AUTOSAR
 uint8_t crc8_lut_8h2f[256];
 
+// Slice by 8 tables, slices[k][b] is the CRC of byte b followed by k zero bytes. CRCs are linear,
+// so each byte of a frame is looked up on its own instead of waiting for the previous one
+static uint8_t crc8_slices_8h2f[8][256];
+static uint8_t crc8_slices_1d[8][256];  // SAE J1850, for Chrysler
+static uint8_t crc8_slices_d5[8][256];  // for the pedal
+
 void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
   uint8_t crc;
   int i, j;
@@ -86,10 +70,42 @@ void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
   }
 }
 
+void gen_crc_slice_tables(uint8_t poly, uint8_t slices[][256]) {
+  gen_crc_lookup_table(poly, slices[0]);
+  for (int k = 1; k < 8; k++) {
+    for (int b = 0; b < 256; b++) {
+      slices[k][b] = slices[0][slices[k - 1][b]];
+    }
+  }
+}
+
 void init_crc_lookup_tables() {
   // At init time, set up static lookup tables for fast CRC computation.
 
   gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
+  gen_crc_slice_tables(0x2F, crc8_slices_8h2f);
+  gen_crc_slice_tables(0x1D, crc8_slices_1d);
+  gen_crc_slice_tables(0xD5, crc8_slices_d5);
+}
+
+// CRC8 of the n low bytes of d, lowest byte first, starting from init
+static inline uint8_t crc8_sliced(const uint8_t slices[][256], uint64_t d, int n, uint8_t init) {
+  if (n <= 0) {
+    return init;
+  }
+  d ^= init;  // init goes in with the first byte
+  uint8_t crc = 0;
+  for (int i = 0; i < n; i++) {
+    crc ^= slices[n - 1 - i][(d >> (i*8)) & 0xFF];
+  }
+  return crc;
+}
+
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+  /* This function does not want the checksum byte in the input data.
+  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf
+  it's CRC8 SAE J1850, poly 0x1D, init and final xor 0xFF */
+  return crc8_sliced(crc8_slices_1d, d, l - 1, 0xFF) ^ 0xFF;
 }
 
 unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
@@ -100,10 +116,7 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
   uint8_t crc = 0xFF; // Standard init value for CRC8 8H2F/AUTOSAR
 
   // CRC the payload first, skipping over the first byte where the CRC lives.
-  for (int i = 1; i < l; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    crc = crc8_lut_8h2f[crc];
-  }
+  crc = crc8_sliced(crc8_slices_8h2f, d >> 8, l - 1, crc);
 
   // Look up and apply the magic final CRC padding byte, which permutes by CAN
   // address, and additionally (for SOME addresses) by the message counter.
@@ -169,25 +182,37 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
 
 
 unsigned int pedal_checksum(uint64_t d, int l) {
-  uint8_t crc = 0xFF;
-  uint8_t poly = 0xD5; // standard crc8
-
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0) {
-        crc = (uint8_t)((crc << 1) ^ poly);
-      }
-      else {
-        crc <<= 1;
-      }
-    }
+  return crc8_sliced(crc8_slices_d5, d, l - 1, 0xFF);  // standard crc8, poly 0xD5
+}
+
+void checksum_many(SignalType type, unsigned int address, int l, const uint64_t *d, unsigned int *out, size_t n) {
+  // the switch is outside the loops, so the frames' checksums are independent and overlap
+  switch (type) {
+    case SignalType::HONDA_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = honda_checksum(address, d[i], l);
+      break;
+    case SignalType::TOYOTA_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = toyota_checksum(address, d[i], l);
+      break;
+    case SignalType::VOLKSWAGEN_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = volkswagen_crc(address, d[i], l);
+      break;
+    case SignalType::SUBARU_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = subaru_checksum(address, d[i], l);
+      break;
+    case SignalType::CHRYSLER_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = chrysler_checksum(address, d[i], l);
+      break;
+    case SignalType::PEDAL_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = pedal_checksum(d[i], l);
+      break;
+    default:
+      for (size_t i = 0; i < n; i++) out[i] = 0;
+      break;
   }
-  return crc;
 }
 
 
@@ -10,6 +10,23 @@
 
 #define MAX_BAD_COUNTER 5
 
+// CANParser's receive latency histogram, the last bucket has everything past it
+#define CAN_LATENCY_BUCKET_US 500
+#define CAN_LATENCY_BUCKETS 40
+
+// CANParser's per message stats, intervals go in power of 2 us buckets, the last has the rest
+#define CAN_STATS_BUCKETS 24
+#define CAN_STATS_ALPHA 0.05
+
+struct MessageStats {
+  uint64_t frames = 0;
+  uint64_t last_time = 0;
+  // moving averages of the interval between frames and of its distance from that, in seconds
+  double interval = 0;
+  double jitter = 0;
+  std::vector<uint32_t> interval_histogram = std::vector<uint32_t>(CAN_STATS_BUCKETS);
+};
+
 // Helper functions
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
 unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
@@ -18,8 +35,9 @@ unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
 void init_crc_lookup_tables();
 unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
 unsigned int pedal_checksum(uint64_t d, int l);
-uint64_t read_u64_be(const uint8_t* v);
-uint64_t read_u64_le(const uint8_t* v);
+// type's checksum of n frames of the same message, d as the checksum takes it: little endian
+// for Volkswagen and Chrysler, big endian for the rest. Other types get 0
+void checksum_many(SignalType type, unsigned int address, int l, const uint64_t *d, unsigned int *out, size_t n);
 
 class MessageState {
 public:
@@ -29,13 +47,36 @@ public:
   std::vector<Signal> parse_sigs;
   std::vector<double> vals;
 
+  // parse_sigs compiled by compile(), one entry per signal. A signal is
+  // ((dat[big_endian] >> shift) & mask) sign extended from sign_bit, 0 if unsigned
+  std::vector<uint8_t> big_endian;
+  std::vector<uint8_t> shift;
+  std::vector<uint64_t> mask;
+  std::vector<uint64_t> sign_bit;
+  std::vector<double> factor;
+  std::vector<double> offset;
+  // the checksum and counter signals, -1 if there's none, checked once before extracting
+  int checksum_sig = -1;
+  int counter_sig = -1;
+  bool needs_le = false;
+  bool needs_be = false;
+  // the DBC's generated decoder, used instead of the arrays when there is one. It fills decoded
+  // with every signal of the message, parse_sigs[i] is decoded[decode_index[i]]
+  void (*decode)(const uint8_t *dat, double *vals) = nullptr;
+  std::vector<int> decode_index;
+  std::vector<double> decoded;
+
   uint16_t ts;
   uint64_t seen;
   uint64_t check_threshold;
 
   uint8_t counter;
   uint8_t counter_fail;
+  // every failure, counted on the failing path only
+  uint32_t checksum_errors = 0;
+  uint32_t counter_errors = 0;
 
+  void compile();
   bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
   bool update_counter_generic(int64_t v, int cnt_size);
 };
@@ -45,11 +86,38 @@ private:
   const int bus;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+  std::vector<MessageState> message_states;
+  // slots in message_states by address, -1 if it isn't parsed. 11 bit addresses index std_slots,
+  // extended ones are in an open addressing table, a power of 2 at most half full
+  std::vector<int16_t> std_slots = std::vector<int16_t>(2048, -1);
+  std::vector<uint32_t> ext_addresses;
+  std::vector<int16_t> ext_slots;
+  // bitset of the message_states parsed by the last update
+  std::vector<uint64_t> updated;
+
+  // reused for copying strings to word alignment
+  kj::Array<capnp::word> aligned;
+
+  MessageState *find_state(uint32_t address);
+  void UpdateCan(uint64_t sec, uint64_t now, const cereal::CanData::Reader& cmsg);
+  void BeginUpdate(uint64_t sec);
+  void UpdateEvent(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans, int &invalid);
+  void RecordHistory(uint64_t sec);
+  friend class CANParserGroup;
 
 public:
   bool can_valid = false;
   uint64_t last_sec = 0;
+  // parsed messages by the time from the panda receiving them to parsing, for those with an rxTime
+  std::vector<uint64_t> latency_histogram = std::vector<uint64_t>(CAN_LATENCY_BUCKETS);
+  // with record_history, update_strings and update_log keep every event's values. history_times
+  // has the events' logMonoTime and history[column] the value after each one, columns are the
+  // signals of states() in order
+  bool record_history = false;
+  // by slot like states(), empty unless enable_stats() was called
+  std::vector<MessageStats> stats;
+  std::vector<uint64_t> history_times;
+  std::vector<std::vector<double>> history;
 
   CANParser(int abus, const std::string& dbc_name,
             const std::vector<MessageParseOptions> &options,
@@ -57,16 +125,67 @@ public:
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
   void UpdateValid(uint64_t sec);
   void update_string(std::string data, bool sendcan);
+  // each string goes through as in update_string, query_updated has the messages parsed by any
+  // of them. Return how many of the last events in a row weren't can_valid
+  int update_strings(const std::vector<std::string> &data, bool sendcan);
+  // the same for the events of an uncompressed log, ones without can or sendcan are skipped
+  int update_log(const std::string &data, bool sendcan);
   std::vector<SignalValue> query_latest();
+  // the slots of the messages parsed by the last update, their values are in states()[slot].vals,
+  // which stay where they are for the life of the parser
+  void query_updated(std::vector<int> &slots) const;
+  const std::vector<MessageState> &states() const { return message_states; }
+  int get_bus() const { return bus; }
+  void enable_stats();
+};
+
+// Parsers of the same can events, usually one per bus of a car. Each event is read once and
+// every frame only goes to the parsers on its bus
+class CANParserGroup {
+private:
+  std::vector<CANParser*> parsers;
+  std::vector<std::vector<CANParser*>> bus_parsers;  // by src
+
+public:
+  void add(CANParser *parser);
+  void update_string(const std::string &data, bool sendcan);
+};
+
+// a signal and its index for the message's generated encoder
+struct PackSignal {
+  Signal sig;
+  int index;
+  uint64_t (*encode)(int sig, uint64_t ret, int64_t ival);
+};
+
+// a message and signals resolved once, for packing without looking them up by name.
+// Undefined signals are nullptr and their values skipped
+struct PackHandle {
+  uint32_t address;
+  int size;
+  std::vector<const PackSignal*> sigs;
+  const PackSignal *counter = nullptr;
+  const PackSignal *checksum = nullptr;
 };
 
 class CANPacker {
 private:
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
+  std::map<std::pair<uint32_t, std::string>, PackSignal> signal_lookup;
   std::map<uint32_t, Msg> message_lookup;
+  std::vector<PackHandle> handles;
+
+  const PackSignal *find_signal(uint32_t address, const std::string &name) const;
+  uint64_t pack_counter_checksum(uint32_t address, int size, const PackSignal *counter_sig,
+                                 const PackSignal *checksum_sig, uint64_t ret, int counter);
 
 public:
   CANPacker(const std::string& dbc_name);
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter);
+  // a handle for packing address with values of names in that order, -1 if it isn't in the dbc
+  int handle(uint32_t address, const std::vector<std::string> &names);
+  uint32_t handle_address(int handle) const;
+  int handle_size(int handle) const;
+  // values has one per name of the handle
+  uint64_t pack(int handle, const double *values, int counter);
 };
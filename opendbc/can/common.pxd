@@ -73,12 +73,47 @@ cdef extern from "common_dbc.h":
 cdef extern from "common.h":
   cdef const DBC* dbc_lookup(const string);
 
+  cdef int CAN_LATENCY_BUCKET_US
+
+  cdef cppclass MessageState:
+    uint32_t address
+    vector[Signal] parse_sigs
+    vector[double] vals
+    uint16_t ts
+    uint32_t checksum_errors
+    uint32_t counter_errors
+
+  cdef cppclass MessageStats:
+    uint64_t frames
+    double interval
+    double jitter
+    vector[uint32_t] interval_histogram
+
   cdef cppclass CANParser:
     bool can_valid
+    vector[uint64_t] latency_histogram
+    bool record_history
+    vector[uint64_t] history_times
+    vector[vector[double]] history
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
+    int update_strings(vector[string]&, bool)
+    int update_log(string&, bool)
     vector[SignalValue] query_latest()
+    void query_updated(vector[int]&)
+    const vector[MessageState]& states()
+    vector[MessageStats] stats
+    int get_bus()
+    void enable_stats()
+
+  cdef cppclass CANParserGroup:
+    void add(CANParser *)
+    void update_string(string, bool)
 
   cdef cppclass CANPacker:
    CANPacker(string)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   int handle(uint32_t, vector[string])
+   uint32_t handle_address(int)
+   int handle_size(int)
+   uint64_t pack(int, const double *, int counter)
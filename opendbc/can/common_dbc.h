@@ -57,6 +57,10 @@ struct Msg {
   unsigned int size;
   size_t num_sigs;
   const Signal *sigs;
+  // generated by process_dbc.py. decode writes every signal's value to vals, in sigs order,
+  // encode sets signal sig in a message packed like CANPacker does
+  void (*decode)(const uint8_t *dat, double *vals);
+  uint64_t (*encode)(int sig, uint64_t ret, int64_t ival);
 };
 
 struct Val {
@@ -74,11 +78,27 @@ struct DBC {
   size_t num_vals;
 };
 
-const DBC* dbc_lookup(const std::string& dbc_name);
+// A DBC's generated decoders and encoders, by address. They're only used with the bundle's tables
+// of the same hash
+struct MsgCode {
+  uint32_t address;
+  void (*decode)(const uint8_t *dat, double *vals);
+  uint64_t (*encode)(int sig, uint64_t ret, int64_t ival);
+};
 
-void dbc_register(const DBC* dbc);
+struct DbcCode {
+  const char* name;
+  uint64_t hash;
+  size_t num_msgs;
+  const MsgCode *msgs;
+};
+
+extern const DbcCode *const dbc_codes[];
+extern const size_t dbc_codes_count;
+
+// The DBC's tables, decoded from the bundle process_dbc.py writes the first time it's looked up
+// and kept. NULL when the bundle doesn't have it
+const DBC* dbc_lookup(const std::string& dbc_name);
 
-#define dbc_init(dbc) \
-static void __attribute__((constructor)) do_dbc_init_ ## dbc(void) { \
-  dbc_register(&dbc); \
-}
+uint64_t read_u64_be(const uint8_t* v);
+uint64_t read_u64_le(const uint8_t* v);
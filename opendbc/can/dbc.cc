@@ -1,27 +1,247 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "common_dbc.h"
 
+// The bundle process_dbc.py writes, see write_bundle there for the layout. It's found next to
+// libdbc in dbc_out/, or at DBC_BUNDLE
+#define BUNDLE_MAGIC "DBCBNDL1"
+#define BUNDLE_PATH "dbc_out/dbcs.bundle"
+
 namespace {
 
-std::vector<const DBC*>& get_dbcs() {
-  static std::vector<const DBC*> vec;
-  return vec;
-}
+struct BundleHeader {
+  char magic[8];
+  uint32_t num_dbcs;
+  uint32_t reserved;
+};
 
-}
+struct BundleIndex {
+  uint32_t name;
+  uint32_t reserved;
+  uint64_t hash;
+  uint32_t offset, size;
+  uint32_t reserved2;
+};
 
-const DBC* dbc_lookup(const std::string& dbc_name) {
-  for (const auto& dbci : get_dbcs()) {
-    if (dbc_name == dbci->name) {
-      return dbci;
+struct BundleTables {
+  uint32_t num_msgs, num_vals, num_sigs;
+  uint32_t reserved;
+};
+
+struct BundleMsg {
+  uint32_t name, address, size, num_sigs, first_sig;
+  uint32_t reserved;
+};
+
+struct BundleVal {
+  uint32_t name, address, def_val, msg;
+};
+
+struct BundleSignal {
+  uint32_t name;
+  int32_t b1, b2, bo;
+  uint8_t is_signed, is_little_endian, type;
+  uint8_t reserved[5];
+  double factor, offset;
+};
+
+static_assert(sizeof(BundleHeader) == 16 && sizeof(BundleIndex) == 32 && sizeof(BundleTables) == 16);
+static_assert(sizeof(BundleMsg) == 24 && sizeof(BundleVal) == 16 && sizeof(BundleSignal) == 40);
+
+// A DBC decoded from the bundle, its names point into the mapping
+struct LoadedDbc {
+  DBC dbc;
+  std::vector<Msg> msgs;
+  std::vector<Signal> sigs;
+  std::vector<Val> vals;
+};
+
+class Bundle {
+public:
+  Bundle() {
+    std::string path;
+    if (const char *env = getenv("DBC_BUNDLE")) {
+      path = env;
+    } else {
+      Dl_info info;
+      if (dladdr((void *)&dbc_codes, &info) && info.dli_fname) {
+        path = info.dli_fname;
+        size_t slash = path.find_last_of('/');
+        path = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+      }
+      path += BUNDLE_PATH;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BundleHeader)) {
+      fprintf(stderr, "dbc: can't read the bundle %s\n", path.c_str());
+      if (fd >= 0) close(fd);
+      return;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "dbc: can't map the bundle %s\n", path.c_str());
+      return;
+    }
+
+    const BundleHeader *header = (const BundleHeader *)addr;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        sizeof(BundleHeader) + (size_t)header->num_dbcs * sizeof(BundleIndex) > (size_t)st.st_size) {
+      fprintf(stderr, "dbc: %s isn't a bundle\n", path.c_str());
+      munmap(addr, st.st_size);
+      return;
+    }
+    // never unmapped, the DBCs handed out point into it
+    data = (const uint8_t *)addr;
+    size = st.st_size;
+  }
+
+  // Not thread safe, dbc_lookup holds the lock
+  const DBC *lookup(const std::string &name) {
+    auto it = loaded.find(name);
+    if (it != loaded.end()) return it->second ? &it->second->dbc : NULL;
+
+    std::unique_ptr<LoadedDbc> &dbc = loaded[name];
+    if (!data) return NULL;
+    const BundleHeader *header = (const BundleHeader *)data;
+    const BundleIndex *index = (const BundleIndex *)(data + sizeof(BundleHeader));
+    for (uint32_t i = 0; i < header->num_dbcs; i++) {
+      const char *dbc_name = string(index[i].name);
+      if (dbc_name && name == dbc_name) {
+        dbc = decode(index[i]);
+        break;
+      }
     }
+    return dbc ? &dbc->dbc : NULL;
   }
-  return NULL;
+
+private:
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  std::map<std::string, std::unique_ptr<LoadedDbc>> loaded;
+
+  // NULL past the end of the mapping or without its NUL
+  const char *string(uint32_t offset) const {
+    if (offset >= size || !memchr(data + offset, '\0', size - offset)) return NULL;
+    return (const char *)(data + offset);
+  }
+
+  std::unique_ptr<LoadedDbc> decode(const BundleIndex &index) const {
+    const char *dbc_name = string(index.name);
+    if ((size_t)index.offset + index.size > size || index.offset % 8 != 0 || index.size < sizeof(BundleTables)) {
+      fprintf(stderr, "dbc: %s is cut short in the bundle\n", dbc_name);
+      return nullptr;
+    }
+    const uint8_t *p = data + index.offset;
+    const BundleTables *tables = (const BundleTables *)p;
+    const size_t needed = sizeof(BundleTables) + (size_t)tables->num_msgs * sizeof(BundleMsg) +
+                          (size_t)tables->num_vals * sizeof(BundleVal) + (size_t)tables->num_sigs * sizeof(BundleSignal);
+    if (needed > index.size) {
+      fprintf(stderr, "dbc: %s is cut short in the bundle\n", dbc_name);
+      return nullptr;
+    }
+    const BundleMsg *msgs = (const BundleMsg *)(p + sizeof(BundleTables));
+    const BundleVal *vals = (const BundleVal *)(msgs + tables->num_msgs);
+    const BundleSignal *sigs = (const BundleSignal *)(vals + tables->num_vals);
+
+    auto dbc = std::make_unique<LoadedDbc>();
+    dbc->sigs.reserve(tables->num_sigs);
+    for (uint32_t i = 0; i < tables->num_sigs; i++) {
+      const BundleSignal &s = sigs[i];
+      const char *sig_name = string(s.name);
+      if (!sig_name) return nullptr;
+      dbc->sigs.push_back({
+        .name = sig_name,
+        .b1 = s.b1,
+        .b2 = s.b2,
+        .bo = s.bo,
+        .is_signed = s.is_signed != 0,
+        .factor = s.factor,
+        .offset = s.offset,
+        .is_little_endian = s.is_little_endian != 0,
+        .type = (SignalType)s.type,
+      });
+    }
+
+    // the generated code only goes with the tables it was generated with
+    const DbcCode *code = nullptr;
+    for (size_t i = 0; i < dbc_codes_count; i++) {
+      if (strcmp(dbc_codes[i]->name, dbc_name) == 0) code = dbc_codes[i];
+    }
+    if (code && code->hash != index.hash) {
+      fprintf(stderr, "dbc: the bundle's %s isn't the one libdbc was built with, parsing it without the generated code\n", dbc_name);
+      code = nullptr;
+    }
+
+    dbc->msgs.reserve(tables->num_msgs);
+    for (uint32_t i = 0; i < tables->num_msgs; i++) {
+      const BundleMsg &m = msgs[i];
+      const char *msg_name = string(m.name);
+      if (!msg_name || (size_t)m.first_sig + m.num_sigs > dbc->sigs.size()) return nullptr;
+      Msg msg = {
+        .name = msg_name,
+        .address = m.address,
+        .size = m.size,
+        .num_sigs = m.num_sigs,
+        .sigs = &dbc->sigs[m.first_sig],
+        .decode = nullptr,
+        .encode = nullptr,
+      };
+      // both are sorted by address
+      if (code && i < code->num_msgs && code->msgs[i].address == m.address) {
+        msg.decode = code->msgs[i].decode;
+        msg.encode = code->msgs[i].encode;
+      }
+      dbc->msgs.push_back(msg);
+    }
+
+    dbc->vals.reserve(tables->num_vals);
+    for (uint32_t i = 0; i < tables->num_vals; i++) {
+      const BundleVal &v = vals[i];
+      const char *val_name = string(v.name), *def_val = string(v.def_val);
+      if (!val_name || !def_val || v.msg >= dbc->msgs.size()) return nullptr;
+      dbc->vals.push_back({
+        .name = val_name,
+        .address = v.address,
+        .def_val = def_val,
+        .sigs = dbc->msgs[v.msg].sigs,
+      });
+    }
+
+    dbc->dbc = {
+      .name = dbc_name,
+      .num_msgs = dbc->msgs.size(),
+      .msgs = dbc->msgs.data(),
+      .vals = dbc->vals.data(),
+      .num_vals = dbc->vals.size(),
+    };
+    return dbc;
+  }
+};
+
 }
 
-void dbc_register(const DBC* dbc) {
-  get_dbcs().push_back(dbc);
+const DBC* dbc_lookup(const std::string& dbc_name) {
+  static std::mutex lock;
+  std::lock_guard<std::mutex> lk(lock);
+  // mapped on the first lookup, not when the library loads
+  static Bundle bundle;
+  return bundle.lookup(dbc_name);
 }
 
 extern "C" {
@@ -1,85 +1,60 @@
 #include "common_dbc.h"
 
+// The generated decoders and encoders of {{dbc.name}}, its tables are in the bundle
+
 namespace {
 
 {% for address, msg_name, msg_size, sigs in msgs %}
-const Signal sigs_{{address}}[] = {
+void decode_{{address}}(const uint8_t *dat, double *vals) {
+  {% if sigs|selectattr("is_little_endian")|list %}
+  const uint64_t le = read_u64_le(dat);
+  {% endif %}
+  {% if sigs|rejectattr("is_little_endian")|list %}
+  const uint64_t be = read_u64_be(dat);
+  {% endif %}
   {% for sig in sigs %}
-    {
-      {% if sig.is_little_endian %}
-        {% set b1 = sig.start_bit %}
-      {% else %}
-        {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
-      {% endif %}
-      .name = "{{sig.name}}",
-      .b1 = {{b1}},
-      .b2 = {{sig.size}},
-      .bo = {{64 - (b1 + sig.size)}},
-      .is_signed = {{"true" if sig.is_signed else "false"}},
-      .factor = {{sig.factor}},
-      .offset = {{sig.offset}},
-      .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "CHECKSUM" %}
-      .type = SignalType::VOLKSWAGEN_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "COUNTER" %}
-      .type = SignalType::VOLKSWAGEN_COUNTER,
-      {% elif checksum_type == "subaru" and sig.name == "CHECKSUM" %}
-      .type = SignalType::SUBARU_CHECKSUM,
-      {% elif checksum_type == "chrysler" and sig.name == "CHECKSUM" %}
-      .type = SignalType::CHRYSLER_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}
-      .type = SignalType::PEDAL_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}
-      .type = SignalType::PEDAL_COUNTER,
-      {% else %}
-      .type = SignalType::DEFAULT,
-      {% endif %}
-    },
+    {% set l = layout(sig) %}
+    {% set raw = "((%s >> %d) & %s)" % ("le" if sig.is_little_endian else "be", l.shift, l.mask) %}
+    {% if sig.is_signed %}
+      {% set raw = "((int64_t)(%s << %d) >> %d)" % (raw, 64 - sig.size, 64 - sig.size) %}
+    {% endif %}
+  vals[{{loop.index0}}] = (double){{raw}}{% if sig.factor != 1 %} * {{sig.factor}}{% endif %}{% if sig.offset != 0 %} + {{sig.offset}}{% endif %};
   {% endfor %}
-};
+}
+
+uint64_t encode_{{address}}(int sig, uint64_t ret, int64_t ival) {
+  switch (sig) {
+  {% for sig in sigs %}
+    {% set l = layout(sig) %}
+    case {{loop.index0}}:
+    {% if sig.is_little_endian %}
+      return (ret & ~{{l.encode_mask}}) | __builtin_bswap64(((uint64_t)ival & {{l.mask}}) << {{l.shift}});
+    {% else %}
+      return (ret & ~{{l.encode_mask}}) | (((uint64_t)ival & {{l.mask}}) << {{l.shift}});
+    {% endif %}
+  {% endfor %}
+    default:
+      return ret;
+  }
+}
 {% endfor %}
 
-const Msg msgs[] = {
+const MsgCode msgs[] = {
 {% for address, msg_name, msg_size, sigs in msgs %}
   {% set address_hex = "0x%X" % address %}
   {
-    .name = "{{msg_name}}",
     .address = {{address_hex}},
-    .size = {{msg_size}},
-    .num_sigs = ARRAYSIZE(sigs_{{address}}),
-    .sigs = sigs_{{address}},
+    .decode = decode_{{address}},
+    .encode = encode_{{address}},
   },
 {% endfor %}
 };
 
-const Val vals[] = {
-{% for address, sig in def_vals %}
-  {% for sg_name, def_val in sig %}
-    {% set address_hex = "0x%X" % address %}
-    {
-      .name = "{{sg_name}}",
-      .address = {{address_hex}},
-      .def_val = {{def_val}},
-      .sigs = sigs_{{address}},
-    },
-  {% endfor %}
-{% endfor %}
-};
-
 }
 
-const DBC {{dbc.name}} = {
+extern const DbcCode {{dbc.name}}_code = {
   .name = "{{dbc.name}}",
+  .hash = {{"0x%016X" % hash}}ULL,
   .num_msgs = ARRAYSIZE(msgs),
   .msgs = msgs,
-  .vals = vals,
-  .num_vals = ARRAYSIZE(vals),
 };
-
-dbc_init({{dbc.name}})
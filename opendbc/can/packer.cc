@@ -33,6 +33,10 @@ uint64_t set_value(uint64_t ret, Signal sig, int64_t ival){
   return ret;
 }
 
+uint64_t set_value(uint64_t ret, const PackSignal &psig, int64_t ival){
+  return psig.encode ? psig.encode(psig.index, ret, ival) : set_value(ret, psig.sig, ival);
+}
+
 CANPacker::CANPacker(const std::string& dbc_name) {
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
@@ -42,69 +46,120 @@ CANPacker::CANPacker(const std::string& dbc_name) {
     message_lookup[msg->address] = *msg;
     for (int j=0; j<msg->num_sigs; j++) {
       const Signal* sig = &msg->sigs[j];
-      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
+      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = {*sig, j, msg->encode};
     }
   }
   init_crc_lookup_tables();
 }
 
+const PackSignal *CANPacker::find_signal(uint32_t address, const std::string &name) const {
+  auto sig_it = signal_lookup.find(std::make_pair(address, name));
+  return sig_it == signal_lookup.end() ? nullptr : &sig_it->second;
+}
+
+static int64_t pack_ival(const Signal &sig, double value) {
+  int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
+  if (ival < 0) {
+    ival = (1ULL << sig.b2) + ival;
+  }
+  return ival;
+}
+
 uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
   uint64_t ret = 0;
   for (const auto& sigval : signals) {
     std::string name = std::string(sigval.name);
-    double value = sigval.value;
 
-    auto sig_it = signal_lookup.find(std::make_pair(address, name));
-    if (sig_it == signal_lookup.end()) {
+    const PackSignal *psig = find_signal(address, name);
+    if (psig == nullptr) {
       WARN("undefined signal %s - %d\n", name.c_str(), address);
       continue;
     }
-    auto sig = sig_it->second;
+    ret = set_value(ret, *psig, pack_ival(psig->sig, sigval.value));
+  }
+
+  auto msg_it = message_lookup.find(address);
+  int size = msg_it == message_lookup.end() ? 0 : msg_it->second.size;
+  return pack_counter_checksum(address, size, find_signal(address, "COUNTER"), find_signal(address, "CHECKSUM"), ret, counter);
+}
+
+int CANPacker::handle(uint32_t address, const std::vector<std::string> &names) {
+  auto msg_it = message_lookup.find(address);
+  if (msg_it == message_lookup.end()) {
+    WARN("undefined message %d\n", address);
+    return -1;
+  }
 
-    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
-    if (ival < 0) {
-      ival = (1ULL << sig.b2) + ival;
+  PackHandle h = {.address = address, .size = (int)msg_it->second.size};
+  for (const auto &name : names) {
+    const PackSignal *psig = find_signal(address, name);
+    if (psig == nullptr) {
+      WARN("undefined signal %s - %d\n", name.c_str(), address);
     }
+    h.sigs.push_back(psig);
+  }
+  h.counter = find_signal(address, "COUNTER");
+  h.checksum = find_signal(address, "CHECKSUM");
+  handles.push_back(std::move(h));
+  return handles.size() - 1;
+}
+
+uint32_t CANPacker::handle_address(int handle) const {
+  return handles[handle].address;
+}
 
-    ret = set_value(ret, sig, ival);
+int CANPacker::handle_size(int handle) const {
+  return handles[handle].size;
+}
+
+uint64_t CANPacker::pack(int handle, const double *values, int counter) {
+  const PackHandle &h = handles[handle];
+  uint64_t ret = 0;
+  for (int i = 0; i < h.sigs.size(); i++) {
+    if (h.sigs[i] != nullptr) {
+      ret = set_value(ret, *h.sigs[i], pack_ival(h.sigs[i]->sig, values[i]));
+    }
   }
+  return pack_counter_checksum(h.address, h.size, h.counter, h.checksum, ret, counter);
+}
 
+uint64_t CANPacker::pack_counter_checksum(uint32_t address, int size, const PackSignal *counter_sig,
+                                          const PackSignal *checksum_sig, uint64_t ret, int counter) {
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    if (counter_sig == nullptr) {
       WARN("COUNTER not defined\n");
       return ret;
     }
-    auto sig = sig_it->second;
+    const auto &sig = counter_sig->sig;
 
     if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
       WARN("COUNTER signal type not valid\n");
     }
 
-    ret = set_value(ret, sig, counter);
+    ret = set_value(ret, *counter_sig, counter);
   }
 
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    auto sig = sig_it_checksum->second;
+  if (checksum_sig != nullptr) {
+    const auto &psig = *checksum_sig;
+    const auto &sig = psig.sig;
     if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
+      unsigned int chksm = honda_checksum(address, ret, size);
+      ret = set_value(ret, psig, chksm);
     } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
+      unsigned int chksm = toyota_checksum(address, ret, size);
+      ret = set_value(ret, psig, chksm);
     } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
       // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
       // until later in the pack process. Checksums can be run backwards, CRCs not so much.
       // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
+      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), size);
+      ret = set_value(ret, psig, chksm);
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
+      unsigned int chksm = subaru_checksum(address, ret, size);
+      ret = set_value(ret, psig, chksm);
     } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
+      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), size);
+      ret = set_value(ret, psig, chksm);
     } else {
       //WARN("CHECKSUM signal type not valid\n");
     }
@@ -2,6 +2,9 @@
 # cython: c_string_encoding=ascii, language_level=3
 
 from libc.stdint cimport uint32_t, uint64_t
+from libc.string cimport memcpy
+from cpython cimport array
+import array
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -12,12 +15,17 @@ from .common cimport CANPacker as cpp_CANPacker
 from .common cimport dbc_lookup, SignalPackValue, DBC
 
 
+cdef array.array UINT32_ARRAY = array.array('I')
+cdef array.array UINT8_ARRAY = array.array('B')
+
+
 cdef class CANPacker:
   cdef:
     cpp_CANPacker *packer
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    vector[double] handle_values
 
   def __init__(self, dbc_name):
     self.dbc = dbc_lookup(dbc_name)
@@ -67,3 +75,52 @@ cdef class CANPacker:
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  def handle(self, name_or_addr, signal_names):
+    """A handle for packing the message with the values of signal_names, in that order, without
+    looking them up each time. For make_can_msg_handle and pack_many"""
+    if type(name_or_addr) != int:
+      name_or_addr = self.name_to_address_and_size[name_or_addr.encode('utf8')][0]
+    cdef vector[string] names = [n.encode('utf8') for n in signal_names]
+    cdef int h = self.packer.handle(name_or_addr, names)
+    if h < 0:
+      raise KeyError(name_or_addr)
+    return h
+
+  cdef pack_handle(self, int handle, bus, values, int counter):
+    self.handle_values = values
+    cdef uint64_t val = self.ReverseBytes(self.packer.pack(handle, self.handle_values.data(), counter))
+    return [self.packer.handle_address(handle), 0, (<char *>&val)[:self.packer.handle_size(handle)], bus]
+
+  def make_can_msg_handle(self, int handle, bus, values, int counter=-1):
+    """make_can_msg with values a sequence in the handle's signal order"""
+    return self.pack_handle(handle, bus, values, counter)
+
+  def pack_many(self, msgs):
+    """The can messages of (handle, bus, values, counter) in msgs, all of one sendcan in one call"""
+    return [self.pack_handle(handle, bus, values, counter) for handle, bus, values, counter in msgs]
+
+  def pack_arrays(self, msgs):
+    """pack_many into the packed arrays can_arrays_to_can_capnp takes, (addresses, dat, lens, buses), for
+    building the sendcan without a list of the messages in between"""
+    cdef int n = len(msgs)
+    cdef array.array addresses = array.clone(UINT32_ARRAY, n, zero=False)
+    cdef array.array dat = array.clone(UINT8_ARRAY, 8 * n, zero=False)
+    cdef array.array lens = array.clone(UINT8_ARRAY, n, zero=False)
+    cdef array.array buses = array.clone(UINT8_ARRAY, n, zero=False)
+
+    cdef int i = 0, h, size, offset = 0
+    cdef uint64_t val
+    for handle, bus, values, counter in msgs:
+      h = handle
+      self.handle_values = values
+      val = self.ReverseBytes(self.packer.pack(h, self.handle_values.data(), counter))
+      size = self.packer.handle_size(h)
+      addresses.data.as_uints[i] = self.packer.handle_address(h)
+      memcpy(&dat.data.as_uchars[offset], &val, size)
+      lens.data.as_uchars[i] = size
+      buses.data.as_uchars[i] = bus
+      offset += size
+      i += 1
+    array.resize(dat, offset)
+    return addresses, dat, lens, buses
@@ -1,6 +1,8 @@
 #include <cassert>
 #include <cstring>
+#include <cmath>
 
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -14,71 +16,96 @@
 #define INFO printf
 
 
-bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
-  uint64_t dat_le = read_u64_le(dat);
-  uint64_t dat_be = read_u64_be(dat);
-
+void MessageState::compile() {
   for (int i=0; i < parse_sigs.size(); i++) {
-    auto& sig = parse_sigs[i];
-    int64_t tmp;
-
-    if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
-    } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
+    const auto& sig = parse_sigs[i];
+    big_endian.push_back(!sig.is_little_endian);
+    shift.push_back(sig.is_little_endian ? sig.b1 : sig.bo);
+    mask.push_back(sig.b2 >= 64 ? ~0ULL : (1ULL << sig.b2) - 1);
+    sign_bit.push_back(sig.is_signed ? (1ULL << (sig.b2 - 1)) : 0);
+    factor.push_back(sig.factor);
+    offset.push_back(sig.offset);
+    (sig.is_little_endian ? needs_le : needs_be) = true;
+
+    switch (sig.type) {
+      case SignalType::VOLKSWAGEN_CHECKSUM:
+      case SignalType::CHRYSLER_CHECKSUM:
+        checksum_sig = i;
+        needs_le = true;
+        break;
+      case SignalType::HONDA_CHECKSUM:
+      case SignalType::TOYOTA_CHECKSUM:
+      case SignalType::SUBARU_CHECKSUM:
+      case SignalType::PEDAL_CHECKSUM:
+        checksum_sig = i;
+        needs_be = true;
+        break;
+      case SignalType::HONDA_COUNTER:
+      case SignalType::VOLKSWAGEN_COUNTER:
+      case SignalType::PEDAL_COUNTER:
+        counter_sig = i;
+        break;
+      default:
+        break;
     }
+  }
+}
 
-    if (sig.is_signed) {
-      tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
+bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
+  // indexed by big_endian
+  const uint64_t words[2] = {needs_le ? read_u64_le(dat) : 0, needs_be ? read_u64_be(dat) : 0};
+  auto extract = [&](int i) {
+    uint64_t raw = (words[big_endian[i]] >> shift[i]) & mask[i];
+    return (int64_t)((raw ^ sign_bit[i]) - sign_bit[i]);
+  };
+
+  if (checksum_sig >= 0) {
+    int64_t tmp = extract(checksum_sig);
+    bool ok = true;
+    switch (parse_sigs[checksum_sig].type) {
+      case SignalType::HONDA_CHECKSUM:
+        ok = honda_checksum(address, words[1], size) == tmp;
+        break;
+      case SignalType::TOYOTA_CHECKSUM:
+        ok = toyota_checksum(address, words[1], size) == tmp;
+        break;
+      case SignalType::VOLKSWAGEN_CHECKSUM:
+        ok = volkswagen_crc(address, words[0], size) == tmp;
+        break;
+      case SignalType::SUBARU_CHECKSUM:
+        ok = subaru_checksum(address, words[1], size) == tmp;
+        break;
+      case SignalType::CHRYSLER_CHECKSUM:
+        ok = chrysler_checksum(address, words[0], size) == tmp;
+        break;
+      case SignalType::PEDAL_CHECKSUM:
+        ok = pedal_checksum(words[1], size) == tmp;
+        break;
+      default:
+        break;
     }
+    if (!ok) {
+      INFO("0x%X CHECKSUM FAIL\n", address);
+      checksum_errors++;
+      return false;
+    }
+  }
 
-    DEBUG("parse 0x%X %s -> %lld\n", address, sig.name, tmp);
+  if (counter_sig >= 0 && !update_counter_generic(extract(counter_sig), parse_sigs[counter_sig].b2)) {
+    return false;
+  }
 
-    if (sig.type == SignalType::HONDA_CHECKSUM) {
-      if (honda_checksum(address, dat_be, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
-        return false;
-      }
-    } else if (sig.type == SignalType::HONDA_COUNTER) {
-      if (!update_counter_generic(tmp, sig.b2)) {
-        return false;
-      }
-    } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      if (toyota_checksum(address, dat_be, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
-        return false;
-      }
-    } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-      if (volkswagen_crc(address, dat_le, size) != tmp) {
-        INFO("0x%X CRC FAIL\n", address);
-        return false;
-      }
-    } else if (sig.type == SignalType::VOLKSWAGEN_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-        return false;
-      }
-    } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      if (subaru_checksum(address, dat_be, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
-        return false;
-      }
-    } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      if (chrysler_checksum(address, dat_le, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
-        return false;
-      }
-    } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
-      if (pedal_checksum(dat_be, size) != tmp) {
-        INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
-        return false;
-      }
-    } else if (sig.type == SignalType::PEDAL_COUNTER) {
-      if (!update_counter_generic(tmp, sig.b2)) {
-        return false;
-      }
+  if (decode) {
+    decode(dat, decoded.data());
+    for (int i=0; i < vals.size(); i++) {
+      vals[i] = decoded[decode_index[i]];
+    }
+  } else {
+    for (int i=0; i < vals.size(); i++) {
+      int64_t tmp = extract(i);
+      DEBUG("parse 0x%X %s -> %lld\n", address, parse_sigs[i].name, tmp);
+      vals[i] = tmp * factor[i] + offset[i];
     }
-
-    vals[i] = tmp * sig.factor + sig.offset;
   }
   ts = ts_;
   seen = sec;
@@ -92,6 +119,7 @@ bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
   counter = v;
   if (((old_counter+1) & ((1 << cnt_size) -1)) != v) {
     counter_fail += 1;
+    counter_errors++;
     if (counter_fail > 1) {
       INFO("0x%X COUNTER FAIL %d -- %d vs %d\n", address, counter_fail, old_counter, (int)v);
     }
@@ -105,6 +133,28 @@ bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
 }
 
 
+static size_t ext_hash(uint32_t address) {
+  return (address * 2654435761U) >> 16;
+}
+
+// the frames of a can event, or of boardd's per bus ones, or of sendcan
+static capnp::List<cereal::CanData>::Reader event_cans(const cereal::Event::Reader &event, bool sendcan) {
+  if (sendcan) return event.getSendcan();
+  switch (event.which()) {
+    case cereal::Event::CAN0: return event.getCan0();
+    case cereal::Event::CAN1: return event.getCan1();
+    case cereal::Event::CAN2: return event.getCan2();
+    default: return event.getCan();
+  }
+}
+
+// rxTime is nanos since boot
+static uint64_t boottime_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
 CANParser::CANParser(int abus, const std::string& dbc_name,
           const std::vector<MessageParseOptions> &options,
           const std::vector<SignalParseOptions> &sigoptions)
@@ -139,6 +189,8 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
     }
 
     state.size = msg->size;
+    state.decode = msg->decode;
+    state.decoded.resize(msg->num_sigs);
 
     // track checksums and counters for this message
     for (int i=0; i<msg->num_sigs; i++) {
@@ -146,6 +198,7 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
       if (sig->type != SignalType::DEFAULT) {
         state.parse_sigs.push_back(*sig);
         state.vals.push_back(0);
+        state.decode_index.push_back(i);
       }
     }
 
@@ -159,46 +212,133 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
             && sig->type == SignalType::DEFAULT) {
           state.parse_sigs.push_back(*sig);
           state.vals.push_back(sigop.default_value);
+          state.decode_index.push_back(i);
           break;
         }
       }
 
     }
 
-    message_states[state.address] = state;
+    state.compile();
+    message_states.push_back(state);
   }
-}
 
-void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
-    int msg_count = cans.size();
+  updated.resize((message_states.size() + 63) / 64);
 
-    DEBUG("got %d messages\n", msg_count);
+  size_t ext_count = 0;
+  for (const auto& state : message_states) {
+    ext_count += state.address >= std_slots.size();
+  }
+  size_t ext_size = 8;
+  while (ext_size < ext_count * 2) ext_size *= 2;
+  ext_addresses.resize(ext_size);
+  ext_slots.resize(ext_size, -1);
+
+  for (int16_t slot = 0; slot < message_states.size(); slot++) {
+    uint32_t address = message_states[slot].address;
+    if (address < std_slots.size()) {
+      std_slots[address] = slot;
+      continue;
+    }
+    size_t i = ext_hash(address) & (ext_size - 1);
+    while (ext_slots[i] != -1) i = (i + 1) & (ext_size - 1);
+    ext_addresses[i] = address;
+    ext_slots[i] = slot;
+  }
+}
 
-    // parse the messages
-    for (int i = 0; i < msg_count; i++) {
-      auto cmsg = cans[i];
-      if (cmsg.getSrc() != bus) {
-        // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
-        continue;
-      }
-      auto state_it = message_states.find(cmsg.getAddress());
-      if (state_it == message_states.end()) {
-        // DEBUG("skip %d: not specified\n", cmsg.getAddress());
-        continue;
+MessageState *CANParser::find_state(uint32_t address) {
+  int16_t slot = -1;
+  if (address < std_slots.size()) {
+    slot = std_slots[address];
+  } else {
+    for (size_t i = ext_hash(address) & (ext_slots.size() - 1); ext_slots[i] != -1; i = (i + 1) & (ext_slots.size() - 1)) {
+      if (ext_addresses[i] == address) {
+        slot = ext_slots[i];
+        break;
       }
+    }
+  }
+  return slot == -1 ? nullptr : &message_states[slot];
+}
 
-      if (cmsg.getDat().size() > 8) continue; //shouldn't ever happen
-      uint8_t dat[8] = {0};
-      memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
+static void update_stats(MessageStats &s, uint64_t time) {
+  if (s.frames > 0 && time > s.last_time) {
+    uint64_t us = (time - s.last_time) / 1000;
+    int bucket = us == 0 ? 0 : 63 - __builtin_clzll(us);
+    s.interval_histogram[std::min(bucket, CAN_STATS_BUCKETS - 1)]++;
 
-      state_it->second.parse(sec, cmsg.getBusTime(), dat);
+    double dt = (time - s.last_time) * 1e-9;
+    if (s.interval == 0) {
+      s.interval = dt;
+    } else {
+      s.jitter += CAN_STATS_ALPHA * (std::abs(dt - s.interval) - s.jitter);
+      s.interval += CAN_STATS_ALPHA * (dt - s.interval);
     }
+  }
+  s.frames++;
+  s.last_time = time;
+}
+
+void CANParser::enable_stats() {
+  stats.resize(message_states.size());
+}
+
+void CANParser::UpdateCan(uint64_t sec, uint64_t now, const cereal::CanData::Reader& cmsg) {
+  MessageState *state = find_state(cmsg.getAddress());
+  if (!state) {
+    // DEBUG("skip %d: not specified\n", cmsg.getAddress());
+    return;
+  }
+  size_t slot = state - message_states.data();
+
+  uint64_t rx_time = cmsg.getRxTime();
+  if (rx_time != 0 && rx_time <= now) {
+    uint64_t bucket = (now - rx_time) / 1000 / CAN_LATENCY_BUCKET_US;
+    latency_histogram[std::min(bucket, (uint64_t)CAN_LATENCY_BUCKETS - 1)]++;
+  }
+  if (!stats.empty()) {
+    // the panda's receive time is closer to the bus than the event's
+    update_stats(stats[slot], rx_time != 0 ? rx_time : sec);
+  }
+
+  if (cmsg.getDat().size() > 8) return; //shouldn't ever happen
+  uint8_t dat[8] = {0};
+  memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
+
+  if (state->parse(sec, cmsg.getBusTime(), dat)) {
+    updated[slot / 64] |= 1ULL << (slot % 64);
+  }
+}
+
+void CANParser::BeginUpdate(uint64_t sec) {
+  last_sec = sec;
+  std::fill(updated.begin(), updated.end(), 0);
+}
+
+void CANParser::query_updated(std::vector<int> &slots) const {
+  slots.clear();
+  for (int w = 0; w < updated.size(); w++) {
+    for (uint64_t bits = updated[w]; bits != 0; bits &= bits - 1) {
+      slots.push_back(w * 64 + __builtin_ctzll(bits));
+    }
+  }
+}
+
+void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
+  DEBUG("got %d messages\n", cans.size());
+
+  uint64_t now = boottime_ns();
+  for (const auto cmsg : cans) {
+    if (cmsg.getSrc() == bus) {
+      UpdateCan(sec, now, cmsg);
+    }
+  }
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
   can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
       if (state.seen > 0) {
         DEBUG("0x%X TIMEOUT\n", state.address);
@@ -217,20 +357,85 @@ void CANParser::update_string(std::string data, bool sendcan) {
   capnp::FlatArrayMessageReader cmsg(amsg);
   cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
-  last_sec = event.getLogMonoTime();
+  BeginUpdate(event.getLogMonoTime());
 
-  auto cans = sendcan? event.getSendcan() : event.getCan();
+  auto cans = event_cans(event, sendcan);
   UpdateCans(last_sec, cans);
 
   UpdateValid(last_sec);
 }
 
+void CANParser::UpdateEvent(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans, int &invalid) {
+  last_sec = sec;
+  UpdateCans(sec, cans);
+  UpdateValid(sec);
+  invalid = can_valid ? 0 : invalid + 1;
+  if (record_history) {
+    RecordHistory(sec);
+  }
+}
+
+void CANParser::RecordHistory(uint64_t sec) {
+  if (history.empty()) {
+    size_t columns = 0;
+    for (const auto& state : message_states) {
+      columns += state.vals.size();
+    }
+    history.resize(columns);
+  }
+
+  history_times.push_back(sec);
+  auto column = history.begin();
+  for (const auto& state : message_states) {
+    for (double v : state.vals) {
+      (column++)->push_back(v);
+    }
+  }
+}
+
+int CANParser::update_strings(const std::vector<std::string> &data, bool sendcan) {
+  BeginUpdate(last_sec);
+
+  int invalid = 0;
+  for (const auto &d : data) {
+    size_t words = (d.length() / sizeof(capnp::word)) + 1;
+    if (aligned.size() < words) {
+      aligned = kj::heapArray<capnp::word>(words);
+    }
+    memcpy(aligned.begin(), d.data(), d.length());
+
+    capnp::FlatArrayMessageReader cmsg(kj::arrayPtr(aligned.begin(), words));
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    UpdateEvent(event.getLogMonoTime(), event_cans(event, sendcan), invalid);
+  }
+  return invalid;
+}
+
+int CANParser::update_log(const std::string &data, bool sendcan) {
+  BeginUpdate(last_sec);
+
+  auto words = kj::heapArray<capnp::word>(data.length() / sizeof(capnp::word));
+  memcpy(words.begin(), data.data(), words.size() * sizeof(capnp::word));
+
+  int invalid = 0;
+  const auto which = sendcan ? cereal::Event::SENDCAN : cereal::Event::CAN;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    capnp::FlatArrayMessageReader cmsg(remaining);
+    remaining = kj::arrayPtr(cmsg.getEnd(), remaining.end());
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    if (event.which() == which) {
+      UpdateEvent(event.getLogMonoTime(), sendcan ? event.getSendcan() : event.getCan(), invalid);
+    }
+  }
+  return invalid;
+}
+
 
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
 
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (last_sec != 0 && state.seen != last_sec) continue;
 
     for (int i=0; i<state.parse_sigs.size(); i++) {
@@ -246,3 +451,41 @@ std::vector<SignalValue> CANParser::query_latest() {
 
   return ret;
 }
+
+
+void CANParserGroup::add(CANParser *parser) {
+  parsers.push_back(parser);
+  if (parser->bus >= bus_parsers.size()) {
+    bus_parsers.resize(parser->bus + 1);
+  }
+  bus_parsers[parser->bus].push_back(parser);
+}
+
+void CANParserGroup::update_string(const std::string &data, bool sendcan) {
+  // same as CANParser::update_string, once for all of them
+  auto amsg = kj::heapArray<capnp::word>((data.length() / sizeof(capnp::word)) + 1);
+  memcpy(amsg.begin(), data.data(), data.length());
+
+  capnp::FlatArrayMessageReader cmsg(amsg);
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+  uint64_t sec = event.getLogMonoTime();
+  uint64_t now = boottime_ns();
+  for (auto parser : parsers) {
+    parser->BeginUpdate(sec);
+  }
+
+  auto cans = event_cans(event, sendcan);
+  for (const auto cmsg : cans) {
+    uint8_t src = cmsg.getSrc();
+    if (src < bus_parsers.size()) {
+      for (auto parser : bus_parsers[src]) {
+        parser->UpdateCan(sec, now, cmsg);
+      }
+    }
+  }
+
+  for (auto parser : parsers) {
+    parser->UpdateValid(sec);
+  }
+}
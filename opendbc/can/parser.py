@@ -1,2 +1,2 @@
-from opendbc.can.parser_pyx import CANParser, CANDefine  # pylint: disable=no-name-in-module, import-error
-assert CANParser, CANDefine
+from opendbc.can.parser_pyx import CANParser, CANParserGroup, CANDefine  # pylint: disable=no-name-in-module, import-error
+assert CANParser and CANParserGroup and CANDefine
@@ -9,10 +9,13 @@ from libcpp.map cimport map
 from libcpp cimport bool
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
+from .common cimport CANParserGroup as cpp_CANParserGroup
+from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC, MessageState, MessageStats
+from .common cimport CAN_LATENCY_BUCKET_US
 
 import os
 import numbers
+import numpy as np
 from collections import defaultdict
 
 cdef int CAN_INVALID_CNT = 5
@@ -25,6 +28,11 @@ cdef class CANParser:
     map[uint32_t, string] address_to_msg_name
     vector[SignalValue] can_values
     bool test_mode_enabled
+    vector[int] updated_slots
+    # by the parser's message slot
+    list slot_sig_names
+    list slot_vl
+    list slot_ts
 
   cdef readonly:
     string dbc_name
@@ -54,10 +62,8 @@ cdef class CANParser:
 
       self.msg_name_to_address[name] = msg.address
       self.address_to_msg_name[msg.address] = name
-      self.vl[msg.address] = {}
-      self.vl[name] = {}
-      self.ts[msg.address] = {}
-      self.ts[name] = {}
+      self.vl[msg.address] = self.vl[name] = {}
+      self.ts[msg.address] = self.ts[name] = {}
 
     # Convert message names into addresses
     for i in range(len(signals)):
@@ -93,47 +99,162 @@ cdef class CANParser:
       message_options_v.push_back(mpo)
 
     self.can = new cpp_CANParser(bus, dbc_name, message_options_v, signal_options_v)
-    self.update_vl()
 
-  cdef unordered_set[uint32_t] update_vl(self):
-    cdef string sig_name
+    # the names and dicts each message's values go to, made once
+    self.slot_sig_names, self.slot_vl, self.slot_ts = [], [], []
+    cdef const MessageState *state
+    for slot in range(self.can.states().size()):
+      state = &self.can.states()[slot]
+      self.slot_sig_names.append([<unicode>sig.name for sig in state.parse_sigs])
+      self.slot_vl.append(self.vl[state.address])
+      self.slot_ts.append(self.ts[state.address])
+      self.update_slot(slot)
+
+  cdef void update_slot(self, int slot):
+    cdef const MessageState *state = &self.can.states()[slot]
+    cdef list names = self.slot_sig_names[slot]
+    cdef dict vl = self.slot_vl[slot]
+    cdef dict ts = self.slot_ts[slot]
+    for i in range(len(names)):
+      vl[names[i]] = state.vals[i]
+      ts[names[i]] = state.ts
+
+  cdef unordered_set[uint32_t] update_vl(self, int events, int invalid):
     cdef unordered_set[uint32_t] updated_val
 
-    can_values = self.can.query_latest()
-    valid = self.can.can_valid
+    self.can.query_updated(self.updated_slots)
 
-    # Update invalid flag
-    self.can_invalid_cnt += 1
-    if valid:
-        self.can_invalid_cnt = 0
+    # Update invalid flag, invalid is how many of the last events in a row weren't valid
+    if invalid < events:
+      self.can_invalid_cnt = invalid
+    else:
+      self.can_invalid_cnt += events
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
 
 
-    for cv in can_values:
-      # Cast char * directly to unicode
-      name = <unicode>self.address_to_msg_name[cv.address].c_str()
-      cv_name = <unicode>cv.name
-
-      self.vl[cv.address][cv_name] = cv.value
-      self.ts[cv.address][cv_name] = cv.ts
-
-      self.vl[name][cv_name] = cv.value
-      self.ts[name][cv_name] = cv.ts
-
-      updated_val.insert(cv.address)
+    for slot in self.updated_slots:
+      self.update_slot(slot)
+      updated_val.insert(self.can.states()[slot].address)
 
     return updated_val
 
+  def signal_view(self, msg):
+    """The parsed signal names of message msg, by name or address, and a numpy view of their values
+    that updates in place, for reading them without the vl dicts"""
+    address = self.msg_name_to_address[msg.encode('utf8')] if isinstance(msg, str) else msg
+    cdef const MessageState *state
+    for slot in range(self.can.states().size()):
+      state = &self.can.states()[slot]
+      if state.address == address:
+        if state.vals.size() == 0:
+          return [], np.zeros(0)
+        return list(self.slot_sig_names[slot]), np.asarray(<double[:state.vals.size()]> <double *>state.vals.data())
+    raise KeyError(msg)
+
   def update_string(self, dat, sendcan=False):
     self.can.update_string(dat, sendcan)
-    return self.update_vl()
+    return self.update_vl(1, 0 if self.can.can_valid else 1)
+
+  @property
+  def latency_histogram(self):
+    """Parsed messages counted by their receive latency, in latency_bucket_us buckets. The last bucket has the rest"""
+    return list(self.can.latency_histogram)
+
+  @property
+  def latency_bucket_us(self):
+    return CAN_LATENCY_BUCKET_US
+
+  def enable_stats(self):
+    """Start keeping each message's rate, interval histogram and checksum and counter errors, for stats()"""
+    self.can.enable_stats()
+
+  @property
+  def bus(self):
+    return self.can.get_bus()
+
+  def stats(self):
+    """The stats of every message, as the fields of a canStats entry"""
+    ret = []
+    cdef const MessageState *state
+    cdef const MessageStats *s
+    for slot in range(self.can.stats.size()):
+      state = &self.can.states()[slot]
+      s = &self.can.stats[slot]
+      ret.append({
+        'address': state.address,
+        'bus': self.can.get_bus(),
+        'frames': s.frames,
+        'rateHz': 1. / s.interval if s.interval > 0 else 0.,
+        'jitterMs': s.jitter * 1e3,
+        'intervalHistogram': list(s.interval_histogram),
+        'checksumErrors': state.checksum_errors,
+        'counterErrors': state.counter_errors,
+      })
+    return ret
+
+  def update_strings(self, strings, sendcan=False):
+    cdef vector[string] data = strings
+    if data.size() == 0:
+      return set()
+    cdef int invalid = self.can.update_strings(data, sendcan)
+    return self.update_vl(data.size(), invalid)
+
+  def update_log(self, log, sendcan=False):
+    """Parses every can (or sendcan) event of log, the bytes of an uncompressed rlog or its path,
+    .bz2 ones are decompressed. Returns the addresses updated by any of them"""
+    if isinstance(log, str):
+      with open(log, 'rb') as f:
+        log = f.read()
+      if log[:3] == b'BZh':
+        import bz2
+        log = bz2.decompress(log)
+    cdef string data = log
+    cdef int invalid = self.can.update_log(data, sendcan)
+    # validity goes as if it were one event
+    return self.update_vl(1, min(invalid, 1))
+
+  def record_history(self, enable=True):
+    """Keep the values after each event of update_strings and update_log, for history()"""
+    self.can.record_history = enable
+
+  def history(self):
+    """The recorded events' logMonoTime and the values after each, as numpy arrays by message
+    (name and address, like vl) and signal name"""
+    times = np.array(self.can.history_times, dtype=np.uint64)
+    hist = {}
+    cdef int column = 0
+    for slot in range(self.can.states().size()):
+      address = self.can.states()[slot].address
+      sigs = {}
+      for name in self.slot_sig_names[slot]:
+        sigs[name] = np.array(self.can.history[column]) if column < self.can.history.size() else np.zeros(0)
+        column += 1
+      hist[address] = sigs
+      hist[self.address_to_msg_name[address].decode('utf8')] = sigs
+    return times, hist
+
+cdef class CANParserGroup:
+  """CANParsers of the same can strings, each string is read once and every frame goes only to the parsers on its bus"""
+  cdef:
+    cpp_CANParserGroup group
+
+  cdef readonly:
+    list parsers
+
+  def __init__(self, parsers):
+    self.parsers = list(parsers)
+    cdef CANParser p
+    for p in self.parsers:
+      self.group.add(p.can)
 
   def update_strings(self, strings, sendcan=False):
     updated_vals = set()
+    cdef CANParser p
 
     for s in strings:
-      updated_val = self.update_string(s, sendcan)
-      updated_vals.update(updated_val)
+      self.group.update_string(s, sendcan)
+      for p in self.parsers:
+        updated_vals.update(p.update_vl(1, 0 if p.can.can_valid else 1))
 
     return updated_vals
 
@@ -1,23 +1,65 @@
 #!/usr/bin/env python3
 from __future__ import print_function
+import hashlib
 import os
+import struct
 import sys
 
-import jinja2
-
 from collections import Counter
 from opendbc.can.dbc import dbc
 
-def process(in_fn, out_fn):
-  dbc_name = os.path.split(out_fn)[-1].replace('.cc', '')
-  # print("processing %s: %s -> %s" % (dbc_name, in_fn, out_fn))
+# The bundle libdbc maps the DBC tables from, read by dbc.cc. Little endian, offsets from the start
+# of the file and strings NUL terminated:
+#   header  magic, number of DBCs
+#   index   per DBC its name, hash, and the offset and size of its tables
+#   tables  per DBC the message, val and signal counts, then the messages, the vals and the
+#           signals, 8 byte aligned. A message's signals are num_sigs from its first_sig
+#   strings
+BUNDLE_MAGIC = b"DBCBNDL1"
+BUNDLE_HEADER = struct.Struct("<8sII")
+BUNDLE_INDEX = struct.Struct("<IIQIII4x")
+BUNDLE_TABLES = struct.Struct("<III4x")
+BUNDLE_MSG = struct.Struct("<IIIII4x")
+BUNDLE_VAL = struct.Struct("<IIII")
+BUNDLE_SIGNAL = struct.Struct("<IiiiBBBxxxxxdd")
 
-  template_fn = os.path.join(os.path.dirname(__file__), "dbc_template.cc")
+# the SignalType enum of common_dbc.h
+SIGNAL_TYPES = ["DEFAULT", "HONDA_CHECKSUM", "HONDA_COUNTER", "TOYOTA_CHECKSUM", "PEDAL_CHECKSUM", "PEDAL_COUNTER",
+                "VOLKSWAGEN_CHECKSUM", "VOLKSWAGEN_COUNTER", "SUBARU_CHECKSUM", "CHRYSLER_CHECKSUM"]
 
-  with open(template_fn, "r") as template_f:
-    template = jinja2.Template(template_f.read(), trim_blocks=True, lstrip_blocks=True)
+def layout(sig):
+  """Bit layout of a signal for the generated decode and encode, same as the Signal table"""
+  if sig.is_little_endian:
+    b1 = sig.start_bit
+  else:
+    b1 = (sig.start_bit//8)*8 + (-sig.start_bit-1) % 8
+  bo = 64 - (b1 + sig.size)
+  shift = b1 if sig.is_little_endian else bo
+  mask = (1 << sig.size) - 1
+  # CANPacker works in the big endian word and byte swaps little endian signals into it
+  encode_mask = mask << shift
+  if sig.is_little_endian:
+    encode_mask = int.from_bytes(encode_mask.to_bytes(8, 'little'), 'big')
+  return {"shift": shift, "mask": "0x%XULL" % mask, "encode_mask": "0x%XULL" % encode_mask}
+
+def dbc_hash(in_fn):
+  """Ties a DBC's generated code to its tables in the bundle"""
+  with open(in_fn, "rb") as f:
+    return struct.unpack("<Q", hashlib.sha256(f.read()).digest()[:8])[0]
 
+def signal_type(checksum_type, address, sig):
+  if checksum_type is not None and sig.name in ("CHECKSUM", "COUNTER"):
+    name = "%s_%s" % (checksum_type.upper(), sig.name)
+    if name in SIGNAL_TYPES:
+      return SIGNAL_TYPES.index(name)
+  if address in [512, 513] and sig.name in ("CHECKSUM_PEDAL", "COUNTER_PEDAL"):
+    return SIGNAL_TYPES.index("PEDAL_" + sig.name.split("_")[0])
+  return SIGNAL_TYPES.index("DEFAULT")
+
+def load(in_fn):
+  """The DBC's messages with signals, counter and checksum first, its checksum type and its vals"""
   can_dbc = dbc(in_fn)
+  dbc_name = can_dbc.name
 
   # process counter and checksums first
   msgs = [(address, msg_name, msg_size, sorted(msg_sigs, key=lambda s: s.name not in ("COUNTER", "CHECKSUM")))
@@ -104,10 +146,97 @@ def process(in_fn, out_fn):
     if count > 1:
       sys.exit("%s: Duplicate message name in DBC file %s" % (dbc_name, name))
 
-  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len)
+  return can_dbc, checksum_type, msgs, def_vals
+
+def process(in_fn, out_fn):
+  """Generates the decoders and encoders of a DBC, its tables go in the bundle"""
+  import jinja2
+
+  template_fn = os.path.join(os.path.dirname(__file__), "dbc_template.cc")
+  with open(template_fn, "r") as template_f:
+    template = jinja2.Template(template_f.read(), trim_blocks=True, lstrip_blocks=True)
+
+  can_dbc, _, msgs, _ = load(in_fn)
+  code = template.render(dbc=can_dbc, msgs=msgs, hash=dbc_hash(in_fn), layout=layout)
+
+  with open(out_fn, "w") as out_f:
+    out_f.write(code)
 
+def write_code_index(dbc_names, out_fn):
+  """The table of every DBC's generated code, looked up by name without static initializers"""
+  lines = ['#include "common_dbc.h"', '']
+  lines += ['extern const DbcCode %s_code;' % name for name in dbc_names]
+  lines += ['', 'const DbcCode *const dbc_codes[] = {']
+  lines += ['  &%s_code,' % name for name in dbc_names]
+  lines += ['};', 'const size_t dbc_codes_count = ARRAYSIZE(dbc_codes);', '']
   with open(out_fn, "w") as out_f:
-    out_f.write(parser_code)
+    out_f.write("\n".join(lines))
+
+def write_bundle(in_fns, out_fn):
+  strings = bytearray()
+  string_offsets = {}
+
+  def string(s):
+    if s not in string_offsets:
+      string_offsets[s] = len(strings)
+      strings.extend(s.encode() + b"\0")
+    return string_offsets[s]
+
+  # the strings go last, their offsets are fixed up once the tables' size is known
+  tables = bytearray()
+  index = []
+  fixups = []  # (position in tables, string offset)
+
+  def add_string(pos, s):
+    fixups.append((pos, string(s)))
+
+  for in_fn in in_fns:
+    can_dbc, checksum_type, msgs, def_vals = load(in_fn)
+    while len(tables) % 8:
+      tables.append(0)
+    start = len(tables)
+    vals = [(address, sg_name, def_val) for address, sig in def_vals for sg_name, def_val in sig]
+    tables += BUNDLE_TABLES.pack(len(msgs), len(vals), sum(len(sigs) for _, _, _, sigs in msgs))
+
+    msg_idx = {}
+    first_sig = 0
+    for i, (address, msg_name, msg_size, sigs) in enumerate(msgs):
+      add_string(len(tables), msg_name)
+      tables += BUNDLE_MSG.pack(0, address, msg_size, len(sigs), first_sig)
+      msg_idx[address] = i
+      first_sig += len(sigs)
+
+    for address, sg_name, def_val in vals:
+      # the C string literal the generated tables had
+      add_string(len(tables), sg_name)
+      tables += BUNDLE_VAL.pack(0, address, 0, msg_idx[address])
+      fixups.append((len(tables) - BUNDLE_VAL.size + 8, string(def_val[1:-1].replace(r"\?", "?"))))
+
+    for address, _, _, sigs in msgs:
+      for sig in sigs:
+        if sig.is_little_endian:
+          b1 = sig.start_bit
+        else:
+          b1 = (sig.start_bit//8)*8 + (-sig.start_bit-1) % 8
+        add_string(len(tables), sig.name)
+        tables += BUNDLE_SIGNAL.pack(0, b1, sig.size, 64 - (b1 + sig.size), sig.is_signed, sig.is_little_endian,
+                                     signal_type(checksum_type, address, sig), sig.factor, sig.offset)
+
+    index.append((can_dbc.name, dbc_hash(in_fn), start, len(tables) - start))
+
+  tables_offset = BUNDLE_HEADER.size + BUNDLE_INDEX.size * len(index)
+  strings_offset = tables_offset + len(tables)
+  for pos, offset in fixups:
+    struct.pack_into("<I", tables, pos, strings_offset + offset)
+
+  out = bytearray(BUNDLE_HEADER.pack(BUNDLE_MAGIC, len(index), 0))
+  index_strings = [string(name) for name, _, _, _ in index]
+  for (name, h, start, size), name_offset in zip(index, index_strings):
+    out += BUNDLE_INDEX.pack(strings_offset + name_offset, 0, h, tables_offset + start, size, 0)
+  out += tables + strings
+
+  with open(out_fn, "wb") as out_f:
+    out_f.write(out)
 
 def main():
   if len(sys.argv) != 3:
@@ -0,0 +1,158 @@
+// Checks the checksums in common.cc against the byte at a time versions they replaced, and times both
+//   benchmark_checksums [frames]
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "common.h"
+
+extern uint8_t crc8_lut_8h2f[256];
+
+namespace scalar {
+
+unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8);
+  d >>= 4;
+  int s = 0;
+  while (address) { s += (address & 0xF); address >>= 4; }
+  while (d) { s += (d & 0xF); d >>= 4; }
+  s = 8-s;
+  s &= 0xF;
+  return s;
+}
+
+unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8);
+  d >>= 8;
+  unsigned int s = l;
+  while (address) { s += address & 0xFF; address >>= 8; }
+  while (d) { s += d & 0xFF; d >>= 8; }
+  return s & 0xFF;
+}
+
+unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8);
+  unsigned int s = 0;
+  while (address) { s += address & 0xFF; address >>= 8; }
+  l -= 1;
+  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
+  return s & 0xFF;
+}
+
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+  uint8_t checksum = 0xFF;
+  for (int j = 0; j < (l - 1); j++) {
+    uint8_t shift = 0x80;
+    uint8_t curr = (d >> 8*j) & 0xFF;
+    for (int i=0; i<8; i++) {
+      uint8_t bit_sum = curr & shift;
+      uint8_t temp_chk = checksum & 0x80U;
+      if (bit_sum != 0U) {
+        bit_sum = 0x1C;
+        if (temp_chk != 0U) {
+          bit_sum = 1;
+        }
+        checksum = checksum << 1;
+        temp_chk = checksum | 1U;
+        bit_sum ^= temp_chk;
+      } else {
+        if (temp_chk != 0U) {
+          bit_sum = 0x1D;
+        }
+        checksum = checksum << 1;
+        bit_sum ^= checksum;
+      }
+      checksum = bit_sum;
+      shift = shift >> 1;
+    }
+  }
+  return ~checksum & 0xFF;
+}
+
+// only the CRC of the payload, the final padding byte is the same in both
+unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
+  uint8_t crc = 0xFF;
+  for (int i = 1; i < l; i++) {
+    crc ^= (d >> (i*8)) & 0xFF;
+    crc = crc8_lut_8h2f[crc];
+  }
+  crc ^= 0x86;  // LWI_01
+  crc = crc8_lut_8h2f[crc];
+  return crc ^ 0xFF;
+}
+
+unsigned int pedal_checksum(uint64_t d, int l) {
+  uint8_t crc = 0xFF;
+  uint8_t poly = 0xD5;
+  d >>= ((8-l)*8);
+  d >>= 8;
+  for (int i = 0; i < l - 1; i++) {
+    crc ^= (d >> (i*8)) & 0xFF;
+    for (int j = 0; j < 8; j++) {
+      if ((crc & 0x80) != 0) {
+        crc = (uint8_t)((crc << 1) ^ poly);
+      } else {
+        crc <<= 1;
+      }
+    }
+  }
+  return crc;
+}
+
+}  // namespace scalar
+
+int main(int argc, char** argv) {
+  const size_t n = argc > 1 ? atol(argv[1]) : 1000000;
+  init_crc_lookup_tables();
+
+  std::mt19937_64 rng(0);
+  std::vector<uint64_t> frames(n);
+  for (auto &d : frames) d = rng();
+  std::vector<unsigned int> out(n);
+
+  struct Checksum {
+    const char *name;
+    SignalType type;
+    unsigned int address;
+    unsigned int (*scalar)(unsigned int address, uint64_t d, int l);
+  };
+  auto pedal = [](unsigned int, uint64_t d, int l) { return scalar::pedal_checksum(d, l); };
+  const Checksum checksums[] = {
+    {"honda", SignalType::HONDA_CHECKSUM, 0x1FA, scalar::honda_checksum},
+    {"toyota", SignalType::TOYOTA_CHECKSUM, 0x2E4, scalar::toyota_checksum},
+    {"subaru", SignalType::SUBARU_CHECKSUM, 0x122, scalar::subaru_checksum},
+    {"chrysler", SignalType::CHRYSLER_CHECKSUM, 0x292, scalar::chrysler_checksum},
+    {"volkswagen", SignalType::VOLKSWAGEN_CHECKSUM, 0x86, scalar::volkswagen_crc},
+    {"pedal", SignalType::PEDAL_CHECKSUM, 0x201, pedal},
+  };
+
+  int failed = 0;
+  for (const auto &c : checksums) {
+    for (int l = 1; l <= 8; l++) {
+      checksum_many(c.type, c.address, l, frames.data(), out.data(), n);
+      for (size_t i = 0; i < n; i++) {
+        if (out[i] != c.scalar(c.address, frames[i], l)) {
+          fprintf(stderr, "%s mismatch, length %d frame %016lx\n", c.name, l, frames[i]);
+          failed = 1;
+          break;
+        }
+      }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    unsigned int sum = 0;
+    for (size_t i = 0; i < n; i++) sum += c.scalar(c.address, frames[i], 8);
+    double scalar_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    checksum_many(c.type, c.address, 8, frames.data(), out.data(), n);
+    double batch_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    for (size_t i = 0; i < n; i++) sum -= out[i];
+
+    printf("%-10s %6.2f ns scalar, %6.2f ns batch per frame%s\n", c.name, scalar_ns / n, batch_ns / n, sum ? " (wrong)" : "");
+  }
+  return failed;
+}
@@ -0,0 +1,76 @@
+// Times CANParser over the can events of a log, parsing every signal of every message in the DBC
+//   benchmark_parser <dbc name> <bus> <uncompressed rlog> [passes]
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s <dbc name> <bus> <uncompressed rlog> [passes]\n", argv[0]);
+    return 1;
+  }
+  const int bus = atoi(argv[2]);
+  const int passes = argc > 4 ? atoi(argv[4]) : 10;
+
+  const DBC *dbc = dbc_lookup(argv[1]);
+  if (!dbc) {
+    fprintf(stderr, "unknown dbc %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    options.push_back({.address = msg.address, .check_frequency = 0});
+    for (int j = 0; j < msg.num_sigs; j++) {
+      sigoptions.push_back({.address = msg.address, .name = msg.sigs[j].name, .default_value = 0});
+    }
+  }
+  CANParser parser(bus, argv[1], options, sigoptions);
+
+  std::ifstream f(argv[3], std::ios::binary | std::ios::ate);
+  if (!f) {
+    fprintf(stderr, "can't read %s\n", argv[3]);
+    return 1;
+  }
+  size_t size = f.tellg();
+  auto words = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  f.seekg(0);
+  f.read((char *)words.begin(), words.size() * sizeof(capnp::word));
+
+  std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> events;
+  size_t msgs = 0;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    auto reader = std::make_unique<capnp::FlatArrayMessageReader>(remaining);
+    remaining = kj::arrayPtr(reader->getEnd(), remaining.end());
+    auto event = reader->getRoot<cereal::Event>();
+    if (event.which() == cereal::Event::CAN) {
+      msgs += event.getCan().size();
+      events.push_back(std::move(reader));
+    }
+  }
+  if (events.empty()) {
+    fprintf(stderr, "no can events in %s\n", argv[3]);
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; pass++) {
+    for (auto &reader : events) {
+      auto event = reader->getRoot<cereal::Event>();
+      parser.UpdateCans(event.getLogMonoTime(), event.getCan());
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  printf("%zu events, %zu messages, %d passes\n", events.size(), msgs, passes);
+  printf("%.1f ns per event, %.1f ns per message\n", ns / passes / events.size(), ns / passes / msgs);
+  return 0;
+}
@@ -2,7 +2,7 @@
 import unittest
 
 import cereal.messaging as messaging
-from opendbc.can.parser import CANParser
+from opendbc.can.parser import CANParser, CANParserGroup
 from opendbc.can.packer import CANPacker
 
 # Python implementation so we don't have to depend on boardd
@@ -11,10 +11,7 @@ def can_list_to_can_capnp(can_msgs, msgtype='can'):
   dat.init(msgtype, len(can_msgs))
 
   for i, can_msg in enumerate(can_msgs):
-    if msgtype == 'sendcan':
-      cc = dat.sendcan[i]
-    else:
-      cc = dat.can[i]
+    cc = getattr(dat, msgtype)[i]
 
     cc.address = can_msg[0]
     cc.busTime = can_msg[1]
@@ -58,6 +55,18 @@ class TestCanParserPacker(unittest.TestCase):
 
         idx += 1
 
+  def test_bus_service(self):
+    dbc_file = "honda_civic_touring_2016_can_generated"
+    parser = CANParser(dbc_file, [("STEER_TORQUE", "STEERING_CONTROL", 0)], [], 2)
+    packer = CANPacker(dbc_file)
+    self.assertEqual(parser.bus, 2)
+
+    # boardd's can2 has only bus 2's frames, the parser reads it like can
+    for msgtype, steer in [('can2', 100), ('can', -50)]:
+      msgs = packer.make_can_msg("STEERING_CONTROL", 2, {"STEER_TORQUE": steer}, 0)
+      parser.update_strings([can_list_to_can_capnp([msgs], msgtype)])
+      self.assertAlmostEqual(parser.vl["STEERING_CONTROL"]["STEER_TORQUE"], steer)
+
   def test_subaru(self):
     # Subuaru is little endian
 
@@ -97,6 +106,115 @@ class TestCanParserPacker(unittest.TestCase):
 
         idx += 1
 
+  def test_group_and_view(self):
+    dbc_file = "honda_civic_touring_2016_can_generated"
+
+    signals = [
+      ("STEER_TORQUE", "STEERING_CONTROL", 0),
+    ]
+
+    parser_0 = CANParser(dbc_file, signals, [], 0)
+    parser_2 = CANParser(dbc_file, signals, [], 2)
+    group = CANParserGroup([parser_0, parser_2])
+    packer = CANPacker(dbc_file)
+
+    names, vals = parser_2.signal_view("STEERING_CONTROL")
+    torque = names.index("STEER_TORQUE")
+
+    for idx, steer in enumerate(range(-100, 100)):
+      msgs = [packer.make_can_msg("STEERING_CONTROL", 0, {"STEER_TORQUE": steer}, idx),
+              packer.make_can_msg("STEERING_CONTROL", 2, {"STEER_TORQUE": -steer}, idx)]
+      updated = group.update_strings([can_list_to_can_capnp(msgs)])
+
+      self.assertEqual(updated, {0xE4})
+      self.assertAlmostEqual(parser_0.vl["STEERING_CONTROL"]["STEER_TORQUE"], steer)
+      self.assertAlmostEqual(parser_2.vl["STEERING_CONTROL"]["STEER_TORQUE"], -steer)
+      self.assertAlmostEqual(parser_2.vl[0xE4]["STEER_TORQUE"], -steer)
+      self.assertAlmostEqual(vals[torque], -steer)
+
+    # nothing parsed, nothing updated
+    self.assertEqual(group.update_strings([can_list_to_can_capnp([])]), set())
+
+  def test_stats(self):
+    dbc_file = "honda_civic_touring_2016_can_generated"
+
+    signals = [
+      ("STEER_TORQUE", "STEERING_CONTROL", 0),
+    ]
+
+    parser = CANParser(dbc_file, signals, [], 0)
+    parser.enable_stats()
+    packer = CANPacker(dbc_file)
+
+    for idx in range(10):
+      counter = idx + 1 if idx == 5 else idx  # skips one
+      parser.update_string(can_list_to_can_capnp([packer.make_can_msg("STEERING_CONTROL", 0, {}, counter % 4)]))
+
+    # a corrupted checksum
+    addr, _, dat, bus = packer.make_can_msg("STEERING_CONTROL", 0, {}, 3)
+    parser.update_string(can_list_to_can_capnp([[addr, 0, bytes([dat[0] ^ 1]) + dat[1:], bus]]))
+
+    stats, = parser.stats()
+    self.assertEqual(stats['address'], 0xE4)
+    self.assertEqual(stats['frames'], 11)
+    self.assertEqual(stats['checksumErrors'], 1)
+    self.assertGreaterEqual(stats['counterErrors'], 1)
+    self.assertLessEqual(sum(stats['intervalHistogram']), 10)
+
+  def test_packer_handles(self):
+    dbc_file = "honda_civic_touring_2016_can_generated"
+    packer = CANPacker(dbc_file)
+
+    names = ["STEER_TORQUE", "STEER_TORQUE_REQUEST"]
+    handle = packer.handle("STEERING_CONTROL", names)
+    self.assertEqual(packer.handle(0xE4, names), handle + 1)
+    with self.assertRaises(KeyError):
+      packer.handle("NOT_A_MESSAGE", names)
+
+    msgs = []
+    for idx, steer in enumerate(range(-100, 100)):
+      values = {"STEER_TORQUE": steer, "STEER_TORQUE_REQUEST": steer % 2}
+      msg = packer.make_can_msg("STEERING_CONTROL", 0, values, idx % 4)
+      self.assertEqual(packer.make_can_msg_handle(handle, 0, [values[n] for n in names], idx % 4), msg)
+      msgs.append(((handle, 0, [values[n] for n in names], idx % 4), msg))
+
+    self.assertEqual(packer.pack_many([m[0] for m in msgs]), [m[1] for m in msgs])
+
+    addresses, dat, lens, buses = packer.pack_arrays([m[0] for m in msgs])
+    self.assertEqual(list(addresses), [m[1][0] for m in msgs])
+    self.assertEqual(dat.tobytes(), b''.join(m[1][2] for m in msgs))
+    self.assertEqual(list(lens), [len(m[1][2]) for m in msgs])
+    self.assertEqual(list(buses), [m[1][3] for m in msgs])
+
+  def test_bulk_and_history(self):
+    dbc_file = "honda_civic_touring_2016_can_generated"
+
+    signals = [
+      ("STEER_TORQUE", "STEERING_CONTROL", 0),
+    ]
+
+    packer = CANPacker(dbc_file)
+    steers = list(range(-50, 50))
+    strings = [can_list_to_can_capnp([packer.make_can_msg("STEERING_CONTROL", 0, {"STEER_TORQUE": steer}, idx)])
+               for idx, steer in enumerate(steers)]
+
+    parser = CANParser(dbc_file, signals, [], 0)
+    parser.record_history()
+    self.assertEqual(parser.update_strings(strings), {0xE4})
+    self.assertAlmostEqual(parser.vl["STEERING_CONTROL"]["STEER_TORQUE"], steers[-1])
+
+    times, hist = parser.history()
+    self.assertEqual(len(times), len(steers))
+    self.assertTrue(all(times[1:] >= times[:-1]))
+    self.assertEqual(list(hist["STEERING_CONTROL"]["STEER_TORQUE"]), steers)
+
+    # the same events as a log
+    parser = CANParser(dbc_file, signals, [], 0)
+    parser.record_history()
+    self.assertEqual(parser.update_log(b"".join(strings)), {0xE4})
+    _, log_hist = parser.history()
+    self.assertEqual(list(log_hist[0xE4]["STEER_TORQUE"]), steers)
+
 
 if __name__ == "__main__":
   unittest.main()
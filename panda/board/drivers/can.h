@@ -7,8 +7,21 @@ typedef struct {
   volatile uint32_t r_ptr;
   uint32_t fifo_size;
   CAN_FIFOMailBox_TypeDef *elems;
+  uint32_t *ts;  // TIM2 when each elem was pushed, NULL if not kept
+  uint32_t high_water;  // most elems held since it was last reset
 } can_ring;
 
+// A bus's traffic since its stats were last taken. The bits are of the frames received and sent
+// without stuffing, the error states are counted as the SCE IRQ sees the controller go into them
+typedef struct {
+  uint32_t rx_cnt;
+  uint32_t tx_cnt;
+  uint32_t bits;
+  uint32_t error_passive_cnt;
+  uint32_t bus_off_cnt;
+  uint32_t start_us;  // TIM2 when they were last taken
+} can_bus_stats_t;
+
 #define CAN_BUS_RET_FLAG 0x80U
 #define CAN_BUS_NUM_MASK 0x7FU
 
@@ -31,6 +44,16 @@ void can_init_all(void);
 bool can_tx_check_min_slots_free(uint32_t min);
 void can_send(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number, bool skip_tx_hook);
 bool can_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem);
+bool can_pop_ts(can_ring *q, CAN_FIFOMailBox_TypeDef *elem, uint32_t *ts);
+bool can_push_ts(can_ring *q, CAN_FIFOMailBox_TypeDef *elem, uint32_t ts);
+bool can_is_bulk(CAN_FIFOMailBox_TypeDef *msg);
+uint32_t can_take_high_water(can_ring *q);
+void can_set_rx_deferred(bool deferred);
+uint32_t can_take_rx_delay_max(void);
+uint32_t can_take_rx_missed(uint8_t bus_number);
+void can_take_bus_stats(uint8_t bus_number, can_bus_stats_t *stats);
+bool can_add_filter(uint8_t bus_number, uint32_t id, uint32_t mask);
+void can_clear_filters(uint8_t bus_number);
 
 // Ignition detected from CAN meessages
 bool ignition_can = false;
@@ -48,15 +71,64 @@ int can_live = 0, pending_can_live = 0, can_loopback = 0, can_silent = ALL_CAN_S
 
 #define can_buffer(x, size) \
   CAN_FIFOMailBox_TypeDef elems_##x[size]; \
-  can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = size, .elems = (CAN_FIFOMailBox_TypeDef *)&elems_##x };
+  can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = size, .elems = (CAN_FIFOMailBox_TypeDef *)&elems_##x, .ts = NULL, .high_water = 0 };
+
+// rx is timestamped in the rx IRQ, for measuring the latency to the host
+#define can_buffer_ts(x, size) \
+  CAN_FIFOMailBox_TypeDef elems_##x[size]; \
+  uint32_t ts_##x[size]; \
+  can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = size, .elems = (CAN_FIFOMailBox_TypeDef *)&elems_##x, .ts = ts_##x, .high_water = 0 };
 
-can_buffer(rx_q, 0x1000)
+can_buffer_ts(rx_q, 0x1000)
 can_buffer(tx1_q, 0x100)
 can_buffer(tx2_q, 0x100)
 can_buffer(tx3_q, 0x100)
 can_buffer(txgmlan_q, 0x100)
 can_ring *can_queues[] = {&can_tx1_q, &can_tx2_q, &can_tx3_q, &can_txgmlan_q};
 
+// bulk and diagnostic traffic waits in these until the queues above are empty, so a flood of
+// it can't hold up control messages
+can_buffer(tx1_bulk_q, 0x80)
+can_buffer(tx2_bulk_q, 0x80)
+can_buffer(tx3_bulk_q, 0x80)
+can_buffer(txgmlan_bulk_q, 0x80)
+can_ring *can_bulk_queues[] = {&can_tx1_bulk_q, &can_tx2_bulk_q, &can_tx3_bulk_q, &can_txgmlan_bulk_q};
+
+// Deferred rx: the RX0 IRQs only copy the mailbox in here and pend CAN_RX_DEFER_IRQn, which
+// runs at a lower priority and does the forwarding, safety hooks and queueing for the host. The
+// RX0 IRQs are the only writers and can't preempt each other, the deferred IRQ the only reader
+#define CAN_RX_DEFER_SIZE 0x80U  // power of 2
+#define CAN_RX_DEFER_IRQn TIM8_TRG_COM_TIM14_IRQn  // unused, only ever pended from software
+#define CAN_RX_DEFER_PRIORITY 1U  // everything else is at 0
+
+typedef struct {
+  CAN_FIFOMailBox_TypeDef msg;
+  uint32_t ts;  // TIM2 when the RX0 IRQ took it from the mailbox
+} can_rx_defer_elem;
+
+can_rx_defer_elem can_rx_defer_elems[CAN_RX_DEFER_SIZE];
+volatile uint32_t can_rx_defer_w_ptr = 0U;
+volatile uint32_t can_rx_defer_r_ptr = 0U;
+bool can_rx_deferred = false;
+
+// since they were last taken for the health packet
+uint32_t can_rx_delay_max = 0U;  // us, from the RX0 IRQ to the deferred processing
+uint32_t can_rx_missed[BUS_MAX] = {0U};  // mailbox overruns or deferred ring full
+can_bus_stats_t can_bus_stats[BUS_MAX];
+
+// Host filters: the frames of a bus the host wants, ids and masks in the layout of RIR, the standard
+// ids in bits 21-31, the extended ones in bits 3-31 with IDE, bit 2, set. A bus without filters sends
+// the host every frame. The frames still go through forwarding and the safety hooks first, the
+// filters only keep them from the host. They're programmed into the controller's filter banks, so
+// the rest never raise an RX0 IRQ, only while nothing on the panda reads the bus: the safety mode
+// has no rx or forwarding hooks of its own and nothing forwards from the bus
+#define CAN_HOST_FILTERS LLCAN_FILTER_BANKS
+uint32_t can_filter_ids[BUS_MAX][CAN_HOST_FILTERS];
+uint32_t can_filter_masks[BUS_MAX][CAN_HOST_FILTERS];
+uint8_t can_filters_len[BUS_MAX] = {0U};
+// frames the filters kept from the host, since boot
+uint32_t can_filtered_cnt = 0U;
+
 // global CAN stats
 int can_rx_cnt = 0;
 int can_tx_cnt = 0;
@@ -66,12 +138,30 @@ int can_overflow_cnt = 0;
 
 // ********************* interrupt safe queue *********************
 
+// callers are in a critical section
+uint32_t can_slots_empty_locked(can_ring *q) {
+  uint32_t ret = 0;
+  if (q->w_ptr >= q->r_ptr) {
+    ret = q->fifo_size - 1U - q->w_ptr + q->r_ptr;
+  } else {
+    ret = q->r_ptr - q->w_ptr - 1U;
+  }
+  return ret;
+}
+
 bool can_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
+  return can_pop_ts(q, elem, NULL);
+}
+
+bool can_pop_ts(can_ring *q, CAN_FIFOMailBox_TypeDef *elem, uint32_t *ts) {
   bool ret = 0;
 
   ENTER_CRITICAL();
   if (q->w_ptr != q->r_ptr) {
     *elem = q->elems[q->r_ptr];
+    if (ts != NULL) {
+      *ts = (q->ts != NULL) ? q->ts[q->r_ptr] : 0U;
+    }
     if ((q->r_ptr + 1U) == q->fifo_size) {
       q->r_ptr = 0;
     } else {
@@ -85,6 +175,10 @@ bool can_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
 }
 
 bool can_push(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
+  return can_push_ts(q, elem, TIM2->CNT);
+}
+
+bool can_push_ts(can_ring *q, CAN_FIFOMailBox_TypeDef *elem, uint32_t ts) {
   bool ret = false;
   uint32_t next_w_ptr;
 
@@ -96,7 +190,11 @@ bool can_push(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
   }
   if (next_w_ptr != q->r_ptr) {
     q->elems[q->w_ptr] = *elem;
+    if (q->ts != NULL) {
+      q->ts[q->w_ptr] = ts;
+    }
     q->w_ptr = next_w_ptr;
+    q->high_water = MAX(q->high_water, q->fifo_size - 1U - can_slots_empty_locked(q));
     ret = true;
   }
   EXIT_CRITICAL();
@@ -113,11 +211,7 @@ uint32_t can_slots_empty(can_ring *q) {
   uint32_t ret = 0;
 
   ENTER_CRITICAL();
-  if (q->w_ptr >= q->r_ptr) {
-    ret = q->fifo_size - 1U - q->w_ptr + q->r_ptr;
-  } else {
-    ret = q->r_ptr - q->w_ptr - 1U;
-  }
+  ret = can_slots_empty_locked(q);
   EXIT_CRITICAL();
 
   return ret;
@@ -130,6 +224,14 @@ void can_clear(can_ring *q) {
   EXIT_CRITICAL();
 }
 
+uint32_t can_take_high_water(can_ring *q) {
+  ENTER_CRITICAL();
+  uint32_t ret = q->high_water;
+  q->high_water = 0U;
+  EXIT_CRITICAL();
+  return ret;
+}
+
 // assign CAN numbering
 // bus num: Can bus number on ODB connector. Sent to/from USB
 //    Min: 0; Max: 127; Bit 7 marks message as receipt (bus 129 is receipt for but 1)
@@ -167,6 +269,7 @@ void can_init_all(void) {
   bool ret = true;
   for (uint8_t i=0U; i < CAN_MAX; i++) {
     can_clear(can_queues[i]);
+    can_clear(can_bulk_queues[i]);
     ret &= can_init(i);
   }
   UNUSED(ret);
@@ -257,6 +360,14 @@ void can_set_obd(uint8_t harness_orientation, bool obd){
   }
 }
 
+// a classic frame's bits on the bus without stuffing: the fields, the data and the interframe space
+uint32_t can_frame_bits(uint32_t ir, uint32_t dtr) {
+  return (((ir & 4U) != 0U) ? 67U : 47U) + (8U * (dtr & 0xFU));
+}
+
+// the ESR error states of each CAN at its last SCE IRQ
+uint32_t can_esr_last[CAN_MAX] = {0U};
+
 // CAN error
 void can_sce(CAN_TypeDef *CAN) {
   ENTER_CRITICAL();
@@ -281,6 +392,17 @@ void can_sce(CAN_TypeDef *CAN) {
   #endif
 
   can_err_cnt += 1;
+  uint8_t can_number = CAN_NUM_FROM_CANIF(CAN);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  uint32_t esr = CAN->ESR;
+  uint32_t entered = esr & ~can_esr_last[can_number];
+  if ((entered & CAN_ESR_EPVF) != 0U) {
+    can_bus_stats[bus_number].error_passive_cnt += 1U;
+  }
+  if ((entered & CAN_ESR_BOFF) != 0U) {
+    can_bus_stats[bus_number].bus_off_cnt += 1U;
+  }
+  can_esr_last[can_number] = esr & (CAN_ESR_EPVF | CAN_ESR_BOFF);
   llcan_clear_send(CAN);
   EXIT_CRITICAL();
 }
@@ -303,6 +425,8 @@ void process_can(uint8_t can_number) {
         can_txd_cnt += 1;
 
         if ((CAN->TSR & CAN_TSR_TXOK0) == CAN_TSR_TXOK0) {
+          can_bus_stats[bus_number].tx_cnt += 1U;
+          can_bus_stats[bus_number].bits += can_frame_bits(CAN->sTxMailBox[0].TIR, CAN->sTxMailBox[0].TDTR);
           CAN_FIFOMailBox_TypeDef to_push;
           to_push.RIR = CAN->sTxMailBox[0].TIR;
           to_push.RDTR = (CAN->sTxMailBox[0].TDTR & 0xFFFF000FU) | ((CAN_BUS_RET_FLAG | bus_number) << 4);
@@ -328,7 +452,7 @@ void process_can(uint8_t can_number) {
         CAN->TSR |= CAN_TSR_RQCP0;
       }
 
-      if (can_pop(can_queues[bus_number], &to_send)) {
+      if (can_pop(can_queues[bus_number], &to_send) || can_pop(can_bulk_queues[bus_number], &to_send)) {
         can_tx_cnt += 1;
         // only send if we have received a packet
         CAN->sTxMailBox[0].TDLR = to_send.RDLR;
@@ -374,47 +498,138 @@ void ignition_can_hook(CAN_FIFOMailBox_TypeDef *to_push) {
   }
 }
 
+bool can_host_wants(uint8_t bus_number, const CAN_FIFOMailBox_TypeDef *msg) {
+  bool ret = can_filters_len[bus_number] == 0U;
+  for (uint8_t i = 0U; (i < can_filters_len[bus_number]) && !ret; i++) {
+    ret = ((msg->RIR ^ can_filter_ids[bus_number][i]) & can_filter_masks[bus_number][i]) == 0U;
+  }
+  return ret;
+}
+
+// forwarding, safety hooks and queueing for the host of a received message
+void can_rx_process(CAN_FIFOMailBox_TypeDef *to_push, uint32_t ts) {
+  uint8_t bus_number = (to_push->RDTR >> 4) & 0xFFU;
+
+  // forwarding (panda only)
+  int bus_fwd_num = (can_forwarding[bus_number] != -1) ? can_forwarding[bus_number] : safety_fwd_hook(bus_number, to_push);
+  if (bus_fwd_num != -1) {
+    CAN_FIFOMailBox_TypeDef to_send;
+    to_send.RIR = to_push->RIR | 1; // TXRQ
+    to_send.RDTR = to_push->RDTR;
+    to_send.RDLR = to_push->RDLR;
+    to_send.RDHR = to_push->RDHR;
+    can_send(&to_send, bus_fwd_num, true);
+  }
+
+  can_rx_errs += safety_rx_hook(to_push) ? 0U : 1U;
+  ignition_can_hook(to_push);
+
+  current_board->set_led(LED_BLUE, true);
+  if (can_host_wants(bus_number, to_push)) {
+    can_send_errs += can_push_ts(&can_rx_q, to_push, ts) ? 0U : 1U;
+  } else {
+    can_filtered_cnt += 1U;
+  }
+}
+
+bool can_rx_defer_push(CAN_FIFOMailBox_TypeDef *msg) {
+  uint32_t next_w_ptr = (can_rx_defer_w_ptr + 1U) & (CAN_RX_DEFER_SIZE - 1U);
+  bool ret = next_w_ptr != can_rx_defer_r_ptr;
+  if (ret) {
+    can_rx_defer_elems[can_rx_defer_w_ptr].msg = *msg;
+    can_rx_defer_elems[can_rx_defer_w_ptr].ts = TIM2->CNT;
+    can_rx_defer_w_ptr = next_w_ptr;
+  }
+  return ret;
+}
+
+// the hooks share state with the tx side, which runs at the higher priority, so each message
+// is processed in a critical section. That's as long as the RX0 IRQs can be held off for
+void can_rx_defer_handler(void) {
+  while (can_rx_defer_r_ptr != can_rx_defer_w_ptr) {
+    can_rx_defer_elem *elem = &can_rx_defer_elems[can_rx_defer_r_ptr];
+    ENTER_CRITICAL();
+    can_rx_delay_max = MAX(can_rx_delay_max, TIM2->CNT - elem->ts);
+    can_rx_process(&elem->msg, elem->ts);
+    EXIT_CRITICAL();
+    can_rx_defer_r_ptr = (can_rx_defer_r_ptr + 1U) & (CAN_RX_DEFER_SIZE - 1U);
+  }
+}
+
+// Messages already in the ring are still processed after it's turned off
+void can_set_rx_deferred(bool deferred) {
+  can_rx_deferred = deferred;
+}
+
+uint32_t can_take_rx_delay_max(void) {
+  ENTER_CRITICAL();
+  uint32_t ret = can_rx_delay_max;
+  can_rx_delay_max = 0U;
+  EXIT_CRITICAL();
+  return ret;
+}
+
+uint32_t can_take_rx_missed(uint8_t bus_number) {
+  ENTER_CRITICAL();
+  uint32_t ret = can_rx_missed[bus_number];
+  can_rx_missed[bus_number] = 0U;
+  EXIT_CRITICAL();
+  return ret;
+}
+
+void can_take_bus_stats(uint8_t bus_number, can_bus_stats_t *stats) {
+  ENTER_CRITICAL();
+  *stats = can_bus_stats[bus_number];
+  (void)memset(&can_bus_stats[bus_number], 0, sizeof(can_bus_stats[bus_number]));
+  can_bus_stats[bus_number].start_us = TIM2->CNT;
+  EXIT_CRITICAL();
+}
+
 // CAN receive handlers
 // blink blue when we are receiving CAN messages
 void can_rx(uint8_t can_number) {
   CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
   uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  bool pend = false;
   while ((CAN->RF0R & CAN_RF0R_FMP0) != 0) {
     can_rx_cnt += 1;
 
     // can is live
     pending_can_live = 1;
 
+    // the mailbox held 3 and dropped one, releasing below clears the flag
+    if ((CAN->RF0R & CAN_RF0R_FOVR0) != 0U) {
+      can_rx_missed[bus_number] += 1U;
+    }
+
     // add to my fifo
     CAN_FIFOMailBox_TypeDef to_push;
     to_push.RIR = CAN->sFIFOMailBox[0].RIR;
     to_push.RDTR = CAN->sFIFOMailBox[0].RDTR;
     to_push.RDLR = CAN->sFIFOMailBox[0].RDLR;
     to_push.RDHR = CAN->sFIFOMailBox[0].RDHR;
+    can_bus_stats[bus_number].rx_cnt += 1U;
+    can_bus_stats[bus_number].bits += can_frame_bits(to_push.RIR, to_push.RDTR);
 
     // modify RDTR for our API
     to_push.RDTR = (to_push.RDTR & 0xFFFF000F) | (bus_number << 4);
 
-    // forwarding (panda only)
-    int bus_fwd_num = (can_forwarding[bus_number] != -1) ? can_forwarding[bus_number] : safety_fwd_hook(bus_number, &to_push);
-    if (bus_fwd_num != -1) {
-      CAN_FIFOMailBox_TypeDef to_send;
-      to_send.RIR = to_push.RIR | 1; // TXRQ
-      to_send.RDTR = to_push.RDTR;
-      to_send.RDLR = to_push.RDLR;
-      to_send.RDHR = to_push.RDHR;
-      can_send(&to_send, bus_fwd_num, true);
+    if (can_rx_deferred) {
+      if (can_rx_defer_push(&to_push)) {
+        pend = true;
+      } else {
+        can_rx_missed[bus_number] += 1U;
+      }
+    } else {
+      can_rx_process(&to_push, TIM2->CNT);
     }
 
-    can_rx_errs += safety_rx_hook(&to_push) ? 0U : 1U;
-    ignition_can_hook(&to_push);
-
-    current_board->set_led(LED_BLUE, true);
-    can_send_errs += can_push(&can_rx_q, &to_push) ? 0U : 1U;
-
     // next
     CAN->RF0R |= CAN_RF0R_RFOM0;
   }
+  if (pend) {
+    NVIC_SetPendingIRQ(CAN_RX_DEFER_IRQn);
+  }
 }
 
 void CAN1_TX_IRQ_Handler(void) { process_can(0); }
@@ -429,12 +644,18 @@ void CAN3_TX_IRQ_Handler(void) { process_can(2); }
 void CAN3_RX0_IRQ_Handler(void) { can_rx(2); }
 void CAN3_SCE_IRQ_Handler(void) { can_sce(CAN3); }
 
+void CAN_RX_DEFER_IRQ_Handler(void) { can_rx_defer_handler(); }
+
 bool can_tx_check_min_slots_free(uint32_t min) {
   return
     (can_slots_empty(&can_tx1_q) >= min) &&
     (can_slots_empty(&can_tx2_q) >= min) &&
     (can_slots_empty(&can_tx3_q) >= min) &&
-    (can_slots_empty(&can_txgmlan_q) >= min);
+    (can_slots_empty(&can_txgmlan_q) >= min) &&
+    (can_slots_empty(&can_tx1_bulk_q) >= min) &&
+    (can_slots_empty(&can_tx2_bulk_q) >= min) &&
+    (can_slots_empty(&can_tx3_bulk_q) >= min) &&
+    (can_slots_empty(&can_txgmlan_bulk_q) >= min);
 }
 
 void can_send(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number, bool skip_tx_hook) {
@@ -446,15 +667,90 @@ void can_send(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number, bool skip_tx
       if ((bus_number == 3U) && (can_num_lookup[3] == 0xFFU)) {
         gmlan_send_errs += bitbang_gmlan(to_push) ? 0U : 1U;
       } else {
-        can_fwd_errs += can_push(can_queues[bus_number], to_push) ? 0U : 1U;
+        can_ring *q = can_is_bulk(to_push) ? can_bulk_queues[bus_number] : can_queues[bus_number];
+        can_fwd_errs += can_push(q, to_push) ? 0U : 1U;
         process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
       }
     }
   }
 }
 
+// UDS and other ISO-TP diagnostics, 0x700-0x7FF and the 29 bit 0x18DA/0x18DB addressing. CAN
+// arbitration already favours the rest, this keeps the queue from undoing it
+bool can_is_bulk(CAN_FIFOMailBox_TypeDef *msg) {
+  bool extended = (msg->RIR & 4U) != 0U;
+  uint32_t addr = extended ? (msg->RIR >> 3) : (msg->RIR >> 21);
+  return extended ? ((addr >> 17) == (0x18DA0000U >> 17)) : (addr >= 0x700U);
+}
+
+// The ignition hook reads these from bus 0, they pass the hardware filters of bus 0 with the host's
+const uint16_t can_ignition_addrs[] = {0x160U, 0x1F1U, 0x348U};
+#define CAN_IGNITION_ADDRS (sizeof(can_ignition_addrs) / sizeof(can_ignition_addrs[0]))
+
+bool can_filters_in_hw(uint8_t bus_number) {
+  uint8_t reserved = (bus_number == 0U) ? (uint8_t)CAN_IGNITION_ADDRS : 0U;
+  return (can_filters_len[bus_number] > 0U) && ((can_filters_len[bus_number] + reserved) <= LLCAN_FILTER_BANKS) &&
+         (current_hooks->rx == default_rx_hook) && (current_hooks->fwd == default_fwd_hook) &&
+         (can_forwarding[bus_number] == -1);
+}
+
+// the host's filters or every frame, reprogrammed after anything can_filters_in_hw checks changes
+void can_filters_apply(uint8_t can_number) {
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
+  if (can_filters_in_hw(bus_number)) {
+    uint32_t ids[LLCAN_FILTER_BANKS];
+    uint32_t masks[LLCAN_FILTER_BANKS];
+    uint8_t len = can_filters_len[bus_number];
+    for (uint8_t i = 0U; i < len; i++) {
+      ids[i] = can_filter_ids[bus_number][i];
+      masks[i] = can_filter_masks[bus_number][i];
+    }
+    if (bus_number == 0U) {
+      for (uint8_t i = 0U; i < CAN_IGNITION_ADDRS; i++) {
+        ids[len] = (uint32_t)can_ignition_addrs[i] << 21;
+        masks[len] = 0xFFE00004U;
+        len++;
+      }
+    }
+    llcan_set_filters(CAN, ids, masks, len);
+  } else {
+    llcan_set_filters(CAN, NULL, NULL, 0U);
+  }
+}
+
+void can_filters_apply_all(void) {
+  for (uint8_t i = 0U; i < CAN_MAX; i++) {
+    can_filters_apply(i);
+  }
+}
+
+// false if the bus has all the filters it can take
+bool can_add_filter(uint8_t bus_number, uint32_t id, uint32_t mask) {
+  bool ret = can_filters_len[bus_number] < CAN_HOST_FILTERS;
+  if (ret) {
+    ENTER_CRITICAL();
+    // RTR and TXRQ don't take part, IDE always does
+    uint32_t m = (mask & ~3U) | 4U;
+    can_filter_ids[bus_number][can_filters_len[bus_number]] = id & m;
+    can_filter_masks[bus_number][can_filters_len[bus_number]] = m;
+    can_filters_len[bus_number] += 1U;
+    EXIT_CRITICAL();
+    can_filters_apply_all();
+  }
+  return ret;
+}
+
+void can_clear_filters(uint8_t bus_number) {
+  ENTER_CRITICAL();
+  can_filters_len[bus_number] = 0U;
+  EXIT_CRITICAL();
+  can_filters_apply_all();
+}
+
 void can_set_forwarding(int from, int to) {
   can_forwarding[from] = to;
+  can_filters_apply_all();
 }
 
 bool can_init(uint8_t can_number) {
@@ -469,11 +765,15 @@ bool can_init(uint8_t can_number) {
   REGISTER_INTERRUPT(CAN3_TX_IRQn, CAN3_TX_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
   REGISTER_INTERRUPT(CAN3_RX0_IRQn, CAN3_RX0_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
   REGISTER_INTERRUPT(CAN3_SCE_IRQn, CAN3_SCE_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
+  REGISTER_INTERRUPT(CAN_RX_DEFER_IRQn, CAN_RX_DEFER_IRQ_Handler, CAN_INTERRUPT_RATE * CAN_MAX, FAULT_INTERRUPT_RATE_CAN_RX_DEFER)
+  NVIC_SetPriority(CAN_RX_DEFER_IRQn, CAN_RX_DEFER_PRIORITY);
+  NVIC_EnableIRQ(CAN_RX_DEFER_IRQn);
 
   if (can_number != 0xffU) {
     CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
     ret &= can_set_speed(can_number);
     ret &= llcan_init(CAN);
+    can_filters_apply(can_number);
     // in case there are queued up messages
     process_can(can_number);
   }
@@ -0,0 +1,152 @@
+// CAN over USB framing
+//
+// v1 sends every message as its 0x10 byte CAN_FIFOMailBox_TypeDef. v2 is set with
+// control request 0xe8 and lasts until the next USB reset. Every v2 USB packet is
+//
+//   [u8 counter][u8 offset of the first frame that starts in the packet, 0xFF if none][frames...]
+//
+// and frames run on from one packet into the next, so short messages pack tighter and
+// CAN FD sized payloads fit:
+//
+//   u8  (dlc << 4) | (bus << 1) | fd
+//   u32 (addr << 3) | (extended << 2) | (returned << 1) | rejected, little endian
+//   dlc_to_len[dlc] bytes of data
+//
+// Packets to the host have a u32 after the offset, the TIM2 time its oldest frame was
+// received at. Control request 0xa8 reads TIM2, for the host to sync its clock to.
+// A gap in the counter drops the partial frame, the stream resyncs on the next frame start.
+// selfdrive/boardd/panda.cc is the other end, keep them in sync
+
+#define CAN_FRAMING_V1 1U
+#define CAN_FRAMING_V2 2U
+
+#define CANPACKET_HEAD_SIZE 5U
+#define CANPACKET_DATA_SIZE_MAX 64U
+#define USBPACKET_HEAD_SIZE 2U
+#define USBPACKET_IN_HEAD_SIZE 6U
+#define USBPACKET_NO_FRAME_START 0xFFU
+
+const uint8_t dlc_to_len[16] = {0U, 1U, 2U, 3U, 4U, 5U, 6U, 7U, 8U, 12U, 16U, 20U, 24U, 32U, 48U, 64U};
+
+typedef struct {
+  uint8_t counter;
+  bool synced;
+  uint8_t frame[CANPACKET_HEAD_SIZE + CANPACKET_DATA_SIZE_MAX];
+  uint32_t len;  // of the frame, only used going out
+  uint32_t pos;  // bytes of the frame sent or received so far
+  uint32_t ts;   // when the frame was received, only used going out
+} can_stream;
+
+uint8_t can_framing = CAN_FRAMING_V1;
+can_stream can_stream_in;   // to the host
+can_stream can_stream_out;  // from the host
+
+void can_framing_set(uint8_t framing) {
+  can_framing = framing;
+  (void)memset(&can_stream_in, 0, sizeof(can_stream_in));
+  (void)memset(&can_stream_out, 0, sizeof(can_stream_out));
+}
+
+uint32_t can_framing_pack(CAN_FIFOMailBox_TypeDef *msg, uint8_t *out) {
+  uint32_t len = msg->RDTR & 0xFU;  // bxCAN is classic CAN, the dlc is the length
+  uint32_t bus = (msg->RDTR >> 4) & 0xFFU;
+  bool extended = (msg->RIR & 4U) != 0U;
+  uint32_t addr = extended ? (msg->RIR >> 3) : (msg->RIR >> 21);
+  uint32_t id = (addr << 3) | (extended ? 4U : 0U) | (((bus & CAN_BUS_RET_FLAG) != 0U) ? 2U : 0U);
+  uint32_t dat[2] = {msg->RDLR, msg->RDHR};
+
+  out[0] = (uint8_t)((len << 4) | ((bus & 0x7U) << 1));
+  (void)memcpy(&out[1], &id, 4U);
+  (void)memcpy(&out[CANPACKET_HEAD_SIZE], dat, len);
+  return CANPACKET_HEAD_SIZE + len;
+}
+
+// false for frames bxCAN can't send
+bool can_framing_unpack(const uint8_t *in, CAN_FIFOMailBox_TypeDef *msg, uint8_t *bus_number) {
+  uint32_t len = in[0] >> 4;
+  bool ret = ((in[0] & 1U) == 0U) && (len <= 8U);
+  if (ret) {
+    uint32_t id;
+    (void)memcpy(&id, &in[1], 4U);
+    uint32_t addr = id >> 3;
+    uint32_t dat[2] = {0U, 0U};
+    (void)memcpy(dat, &in[CANPACKET_HEAD_SIZE], len);
+
+    *bus_number = (in[0] >> 1) & 0x7U;
+    msg->RIR = ((id & 4U) != 0U) ? ((addr << 3) | 5U) : ((addr << 21) | 1U);
+    msg->RDTR = len | ((uint32_t)*bus_number << 4);
+    msg->RDLR = dat[0];
+    msg->RDHR = dat[1];
+  }
+  return ret;
+}
+
+// Fills one USB packet from can_rx_q, returns its length or 0 if there's nothing to send
+int can_framing_ep1_in(uint8_t *out, int len) {
+  uint32_t pos = USBPACKET_IN_HEAD_SIZE;
+  uint8_t first = USBPACKET_NO_FRAME_START;
+  // a frame carried over from the last packet is the oldest
+  bool carried = can_stream_in.pos != can_stream_in.len;
+  uint32_t ts = can_stream_in.ts;
+  while (pos < (uint32_t)len) {
+    if (can_stream_in.pos == can_stream_in.len) {
+      CAN_FIFOMailBox_TypeDef msg;
+      if (!can_pop_ts(&can_rx_q, &msg, &can_stream_in.ts)) {
+        break;
+      }
+      can_stream_in.len = can_framing_pack(&msg, can_stream_in.frame);
+      can_stream_in.pos = 0U;
+      if (first == USBPACKET_NO_FRAME_START) {
+        first = (uint8_t)pos;
+        if (!carried) {
+          ts = can_stream_in.ts;
+        }
+      }
+    }
+    uint32_t n = MIN((uint32_t)len - pos, can_stream_in.len - can_stream_in.pos);
+    (void)memcpy(&out[pos], &can_stream_in.frame[can_stream_in.pos], n);
+    pos += n;
+    can_stream_in.pos += n;
+  }
+
+  int ret = 0;
+  if (pos > USBPACKET_IN_HEAD_SIZE) {
+    out[0] = can_stream_in.counter;
+    out[1] = first;
+    (void)memcpy(&out[2], &ts, 4U);
+    can_stream_in.counter++;
+    ret = (int)pos;
+  }
+  return ret;
+}
+
+void can_framing_ep3_out(const uint8_t *data, int len) {
+  if (len >= (int)USBPACKET_HEAD_SIZE) {
+    uint32_t pos = USBPACKET_HEAD_SIZE;
+    if (data[0] != can_stream_out.counter) {
+      can_stream_out.synced = false;
+    }
+    can_stream_out.counter = data[0] + 1U;
+
+    // after a gap, or at the start, skip ahead to a frame start
+    if (!can_stream_out.synced && (data[1] >= USBPACKET_HEAD_SIZE) && ((int)data[1] < len)) {
+      can_stream_out.synced = true;
+      can_stream_out.pos = 0U;
+      pos = data[1];
+    }
+
+    while (can_stream_out.synced && (pos < (uint32_t)len)) {
+      can_stream_out.frame[can_stream_out.pos] = data[pos];
+      can_stream_out.pos++;
+      pos++;
+      if (can_stream_out.pos == (CANPACKET_HEAD_SIZE + dlc_to_len[can_stream_out.frame[0] >> 4])) {
+        CAN_FIFOMailBox_TypeDef to_push;
+        uint8_t bus_number;
+        if (can_framing_unpack(can_stream_out.frame, &to_push, &bus_number)) {
+          can_send(&to_push, bus_number, false);
+        }
+        can_stream_out.pos = 0U;
+      }
+    }
+  }
+}
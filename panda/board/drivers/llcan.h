@@ -73,6 +73,34 @@ bool llcan_set_speed(CAN_TypeDef *CAN_obj, uint32_t speed, bool loopback, bool s
   return ret;
 }
 
+// Filter banks are only in the master, CAN1 has 0-13 and CAN2 14-27. CAN3 has its own 0-13
+#define LLCAN_FILTER_BANKS 14U
+
+// A bank per filter in 32 bit mask mode, ids and masks in the layout of RIR. No filters is every frame
+void llcan_set_filters(CAN_TypeDef *CAN_obj, const uint32_t *ids, const uint32_t *masks, uint8_t len) {
+  CAN_TypeDef *master = (CAN_obj == CAN2) ? CAN1 : CAN_obj;
+  uint8_t first = (CAN_obj == CAN2) ? LLCAN_FILTER_BANKS : 0U;
+  uint32_t banks = ((1UL << LLCAN_FILTER_BANKS) - 1U) << first;
+
+  register_set_bits(&(master->FMR), CAN_FMR_FINIT);
+  master->FA1R &= ~banks;
+  master->FM1R &= ~banks;  // mask mode
+  master->FS1R |= banks;   // 32 bit
+  master->FFA1R &= ~banks; // FIFO 0
+  if (len == 0U) {
+    master->sFilterRegister[first].FR1 = 0U;
+    master->sFilterRegister[first].FR2 = 0U;
+    master->FA1R |= 1UL << first;
+  } else {
+    for (uint8_t i = 0U; i < MIN(len, LLCAN_FILTER_BANKS); i++) {
+      master->sFilterRegister[first + i].FR1 = ids[i];
+      master->sFilterRegister[first + i].FR2 = masks[i];
+      master->FA1R |= 1UL << (first + i);
+    }
+  }
+  register_clear_bits(&(master->FMR), CAN_FMR_FINIT);
+}
+
 bool llcan_init(CAN_TypeDef *CAN_obj) {
   bool ret = true;
 
@@ -105,8 +133,8 @@ bool llcan_init(CAN_TypeDef *CAN_obj) {
     // Exit init mode, do not wait
     register_clear_bits(&(CAN_obj->FMR), CAN_FMR_FINIT);
 
-    // enable certain CAN interrupts
-    register_set_bits(&(CAN_obj->IER), CAN_IER_TMEIE | CAN_IER_FMPIE0 |  CAN_IER_WKUIE);
+    // enable certain CAN interrupts, SCE for wakeup and going error passive or bus off
+    register_set_bits(&(CAN_obj->IER), CAN_IER_TMEIE | CAN_IER_FMPIE0 |  CAN_IER_WKUIE | CAN_IER_ERRIE | CAN_IER_EPVIE | CAN_IER_BOFIE);
 
     if (CAN_obj == CAN1) {
       NVIC_EnableIRQ(CAN1_TX_IRQn);
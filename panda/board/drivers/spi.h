@@ -2,14 +2,40 @@
 
 void spi_init(void);
 int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out);
+// A framed request of len bytes to endpoint. Returns the length of the response in data_out, at most
+// max_len, or -1 to NACK it, for the host to try again
+int spi_cb_framed(uint8_t endpoint, uint8_t *data, int len, uint8_t *data_out, int max_len);
 
 // end API
 
-#define SPI_BUF_SIZE 256
-uint8_t spi_buf[SPI_BUF_SIZE];
+// Requests start with SPI_HEADER_SIZE bytes, the ESP's fixed frames for spi_cb_rx with the endpoint
+// first. The host's framed requests start with SPI_SYNC instead:
+//   sync, endpoint, data length (2), max response length (2), checksum of those 6, padding
+// and, after a pause for the DMA to be set up again, the data and its checksum. The response is
+// DMAed out on the host's next transfer, the handshake line is driven low when it's ready:
+//   SPI_ACK or SPI_NACK, length (2), data, checksum of the bytes before it
+// Lengths are little endian, checksums XOR the bytes onto SPI_CHECKSUM_START
+#define SPI_BUF_SIZE 0x400U
+#define SPI_HEADER_SIZE 0x14U
+#define SPI_SYNC 0x5AU
+#define SPI_ACK 0x79U
+#define SPI_NACK 0x1FU
+#define SPI_CHECKSUM_START 0xABU
+
+#define SPI_STATE_HEADER 0U
+#define SPI_STATE_DATA 1U
+#define SPI_STATE_TX 2U
+
+// the header, the data and its checksum
+uint8_t spi_buf[SPI_HEADER_SIZE + SPI_BUF_SIZE + 1U];
 int spi_buf_count = 0;
 int spi_total_count = 0;
 
+uint8_t spi_state = SPI_STATE_HEADER;
+uint8_t spi_endpoint = 0U;
+uint16_t spi_data_len = 0U;
+uint16_t spi_max_rx_len = 0U;
+
 void spi_tx_dma(void *addr, int len) {
   // disable DMA
   register_clear_bits(&(SPI1->CR2), SPI_CR2_TXDMAEN);
@@ -40,6 +66,9 @@ void spi_rx_dma(void *addr, int len) {
   // drain the bus
   volatile uint8_t dat = SPI1->DR;
   (void)dat;
+  // clears an overrun from the bytes nobody read while a response went out
+  dat = SPI1->SR;
+  (void)dat;
 
   // DMA2, stream 2, channel 3
   register_set(&(DMA2_Stream2->M0AR), (uint32_t)addr, 0xFFFFFFFFU);
@@ -54,24 +83,62 @@ void spi_rx_dma(void *addr, int len) {
   register_set_bits(&(SPI1->CR2), SPI_CR2_RXDMAEN);
 }
 
+uint8_t spi_checksum(const uint8_t *data, uint16_t len) {
+  uint8_t checksum = SPI_CHECKSUM_START;
+  for (uint16_t i = 0U; i < len; i++) {
+    checksum ^= data[i];
+  }
+  return checksum;
+}
+
 // ***************************** SPI IRQs *****************************
-// can't go on the stack cause it's DMAed
-uint8_t spi_tx_buf[0x44];
+// can't go on the stack cause it's DMAed. A framed response's ack, length and checksum around the data
+uint8_t spi_tx_buf[SPI_BUF_SIZE + 4U];
+
+// sends the response already in spi_tx_buf after its header
+void spi_respond(uint8_t ack, uint16_t len) {
+  spi_tx_buf[0] = ack;
+  spi_tx_buf[1] = len & 0xFFU;
+  spi_tx_buf[2] = (len >> 8) & 0xFFU;
+  spi_tx_buf[3U + len] = spi_checksum(spi_tx_buf, 3U + len);
+  spi_state = SPI_STATE_TX;
+  spi_tx_dma(spi_tx_buf, 4U + len);
+}
 
 // SPI RX
 void DMA2_Stream2_IRQ_Handler(void) {
-  int *resp_len = (int*)spi_tx_buf;
-  (void)memset(spi_tx_buf, 0xaa, 0x44);
-  *resp_len = spi_cb_rx(spi_buf, 0x14, spi_tx_buf+4);
-  #ifdef DEBUG_SPI
-    puts("SPI write: ");
-    puth(*resp_len);
-    puts("\n");
-  #endif
-  spi_tx_dma(spi_tx_buf, *resp_len + 4);
-
   // ack
   DMA2->LIFCR = DMA_LIFCR_CTCIF2;
+
+  if (spi_state == SPI_STATE_DATA) {
+    uint8_t ack = SPI_NACK;
+    int resp_len = 0;
+    if (spi_checksum(&spi_buf[SPI_HEADER_SIZE], spi_data_len) == spi_buf[SPI_HEADER_SIZE + spi_data_len]) {
+      resp_len = spi_cb_framed(spi_endpoint, &spi_buf[SPI_HEADER_SIZE], spi_data_len, &spi_tx_buf[3], spi_max_rx_len);
+      ack = (resp_len < 0) ? SPI_NACK : SPI_ACK;
+    }
+    spi_respond(ack, (resp_len < 0) ? 0U : (uint16_t)resp_len);
+  } else if (spi_buf[0] == SPI_SYNC) {
+    spi_endpoint = spi_buf[1];
+    spi_data_len = spi_buf[2] | ((uint16_t)spi_buf[3] << 8);
+    spi_max_rx_len = spi_buf[4] | ((uint16_t)spi_buf[5] << 8);
+    if ((spi_checksum(spi_buf, 6U) == spi_buf[6]) && (spi_data_len <= SPI_BUF_SIZE) && (spi_max_rx_len <= SPI_BUF_SIZE)) {
+      spi_state = SPI_STATE_DATA;
+      spi_rx_dma(&spi_buf[SPI_HEADER_SIZE], spi_data_len + 1U);
+    } else {
+      spi_respond(SPI_NACK, 0U);
+    }
+  } else {
+    int *resp_len = (int*)spi_tx_buf;
+    (void)memset(spi_tx_buf, 0xaa, 0x44);
+    *resp_len = spi_cb_rx(spi_buf, 0x14, spi_tx_buf+4);
+    #ifdef DEBUG_SPI
+      puts("SPI write: ");
+      puth(*resp_len);
+      puts("\n");
+    #endif
+    spi_tx_dma(spi_tx_buf, *resp_len + 4);
+  }
 }
 
 // SPI TX
@@ -83,6 +150,9 @@ void DMA2_Stream3_IRQ_Handler(void) {
   // reset handshake back to pull up
   set_gpio_mode(GPIOB, 0, MODE_INPUT);
   set_gpio_pullup(GPIOB, 0, PULL_UP);
+  if (spi_state == SPI_STATE_TX) {
+    spi_state = SPI_STATE_HEADER;
+  }
 
   // ack
   DMA2->LIFCR = DMA_LIFCR_CTCIF3;
@@ -96,7 +166,13 @@ void EXTI4_IRQ_Handler(void) {
   // SPI CS falling
   if ((pr & (1U << 4)) != 0U) {
     spi_total_count = 0;
-    spi_rx_dma(spi_buf, 0x14);
+    // on the host's read of a framed response there's only the response going out, it may start
+    // before the IRQ of the request's data is done
+    bool data_received = (spi_state == SPI_STATE_DATA) && (DMA2_Stream2->NDTR == 0U);
+    if ((spi_state != SPI_STATE_TX) && !data_received) {
+      spi_state = SPI_STATE_HEADER;
+      spi_rx_dma(spi_buf, SPI_HEADER_SIZE);
+    }
   }
   EXTI->PR = pr;
 }
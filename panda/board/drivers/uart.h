@@ -1,4 +1,4 @@
-// IRQs: USART1, USART2, USART3, UART5
+// IRQs: USART1, USART2, USART3, UART5, DMA2_Stream5 (gps RX), DMA2_Stream7 (gps TX)
 
 // ***************************** Definitions *****************************
 #define FIFO_SIZE_INT 0x400U
@@ -15,10 +15,15 @@ typedef struct uart_ring {
   uint32_t rx_fifo_size;
   USART_TypeDef *uart;
   void (*callback)(struct uart_ring*);
+  // RX is a circular DMA into elems_rx, w_ptr_rx follows it at the half, full and idle interrupts.
+  // TX sends the ring's contiguous bytes from r_ptr_tx a DMA at a time, r_ptr_tx moves when it's done
   bool dma_rx;
+  bool dma_tx;
+  uint32_t dma_rx_last;  // where the RX DMA was at the last interrupt
+  volatile uint16_t dma_tx_len;  // bytes the TX DMA is sending, 0 when idle
 } uart_ring;
 
-#define UART_BUFFER(x, size_rx, size_tx, uart_ptr, callback_ptr, rx_dma) \
+#define UART_BUFFER(x, size_rx, size_tx, uart_ptr, callback_ptr, rx_dma, tx_dma) \
   uint8_t elems_rx_##x[size_rx]; \
   uint8_t elems_tx_##x[size_tx]; \
   uart_ring uart_ring_##x = {  \
@@ -32,7 +37,10 @@ typedef struct uart_ring {
     .rx_fifo_size = size_rx, \
     .uart = uart_ptr, \
     .callback = callback_ptr, \
-    .dma_rx = rx_dma \
+    .dma_rx = rx_dma, \
+    .dma_tx = tx_dma, \
+    .dma_rx_last = 0, \
+    .dma_tx_len = 0 \
   };
 
 
@@ -51,15 +59,15 @@ void debug_ring_callback(uart_ring *ring);
 // ******************************** UART buffers ********************************
 
 // gps = USART1
-UART_BUFFER(gps, FIFO_SIZE_DMA, FIFO_SIZE_INT, USART1, NULL, true)
+UART_BUFFER(gps, FIFO_SIZE_DMA, FIFO_SIZE_INT, USART1, NULL, true, true)
 
 // lin1, K-LINE = UART5
 // lin2, L-LINE = USART3
-UART_BUFFER(lin1, FIFO_SIZE_INT, FIFO_SIZE_INT, UART5, NULL, false)
-UART_BUFFER(lin2, FIFO_SIZE_INT, FIFO_SIZE_INT, USART3, NULL, false)
+UART_BUFFER(lin1, FIFO_SIZE_INT, FIFO_SIZE_INT, UART5, NULL, false, false)
+UART_BUFFER(lin2, FIFO_SIZE_INT, FIFO_SIZE_INT, USART3, NULL, false, false)
 
 // debug = USART2
-UART_BUFFER(debug, FIFO_SIZE_INT, FIFO_SIZE_INT, USART2, debug_ring_callback, false)
+UART_BUFFER(debug, FIFO_SIZE_INT, FIFO_SIZE_INT, USART2, debug_ring_callback, false, false)
 
 uart_ring *get_ring_by_number(int a) {
   uart_ring *ring = NULL;
@@ -85,10 +93,32 @@ uart_ring *get_ring_by_number(int a) {
 
 // ***************************** Interrupt handlers *****************************
 
+// Moves r_ptr_tx past a finished TX DMA, the stream disables itself when it's done or fails, and
+// starts the next on the bytes up to w_ptr_tx or the end of the ring. putc runs it too, so a writer
+// waiting for room in an interrupt doesn't wait on the DMA's
+void dma_tx_update(uart_ring *q) {
+  if (q == &uart_ring_gps) {
+    if ((q->dma_tx_len != 0U) && ((DMA2_Stream7->CR & DMA_SxCR_EN) == 0U)) {
+      q->r_ptr_tx = (q->r_ptr_tx + q->dma_tx_len) % q->tx_fifo_size;
+      q->dma_tx_len = 0U;
+    }
+    if ((q->dma_tx_len == 0U) && (q->w_ptr_tx != q->r_ptr_tx)) {
+      uint16_t len = (q->w_ptr_tx > q->r_ptr_tx) ? (uint16_t)(q->w_ptr_tx - q->r_ptr_tx) : (uint16_t)(q->tx_fifo_size - q->r_ptr_tx);
+      q->dma_tx_len = len;
+      DMA2->HIFCR = DMA_HIFCR_CTCIF7 | DMA_HIFCR_CHTIF7 | DMA_HIFCR_CTEIF7 | DMA_HIFCR_CDMEIF7 | DMA_HIFCR_CFEIF7;
+      DMA2_Stream7->M0AR = (uint32_t)&q->elems_tx[q->r_ptr_tx];
+      DMA2_Stream7->NDTR = len;
+      DMA2_Stream7->CR |= DMA_SxCR_EN;
+    }
+  }
+}
+
 void uart_tx_ring(uart_ring *q){
   ENTER_CRITICAL();
-  // Send out next byte of TX buffer
-  if (q->w_ptr_tx != q->r_ptr_tx) {
+  if (q->dma_tx) {
+    dma_tx_update(q);
+  } else if (q->w_ptr_tx != q->r_ptr_tx) {
+    // Send out next byte of TX buffer
     // Only send if transmit register is empty (aka last byte has been sent)
     if ((q->uart->SR & USART_SR_TXE) != 0) {
       q->uart->DR = q->elems_tx[q->r_ptr_tx];   // This clears TXE
@@ -131,10 +161,10 @@ void uart_rx_ring(uart_ring *q){
 // * Half-transfer DMA interrupt
 // * Full-transfer DMA interrupt
 // * UART IDLE detection
-uint32_t prev_w_index = 0;
 void dma_pointer_handler(uart_ring *q, uint32_t dma_ndtr) {
   ENTER_CRITICAL();
   uint32_t w_index = (q->rx_fifo_size - dma_ndtr);
+  uint32_t prev_w_index = q->dma_rx_last;
 
   // Check for new data
   if (w_index != prev_w_index){
@@ -151,7 +181,7 @@ void dma_pointer_handler(uart_ring *q, uint32_t dma_ndtr) {
     q->w_ptr_rx = w_index;
   }
 
-  prev_w_index = w_index;
+  q->dma_rx_last = w_index;
   EXIT_CRITICAL();
 }
 
@@ -225,6 +255,21 @@ void DMA2_Stream5_IRQ_Handler(void) {
   EXIT_CRITICAL();
 }
 
+void DMA2_Stream7_IRQ_Handler(void) {
+  ENTER_CRITICAL();
+
+  // an error drops the bytes of the transfer, the ring goes on with the next
+  #ifdef DEBUG_UART
+    if ((DMA2->HISR & (DMA_HISR_TEIF7 | DMA_HISR_DMEIF7 | DMA_HISR_FEIF7)) != 0U) {
+      puts("Encountered UART TX DMA error\n");
+    }
+  #endif
+  DMA2->HIFCR = DMA_HIFCR_CTCIF7 | DMA_HIFCR_CHTIF7 | DMA_HIFCR_CTEIF7 | DMA_HIFCR_CDMEIF7 | DMA_HIFCR_CFEIF7;
+  dma_tx_update(&uart_ring_gps);
+
+  EXIT_CRITICAL();
+}
+
 // ***************************** Hardware setup *****************************
 
 void dma_rx_init(uart_ring *q) {
@@ -257,6 +302,29 @@ void dma_rx_init(uart_ring *q) {
   }
 }
 
+void dma_tx_init(uart_ring *q) {
+  if(q == &uart_ring_gps){
+    // DMA2, stream 7, channel 4
+
+    // Disable FIFO mode (enable direct)
+    DMA2_Stream7->FCR &= ~DMA_SxFCR_DMDIS;
+
+    // the memory address and length are set for each transfer
+    DMA2_Stream7->PAR = (uint32_t)&(USART1->DR);
+
+    // Increment memory, byte size, memory -> periph
+    // Transfer complete, transfer error and direct mode error interrupt enable
+    DMA2_Stream7->CR = DMA_SxCR_CHSEL_2 | DMA_SxCR_MINC | DMA_SxCR_DIR_0 | DMA_SxCR_TCIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE;
+
+    // Enable DMA transmitter in UART
+    q->uart->CR3 |= USART_CR3_DMAT;
+
+    NVIC_EnableIRQ(DMA2_Stream7_IRQn);
+  } else {
+    puts("Tried to initialize TX DMA for an unsupported UART\n");
+  }
+}
+
 #define __DIV(_PCLK_, _BAUD_)                    (((_PCLK_) * 25U) / (4U * (_BAUD_)))
 #define __DIVMANT(_PCLK_, _BAUD_)                (__DIV((_PCLK_), (_BAUD_)) / 100U)
 #define __DIVFRAQ(_PCLK_, _BAUD_)                ((((__DIV((_PCLK_), (_BAUD_)) - (__DIVMANT((_PCLK_), (_BAUD_)) * 100U)) * 16U) + 50U) / 100U)
@@ -287,6 +355,9 @@ void uart_init(uart_ring *q, int baud) {
   if(q->dma_rx){
     REGISTER_INTERRUPT(DMA2_Stream5_IRQn, DMA2_Stream5_IRQ_Handler, 100U, FAULT_INTERRUPT_RATE_UART_DMA)   // Called twice per buffer
   }
+  if(q->dma_tx){
+    REGISTER_INTERRUPT(DMA2_Stream7_IRQn, DMA2_Stream7_IRQ_Handler, 1000U, FAULT_INTERRUPT_RATE_UART_DMA)  // Once per host write, at most twice
+  }
 
   // Set baud and enable peripheral with TX and RX mode
   uart_set_baud(q->uart, baud);
@@ -312,6 +383,9 @@ void uart_init(uart_ring *q, int baud) {
   if(q->dma_rx){
     dma_rx_init(q);
   }
+  if(q->dma_tx){
+    dma_tx_init(q);
+  }
 }
 
 // ************************* Low-level buffer functions *************************
@@ -386,10 +460,20 @@ void uart_send_break(uart_ring *u) {
 
 void clear_uart_buff(uart_ring *q) {
   ENTER_CRITICAL();
-  q->w_ptr_tx = 0;
-  q->r_ptr_tx = 0;
-  q->w_ptr_rx = 0;
-  q->r_ptr_rx = 0;
+  if (q->dma_tx) {
+    // the transfer in flight finishes, it moves r_ptr_tx up to here
+    q->w_ptr_tx = (q->r_ptr_tx + q->dma_tx_len) % q->tx_fifo_size;
+  } else {
+    q->w_ptr_tx = 0;
+    q->r_ptr_tx = 0;
+  }
+  if (q->dma_rx) {
+    // the DMA writes on where it is
+    q->r_ptr_rx = q->w_ptr_rx;
+  } else {
+    q->w_ptr_rx = 0;
+    q->r_ptr_rx = 0;
+  }
   EXIT_CRITICAL();
 }
 
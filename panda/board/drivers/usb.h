@@ -23,13 +23,15 @@ typedef union _USB_Setup {
 }
 USB_Setup_TypeDef;
 
-#define MAX_CAN_MSGS_PER_BULK_TRANSFER 4U
+// v2 framing fits up to 13 messages in a packet
+#define MAX_CAN_MSGS_PER_BULK_TRANSFER 13U
 
 bool usb_eopf_detected = false;
 
 void usb_init(void);
 int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, bool hardwired);
 int usb_cb_ep1_in(void *usbdata, int len, bool hardwired);
+int usb_cb_ep2_in(void *usbdata, int len, bool hardwired);
 void usb_cb_ep2_out(void *usbdata, int len, bool hardwired);
 void usb_cb_ep3_out(void *usbdata, int len, bool hardwired);
 void usb_cb_ep3_out_complete(void);
@@ -164,12 +166,12 @@ uint8_t device_qualifier[] = {
 
 uint8_t configuration_desc[] = {
   DSCR_CONFIG_LEN, USB_DESC_TYPE_CONFIGURATION, // Length, Type,
-  TOUSBORDER(0x0045U), // Total Len (uint16)
+  TOUSBORDER(0x0053U), // Total Len (uint16)
   0x01, 0x01, STRING_OFFSET_ICONFIGURATION, // Num Interface, Config Value, Configuration
   0xc0, 0x32, // Attributes, Max Power
   // interface 0 ALT 0
   DSCR_INTERFACE_LEN, USB_DESC_TYPE_INTERFACE, // Length, Type
-  0x00, 0x00, 0x03, // Index, Alt Index idx, Endpoint count
+  0x00, 0x00, 0x04, // Index, Alt Index idx, Endpoint count
   0XFF, 0xFF, 0xFF, // Class, Subclass, Protocol
   0x00, // Interface
     // endpoint 1, read CAN
@@ -177,6 +179,11 @@ uint8_t configuration_desc[] = {
     ENDPOINT_RCV | 1, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
     TOUSBORDER(0x0040U), // Max Packet (0x0040)
     0x00, // Polling Interval (NA)
+    // endpoint 2, read serial (the gps)
+    DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
+    ENDPOINT_RCV | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040U), // Max Packet (0x0040)
+    0x00, // Polling Interval (NA)
     // endpoint 2, send serial
     DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
     ENDPOINT_SND | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
@@ -189,7 +196,7 @@ uint8_t configuration_desc[] = {
     0x00, // Polling Interval
   // interface 0 ALT 1
   DSCR_INTERFACE_LEN, USB_DESC_TYPE_INTERFACE, // Length, Type
-  0x00, 0x01, 0x03, // Index, Alt Index idx, Endpoint count
+  0x00, 0x01, 0x04, // Index, Alt Index idx, Endpoint count
   0XFF, 0xFF, 0xFF, // Class, Subclass, Protocol
   0x00, // Interface
     // endpoint 1, read CAN
@@ -197,6 +204,11 @@ uint8_t configuration_desc[] = {
     ENDPOINT_RCV | 1, ENDPOINT_TYPE_INT, // Endpoint Num/Direction, Type
     TOUSBORDER(0x0040U), // Max Packet (0x0040)
     0x05, // Polling Interval (5 frames)
+    // endpoint 2, read serial (the gps)
+    DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
+    ENDPOINT_RCV | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040U), // Max Packet (0x0040)
+    0x00, // Polling Interval (NA)
     // endpoint 2, send serial
     DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
     ENDPOINT_SND | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
@@ -476,6 +488,9 @@ void usb_reset(void) {
   // EP1, massive
   USBx->DIEPTXF[0] = (0x40U << 16) | 0x80U;
 
+  // EP2, a packet at a time
+  USBx->DIEPTXF[1] = (0x40U << 16) | 0xC0U;
+
   // flush TX fifo
   USBx->GRSTCTL = USB_OTG_GRSTCTL_TXFFLSH | USB_OTG_GRSTCTL_TXFNUM_4;
   while ((USBx->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH) == USB_OTG_GRSTCTL_TXFFLSH);
@@ -510,6 +525,11 @@ void usb_setup(void) {
                               USB_OTG_DIEPCTL_SD0PID_SEVNFRM | USB_OTG_DIEPCTL_USBAEP;
       USBx_INEP(1)->DIEPINT = 0xFF;
 
+      // bulk, TX FIFO 2
+      USBx_INEP(2)->DIEPCTL = (0x40U & USB_OTG_DIEPCTL_MPSIZ) | (2U << 18) | (2U << 22) |
+                              USB_OTG_DIEPCTL_SD0PID_SEVNFRM | USB_OTG_DIEPCTL_USBAEP;
+      USBx_INEP(2)->DIEPINT = 0xFF;
+
       USBx_OUTEP(2)->DOEPTSIZ = (1U << 19) | 0x40U;
       USBx_OUTEP(2)->DOEPCTL = (0x40U & USB_OTG_DOEPCTL_MPSIZ) | (2U << 18) |
                                USB_OTG_DOEPCTL_SD0PID_SEVNFRM | USB_OTG_DOEPCTL_USBAEP;
@@ -918,6 +938,12 @@ void usb_irqhandler(void) {
         break;
     }
 
+    // bulk in both settings, an empty packet when there's nothing
+    if ((USBx_INEP(2)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) != 0) {
+      uint32_t ep2_data[0x40U / 4U];
+      USB_WritePacket((void *)ep2_data, usb_cb_ep2_in(ep2_data, 0x40, 1), 2);
+    }
+
     if ((USBx_INEP(0)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) != 0) {
       #ifdef DEBUG_USB
       puts("  IN PACKET QUEUE\n");
@@ -939,6 +965,7 @@ void usb_irqhandler(void) {
     // clear interrupts
     USBx_INEP(0)->DIEPINT = USBx_INEP(0)->DIEPINT; // Why ep0?
     USBx_INEP(1)->DIEPINT = USBx_INEP(1)->DIEPINT;
+    USBx_INEP(2)->DIEPINT = USBx_INEP(2)->DIEPINT;
   }
 
   // clear all interrupts we handled
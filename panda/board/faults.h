@@ -25,6 +25,7 @@
 #define FAULT_INTERRUPT_RATE_KLINE_INIT     (1U << 19)
 #define FAULT_INTERRUPT_RATE_CLOCK_SOURCE   (1U << 20)
 #define FAULT_INTERRUPT_RATE_TIM9           (1U << 21)
+#define FAULT_INTERRUPT_RATE_CAN_RX_DEFER   (1U << 22)
 
 // Permanent faults
 #define PERMANENT_FAULTS 0U
@@ -39,6 +39,7 @@
 #include "safety.h"
 
 #include "drivers/can.h"
+#include "drivers/can_framing.h"
 
 extern int _app_start[0xc000]; // Only first 3 sectors of size 0x4000 are used
 
@@ -60,6 +61,26 @@ struct __attribute__((packed)) health_t {
   uint8_t safety_mode_pkt;
   uint8_t fault_status_pkt;
   uint8_t power_save_enabled_pkt;
+  // most messages each bus's tx queues held since the last health read
+  uint8_t can_tx_high_water_pkt[BUS_MAX];
+  uint8_t can_tx_bulk_high_water_pkt[BUS_MAX];
+  // longest any message waited for deferred rx, in us, and messages each bus lost before the
+  // safety hooks saw them
+  uint16_t can_rx_delay_max_pkt;
+  uint8_t can_rx_missed_pkt[BUS_MAX];
+};
+
+// a bus since its last stats packet
+struct __attribute__((packed)) can_health_t {
+  uint32_t rx_cnt_pkt;
+  uint32_t tx_cnt_pkt;
+  uint16_t bus_load_pkt;  // in 0.1% of the bitrate
+  uint16_t error_passive_cnt_pkt;
+  uint16_t bus_off_cnt_pkt;
+  // the controller's error flags, last error code and counters now
+  uint8_t esr_flags_pkt;
+  uint8_t tec_pkt;
+  uint8_t rec_pkt;
 };
 
 
@@ -184,9 +205,48 @@ int get_health_pkt(void *dat) {
   health->fault_status_pkt = fault_status;
   health->faults_pkt = faults;
 
+  for (uint8_t i = 0U; i < BUS_MAX; i++) {
+    health->can_tx_high_water_pkt[i] = (uint8_t)MIN(can_take_high_water(can_queues[i]), 0xFFU);
+    health->can_tx_bulk_high_water_pkt[i] = (uint8_t)MIN(can_take_high_water(can_bulk_queues[i]), 0xFFU);
+    health->can_rx_missed_pkt[i] = (uint8_t)MIN(can_take_rx_missed(i), 0xFFU);
+  }
+  health->can_rx_delay_max_pkt = (uint16_t)MIN(can_take_rx_delay_max(), 0xFFFFU);
+
   return sizeof(*health);
 }
 
+int get_can_health_pkt(uint8_t bus_number, void *dat) {
+  COMPILE_TIME_ASSERT(sizeof(struct can_health_t) <= MAX_RESP_LEN);
+  struct can_health_t * can_health = (struct can_health_t*)dat;
+
+  can_bus_stats_t stats;
+  uint32_t now = TIM2->CNT;
+  can_take_bus_stats(bus_number, &stats);
+  uint32_t elapsed_us = now - stats.start_us;
+  float load = 0.0f;
+  if ((elapsed_us > 0U) && (can_speed[bus_number] > 0U)) {
+    // can_speed is in 100 bit/s
+    load = ((float)stats.bits * 1e7f) / ((float)can_speed[bus_number] * (float)elapsed_us);
+  }
+
+  uint32_t esr = 0U;
+  uint8_t can_number = CAN_NUM_FROM_BUS_NUM(bus_number);
+  if (can_number < CAN_MAX) {
+    esr = CANIF_FROM_CAN_NUM(can_number)->ESR;
+  }
+
+  can_health->rx_cnt_pkt = stats.rx_cnt;
+  can_health->tx_cnt_pkt = stats.tx_cnt;
+  can_health->bus_load_pkt = (uint16_t)MIN(load, 65535.0f);
+  can_health->error_passive_cnt_pkt = (uint16_t)MIN(stats.error_passive_cnt, 0xFFFFU);
+  can_health->bus_off_cnt_pkt = (uint16_t)MIN(stats.bus_off_cnt, 0xFFFFU);
+  can_health->esr_flags_pkt = esr & 0x7FU;
+  can_health->tec_pkt = (esr >> 16) & 0xFFU;
+  can_health->rec_pkt = (esr >> 24) & 0xFFU;
+
+  return sizeof(*can_health);
+}
+
 int get_rtc_pkt(void *dat) {
   timestamp_t t = rtc_get_time();
   (void)memcpy(dat, &t, sizeof(t));
@@ -194,7 +254,9 @@ int get_rtc_pkt(void *dat) {
 }
 
 int usb_cb_ep1_in(void *usbdata, int len, bool hardwired) {
-  UNUSED(hardwired);
+  if (hardwired && (can_framing == CAN_FRAMING_V2)) {
+    return can_framing_ep1_in((uint8_t *)usbdata, len);
+  }
   CAN_FIFOMailBox_TypeDef *reply = (CAN_FIFOMailBox_TypeDef *)usbdata;
   int ilen = 0;
   while (ilen < MIN(len/0x10, 4) && can_pop(&can_rx_q, &reply[ilen])) {
@@ -203,6 +265,18 @@ int usb_cb_ep1_in(void *usbdata, int len, bool hardwired) {
   return ilen*0x10;
 }
 
+// read the gps ring, what 0xe0 reads a control transfer at a time
+int usb_cb_ep2_in(void *usbdata, int len, bool hardwired) {
+  UNUSED(hardwired);
+  uint8_t *usbdata8 = (uint8_t *)usbdata;
+  dma_pointer_handler(&uart_ring_gps, DMA2_Stream5->NDTR);
+  int resp_len = 0;
+  while ((resp_len < len) && getc(&uart_ring_gps, (char *)&usbdata8[resp_len])) {
+    ++resp_len;
+  }
+  return resp_len;
+}
+
 // send on serial, first byte to select the ring
 void usb_cb_ep2_out(void *usbdata, int len, bool hardwired) {
   UNUSED(hardwired);
@@ -221,7 +295,10 @@ void usb_cb_ep2_out(void *usbdata, int len, bool hardwired) {
 
 // send on CAN
 void usb_cb_ep3_out(void *usbdata, int len, bool hardwired) {
-  UNUSED(hardwired);
+  if (hardwired && (can_framing == CAN_FRAMING_V2)) {
+    can_framing_ep3_out((uint8_t *)usbdata, len);
+    return;
+  }
   int dpkt = 0;
   uint32_t *d32 = (uint32_t *)usbdata;
   for (dpkt = 0; dpkt < (len / 4); dpkt += 4) {
@@ -245,12 +322,18 @@ void usb_cb_ep3_out_complete() {
 void usb_cb_enumeration_complete() {
   puts("USB enumeration complete\n");
   is_enumerated = 1;
+  // a new host starts out on v1, with every frame
+  can_framing_set(CAN_FRAMING_V1);
+  for (uint8_t i = 0U; i < BUS_MAX; i++) {
+    can_clear_filters(i);
+  }
 }
 
 int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, bool hardwired) {
   unsigned int resp_len = 0;
   uart_ring *ur = NULL;
   timestamp_t t;
+  uint32_t ts;
   switch (setup->b.bRequest) {
     // **** 0xa0: get rtc time
     case 0xa0:
@@ -298,6 +381,12 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, bool hardwired)
       t.second = setup->b.wValue.w;
       rtc_set_time(t);
       break;
+    // **** 0xa8: get the microsecond timer, for syncing the host's clock to CAN timestamps
+    case 0xa8:
+      ts = TIM2->CNT;
+      (void)memcpy(resp, &ts, 4U);
+      resp_len = 4U;
+      break;
     // **** 0xb0: set IR power
     case 0xb0:
       current_board->set_ir_power(setup->b.wValue.w);
@@ -557,6 +646,18 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, bool hardwired)
     case 0xe7:
       set_power_save_state(setup->b.wValue.w);
       break;
+    // **** 0xe8: set CAN framing, replies with the framing in use
+    case 0xe8:
+      if ((setup->b.wValue.w == CAN_FRAMING_V1) || (setup->b.wValue.w == CAN_FRAMING_V2)) {
+        can_framing_set((uint8_t)setup->b.wValue.w);
+      }
+      resp[0] = can_framing;
+      resp_len = 1U;
+      break;
+    // **** 0xe9: set deferred CAN rx, the safety hooks run outside the RX IRQs
+    case 0xe9:
+      can_set_rx_deferred(setup->b.wValue.w > 0U);
+      break;
     // **** 0xf0: k-line/l-line wake-up pulse for KWP2000 fast initialization
     case 0xf0:
       if(board_has_lin()) {
@@ -575,6 +676,7 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, bool hardwired)
       } else if (setup->b.wValue.w < BUS_MAX) {
         puts("Clearing CAN Tx queue\n");
         can_clear(can_queues[setup->b.wValue.w]);
+        can_clear(can_bulk_queues[setup->b.wValue.w]);
       } else {
         puts("Clearing CAN CAN ring buffer failed: wrong bus number\n");
       }
@@ -614,6 +716,39 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, bool hardwired)
     case 0xf6:
       siren_enabled = (setup->b.wValue.w != 0U);
       break;
+    // **** 0xf7: clear the filters of a bus, it sends every frame again
+    case 0xf7:
+      if (setup->b.wValue.w < BUS_MAX) {
+        can_clear_filters(setup->b.wValue.w);
+      }
+      break;
+    // **** 0xf8: add a standard id filter
+    case 0xf8:
+      // wValue = id in bits 0-10, bus in bits 12-15
+      // wIndex = the id bits that have to match
+      if ((setup->b.wValue.w >> 12) < BUS_MAX) {
+        if (!can_add_filter(setup->b.wValue.w >> 12, (setup->b.wValue.w & 0x7FFU) << 21, ((setup->b.wIndex.w & 0x7FFU) << 21) | 4U)) {
+          puts("CAN filters full\n");
+        }
+      }
+      break;
+    // **** 0xf9: add an extended id, matched exactly
+    case 0xf9:
+      // wValue = id bits 0-15
+      // wIndex = id bits 16-28 in bits 0-12, bus in bits 13-15
+      if ((setup->b.wIndex.w >> 13) < BUS_MAX) {
+        uint32_t id = ((setup->b.wIndex.w & 0x1FFFUL) << 16) | setup->b.wValue.w;
+        if (!can_add_filter(setup->b.wIndex.w >> 13, (id << 3) | 4U, 0xFFFFFFFCU)) {
+          puts("CAN filters full\n");
+        }
+      }
+      break;
+    // **** 0xfa: get the stats of bus wValue since they were last got
+    case 0xfa:
+      if (setup->b.wValue.w < BUS_MAX) {
+        resp_len = get_can_health_pkt(setup->b.wValue.w, resp);
+      }
+      break;
     default:
       puts("NO HANDLER ");
       puth(setup->b.bRequest);
@@ -653,6 +788,61 @@ int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out) {
   }
   return resp_len;
 }
+
+// the host's SPI link is hardwired, the bulk endpoints take it in USB packets like they do over USB
+int spi_cb_framed(uint8_t endpoint, uint8_t *data, int len, uint8_t *data_out, int max_len) {
+  int resp_len = 0;
+  switch (endpoint) {
+    case 0:
+      // control transfer, the data is the setup packet
+      if (len == (int)sizeof(USB_Setup_TypeDef)) {
+        USB_Setup_TypeDef *setup = (USB_Setup_TypeDef *)data;
+        resp_len = MIN(usb_cb_control_msg(setup, data_out, true), MIN((int)setup->b.wLength.w, max_len));
+      } else {
+        resp_len = -1;
+      }
+      break;
+    case 1:
+      // ep 1, read until a short packet
+      while ((resp_len + 0x40) <= max_len) {
+        int n = usb_cb_ep1_in(&data_out[resp_len], 0x40, true);
+        resp_len += n;
+        if (n < 0x40) {
+          break;
+        }
+      }
+      break;
+    case 2:
+      // ep 2, send serial, or read the gps without data, until a short packet
+      if (len == 0) {
+        while ((resp_len + 0x40) <= max_len) {
+          int n = usb_cb_ep2_in(&data_out[resp_len], 0x40, true);
+          resp_len += n;
+          if (n < 0x40) {
+            break;
+          }
+        }
+      }
+      for (int i = 0; i < len; i += 0x40) {
+        usb_cb_ep2_out(&data[i], MIN(len - i, 0x40), true);
+      }
+      break;
+    case 3:
+      // ep 3, send CAN. Where USB would NAK, the host tries again
+      if (can_tx_check_min_slots_free(MAX_CAN_MSGS_PER_BULK_TRANSFER * (((uint32_t)len + 0x3FU) / 0x40U))) {
+        for (int i = 0; i < len; i += 0x40) {
+          usb_cb_ep3_out(&data[i], MIN(len - i, 0x40), true);
+        }
+      } else {
+        resp_len = -1;
+      }
+      break;
+    default:
+      resp_len = -1;
+      break;
+  }
+  return resp_len;
+}
 #endif
 
 // ***************************** main code *****************************
@@ -74,16 +74,139 @@ void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
   }
 }
 
+// Hash tables of a safety mode's TX and RX check lists, built by its init, so the hooks look
+// up a message in a bounded number of probes instead of scanning. Lists without one are scanned
+#define SAFETY_LOOKUP_SLOTS 64U  // power of 2, twice the longest list
+#define SAFETY_LOOKUPS 8U
+#define SAFETY_LOOKUP_EMPTY 0xFFU
+
+typedef struct {
+  uint32_t addr;
+  uint8_t bus;
+  uint8_t len;
+  uint8_t index;  // in the list, SAFETY_LOOKUP_EMPTY if the slot is free
+  uint8_t alt;    // which of an AddrCheckStruct's msgs
+} safety_lookup_slot;
+
+typedef struct {
+  const void *list;
+  uint8_t max_probe;  // longest probe sequence of any entry
+  safety_lookup_slot slot[SAFETY_LOOKUP_SLOTS];
+} safety_lookup;
+
+safety_lookup safety_lookups[SAFETY_LOOKUPS];
+uint8_t safety_lookups_len = 0U;
+
+uint32_t safety_lookup_hash(int addr, int bus) {
+  return ((((uint32_t)addr) ^ ((uint32_t)bus << 29)) * 2654435761U) >> 26;  // 64 slots
+}
+
+safety_lookup *safety_lookup_get(const void *list) {
+  safety_lookup *ret = NULL;
+  for (uint8_t i = 0U; i < safety_lookups_len; i++) {
+    if (safety_lookups[i].list == list) {
+      ret = &safety_lookups[i];
+      break;
+    }
+  }
+  return ret;
+}
+
+// returns the new table, or NULL if there's no room
+safety_lookup *safety_lookup_new(const void *list, int entries) {
+  safety_lookup *ret = NULL;
+  if ((safety_lookups_len < SAFETY_LOOKUPS) && ((uint32_t)entries <= (SAFETY_LOOKUP_SLOTS / 2U)) &&
+      (safety_lookup_get(list) == NULL)) {
+    ret = &safety_lookups[safety_lookups_len];
+    safety_lookups_len++;
+    ret->list = list;
+    ret->max_probe = 0U;
+    for (uint32_t i = 0U; i < SAFETY_LOOKUP_SLOTS; i++) {
+      ret->slot[i].index = SAFETY_LOOKUP_EMPTY;
+    }
+  }
+  return ret;
+}
+
+// the first of duplicate entries is kept, like scanning
+void safety_lookup_insert(safety_lookup *lookup, int addr, int bus, int len, int index, int alt) {
+  uint32_t h = safety_lookup_hash(addr, bus);
+  for (uint8_t probe = 0U; probe < SAFETY_LOOKUP_SLOTS; probe++) {
+    safety_lookup_slot *s = &lookup->slot[(h + probe) & (SAFETY_LOOKUP_SLOTS - 1U)];
+    if (s->index == SAFETY_LOOKUP_EMPTY) {
+      s->addr = (uint32_t)addr;
+      s->bus = (uint8_t)bus;
+      s->len = (uint8_t)len;
+      s->index = (uint8_t)index;
+      s->alt = (uint8_t)alt;
+      lookup->max_probe = MAX(lookup->max_probe, probe + 1U);
+      break;
+    }
+    if ((s->addr == (uint32_t)addr) && (s->bus == (uint8_t)bus) && (s->len == (uint8_t)len)) {
+      break;
+    }
+  }
+}
+
+// returns the slot for the message, or NULL
+const safety_lookup_slot *safety_lookup_find(const safety_lookup *lookup, int addr, int bus, int len) {
+  const safety_lookup_slot *ret = NULL;
+  uint32_t h = safety_lookup_hash(addr, bus);
+  for (uint8_t probe = 0U; probe < lookup->max_probe; probe++) {
+    const safety_lookup_slot *s = &lookup->slot[(h + probe) & (SAFETY_LOOKUP_SLOTS - 1U)];
+    if (s->index == SAFETY_LOOKUP_EMPTY) {
+      break;
+    }
+    if ((s->addr == (uint32_t)addr) && (s->bus == (uint8_t)bus) && (s->len == (uint8_t)len)) {
+      ret = s;
+      break;
+    }
+  }
+  return ret;
+}
+
+void safety_lookup_add_tx(const CanMsg msg_list[], int len) {
+  safety_lookup *lookup = safety_lookup_new(msg_list, len);
+  if (lookup != NULL) {
+    for (int i = 0; i < len; i++) {
+      safety_lookup_insert(lookup, msg_list[i].addr, msg_list[i].bus, msg_list[i].len, i, 0);
+    }
+  }
+}
+
+void safety_lookup_add_rx(const AddrCheckStruct addr_list[], int len) {
+  int entries = 0;
+  for (int i = 0; i < len; i++) {
+    for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
+      entries++;
+    }
+  }
+  safety_lookup *lookup = safety_lookup_new(addr_list, entries);
+  if (lookup != NULL) {
+    for (int i = 0; i < len; i++) {
+      for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
+        const CanMsgCheck *m = &addr_list[i].msg[j];
+        safety_lookup_insert(lookup, m->addr, m->bus, m->len, i, j);
+      }
+    }
+  }
+}
+
 bool msg_allowed(CAN_FIFOMailBox_TypeDef *to_send, const CanMsg msg_list[], int len) {
   int addr = GET_ADDR(to_send);
   int bus = GET_BUS(to_send);
   int length = GET_LEN(to_send);
 
   bool allowed = false;
-  for (int i = 0; i < len; i++) {
-    if ((addr == msg_list[i].addr) && (bus == msg_list[i].bus) && (length == msg_list[i].len)) {
-      allowed = true;
-      break;
+  const safety_lookup *lookup = safety_lookup_get(msg_list);
+  if (lookup != NULL) {
+    allowed = safety_lookup_find(lookup, addr, bus, length) != NULL;
+  } else {
+    for (int i = 0; i < len; i++) {
+      if ((addr == msg_list[i].addr) && (bus == msg_list[i].bus) && (length == msg_list[i].len)) {
+        allowed = true;
+        break;
+      }
     }
   }
   return allowed;
@@ -101,24 +224,38 @@ int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_
   int length = GET_LEN(to_push);
 
   int index = -1;
-  for (int i = 0; i < len; i++) {
-    // if multiple msgs are allowed, determine which one is present on the bus
-    if (!addr_list[i].msg_seen) {
-      for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
-        if ((addr == addr_list[i].msg[j].addr) && (bus == addr_list[i].msg[j].bus) &&
-              (length == addr_list[i].msg[j].len)) {
-          addr_list[i].index = j;
-          addr_list[i].msg_seen = true;
-          break;
-        }
+  const safety_lookup *lookup = safety_lookup_get(addr_list);
+  if (lookup != NULL) {
+    const safety_lookup_slot *s = safety_lookup_find(lookup, addr, bus, length);
+    if (s != NULL) {
+      AddrCheckStruct *check = &addr_list[s->index];
+      // if multiple msgs are allowed, the first one seen is the one checked
+      if (!check->msg_seen) {
+        check->index = s->alt;
+        check->msg_seen = true;
       }
+      index = (check->index == (int)s->alt) ? (int)s->index : -1;
     }
+  } else {
+    for (int i = 0; i < len; i++) {
+      // if multiple msgs are allowed, determine which one is present on the bus
+      if (!addr_list[i].msg_seen) {
+        for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
+          if ((addr == addr_list[i].msg[j].addr) && (bus == addr_list[i].msg[j].bus) &&
+                (length == addr_list[i].msg[j].len)) {
+            addr_list[i].index = j;
+            addr_list[i].msg_seen = true;
+            break;
+          }
+        }
+      }
 
-    int idx = addr_list[i].index;
-    if ((addr == addr_list[i].msg[idx].addr) && (bus == addr_list[i].msg[idx].bus) &&
-        (length == addr_list[i].msg[idx].len)) {
-      index = i;
-      break;
+      int idx = addr_list[i].index;
+      if ((addr == addr_list[i].msg[idx].addr) && (bus == addr_list[i].msg[idx].bus) &&
+          (length == addr_list[i].msg[idx].len)) {
+        index = i;
+        break;
+      }
     }
   }
   return index;
@@ -286,6 +423,9 @@ int set_safety_hooks(uint16_t mode, int16_t param) {
   angle_meas.min = 0;
   angle_meas.max = 0;
 
+  // the new mode's init builds its own
+  safety_lookups_len = 0U;
+
   int set_status = -1;  // not set
   int hook_config_count = sizeof(safety_hook_registry) / sizeof(safety_hook_config);
   for (int i = 0; i < hook_config_count; i++) {
@@ -204,8 +204,14 @@ static int chrysler_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
 }
 
 
+static void chrysler_init(int16_t param) {
+  nooutput_init(param);
+  safety_lookup_add_tx(CHRYSLER_TX_MSGS, sizeof(CHRYSLER_TX_MSGS) / sizeof(CHRYSLER_TX_MSGS[0]));
+  safety_lookup_add_rx(chrysler_rx_checks, CHRYSLER_RX_CHECK_LEN);
+}
+
 const safety_hooks chrysler_hooks = {
-  .init = nooutput_init,
+  .init = chrysler_init,
   .rx = chrysler_rx_hook,
   .tx = chrysler_tx_hook,
   .tx_lin = nooutput_tx_lin_hook,
@@ -209,8 +209,14 @@ static int gm_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
 }
 
 
+static void gm_init(int16_t param) {
+  nooutput_init(param);
+  safety_lookup_add_tx(GM_TX_MSGS, sizeof(GM_TX_MSGS) / sizeof(GM_TX_MSGS[0]));
+  safety_lookup_add_rx(gm_rx_checks, GM_RX_CHECK_LEN);
+}
+
 const safety_hooks gm_hooks = {
-  .init = nooutput_init,
+  .init = gm_init,
   .rx = gm_rx_hook,
   .tx = gm_tx_hook,
   .tx_lin = nooutput_tx_lin_hook,
@@ -301,6 +301,8 @@ static void honda_nidec_init(int16_t param) {
   honda_hw = HONDA_N_HW;
   honda_alt_brake_msg = false;
   honda_bosch_long = false;
+  safety_lookup_add_tx(HONDA_N_TX_MSGS, sizeof(HONDA_N_TX_MSGS) / sizeof(HONDA_N_TX_MSGS[0]));
+  safety_lookup_add_rx(honda_rx_checks, HONDA_RX_CHECKS_LEN);
 }
 
 static void honda_bosch_giraffe_init(int16_t param) {
@@ -311,6 +313,12 @@ static void honda_bosch_giraffe_init(int16_t param) {
   honda_alt_brake_msg = GET_FLAG(param, HONDA_PARAM_ALT_BRAKE);
   // radar disabled so allow gas/brakes
   honda_bosch_long = GET_FLAG(param, HONDA_PARAM_BOSCH_LONG);
+  if (honda_bosch_long) {
+    safety_lookup_add_tx(HONDA_BG_LONG_TX_MSGS, sizeof(HONDA_BG_LONG_TX_MSGS) / sizeof(HONDA_BG_LONG_TX_MSGS[0]));
+  } else {
+    safety_lookup_add_tx(HONDA_BG_TX_MSGS, sizeof(HONDA_BG_TX_MSGS) / sizeof(HONDA_BG_TX_MSGS[0]));
+  }
+  safety_lookup_add_rx(honda_rx_checks, HONDA_RX_CHECKS_LEN);
 }
 
 static void honda_bosch_harness_init(int16_t param) {
@@ -321,6 +329,12 @@ static void honda_bosch_harness_init(int16_t param) {
   honda_alt_brake_msg = GET_FLAG(param, HONDA_PARAM_ALT_BRAKE);
   // radar disabled so allow gas/brakes
   honda_bosch_long = GET_FLAG(param, HONDA_PARAM_BOSCH_LONG);
+  if (honda_bosch_long) {
+    safety_lookup_add_tx(HONDA_BH_LONG_TX_MSGS, sizeof(HONDA_BH_LONG_TX_MSGS) / sizeof(HONDA_BH_LONG_TX_MSGS[0]));
+  } else {
+    safety_lookup_add_tx(HONDA_BH_TX_MSGS, sizeof(HONDA_BH_TX_MSGS) / sizeof(HONDA_BH_TX_MSGS[0]));
+  }
+  safety_lookup_add_rx(honda_bh_rx_checks, HONDA_BH_RX_CHECKS_LEN);
 }
 
 static int honda_nidec_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
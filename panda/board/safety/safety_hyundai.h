@@ -244,6 +244,8 @@ static void hyundai_init(int16_t param) {
   relay_malfunction_reset();
 
   hyundai_legacy = false;
+  safety_lookup_add_tx(HYUNDAI_TX_MSGS, sizeof(HYUNDAI_TX_MSGS) / sizeof(HYUNDAI_TX_MSGS[0]));
+  safety_lookup_add_rx(hyundai_rx_checks, HYUNDAI_RX_CHECK_LEN);
 }
 
 static void hyundai_legacy_init(int16_t param) {
@@ -252,6 +254,8 @@ static void hyundai_legacy_init(int16_t param) {
   relay_malfunction_reset();
 
   hyundai_legacy = true;
+  safety_lookup_add_tx(HYUNDAI_TX_MSGS, sizeof(HYUNDAI_TX_MSGS) / sizeof(HYUNDAI_TX_MSGS[0]));
+  safety_lookup_add_rx(hyundai_legacy_rx_checks, HYUNDAI_LEGACY_RX_CHECK_LEN);
 }
 
 const safety_hooks hyundai_hooks = {
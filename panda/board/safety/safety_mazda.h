@@ -188,6 +188,8 @@ static void mazda_init(int16_t param) {
   controls_allowed = false;
   relay_malfunction_reset();
   mazda_lkas_allowed = false;
+  safety_lookup_add_tx(MAZDA_TX_MSGS, sizeof(MAZDA_TX_MSGS) / sizeof(MAZDA_TX_MSGS[0]));
+  safety_lookup_add_rx(mazda_rx_checks, MAZDA_RX_CHECKS_LEN);
 }
 
 const safety_hooks mazda_hooks = {
@@ -194,6 +194,8 @@ static void nissan_init(int16_t param) {
   controls_allowed = 0;
   nissan_alt_eps = param ? 1 : 0;
   relay_malfunction_reset();
+  safety_lookup_add_tx(NISSAN_TX_MSGS, sizeof(NISSAN_TX_MSGS) / sizeof(NISSAN_TX_MSGS[0]));
+  safety_lookup_add_rx(nissan_rx_checks, NISSAN_RX_CHECK_LEN);
 }
 
 const safety_hooks nissan_hooks = {
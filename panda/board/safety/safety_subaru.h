@@ -320,8 +320,14 @@ static int subaru_legacy_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd)
   return bus_fwd;
 }
 
+static void subaru_init(int16_t param) {
+  nooutput_init(param);
+  safety_lookup_add_tx(SUBARU_TX_MSGS, SUBARU_TX_MSGS_LEN);
+  safety_lookup_add_rx(subaru_rx_checks, SUBARU_RX_CHECK_LEN);
+}
+
 const safety_hooks subaru_hooks = {
-  .init = nooutput_init,
+  .init = subaru_init,
   .rx = subaru_rx_hook,
   .tx = subaru_tx_hook,
   .tx_lin = nooutput_tx_lin_hook,
@@ -330,8 +336,14 @@ const safety_hooks subaru_hooks = {
   .addr_check_len = sizeof(subaru_rx_checks) / sizeof(subaru_rx_checks[0]),
 };
 
+static void subaru_legacy_init(int16_t param) {
+  nooutput_init(param);
+  safety_lookup_add_tx(SUBARU_L_TX_MSGS, SUBARU_L_TX_MSGS_LEN);
+  safety_lookup_add_rx(subaru_l_rx_checks, SUBARU_L_RX_CHECK_LEN);
+}
+
 const safety_hooks subaru_legacy_hooks = {
-  .init = nooutput_init,
+  .init = subaru_legacy_init,
   .rx = subaru_legacy_rx_hook,
   .tx = subaru_legacy_tx_hook,
   .tx_lin = nooutput_tx_lin_hook,
@@ -237,6 +237,8 @@ static void toyota_init(int16_t param) {
   relay_malfunction_reset();
   gas_interceptor_detected = 0;
   toyota_dbc_eps_torque_factor = param;
+  safety_lookup_add_tx(TOYOTA_TX_MSGS, sizeof(TOYOTA_TX_MSGS) / sizeof(TOYOTA_TX_MSGS[0]));
+  safety_lookup_add_rx(toyota_rx_checks, TOYOTA_RX_CHECKS_LEN);
 }
 
 static int toyota_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
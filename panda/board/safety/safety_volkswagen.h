@@ -126,6 +126,8 @@ static void volkswagen_mqb_init(int16_t param) {
   volkswagen_torque_msg = MSG_HCA_01;
   volkswagen_lane_msg = MSG_LDW_02;
   gen_crc_lookup_table(0x2F, volkswagen_crc8_lut_8h2f);
+  safety_lookup_add_tx(VOLKSWAGEN_MQB_TX_MSGS, VOLKSWAGEN_MQB_TX_MSGS_LEN);
+  safety_lookup_add_rx(volkswagen_mqb_rx_checks, VOLKSWAGEN_MQB_RX_CHECKS_LEN);
 }
 
 static void volkswagen_pq_init(int16_t param) {
@@ -135,6 +137,8 @@ static void volkswagen_pq_init(int16_t param) {
   relay_malfunction_reset();
   volkswagen_torque_msg = MSG_HCA_1;
   volkswagen_lane_msg = MSG_LDW_1;
+  safety_lookup_add_tx(VOLKSWAGEN_PQ_TX_MSGS, VOLKSWAGEN_PQ_TX_MSGS_LEN);
+  safety_lookup_add_rx(volkswagen_pq_rx_checks, VOLKSWAGEN_PQ_RX_CHECKS_LEN);
 }
 
 static int volkswagen_mqb_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
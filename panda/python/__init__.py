@@ -374,6 +374,21 @@ class Panda(object):
       "power_save_enabled": a[16]
     }
 
+  def can_health(self, bus):
+    """The traffic and errors of bus since the last call, bus_load in 0.1% of the bitrate"""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xfa, bus, 0, 17)
+    a = struct.unpack("<IIHHHBBB", dat)
+    return {
+      "rx_cnt": a[0],
+      "tx_cnt": a[1],
+      "bus_load": a[2],
+      "error_passive_cnt": a[3],
+      "bus_off_cnt": a[4],
+      "esr_flags": a[5],
+      "tec": a[6],
+      "rec": a[7],
+    }
+
   # ******************* control *******************
 
   def enter_bootloader(self):
@@ -445,6 +460,19 @@ class Panda(object):
     # TODO: This feature may not work correctly with saturated buses
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xdd, from_bus, to_bus, b'')
 
+  def set_can_filters(self, bus, filters):
+    """Only sends the host the frames of bus that match filters, (addr, mask) for standard ids, where mask
+    has the bits that have to match, or an addr. Addrs above 0x7ff are extended ids, matched exactly. The
+    panda also programs them into the CAN controller while its safety mode doesn't read the bus. None or
+    [] sends every frame again"""
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf7, bus, 0, b'')
+    for f in filters or []:
+      addr, mask = f if isinstance(f, tuple) else (f, 0x7ff)
+      if addr > 0x7ff:
+        self._handle.controlWrite(Panda.REQUEST_OUT, 0xf9, addr & 0xffff, (addr >> 16) | (bus << 13), b'')
+      else:
+        self._handle.controlWrite(Panda.REQUEST_OUT, 0xf8, addr | (bus << 12), mask & 0x7ff, b'')
+
   def set_gmlan(self, bus=2):
     # TODO: check panda type
     if bus is None:
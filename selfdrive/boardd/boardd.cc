@@ -13,8 +13,11 @@
 #include <iostream>
 #include <algorithm>
 #include <bitset>
+#include <sstream>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <memory>
 
 #include <libusb-1.0/libusb.h>
 
@@ -24,7 +27,10 @@
 #include "common/params.h"
 #include "common/swaglog.h"
 #include "common/timing.h"
+#include "common/trace.h"
+#include "common/alloc_tracker.h"
 #include "messaging.hpp"
+#include "services.h"
 
 #include "panda.h"
 #include "pigeon.h"
@@ -35,8 +41,17 @@
 #define CUTOFF_IL 200
 #define SATURATE_IL 1600
 #define NIBBLE_TO_HEX(n) ((n) < 10 ? (n) + '0' : ((n) - 10) + 'a')
-
+#define MAX_PANDAS 4
+// sendcan events taken at once, the rest wait for the next transfer
+#define SENDCAN_BATCH 8
+// BOARDD_CAN_PER_BUS also publishes the frames of buses 0 to CAN_BUS_SERVICES - 1 on their own, in
+// can0 and so on, for the consumers of one bus. can still has every bus
+#define CAN_BUS_SERVICES 3
+
+// panda is the first of pandas, the one in the car harness. It has the GPS, fan and
+// RTC, and its health is what the rest of openpilot sees as health
 Panda * panda = NULL;
+std::vector<Panda *> pandas;
 std::atomic<bool> safety_setter_thread_running(false);
 bool spoofing_started = false;
 bool fake_send = false;
@@ -44,6 +59,32 @@ bool connected_once = false;
 bool ignition = false;
 
 ExitHandler do_exit;
+
+// per panda, since the last health message. From the panda's receive time of a batch's
+// oldest message to publishing it, and sendcan's transfers
+struct CanRxLatency {
+  uint32_t batches = 0;
+  uint64_t total_us = 0, max_us = 0;
+};
+struct CanTxStats {
+  uint32_t transfers = 0, events = 0, late = 0, dropped = 0;
+  uint64_t max_delay_us = 0;
+};
+std::mutex can_stats_lock;
+CanRxLatency can_latency[MAX_PANDAS];
+CanTxStats can_tx_stats[MAX_PANDAS];
+
+bool pandas_connected() {
+  for (auto p : pandas) {
+    if (!p->connected) return false;
+  }
+  return true;
+}
+
+void set_safety_model(cereal::CarParams::SafetyModel safety_model, int safety_param=0) {
+  for (auto p : pandas) p->set_safety_model(safety_model, safety_param);
+}
+
 struct tm get_time(){
   time_t rawtime;
   time(&rawtime);
@@ -63,11 +104,11 @@ bool time_valid(struct tm sys_time){
 void safety_setter_thread() {
   LOGD("Starting safety setter thread");
   // diagnostic only is the default, needed for VIN query
-  panda->set_safety_model(cereal::CarParams::SafetyModel::ELM327);
+  set_safety_model(cereal::CarParams::SafetyModel::ELM327);
 
   // switch to SILENT when CarVin param is read
   while (true) {
-    if (do_exit || !panda->connected){
+    if (do_exit || !pandas_connected()){
       safety_setter_thread_running = false;
       return;
     };
@@ -84,12 +125,12 @@ void safety_setter_thread() {
   }
 
   // VIN query done, stop listening to OBDII
-  panda->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+  set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
 
   std::vector<char> params;
   LOGW("waiting for params to set safety model");
   while (true) {
-    if (do_exit || !panda->connected){
+    if (do_exit || !pandas_connected()){
       safety_setter_thread_running = false;
       return;
     };
@@ -109,31 +150,74 @@ void safety_setter_thread() {
   cereal::CarParams::SafetyModel safety_model = car_params.getSafetyModel();
 
   LOGW("setting unsafe mode: disable enforcement of disengage on gas");
-  panda->set_unsafe_mode();
+  for (auto p : pandas) p->set_unsafe_mode();
 
   auto safety_param = car_params.getSafetyParam();
   LOGW("setting safety model: %d with param %d", (int)safety_model, safety_param);
 
-  panda->set_safety_model(safety_model, safety_param);
+  set_safety_model(safety_model, safety_param);
 
   safety_setter_thread_running = false;
 }
 
 
+// BOARDD_PANDAS is a comma separated list of the serials to connect to, the first is the
+// primary. Otherwise all connected pandas are used, in order of serial
+std::vector<std::string> panda_serials() {
+  const char *env = getenv("BOARDD_PANDAS");
+  if (env == NULL) {
+    std::vector<std::string> serials = Panda::list();
+    // any panda, as before, if none could be listed
+    if (serials.empty()) return {""};
+    std::sort(serials.begin(), serials.end());
+    if (serials.size() > MAX_PANDAS) {
+      LOGW("found %d pandas, using the first %d", serials.size(), MAX_PANDAS);
+      serials.resize(MAX_PANDAS);
+    }
+    return serials;
+  }
+
+  std::vector<std::string> serials;
+  std::stringstream ss(env);
+  std::string serial;
+  while (std::getline(ss, serial, ',')) {
+    if (!serial.empty()) serials.push_back(serial);
+  }
+  assert(serials.size() <= MAX_PANDAS);
+  return serials;
+}
+
 bool usb_connect() {
-  try {
-    assert(panda == NULL);
-    panda = new Panda();
-  } catch (std::exception &e) {
-    return false;
+  assert(panda == NULL && pandas.empty());
+
+  std::vector<std::string> serials = panda_serials();
+  if (serials.empty()) return false;
+
+  std::vector<Panda *> connected;
+  for (int i = 0; i < serials.size(); i++) {
+    try {
+      connected.push_back(new Panda(serials[i], i * PANDA_BUS_CNT));
+    } catch (std::exception &e) {
+      for (auto p : connected) delete p;
+      return false;
+    }
+    LOGW("panda %s on buses %d-%d", serials[i].c_str(), i * PANDA_BUS_CNT, (i + 1) * PANDA_BUS_CNT - 1);
   }
 
   Params params = Params();
 
   if (getenv("BOARDD_LOOPBACK")) {
-    panda->set_loopback(true);
+    for (auto p : connected) p->set_loopback(true);
   }
 
+  // the panda runs its safety hooks outside the CAN rx IRQs, so they keep up at high bus load
+  const char *deferred_env = getenv("BOARDD_CAN_RX_DEFERRED");
+  const bool deferred = deferred_env ? atoi(deferred_env) != 0 : true;
+  for (auto p : connected) p->set_can_rx_deferred(deferred);
+
+  pandas = connected;
+  panda = pandas[0];
+
   const char *fw_sig_buf = panda->get_firmware_version();
   if (fw_sig_buf){
     params.write_db_value("PandaFirmware", fw_sig_buf, 128);
@@ -186,54 +270,179 @@ bool usb_connect() {
   return true;
 }
 
+void usb_disconnect() {
+  panda = NULL;
+  for (auto p : pandas) delete p;
+  pandas.clear();
+}
+
 // must be called before threads or with mutex
 void usb_retry_connect() {
   LOGW("attempting to connect");
-  while (!usb_connect()) { util::sleep_for(100); }
-  LOGW("connected to board");
+  while (!usb_connect()) {
+    usb_disconnect();
+    util::sleep_for(100);
+  }
+  LOGW("connected to %d board(s)", pandas.size());
+  notify_ready("boardd");
 }
 
-void can_recv(PubMaster &pm) {
-  // create message
-  MessageBuilder msg;
-  auto event = msg.initEvent();
-  panda->can_receive(event);
-  pm.send("can", msg);
+void can_recv(PubMaster &pm, bool async, PubMaster *bus_pm) {
+  TRACE_SCOPE("can_recv");
+  const uint8_t *data[MAX_PANDAS];
+  const uint64_t *rx_times[MAX_PANDAS];
+  int len[MAX_PANDAS], count[MAX_PANDAS];
+  int total_len = 0, total_count = 0;
+  for (int i = 0; i < pandas.size(); i++) {
+    len[i] = async ? pandas[i]->can_read_async(&data[i], &rx_times[i]) : pandas[i]->can_read(&data[i], &rx_times[i]);
+    count[i] = can_count(data[i], len[i], pandas[i]->can_framing);
+    total_len += len[i];
+    total_count += count[i];
+  }
+
+  // all pandas' CAN goes out in one message, built straight into the publisher's buffer
+  InPlaceMessageBuilder msg(pm, "can", can_event_size(total_count, total_len));
+  auto can = msg.initEvent().initCan(total_count);
+  int n = 0;
+  for (int i = 0; i < pandas.size(); i++) {
+    n += can_unpack(data[i], len[i], can, n, pandas[i]->bus_offset, pandas[i]->can_framing, rx_times[i]);
+  }
+
+  if (bus_pm == nullptr) {
+    msg.commit();
+  } else {
+    // copied out of can before it's sent, and sent after it
+    static const char *bus_services[CAN_BUS_SERVICES] = {"can0", "can1", "can2"};
+    int bus_count[CAN_BUS_SERVICES] = {};
+    for (auto c : can) {
+      if (c.getSrc() < CAN_BUS_SERVICES) bus_count[c.getSrc()]++;
+    }
+    std::unique_ptr<InPlaceMessageBuilder> bus_msgs[CAN_BUS_SERVICES];
+    capnp::List<cereal::CanData>::Builder bus_can[CAN_BUS_SERVICES];
+    for (int bus = 0; bus < CAN_BUS_SERVICES; bus++) {
+      bus_msgs[bus].reset(new InPlaceMessageBuilder(*bus_pm, bus_services[bus], can_event_size(bus_count[bus], total_len)));
+      auto event = bus_msgs[bus]->initEvent();
+      bus_can[bus] = bus == 0 ? event.initCan0(bus_count[bus]) : bus == 1 ? event.initCan1(bus_count[bus]) : event.initCan2(bus_count[bus]);
+      bus_count[bus] = 0;
+    }
+    for (auto c : can.asReader()) {
+      const uint8_t bus = c.getSrc();
+      if (bus < CAN_BUS_SERVICES) bus_can[bus].setWithCaveats(bus_count[bus]++, c);
+    }
+    msg.commit();
+    for (auto &m : bus_msgs) m->commit();
+  }
+
+  uint64_t sent = nanos_since_boot();
+  std::lock_guard<std::mutex> lk(can_stats_lock);
+  for (int i = 0; i < pandas.size(); i++) {
+    uint64_t oldest = UINT64_MAX;
+    for (int j = 0; j < count[i]; j++) {
+      if (rx_times[i][j] != 0) oldest = std::min(oldest, rx_times[i][j]);
+    }
+    if (oldest == UINT64_MAX) continue;
+
+    // a stale clock sync can put the receive time a little ahead
+    uint64_t latency_us = sent > oldest ? (sent - oldest) / 1000 : 0;
+    CanRxLatency &l = can_latency[pandas[i]->bus_offset / PANDA_BUS_CNT];
+    l.batches++;
+    l.total_us += latency_us;
+    l.max_us = std::max(l.max_us, latency_us);
+  }
 }
 
-void can_send_thread() {
-  LOGD("start send thread");
+// every panda reads sendcan, and sends what's on its buses. Whatever has arrived is sent
+// together in one transfer, earliest deadline first. An event's deadline is its logMonoTime
+// plus BOARDD_SENDCAN_DEADLINE_MS (default 10). Later ones still go and are counted late,
+// those over a second old are dropped
+void can_send_thread(Panda *p) {
+  LOGD("start send thread for %s", p->usb_serial.c_str());
 
   Context * context = Context::create();
   SubSocket * subscriber = SubSocket::create(context, "sendcan");
   assert(subscriber != NULL);
   subscriber->setTimeout(100);
 
+  const char *deadline_env = getenv("BOARDD_SENDCAN_DEADLINE_MS");
+  const uint64_t deadline_ns = (deadline_env ? atoi(deadline_env) : 10) * 1000000ULL;
+
+  // messages are copied here to align them, they only grow
+  kj::Array<capnp::word> amsgs[SENDCAN_BATCH];
+  size_t sizes[SENDCAN_BATCH];
+  // logMonoTime and index. The deadlines are all the same after it, so this is their order too
+  std::pair<uint64_t, int> order[SENDCAN_BATCH];
+  bool queued[SENDCAN_BATCH];
+
   // run as fast as messages come in
-  while (!do_exit && panda->connected) {
-    Message * msg = subscriber->receive();
+  AllocLoop alloc_loop("can_send");
+  while (!do_exit && pandas_connected()) {
+    alloc_loop.iteration();
+    int n = 0;
+    Message *msg = subscriber->receive();
+    while (msg) {
+      const size_t words = (msg->getSize() / sizeof(capnp::word)) + 1;
+      if (amsgs[n].size() < words) amsgs[n] = kj::heapArray<capnp::word>(words);
+      memcpy(amsgs[n].begin(), msg->getData(), msg->getSize());
+      sizes[n] = words;
+      delete msg;
+
+      capnp::FlatArrayMessageReader cmsg(amsgs[n].slice(0, words));
+      order[n] = {cmsg.getRoot<cereal::Event>().getLogMonoTime(), n};
+      n++;
+      msg = n < SENDCAN_BATCH ? subscriber->receive(true) : NULL;
+    }
 
-    if (!msg){
+    if (n == 0) {
       if (errno == EINTR) {
         do_exit = true;
       }
       continue;
     }
 
-    auto amsg = kj::heapArray<capnp::word>((msg->getSize() / sizeof(capnp::word)) + 1);
-    memcpy(amsg.begin(), msg->getData(), msg->getSize());
-
-    capnp::FlatArrayMessageReader cmsg(amsg);
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    TRACE_SCOPE("can_send");
+    std::sort(order, order + n);
+    uint64_t now = nanos_since_boot();
+    uint64_t oldest = 0;
+    int sent = 0, late = 0, dropped = 0;
+    for (int i = 0; i < n; i++) {
+      auto [mono_time, k] = order[i];
+      //Dont send if older than 1 second
+      queued[i] = now - mono_time < 1e9;
+      if (!queued[i]) {
+        dropped++;
+        continue;
+      }
+      if (sent == 0) oldest = mono_time;
 
-    //Dont send if older than 1 second
-    if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
-      if (!fake_send){
-        panda->can_send(event.getSendcan());
+      capnp::FlatArrayMessageReader cmsg(amsgs[k].slice(0, sizes[k]));
+      if (!fake_send) {
+        p->can_send_add(cmsg.getRoot<cereal::Event>().getSendcan());
       }
+      sent++;
+    }
+    // the write gets until the earliest deadline, between 1 and 5ms
+    uint64_t earliest = oldest + deadline_ns;
+    unsigned int timeout = earliest > now ? std::clamp<uint64_t>((earliest - now) / 1000000, 1, 5) : 1;
+    if (sent > 0 && !fake_send && !p->can_send_flush(timeout)) {
+      LOGE_100("sendcan transfer failed, dropped %d events", sent);
+      dropped += sent;
+      sent = 0;
+    }
+
+    uint64_t done = nanos_since_boot();
+    for (int i = 0; i < n && sent > 0; i++) {
+      if (queued[i] && done > order[i].first + deadline_ns) late++;
     }
 
-    delete msg;
+    std::lock_guard<std::mutex> lk(can_stats_lock);
+    CanTxStats &s = can_tx_stats[p->bus_offset / PANDA_BUS_CNT];
+    s.dropped += dropped;
+    if (sent > 0) {
+      s.transfers++;
+      s.events += sent;
+      s.late += late;
+      s.max_delay_us = std::max(s.max_delay_us, (done - oldest) / 1000);
+    }
   }
 
   delete subscriber;
@@ -245,32 +454,202 @@ void can_recv_thread() {
 
   // can = 8006
   PubMaster pm({"can"});
+  std::unique_ptr<PubMaster> bus_pm;
+  if (getenv("BOARDD_CAN_PER_BUS")) {
+    bus_pm.reset(new PubMaster({"can0", "can1", "can2"}));
+  }
 
-  // run at 100hz
-  const uint64_t dt = 10000000ULL;
+  // CAN is read as soon as the panda has it, and published at most once per window.
+  // The default of 10ms keeps the 100hz cadence controlsd runs on, 0 publishes every read
+  const char *window_env = getenv("BOARDD_CAN_WINDOW_MS");
+  const uint64_t dt = (window_env ? atof(window_env) : 10) * 1e6;
+
+  bool async = true;
+  for (auto p : pandas) async = p->can_recv_start() && async;
+  if (!async) {
+    LOGE("failed to start async CAN reads, reading synchronously");
+    for (auto p : pandas) p->can_recv_stop();
+  }
+
+  // this thread handles the first panda's USB events, usb_event_thread the others'
   uint64_t next_frame_time = nanos_since_boot() + dt;
+  AllocLoop alloc_loop("can_recv");
+  while (!do_exit && pandas_connected()) {
+    alloc_loop.iteration();
+    if (!async) {
+      can_recv(pm, false, bus_pm.get());
+
+      sleep_until_nanos_since_boot(next_frame_time);
+      next_frame_time = std::max(next_frame_time, nanos_since_boot()) + std::max(dt, (uint64_t)1000000ULL);
+      continue;
+    }
 
-  while (!do_exit && panda->connected) {
-    can_recv(pm);
+    if (dt == 0) {
+      panda->handle_usb_events(10000);
+      bool pending = false;
+      for (auto p : pandas) pending = pending || p->can_recv_pending();
+      if (pending) can_recv(pm, true, bus_pm.get());
+      continue;
+    }
 
     uint64_t cur_time = nanos_since_boot();
     int64_t remaining = next_frame_time - cur_time;
-    if (remaining > 0){
-      std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
-    } else {
+    if (remaining > 0) {
+      // returns early when a read completes
+      panda->handle_usb_events(remaining / 1000);
+      continue;
+    }
+
+    can_recv(pm, true, bus_pm.get());
+    if (remaining < -(int64_t)dt) {
       if (ignition){
-        LOGW("missed cycles (%d) %lld", (int)-1*remaining/dt, remaining);
+        LOGW("missed cycles (%d) %lld", (int)(-1*remaining/dt), remaining);
       }
       next_frame_time = cur_time;
     }
-
     next_frame_time += dt;
   }
+
+  if (async) {
+    for (auto p : pandas) p->can_recv_stop();
+  }
+}
+
+void usb_event_thread(Panda *p) {
+  LOGD("start usb event thread for %s", p->usb_serial.c_str());
+  while (!do_exit && pandas_connected()) {
+    p->handle_usb_events(100000);
+  }
+}
+
+static void fill_health(Panda *p, const health_t &health, cereal::HealthData::Builder healthData) {
+  uint16_t fan_speed_rpm = p->get_fan_speed();
+
+  // set fields
+  healthData.setUptime(health.uptime);
+
+#ifdef QCOM2
+  if (p == panda) {
+    healthData.setVoltage(std::stoi(util::read_file("/sys/class/hwmon/hwmon1/in1_input")));
+    healthData.setCurrent(std::stoi(util::read_file("/sys/class/hwmon/hwmon1/curr1_input")));
+  } else {
+    healthData.setVoltage(health.voltage);
+    healthData.setCurrent(health.current);
+  }
+#else
+  healthData.setVoltage(health.voltage);
+  healthData.setCurrent(health.current);
+#endif
+
+  healthData.setIgnitionLine(health.ignition_line);
+  healthData.setIgnitionCan(health.ignition_can);
+  healthData.setControlsAllowed(health.controls_allowed);
+  healthData.setGasInterceptorDetected(health.gas_interceptor_detected);
+  healthData.setHasGps(p->is_pigeon);
+  healthData.setCanRxErrs(health.can_rx_errs);
+  healthData.setCanSendErrs(health.can_send_errs);
+  healthData.setCanFwdErrs(health.can_fwd_errs);
+  healthData.setGmlanSendErrs(health.gmlan_send_errs);
+  healthData.setHwType(p->hw_type);
+  healthData.setUsbPowerMode(cereal::HealthData::UsbPowerMode(health.usb_power_mode));
+  healthData.setSafetyModel(cereal::CarParams::SafetyModel(health.safety_model));
+  healthData.setFanSpeedRpm(fan_speed_rpm);
+  healthData.setFaultStatus(cereal::HealthData::FaultStatus(health.fault_status));
+  healthData.setPowerSaveEnabled((bool)(health.power_save_enabled));
+  healthData.setSerial(p->usb_serial);
+  healthData.setBusOffset(p->bus_offset);
+
+  UsbRequestStats usb_stats[(int)UsbRequest::NUM];
+  p->take_usb_stats(usb_stats);
+  auto usb_requests = healthData.initUsbRequests((int)UsbRequest::NUM);
+  for (int i = 0; i < (int)UsbRequest::NUM; i++) {
+    usb_requests[i].setType(cereal::HealthData::UsbRequestType(i));
+    usb_requests[i].setCount(usb_stats[i].count);
+    usb_requests[i].setLockWaitUs(usb_stats[i].lock_wait_us);
+    usb_requests[i].setMaxLockWaitUs(usb_stats[i].max_lock_wait_us);
+    usb_requests[i].setTransferUs(usb_stats[i].transfer_us);
+    usb_requests[i].setMaxTransferUs(usb_stats[i].max_transfer_us);
+  }
+
+  CanRxLatency latency;
+  CanTxStats tx;
+  {
+    std::lock_guard<std::mutex> lk(can_stats_lock);
+    latency = can_latency[p->bus_offset / PANDA_BUS_CNT];
+    can_latency[p->bus_offset / PANDA_BUS_CNT] = CanRxLatency();
+    tx = can_tx_stats[p->bus_offset / PANDA_BUS_CNT];
+    can_tx_stats[p->bus_offset / PANDA_BUS_CNT] = CanTxStats();
+  }
+  bool clock_synced = p->sync_clock();
+  auto rx_latency = healthData.initCanRxLatency();
+  rx_latency.setBatches(latency.batches);
+  rx_latency.setMeanUs(latency.batches ? latency.total_us / latency.batches : 0);
+  rx_latency.setMaxUs(latency.max_us);
+  rx_latency.setClockSynced(clock_synced);
+  rx_latency.setClockSyncRttUs(p->clock_sync_rtt_us);
+
+  auto high_water = healthData.initCanTxHighWater(PANDA_BUS_CNT);
+  auto bulk_high_water = healthData.initCanTxBulkHighWater(PANDA_BUS_CNT);
+  auto rx_missed = healthData.initCanRxMissed(PANDA_BUS_CNT);
+  for (int i = 0; i < PANDA_BUS_CNT; i++) {
+    high_water.set(i, health.can_tx_high_water[i]);
+    bulk_high_water.set(i, health.can_tx_bulk_high_water[i]);
+    rx_missed.set(i, health.can_rx_missed[i]);
+  }
+  healthData.setCanRxDelayMaxUs(health.can_rx_delay_max_us);
+
+  can_health_t can_healths[PANDA_BUS_CNT];
+  int can_health_cnt = 0;
+  while (can_health_cnt < PANDA_BUS_CNT && p->get_can_health(can_health_cnt, can_healths[can_health_cnt])) {
+    can_health_cnt++;
+  }
+  auto bus_stats = healthData.initCanBusStats(can_health_cnt);
+  for (int i = 0; i < can_health_cnt; i++) {
+    const can_health_t &c = can_healths[i];
+    // ESR's flags, bus off over passive over warning
+    auto state = cereal::HealthData::CanErrorState::ACTIVE;
+    if (c.esr_flags & 4) {
+      state = cereal::HealthData::CanErrorState::BUS_OFF;
+    } else if (c.esr_flags & 2) {
+      state = cereal::HealthData::CanErrorState::PASSIVE;
+    } else if (c.esr_flags & 1) {
+      state = cereal::HealthData::CanErrorState::WARNING;
+    }
+    bus_stats[i].setRxCount(c.rx_cnt);
+    bus_stats[i].setTxCount(c.tx_cnt);
+    bus_stats[i].setBusLoad(c.bus_load / 10.0);
+    bus_stats[i].setErrorPassiveCount(c.error_passive_cnt);
+    bus_stats[i].setBusOffCount(c.bus_off_cnt);
+    bus_stats[i].setErrorState(state);
+    bus_stats[i].setLastErrorCode((c.esr_flags >> 4) & 0x7);
+    bus_stats[i].setTxErrorCounter(c.tec);
+    bus_stats[i].setRxErrorCounter(c.rec);
+  }
+
+  auto can_tx = healthData.initCanTx();
+  can_tx.setTransfers(tx.transfers);
+  can_tx.setEvents(tx.events);
+  can_tx.setLate(tx.late);
+  can_tx.setDropped(tx.dropped);
+  can_tx.setMaxDelayUs(tx.max_delay_us);
+
+  // Convert faults bitset to capnp list
+  std::bitset<sizeof(health.faults) * 8> fault_bits(health.faults);
+  auto faults = healthData.initFaults(fault_bits.count());
+
+  size_t i = 0;
+  for (size_t f = size_t(cereal::HealthData::FaultType::RELAY_MALFUNCTION);
+      f <= size_t(cereal::HealthData::FaultType::INTERRUPT_RATE_CAN_RX_DEFER); f++){
+    if (fault_bits.test(f)) {
+      faults.set(i, cereal::HealthData::FaultType(f));
+      i++;
+    }
+  }
 }
 
 void can_health_thread() {
   LOGD("start health thread");
-  PubMaster pm({"health"});
+  PubMaster pm({"health", "pandaHealth"});
 
   uint32_t no_ignition_cnt = 0;
   bool ignition_last = false;
@@ -287,21 +666,23 @@ void can_health_thread() {
   }
 
   // run at 2hz
-  while (!do_exit && panda->connected) {
-    MessageBuilder msg;
-    auto healthData = msg.initEvent().initHealth();
+  while (!do_exit && pandas_connected()) {
+    health_t healths[MAX_PANDAS];
+    for (int i = 0; i < pandas.size(); i++) {
+      healths[i] = pandas[i]->get_health();
 
-    health_t health = panda->get_health();
-
-    if (spoofing_started) {
-      health.ignition_line = 1;
-    }
+      if (spoofing_started) {
+        healths[i].ignition_line = 1;
+      }
 
-    // Make sure CAN buses are live: safety_setter_thread does not work if Panda CAN are silent and there is only one other CAN node
-    if (health.safety_model == (uint8_t)(cereal::CarParams::SafetyModel::SILENT)) {
-      panda->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+      // Make sure CAN buses are live: safety_setter_thread does not work if Panda CAN are silent and there is only one other CAN node
+      if (healths[i].safety_model == (uint8_t)(cereal::CarParams::SafetyModel::SILENT)) {
+        pandas[i]->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+      }
     }
 
+    // ignition comes from the primary panda
+    const health_t &health = healths[0];
     ignition = ((health.ignition_line != 0) || (health.ignition_can != 0));
 
     if (ignition) {
@@ -312,16 +693,17 @@ void can_health_thread() {
 
 #ifndef __x86_64__
     bool power_save_desired = !ignition;
-    if (health.power_save_enabled != power_save_desired){
-      panda->set_power_saving(power_save_desired);
-    }
+    for (int i = 0; i < pandas.size(); i++) {
+      if (healths[i].power_save_enabled != power_save_desired){
+        pandas[i]->set_power_saving(power_save_desired);
+      }
 
-    // set safety mode to NO_OUTPUT when car is off. ELM327 is an alternative if we want to leverage athenad/connect
-    if (!ignition && (health.safety_model != (uint8_t)(cereal::CarParams::SafetyModel::NO_OUTPUT))) {
-      panda->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+      // set safety mode to NO_OUTPUT when car is off. ELM327 is an alternative if we want to leverage athenad/connect
+      if (!ignition && (healths[i].safety_model != (uint8_t)(cereal::CarParams::SafetyModel::NO_OUTPUT))) {
+        pandas[i]->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+      }
     }
 #endif
-
     // clear VIN, CarParams, and set new safety on car start
     if (ignition && !ignition_last) {
       int result = params.delete_db_value("CarVin");
@@ -347,49 +729,20 @@ void can_health_thread() {
     }
 
     ignition_last = ignition;
-    uint16_t fan_speed_rpm = panda->get_fan_speed();
-
-    // set fields
-    healthData.setUptime(health.uptime);
-
-#ifdef QCOM2
-    healthData.setVoltage(std::stoi(util::read_file("/sys/class/hwmon/hwmon1/in1_input")));
-    healthData.setCurrent(std::stoi(util::read_file("/sys/class/hwmon/hwmon1/curr1_input")));
-#else
-    healthData.setVoltage(health.voltage);
-    healthData.setCurrent(health.current);
-#endif
 
-    healthData.setIgnitionLine(health.ignition_line);
-    healthData.setIgnitionCan(health.ignition_can);
-    healthData.setControlsAllowed(health.controls_allowed);
-    healthData.setGasInterceptorDetected(health.gas_interceptor_detected);
-    healthData.setHasGps(panda->is_pigeon);
-    healthData.setCanRxErrs(health.can_rx_errs);
-    healthData.setCanSendErrs(health.can_send_errs);
-    healthData.setCanFwdErrs(health.can_fwd_errs);
-    healthData.setGmlanSendErrs(health.gmlan_send_errs);
-    healthData.setHwType(panda->hw_type);
-    healthData.setUsbPowerMode(cereal::HealthData::UsbPowerMode(health.usb_power_mode));
-    healthData.setSafetyModel(cereal::CarParams::SafetyModel(health.safety_model));
-    healthData.setFanSpeedRpm(fan_speed_rpm);
-    healthData.setFaultStatus(cereal::HealthData::FaultStatus(health.fault_status));
-    healthData.setPowerSaveEnabled((bool)(health.power_save_enabled));
-
-    // Convert faults bitset to capnp list
-    std::bitset<sizeof(health.faults) * 8> fault_bits(health.faults);
-    auto faults = healthData.initFaults(fault_bits.count());
-
-    size_t i = 0;
-    for (size_t f = size_t(cereal::HealthData::FaultType::RELAY_MALFUNCTION);
-        f <= size_t(cereal::HealthData::FaultType::INTERRUPT_RATE_TIM9); f++){
-      if (fault_bits.test(f)) {
-        faults.set(i, cereal::HealthData::FaultType(f));
-        i++;
-      }
+    // every panda's health in bus order, and the primary's on its own for the rest of openpilot
+    MessageBuilder all_msg;
+    auto all = all_msg.initEvent().initPandaHealth(pandas.size());
+    for (int i = 0; i < pandas.size(); i++) {
+      fill_health(pandas[i], healths[i], all[i]);
     }
+
+    MessageBuilder msg;
+    msg.initEvent().setHealth(all[0].asReader());
     pm.send("health", msg);
-    panda->send_heartbeat();
+    pm.send("pandaHealth", all_msg);
+
+    for (auto p : pandas) p->send_heartbeat();
     util::sleep_for(500);
   }
 }
@@ -407,7 +760,7 @@ void hardware_control_thread() {
 #endif
   unsigned int cnt = 0;
 
-  while (!do_exit && panda->connected) {
+  while (!do_exit && pandas_connected()) {
     cnt++;
     sm.update(1000); // TODO: what happens if EINTR is sent while in sm.update?
 
@@ -465,22 +818,25 @@ void hardware_control_thread() {
   }
 }
 
-static void pigeon_publish_raw(PubMaster &pm, std::string dat) {
+static void pigeon_publish_raw(PubMaster &pm, const uint8_t *dat, int len) {
   // create message
   MessageBuilder msg;
-  auto ublox_raw = msg.initEvent().initUbloxRaw(dat.length());
-  memcpy(ublox_raw.begin(), dat.data(), dat.length());
+  msg.initEvent().setUbloxRaw(kj::arrayPtr(dat, len));
 
   pm.send("ubloxRaw", msg);
 }
 
 
+// how often the ublox's database is saved onroad, it's saved again when the ignition goes off
+#define PIGEON_DATABASE_POLL_NS (5 * 60 * 1000000000ULL)
+
 void pigeon_thread() {
   if (!panda->is_pigeon){ return; };
 
   // ubloxRaw = 8042
   PubMaster pm({"ubloxRaw"});
   bool ignition_last = false;
+  uint64_t last_database_poll = 0;
 
 #ifdef QCOM2
   Pigeon * pigeon = Pigeon::connect("/dev/ttyHS0");
@@ -488,16 +844,18 @@ void pigeon_thread() {
   Pigeon * pigeon = Pigeon::connect(panda);
 #endif
 
-  while (!do_exit && panda->connected) {
-    std::string recv = pigeon->receive();
-    if (recv.length() > 0) {
-      if (recv[0] == (char)0x00){
+  uint8_t recv[PIGEON_RECV_SIZE];
+  while (!do_exit && pandas_connected()) {
+    // waits for the GPS, published as soon as it comes. The timeout keeps the ignition edge checked
+    int len = pigeon->receive(recv, sizeof(recv), 10);
+    if (len > 0) {
+      if (recv[0] == 0x00){
         if (ignition) {
           LOGW("received invalid ublox message while onroad, resetting panda GPS");
           pigeon->init();
         }
       } else {
-        pigeon_publish_raw(pm, recv);
+        pigeon_publish_raw(pm, recv, len);
       }
     }
 
@@ -505,12 +863,16 @@ void pigeon_thread() {
     // since it was turned off in low power mode
     if(ignition && !ignition_last) {
       pigeon->init();
+      last_database_poll = nanos_since_boot();
     }
 
-    ignition_last = ignition;
+    // the next init's assistance, ubloxd saves the dump
+    if ((ignition && nanos_since_boot() - last_database_poll > PIGEON_DATABASE_POLL_NS) || (!ignition && ignition_last)) {
+      pigeon->request_database();
+      last_database_poll = nanos_since_boot();
+    }
 
-    // 10ms - 100 Hz
-    util::sleep_for(10);
+    ignition_last = ignition;
   }
 
   delete pigeon;
@@ -522,10 +884,8 @@ int main() {
   LOGW("starting boardd");
 
   // set process priority and affinity
-  err = set_realtime_priority(54);
-  LOG("set priority returns %d", err);
-  err = set_core_affinity(3);
-  LOG("set affinity returns %d", err);
+  err = set_sched_profile("boardd");
+  LOG("set sched profile returns %d", err);
 
   // check the environment
   if (getenv("STARTED")) {
@@ -545,14 +905,16 @@ int main() {
     // connect to the board
     usb_retry_connect();
 
-    threads.push_back(std::thread(can_send_thread));
+    for (auto p : pandas) {
+      threads.push_back(std::thread(can_send_thread, p));
+      if (p != panda) threads.push_back(std::thread(usb_event_thread, p));
+    }
     threads.push_back(std::thread(can_recv_thread));
     threads.push_back(std::thread(hardware_control_thread));
     threads.push_back(std::thread(pigeon_thread));
 
     for (auto &t : threads) t.join();
 
-    delete panda;
-    panda = NULL;
+    usb_disconnect();
   }
 }
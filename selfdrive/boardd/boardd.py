@@ -1,8 +1,19 @@
 # pylint: skip-file
+import os
 
 # Cython, now uses scons to build
-from selfdrive.boardd.boardd_api_impl import can_list_to_can_capnp
+from selfdrive.boardd.boardd_api_impl import can_list_to_can_capnp, can_arrays_to_can_capnp
 assert can_list_to_can_capnp
+assert can_arrays_to_can_capnp
+
+# the buses boardd publishes on their own with BOARDD_CAN_PER_BUS
+CAN_BUS_SERVICES = 3
+
+def can_service(bus):
+  """The service with the frames of bus, can when boardd doesn't publish the bus on its own"""
+  if os.getenv("BOARDD_CAN_PER_BUS") is not None and 0 <= bus < CAN_BUS_SERVICES:
+    return "can%d" % bus
+  return "can"
 
 def can_capnp_to_can_list(can, src_filter=None):
   ret = []
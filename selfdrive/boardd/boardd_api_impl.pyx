@@ -1,5 +1,6 @@
 # distutils: language = c++
 # cython: language_level=3
+from libc.stdint cimport uint8_t, uint32_t
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp cimport bool
@@ -11,6 +12,9 @@ cdef struct can_frame:
   long src
 
 cdef extern void can_list_to_can_capnp_cpp(const vector[can_frame] &can_list, string &out, bool sendCan, bool valid)
+cdef extern size_t can_arrays_to_can_capnp_cpp(size_t n, const uint32_t *addresses, const uint8_t *dat, size_t dat_size,
+                                               const uint8_t *lens, const uint8_t *buses, bool sendCan, bool valid,
+                                               const uint8_t **out)
 
 def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
   cdef vector[can_frame] can_list
@@ -24,3 +28,22 @@ def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
   cdef string out
   can_list_to_can_capnp_cpp(can_list, out, msgtype == 'sendcan', valid)
   return out
+
+def can_arrays_to_can_capnp(const uint32_t[:] addresses, const uint8_t[:] dat, const uint8_t[:] lens, const uint8_t[:] buses,
+                            msgtype='can', valid=True):
+  """can_list_to_can_capnp of packed arrays, numpy ones or the ones CANPacker.pack_arrays returns. Frame i
+  is lens[i] bytes of dat, after the ones of the frames before it. The bus times are 0"""
+  cdef size_t n = addresses.shape[0]
+  if lens.shape[0] != n or buses.shape[0] != n:
+    raise ValueError("addresses, lens and buses aren't the same length")
+  cdef size_t i, dat_size = 0
+  for i in range(n):
+    dat_size += lens[i]
+  if dat_size > <size_t>dat.shape[0]:
+    raise ValueError(f"lens add up to {dat_size} bytes, dat has {dat.shape[0]}")
+
+  cdef const uint8_t *out
+  cdef size_t size = can_arrays_to_can_capnp_cpp(n, &addresses[0] if n else NULL, &dat[0] if dat_size else NULL, dat_size,
+                                                 &lens[0] if n else NULL, &buses[0] if n else NULL,
+                                                 msgtype == 'sendcan', valid, &out)
+  return (<const char *>out)[:size]
@@ -1,3 +1,8 @@
+#include <assert.h>
+#include <string.h>
+
+#include <vector>
+
 #include "messaging.hpp"
 
 typedef struct {
@@ -26,4 +31,46 @@ void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::stri
   out.append((const char *)bytes.begin(), bytes.size());
 }
 
+// The frames of packed arrays: frame i is lens[i] bytes of dat, after the ones of the frames before it.
+// The message is built in a segment reused between calls, with its segment table in front, so it's
+// already a flat array message. *out points into it, or into the flat copy of a message that outgrew
+// it, until the next call
+size_t can_arrays_to_can_capnp_cpp(size_t n, const uint32_t *addresses, const uint8_t *dat, size_t dat_size,
+                                   const uint8_t *lens, const uint8_t *buses, bool sendCan, bool valid,
+                                   const uint8_t **out) {
+  static thread_local std::vector<capnp::word> segment(1024);
+  static thread_local kj::Array<capnp::word> flat;
+
+  // capnp requires the first segment to be zeroed
+  memset(segment.data(), 0, segment.size() * sizeof(capnp::word));
+  MessageBuilder msg(kj::ArrayPtr<capnp::word>(segment.data() + 1, segment.size() - 1));
+  auto event = msg.initEvent(valid);
+
+  auto canData = sendCan ? event.initSendcan(n) : event.initCan(n);
+  size_t offset = 0;
+  for (size_t i = 0; i < n; i++) {
+    assert(offset + lens[i] <= dat_size);
+    auto c = canData[i];
+    c.setAddress(addresses[i]);
+    c.setDat(kj::arrayPtr(dat + offset, lens[i]));
+    c.setSrc(buses[i]);
+    offset += lens[i];
+  }
+
+  auto segments = msg.getSegmentsForOutput();
+  if (segments.size() != 1) {
+    // room for this many next time
+    segment.resize(segment.size() * 2);
+    flat = capnp::messageToFlatArray(segments);
+    *out = flat.asBytes().begin();
+    return flat.asBytes().size();
+  }
+
+  uint32_t *table = (uint32_t *)segment.data();
+  table[0] = 0;  // segment count - 1
+  table[1] = segments[0].size();
+  *out = (const uint8_t *)segment.data();
+  return (segments[0].size() + 1) * sizeof(capnp::word);
+}
+
 }
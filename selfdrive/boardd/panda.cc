@@ -1,14 +1,32 @@
 #include <stdexcept>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
 
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
 
 #include "common/swaglog.h"
 #include "common/gpio.h"
 #include "common/util.h"
+#include "common/timing.h"
 #include "panda.h"
 
+// copied from panda/board/drivers/spi.h
+#define SPI_HEADER_SIZE 0x14
+#define SPI_SYNC 0x5A
+#define SPI_ACK 0x79
+#define SPI_NACK 0x1F
+#define SPI_CHECKSUM_START 0xAB
+// for the panda to set up the DMA of the data after the header
+#define SPI_HEADER_DELAY_US 20
+// between reads for a response without the handshake gpio
+#define SPI_POLL_US 200
+
 #ifdef QCOM2
 bool is_legacy_panda_reset() {
   FILE *file = fopen("/persist/LEGACY_PANDA_RESET", "r");
@@ -37,34 +55,108 @@ void panda_set_power(bool power){
 #endif
 }
 
-Panda::Panda(){
+static bool is_panda(libusb_device *dev) {
+  libusb_device_descriptor desc;
+  return libusb_get_device_descriptor(dev, &desc) == 0 && desc.idVendor == 0xbbaa && desc.idProduct == 0xddcc;
+}
+
+static std::string get_usb_serial(libusb_device_handle *handle) {
+  libusb_device_descriptor desc;
+  unsigned char serial[256] = {0};
+  if (libusb_get_device_descriptor(libusb_get_device(handle), &desc) != 0) return "";
+  int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, serial, sizeof(serial));
+  return len > 0 ? std::string((char *)serial, len) : "";
+}
+
+// Opens the panda with the given serial, any panda if it's empty
+static libusb_device_handle *open_panda(libusb_context *ctx, const std::string &serial) {
+  libusb_device **devs = NULL;
+  libusb_device_handle *handle = NULL;
+  ssize_t n = libusb_get_device_list(ctx, &devs);
+  for (ssize_t i = 0; i < n && handle == NULL; i++) {
+    if (!is_panda(devs[i]) || libusb_open(devs[i], &handle) != 0) continue;
+    if (!serial.empty() && get_usb_serial(handle) != serial) {
+      libusb_close(handle);
+      handle = NULL;
+    }
+  }
+  if (n >= 0) libusb_free_device_list(devs, 1);
+  return handle;
+}
+
+std::vector<std::string> Panda::list() {
+  std::vector<std::string> serials;
+  // the panda on SPI is the one connected
+  if (getenv("BOARDD_SPI")) return {PANDA_SPI_SERIAL};
+
+  libusb_context *ctx = NULL;
+  if (libusb_init(&ctx) != 0) return serials;
+
+  libusb_device **devs = NULL;
+  ssize_t n = libusb_get_device_list(ctx, &devs);
+  for (ssize_t i = 0; i < n; i++) {
+    libusb_device_handle *handle = NULL;
+    if (!is_panda(devs[i]) || libusb_open(devs[i], &handle) != 0) continue;
+    std::string serial = get_usb_serial(handle);
+    if (!serial.empty()) serials.push_back(serial);
+    libusb_close(handle);
+  }
+  if (n >= 0) libusb_free_device_list(devs, 1);
+  libusb_exit(ctx);
+  return serials;
+}
+
+Panda::Panda(std::string serial, int bus_offset) : bus_offset(bus_offset) {
   int err;
 
   err = pthread_mutex_init(&usb_lock, NULL);
   if (err != 0) { goto fail; }
-
-  // init libusb
-  err = libusb_init(&ctx);
+  err = pthread_mutex_init(&bulk_out_lock, NULL);
+  if (err != 0) { goto fail; }
+  err = pthread_mutex_init(&bulk_in_lock, NULL);
   if (err != 0) { goto fail; }
 
+  if (serial == PANDA_SPI_SERIAL) {
+    if (!spi_open()) { goto fail; }
+    usb_serial = serial;
+    // the SPI firmware has it
+    has_pigeon_endpoint = true;
+  } else {
+    // init libusb
+    err = libusb_init(&ctx);
+    if (err != 0) { goto fail; }
+
 #if LIBUSB_API_VERSION >= 0x01000106
-  libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
 #else
-  libusb_set_debug(ctx, 3);
+    libusb_set_debug(ctx, 3);
 #endif
 
-  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
-  if (dev_handle == NULL) { goto fail; }
+    dev_handle = open_panda(ctx, serial);
+    if (dev_handle == NULL) { goto fail; }
+    usb_serial = get_usb_serial(dev_handle);
 
-  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
-    libusb_detach_kernel_driver(dev_handle, 0);
-  }
+    if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
+      libusb_detach_kernel_driver(dev_handle, 0);
+    }
 
-  err = libusb_set_configuration(dev_handle, 1);
-  if (err != 0) { goto fail; }
+    err = libusb_set_configuration(dev_handle, 1);
+    if (err != 0) { goto fail; }
 
-  err = libusb_claim_interface(dev_handle, 0);
-  if (err != 0) { goto fail; }
+    err = libusb_claim_interface(dev_handle, 0);
+    if (err != 0) { goto fail; }
+
+    libusb_config_descriptor *config = NULL;
+    if (libusb_get_active_config_descriptor(libusb_get_device(dev_handle), &config) == 0) {
+      const libusb_interface_descriptor &intf = config->interface[0].altsetting[0];
+      for (int i = 0; i < intf.bNumEndpoints; i++) {
+        if (intf.endpoint[i].bEndpointAddress == (LIBUSB_ENDPOINT_IN | 2)) has_pigeon_endpoint = true;
+      }
+      libusb_free_config_descriptor(config);
+    }
+  }
+
+  negotiate_can_framing();
 
   hw_type = get_hw_type();
   is_pigeon =
@@ -83,12 +175,34 @@ fail:
 }
 
 Panda::~Panda(){
+  // other clients of the panda expect v1
+  if (connected && can_framing != CAN_FRAMING_V1) {
+    unsigned char framing;
+    control_transfer(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+                     0xe8, CAN_FRAMING_V1, 0, &framing, 1, 100);
+  }
   pthread_mutex_lock(&usb_lock);
+  pthread_mutex_lock(&bulk_out_lock);
+  pthread_mutex_lock(&bulk_in_lock);
   cleanup();
   connected = false;
+  pthread_mutex_unlock(&bulk_in_lock);
+  pthread_mutex_unlock(&bulk_out_lock);
   pthread_mutex_unlock(&usb_lock);
 }
 
+void Panda::negotiate_can_framing() {
+  const char *env = getenv("BOARDD_CAN_FRAMING");
+  const uint16_t wanted = env ? atoi(env) : CAN_FRAMING_V2;
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+
+  // not usb_read, which retries forever. Firmware without 0xe8 replies with nothing
+  unsigned char framing = 0;
+  int err = control_transfer(bmRequestType, 0xe8, wanted, 0, &framing, 1, 100);
+  can_framing = (err == 1 && framing == CAN_FRAMING_V2) ? CAN_FRAMING_V2 : CAN_FRAMING_V1;
+  LOGW("CAN framing v%d", can_framing);
+}
+
 void Panda::cleanup(){
   if (dev_handle){
     libusb_release_interface(dev_handle, 0);
@@ -98,6 +212,147 @@ void Panda::cleanup(){
   if (ctx) {
     libusb_exit(ctx);
   }
+
+  if (spi_ready_fd >= 0) close(spi_ready_fd);
+  if (spi_fd >= 0) close(spi_fd);
+}
+
+bool Panda::spi_open() {
+  const char *dev = getenv("BOARDD_SPI");
+  spi_fd = open(dev ? dev : PANDA_SPI_DEVICE, O_RDWR);
+  if (spi_fd < 0) {
+    LOGE("can't open %s: %s", dev ? dev : PANDA_SPI_DEVICE, strerror(errno));
+    return false;
+  }
+
+  // the panda is a mode 0 slave
+  uint8_t mode = SPI_MODE_0, bits = 8;
+  uint32_t speed = SPI_SPEED_HZ;
+  if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0 || ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+      ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+    LOGE("can't set up the SPI bus: %s", strerror(errno));
+    return false;
+  }
+
+  const char *gpio = getenv("BOARDD_SPI_READY_GPIO");
+  if (gpio) {
+    spi_ready_fd = gpio_open_edge(atoi(gpio), "falling");
+    if (spi_ready_fd < 0) LOGE("can't open handshake gpio %s, polling for SPI responses", gpio);
+  }
+  return true;
+}
+
+static uint8_t spi_checksum(const uint8_t *data, int len) {
+  uint8_t checksum = SPI_CHECKSUM_START;
+  for (int i = 0; i < len; i++) checksum ^= data[i];
+  return checksum;
+}
+
+int Panda::spi_transfer(uint8_t endpoint, const uint8_t *tx, int tx_len, uint8_t *rx, int max_rx_len, unsigned int timeout) {
+  assert(tx_len <= SPI_MAX_DATA && max_rx_len <= SPI_MAX_DATA);
+  // 0xff clocked out on reads is never taken for the start of a request
+  static const std::vector<uint8_t> fill(SPI_MAX_DATA + 4, 0xff);
+  std::lock_guard<std::mutex> lk(spi_lock);
+  const uint64_t deadline = nanos_since_boot() + (uint64_t)(timeout ? timeout : SPI_TIMEOUT_MS) * 1000000ULL;
+  auto spi_error = [](int err) { return err == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO; };
+
+  uint8_t *header = spi_tx_buf, *data = &spi_tx_buf[SPI_HEADER_SIZE];
+  memset(header, 0, SPI_HEADER_SIZE);
+  header[0] = SPI_SYNC;
+  header[1] = endpoint;
+  header[2] = tx_len & 0xff;
+  header[3] = tx_len >> 8;
+  header[4] = max_rx_len & 0xff;
+  header[5] = max_rx_len >> 8;
+  header[6] = spi_checksum(header, 6);
+  if (tx_len > 0) memcpy(data, tx, tx_len);
+  data[tx_len] = spi_checksum(data, tx_len);
+
+  spi_ioc_transfer request[2] = {};
+  request[0].tx_buf = (uintptr_t)header;
+  request[0].len = SPI_HEADER_SIZE;
+  request[0].delay_usecs = SPI_HEADER_DELAY_US;
+  request[1].tx_buf = (uintptr_t)data;
+  request[1].len = tx_len + 1;
+  spi_ioc_transfer response = {};
+  response.tx_buf = (uintptr_t)fill.data();
+  response.rx_buf = (uintptr_t)spi_rx_buf;
+  response.len = max_rx_len + 4;
+
+  while (true) {
+    // an edge of an earlier response
+    uint64_t ts;
+    if (spi_ready_fd >= 0) gpio_wait_edge(spi_ready_fd, 0, &ts);
+    if (ioctl(spi_fd, SPI_IOC_MESSAGE(2), request) < 0) return spi_error(errno);
+
+    // the response, read once the handshake says it's ready
+    bool responded = false;
+    while (!responded) {
+      const int64_t remaining_ms = ((int64_t)deadline - (int64_t)nanos_since_boot()) / 1000000;
+      if (remaining_ms < 0) break;
+      if (spi_ready_fd >= 0) {
+        if (gpio_wait_edge(spi_ready_fd, remaining_ms, &ts) <= 0) break;
+      } else {
+        usleep(SPI_POLL_US);
+      }
+      if (ioctl(spi_fd, SPI_IOC_MESSAGE(1), &response) < 0) return spi_error(errno);
+      // otherwise nothing went out yet
+      responded = spi_rx_buf[0] == SPI_ACK || spi_rx_buf[0] == SPI_NACK;
+    }
+    if (!responded) {
+      // takes a late response, the panda sends it on the next transfer
+      ioctl(spi_fd, SPI_IOC_MESSAGE(1), &response);
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    const int len = spi_rx_buf[1] | (spi_rx_buf[2] << 8);
+    if (len > max_rx_len || spi_checksum(spi_rx_buf, 3 + len) != spi_rx_buf[3 + len]) return LIBUSB_ERROR_IO;
+    if (spi_rx_buf[0] == SPI_ACK) {
+      if (len > 0) memcpy(rx, &spi_rx_buf[3], len);
+      return len;
+    }
+    // NACKed, the panda couldn't take it yet
+    if (nanos_since_boot() >= deadline) return LIBUSB_ERROR_TIMEOUT;
+    usleep(SPI_POLL_US);
+  }
+}
+
+int Panda::control_transfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            unsigned char *data, uint16_t wLength, unsigned int timeout) {
+  if (spi_fd < 0) {
+    return libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+  }
+  // the setup packet
+  const uint8_t setup[8] = {bmRequestType, bRequest, (uint8_t)(wValue & 0xff), (uint8_t)(wValue >> 8),
+                            (uint8_t)(wIndex & 0xff), (uint8_t)(wIndex >> 8), (uint8_t)(wLength & 0xff), (uint8_t)(wLength >> 8)};
+  return spi_transfer(0, setup, sizeof(setup), data, std::min((int)wLength, SPI_MAX_DATA), timeout);
+}
+
+int Panda::bulk_transfer(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+  if (spi_fd < 0) {
+    return libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+  }
+
+  *transferred = 0;
+  const uint8_t ep = endpoint & ~LIBUSB_ENDPOINT_IN;
+  while (*transferred < length) {
+    int ret;
+    if (endpoint & LIBUSB_ENDPOINT_IN) {
+      // in whole USB packets, less is all the panda had
+      const int n = std::min(length - *transferred, SPI_MAX_DATA) / USBPACKET_MAX_SIZE * USBPACKET_MAX_SIZE;
+      if (n == 0) break;
+      ret = spi_transfer(ep, NULL, 0, data + *transferred, n, timeout);
+      if (ret < 0) return ret;
+      *transferred += ret;
+      if (ret < n) break;
+    } else {
+      const int n = std::min(length - *transferred, SPI_MAX_DATA);
+      ret = spi_transfer(ep, data + *transferred, n, NULL, 0, timeout);
+      if (ret < 0) return ret;
+      *transferred += n;
+    }
+  }
+  return 0;
 }
 
 void Panda::handle_usb_issue(int err, const char func[]) {
@@ -109,6 +364,38 @@ void Panda::handle_usb_issue(int err, const char func[]) {
   // TODO: check other errors, is simply retrying okay?
 }
 
+uint64_t Panda::lock_timed(pthread_mutex_t *lock, UsbRequest req) {
+  uint64_t start = nanos_since_boot();
+  pthread_mutex_lock(lock);
+  uint64_t locked = nanos_since_boot();
+
+  std::lock_guard<std::mutex> lk(stats_lock);
+  UsbRequestStats &s = usb_stats[(int)req];
+  uint64_t wait_us = (locked - start) / 1000;
+  s.lock_wait_us += wait_us;
+  s.max_lock_wait_us = std::max(s.max_lock_wait_us, wait_us);
+  return locked;
+}
+
+void Panda::unlock_timed(pthread_mutex_t *lock, UsbRequest req, uint64_t locked) {
+  uint64_t transfer_us = (nanos_since_boot() - locked) / 1000;
+  pthread_mutex_unlock(lock);
+
+  std::lock_guard<std::mutex> lk(stats_lock);
+  UsbRequestStats &s = usb_stats[(int)req];
+  s.count++;
+  s.transfer_us += transfer_us;
+  s.max_transfer_us = std::max(s.max_transfer_us, transfer_us);
+}
+
+void Panda::take_usb_stats(UsbRequestStats out[(int)UsbRequest::NUM]) {
+  std::lock_guard<std::mutex> lk(stats_lock);
+  for (int i = 0; i < (int)UsbRequest::NUM; i++) {
+    out[i] = usb_stats[i];
+    usb_stats[i] = UsbRequestStats();
+  }
+}
+
 int Panda::usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) {
   int err;
   const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
@@ -117,13 +404,13 @@ int Panda::usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigne
     return LIBUSB_ERROR_NO_DEVICE;
   }
 
-  pthread_mutex_lock(&usb_lock);
+  uint64_t locked = lock_timed(&usb_lock, UsbRequest::CONTROL);
   do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
+    err = control_transfer(bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
     if (err < 0) handle_usb_issue(err, __func__);
   } while (err < 0 && connected);
 
-  pthread_mutex_unlock(&usb_lock);
+  unlock_timed(&usb_lock, UsbRequest::CONTROL, locked);
 
   return err;
 }
@@ -132,12 +419,12 @@ int Panda::usb_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned
   int err;
   const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
 
-  pthread_mutex_lock(&usb_lock);
+  uint64_t locked = lock_timed(&usb_lock, UsbRequest::CONTROL);
   do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+    err = control_transfer(bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
     if (err < 0) handle_usb_issue(err, __func__);
   } while (err < 0 && connected);
-  pthread_mutex_unlock(&usb_lock);
+  unlock_timed(&usb_lock, UsbRequest::CONTROL, locked);
 
   return err;
 }
@@ -150,11 +437,12 @@ int Panda::usb_bulk_write(unsigned char endpoint, unsigned char* data, int lengt
     return 0;
   }
 
-  pthread_mutex_lock(&usb_lock);
+  // the pigeon's writes are counted with CAN, they share the lock and are rare
+  uint64_t locked = lock_timed(&bulk_out_lock, UsbRequest::CAN_SEND);
   do {
     // Try sending can messages. If the receive buffer on the panda is full it will NAK
     // and libusb will try again. After 5ms, it will time out. We will drop the messages.
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+    err = bulk_transfer(endpoint, data, length, &transferred, timeout);
 
     if (err == LIBUSB_ERROR_TIMEOUT) {
       LOGW("Transmit buffer full");
@@ -164,7 +452,7 @@ int Panda::usb_bulk_write(unsigned char endpoint, unsigned char* data, int lengt
     }
   } while(err != 0 && connected);
 
-  pthread_mutex_unlock(&usb_lock);
+  unlock_timed(&bulk_out_lock, UsbRequest::CAN_SEND, locked);
   return transferred;
 }
 
@@ -176,10 +464,10 @@ int Panda::usb_bulk_read(unsigned char endpoint, unsigned char* data, int length
     return 0;
   }
 
-  pthread_mutex_lock(&usb_lock);
+  uint64_t locked = lock_timed(&bulk_in_lock, UsbRequest::CAN_RECV);
 
   do {
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+    err = bulk_transfer(endpoint, data, length, &transferred, timeout);
 
     if (err == LIBUSB_ERROR_TIMEOUT) {
       break; // timeout is okay to exit, recv still happened
@@ -191,11 +479,21 @@ int Panda::usb_bulk_read(unsigned char endpoint, unsigned char* data, int length
 
   } while(err != 0 && connected);
 
-  pthread_mutex_unlock(&usb_lock);
+  unlock_timed(&bulk_in_lock, UsbRequest::CAN_RECV, locked);
 
   return transferred;
 }
 
+int Panda::pigeon_read(unsigned char *data, int length) {
+  if (!connected) return 0;
+
+  // a short packet, an empty one when the ring is, ends the transfer
+  int transferred = 0;
+  int err = bulk_transfer(LIBUSB_ENDPOINT_IN | 2, data, length / USBPACKET_MAX_SIZE * USBPACKET_MAX_SIZE, &transferred, TIMEOUT);
+  if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) handle_usb_issue(err, __func__);
+  return transferred;
+}
+
 void Panda::set_safety_model(cereal::CarParams::SafetyModel safety_model, int safety_param){
   usb_write(0xdc, (uint16_t)safety_model, safety_param);
 }
@@ -267,10 +565,30 @@ health_t Panda::get_health(){
   return health;
 }
 
+bool Panda::get_can_health(uint8_t bus, can_health_t &can_health) {
+  can_health = {};
+  return usb_read(0xfa, bus, 0, (unsigned char*)&can_health, sizeof(can_health)) == sizeof(can_health);
+}
+
 void Panda::set_loopback(bool loopback){
   usb_write(0xe5, loopback, 0);
 }
 
+void Panda::set_can_rx_deferred(bool deferred){
+  usb_write(0xe9, deferred, 0);
+}
+
+void Panda::set_can_filters(uint8_t bus, const std::vector<std::pair<uint32_t, uint16_t>> &filters){
+  usb_write(0xf7, bus, 0);
+  for (auto &[addr, mask] : filters){
+    if (addr > 0x7ff){
+      usb_write(0xf9, addr & 0xffff, (addr >> 16) | (bus << 13));
+    } else {
+      usb_write(0xf8, addr | (bus << 12), mask & 0x7ff);
+    }
+  }
+}
+
 const char* Panda::get_firmware_version(){
   const char* fw_sig_buf = new char[128]();
 
@@ -310,32 +628,259 @@ void Panda::send_heartbeat(){
   usb_write(0xf3, 1, 0);
 }
 
-void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list){
-  int msg_count = can_data_list.size();
+static const uint8_t dlc_to_len[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
 
-  uint32_t *send = new uint32_t[msg_count*0x10]();
+static uint8_t len_to_dlc(int len) {
+  uint8_t dlc = 0;
+  while (dlc_to_len[dlc] < len) dlc++;
+  return dlc;
+}
 
-  for (int i = 0; i < msg_count; i++) {
-    auto cmsg = can_data_list[i];
-    if (cmsg.getAddress() >= 0x800) { // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
-    } else { // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
+static int frame_size(const uint8_t *frame, int framing) {
+  return framing == CAN_FRAMING_V2 ? CANPACKET_HEAD_SIZE + dlc_to_len[frame[0] >> 4] : 0x10;
+}
+
+size_t can_pack_size(int n, int framing) {
+  if (framing != CAN_FRAMING_V2) return n * 0x10;
+  size_t stream = (size_t)n * CANPACKET_MAX_SIZE;
+  size_t packets = stream / (USBPACKET_MAX_SIZE - USBPACKET_HEAD_SIZE) + 1;
+  return stream + packets * USBPACKET_HEAD_SIZE;
+}
+
+// one v1 message
+static void pack_v1(cereal::CanData::Reader cmsg, int bus, uint32_t *out) {
+  if (cmsg.getAddress() >= 0x800) { // extended
+    out[0] = (cmsg.getAddress() << 3) | 5;
+  } else { // normal
+    out[0] = (cmsg.getAddress() << 21) | 1;
+  }
+  auto can_data = cmsg.getDat();
+  assert(can_data.size() <= 8);
+  out[1] = can_data.size() | (bus << 4);
+  out[2] = out[3] = 0;
+  memcpy(&out[2], can_data.begin(), can_data.size());
+}
+
+// one v2 frame, returns its size
+static int pack_v2(cereal::CanData::Reader cmsg, int bus, uint8_t *out) {
+  auto can_data = cmsg.getDat();
+  assert(can_data.size() <= CANPACKET_DATA_SIZE_MAX);
+  uint8_t dlc = len_to_dlc(can_data.size());
+  bool fd = can_data.size() > 8;
+  bool extended = cmsg.getAddress() >= 0x800;
+  uint32_t id = (cmsg.getAddress() << 3) | (extended << 2);
+
+  out[0] = (dlc << 4) | ((bus & 0x7) << 1) | fd;
+  memcpy(&out[1], &id, sizeof(id));
+  memset(&out[CANPACKET_HEAD_SIZE], 0, dlc_to_len[dlc]);
+  memcpy(&out[CANPACKET_HEAD_SIZE], can_data.begin(), can_data.size());
+  return CANPACKET_HEAD_SIZE + dlc_to_len[dlc];
+}
+
+int can_pack(capnp::List<cereal::CanData>::Reader can_data_list, uint8_t *out, int bus_offset,
+             int framing, uint8_t *counter, int start) {
+  int len = start;
+  int packet_start = start - start % USBPACKET_MAX_SIZE;
+  for (auto cmsg : can_data_list) {
+    // other pandas' buses
+    if (cmsg.getSrc() < bus_offset || cmsg.getSrc() >= bus_offset + PANDA_BUS_CNT) continue;
+    int bus = cmsg.getSrc() - bus_offset;
+
+    if (framing != CAN_FRAMING_V2) {
+      pack_v1(cmsg, bus, (uint32_t *)&out[len]);
+      len += 0x10;
+      continue;
+    }
+
+    // the frame is packed whole, then split at the packet boundaries
+    uint8_t frame[CANPACKET_MAX_SIZE];
+    int size = pack_v2(cmsg, bus, frame);
+    for (int pos = 0; pos < size;) {
+      if (len == packet_start) {
+        out[len] = (*counter)++;
+        out[len + 1] = pos == 0 ? USBPACKET_HEAD_SIZE : 0xff;
+        len += USBPACKET_HEAD_SIZE;
+      } else if (pos == 0 && out[packet_start + 1] == 0xff) {
+        out[packet_start + 1] = len - packet_start;
+      }
+      int n = std::min(size - pos, USBPACKET_MAX_SIZE - (len - packet_start));
+      memcpy(&out[len], &frame[pos], n);
+      pos += n;
+      len += n;
+      if (len - packet_start == USBPACKET_MAX_SIZE) packet_start = len;
     }
-    auto can_data = cmsg.getDat();
-    assert(can_data.size() <= 8);
-    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
   }
+  return len;
+}
+
+int can_count(const uint8_t *data, int len, int framing) {
+  if (framing != CAN_FRAMING_V2) return len / 0x10;
+  int count = 0;
+  for (int pos = 0; pos < len; pos += frame_size(&data[pos], framing)) count++;
+  return count;
+}
 
-  usb_bulk_write(3, (unsigned char*)send, msg_count*0x10, 5);
+int can_unpack(const uint8_t *data, int len, capnp::List<cereal::CanData>::Builder can, int start,
+               int bus_offset, int framing, const uint64_t *rx_times) {
+  int i = 0;
+  for (int pos = 0; pos < len; pos += frame_size(&data[pos], framing), i++) {
+    auto canData = can[start + i];
+    if (rx_times && rx_times[i]) canData.setRxTime(rx_times[i]);
+    if (framing == CAN_FRAMING_V2) {
+      const uint8_t *frame = &data[pos];
+      uint32_t id;
+      memcpy(&id, &frame[1], sizeof(id));
+      int bus = (frame[0] >> 1) & 0x7;
+      canData.setAddress(id >> 3);
+      canData.setDat(kj::arrayPtr(&frame[CANPACKET_HEAD_SIZE], dlc_to_len[frame[0] >> 4]));
+      // returned messages are flagged like v1 does
+      canData.setSrc((bus | ((id & 2) ? 0x80 : 0)) + bus_offset);
+      continue;
+    }
 
-  delete[] send;
+    const uint32_t *msg = (const uint32_t *)&data[pos];
+    if (msg[0] & 4) {
+      // extended
+      canData.setAddress(msg[0] >> 3);
+      //printf("got extended: %x\n", msg[0] >> 3);
+    } else {
+      // normal
+      canData.setAddress(msg[0] >> 21);
+    }
+    canData.setBusTime(msg[1] >> 16);
+    int dlen = msg[1]&0xF;
+    canData.setDat(kj::arrayPtr((uint8_t*)&msg[2], dlen));
+    canData.setSrc(((msg[1] >> 4) & 0xff) + bus_offset);
+  }
+  return i;
 }
 
-int Panda::can_receive(cereal::Event::Builder &event){
-  uint32_t data[RECV_SIZE/4];
-  int recv = usb_bulk_read(0x81, (unsigned char*)data, RECV_SIZE);
+size_t can_event_size(int count, int len) {
+  // each CanData is three words in the list, and its dat at most one more word than its share
+  // of len. The rest covers the segment table, the Event and the list tag
+  return count * 4 * sizeof(capnp::word) + len + 512;
+}
+
+int CanStream::parse(const uint8_t *data, int len, std::vector<uint8_t> &out, std::vector<uint32_t> *ts) {
+  int lost = 0;
+  for (int start = 0; start < len; start += USBPACKET_MAX_SIZE) {
+    const uint8_t *packet = &data[start];
+    int size = std::min(len - start, USBPACKET_MAX_SIZE);
+    if (size < head_size) break;
+
+    if (packet[0] != counter) {
+      lost += (uint8_t)(packet[0] - counter);
+      synced = false;
+    }
+    counter = packet[0] + 1;
+
+    // the packet's oldest frame, so a frame carried over from the last one keeps its time
+    uint32_t packet_ts = 0;
+    if (head_size == USBPACKET_IN_HEAD_SIZE) memcpy(&packet_ts, &packet[2], sizeof(packet_ts));
+
+    // after a gap, or at the start, skip ahead to a frame start
+    int p = head_size;
+    if (!synced) {
+      if (packet[1] < head_size || packet[1] >= size) continue;
+      synced = true;
+      pos = 0;
+      p = packet[1];
+    }
+
+    for (; p < size; p++) {
+      if (pos == 0) frame_ts = packet_ts;
+      frame[pos++] = packet[p];
+      if (pos == frame_size(frame, CAN_FRAMING_V2)) {
+        out.insert(out.end(), frame, frame + pos);
+        if (ts) ts->push_back(frame_ts);
+        pos = 0;
+      }
+    }
+  }
+  return lost;
+}
+
+// appends the whole messages in a bulk read to out
+void Panda::add_can_data(const uint8_t *data, int len, std::vector<uint8_t> &out, std::vector<uint32_t> &ts) {
+  if (can_framing == CAN_FRAMING_V2) {
+    int lost = can_recv_stream.parse(data, len, out, &ts);
+    if (lost > 0) LOGE_100("lost %d CAN packets", lost);
+  } else {
+    len = len / 0x10 * 0x10;
+    out.insert(out.end(), data, data + len);
+    // v1 has no receive times
+    ts.insert(ts.end(), len / 0x10, 0);
+  }
+}
+
+bool Panda::sync_clock() {
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+
+  // the read with the shortest round trip has the least uncertainty about when it happened
+  bool synced = false;
+  uint64_t best_rtt = UINT64_MAX, host_ns = 0;
+  uint32_t panda_us = 0;
+  for (int i = 0; i < 4; i++) {
+    uint32_t ts;
+    uint64_t locked = lock_timed(&usb_lock, UsbRequest::CONTROL);
+    uint64_t t0 = nanos_since_boot();
+    // not usb_read, which retries forever. Firmware without 0xa8 replies with nothing
+    int err = control_transfer(bmRequestType, 0xa8, 0, 0, (unsigned char *)&ts, sizeof(ts), 100);
+    uint64_t t1 = nanos_since_boot();
+    unlock_timed(&usb_lock, UsbRequest::CONTROL, locked);
+    if (err != (int)sizeof(ts)) break;
+
+    if (t1 - t0 < best_rtt) {
+      best_rtt = t1 - t0;
+      host_ns = t0 + (t1 - t0) / 2;
+      panda_us = ts;
+      synced = true;
+    }
+  }
+
+  if (synced) {
+    std::lock_guard<std::mutex> lk(clock_lock);
+    clock_synced = true;
+    clock_panda_us = panda_us;
+    clock_host_ns = host_ns;
+    clock_sync_rtt_us = best_rtt / 1000;
+  }
+  return synced;
+}
+
+void Panda::convert_can_times() {
+  can_read_times.resize(can_read_ts.size());
+
+  std::lock_guard<std::mutex> lk(clock_lock);
+  for (size_t i = 0; i < can_read_ts.size(); i++) {
+    // the timer wraps every 71 minutes, the sync is far more recent than that
+    int32_t since_sync_us = can_read_ts[i] - clock_panda_us;
+    bool known = clock_synced && can_read_ts[i] != 0;
+    can_read_times[i] = known ? clock_host_ns + (int64_t)since_sync_us * 1000 : 0;
+  }
+}
+
+void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list){
+  can_send_add(can_data_list);
+  can_send_flush(5);
+}
+
+void Panda::can_send_add(capnp::List<cereal::CanData>::Reader can_data_list){
+  size_t size = can_send_len + can_pack_size(can_data_list.size(), can_framing);
+  if (can_send_buf.size() < size) can_send_buf.resize(size);
+
+  can_send_len = can_pack(can_data_list, can_send_buf.data(), bus_offset, can_framing, &can_send_counter, can_send_len);
+}
+
+bool Panda::can_send_flush(unsigned int timeout){
+  int len = can_send_len;
+  can_send_len = 0;
+  if (len == 0) return true;
+  return usb_bulk_write(3, (unsigned char*)can_send_buf.data(), len, timeout) == len;
+}
+
+int Panda::can_read(const uint8_t **data, const uint64_t **rx_times){
+  int recv = usb_bulk_read(0x81, can_read_data, RECV_SIZE);
 
   // Not sure if this can happen
   if (recv < 0) recv = 0;
@@ -344,24 +889,139 @@ int Panda::can_receive(cereal::Event::Builder &event){
     LOGW("Receive buffer full");
   }
 
-  size_t num_msg = recv / 0x10;
-  auto canData = event.initCan(num_msg);
+  if (can_read_buf.capacity() < RECV_SIZE + CANPACKET_MAX_SIZE) can_read_buf.reserve(RECV_SIZE + CANPACKET_MAX_SIZE);
+  if (can_read_ts.capacity() < RECV_SIZE / CANPACKET_HEAD_SIZE + 1) {
+    can_read_ts.reserve(RECV_SIZE / CANPACKET_HEAD_SIZE + 1);
+    can_read_times.reserve(RECV_SIZE / CANPACKET_HEAD_SIZE + 1);
+  }
+  can_read_buf.clear();
+  can_read_ts.clear();
+  add_can_data(can_read_data, recv, can_read_buf, can_read_ts);
+
+  *data = can_read_buf.data();
+  if (rx_times) {
+    convert_can_times();
+    *rx_times = can_read_times.data();
+  }
+  return can_read_buf.size();
+}
 
-  // populate message
-  for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
-      // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
+int Panda::can_receive(cereal::Event::Builder &event){
+  const uint8_t *data;
+  const uint64_t *rx_times;
+  int len = can_read(&data, &rx_times);
+  can_unpack(data, len, event.initCan(can_count(data, len, can_framing)), 0, bus_offset, can_framing, rx_times);
+  return len;
+}
+
+void LIBUSB_CALL Panda::can_recv_callback(libusb_transfer *transfer) {
+  Panda *p = (Panda *)transfer->user_data;
+
+  std::lock_guard<std::mutex> lk(p->can_recv_lock);
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED || transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    int len = transfer->actual_length;
+    if (p->can_recv_buf.size() + len + CANPACKET_MAX_SIZE > CAN_RECV_MAX_BUFFERED) {
+      // with v2 the gap in the packet counter resyncs the stream
+      if (!p->can_recv_full) LOGW("Receive buffer full");
+      p->can_recv_full = true;
     } else {
-      // normal
-      canData[i].setAddress(data[i*4] >> 21);
+      p->add_can_data(transfer->buffer, len, p->can_recv_buf, p->can_recv_ts);
     }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
+  } else if (transfer->status == LIBUSB_TRANSFER_OVERFLOW) {
+    LOGE_100("overflow got 0x%x", transfer->actual_length);
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    LOGE("lost connection");
+    p->connected = false;
   }
 
-  return recv;
+  if (transfer->status != LIBUSB_TRANSFER_CANCELLED && p->connected) {
+    int err = libusb_submit_transfer(transfer);
+    if (err == 0) return;
+    p->handle_usb_issue(err, __func__);
+  }
+  p->can_recv_in_flight--;
+}
+
+bool Panda::can_recv_start() {
+  // SPI is read synchronously
+  if (spi_fd >= 0) return false;
+
+  can_recv_buf.reserve(CAN_RECV_MAX_BUFFERED);
+  can_read_buf.reserve(CAN_RECV_MAX_BUFFERED);
+  // a frame is at least its header
+  can_recv_ts.reserve(CAN_RECV_MAX_BUFFERED / CANPACKET_HEAD_SIZE);
+  can_read_ts.reserve(CAN_RECV_MAX_BUFFERED / CANPACKET_HEAD_SIZE);
+  can_read_times.reserve(CAN_RECV_MAX_BUFFERED / CANPACKET_HEAD_SIZE);
+  for (int i = 0; i < CAN_RECV_TRANSFERS; i++) {
+    libusb_transfer *transfer = libusb_alloc_transfer(0);
+    if (transfer == NULL) return false;
+    libusb_fill_bulk_transfer(transfer, dev_handle, 0x81, can_recv_data[i], RECV_SIZE, can_recv_callback, this, 0);
+    can_recv_transfers[i] = transfer;
+
+    std::lock_guard<std::mutex> lk(can_recv_lock);
+    int err = libusb_submit_transfer(transfer);
+    if (err != 0) {
+      handle_usb_issue(err, __func__);
+      return false;
+    }
+    can_recv_in_flight++;
+  }
+  return true;
+}
+
+void Panda::can_recv_stop() {
+  for (auto transfer : can_recv_transfers) {
+    if (transfer) libusb_cancel_transfer(transfer);
+  }
+  auto in_flight = [&]() {
+    std::lock_guard<std::mutex> lk(can_recv_lock);
+    return can_recv_in_flight;
+  };
+  for (int i = 0; i < 100 && in_flight() > 0; i++) {
+    handle_usb_events(10000);
+  }
+  if (in_flight() > 0) {
+    // freeing a transfer libusb still has would be worse than leaking it
+    LOGE("%d CAN reads didn't cancel", in_flight());
+    return;
+  }
+  for (auto &transfer : can_recv_transfers) {
+    libusb_free_transfer(transfer);
+    transfer = NULL;
+  }
+}
+
+void Panda::handle_usb_events(int timeout_us) {
+  // there are no async transfers over SPI
+  if (spi_fd >= 0) {
+    util::sleep_for(timeout_us / 1000);
+    return;
+  }
+  struct timeval tv = {timeout_us / 1000000, timeout_us % 1000000};
+  int err = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  if (err != 0) handle_usb_issue(err, __func__);
+}
+
+bool Panda::can_recv_pending() {
+  std::lock_guard<std::mutex> lk(can_recv_lock);
+  return !can_recv_buf.empty();
+}
+
+int Panda::can_read_async(const uint8_t **data, const uint64_t **rx_times) {
+  {
+    std::lock_guard<std::mutex> lk(can_recv_lock);
+    // swapped rather than copied, both keep their capacity
+    can_read_buf.clear();
+    can_read_ts.clear();
+    std::swap(can_read_buf, can_recv_buf);
+    std::swap(can_read_ts, can_recv_ts);
+    can_recv_full = false;
+  }
+
+  *data = can_read_buf.data();
+  if (rx_times) {
+    convert_can_times();
+    *rx_times = can_read_times.data();
+  }
+  return can_read_buf.size();
 }
@@ -3,6 +3,9 @@
 #include <ctime>
 #include <cstdint>
 #include <pthread.h>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include <libusb-1.0/libusb.h>
 
@@ -13,6 +16,13 @@
 #define RECV_SIZE (0x1000)
 #define TIMEOUT 0
 
+// CAN buses per panda, the nth panda's buses are numbered from n * PANDA_BUS_CNT
+#define PANDA_BUS_CNT 4
+
+// async CAN reads kept in flight, and how much received CAN is held until it's published
+#define CAN_RECV_TRANSFERS 4
+#define CAN_RECV_MAX_BUFFERED (16 * RECV_SIZE)
+
 // copied from panda/board/main.c
 struct __attribute__((packed)) health_t {
   uint32_t uptime;
@@ -32,33 +42,185 @@ struct __attribute__((packed)) health_t {
   uint8_t safety_model;
   uint8_t fault_status;
   uint8_t power_save_enabled;
+  uint8_t can_tx_high_water[PANDA_BUS_CNT];
+  uint8_t can_tx_bulk_high_water[PANDA_BUS_CNT];
+  uint16_t can_rx_delay_max_us;
+  uint8_t can_rx_missed[PANDA_BUS_CNT];
+};
+
+// a bus since its last read, copied from panda/board/main.c
+struct __attribute__((packed)) can_health_t {
+  uint32_t rx_cnt;
+  uint32_t tx_cnt;
+  uint16_t bus_load;  // in 0.1% of the bitrate
+  uint16_t error_passive_cnt;
+  uint16_t bus_off_cnt;
+  // the controller's ESR: error warning, passive and bus off flags, and last error code in bits 4-6
+  uint8_t esr_flags;
+  uint8_t tec;
+  uint8_t rec;
 };
 
 
 void panda_set_power(bool power);
 
+// The panda's USB CAN framing, see panda/board/drivers/can_framing.h. v1 is 0x10 bytes per
+// message. v2, used when the firmware has it, is a header and the data, in 0x40 byte USB
+// packets with a counter, and the panda's receive time on the packets it sends. Only whole
+// frames are passed around here. None of these allocate.
+#define CAN_FRAMING_V1 1
+#define CAN_FRAMING_V2 2
+#define USBPACKET_MAX_SIZE 0x40
+#define USBPACKET_HEAD_SIZE 2
+#define USBPACKET_IN_HEAD_SIZE 6
+#define CANPACKET_HEAD_SIZE 5
+#define CANPACKET_DATA_SIZE_MAX 64
+#define CANPACKET_MAX_SIZE (CANPACKET_HEAD_SIZE + CANPACKET_DATA_SIZE_MAX)
+
+// Bytes can_pack needs at most for n messages
+size_t can_pack_size(int n, int framing=CAN_FRAMING_V1);
+// Packs the messages for buses bus_offset to bus_offset + PANDA_BUS_CNT into out after the start
+// bytes of earlier calls, and returns the total size in bytes. v2 is packed into USB packets,
+// continuing the last one, counter is where the packet counter is kept
+int can_pack(capnp::List<cereal::CanData>::Reader can_data_list, uint8_t *out, int bus_offset=0,
+             int framing=CAN_FRAMING_V1, uint8_t *counter=NULL, int start=0);
+// Number of messages in len bytes of whole frames
+int can_count(const uint8_t *data, int len, int framing=CAN_FRAMING_V1);
+// Unpacks into can from index start, with bus_offset added to the buses, and rx_times, if given,
+// as the messages' rxTime. Returns the message count
+int can_unpack(const uint8_t *data, int len, capnp::List<cereal::CanData>::Builder can, int start=0,
+               int bus_offset=0, int framing=CAN_FRAMING_V1, const uint64_t *rx_times=NULL);
+// Upper bound on the serialized size of a can event of count messages from len bytes
+size_t can_event_size(int count, int len);
+
+// Reassembles the frames of v2 USB packets
+class CanStream {
+public:
+  // USBPACKET_IN_HEAD_SIZE for packets from the panda
+  CanStream(int head_size=USBPACKET_HEAD_SIZE) : head_size(head_size) {}
+  // Appends the frames completed by len bytes of packets to out, which must have room
+  // for len + CANPACKET_MAX_SIZE more bytes, and, with the IN header, the receive time of
+  // the packet each started in to ts. Returns the number of packets lost before these
+  int parse(const uint8_t *data, int len, std::vector<uint8_t> &out, std::vector<uint32_t> *ts=NULL);
+
+private:
+  const int head_size;
+  uint8_t counter = 0;
+  bool synced = false;
+  uint8_t frame[CANPACKET_MAX_SIZE];
+  int pos = 0;
+  uint32_t frame_ts = 0;
+};
+
+// The serial of a panda on the SPI bus instead of USB, listed when BOARDD_SPI is set to its spidev.
+// BOARDD_SPI_READY_GPIO is the gpio of its handshake line, driven low when a response is ready,
+// otherwise the response is polled for. The framing is in panda/board/drivers/spi.h, the same
+// control requests and endpoints go over it
+#define PANDA_SPI_SERIAL "spi"
+#define PANDA_SPI_DEVICE "/dev/spidev0.0"
+#define SPI_SPEED_HZ 10000000
+// the most data a request or response carries, longer bulk transfers are split
+#define SPI_MAX_DATA 0x400
+// a transfer without a timeout gives up after this, like a stalled USB transfer
+#define SPI_TIMEOUT_MS 100
+
+// USB request classes that are timed separately. Each has its own lock, so a slow control
+// transfer from the health or hardware threads never holds up sending or receiving CAN
+enum class UsbRequest {
+  CONTROL,
+  CAN_SEND,
+  CAN_RECV,
+  NUM,
+};
+
+struct UsbRequestStats {
+  uint32_t count = 0;
+  uint64_t lock_wait_us = 0, max_lock_wait_us = 0;
+  uint64_t transfer_us = 0, max_transfer_us = 0;
+};
+
 class Panda {
  private:
   libusb_context *ctx = NULL;
   libusb_device_handle *dev_handle = NULL;
-  pthread_mutex_t usb_lock;
+  // control transfers, the CAN and pigeon bulk writes, and synchronous bulk reads
+  pthread_mutex_t usb_lock, bulk_out_lock, bulk_in_lock;
+  std::mutex stats_lock;
+  UsbRequestStats usb_stats[(int)UsbRequest::NUM];
+  // takes lock, timing the wait and returning the time it's acquired
+  uint64_t lock_timed(pthread_mutex_t *lock, UsbRequest req);
+  void unlock_timed(pthread_mutex_t *lock, UsbRequest req, uint64_t locked);
   void handle_usb_issue(int err, const char func[]);
   void cleanup();
 
+  // the transfers of usb_* and the rest, over USB or SPI. Return what libusb would
+  int control_transfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                       unsigned char *data, uint16_t wLength, unsigned int timeout);
+  int bulk_transfer(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+  // the spidev and the handshake gpio's value, -1 over USB. The bus takes a request at a time
+  int spi_fd = -1, spi_ready_fd = -1;
+  std::mutex spi_lock;
+  uint8_t spi_tx_buf[SPI_MAX_DATA + 0x20], spi_rx_buf[SPI_MAX_DATA + 4];
+  bool spi_open();
+  // One request to endpoint and its response. Returns the response length, LIBUSB_ERROR_TIMEOUT if the
+  // panda NACKed it or didn't respond in time, or LIBUSB_ERROR_IO
+  int spi_transfer(uint8_t endpoint, const uint8_t *tx, int tx_len, uint8_t *rx, int max_rx_len, unsigned int timeout);
+
+  // async CAN receive, the callback runs in whichever thread is handling libusb events
+  static void LIBUSB_CALL can_recv_callback(libusb_transfer *transfer);
+  libusb_transfer *can_recv_transfers[CAN_RECV_TRANSFERS] = {};
+  unsigned char can_recv_data[CAN_RECV_TRANSFERS][RECV_SIZE];
+  std::mutex can_recv_lock;
+  std::vector<uint8_t> can_recv_buf;
+  // what the last can_read returned, and what can_send packs into. Both only grow
+  std::vector<uint8_t> can_read_buf, can_send_buf;
+  int can_send_len = 0;
+  // the panda's receive times of the frames in can_recv_buf and can_read_buf, 0 if unknown,
+  // and can_read_buf's in the host's clock
+  std::vector<uint32_t> can_recv_ts, can_read_ts;
+  std::vector<uint64_t> can_read_times;
+  // for v2 framing
+  CanStream can_recv_stream{USBPACKET_IN_HEAD_SIZE};
+  uint8_t can_send_counter = 0;
+  uint8_t can_read_data[RECV_SIZE];
+  // switches to v2 framing if the firmware has it, unless BOARDD_CAN_FRAMING is 1
+  void negotiate_can_framing();
+  void add_can_data(const uint8_t *data, int len, std::vector<uint8_t> &out, std::vector<uint32_t> &ts);
+  // converts can_read_ts into can_read_times
+  void convert_can_times();
+
+  // the panda's microsecond timer at a host time, from the sync with the best round trip
+  std::mutex clock_lock;
+  bool clock_synced = false;
+  uint32_t clock_panda_us = 0;
+  uint64_t clock_host_ns = 0;
+  int can_recv_in_flight = 0;
+  bool can_recv_full = false;
+
  public:
-  Panda();
+  // Opens the panda with the given USB serial, or the first one found if it's empty
+  Panda(std::string serial="", int bus_offset=0);
   ~Panda();
+  // USB serials of the connected pandas
+  static std::vector<std::string> list();
 
+  std::string usb_serial;
+  const int bus_offset;
+  int can_framing = CAN_FRAMING_V1;
   bool connected = true;
   cereal::HealthData::HwType hw_type = cereal::HealthData::HwType::UNKNOWN;
   bool is_pigeon = false;
   bool has_rtc = false;
+  // firmware with the gps ring on bulk endpoint 2, else it's read with 0xe0 a packet at a time
+  bool has_pigeon_endpoint = false;
 
   // HW communication
   int usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout=TIMEOUT);
   int usb_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout=TIMEOUT);
   int usb_bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
   int usb_bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  // What the gps ring has, up to length in whole USB packets, without waiting on the CAN reads
+  int pigeon_read(unsigned char *data, int length);
 
   // Panda functionality
   cereal::HealthData::HwType get_hw_type();
@@ -70,13 +232,47 @@ class Panda {
   uint16_t get_fan_speed();
   void set_ir_pwr(uint16_t ir_pwr);
   health_t get_health();
+  // False on firmware without the request
+  bool get_can_health(uint8_t bus, can_health_t &can_health);
   void set_loopback(bool loopback);
+  void set_can_rx_deferred(bool deferred);
+  // Only the frames of bus matching filters go to the host, (addr, mask) pairs where mask has the bits
+  // of a standard addr that have to match. Addrs above 0x7ff are extended, matched exactly. Empty is every frame
+  void set_can_filters(uint8_t bus, const std::vector<std::pair<uint32_t, uint16_t>> &filters);
   const char* get_firmware_version();
   const char* get_serial();
   void set_power_saving(bool power_saving);
   void set_usb_power_mode(cereal::HealthData::UsbPowerMode power_mode);
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
+  // Packs the messages behind those already added, for sending together in one bulk write
+  void can_send_add(capnp::List<cereal::CanData>::Reader can_data_list);
+  // Sends what was added, returns false if it didn't all go out in timeout ms
+  bool can_send_flush(unsigned int timeout);
   int can_receive(cereal::Event::Builder &event);
+  // Reads CAN from the panda into a buffer that stays valid until the next read, and
+  // returns its size in bytes. can_read_async takes what the async reads have buffered.
+  // rx_times gets when each message was received, as nanos_since_boot, 0 if unknown
+  int can_read(const uint8_t **data, const uint64_t **rx_times=NULL);
+  int can_read_async(const uint8_t **data, const uint64_t **rx_times=NULL);
+
+  // Syncs the host's clock to the panda's timer with control request 0xa8, so v2's receive
+  // times can be converted. Call it every second or so, the clocks drift. Returns false on
+  // firmware without it
+  bool sync_clock();
+  // Round trip of the last sync's best read, in microseconds
+  uint64_t clock_sync_rtt_us = 0;
+
+  // Keeps CAN_RECV_TRANSFERS bulk reads of the CAN endpoint in flight, so the panda's FIFO is
+  // emptied as it fills. Received CAN is buffered until can_read_async
+  bool can_recv_start();
+  // Cancels the reads and waits for them
+  void can_recv_stop();
+  // Runs libusb's event handling, and with it the CAN callbacks, for up to timeout_us
+  void handle_usb_events(int timeout_us);
+  bool can_recv_pending();
+
+  // Returns the stats per UsbRequest since the last call
+  void take_usb_stats(UsbRequestStats out[(int)UsbRequest::NUM]);
 
 };
@@ -2,10 +2,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <termios.h>
 
 #include "common/swaglog.h"
 #include "common/gpio.h"
+#include "common/params.h"
 #include "common/util.h"
 
 #include "pigeon.h"
@@ -15,8 +17,70 @@
 #define   B460800 0010004
 #endif
 
+// The panda has no pigeon endpoint and gives a control read at most 0x40 bytes, so it's polled
+#define PANDA_PIGEON_CHUNK 0x40
+#define PANDA_PIGEON_POLL_MS 5
+
+// UBX-MGA, the assistance messages
+#define UBX_CLASS_MGA 0x13
+#define UBX_MGA_INI 0x40
+#define UBX_MGA_DBD 0x80
+
+// a parked car is near its last fix, but it may have been carried off
+#define ASSIST_MIN_POS_ACC_CM (100 * 1000 * 100)
+
 using namespace std::string_literals;
 
+struct __attribute__((packed)) ubx_mga_ini_time_utc {
+  uint8_t type, version, ref;
+  int8_t leap_secs;
+  uint16_t year;
+  uint8_t month, day, hour, minute, second, reserved1;
+  uint32_t ns;
+  uint16_t tacc_s, reserved2;
+  uint32_t tacc_ns;
+};
+static_assert(sizeof(ubx_mga_ini_time_utc) == 24);
+
+struct __attribute__((packed)) ubx_mga_ini_pos_llh {
+  uint8_t type, version, reserved1[2];
+  int32_t lat, lon, alt;
+  uint32_t pos_acc;
+};
+static_assert(sizeof(ubx_mga_ini_pos_llh) == 20);
+
+static std::string ubx_frame(uint8_t cls, uint8_t id, const void *payload, size_t len) {
+  std::string frame = "\xB5\x62"s;
+  frame += (char)cls;
+  frame += (char)id;
+  frame += (char)(len & 0xff);
+  frame += (char)(len >> 8);
+  if (len > 0) frame.append((const char *)payload, len);
+
+  uint8_t a = 0, b = 0;
+  for (size_t i = 2; i < frame.size(); i++) {
+    a += (uint8_t)frame[i];
+    b += a;
+  }
+  frame += (char)a;
+  frame += (char)b;
+  return frame;
+}
+
+// whole frames with a good checksum, what got saved may have been cut short
+static bool ubx_valid_frame(const std::string &dat, size_t offset, size_t *frame_len) {
+  if (dat.size() - offset < 8 || (uint8_t)dat[offset] != 0xB5 || (uint8_t)dat[offset + 1] != 0x62) return false;
+  *frame_len = 8 + ((uint8_t)dat[offset + 4] | ((uint8_t)dat[offset + 5] << 8));
+  if (dat.size() - offset < *frame_len) return false;
+
+  uint8_t a = 0, b = 0;
+  for (size_t i = offset + 2; i < offset + *frame_len - 2; i++) {
+    a += (uint8_t)dat[i];
+    b += a;
+  }
+  return a == (uint8_t)dat[offset + *frame_len - 2] && b == (uint8_t)dat[offset + *frame_len - 1];
+}
+
 
 Pigeon * Pigeon::connect(Panda * p){
   PandaPigeon * pigeon = new PandaPigeon();
@@ -77,9 +141,70 @@ void Pigeon::init() {
   send("\xB5\x62\x06\x01\x03\x00\x02\x13\x01\x20\x6C"s);
   send("\xB5\x62\x06\x01\x03\x00\x0A\x09\x01\x1E\x70"s);
 
+  if (getenv("BOARDD_GNSS_COLD") == NULL) {
+    send_assistance();
+  }
+
   LOGW("panda GPS on");
 }
 
+void Pigeon::send_assistance() {
+  bool time_sent = false, position_sent = false;
+  int database_frames = 0;
+
+  // the system clock, like thermald only once it's been set
+  struct timespec ts;
+  struct tm tm;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  gmtime_r(&ts.tv_sec, &tm);
+  if (tm.tm_year + 1900 > 2020 || (tm.tm_year + 1900 == 2020 && tm.tm_mon + 1 >= 10)) {
+    ubx_mga_ini_time_utc t = {
+      .type = 0x10,
+      .leap_secs = -128,  // unknown
+      .year = (uint16_t)(tm.tm_year + 1900),
+      .month = (uint8_t)(tm.tm_mon + 1),
+      .day = (uint8_t)tm.tm_mday,
+      .hour = (uint8_t)tm.tm_hour,
+      .minute = (uint8_t)tm.tm_min,
+      .second = (uint8_t)tm.tm_sec,
+      .ns = (uint32_t)ts.tv_nsec,
+      .tacc_s = 2,
+    };
+    send(ubx_frame(UBX_CLASS_MGA, UBX_MGA_INI, &t, sizeof(t)));
+    time_sent = true;
+  }
+
+  Params params = Params();
+  int lat, lon, height;
+  unsigned int hacc;
+  if (sscanf(params.get(PIGEON_POSITION_PARAM).c_str(), "%d,%d,%d,%u", &lat, &lon, &height, &hacc) == 4) {
+    ubx_mga_ini_pos_llh p = {
+      .type = 0x01,
+      .lat = lat,
+      .lon = lon,
+      .alt = height / 10,
+      .pos_acc = std::max(hacc / 10, (unsigned int)ASSIST_MIN_POS_ACC_CM),
+    };
+    send(ubx_frame(UBX_CLASS_MGA, UBX_MGA_INI, &p, sizeof(p)));
+    position_sent = true;
+  }
+
+  // the ephemerides and almanacs of the last drive, taken back as the ublox dumped them
+  const std::string database = params.get(PIGEON_DATABASE_PARAM);
+  size_t frame_len;
+  for (size_t i = 0; ubx_valid_frame(database, i, &frame_len); i += frame_len) {
+    if ((uint8_t)database[i + 2] != UBX_CLASS_MGA || (uint8_t)database[i + 3] != UBX_MGA_DBD) break;
+    send(database.substr(i, frame_len));
+    database_frames++;
+  }
+
+  LOGW("panda GPS assistance: time %d, position %d, %d database frames", time_sent, position_sent, database_frames);
+}
+
+void Pigeon::request_database() {
+  send(ubx_frame(UBX_CLASS_MGA, UBX_MGA_DBD, NULL, 0));
+}
+
 void PandaPigeon::connect(Panda * p) {
   panda = p;
 }
@@ -103,16 +228,27 @@ void PandaPigeon::send(std::string s) {
   }
 }
 
-std::string PandaPigeon::receive() {
-  std::string r;
+int PandaPigeon::receive(uint8_t *buf, int len, int timeout_ms) {
+  int r = 0;
+  while (true) {
+    if (panda->has_pigeon_endpoint) {
+      // the ring in one transfer
+      r = panda->pigeon_read(buf, len);
+    } else {
+      // a short read emptied the panda's ring, so there's no trailing empty read
+      while (len - r >= PANDA_PIGEON_CHUNK) {
+        int ret = panda->usb_read(0xe0, 1, 0, &buf[r], PANDA_PIGEON_CHUNK);
+        if (ret <= 0) break;
+        r += ret;
+        if (ret < PANDA_PIGEON_CHUNK) break;
+      }
+    }
+    if (r > 0 || timeout_ms <= 0 || !panda->connected) break;
 
-  while (true){
-    unsigned char dat[0x40];
-    int len = panda->usb_read(0xe0, 1, 0, dat, sizeof(dat));
-    if (len <= 0 || r.length() > 0x1000) break;
-    r.append((char*)dat, len);
+    int wait_ms = std::min(timeout_ms, PANDA_PIGEON_POLL_MS);
+    util::sleep_for(wait_ms);
+    timeout_ms -= wait_ms;
   }
-
   return r;
 }
 
@@ -190,20 +326,23 @@ void TTYPigeon::send(std::string s) {
   if(err < 0) { handle_tty_issue(err, __func__); }
 }
 
-std::string TTYPigeon::receive() {
-  std::string r;
-
-  while (true){
-    char dat[0x40];
-    int len = read(pigeon_tty_fd, dat, sizeof(dat));
-    if(len < 0) {
-      handle_tty_issue(len, __func__);
-    } else if (len == 0 || r.length() > 0x1000){
+int TTYPigeon::receive(uint8_t *buf, int len, int timeout_ms) {
+  struct pollfd pfd = {.fd = pigeon_tty_fd, .events = POLLIN};
+  int err = poll(&pfd, 1, timeout_ms);
+  if (err < 0 && errno != EINTR) { handle_tty_issue(errno, __func__); }
+  if (err <= 0) return 0;
+
+  // VMIN and VTIME are 0, so this takes everything the driver has without blocking
+  int r = 0;
+  while (r < len) {
+    int ret = read(pigeon_tty_fd, &buf[r], len - r);
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EINTR) { handle_tty_issue(errno, __func__); }
+      break;
+    } else if (ret == 0) {
       break;
-    } else {
-      r.append(dat, len);
     }
-
+    r += ret;
   }
   return r;
 }
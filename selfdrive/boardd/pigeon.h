@@ -5,17 +5,35 @@
 
 #include "panda.h"
 
+// what one receive takes at most, a few of the ublox's 10 Hz bursts
+#define PIGEON_RECV_SIZE 0x1000
+
+// The ublox's navigation database and the last fix, saved by ubloxd for the assistance at init.
+// The database is the UBX-MGA-DBD frames of the last dump one after another, the position is
+// "<lat>,<lon>,<height>,<hAcc>" in the NAV-PVT units, 1e-7 deg and mm
+#define PIGEON_DATABASE_PARAM "GnssDatabase"
+#define PIGEON_POSITION_PARAM "LastGpsPosition"
+
 class Pigeon {
  public:
   static Pigeon* connect(Panda * p);
   static Pigeon* connect(const char * tty);
   virtual ~Pigeon(){};
 
+  // Configures the ublox and gives it the time, the last position and the saved database, so it
+  // starts hot. BOARDD_GNSS_COLD=1 leaves the assistance out, to compare the time to first fix
   void init();
+  // Asks for a dump of the navigation database, ubloxd saves it as it comes
+  void request_database();
   virtual void set_baud(int baud) = 0;
   virtual void send(std::string s) = 0;
-  virtual std::string receive() = 0;
+  // Waits up to timeout_ms for data, then reads what's there into buf. Returns the
+  // bytes read, 0 if nothing came
+  virtual int receive(uint8_t *buf, int len, int timeout_ms) = 0;
   virtual void set_power(bool power) = 0;
+
+ private:
+  void send_assistance();
 };
 
 class PandaPigeon : public Pigeon {
@@ -25,7 +43,7 @@ public:
   void connect(Panda * p);
   void set_baud(int baud);
   void send(std::string s);
-  std::string receive();
+  int receive(uint8_t *buf, int len, int timeout_ms);
   void set_power(bool power);
 };
 
@@ -38,6 +56,6 @@ public:
   void connect(const char* tty);
   void set_baud(int baud);
   void send(std::string s);
-  std::string receive();
+  int receive(uint8_t *buf, int len, int timeout_ms);
   void set_power(bool power);
 };
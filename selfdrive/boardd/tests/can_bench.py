@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+# Measures what the host to panda link sustains: frames are sent through boardd in steps of rising rate
+# and timed back, through the panda's loopback or over the wire into a second panda. Starts boardd itself
+#   selfdrive/boardd/tests/can_bench.py [--pattern steady|burst] [--rates 500,1000,...] [--loads 0.2,0.8,...]
+#   second panda wired bus to bus: BOARDD_PANDAS=<first>,<second> ... --no-loopback --rx-bus-offset 4
+# Each frame carries its step and sequence number. For each step and bus it prints the offered and the
+# achieved rate, the frames not echoed as sent (dropped on the way out) and not received back, and the
+# p50/p99 from the sendcan publish to the can message with it. The ceiling is the last step without drops
+import argparse
+import os
+import struct
+import time
+from collections import defaultdict
+
+import cereal.messaging as messaging
+from cereal import car
+from common.basedir import BASEDIR
+from common.params import Params
+from common.realtime import sec_since_boot
+from selfdrive.boardd.boardd import can_list_to_can_capnp
+from selfdrive.car import make_can_msg
+from selfdrive.test.helpers import with_processes
+
+# a standard 8 byte frame without the stuff bits, like the panda counts its bus load
+FRAME_BITS = 47 + 8 * 8
+SENDCAN_HZ = 100
+# time for the last frames of a step to come back
+SETTLE_S = 0.5
+
+
+def percentile(v, p):
+  if not v:
+    return float('nan')
+  v = sorted(v)
+  return v[min(len(v) - 1, int(p * len(v)))]
+
+
+class Step:
+  def __init__(self, step, rate, buses):
+    self.step = step
+    self.rate = rate
+    self.sent = {bus: {} for bus in buses}  # seq -> publish time
+    self.echo = defaultdict(dict)  # bus -> seq -> latency
+    self.rx = defaultdict(dict)
+    self.first_rx, self.last_rx = defaultdict(lambda: None), defaultdict(lambda: None)
+
+
+def receive(can, steps, args):
+  now = sec_since_boot()
+  for msg in messaging.drain_sock(can):
+    for c in msg.can:
+      if c.address != args.addr or len(c.dat) != 8:
+        continue
+      step, seq, bus = struct.unpack('<HIB', c.dat[:7])
+      s = steps.get(step)
+      if s is None or bus not in s.sent or seq not in s.sent[bus]:
+        continue
+      if c.src == 128 + bus:
+        s.echo[bus].setdefault(seq, now - s.sent[bus][seq])
+      elif c.src == bus + args.rx_bus_offset:
+        s.rx[bus].setdefault(seq, now - s.sent[bus][seq])
+        s.first_rx[bus] = s.first_rx[bus] or now
+        s.last_rx[bus] = now
+
+
+def run_step(sendcan, can, steps, s, args):
+  # steady spreads the frames over every sendcan, burst sends a tenth of a second's worth at once
+  period = 1. / SENDCAN_HZ if args.pattern == 'steady' else 0.1
+  owed = 0.
+  seq = 0
+  start = sec_since_boot()
+  next_send = start
+  while next_send - start < args.duration:
+    owed += s.rate * period
+    n, owed = int(owed), owed - int(owed)
+    to_send = []
+    now = sec_since_boot()
+    for _ in range(n):
+      for bus in s.sent:
+        to_send.append(make_can_msg(args.addr, struct.pack('<HIBx', s.step, seq, bus), bus))
+        s.sent[bus][seq] = now
+      seq += 1
+    if to_send:
+      sendcan.send(can_list_to_can_capnp(to_send, msgtype='sendcan'))
+
+    next_send += period
+    while sec_since_boot() < next_send:
+      receive(can, steps, args)
+      time.sleep(0.001)
+
+  end = sec_since_boot() + SETTLE_S
+  while sec_since_boot() < end:
+    receive(can, steps, args)
+    time.sleep(0.001)
+
+
+def report(s, args):
+  ok = True
+  for bus, sent in s.sent.items():
+    echo, rx = s.echo[bus], s.rx[bus]
+    achieved = 0.
+    if len(rx) > 1:
+      achieved = (len(rx) - 1) / max(s.last_rx[bus] - s.first_rx[bus], 1e-6)
+    not_echoed = 100. * (len(sent) - len(echo)) / max(len(sent), 1)
+    not_rx = 100. * (len(sent) - len(rx)) / max(len(sent), 1)
+    ok = ok and not_echoed <= args.drop_threshold and not_rx <= args.drop_threshold
+    print("%4d %8.0f %6.1f%% %10.0f %8.2f%% %8.2f%% %8.2f %8.2f %8.2f %8.2f" % (
+          bus, s.rate, 100. * s.rate * FRAME_BITS / args.bitrate, achieved, not_echoed, not_rx,
+          1e3 * percentile(list(echo.values()), 0.5), 1e3 * percentile(list(echo.values()), 0.99),
+          1e3 * percentile(list(rx.values()), 0.5), 1e3 * percentile(list(rx.values()), 0.99)))
+  return ok
+
+
+def bench(args):
+  # boardd blocks on CarVin and CarParams
+  time.sleep(2)
+  cp = car.CarParams.new_message()
+  cp.safetyModel = car.CarParams.SafetyModel.allOutput
+  Params().put("CarVin", b"0"*17)
+  Params().put("CarParams", cp.to_bytes())
+
+  sendcan = messaging.pub_sock('sendcan')
+  can = messaging.sub_sock('can', conflate=False, timeout=100)
+  time.sleep(1)
+
+  rates = [float(r) for r in args.rates.split(',')] if args.rates else []
+  rates += [float(l) * args.bitrate / FRAME_BITS for l in args.loads.split(',')] if args.loads else []
+  buses = [int(b) for b in args.buses.split(',')]
+
+  print("%4s %8s %7s %10s %9s %9s %8s %8s %8s %8s" % ("bus", "fps", "load", "rx fps", "!echoed", "!rx",
+        "echo p50", "echo p99", "rx p50", "rx p99"))
+  steps = {}
+  ceiling = None
+  for i, rate in enumerate(sorted(rates)):
+    steps[i] = Step(i, rate, buses)
+    run_step(sendcan, can, steps, steps[i], args)
+    if not report(steps[i], args):
+      print("drops from %.0f frames/s a bus" % rate)
+      break
+    ceiling = rate
+  print("ceiling: %s" % ("%.0f frames/s a bus" % ceiling if ceiling is not None else "drops at the first step"))
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="CAN throughput and latency through boardd")
+  parser.add_argument("--pattern", choices=['steady', 'burst'], default='steady')
+  parser.add_argument("--rates", default="100,250,500,1000,2000", help="frames/s a bus, comma separated")
+  parser.add_argument("--loads", default="0.2,0.4,0.6,0.8,0.9", help="shares of the bus bitrate, comma separated")
+  parser.add_argument("--bitrate", type=int, default=500000)
+  parser.add_argument("--buses", default="0,1,2")
+  parser.add_argument("--addr", type=lambda x: int(x, 0), default=0x3f0)
+  parser.add_argument("--duration", type=float, default=5., help="seconds a step")
+  parser.add_argument("--drop-threshold", type=float, default=0., help="%% of frames a step may drop")
+  parser.add_argument("--rx-bus-offset", type=int, default=0, help="where the frames of bus 0 come back")
+  parser.add_argument("--no-loopback", action='store_true', help="frames come back from a second panda")
+  args = parser.parse_args()
+
+  os.environ['STARTED'] = '1'
+  os.environ['BASEDIR'] = BASEDIR
+  if not args.no_loopback:
+    os.environ['BOARDD_LOOPBACK'] = '1'
+  with_processes(['boardd'])(bench)(args)
@@ -53,6 +53,29 @@ class TestBoarddApiMethods(unittest.TestCase):
         for attr in attrs:
           self.assertEqual(getattr(ev.can[i], attr, 'new'), getattr(ev_old.can[i], attr, 'old'))
 
+  def test_arrays(self):
+    for _ in range(100):
+      can_list, cnt = generate_random_can_data_list()
+      for c in can_list:
+        c[1] = 0
+      addresses = np.array([c[0] for c in can_list], dtype=np.uint32)
+      dat = np.frombuffer(b''.join(c[2] for c in can_list), dtype=np.uint8)
+      lens = np.array([len(c[2]) for c in can_list], dtype=np.uint8)
+      buses = np.array([c[3] for c in can_list], dtype=np.uint8)
+
+      for msgtype in ['sendcan', 'can']:
+        ev = log.Event.from_bytes(boardd.can_arrays_to_can_capnp(addresses, dat, lens, buses, msgtype, valid=False))
+        ev_list = log.Event.from_bytes(boardd.can_list_to_can_capnp(can_list, msgtype, valid=False))
+        self.assertEqual(ev.which(), msgtype)
+        self.assertFalse(ev.valid)
+        self.assertEqual(len(getattr(ev, msgtype)), cnt)
+        for m, m_list in zip(getattr(ev, msgtype), getattr(ev_list, msgtype)):
+          for attr in ['address', 'busTime', 'dat', 'src']:
+            self.assertEqual(getattr(m, attr), getattr(m_list, attr))
+
+    with self.assertRaises(ValueError):
+      boardd.can_arrays_to_can_capnp(addresses, dat[:-1], lens, buses)
+
   def test_performance(self):
     can_list, _ = generate_random_can_data_list()
     recursions = 1000
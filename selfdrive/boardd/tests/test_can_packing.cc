@@ -0,0 +1,265 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <capnp/message.h>
+
+#include "catch2/catch.hpp"
+#include "panda.h"
+
+// Counts heap allocations while enabled. operator new goes through malloc too
+static std::atomic<bool> counting{false};
+static std::atomic<int> allocs{0};
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  if (counting) allocs++;
+  return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size) {
+  if (counting) allocs++;
+  return __libc_calloc(n, size);
+}
+void *realloc(void *ptr, size_t size) {
+  if (counting) allocs++;
+  return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+// one full read of the panda's FIFO
+const int BATCH = RECV_SIZE / 0x10;
+
+static void build_sendcan(capnp::MallocMessageBuilder &msg, int n) {
+  auto can = msg.initRoot<cereal::Event>().initSendcan(n);
+  for (int i = 0; i < n; i++) {
+    uint8_t dat[8];
+    for (int j = 0; j < 8; j++) dat[j] = i + j;
+    can[i].setAddress(i % 2 ? 0x18daf110 + i : 0x100 + i);
+    can[i].setDat(kj::arrayPtr(dat, i % 9));
+    can[i].setSrc(i % 3);
+  }
+}
+
+// what the panda's firmware would get from a bulk write, as whole frames
+static std::vector<uint8_t> frames(const std::vector<uint8_t> &buf, int len, int framing) {
+  std::vector<uint8_t> out;
+  out.reserve(len + CANPACKET_MAX_SIZE);
+  if (framing == CAN_FRAMING_V2) {
+    CanStream stream;
+    REQUIRE(stream.parse(buf.data(), len, out) == 0);
+  } else {
+    out.insert(out.end(), buf.begin(), buf.begin() + len);
+  }
+  return out;
+}
+
+TEST_CASE("can_pack and can_unpack round trip") {
+  const int framing = GENERATE(CAN_FRAMING_V1, CAN_FRAMING_V2);
+  capnp::MallocMessageBuilder send_msg;
+  build_sendcan(send_msg, BATCH);
+  auto sendcan = send_msg.getRoot<cereal::Event>().asReader().getSendcan();
+
+  uint8_t counter = 0;
+  std::vector<uint8_t> buf(can_pack_size(BATCH, framing));
+  int len = can_pack(sendcan, buf.data(), 0, framing, &counter);
+  REQUIRE(len <= buf.size());
+  if (framing == CAN_FRAMING_V1) REQUIRE(len == BATCH * 0x10);
+
+  auto data = frames(buf, len, framing);
+  REQUIRE(can_count(data.data(), data.size(), framing) == BATCH);
+
+  capnp::MallocMessageBuilder recv_msg;
+  auto event = recv_msg.initRoot<cereal::Event>();
+  REQUIRE(can_unpack(data.data(), data.size(), event.initCan(BATCH), 0, 0, framing) == BATCH);
+
+  auto can = event.asReader().getCan();
+  for (int i = 0; i < BATCH; i++) {
+    REQUIRE(can[i].getAddress() == sendcan[i].getAddress());
+    REQUIRE(can[i].getSrc() == sendcan[i].getSrc());
+    REQUIRE(can[i].getDat() == sendcan[i].getDat());
+  }
+}
+
+TEST_CASE("v2 framing carries CAN FD payloads") {
+  capnp::MallocMessageBuilder send_msg;
+  auto sendcan = send_msg.initRoot<cereal::Event>().initSendcan(3);
+  uint8_t dat[CANPACKET_DATA_SIZE_MAX];
+  for (int i = 0; i < CANPACKET_DATA_SIZE_MAX; i++) dat[i] = i;
+  const int sizes[3] = {64, 12, 20};
+  for (int i = 0; i < 3; i++) {
+    sendcan[i].setAddress(0x200 + i);
+    sendcan[i].setDat(kj::arrayPtr(dat, sizes[i]));
+  }
+
+  uint8_t counter = 0;
+  std::vector<uint8_t> buf(can_pack_size(3, CAN_FRAMING_V2));
+  int len = can_pack(sendcan.asReader(), buf.data(), 0, CAN_FRAMING_V2, &counter);
+  // the 64 byte frame spans two packets
+  REQUIRE(counter == 2);
+
+  auto data = frames(buf, len, CAN_FRAMING_V2);
+  capnp::MallocMessageBuilder recv_msg;
+  auto can = recv_msg.initRoot<cereal::Event>().initCan(3);
+  REQUIRE(can_unpack(data.data(), data.size(), can, 0, 0, CAN_FRAMING_V2) == 3);
+  for (int i = 0; i < 3; i++) {
+    REQUIRE(can[i].getAddress() == 0x200 + i);
+    REQUIRE(can[i].getDat() == kj::arrayPtr((const uint8_t *)dat, sizes[i]));
+  }
+}
+
+TEST_CASE("can_pack appends to an earlier transfer") {
+  const int framing = GENERATE(CAN_FRAMING_V1, CAN_FRAMING_V2);
+  capnp::MallocMessageBuilder first_msg, second_msg;
+  build_sendcan(first_msg, 7);
+  build_sendcan(second_msg, 11);
+  auto first = first_msg.getRoot<cereal::Event>().asReader().getSendcan();
+  auto second = second_msg.getRoot<cereal::Event>().asReader().getSendcan();
+
+  uint8_t counter = 0;
+  std::vector<uint8_t> buf(can_pack_size(7 + 11, framing));
+  int len = can_pack(first, buf.data(), 0, framing, &counter);
+  len = can_pack(second, buf.data(), 0, framing, &counter, len);
+  REQUIRE(len <= buf.size());
+
+  // one stream, as if it were one list
+  auto data = frames(buf, len, framing);
+  REQUIRE(can_count(data.data(), data.size(), framing) == 7 + 11);
+  capnp::MallocMessageBuilder recv_msg;
+  auto can = recv_msg.initRoot<cereal::Event>().initCan(7 + 11);
+  can_unpack(data.data(), data.size(), can, 0, 0, framing);
+  for (int i = 0; i < 11; i++) {
+    REQUIRE(can[7 + i].getAddress() == second[i].getAddress());
+    REQUIRE(can[7 + i].getDat() == second[i].getDat());
+  }
+}
+
+TEST_CASE("v2 framing resyncs after a lost packet") {
+  capnp::MallocMessageBuilder send_msg;
+  build_sendcan(send_msg, 40);
+  auto sendcan = send_msg.getRoot<cereal::Event>().asReader().getSendcan();
+
+  uint8_t counter = 0;
+  std::vector<uint8_t> buf(can_pack_size(40, CAN_FRAMING_V2));
+  int len = can_pack(sendcan, buf.data(), 0, CAN_FRAMING_V2, &counter);
+  REQUIRE(len > 3 * USBPACKET_MAX_SIZE);
+
+  // drop the second packet
+  std::vector<uint8_t> out;
+  out.reserve(len + CANPACKET_MAX_SIZE);
+  CanStream stream;
+  REQUIRE(stream.parse(buf.data(), USBPACKET_MAX_SIZE, out) == 0);
+  REQUIRE(stream.parse(&buf[2 * USBPACKET_MAX_SIZE], len - 2 * USBPACKET_MAX_SIZE, out) == 1);
+
+  // what's left decodes, and ends on the last message
+  int count = can_count(out.data(), out.size(), CAN_FRAMING_V2);
+  REQUIRE(count < 40);
+  capnp::MallocMessageBuilder recv_msg;
+  auto can = recv_msg.initRoot<cereal::Event>().initCan(count);
+  can_unpack(out.data(), out.size(), can, 0, 0, CAN_FRAMING_V2);
+  REQUIRE(can[count - 1].getAddress() == sendcan[39].getAddress());
+  REQUIRE(can[count - 1].getDat() == sendcan[39].getDat());
+}
+
+TEST_CASE("v2 packets from the panda carry receive times") {
+  // five 8 byte frames, the last split across the packets, then a 1 byte frame
+  const int frame_len = CANPACKET_HEAD_SIZE + 8;
+  uint8_t packets[2 * USBPACKET_MAX_SIZE] = {};
+  uint8_t *frames_in = &packets[USBPACKET_IN_HEAD_SIZE];
+  uint32_t ts[2] = {1000, 2000};
+  packets[0] = 0;
+  packets[1] = USBPACKET_IN_HEAD_SIZE;
+  memcpy(&packets[2], &ts[0], sizeof(ts[0]));
+  for (int i = 0; i < 5; i++) frames_in[i * frame_len] = 8 << 4;
+
+  const int split = USBPACKET_MAX_SIZE - USBPACKET_IN_HEAD_SIZE - 4 * frame_len;
+  uint8_t *second = &packets[USBPACKET_MAX_SIZE];
+  const int last = USBPACKET_IN_HEAD_SIZE + frame_len - split;
+  second[0] = 1;
+  second[1] = last;
+  memcpy(&second[2], &ts[1], sizeof(ts[1]));
+  second[last] = 1 << 4;
+  const int len = USBPACKET_MAX_SIZE + last + CANPACKET_HEAD_SIZE + 1;
+
+  std::vector<uint8_t> out;
+  std::vector<uint32_t> out_ts;
+  out.reserve(len + CANPACKET_MAX_SIZE);
+  CanStream stream(USBPACKET_IN_HEAD_SIZE);
+  REQUIRE(stream.parse(packets, len, out, &out_ts) == 0);
+  REQUIRE(can_count(out.data(), out.size(), CAN_FRAMING_V2) == 6);
+  // the split frame was received with the first packet's
+  REQUIRE(out_ts == std::vector<uint32_t>{1000, 1000, 1000, 1000, 1000, 2000});
+
+  const uint64_t rx_times[6] = {5, 0, 0, 0, 0, 7};
+  capnp::MallocMessageBuilder recv_msg;
+  auto can = recv_msg.initRoot<cereal::Event>().initCan(6);
+  can_unpack(out.data(), out.size(), can, 0, 0, CAN_FRAMING_V2, rx_times);
+  REQUIRE(can[0].getRxTime() == 5);
+  REQUIRE(can[1].getRxTime() == 0);
+  REQUIRE(can[5].getRxTime() == 7);
+  REQUIRE(can[5].getDat().size() == 1);
+}
+
+TEST_CASE("can_pack and can_unpack with a bus offset") {
+  capnp::MallocMessageBuilder send_msg;
+  auto sendcan = send_msg.initRoot<cereal::Event>().initSendcan(PANDA_BUS_CNT * 2);
+  for (int i = 0; i < PANDA_BUS_CNT * 2; i++) {
+    sendcan[i].setAddress(0x100 + i);
+    sendcan[i].setSrc(i);
+  }
+
+  // the second panda only sends what's on its buses
+  std::vector<uint8_t> buf(can_pack_size(PANDA_BUS_CNT * 2));
+  int len = can_pack(sendcan.asReader(), buf.data(), PANDA_BUS_CNT);
+  REQUIRE(len == PANDA_BUS_CNT * 0x10);
+  const uint32_t *msgs = (const uint32_t *)buf.data();
+  for (int i = 0; i < PANDA_BUS_CNT; i++) {
+    REQUIRE(((msgs[i*4+1] >> 4) & 0xff) == i);
+  }
+
+  // and its CAN comes back on them, after the first panda's
+  capnp::MallocMessageBuilder recv_msg;
+  auto can = recv_msg.initRoot<cereal::Event>().initCan(PANDA_BUS_CNT * 2);
+  can_unpack(buf.data(), len, can, PANDA_BUS_CNT, PANDA_BUS_CNT);
+  for (int i = PANDA_BUS_CNT; i < PANDA_BUS_CNT * 2; i++) {
+    REQUIRE(can[i].getAddress() == 0x100 + i);
+    REQUIRE(can[i].getSrc() == i);
+  }
+}
+
+TEST_CASE("CAN is packed and unpacked without allocating") {
+  capnp::MallocMessageBuilder send_msg;
+  build_sendcan(send_msg, BATCH);
+  auto sendcan = send_msg.getRoot<cereal::Event>().asReader().getSendcan();
+
+  // what boardd keeps between cycles
+  std::vector<uint8_t> buf(can_pack_size(BATCH));
+  const size_t words = can_event_size(BATCH, BATCH * 0x10) / sizeof(capnp::word);
+  auto segment = kj::heapArray<capnp::word>(words);
+  memset(segment.begin(), 0, words * sizeof(capnp::word));
+
+  bool one_segment = true;
+  allocs = 0;
+  counting = true;
+  // one second of cycles
+  for (int cycle = 0; cycle < 100; cycle++) {
+    int len = can_pack(sendcan, buf.data());
+
+    capnp::MallocMessageBuilder msg(segment);
+    auto event = msg.initRoot<cereal::Event>();
+    can_unpack(buf.data(), len, event.initCan(can_count(buf.data(), len)));
+    one_segment = one_segment && msg.getSegmentsForOutput().size() == 1;
+  }
+  counting = false;
+
+  REQUIRE(one_segment);
+#ifdef __GLIBC__
+  REQUIRE(allocs == 0);
+#endif
+}
@@ -1,8 +1,18 @@
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <vector>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sched.h>
+#ifndef __APPLE__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #if defined(QCOM) && !defined(QCOM_REPLAY)
 #include "cameras/camera_qcom.h"
@@ -15,12 +25,16 @@
 #endif
 
 #include "camera_common.h"
+#include "raw_capture.h"
 #include <libyuv.h>
 #include <jpeglib.h>
 
 #include "clutil.h"
 #include "common/params.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/trace.h"
+#include "common/alloc_tracker.h"
 #include "common/util.h"
 #include "imgproc/utils.h"
 
@@ -41,6 +55,7 @@ static cl_program build_debayer_program(cl_device_id device_id, cl_context conte
            b->rgb_width, b->rgb_height, b->rgb_stride,
            ci->bayer_flip, ci->hdr);
 #ifdef QCOM2
+  snprintf(args + strlen(args), sizeof(args) - strlen(args), " -DDEBAYER_LOCAL_WORKSIZE=%d", DEBAYER_LOCAL_WORKSIZE);
   return cl_program_from_file(context, device_id, "cameras/real_debayer.cl", args);
 #else
   return cl_program_from_file(context, device_id, "cameras/debayer.cl", args);
@@ -51,11 +66,15 @@ void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s,
   vipc_server = v;
   this->rgb_type = rgb_type;
   this->yuv_type = yuv_type;
+  this->yuv_half_type = (VisionStreamType)(VISION_STREAM_YUV_BACK_HALF + (yuv_type - VISION_STREAM_YUV_BACK));
+  this->yuv_quarter_type = (VisionStreamType)(VISION_STREAM_YUV_BACK_QUARTER + (yuv_type - VISION_STREAM_YUV_BACK));
+  this->yuv_venus_type = (VisionStreamType)(VISION_STREAM_YUV_BACK_VENUS + (yuv_type - VISION_STREAM_YUV_BACK));
   this->release_callback = release_callback;
 
   const CameraInfo *ci = &s->ci;
   camera_state = s;
   frame_buf_count = frame_cnt;
+  assert(frame_buf_count <= FRAME_QUEUE_SIZE);
 
   // RAW frame
   const int frame_size = ci->frame_height * ci->frame_stride;
@@ -86,24 +105,55 @@ void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s,
   }};
   yuv_transform = ci->bayer ? transform_scale_buffer(transform, db_s) : transform;
 
-  vipc_server->create_buffers(rgb_type, UI_BUF_COUNT, true, rgb_width, rgb_height);
+  vipc_server->create_buffers(rgb_type, UI_BUF_COUNT, true, rgb_width, rgb_height, UI_BUF_MAX_COUNT);
   rgb_stride = vipc_server->get_buffer(rgb_type)->stride;
 
-  vipc_server->create_buffers(yuv_type, YUV_COUNT, false, rgb_width, rgb_height);
+  vipc_server->create_buffers(yuv_type, YUV_COUNT, false, rgb_width, rgb_height, YUV_MAX_COUNT);
+
+  // Downscaled streams, so consumers that need less resolution don't have to resample on the cpu
+  vipc_server->create_buffers(yuv_half_type, YUV_COUNT, false, YUV_PYRAMID_HALF(rgb_width), YUV_PYRAMID_HALF(rgb_height), YUV_MAX_COUNT);
+  vipc_server->create_buffers(yuv_quarter_type, YUV_COUNT, false, YUV_PYRAMID_QUARTER(rgb_width), YUV_PYRAMID_QUARTER(rgb_height), YUV_MAX_COUNT);
+
+#if defined(QCOM) || defined(QCOM2)
+  // The encoder reads these ion buffers in place, so loggerd doesn't convert every frame on the cpu
+  venus = true;
+  vipc_server->create_buffers(visionipc_stream_name(yuv_venus_type), VENUS_YUV_COUNT, VISIONBUF_FORMAT_NV12_VENUS, rgb_width, rgb_height);
+#endif
 
   if (ci->bayer) {
     cl_program prg_debayer = build_debayer_program(device_id, context, ci, this);
+#ifdef QCOM2
+    krnl_debayer = CL_CHECK_ERR(clCreateKernel(prg_debayer, "debayer10_yuv", &err));
+    ae_hist_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(ae_hist), NULL, &err));
+#else
     krnl_debayer = CL_CHECK_ERR(clCreateKernel(prg_debayer, "debayer10", &err));
+#endif
     CL_CHECK(clReleaseProgram(prg_debayer));
   }
 
   rgb_to_yuv_init(&rgb_to_yuv_state, context, device_id, rgb_width, rgb_height, rgb_stride);
+  yuv_pyramid_init(&yuv_pyramid_state, context, device_id, rgb_width, rgb_height);
+  if (venus) {
+    const VisionBuf *venus_buf = vipc_server->get_buffer(yuv_venus_type);
+    venus_nv12_init(&venus_nv12_state, context, device_id, rgb_width, rgb_height, venus_buf->stride, venus_buf->u - venus_buf->y);
+  }
+
+  if (env_model_tensor && yuv_type == VISION_STREAM_YUV_BACK) {
+    model_tensor = true;
+    frame_init(&model_frame, DRIVING_MODEL_WIDTH, DRIVING_MODEL_HEIGHT, device_id, context);
+    vipc_server->create_buffers(MODEL_TENSOR_STREAM, UI_BUF_COUNT, VISIONBUF_FORMAT_FLOAT,
+                                DRIVING_MODEL_WIDTH / 2, DRIVING_MODEL_HEIGHT / 2, 6, UI_BUF_MAX_COUNT);
+    calib_sm = std::make_unique<SubMaster>(std::initializer_list<const char *>{"liveCalibration"});
+  }
 
 #ifdef __APPLE__
-  q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+  q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, CL_QUEUE_PROFILING_ENABLE, &err));
+  yuv_q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
 #else
+  const cl_queue_properties q_props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
   const cl_queue_properties props[] = {0};  //CL_QUEUE_PRIORITY_KHR, CL_QUEUE_PRIORITY_HIGH_KHR, 0};
-  q = CL_CHECK_ERR(clCreateCommandQueueWithProperties(context, device_id, props, &err));
+  q = CL_CHECK_ERR(clCreateCommandQueueWithProperties(context, device_id, q_props, &err));
+  yuv_q = CL_CHECK_ERR(clCreateCommandQueueWithProperties(context, device_id, props, &err));
 #endif
 }
 
@@ -113,22 +163,93 @@ CameraBuf::~CameraBuf() {
   }
 
   rgb_to_yuv_destroy(&rgb_to_yuv_state);
+  yuv_pyramid_destroy(&yuv_pyramid_state);
+  if (venus) {
+    venus_nv12_destroy(&venus_nv12_state);
+  }
+  if (model_tensor) {
+    frame_free(&model_frame);
+  }
 
   if (krnl_debayer) {
     CL_CHECK(clReleaseKernel(krnl_debayer));
   }
+  if (ae_hist_cl) {
+    CL_CHECK(clReleaseMemObject(ae_hist_cl));
+  }
+  if (debayer_profile_event) {
+    CL_CHECK(clReleaseEvent(debayer_profile_event));
+  }
+  CL_CHECK(clReleaseCommandQueue(yuv_q));
   CL_CHECK(clReleaseCommandQueue(q));
 }
 
-bool CameraBuf::acquire() {
-  {
-    std::unique_lock<std::mutex> lk(frame_queue_mutex);
-    bool got_frame = frame_queue_cv.wait_for(lk, std::chrono::milliseconds(1), [this]{ return !frame_queue.empty(); });
-    if (!got_frame) return false;
+// the processing threads check do_exit this often without frames
+#define FRAME_WAIT_MS 20
+// a debayer waiting longer than this on the gpu is logged, the other processes' contexts are
+// below camerad's so they shouldn't hold it up for more than a kernel
+#define GPU_QUEUE_WAIT_WARN_US 5000
+
+static void futex_wake(std::atomic<uint32_t> *word) {
+#ifndef __APPLE__
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+static void futex_wait(std::atomic<uint32_t> *word, uint32_t val, int timeout_ms) {
+  const struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+#ifndef __APPLE__
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+#else
+  // polled, the frames come at most every ms
+  struct timespec poll_ts = {0, 1000000L};
+  for (int i = 0; i < timeout_ms && *word == val; i++) nanosleep(&poll_ts, NULL);
+#endif
+}
 
-    cur_buf_idx = frame_queue.front();
-    frame_queue.pop();
+uint32_t CameraBuf::take_gpu_queue_wait() {
+  cl_int status = CL_QUEUED;
+  if (!debayer_profile_event) return 0;
+  CL_CHECK(clGetEventInfo(debayer_profile_event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL));
+  // done long before the next frame, never waited on
+  if (status != CL_COMPLETE) return 0;
+
+  cl_ulong submitted = 0, started = 0;
+  CL_CHECK(clGetEventProfilingInfo(debayer_profile_event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submitted), &submitted, NULL));
+  CL_CHECK(clGetEventProfilingInfo(debayer_profile_event, CL_PROFILING_COMMAND_START, sizeof(started), &started, NULL));
+  CL_CHECK(clReleaseEvent(debayer_profile_event));
+  debayer_profile_event = nullptr;
+
+  const uint32_t wait_us = started > submitted ? (started - submitted) / 1000 : 0;
+  if ((wait_us > GPU_QUEUE_WAIT_WARN_US) != gpu_queue_wait_over) {
+    gpu_queue_wait_over = !gpu_queue_wait_over;
+    if (gpu_queue_wait_over) {
+      LOGW("stream %d debayer waited %u us on the gpu", yuv_type, wait_us);
+    } else {
+      LOGW("stream %d debayer waits on the gpu less than %d us again", yuv_type, GPU_QUEUE_WAIT_WARN_US);
+    }
   }
+  return wait_us;
+}
+
+void CameraBuf::profile_debayer(cl_event event) {
+  if (debayer_profile_event) {
+    CL_CHECK(clReleaseEvent(debayer_profile_event));
+  }
+  CL_CHECK(clRetainEvent(event));
+  debayer_profile_event = event;
+}
+
+bool CameraBuf::acquire() {
+  const uint32_t head = frame_queue_head.load(std::memory_order_relaxed);
+  if (frame_queue_tail.load(std::memory_order_acquire) == head) {
+    // sleeps only while the tail is still head, so a frame queued in between isn't missed
+    futex_wait(&frame_queue_tail, head, FRAME_WAIT_MS);
+    if (frame_queue_tail.load(std::memory_order_acquire) == head) return false;
+  }
+  TRACE_SCOPE("CameraBuf::acquire");
+  cur_buf_idx = frame_queue[head % FRAME_QUEUE_SIZE];
+  frame_queue_head.store(head + 1, std::memory_order_release);
 
   const FrameMetadata &frame_data = camera_bufs_metadata[cur_buf_idx];
   if (frame_data.frame_id == -1) {
@@ -137,22 +258,63 @@ bool CameraBuf::acquire() {
   }
 
   cur_frame_data = frame_data;
+  cur_frame_data.timestamp_acquired = nanos_since_boot();
+  cur_frame_data.gpu_queue_wait_us = take_gpu_queue_wait();
+
+  VisionIpcBufExtra extra = {
+                        frame_data.frame_id,
+                        frame_data.timestamp_sof,
+                        frame_data.timestamp_eof,
+  };
 
+  cur_yuv_buf = vipc_server->get_buffer(yuv_type);
+  yuv_metas[cur_yuv_buf->idx] = frame_data;
+  cl_event yuv_event;
+  cl_mem camrabuf_cl = camera_bufs[cur_buf_idx].buf_cl;
+#ifdef QCOM2
+  assert(camera_state->ci.bayer);
+  // The debayer writes the yuv itself, the rgb frame only when something reads it
+  const bool write_rgb = vipc_server->has_clients(rgb_type) || env_send_front || env_send_rear || env_send_wide;
+  cur_rgb_buf = write_rgb ? vipc_server->get_buffer(rgb_type) : nullptr;
+  cl_mem rgb_cl = write_rgb ? cur_rgb_buf->buf_cl : nullptr;
+  const int write_rgb_arg = write_rgb;
+
+  ae_region_cur = ae_region_next;
+  const cl_int4 ae_rect = {{ae_region_cur.x_start, ae_region_cur.y_start, ae_region_cur.x_end, ae_region_cur.y_end}};
+  const cl_int2 ae_skip = {{std::max(ae_region_cur.x_skip, 1), std::max(ae_region_cur.y_skip, 1)}};
+  const cl_uint zero = 0;
+  CL_CHECK(clEnqueueFillBuffer(q, ae_hist_cl, &zero, sizeof(zero), 0, sizeof(ae_hist), 0, NULL, NULL));
+
+  constexpr int localMemSize = (DEBAYER_LOCAL_WORKSIZE + 2 * (3 / 2)) * (DEBAYER_LOCAL_WORKSIZE + 2 * (3 / 2)) * sizeof(float);
+  const size_t globalWorkSize[] = {size_t(camera_state->ci.frame_width), size_t(camera_state->ci.frame_height)};
+  const size_t localWorkSize[] = {DEBAYER_LOCAL_WORKSIZE, DEBAYER_LOCAL_WORKSIZE};
+  CL_CHECK(clSetKernelArg(krnl_debayer, 0, sizeof(cl_mem), &camrabuf_cl));
+  CL_CHECK(clSetKernelArg(krnl_debayer, 1, sizeof(cl_mem), &rgb_cl));
+  CL_CHECK(clSetKernelArg(krnl_debayer, 2, localMemSize, 0));
+  CL_CHECK(clSetKernelArg(krnl_debayer, 3, sizeof(cl_mem), &cur_yuv_buf->buf_cl));
+  CL_CHECK(clSetKernelArg(krnl_debayer, 4, sizeof(int), &write_rgb_arg));
+  CL_CHECK(clSetKernelArg(krnl_debayer, 5, sizeof(cl_mem), &ae_hist_cl));
+  CL_CHECK(clSetKernelArg(krnl_debayer, 6, sizeof(cl_int4), &ae_rect));
+  CL_CHECK(clSetKernelArg(krnl_debayer, 7, sizeof(cl_int2), &ae_skip));
+  CL_CHECK(clEnqueueNDRangeKernel(q, krnl_debayer, 2, NULL, globalWorkSize, localWorkSize,
+                                  0, 0, &yuv_event));
+  profile_debayer(yuv_event);
+  CL_CHECK(clEnqueueReadBuffer(q, ae_hist_cl, CL_FALSE, 0, sizeof(ae_hist), ae_hist, 0, NULL, &ae_hist_event));
+  CL_CHECK(clFlush(q));
+
+  // The pyramid and the model tensor wait for the debayer on yuv_q, like the conversion below
+  CL_CHECK(clEnqueueBarrierWithWaitList(yuv_q, 1, &yuv_event, NULL));
+  if (write_rgb) {
+    CL_CHECK(clRetainEvent(yuv_event));
+    vipc_server->send(cur_rgb_buf, &extra, true, yuv_event);
+  }
+#else
   cur_rgb_buf = vipc_server->get_buffer(rgb_type);
 
   cl_event debayer_event;
-  cl_mem camrabuf_cl = camera_bufs[cur_buf_idx].buf_cl;
   if (camera_state->ci.bayer) {
     CL_CHECK(clSetKernelArg(krnl_debayer, 0, sizeof(cl_mem), &camrabuf_cl));
     CL_CHECK(clSetKernelArg(krnl_debayer, 1, sizeof(cl_mem), &cur_rgb_buf->buf_cl));
-#ifdef QCOM2
-    constexpr int localMemSize = (DEBAYER_LOCAL_WORKSIZE + 2 * (3 / 2)) * (DEBAYER_LOCAL_WORKSIZE + 2 * (3 / 2)) * sizeof(float);
-    const size_t globalWorkSize[] = {size_t(camera_state->ci.frame_width), size_t(camera_state->ci.frame_height)};
-    const size_t localWorkSize[] = {DEBAYER_LOCAL_WORKSIZE, DEBAYER_LOCAL_WORKSIZE};
-    CL_CHECK(clSetKernelArg(krnl_debayer, 2, localMemSize, 0));
-    CL_CHECK(clEnqueueNDRangeKernel(q, krnl_debayer, 2, NULL, globalWorkSize, localWorkSize,
-                                    0, 0, &debayer_event));
-#else
     float digital_gain = camera_state->digital_gain;
     if ((int)digital_gain == 0) {
       digital_gain = 1.0;
@@ -161,43 +323,113 @@ bool CameraBuf::acquire() {
     const size_t debayer_work_size = rgb_height;  // doesn't divide evenly, is this okay?
     CL_CHECK(clEnqueueNDRangeKernel(q, krnl_debayer, 1, NULL,
                                     &debayer_work_size, NULL, 0, 0, &debayer_event));
-#endif
   } else {
     assert(rgb_stride == camera_state->ci.frame_stride);
     CL_CHECK(clEnqueueCopyBuffer(q, camrabuf_cl, cur_rgb_buf->buf_cl, 0, 0,
                                cur_rgb_buf->len, 0, 0, &debayer_event));
   }
+  profile_debayer(debayer_event);
 
-  clWaitForEvents(1, &debayer_event);
-  CL_CHECK(clReleaseEvent(debayer_event));
+  CL_CHECK(clFlush(q));
 
-  cur_yuv_buf = vipc_server->get_buffer(yuv_type);
-  yuv_metas[cur_yuv_buf->idx] = frame_data;
-  rgb_to_yuv_queue(&rgb_to_yuv_state, q, cur_rgb_buf->buf_cl, cur_yuv_buf->buf_cl);
+  // Nothing waits on the cpu. The conversion waits for the debayer on the gpu, on yuv_q, which is
+  // in order, so frame N's conversion can run while frame N+1 is debayered on q. Each buffer is
+  // sent with the event of the kernel that writes it and the vipc server marks it ready once
+  // that completes
+  CL_CHECK(clEnqueueBarrierWithWaitList(yuv_q, 1, &debayer_event, NULL));
+  rgb_to_yuv_queue(&rgb_to_yuv_state, yuv_q, cur_rgb_buf->buf_cl, cur_yuv_buf->buf_cl, &yuv_event);
+  vipc_server->send(cur_rgb_buf, &extra, true, debayer_event);
+#endif
 
-  VisionIpcBufExtra extra = {
-                        frame_data.frame_id,
-                        frame_data.timestamp_sof,
-                        frame_data.timestamp_eof,
-  };
-  vipc_server->send(cur_rgb_buf, &extra);
-  vipc_server->send(cur_yuv_buf, &extra);
+  cur_yuv_half_buf = vipc_server->get_buffer(yuv_half_type);
+  cur_yuv_quarter_buf = vipc_server->get_buffer(yuv_quarter_type);
+  cl_event pyramid_event;
+  yuv_pyramid_queue(&yuv_pyramid_state, yuv_q, cur_yuv_buf->buf_cl, cur_yuv_half_buf->buf_cl, cur_yuv_quarter_buf->buf_cl, &pyramid_event);
+  cl_event venus_event = nullptr;
+  cur_yuv_venus_buf = venus && vipc_server->has_clients(yuv_venus_type) ? vipc_server->get_buffer(yuv_venus_type) : nullptr;
+  if (cur_yuv_venus_buf) {
+    venus_nv12_queue(&venus_nv12_state, yuv_q, cur_yuv_buf->buf_cl, cur_yuv_venus_buf->buf_cl, &venus_event);
+  }
+  CL_CHECK(clFlush(yuv_q));
+
+  vipc_server->send(cur_yuv_buf, &extra, true, yuv_event);
+  cur_frame_data.timestamp_sent = extra.timestamp_sent;
+  CL_CHECK(clRetainEvent(pyramid_event));
+  vipc_server->send(cur_yuv_half_buf, &extra, true, pyramid_event);
+  vipc_server->send(cur_yuv_quarter_buf, &extra, true, pyramid_event);
+  if (cur_yuv_venus_buf) {
+    vipc_server->send(cur_yuv_venus_buf, &extra, true, venus_event);
+  }
+
+  if (model_tensor) {
+    prepare_model_tensor(extra);
+  }
 
   return true;
 }
 
+void CameraBuf::prepare_model_tensor(const VisionIpcBufExtra &extra) {
+  TRACE_SCOPE("CameraBuf::prepare_model_tensor");
+  if (calib_sm->update(0) > 0) {
+    auto extrinsic_matrix = (*calib_sm)["liveCalibration"].getLiveCalibration().getExtrinsicMatrix();
+    float extrinsic[3*4];
+    for (int i = 0; i < 4*3; i++) {
+      extrinsic[i] = extrinsic_matrix[i];
+    }
+    model_transform = matmul3(yuv_transform, model_transform_from_calibration(extrinsic));
+    calibrated = true;
+  }
+
+  // modeld doesn't run before it has a calibration either
+  if (!calibrated) return;
+
+  VisionBuf *tensor_buf = vipc_server->get_buffer(MODEL_TENSOR_STREAM);
+  frame_queue(&model_frame, yuv_q, cur_yuv_buf->buf_cl, rgb_width, rgb_height, model_transform, tensor_buf->buf_cl);
+  cl_event tensor_event;
+  CL_CHECK(clEnqueueMarkerWithWaitList(yuv_q, 0, NULL, &tensor_event));
+  CL_CHECK(clFlush(yuv_q));
+
+  VisionIpcBufExtra tensor_extra = extra;
+  vipc_server->send(tensor_buf, &tensor_extra, true, tensor_event);
+}
+
+void CameraBuf::wait() const {
+  // For the camera specific processing that reads the frame on the cpu
+  if (cur_rgb_buf) vipc_server->wait(cur_rgb_buf);
+  vipc_server->wait(cur_yuv_buf);
+}
+
 void CameraBuf::release() {
+  // The debayer kernel has to be done reading the camera buffer before it goes back to the sensor.
+  // Without an rgb frame the debayer is the kernel that wrote the yuv
+  vipc_server->wait(cur_rgb_buf ? cur_rgb_buf : cur_yuv_buf);
+  if (ae_hist_event) {
+    CL_CHECK(clWaitForEvents(1, &ae_hist_event));
+    CL_CHECK(clReleaseEvent(ae_hist_event));
+    ae_hist_event = nullptr;
+  }
   if (release_callback){
     release_callback((void*)camera_state, cur_buf_idx);
   }
 }
 
+const uint32_t *CameraBuf::exposure_histogram(const ExposureRegion &region) {
+  ae_region_next = region;
+  if (ae_hist_event == nullptr || !(ae_region_cur == region)) return nullptr;
+
+  CL_CHECK(clWaitForEvents(1, &ae_hist_event));
+  return ae_hist;
+}
+
 void CameraBuf::queue(size_t buf_idx){
-  {
-    std::lock_guard<std::mutex> lk(frame_queue_mutex);
-    frame_queue.push(buf_idx);
+  const uint32_t tail = frame_queue_tail.load(std::memory_order_relaxed);
+  if (tail - frame_queue_head.load(std::memory_order_acquire) >= FRAME_QUEUE_SIZE) {
+    LOGW("%s frame queue full, dropped a frame (%lu total)", visionipc_stream_name(yuv_type), (unsigned long)++frame_queue_overruns);
+    return;
   }
-  frame_queue_cv.notify_one();
+  frame_queue[tail % FRAME_QUEUE_SIZE] = buf_idx;
+  frame_queue_tail.store(tail + 1, std::memory_order_release);
+  futex_wake(&frame_queue_tail);
 }
 
 // common functions
@@ -213,10 +445,14 @@ void fill_frame_data(cereal::FrameData::Builder &framed, const FrameMetadata &fr
   framed.setLensErr(frame_data.lens_err);
   framed.setLensTruePos(frame_data.lens_true_pos);
   framed.setGainFrac(frame_data.gain_frac);
+  framed.setTimestampAcquired(frame_data.timestamp_acquired);
+  framed.setTimestampSent(frame_data.timestamp_sent);
+  framed.setGpuQueueWait(frame_data.gpu_queue_wait_us);
 }
 
 void fill_frame_image(cereal::FrameData::Builder &framed, const CameraBuf *b) {
   assert(b->cur_rgb_buf);
+  b->wait();
   const uint8_t *dat = (const uint8_t *)b->cur_rgb_buf->addr;
   int scale = env_scale;
   int x_min = env_xmin; int y_min = env_ymin; int x_max = b->rgb_width-1; int y_max = b->rgb_height-1;
@@ -224,91 +460,198 @@ void fill_frame_image(cereal::FrameData::Builder &framed, const CameraBuf *b) {
   if (env_ymax != -1) y_max = env_ymax;
   int new_width = (x_max - x_min + 1) / scale;
   int new_height = (y_max - y_min + 1) / scale;
-  uint8_t *resized_dat = new uint8_t[new_width*new_height*3];
 
+  // straight into the message, a row at a time when not scaled
+  auto image = framed.initImage((size_t)new_width*new_height*3);
+  uint8_t *resized_dat = image.begin();
   int goff = x_min*3 + y_min*b->rgb_stride;
   for (int r=0;r<new_height;r++) {
+    const uint8_t *src = &dat[goff+r*b->rgb_stride*scale];
+    uint8_t *dst = &resized_dat[r*new_width*3];
+    if (scale == 1) {
+      memcpy(dst, src, new_width*3);
+      continue;
+    }
     for (int c=0;c<new_width;c++) {
-      memcpy(&resized_dat[(r*new_width+c)*3], &dat[goff+r*b->rgb_stride*scale+c*3*scale], 3*sizeof(uint8_t));
+      dst[c*3+0] = src[c*3*scale+0];
+      dst[c*3+1] = src[c*3*scale+1];
+      dst[c*3+2] = src[c*3*scale+2];
     }
   }
-  framed.setImage(kj::arrayPtr((const uint8_t*)resized_dat, (size_t)new_width*new_height*3));
-  delete[] resized_dat;
 }
 
-static void create_thumbnail(MultiCameraState *s, const CameraBuf *b) {
-  uint8_t* thumbnail_buffer = NULL;
-  unsigned long thumbnail_len = 0;
+void FrameBundler::add(int camera, VisionStreamType stream, const FrameMetadata &frame_data) {
+  auto glass = [](const FrameMetadata &f) { return f.timestamp_sof ? f.timestamp_sof : f.timestamp_eof; };
 
-  unsigned char *row = (unsigned char *)malloc(b->rgb_width/4*3);
+  std::lock_guard<std::mutex> lk(lock);
+  pending[camera] = {true, stream, frame_data};
+
+  uint64_t newest = 0, oldest = UINT64_MAX;
+  for (auto &p : pending) {
+    if (!p.valid) return;
+    newest = std::max(newest, glass(p.frame_data));
+    oldest = std::min(oldest, glass(p.frame_data));
+  }
+  // a camera behind the others waits for its next frame
+  if (newest - oldest > FRAME_BUNDLE_TOLERANCE_NS) {
+    for (auto &p : pending) {
+      if (newest - glass(p.frame_data) > FRAME_BUNDLE_TOLERANCE_NS) p.valid = false;
+    }
+    return;
+  }
 
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+  MessageBuilder msg;
+  auto bundle = msg.initEvent().initFrameBundle();
+  bundle.setSofSpread(newest - oldest);
+  auto frames = bundle.initFrames(pending.size());
+  for (int i = 0; i < pending.size(); i++) {
+    frames[i].setStream(visionipc_stream_name(pending[i].stream));
+    frames[i].setFrameId(pending[i].frame_data.frame_id);
+    frames[i].setTimestampSof(pending[i].frame_data.timestamp_sof);
+    frames[i].setTimestampEof(pending[i].frame_data.timestamp_eof);
+    pending[i].valid = false;
+  }
+  pm->send("frameBundle", msg);
+}
 
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
-  jpeg_mem_dest(&cinfo, &thumbnail_buffer, &thumbnail_len);
+// The rear thumbnails are jpegs of the quarter size yuv frame, which the gpu already makes. The
+// camera thread holds the frame's buffer and hands it to a low priority thread that encodes it,
+// the buffer is released once the jpeg is sent. A thumbnail due while one is encoding is skipped
+class ThumbnailThread {
+public:
+  ThumbnailThread(MultiCameraState *s, CameraBuf *b) : s(s), b(b) {
+    thread = std::thread(&ThumbnailThread::run, this);
+  }
 
-  cinfo.image_width = b->rgb_width / 4;
-  cinfo.image_height = b->rgb_height / 4;
-  cinfo.input_components = 3;
-  cinfo.in_color_space = JCS_RGB;
+  ~ThumbnailThread() {
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      exit = true;
+    }
+    cv.notify_one();
+    thread.join();
+  }
 
-  jpeg_set_defaults(&cinfo);
+  void push() {
+    std::lock_guard<std::mutex> lk(lock);
+    if (buf != nullptr || !b->hold(b->cur_yuv_quarter_buf)) return;
+    buf = b->cur_yuv_quarter_buf;
+    frame_data = b->cur_frame_data;
+    cv.notify_one();
+  }
+
+private:
+  void run() {
+    set_thread_name("thumbnail");
+    // camerad is realtime, this shouldn't compete with the camera threads
+    set_sched_profile("camerad", "thumbnail");
+
+    std::unique_lock<std::mutex> lk(lock);
+    while (true) {
+      cv.wait(lk, [this] { return exit || buf != nullptr; });
+      if (exit) break;
+      lk.unlock();
+
+      if (b->wait_ready(buf)) {
+        encode();
+      }
+      b->unhold(buf);
+
+      lk.lock();
+      buf = nullptr;
+    }
+    if (buf) b->unhold(buf);
+  }
+
+  void encode() {
+    // the frame is limited range bt601, jpeg is full range
+    static uint8_t y_lut[256], uv_lut[256];
+    static bool lut_init = false;
+    if (!lut_init) {
+      for (int i = 0; i < 256; i++) {
+        y_lut[i] = std::clamp((i - 16) * 255 / 219, 0, 255);
+        uv_lut[i] = std::clamp((i - 128) * 255 / 224 + 128, 0, 255);
+      }
+      lut_init = true;
+    }
+
+    uint8_t* thumbnail_buffer = NULL;
+    unsigned long thumbnail_len = 0;
+
+    const int width = buf->width, height = buf->height;
+    std::vector<uint8_t> row(width * 3);
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &thumbnail_buffer, &thumbnail_len);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+
+    jpeg_set_defaults(&cinfo);
 #ifndef __APPLE__
-  jpeg_set_quality(&cinfo, 50, true);
-  jpeg_start_compress(&cinfo, true);
+    jpeg_set_quality(&cinfo, 50, true);
+    jpeg_start_compress(&cinfo, true);
 #else
-  jpeg_set_quality(&cinfo, 50, static_cast<boolean>(true) );
-  jpeg_start_compress(&cinfo, static_cast<boolean>(true) );
+    jpeg_set_quality(&cinfo, 50, static_cast<boolean>(true) );
+    jpeg_start_compress(&cinfo, static_cast<boolean>(true) );
 #endif
 
-  JSAMPROW row_pointer[1];
-  const uint8_t *bgr_ptr = (const uint8_t *)b->cur_rgb_buf->addr;
-  for (int ii = 0; ii < b->rgb_height/4; ii+=1) {
-    for (int j = 0; j < b->rgb_width*3; j+=12) {
-      for (int k = 0; k < 3; k++) {
-        uint16_t dat = 0;
-        int i = ii * 4;
-        dat += bgr_ptr[b->rgb_stride*i + j + k];
-        dat += bgr_ptr[b->rgb_stride*i + j+3 + k];
-        dat += bgr_ptr[b->rgb_stride*(i+1) + j + k];
-        dat += bgr_ptr[b->rgb_stride*(i+1) + j+3 + k];
-        dat += bgr_ptr[b->rgb_stride*(i+2) + j + k];
-        dat += bgr_ptr[b->rgb_stride*(i+2) + j+3 + k];
-        dat += bgr_ptr[b->rgb_stride*(i+3) + j + k];
-        dat += bgr_ptr[b->rgb_stride*(i+3) + j+3 + k];
-        row[(j/4) + (2-k)] = dat/8;
+    JSAMPROW row_pointer[1] = {row.data()};
+    for (int y = 0; y < height; y++) {
+      const uint8_t *y_row = buf->y + y * width;
+      const uint8_t *u_row = buf->u + (y / 2) * (width / 2);
+      const uint8_t *v_row = buf->v + (y / 2) * (width / 2);
+      for (int x = 0; x < width; x++) {
+        row[x*3+0] = y_lut[y_row[x]];
+        row[x*3+1] = uv_lut[u_row[x / 2]];
+        row[x*3+2] = uv_lut[v_row[x / 2]];
       }
+      jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
-    row_pointer[0] = row;
-    jpeg_write_scanlines(&cinfo, row_pointer, 1);
-  }
-  jpeg_finish_compress(&cinfo);
-  jpeg_destroy_compress(&cinfo);
-  free(row);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
 
-  MessageBuilder msg;
-  auto thumbnaild = msg.initEvent().initThumbnail();
-  thumbnaild.setFrameId(b->cur_frame_data.frame_id);
-  thumbnaild.setTimestampEof(b->cur_frame_data.timestamp_eof);
-  thumbnaild.setThumbnail(kj::arrayPtr((const uint8_t*)thumbnail_buffer, thumbnail_len));
+    MessageBuilder msg;
+    auto thumbnaild = msg.initEvent().initThumbnail();
+    thumbnaild.setFrameId(frame_data.frame_id);
+    thumbnaild.setTimestampEof(frame_data.timestamp_eof);
+    thumbnaild.setThumbnail(kj::arrayPtr((const uint8_t*)thumbnail_buffer, thumbnail_len));
 
-  if (s->pm != NULL) {
-    s->pm->send("thumbnail", msg);
+    if (s->pm != NULL) {
+      s->pm->send("thumbnail", msg);
+    }
+    free(thumbnail_buffer);
   }
-  free(thumbnail_buffer);
-}
 
-void set_exposure_target(CameraState *c, const uint8_t *pix_ptr, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip) {
-  const CameraBuf *b = &c->buf;
+  MultiCameraState *s;
+  CameraBuf *b;
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable cv;
+  bool exit = false;
+  VisionBuf *buf = nullptr;
+  FrameMetadata frame_data;
+};
 
-  uint32_t lum_binning[256] = {0};
-  for (int y = y_start; y < y_end; y += y_skip) {
-    for (int x = x_start; x < x_end; x += x_skip) {
-      uint8_t lum = pix_ptr[(y * b->rgb_width) + x];
-      lum_binning[lum]++;
+void set_exposure_target(CameraState *c, const uint8_t *pix_ptr, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip) {
+  CameraBuf *b = &c->buf;
+
+  const uint32_t *lum_binning = b->exposure_histogram({x_start, x_end, x_skip, y_start, y_end, y_skip});
+  uint32_t cpu_binning[256] = {0};
+  if (lum_binning == nullptr) {
+    for (int y = y_start; y < y_end; y += y_skip) {
+      for (int x = x_start; x < x_end; x += x_skip) {
+        uint8_t lum = pix_ptr[(y * b->rgb_width) + x];
+        cpu_binning[lum]++;
+      }
     }
+    lum_binning = cpu_binning;
   }
 
   unsigned int lum_total = (y_end - y_start) * (x_end - x_start) / x_skip / y_skip;
@@ -341,15 +684,29 @@ extern ExitHandler do_exit;
 void *processing_thread(MultiCameraState *cameras, const char *tname,
                         CameraState *cs, process_thread_cb callback) {
   set_thread_name(tname);
+  std::unique_ptr<ThumbnailThread> thumbnails;
+  if (cs == &(cameras->rear)) {
+    thumbnails = std::make_unique<ThumbnailThread>(cameras, &cs->buf);
+  }
+  const char *camera_name = cs == &(cameras->rear) ? "rear" : cs == &(cameras->front) ? "front" : "wide";
+  std::unique_ptr<RawCapture> raw_capture = RawCapture::create(camera_name, cs->ci);
 
+  AllocLoop alloc_loop(tname);
   for (int cnt = 0; !do_exit; cnt++) {
+    alloc_loop.iteration();
     if (!cs->buf.acquire()) continue;
 
-    callback(cameras, cs, cnt);
+    {
+      TRACE_SCOPE("camera_process");
+      callback(cameras, cs, cnt);
+    }
 
-    if (cs == &(cameras->rear) && cnt % 100 == 3) {
-      // this takes 10ms???
-      create_thumbnail(cameras, &(cs->buf));
+    if (thumbnails && is_thumbnail_frame(cs->buf.cur_frame_data.frame_id)) {
+      thumbnails->push();
+    }
+    // copies the raw frame while the gpu still debayers it, release waits for that anyway
+    if (raw_capture) {
+      raw_capture->push(&cs->buf);
     }
     cs->buf.release();
   }
@@ -403,6 +760,7 @@ void common_camera_process_front(SubMaster *sm, PubMaster *pm, CameraState *c, i
     y_max = 1148;
     skip = 4;
 #endif
+    b->wait();
     set_exposure_target(c, (const uint8_t *)b->cur_yuv_buf->y, x_min, x_max, 2, y_min, y_max, skip);
   }
 
@@ -1,7 +1,8 @@
 #pragma once
-#include <queue>
+#include <atomic>
 #include <mutex>
-#include <condition_variable>
+#include <string>
+#include <vector>
 
 #include <stdlib.h>
 #include <stdbool.h>
@@ -15,6 +16,9 @@
 #include "imgproc/utils.h"
 #include "messaging.hpp"
 #include "transforms/rgb_to_yuv.h"
+#include "transforms/yuv_pyramid.h"
+#include "transforms/venus_nv12.h"
+#include "models/commonmodel.h"
 
 #include "visionipc.h"
 #include "visionipc_server.h"
@@ -30,8 +34,19 @@
 #define CAMERA_ID_AR0231 8
 #define CAMERA_ID_MAX 9
 
-#define UI_BUF_COUNT 4
-#define YUV_COUNT 40
+// The buffers a stream starts with and what it can grow to when its readers hold all of them, see
+// VisionIpcServer::create_buffers. The rgb and the model tensor have one reader that holds a frame
+// at a time, the ui and modeld
+#define UI_BUF_COUNT 2
+#define UI_BUF_MAX_COUNT 4
+// modeld, dmonitoringmodeld, the ui and loggerd off device each hold about one, the thumbnails one
+// quarter frame. Deep enough for readers that fall behind
+#define YUV_COUNT 4
+#define YUV_MAX_COUNT 40
+// few, the encoder gives them back as soon as it's read them. Fixed, omx registers all of them up front
+#define VENUS_YUV_COUNT 8
+// more than any camera's FRAME_BUF_COUNT, a power of 2
+#define FRAME_QUEUE_SIZE 32
 #define LOG_CAMERA_ID_FCAMERA 0
 #define LOG_CAMERA_ID_DCAMERA 1
 #define LOG_CAMERA_ID_ECAMERA 2
@@ -42,6 +57,9 @@ const bool env_send_front = getenv("SEND_FRONT") != NULL;
 const bool env_send_rear = getenv("SEND_REAR") != NULL;
 const bool env_send_wide = getenv("SEND_WIDE") != NULL;
 
+// the rear frames that get a thumbnail
+inline bool is_thumbnail_frame(uint32_t frame_id) { return frame_id % 100 == 3; }
+
 typedef void (*release_cb)(void *cookie, int buf_idx);
 
 typedef struct CameraInfo {
@@ -70,6 +88,11 @@ typedef struct FrameMetadata {
   uint32_t frame_id;
   uint64_t timestamp_sof; // only set on tici
   uint64_t timestamp_eof;
+  // when the processing thread took the frame and when its yuv went out over vipc
+  uint64_t timestamp_acquired;
+  uint64_t timestamp_sent;
+  // how long the frame before's debayer waited on the gpu, from submitted to running
+  uint32_t gpu_queue_wait_us;
   unsigned int frame_length;
   unsigned int integ_lines;
   unsigned int global_gain;
@@ -90,6 +113,16 @@ extern CameraInfo cameras_supported[CAMERA_ID_MAX];
 struct MultiCameraState;
 struct CameraState;
 
+// The pixels of the y plane that auto exposure meters, x_start + k * x_skip up to x_end
+struct ExposureRegion {
+  int x_start, x_end, x_skip;
+  int y_start, y_end, y_skip;
+  bool operator==(const ExposureRegion &o) const {
+    return x_start == o.x_start && x_end == o.x_end && x_skip == o.x_skip &&
+           y_start == o.y_start && y_end == o.y_end && y_skip == o.y_skip;
+  }
+};
+
 class CameraBuf {
 private:
   VisionIpcServer *vipc_server;
@@ -97,24 +130,60 @@ private:
   cl_kernel krnl_debayer;
 
   RGBToYUVState rgb_to_yuv_state;
+  YUVPyramidState yuv_pyramid_state;
+  VenusNV12State venus_nv12_state;
 
-  FrameMetadata yuv_metas[YUV_COUNT];
+  FrameMetadata yuv_metas[YUV_MAX_COUNT];
   VisionStreamType rgb_type, yuv_type;
+  VisionStreamType yuv_half_type, yuv_quarter_type;
+  // the hardware encoder's copy of the yuv stream, only made on the devices with one
+  bool venus = false;
+  VisionStreamType yuv_venus_type;
   
   int cur_buf_idx;
 
-  std::mutex frame_queue_mutex;
-  std::condition_variable frame_queue_cv;
-  std::queue<size_t> frame_queue;
+  // Filled frames from the sensor thread to the processing thread, a single producer single consumer
+  // ring. Tail is the futex the consumer sleeps on
+  size_t frame_queue[FRAME_QUEUE_SIZE];
+  std::atomic<uint32_t> frame_queue_head = 0, frame_queue_tail = 0;
+  std::atomic<uint64_t> frame_queue_overruns = 0;
 
   int frame_buf_count;
   release_cb release_callback;
 
+  // Driving model input for modeld, see MODEL_TENSOR_STREAM
+  bool model_tensor = false;
+  bool calibrated = false;
+  ModelFrame model_frame;
+  mat3 model_transform;
+  std::unique_ptr<SubMaster> calib_sm;
+
+  void prepare_model_tensor(const VisionIpcBufExtra &extra);
+
+  // The debayer bins the y of the region the last auto exposure update asked for, so the update
+  // after it reads 256 counters instead of walking the frame
+  cl_mem ae_hist_cl = nullptr;
+  cl_event ae_hist_event = nullptr;
+  uint32_t ae_hist[256];
+  ExposureRegion ae_region_cur = {}, ae_region_next = {};
+
+  // The last debayer, q is profiled for the time it waits behind the other processes' gpu work
+  cl_event debayer_profile_event = nullptr;
+  bool gpu_queue_wait_over = false;
+  uint32_t take_gpu_queue_wait();
+  void profile_debayer(cl_event event);
+
 public:
   cl_command_queue q;
+  // the yuv conversion runs on its own queue, so the next frame's debayer doesn't wait behind it
+  cl_command_queue yuv_q;
   FrameMetadata cur_frame_data;
   VisionBuf *cur_rgb_buf;
   VisionBuf *cur_yuv_buf;
+  VisionBuf *cur_yuv_half_buf;
+  VisionBuf *cur_yuv_quarter_buf;
+  // null when nobody reads the stream
+  VisionBuf *cur_yuv_venus_buf = nullptr;
   std::unique_ptr<VisionBuf[]> camera_bufs;
   std::unique_ptr<FrameMetadata[]> camera_bufs_metadata;
   int rgb_width, rgb_height, rgb_stride;
@@ -125,8 +194,41 @@ public:
   ~CameraBuf();
   void init(cl_device_id device_id, cl_context context, CameraState *s, VisionIpcServer * v, int frame_cnt, VisionStreamType rgb_type, VisionStreamType yuv_type, release_cb release_callback=nullptr);
   bool acquire();
+  // Waits for the gpu to finish the current rgb and yuv buffers
+  void wait() const;
   void release();
   void queue(size_t buf_idx);
+  uint32_t queue_depth() const { return frame_queue_tail - frame_queue_head; }
+  // frames dropped because the ring was full
+  uint64_t queue_overruns() const { return frame_queue_overruns; }
+  // The current frame's histogram of region, null when the gpu didn't bin this region. The
+  // following frames are binned for region
+  const uint32_t *exposure_histogram(const ExposureRegion &region);
+  // Keeps a sent buffer from being reused, for work that runs behind the camera thread
+  bool hold(VisionBuf *buf) { return vipc_server->hold(buf); }
+  void unhold(VisionBuf *buf) { vipc_server->release(buf); }
+  bool wait_ready(VisionBuf *buf) const { return vipc_server->wait(buf); }
+  // the raw sensor frame acquire took, until release
+  VisionBuf *cur_camera_buf() { return &camera_bufs[cur_buf_idx]; }
+};
+
+// Matches up the frames of the cameras by start of frame, or end of frame where there is none,
+// and publishes each matched set as a frameBundle. Called from every camera's processing thread
+#define FRAME_BUNDLE_TOLERANCE_NS (5 * 1000000ULL)
+class FrameBundler {
+public:
+  FrameBundler(PubMaster *pm, int num_cameras) : pm(pm), pending(num_cameras) {}
+  void add(int camera, VisionStreamType stream, const FrameMetadata &frame_data);
+
+private:
+  struct Pending {
+    bool valid = false;
+    VisionStreamType stream;
+    FrameMetadata frame_data;
+  };
+  std::mutex lock;
+  PubMaster *pm;
+  std::vector<Pending> pending;
 };
 
 typedef void (*process_thread_cb)(MultiCameraState *s, CameraState *c, int cnt);
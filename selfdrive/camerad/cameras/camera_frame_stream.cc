@@ -2,11 +2,17 @@
 
 #include <unistd.h>
 #include <cassert>
+#include <fstream>
 
 #include <capnp/dynamic.h>
 
 #include "messaging.hpp"
 #include "common/util.h"
+#include "common/timing.h"
+#include "common/swaglog.h"
+#ifdef FRAME_STREAM_REPLAY
+#include "FrameReader.hpp"
+#endif
 
 #define FRAME_WIDTH 1164
 #define FRAME_HEIGHT 874
@@ -51,6 +57,80 @@ void run_frame_stream(CameraState &camera, const char* frame_pkt) {
   }
 }
 
+#ifdef FRAME_STREAM_REPLAY
+
+// Decodes a logged segment straight into the camera buffers instead of taking frame messages
+// over msgq. Frames go out at their logged pace, or with fast as soon as the processing thread
+// has room. The metadata comes from the log's frame events. On a replay's simulated clock the
+// log's times are the clock's, a frame goes out at its logMonoTime and the ones already passed are dropped
+void run_replay_stream(CameraState &camera, const char *log_fn, const char *video_fn, bool fast) {
+  if (log_fn == NULL) {
+    LOGE("FRAME_STREAM_VIDEO needs its FRAME_STREAM_LOG");
+    return;
+  }
+  std::ifstream f(log_fn, std::ios::binary | std::ios::ate);
+  if (!f) {
+    LOGE("can't read %s", log_fn);
+    return;
+  }
+  size_t size = f.tellg();
+  auto words = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  f.seekg(0);
+  f.read((char *)words.begin(), words.size() * sizeof(capnp::word));
+
+  FrameReader fr(video_fn);
+  fr.waitForReady();
+  assert(fr.getWidth() == camera.ci.frame_width && fr.getHeight() == camera.ci.frame_height);
+
+  const bool simulated = simulated_clock() != NULL;
+  int frame_idx = 0;
+  size_t buf_idx = 0;
+  uint64_t log_start = 0, start = 0;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (!do_exit && remaining.size() > 0 && frame_idx < fr.getFrameCount()) {
+    capnp::FlatArrayMessageReader reader(remaining);
+    remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+    auto event = reader.getRoot<cereal::Event>();
+    if (event.which() != cereal::Event::FRAME) continue;
+    if (simulated && !fast && event.getLogMonoTime() < nanos_since_boot()) {
+      fr.release(frame_idx++);
+      continue;
+    }
+
+    // decoded ahead of the wait so the decode doesn't eat into the pacing
+    uint8_t *rgb = fr.get(frame_idx);
+    if (fast) {
+      while (!do_exit && camera.buf.queue_depth() >= FRAME_BUF_COUNT/2) util::sleep_for(1);
+    } else if (simulated) {
+      sleep_until_nanos_since_boot(event.getLogMonoTime());
+    } else if (log_start == 0) {
+      log_start = event.getLogMonoTime();
+      start = nanos_since_boot();
+    } else {
+      int64_t wait_ns = (int64_t)(start + (event.getLogMonoTime() - log_start)) - (int64_t)nanos_since_boot();
+      if (wait_ns > 0) util::sleep_for(wait_ns / 1000000);
+    }
+
+    auto frame = event.getFrame();
+    camera.buf.camera_bufs_metadata[buf_idx] = {
+      .frame_id = frame.getFrameId(),
+      .timestamp_eof = frame.getTimestampEof(),
+      .frame_length = frame.getFrameLength(),
+      .integ_lines = frame.getIntegLines(),
+      .global_gain = frame.getGlobalGain(),
+    };
+    clEnqueueWriteBuffer(camera.buf.camera_bufs[buf_idx].copy_q, camera.buf.camera_bufs[buf_idx].buf_cl, CL_TRUE,
+                         0, fr.getRGBSize(), rgb, 0, NULL, NULL);
+    camera.buf.queue(buf_idx);
+    buf_idx = (buf_idx + 1) % FRAME_BUF_COUNT;
+    fr.release(frame_idx++);
+  }
+  LOG("replayed %d frames of %s", frame_idx, video_fn);
+  do_exit = true;
+}
+
+#endif
+
 }  // namespace
 
 // TODO: make this more generic
@@ -87,6 +167,15 @@ void camera_process_rear(MultiCameraState *s, CameraState *c, int cnt) {}
 void cameras_run(MultiCameraState *s) {
   std::thread t = start_process_thread(s, "processing", &s->rear, camera_process_rear);
   set_thread_name("frame_streaming");
+#ifdef FRAME_STREAM_REPLAY
+  // FRAME_STREAM_LOG=<uncompressed rlog> FRAME_STREAM_VIDEO=<fcamera.hevc> [FRAME_STREAM_FAST=1]
+  const char *video_fn = getenv("FRAME_STREAM_VIDEO");
+  if (video_fn != NULL) {
+    run_replay_stream(s->rear, getenv("FRAME_STREAM_LOG"), video_fn, getenv("FRAME_STREAM_FAST") != NULL);
+    t.join();
+    return;
+  }
+#endif
   run_frame_stream(s->rear, "frame");
   t.join();
 }
@@ -1352,17 +1352,18 @@ static void parse_autofocus(CameraState *s, uint8_t *d) {
   s->focus_err = max_focus*1.0;
 }
 
+// the newest of the message, sensord sends a publish period's samples together
 static std::optional<float> get_accel_z(SubMaster *sm) {
+  std::optional<float> accel_z;
   if (sm->update(0) > 0) {
     for (auto event : (*sm)["sensorEvents"].getSensorEvents()) {
       if (event.which() == cereal::SensorEventData::ACCELERATION) {
         if (auto v = event.getAcceleration().getV(); v.size() >= 3)
-          return -v[2];
-        break;
+          accel_z = -v[2];
       }
     }
   }
-  return std::nullopt;
+  return accel_z;
 }
 
 static void do_autofocus(CameraState *s, SubMaster *sm) {
@@ -1587,7 +1588,6 @@ static void ops_thread(MultiCameraState *s) {
 static void update_lapmap(MultiCameraState *s, const CameraBuf *b, const int cnt) {
   const size_t width = b->rgb_width / NUM_SEGMENTS_X;
   const size_t height = b->rgb_height / NUM_SEGMENTS_Y;
-  static std::unique_ptr<uint8_t[]> rgb_roi_buf = std::make_unique<uint8_t[]>(width * height * 3);
   static std::unique_ptr<int16_t[]> conv_result = std::make_unique<int16_t[]>(width * height);
 
   // sharpness scores
@@ -1595,23 +1595,23 @@ static void update_lapmap(MultiCameraState *s, const CameraBuf *b, const int cnt
   const int x_offset = ROI_X_MIN + roi_id % (ROI_X_MAX - ROI_X_MIN + 1);
   const int y_offset = ROI_Y_MIN + roi_id / (ROI_X_MAX - ROI_X_MIN + 1);
 
-  const uint8_t *rgb_addr_offset = (uint8_t *)b->cur_rgb_buf->addr + y_offset * height * FULL_STRIDE_X * 3 + x_offset * width * 3;
-  for (int i = 0; i < height; ++i) {
-    memcpy(rgb_roi_buf.get() + i * width * 3, rgb_addr_offset + i * FULL_STRIDE_X * 3, width * 3);
-  }
+  // The roi is cut out on the gpu, after the debayer on the same queue, so the cpu neither waits
+  // for the frame nor copies it
+  const size_t src_origin[3] = {x_offset * width * 3, y_offset * height, 0};
+  const size_t dst_origin[3] = {0, 0, 0};
+  const size_t region[3] = {width * 3, height, 1};
+  CL_CHECK(clEnqueueCopyBufferRect(b->q, b->cur_rgb_buf->buf_cl, s->rgb_conv_roi_cl, src_origin, dst_origin, region,
+                                   FULL_STRIDE_X * 3, 0, width * 3, 0, 0, NULL, NULL));
 
   constexpr int conv_cl_localMemSize = (CONV_LOCAL_WORKSIZE + 2 * (3 / 2)) * (CONV_LOCAL_WORKSIZE + 2 * (3 / 2)) * (3 * sizeof(uint8_t));
-  CL_CHECK(clEnqueueWriteBuffer(b->q, s->rgb_conv_roi_cl, true, 0, width * height * 3 * sizeof(uint8_t), rgb_roi_buf.get(), 0, 0, 0));
   CL_CHECK(clSetKernelArg(s->krnl_rgb_laplacian, 0, sizeof(cl_mem), (void *)&s->rgb_conv_roi_cl));
   CL_CHECK(clSetKernelArg(s->krnl_rgb_laplacian, 1, sizeof(cl_mem), (void *)&s->rgb_conv_result_cl));
   CL_CHECK(clSetKernelArg(s->krnl_rgb_laplacian, 2, sizeof(cl_mem), (void *)&s->rgb_conv_filter_cl));
   CL_CHECK(clSetKernelArg(s->krnl_rgb_laplacian, 3, conv_cl_localMemSize, 0));
-  cl_event conv_event;
   CL_CHECK(clEnqueueNDRangeKernel(b->q, s->krnl_rgb_laplacian, 2, NULL,
-                                  (size_t[]){width, height}, (size_t[]){CONV_LOCAL_WORKSIZE, CONV_LOCAL_WORKSIZE}, 0, 0, &conv_event));
-  clWaitForEvents(1, &conv_event);
-  CL_CHECK(clReleaseEvent(conv_event));
+                                  (size_t[]){width, height}, (size_t[]){CONV_LOCAL_WORKSIZE, CONV_LOCAL_WORKSIZE}, 0, 0, NULL));
 
+  // blocks for the copy and the conv too
   CL_CHECK(clEnqueueReadBuffer(b->q, s->rgb_conv_result_cl, true, 0,
                                width * height * sizeof(int16_t), conv_result.get(), 0, 0, 0));
 
@@ -1670,6 +1670,7 @@ void camera_process_frame(MultiCameraState *s, CameraState *c, int cnt) {
   if (cnt % 3 == 0) {
     const int x = 290, y = 322, width = 560, height = 314;
     const int skip = 1;
+    b->wait();
     set_exposure_target(c, (const uint8_t *)b->cur_yuv_buf->y, x, x + width, skip, y, y + height, skip);
   }
 }
@@ -140,29 +140,35 @@ void clear_req_queue(int fd, int32_t session_hdl, int32_t link_hdl) {
 
 // ************** high level camera helpers ****************
 
-void sensors_poke(struct CameraState *s, int request_id) {
-  uint32_t cam_packet_handle = 0;
-  int size = sizeof(struct cam_packet);
-  struct cam_packet *pkt = (struct cam_packet *)alloc(s->video0_fd, size, 8,
-    CAM_MEM_FLAG_KMD_ACCESS | CAM_MEM_FLAG_UMD_ACCESS | CAM_MEM_FLAG_CMD_BUF_TYPE, &cam_packet_handle);
-  pkt->num_cmd_buf = 1;
-  pkt->kmd_cmd_buf_index = -1;
-  pkt->header.size = size;
-  pkt->header.op_code = 0x7f;
-  pkt->header.request_id = request_id;
-  //struct cam_cmd_buf_desc *buf_desc = (struct cam_cmd_buf_desc *)&pkt->payload;
+// Packets that are sent once per request are allocated once, the kernel parses them during CAM_CONFIG_DEV
+// and doesn't hold on to them
+static CameraPacket alloc_packet(int video0_fd, int size) {
+  CameraPacket p = {.size = size};
+  p.pkt = (struct cam_packet *)alloc(video0_fd, size, 8,
+    CAM_MEM_FLAG_KMD_ACCESS | CAM_MEM_FLAG_UMD_ACCESS | CAM_MEM_FLAG_CMD_BUF_TYPE, &p.handle);
+  p.pkt->header.size = size;
+  return p;
+}
+
+static void free_packet(int video0_fd, CameraPacket *p) {
+  munmap(p->pkt, p->size);
+  release_fd(video0_fd, p->handle);
+}
 
+static int config_dev(CameraState *s, int fd, uint32_t dev_handle, const CameraPacket &p) {
   struct cam_config_dev_cmd config_dev_cmd = {};
   config_dev_cmd.session_handle = s->session_handle;
-  config_dev_cmd.dev_handle = s->sensor_dev_handle;
+  config_dev_cmd.dev_handle = dev_handle;
   config_dev_cmd.offset = 0;
-  config_dev_cmd.packet_handle = cam_packet_handle;
+  config_dev_cmd.packet_handle = p.handle;
+  return cam_control(fd, CAM_CONFIG_DEV, &config_dev_cmd, sizeof(config_dev_cmd));
+}
 
-  int ret = cam_control(s->sensor_fd, CAM_CONFIG_DEV, &config_dev_cmd, sizeof(config_dev_cmd));
+void sensors_poke(struct CameraState *s, int i, int request_id) {
+  CameraPacket &p = s->poke_pkts[i];
+  p.pkt->header.request_id = request_id;
+  int ret = config_dev(s, s->sensor_fd, s->sensor_dev_handle, p);
   assert(ret == 0);
-
-  munmap(pkt, size);
-  release_fd(s->video0_fd, cam_packet_handle);
 }
 
 void sensors_i2c(struct CameraState *s, struct i2c_random_wr_payload* dat, int len, int op_code) {
@@ -373,29 +379,46 @@ void sensors_init(int video0_fd, int sensor_fd, int camera_num) {
   release_fd(video0_fd, cam_packet_handle);
 }
 
-void config_isp(struct CameraState *s, int io_mem_handle, int fence, int request_id, int buf0_mem_handle, int buf0_offset) {
-  uint32_t cam_packet_handle = 0;
+// The isp settings of every packet, parsed by cam_isp_packet_generic_blob_handler
+static const uint32_t isp_generic_blob[] = {
+  // size is 0x20, type is 0(CAM_ISP_GENERIC_BLOB_TYPE_HFR_CONFIG)
+  0x2000,
+  0x1, 0x0, CAM_ISP_IFE_OUT_RES_RDI_0, 0x1, 0x0, 0x1, 0x0, 0x0, // 1 port, CAM_ISP_IFE_OUT_RES_RDI_0
+  // size is 0x38, type is 1(CAM_ISP_GENERIC_BLOB_TYPE_CLOCK_CONFIG), clocks
+  0x3801,
+  0x1, 0x4, // Dual mode, 4 RDI wires
+  0x18148d00, 0x0, 0x18148d00, 0x0, 0x18148d00, 0x0, // rdi clock
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0,  // junk?
+  // offset 0x60
+  // size is 0xe0, type is 2(CAM_ISP_GENERIC_BLOB_TYPE_BW_CONFIG), bandwidth
+  0xe002,
+  0x1, 0x4, // 4 RDI
+  0x0, 0x0, 0x1ad27480, 0x0, 0x1ad27480, 0x0, // left_pix_vote
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, // right_pix_vote
+  0x0, 0x0, 0x6ee11c0, 0x2, 0x6ee11c0, 0x2,  // rdi_vote
+  0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
+
+static CameraPacket build_isp_packet(CameraState *s, bool io, int buf0_offset) {
   int size = sizeof(struct cam_packet)+sizeof(struct cam_cmd_buf_desc)*2;
-  if (io_mem_handle != 0) {
+  if (io) {
     size += sizeof(struct cam_buf_io_cfg);
   }
-  struct cam_packet *pkt = (struct cam_packet *)alloc(s->video0_fd, size, 8,
-    CAM_MEM_FLAG_KMD_ACCESS | CAM_MEM_FLAG_UMD_ACCESS | CAM_MEM_FLAG_CMD_BUF_TYPE, &cam_packet_handle);
+  CameraPacket p = alloc_packet(s->video0_fd, size);
+  struct cam_packet *pkt = p.pkt;
   pkt->num_cmd_buf = 2;
   pkt->kmd_cmd_buf_index = 0;
 
-  if (io_mem_handle != 0) {
+  if (io) {
     pkt->io_configs_offset = sizeof(struct cam_cmd_buf_desc)*2;
     pkt->num_io_configs = 1;
-  }
-
-  if (io_mem_handle != 0) {
     pkt->header.op_code = 0xf000001;
-    pkt->header.request_id = request_id;
   } else {
     pkt->header.op_code = 0xf000000;
   }
-  pkt->header.size = size;
   struct cam_cmd_buf_desc *buf_desc = (struct cam_cmd_buf_desc *)&pkt->payload;
   struct cam_buf_io_cfg *io_cfg = (struct cam_buf_io_cfg *)((char*)&pkt->payload + pkt->io_configs_offset);
 
@@ -404,86 +427,111 @@ void config_isp(struct CameraState *s, int io_mem_handle, int fence, int request
   buf_desc[0].length = 0;
   buf_desc[0].type = CAM_CMD_BUF_DIRECT;
   buf_desc[0].meta_data = 3;
-  buf_desc[0].mem_handle = buf0_mem_handle;
+  buf_desc[0].mem_handle = s->buf0_handle;
   buf_desc[0].offset = buf0_offset;
 
   buf_desc[1].size = 324;
-	if (io_mem_handle != 0) {
+  if (io) {
     buf_desc[1].length = 228; // 0 works here too
     buf_desc[1].offset = 0x60;
-	} else {
+  } else {
     buf_desc[1].length = 324;
   }
   buf_desc[1].type = CAM_CMD_BUF_GENERIC;
   buf_desc[1].meta_data = CAM_ISP_PACKET_META_GENERIC_BLOB_COMMON;
-  uint32_t *buf2 = (uint32_t *)alloc(s->video0_fd, buf_desc[1].size, 0x20, CAM_MEM_FLAG_KMD_ACCESS | CAM_MEM_FLAG_UMD_ACCESS | CAM_MEM_FLAG_CMD_BUF_TYPE, (uint32_t*)&buf_desc[1].mem_handle);
-
-  // cam_isp_packet_generic_blob_handler
-  uint32_t tmp[] = {
-    // size is 0x20, type is 0(CAM_ISP_GENERIC_BLOB_TYPE_HFR_CONFIG)
-    0x2000,
-    0x1, 0x0, CAM_ISP_IFE_OUT_RES_RDI_0, 0x1, 0x0, 0x1, 0x0, 0x0, // 1 port, CAM_ISP_IFE_OUT_RES_RDI_0
-    // size is 0x38, type is 1(CAM_ISP_GENERIC_BLOB_TYPE_CLOCK_CONFIG), clocks
-    0x3801,
-    0x1, 0x4, // Dual mode, 4 RDI wires
-    0x18148d00, 0x0, 0x18148d00, 0x0, 0x18148d00, 0x0, // rdi clock
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0,  // junk?
-    // offset 0x60
-    // size is 0xe0, type is 2(CAM_ISP_GENERIC_BLOB_TYPE_BW_CONFIG), bandwidth
-    0xe002,
-    0x1, 0x4, // 4 RDI
-    0x0, 0x0, 0x1ad27480, 0x0, 0x1ad27480, 0x0, // left_pix_vote
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, // right_pix_vote
-    0x0, 0x0, 0x6ee11c0, 0x2, 0x6ee11c0, 0x2,  // rdi_vote
-    0x0, 0x0, 0x0, 0x0,
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
-  memcpy(buf2, tmp, sizeof(tmp));
-
-  if (io_mem_handle != 0) {
-    io_cfg[0].mem_handle[0] = io_mem_handle;
-		io_cfg[0].planes[0] = (struct cam_plane_cfg){
-		 .width = FRAME_WIDTH,
-		 .height = FRAME_HEIGHT,
-		 .plane_stride = FRAME_STRIDE,
-		 .slice_height = FRAME_HEIGHT,
-		 .meta_stride = 0x0,
-		 .meta_size = 0x0,
-		 .meta_offset = 0x0,
-		 .packer_config = 0x0,
-		 .mode_config = 0x0,
-		 .tile_config = 0x0,
-		 .h_init = 0x0,
-		 .v_init = 0x0,
-		};
+  buf_desc[1].mem_handle = s->isp_blob_handle;
+
+  if (io) {
+    // the buffer and its fence are set per request
+    io_cfg[0].planes[0] = (struct cam_plane_cfg){
+      .width = FRAME_WIDTH,
+      .height = FRAME_HEIGHT,
+      .plane_stride = FRAME_STRIDE,
+      .slice_height = FRAME_HEIGHT,
+      .meta_stride = 0x0,
+      .meta_size = 0x0,
+      .meta_offset = 0x0,
+      .packer_config = 0x0,
+      .mode_config = 0x0,
+      .tile_config = 0x0,
+      .h_init = 0x0,
+      .v_init = 0x0,
+    };
     io_cfg[0].format = CAM_FORMAT_MIPI_RAW_10;
     io_cfg[0].color_pattern = 0x5;
     io_cfg[0].bpp = 0xc;
     io_cfg[0].resource_type = CAM_ISP_IFE_OUT_RES_RDI_0;
-    io_cfg[0].fence = fence;
     io_cfg[0].direction = CAM_BUF_OUTPUT;
     io_cfg[0].subsample_pattern = 0x1;
     io_cfg[0].framedrop_pattern = 0x1;
   }
+  return p;
+}
 
-  struct cam_config_dev_cmd config_dev_cmd = {};
-  config_dev_cmd.session_handle = s->session_handle;
-  config_dev_cmd.dev_handle = s->isp_dev_handle;
-  config_dev_cmd.offset = 0;
-  config_dev_cmd.packet_handle = cam_packet_handle;
+// the initial configuration, without a buffer
+void config_isp_init(struct CameraState *s) {
+  CameraPacket p = build_isp_packet(s, false, 0);
+  if (config_dev(s, s->isp_fd, s->isp_dev_handle, p) != 0) {
+    printf("ISP CONFIG FAILED\n");
+  }
+  free_packet(s->video0_fd, &p);
+}
 
-  int ret = cam_control(s->isp_fd, CAM_CONFIG_DEV, &config_dev_cmd, sizeof(config_dev_cmd));
-  if (ret != 0) {
+void config_isp(struct CameraState *s, int i) {
+  CameraPacket &p = s->isp_pkts[i];
+  p.pkt->header.request_id = s->request_ids[i];
+  struct cam_buf_io_cfg *io_cfg = (struct cam_buf_io_cfg *)((char*)&p.pkt->payload + p.pkt->io_configs_offset);
+  io_cfg[0].mem_handle[0] = s->buf_handle[i];
+  io_cfg[0].fence = s->sync_objs[i];
+  if (config_dev(s, s->isp_fd, s->isp_dev_handle, p) != 0) {
     printf("ISP CONFIG FAILED\n");
   }
+}
 
-  munmap(buf2, buf_desc[1].size);
-  release_fd(s->video0_fd, buf_desc[1].mem_handle);
-  // release_fd(s->video0_fd, buf_desc[0].mem_handle);
-  munmap(pkt, size);
-  release_fd(s->video0_fd, cam_packet_handle);
+// Everything sent per request or exposure change: an isp and a sensor poke packet per buffer, the blob
+// the isp packets share and the exposure write
+static void request_packets_init(CameraState *s) {
+  s->isp_blob = (uint32_t *)alloc(s->video0_fd, 324, 0x20, CAM_MEM_FLAG_KMD_ACCESS | CAM_MEM_FLAG_UMD_ACCESS | CAM_MEM_FLAG_CMD_BUF_TYPE, &s->isp_blob_handle);
+  memcpy(s->isp_blob, isp_generic_blob, sizeof(isp_generic_blob));
+
+  for (int i = 0; i < FRAME_BUF_COUNT; i++) {
+    s->isp_pkts[i] = build_isp_packet(s, true, 65632*(i+1));
+
+    s->poke_pkts[i] = alloc_packet(s->video0_fd, sizeof(struct cam_packet));
+    s->poke_pkts[i].pkt->num_cmd_buf = 1;
+    s->poke_pkts[i].pkt->kmd_cmd_buf_index = -1;
+    s->poke_pkts[i].pkt->header.op_code = 0x7f;
+  }
+
+  // the exposure registers in one i2c write, only their values change
+  s->exp_pkt = alloc_packet(s->video0_fd, sizeof(struct cam_packet)+sizeof(struct cam_cmd_buf_desc));
+  struct cam_packet *pkt = s->exp_pkt.pkt;
+  pkt->num_cmd_buf = 1;
+  pkt->kmd_cmd_buf_index = -1;
+  pkt->header.op_code = CAM_SENSOR_PACKET_OPCODE_SENSOR_CONFIG;
+  struct cam_cmd_buf_desc *buf_desc = (struct cam_cmd_buf_desc *)&pkt->payload;
+  buf_desc[0].size = buf_desc[0].length = sizeof(struct cam_cmd_i2c_random_wr) + (EXPOSURE_REG_COUNT-1)*sizeof(struct i2c_random_wr_payload);
+  buf_desc[0].type = CAM_CMD_BUF_I2C;
+  s->exp_wr = (struct cam_cmd_i2c_random_wr *)alloc(s->video0_fd, buf_desc[0].size, 8, CAM_MEM_FLAG_KMD_ACCESS | CAM_MEM_FLAG_UMD_ACCESS | CAM_MEM_FLAG_CMD_BUF_TYPE, (uint32_t*)&buf_desc[0].mem_handle);
+  s->exp_wr->header.count = EXPOSURE_REG_COUNT;
+  s->exp_wr->header.op_code = 1;
+  s->exp_wr->header.cmd_type = CAMERA_SENSOR_CMD_TYPE_I2C_RNDM_WR;
+  s->exp_wr->header.data_type = CAMERA_SENSOR_I2C_TYPE_WORD;
+  s->exp_wr->header.addr_type = CAMERA_SENSOR_I2C_TYPE_WORD;
+  s->exp_written = false;
+}
+
+static void request_packets_free(CameraState *s) {
+  struct cam_cmd_buf_desc *buf_desc = (struct cam_cmd_buf_desc *)&s->exp_pkt.pkt->payload;
+  munmap(s->exp_wr, buf_desc[0].size);
+  release_fd(s->video0_fd, buf_desc[0].mem_handle);
+  free_packet(s->video0_fd, &s->exp_pkt);
+  for (int i = 0; i < FRAME_BUF_COUNT; i++) {
+    free_packet(s->video0_fd, &s->poke_pkts[i]);
+    free_packet(s->video0_fd, &s->isp_pkts[i]);
+  }
+  munmap(s->isp_blob, 324);
+  release_fd(s->video0_fd, s->isp_blob_handle);
 }
 
 void enqueue_buffer(struct CameraState *s, int i, bool dp) {
@@ -536,11 +584,11 @@ void enqueue_buffer(struct CameraState *s, int i, bool dp) {
   s->buf_handle[i] = mem_mgr_map_cmd.out.buf_handle;
 
   // poke sensor
-  sensors_poke(s, request_id);
+  sensors_poke(s, i, request_id);
   // LOGD("Poked sensor");
 
   // push the buffer
-  config_isp(s, s->buf_handle[i], s->sync_objs[i], request_id, s->buf0_handle, 65632*(i+1));
+  config_isp(s, i);
 }
 
 void enqueue_req_multi(struct CameraState *s, int start, int n, bool dp) {
@@ -719,7 +767,8 @@ static void camera_open(CameraState *s) {
 
   // config ISP
   alloc_w_mmu_hdl(s->video0_fd, 984480, 0x20, CAM_MEM_FLAG_HW_READ_WRITE | CAM_MEM_FLAG_KMD_ACCESS | CAM_MEM_FLAG_UMD_ACCESS | CAM_MEM_FLAG_CMD_BUF_TYPE, (uint32_t*)&s->buf0_handle, s->device_iommu, s->cdm_iommu);
-  config_isp(s, 0, 0, 1, s->buf0_handle, 0);
+  request_packets_init(s);
+  config_isp_init(s);
 
   LOG("-- Configuring sensor");
   sensors_i2c(s, init_array_ar0231, sizeof(init_array_ar0231)/sizeof(struct i2c_random_wr_payload),
@@ -806,7 +855,8 @@ void cameras_init(VisionIpcServer *v, MultiCameraState *s, cl_device_id device_i
   printf("front initted \n");
 
   s->sm = new SubMaster({"driverState"});
-  s->pm = new PubMaster({"frame", "frontFrame", "wideFrame", "thumbnail"});
+  s->pm = new PubMaster({"frame", "frontFrame", "wideFrame", "thumbnail", "frameBundle"});
+  s->bundler = new FrameBundler(s->pm, 3);
 }
 
 void cameras_open(MultiCameraState *s) {
@@ -901,6 +951,8 @@ static void camera_close(CameraState *s) {
   ret = device_control(s->csiphy_fd, CAM_RELEASE_DEV, s->session_handle, s->csiphy_dev_handle);
   LOGD("release csiphy: %d", ret);
 
+  request_packets_free(s);
+
   ret = cam_control(s->video0_fd, CAM_REQ_MGR_DESTROY_SESSION, &s->req_mgr_session_info, sizeof(s->req_mgr_session_info));
   LOGD("destroyed session: %d", ret);
 }
@@ -910,6 +962,7 @@ static void cameras_close(MultiCameraState *s) {
   camera_close(&s->wide);
   camera_close(&s->front);
 
+  delete s->bundler;
   delete s->sm;
   delete s->pm;
 }
@@ -1051,16 +1104,16 @@ static void set_camera_exposure(CameraState *s, float grey_frac) {
   // printf("cam %d, min %d, max %d \n", s->camera_num, s->exposure_time_min, s->exposure_time_max);
   // printf("cam %d, set AG to 0x%X, S to %d, dc %d \n", s->camera_num, AG, s->exposure_time, s->dc_gain_enabled);
 
-  struct i2c_random_wr_payload exp_reg_array[] = {{0x3366, AG}, // analog gain
-                                                  {0x3362, (uint16_t)(s->dc_gain_enabled?0x1:0x0)}, // DC_GAIN
-                                                  {0x305A, 0x00D8}, // red gain
-                                                  {0x3058, 0x011B}, // blue gain
-                                                  {0x3056, 0x009A}, // g1 gain
-                                                  {0x305C, 0x009A}, // g2 gain
-                                                  {0x3012, (uint16_t)s->exposure_time}}; // integ time
-                                                  //{0x301A, 0x091C}}; // reset
-  sensors_i2c(s, exp_reg_array, sizeof(exp_reg_array)/sizeof(struct i2c_random_wr_payload),
-               CAM_SENSOR_PACKET_OPCODE_SENSOR_CONFIG);
+  // the color gains don't change from init_array_ar0231's
+  const struct i2c_random_wr_payload exp_reg_array[EXPOSURE_REG_COUNT] = {{0x3366, AG}, // analog gain
+                                                                          {0x3362, (uint16_t)(s->dc_gain_enabled?0x1:0x0)}, // DC_GAIN
+                                                                          {0x3012, (uint16_t)s->exposure_time}}; // integ time
+  // mostly the exposure settles and there's nothing to write
+  if (s->exp_written && memcmp(s->exp_wr->random_wr_payload, exp_reg_array, sizeof(exp_reg_array)) == 0) return;
+  memcpy(s->exp_wr->random_wr_payload, exp_reg_array, sizeof(exp_reg_array));
+  int ret = config_dev(s, s->sensor_fd, s->sensor_dev_handle, s->exp_pkt);
+  assert(ret == 0);
+  s->exp_written = true;
 }
 
 void camera_autoexposure(CameraState *s, float grey_frac) {
@@ -1093,6 +1146,7 @@ static void ae_thread(MultiCameraState *s) {
 
 void camera_process_front(MultiCameraState *s, CameraState *c, int cnt) {
   common_camera_process_front(s->sm, s->pm, c, cnt);
+  s->bundler->add(c->camera_num, VISION_STREAM_YUV_FRONT, c->buf.cur_frame_data);
 }
 
 // called by processing_thread
@@ -1109,10 +1163,12 @@ void camera_process_frame(MultiCameraState *s, CameraState *c, int cnt) {
     framed.setTransform(b->yuv_transform.v);
   }
   s->pm->send(c == &s->rear ? "frame" : "wideFrame", msg);
+  s->bundler->add(c->camera_num, c == &s->rear ? VISION_STREAM_YUV_BACK : VISION_STREAM_YUV_WIDE, b->cur_frame_data);
 
   if (cnt % 3 == 0) {
     const auto [x, y, w, h] = (c == &s->wide) ? std::tuple(96, 250, 1734, 524) : std::tuple(96, 160, 1734, 986);
     const int skip = 2;
+    b->wait();
     set_exposure_target(c, (const uint8_t *)b->cur_yuv_buf->y, x, x + w, skip, y, y + h, skip);
   }
 }
@@ -20,6 +20,16 @@
 
 #define DEBAYER_LOCAL_WORKSIZE 16
 
+// analog gain, dc gain and integration time
+#define EXPOSURE_REG_COUNT 3
+
+// A cam_packet in camera memory, kept mapped to be patched and sent again
+typedef struct CameraPacket {
+  struct cam_packet *pkt;
+  uint32_t handle;
+  int size;
+} CameraPacket;
+
 typedef struct CameraState {
   CameraInfo ci;
 
@@ -56,6 +66,15 @@ typedef struct CameraState {
   int buf_handle[FRAME_BUF_COUNT];
   int sync_objs[FRAME_BUF_COUNT];
   int request_ids[FRAME_BUF_COUNT];
+  // Built at camera_open, a request only patches in its id, fence and buffer
+  CameraPacket isp_pkts[FRAME_BUF_COUNT];
+  CameraPacket poke_pkts[FRAME_BUF_COUNT];
+  uint32_t *isp_blob;
+  uint32_t isp_blob_handle;
+  // and an exposure change its register values
+  CameraPacket exp_pkt;
+  struct cam_cmd_i2c_random_wr *exp_wr;
+  bool exp_written;
   int request_id_last;
   int frame_id_last;
   int idx_offset;
@@ -81,6 +100,7 @@ typedef struct MultiCameraState {
 
   SubMaster *sm;
   PubMaster *pm;
+  FrameBundler *bundler;
 } MultiCameraState;
 
 void cameras_init(VisionIpcServer *v, MultiCameraState *s, cl_device_id device_id, cl_context ctx);
@@ -4,6 +4,9 @@
 #include <assert.h>
 #include <string.h>
 #include <pthread.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 #include "common/util.h"
 #include "common/timing.h"
@@ -18,6 +21,10 @@
 #include <opencv2/videoio.hpp>
 #pragma clang diagnostic pop
 
+#ifndef __APPLE__
+#include "v4l2_capture.h"
+#endif
+
 
 extern ExitHandler do_exit;
 
@@ -44,162 +51,167 @@ void camera_init(VisionIpcServer * v, CameraState *s, int camera_id, unsigned in
   s->buf.init(device_id, ctx, s, v, FRAME_BUF_COUNT, rgb_type, yuv_type);
 }
 
-static void* rear_thread(void *arg) {
-  int err;
-
-  set_thread_name("webcam_rear_thread");
-  CameraState *s = (CameraState*)arg;
-
-  cv::VideoCapture cap_rear(1); // road
-  cap_rear.set(cv::CAP_PROP_FRAME_WIDTH, 853);
-  cap_rear.set(cv::CAP_PROP_FRAME_HEIGHT, 480);
-  cap_rear.set(cv::CAP_PROP_FPS, s->fps);
-  cap_rear.set(cv::CAP_PROP_AUTOFOCUS, 0); // off
-  cap_rear.set(cv::CAP_PROP_FOCUS, 0); // 0 - 255?
-  // cv::Rect roi_rear(160, 0, 960, 720);
-
-  cv::Size size;
-  size.height = s->ci.frame_height;
-  size.width = s->ci.frame_width;
-
-  // transforms calculation see tools/webcam/warp_vis.py
-  float ts[9] = {1.50330396, 0.0, -59.40969163,
-                  0.0, 1.50330396, 76.20704846,
-                  0.0, 0.0, 1.0};
-  // if camera upside down:
-  // float ts[9] = {-1.50330396, 0.0, 1223.4,
-  //                 0.0, -1.50330396, 797.8,
-  //                 0.0, 0.0, 1.0};
-  const cv::Mat transform = cv::Mat(3, 3, CV_32F, ts);
-
-  if (!cap_rear.isOpened()) {
-    err = 1;
-  }
-
-  uint32_t frame_id = 0;
-  size_t buf_idx = 0;
-  while (!do_exit) {
-    cv::Mat frame_mat;
-    cv::Mat transformed_mat;
-
-    cap_rear >> frame_mat;
-
-    // int rows = frame_mat.rows;
-    // int cols = frame_mat.cols;
-    // printf("Raw Rear, R=%d, C=%d\n", rows, cols);
-
-    cv::warpPerspective(frame_mat, transformed_mat, transform, size, cv::INTER_LINEAR, cv::BORDER_CONSTANT, 0);
-
-    int transformed_size = transformed_mat.total() * transformed_mat.elemSize();
-
-    s->buf.camera_bufs_metadata[buf_idx] = {
-      .frame_id = frame_id,
-    };
-
-    cl_command_queue q = s->buf.camera_bufs[buf_idx].copy_q;
-    cl_mem yuv_cl = s->buf.camera_bufs[buf_idx].buf_cl;
-
-    cl_event map_event;
-    void *yuv_buf = (void *)CL_CHECK_ERR(clEnqueueMapBuffer(q, yuv_cl, CL_TRUE,
-                                                CL_MAP_WRITE, 0, transformed_size,
-                                                0, NULL, &map_event, &err));
-    clWaitForEvents(1, &map_event);
-    clReleaseEvent(map_event);
-    memcpy(yuv_buf, transformed_mat.data, transformed_size);
-
-    CL_CHECK(clEnqueueUnmapMemObject(q, yuv_cl, yuv_buf, 0, NULL, &map_event));
-    clWaitForEvents(1, &map_event);
-    clReleaseEvent(map_event);
-
-    s->buf.queue(buf_idx);
-
-    frame_id += 1;
-    frame_mat.release();
-    transformed_mat.release();
-
-
-    buf_idx = (buf_idx + 1) % FRAME_BUF_COUNT;
-  }
-
-  cap_rear.release();
-  return NULL;
+// transforms calculation see tools/webcam/warp_vis.py, for a 853x480 capture
+const float rear_transform[9] = {1.50330396, 0.0, -59.40969163,
+                                 0.0, 1.50330396, 76.20704846,
+                                 0.0, 0.0, 1.0};
+// if camera upside down:
+// {-1.50330396, 0.0, 1223.4,
+//  0.0, -1.50330396, 797.8,
+//  0.0, 0.0, 1.0};
+const float front_transform[9] = {1.42070485, 0.0, -30.16740088,
+                                  0.0, 1.42070485, 91.030837,
+                                  0.0, 0.0, 1.0};
+// if camera upside down:
+// {-1.42070485, 0.0, 1182.2,
+//  0.0, -1.42070485, 773.0,
+//  0.0, 0.0, 1.0};
+
+// the calibrated transforms take a 853x480 frame, larger captures of the same view get scaled down first
+cv::Mat capture_transform(const float ts[9], int capture_width) {
+  cv::Mat transform = cv::Mat(3, 3, CV_32F, (void *)ts).clone();
+  transform.col(0) *= 853.0 / capture_width;
+  transform.col(1) *= 853.0 / capture_width;
+  return transform;
 }
 
-void front_thread(CameraState *s) {
+// warps straight into the mapped camera buffer, returns the buffer to queue
+size_t webcam_warp_frame(CameraState *s, const cv::Mat &frame_mat, const cv::Mat &transform, uint32_t frame_id, uint64_t timestamp) {
   int err;
+  const size_t buf_idx = frame_id % FRAME_BUF_COUNT;
+  const size_t frame_size = s->ci.frame_stride * s->ci.frame_height;
+
+  s->buf.camera_bufs_metadata[buf_idx] = {
+    .frame_id = frame_id,
+    .timestamp_eof = timestamp,
+  };
+
+  cl_command_queue q = s->buf.camera_bufs[buf_idx].copy_q;
+  cl_mem yuv_cl = s->buf.camera_bufs[buf_idx].buf_cl;
+  void *yuv_buf = (void *)CL_CHECK_ERR(clEnqueueMapBuffer(q, yuv_cl, CL_TRUE,
+                                              CL_MAP_WRITE_INVALIDATE_REGION, 0, frame_size,
+                                              0, NULL, NULL, &err));
+  cv::Mat transformed_mat(s->ci.frame_height, s->ci.frame_width, CV_8UC3, yuv_buf, s->ci.frame_stride);
+  cv::warpPerspective(frame_mat, transformed_mat, transform, transformed_mat.size(), cv::INTER_LINEAR, cv::BORDER_CONSTANT, 0);
+
+  cl_event unmap_event;
+  CL_CHECK(clEnqueueUnmapMemObject(q, yuv_cl, yuv_buf, 0, NULL, &unmap_event));
+  clWaitForEvents(1, &unmap_event);
+  clReleaseEvent(unmap_event);
+  return buf_idx;
+}
 
-  cv::VideoCapture cap_front(2); // driver
-  cap_front.set(cv::CAP_PROP_FRAME_WIDTH, 853);
-  cap_front.set(cv::CAP_PROP_FRAME_HEIGHT, 480);
-  cap_front.set(cv::CAP_PROP_FPS, s->fps);
-  // cv::Rect roi_front(320, 0, 960, 720);
-
-  cv::Size size;
-  size.height = s->ci.frame_height;
-  size.width = s->ci.frame_width;
-
-  // transforms calculation see tools/webcam/warp_vis.py
-  float ts[9] = {1.42070485, 0.0, -30.16740088,
-                  0.0, 1.42070485, 91.030837,
-                  0.0, 0.0, 1.0};
-  // if camera upside down:
-  // float ts[9] = {-1.42070485, 0.0, 1182.2,
-  //                 0.0, -1.42070485, 773.0,
-  //                 0.0, 0.0, 1.0};
-  const cv::Mat transform = cv::Mat(3, 3, CV_32F, ts);
-
-  if (!cap_front.isOpened()) {
-    err = 1;
+#ifdef __APPLE__
+
+void webcam_thread(CameraState *s, int device, const float ts[9]) {
+  cv::VideoCapture cap(device);
+  cap.set(cv::CAP_PROP_FRAME_WIDTH, 853);
+  cap.set(cv::CAP_PROP_FRAME_HEIGHT, 480);
+  cap.set(cv::CAP_PROP_FPS, s->fps);
+  cap.set(cv::CAP_PROP_AUTOFOCUS, 0); // off
+  cap.set(cv::CAP_PROP_FOCUS, 0); // 0 - 255?
+  if (!cap.isOpened()) {
+    LOGE("can't open webcam %d", device);
+    return;
   }
+  const cv::Mat transform = capture_transform(ts, cap.get(cv::CAP_PROP_FRAME_WIDTH));
 
   uint32_t frame_id = 0;
-  size_t buf_idx = 0;
-
   while (!do_exit) {
     cv::Mat frame_mat;
-    cv::Mat transformed_mat;
-
-    cap_front >> frame_mat;
-
-    // int rows = frame_mat.rows;
-    // int cols = frame_mat.cols;
-    // printf("Raw Front, R=%d, C=%d\n", rows, cols);
-
-    cv::warpPerspective(frame_mat, transformed_mat, transform, size, cv::INTER_LINEAR, cv::BORDER_CONSTANT, 0);
-
-    int transformed_size = transformed_mat.total() * transformed_mat.elemSize();
-
-    s->buf.camera_bufs_metadata[buf_idx] = {
-      .frame_id = frame_id,
-    };
+    cap >> frame_mat;
+    if (frame_mat.empty()) continue;
+    s->buf.queue(webcam_warp_frame(s, frame_mat, transform, frame_id++, nanos_since_boot()));
+  }
+  cap.release();
+}
 
-    cl_command_queue q = s->buf.camera_bufs[buf_idx].copy_q;
-    cl_mem yuv_cl = s->buf.camera_bufs[buf_idx].buf_cl;
-    cl_event map_event;
-    void *yuv_buf = (void *)CL_CHECK_ERR(clEnqueueMapBuffer(q, yuv_cl, CL_TRUE,
-                                                CL_MAP_WRITE, 0, transformed_size,
-                                                0, NULL, &map_event, &err));
-    clWaitForEvents(1, &map_event);
-    clReleaseEvent(map_event);
-    memcpy(yuv_buf, transformed_mat.data, transformed_size);
+#else
 
-    CL_CHECK(clEnqueueUnmapMemObject(q, yuv_cl, yuv_buf, 0, NULL, &map_event));
-    clWaitForEvents(1, &map_event);
-    clReleaseEvent(map_event);
+// MJPEG at 1080p is too slow to decode on the capture thread, a few workers decode and warp
+// while frames still reach the processing thread in capture order
+#define WEBCAM_DECODE_THREADS 3
+#define WEBCAM_CAPTURE_WIDTH 1920
+#define WEBCAM_CAPTURE_HEIGHT 1080
 
-    s->buf.queue(buf_idx);
+struct WebcamJob {
+  V4L2Frame frame;
+  uint32_t frame_id;
+  uint64_t timestamp;
+};
 
-    frame_id += 1;
-    frame_mat.release();
-    transformed_mat.release();
+void webcam_thread(CameraState *s, int device, const float ts[9]) {
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/video%d", device);
+  V4L2Capture cap;
+  if (!cap.open(path, WEBCAM_CAPTURE_WIDTH, WEBCAM_CAPTURE_HEIGHT, s->fps)) return;
+  const cv::Mat transform = capture_transform(ts, cap.width);
+
+  std::mutex lock;
+  std::condition_variable jobs_cv;
+  std::deque<WebcamJob> jobs;
+  uint32_t next_queued = 0;
+
+  auto decode_worker = [&]() {
+    set_thread_name("webcam_decode");
+    cv::Mat bgr(cap.height, cap.width, CV_8UC3);
+    while (true) {
+      WebcamJob job;
+      {
+        std::unique_lock<std::mutex> lk(lock);
+        jobs_cv.wait(lk, [&] { return !jobs.empty() || do_exit; });
+        if (jobs.empty()) return;
+        job = jobs.front();
+        jobs.pop_front();
+      }
+
+      bool ok = true;
+      if (job.frame.mjpeg) {
+        ok = decode_mjpeg_bgr(job.frame.data, job.frame.len, bgr.data, cap.width, cap.height);
+      } else {
+        cv::cvtColor(cv::Mat(cap.height, cap.width, CV_8UC2, (void *)job.frame.data), bgr, cv::COLOR_YUV2BGR_YUYV);
+      }
+      cap.requeue(job.frame.index);
+      // each in flight frame has its own camera buffer, only the queueing is in order
+      size_t buf_idx = ok ? webcam_warp_frame(s, bgr, transform, job.frame_id, job.timestamp) : 0;
+
+      std::unique_lock<std::mutex> lk(lock);
+      jobs_cv.wait(lk, [&] { return next_queued == job.frame_id || do_exit; });
+      if (do_exit) return;
+      if (ok) {
+        s->buf.queue(buf_idx);
+      } else {
+        LOGW("dropped corrupt webcam frame %d", job.frame.sequence);
+      }
+      next_queued++;
+      jobs_cv.notify_all();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 0; i < WEBCAM_DECODE_THREADS; i++) workers.push_back(std::thread(decode_worker));
 
-    buf_idx = (buf_idx + 1) % FRAME_BUF_COUNT;
+  uint32_t frame_id = 0;
+  while (!do_exit) {
+    V4L2Frame frame;
+    if (!cap.dequeue(&frame, 100)) continue;
+    uint64_t timestamp = nanos_since_boot();
+
+    std::unique_lock<std::mutex> lk(lock);
+    if (jobs.size() >= WEBCAM_DECODE_THREADS) {
+      // the workers are behind, drop the frame rather than add latency
+      cap.requeue(frame.index);
+      continue;
+    }
+    jobs.push_back({.frame = frame, .frame_id = frame_id++, .timestamp = timestamp});
+    jobs_cv.notify_all();
   }
 
-  cap_front.release();
-  return;
+  jobs_cv.notify_all();
+  for (auto &t : workers) t.join();
 }
 
+#endif
+
 }  // namespace
 
 CameraInfo cameras_supported[CAMERA_ID_MAX] = {
@@ -258,6 +270,7 @@ void camera_process_rear(MultiCameraState *s, CameraState *c, int cnt) {
   MessageBuilder msg;
   auto framed = msg.initEvent().initFrame();
   fill_frame_data(framed, b->cur_frame_data, cnt);
+  b->wait();
   framed.setImage(kj::arrayPtr((const uint8_t *)b->cur_yuv_buf->addr, b->cur_yuv_buf->len));
   framed.setTransform(b->yuv_transform.v);
   s->pm->send("frame", msg);
@@ -268,9 +281,12 @@ void cameras_run(MultiCameraState *s) {
   threads.push_back(start_process_thread(s, "processing", &s->rear, camera_process_rear));
   threads.push_back(start_process_thread(s, "frontview", &s->front, camera_process_front));
 
-  std::thread t_rear = std::thread(rear_thread, &s->rear);
+  std::thread t_rear = std::thread([=]() {
+    set_thread_name("webcam_rear_thread");
+    webcam_thread(&s->rear, 1, rear_transform); // road
+  });
   set_thread_name("webcam_thread");
-  front_thread(&s->front);
+  webcam_thread(&s->front, 2, front_transform); // driver
 
   t_rear.join();
 
@@ -0,0 +1,179 @@
+#include "raw_capture.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/trace.h"
+#include "common/util.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+static size_t align_up(size_t size) {
+  return (size + RAW_CAPTURE_ALIGN - 1) / RAW_CAPTURE_ALIGN * RAW_CAPTURE_ALIGN;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t ret = write(fd, (const uint8_t *)data + written, size - written);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+
+std::unique_ptr<RawCapture> RawCapture::create(const char *camera_name, const CameraInfo &ci) {
+  const char *dir = getenv("RAW_CAPTURE");
+  if (dir == nullptr || strcmp(util::getenv_default("RAW_CAPTURE_CAMERA", "", "rear").c_str(), camera_name) != 0) {
+    return nullptr;
+  }
+
+  const std::string path = util::string_format("%s/raw_%s_%llu", dir, camera_name, (unsigned long long)nanos_since_boot());
+  // tmpfs and some fuse mounts don't take O_DIRECT, the writes are aligned either way
+  int fd = open((path + ".bin").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0664);
+  if (fd < 0 && errno == EINVAL) {
+    fd = open((path + ".bin").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  }
+  if (fd < 0) {
+    LOGE("raw capture can't open %s.bin: %s", path.c_str(), strerror(errno));
+    return nullptr;
+  }
+  int idx_fd = open((path + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  if (idx_fd < 0) {
+    LOGE("raw capture can't open %s.idx: %s", path.c_str(), strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+  return std::unique_ptr<RawCapture>(new RawCapture(fd, idx_fd, path, ci));
+}
+
+RawCapture::RawCapture(int fd, int idx_fd, const std::string &path, const CameraInfo &ci)
+    : fd(fd), idx_fd(idx_fd), path(path) {
+  frame_size = (size_t)ci.frame_stride * ci.frame_height;
+  record_size = align_up(sizeof(RawCaptureFrame) + frame_size);
+  // the header block is the first slot until the writer starts
+  int err = posix_memalign((void **)&slots, RAW_CAPTURE_ALIGN, record_size * RAW_CAPTURE_SLOTS);
+  assert(err == 0);
+
+  memset(slots, 0, RAW_CAPTURE_ALIGN);
+  RawCaptureHeader *header = (RawCaptureHeader *)slots;
+  memcpy(header->magic, RAW_CAPTURE_MAGIC, sizeof(header->magic));
+  header->frame_width = ci.frame_width;
+  header->frame_height = ci.frame_height;
+  header->frame_stride = ci.frame_stride;
+  header->bayer_flip = ci.bayer_flip;
+  header->hdr = ci.hdr;
+  header->frame_size = frame_size;
+  header->record_size = record_size;
+  if (!write_all(fd, slots, RAW_CAPTURE_ALIGN)) {
+    LOGE("raw capture can't write %s.bin: %s", path.c_str(), strerror(errno));
+    exit = true;
+  }
+
+  LOGW("raw capture to %s.bin, %zu byte records", path.c_str(), record_size);
+  thread = std::thread(&RawCapture::run, this);
+}
+
+RawCapture::~RawCapture() {
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    exit = true;
+  }
+  cv.notify_one();
+  thread.join();
+
+  LOGW("raw capture to %s.bin wrote %llu frames, dropped %llu", path.c_str(),
+       (unsigned long long)records, (unsigned long long)dropped);
+  close(idx_fd);
+  close(fd);
+  free(slots);
+}
+
+void RawCapture::push(CameraBuf *b) {
+  TRACE_SCOPE("RawCapture::push");
+  uint64_t slot;
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    if (exit) return;
+    if (tail - head >= RAW_CAPTURE_SLOTS) {
+      // the storage can't keep up, the frames that made it in are kept whole
+      if (dropped++ % 100 == 0) {
+        LOGW("raw capture dropped a frame, %llu total", (unsigned long long)dropped);
+      }
+      return;
+    }
+    slot = tail;
+  }
+
+  // Only this thread fills the slot at tail, the writer doesn't touch it before tail moves past it
+  uint8_t *record = slots + (slot % RAW_CAPTURE_SLOTS) * record_size;
+  const FrameMetadata &frame_data = b->cur_frame_data;
+  RawCaptureFrame *frame = (RawCaptureFrame *)record;
+  *frame = {
+    .frame_id = frame_data.frame_id,
+    .frame_length = frame_data.frame_length,
+    .integ_lines = frame_data.integ_lines,
+    .global_gain = frame_data.global_gain,
+    .timestamp_sof = frame_data.timestamp_sof,
+    .timestamp_eof = frame_data.timestamp_eof,
+    .gain_frac = frame_data.gain_frac,
+  };
+  VisionBuf *camera_buf = b->cur_camera_buf();
+  camera_buf->sync(VISIONBUF_SYNC_FROM_DEVICE);
+  memcpy(record + sizeof(RawCaptureFrame), camera_buf->addr, frame_size);
+
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    tail++;
+  }
+  cv.notify_one();
+}
+
+void RawCapture::run() {
+  set_thread_name("raw_capture");
+  set_sched_profile("camerad", "raw_capture");
+
+  std::vector<RawCaptureIndex> index;
+  std::unique_lock<std::mutex> lk(lock);
+  while (true) {
+    cv.wait(lk, [this] { return exit || tail != head; });
+    if (tail == head) break;  // only exits with nothing left to write
+
+    // every filled slot up to the end of the ring in one write
+    const uint64_t first = head;
+    const size_t n = std::min(tail - head, RAW_CAPTURE_SLOTS - head % RAW_CAPTURE_SLOTS);
+    lk.unlock();
+
+    const uint8_t *data = slots + (first % RAW_CAPTURE_SLOTS) * record_size;
+    index.clear();
+    for (size_t i = 0; i < n; i++) {
+      const RawCaptureFrame *frame = (const RawCaptureFrame *)(data + i * record_size);
+      index.push_back({.frame_id = frame->frame_id, .record = (uint32_t)(records + i), .timestamp_eof = frame->timestamp_eof});
+    }
+    const bool ok = write_all(fd, data, n * record_size) &&
+                    write_all(idx_fd, index.data(), index.size() * sizeof(RawCaptureIndex));
+
+    lk.lock();
+    head += n;
+    if (!ok) {
+      LOGE("raw capture to %s.bin stopped: %s", path.c_str(), strerror(errno));
+      exit = true;
+      break;
+    }
+    records += n;
+  }
+}
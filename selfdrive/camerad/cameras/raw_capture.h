@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "camera_common.h"
+
+// Streams one camera's raw sensor frames, before the debayer, to disk for data collection. Enabled with
+//   RAW_CAPTURE=<dir> [RAW_CAPTURE_CAMERA=rear|front|wide]
+// The camera thread copies each frame into a free slot of a ring of RAW_CAPTURE_SLOTS aligned buffers
+// while the gpu debayers it, and a writer thread writes the slots out with O_DIRECT, so the page cache
+// isn't filled with frames nobody reads again. A frame with no free slot is dropped and counted, the
+// camera buffers go back to the sensor as they always do.
+//
+// <dir>/raw_<camera>_<boot ns>.bin is a RawCaptureHeader in the first RAW_CAPTURE_ALIGN bytes and then
+// one record_size record per frame: a RawCaptureFrame followed by the frame_size bytes of the frame.
+// <dir>/raw_<camera>_<boot ns>.idx has a RawCaptureIndex per record, in the order they were written
+#define RAW_CAPTURE_ALIGN 4096
+#define RAW_CAPTURE_SLOTS 8
+#define RAW_CAPTURE_MAGIC "RAWBAYR1"
+
+struct RawCaptureHeader {
+  char magic[8];
+  // 10 bit pixels packed like the debayer reads them
+  uint32_t frame_width, frame_height, frame_stride;
+  uint32_t bayer_flip, hdr;
+  uint32_t frame_size, record_size;
+};
+
+struct RawCaptureFrame {
+  uint32_t frame_id;
+  uint32_t frame_length, integ_lines, global_gain;
+  uint64_t timestamp_sof, timestamp_eof;
+  float gain_frac;
+};
+
+struct RawCaptureIndex {
+  uint32_t frame_id;
+  uint32_t record;
+  uint64_t timestamp_eof;
+};
+
+class RawCapture {
+public:
+  // Null when RAW_CAPTURE doesn't ask for this camera or the files can't be opened
+  static std::unique_ptr<RawCapture> create(const char *camera_name, const CameraInfo &ci);
+  ~RawCapture();
+
+  // Copies the camera thread's current frame into a free slot, for the writer
+  void push(CameraBuf *b);
+
+private:
+  RawCapture(int fd, int idx_fd, const std::string &path, const CameraInfo &ci);
+  void run();
+
+  int fd, idx_fd;
+  std::string path;
+  size_t frame_size, record_size;
+  uint8_t *slots = nullptr;
+
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable cv;
+  bool exit = false;
+  // slots head..tail are filled and waiting for the writer
+  uint64_t head = 0, tail = 0;
+  uint64_t records = 0, dropped = 0;
+};
@@ -33,16 +33,12 @@ float to_normal(uint x) {
   return pv;
 }
 
-__kernel void debayer10(const __global uchar * in,
-                        __global uchar * out,
-                        __local float * cached
-                       )
-{
+// Loads the work group's pixels into cached and debayers this one. Every work item reaches the
+// barrier once, the 1 pixel frame border has no neighbours and returns false
+bool debayer_pixel(const __global uchar * in, __local float * cached, float3 *out_rgb) {
   const int x_global = get_global_id(0);
   const int y_global = get_global_id(1);
 
-  // const int globalOffset = ;
-
   const int localRowLen = 2 + get_local_size(0); // 2 padding
   const int x_local = get_local_id(0);
   const int y_local = get_local_id(1);
@@ -59,70 +55,152 @@ __kernel void debayer10(const __global uchar * in,
   // edges
   if (x_global < 1 || x_global > RGB_WIDTH - 2 || y_global < 1 || y_global > RGB_HEIGHT - 2) {
     barrier(CLK_LOCAL_MEM_FENCE);
-    return;
-  } else {
-    int localColOffset = -1;
-    int globalColOffset = -1;
-
-    // cache padding
-    if (x_local < 1) {
-      localColOffset = x_local;
-      globalColOffset = -1;
-      cached[(y_local + 1) * localRowLen + x_local] = to_normal(int_from_10(in, y_global * FRAME_STRIDE + (5 * ((x_global-1) / 4)), (offset_10 + 3) % 4));
-    } else if (x_local >= get_local_size(0) - 1) {
-      localColOffset = x_local + 2;
-      globalColOffset = 1;
-      cached[localOffset + 1] = to_normal(int_from_10(in, y_global * FRAME_STRIDE + (5 * ((x_global+1) / 4)), (offset_10 + 1) % 4));
+    return false;
+  }
+
+  int localColOffset = -1;
+  int globalColOffset = -1;
+
+  // cache padding
+  if (x_local < 1) {
+    localColOffset = x_local;
+    globalColOffset = -1;
+    cached[(y_local + 1) * localRowLen + x_local] = to_normal(int_from_10(in, y_global * FRAME_STRIDE + (5 * ((x_global-1) / 4)), (offset_10 + 3) % 4));
+  } else if (x_local >= get_local_size(0) - 1) {
+    localColOffset = x_local + 2;
+    globalColOffset = 1;
+    cached[localOffset + 1] = to_normal(int_from_10(in, y_global * FRAME_STRIDE + (5 * ((x_global+1) / 4)), (offset_10 + 1) % 4));
+  }
+
+  if (y_local < 1) {
+    cached[y_local * localRowLen + x_local + 1] = to_normal(int_from_10(in, globalStart_10 - FRAME_STRIDE, offset_10));
+    if (localColOffset != -1) {
+      cached[y_local * localRowLen + localColOffset] = to_normal(int_from_10(in, (y_global-1) * FRAME_STRIDE + (5 * ((x_global+globalColOffset) / 4)), (offset_10+4+globalColOffset) % 4));
+    }
+  } else if (y_local >= get_local_size(1) - 1) {
+    cached[(y_local + 2) * localRowLen + x_local + 1] = to_normal(int_from_10(in, globalStart_10 + FRAME_STRIDE, offset_10));
+    if (localColOffset != -1) {
+      cached[(y_local + 2) * localRowLen + localColOffset] = to_normal(int_from_10(in, (y_global+1) * FRAME_STRIDE + (5 * ((x_global+globalColOffset) / 4)), (offset_10+4+globalColOffset) % 4));
     }
+  }
 
-    if (y_local < 1) {
-      cached[y_local * localRowLen + x_local + 1] = to_normal(int_from_10(in, globalStart_10 - FRAME_STRIDE, offset_10));
-      if (localColOffset != -1) {
-        cached[y_local * localRowLen + localColOffset] = to_normal(int_from_10(in, (y_global-1) * FRAME_STRIDE + (5 * ((x_global+globalColOffset) / 4)), (offset_10+4+globalColOffset) % 4));
-      }
-    } else if (y_local >= get_local_size(1) - 1) {
-      cached[(y_local + 2) * localRowLen + x_local + 1] = to_normal(int_from_10(in, globalStart_10 + FRAME_STRIDE, offset_10));
-      if (localColOffset != -1) {
-        cached[(y_local + 2) * localRowLen + localColOffset] = to_normal(int_from_10(in, (y_global+1) * FRAME_STRIDE + (5 * ((x_global+globalColOffset) / 4)), (offset_10+4+globalColOffset) % 4));
-      }
+  // sync
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // perform debayer
+  float r;
+  float g;
+  float b;
+
+  if (x_global % 2 == 0) {
+    if (y_global % 2 == 0) { // G1
+      r = (cached[localOffset - 1] + cached[localOffset + 1]) / 2.0f;
+      g = (cached[localOffset] + cached[localOffset + localRowLen + 1]) / 2.0f;
+      b = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen]) / 2.0f;
+    } else { // B
+      r = (cached[localOffset - localRowLen - 1] + cached[localOffset - localRowLen + 1] + cached[localOffset + localRowLen - 1] + cached[localOffset + localRowLen + 1]) / 4.0f;
+      g = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen] + cached[localOffset - 1] + cached[localOffset + 1]) / 4.0f;
+      b = cached[localOffset];
+    }
+  } else {
+    if (y_global % 2 == 0) { // R
+      r = cached[localOffset];
+      g = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen] + cached[localOffset - 1] + cached[localOffset + 1]) / 4.0f;
+      b = (cached[localOffset - localRowLen - 1] + cached[localOffset - localRowLen + 1] + cached[localOffset + localRowLen - 1] + cached[localOffset + localRowLen + 1]) / 4.0f;
+    } else { // G2
+      r = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen]) / 2.0f;
+      g = (cached[localOffset] + cached[localOffset - localRowLen - 1]) / 2.0f;
+      b = (cached[localOffset - 1] + cached[localOffset + 1]) / 2.0f;
     }
+  }
 
-    // sync
-    barrier(CLK_LOCAL_MEM_FENCE);
+  *out_rgb = color_correct(r, g, b);
+  // *out_rgb = srgb_gamma(*out_rgb);
+  return true;
+}
+
+__kernel void debayer10(const __global uchar * in,
+                        __global uchar * out,
+                        __local float * cached
+                       )
+{
+  const int x_global = get_global_id(0);
+  const int y_global = get_global_id(1);
+
+  float3 rgb;
+  if (!debayer_pixel(in, cached, &rgb)) return;
+
+  // BGR output
+  out[3 * x_global + 3 * y_global * RGB_WIDTH + 0] = (uchar)(255.0f * rgb.z);
+  out[3 * x_global + 3 * y_global * RGB_WIDTH + 1] = (uchar)(255.0f * rgb.y);
+  out[3 * x_global + 3 * y_global * RGB_WIDTH + 2] = (uchar)(255.0f * rgb.x);
+}
+
+// the same conversion as rgb_to_yuv.cl
+#define RGB_TO_Y(r, g, b) ((((mul24(b, 13) + mul24(g, 65) + mul24(r, 33)) + 64) >> 7) + 16)
+#define RGB_TO_U(r, g, b) ((mul24(b, 56) - mul24(g, 37) - mul24(r, 19) + 0x8080) >> 8)
+#define RGB_TO_V(r, g, b) ((mul24(r, 56) - mul24(g, 47) - mul24(b, 9) + 0x8080) >> 8)
+#define UV_WIDTH (RGB_WIDTH / 2)
+#define UV_HEIGHT (RGB_HEIGHT / 2)
+
+// debayer10 and rgb_to_yuv in one pass, the rgb of the work group stays in local memory for the
+// 2x2 chroma. The rgb frame is only written with write_rgb, the border pixels are black in the yuv.
+// The y of every ae_skip'th pixel in ae_rect (x0, y0, x1, y1) is binned into ae_hist for auto exposure
+__kernel void debayer10_yuv(const __global uchar * in,
+                            __global uchar * out,
+                            __local float * cached,
+                            __global uchar * out_yuv,
+                            int write_rgb,
+                            __global uint * ae_hist,
+                            int4 ae_rect,
+                            int2 ae_skip
+                           )
+{
+  __local uchar4 bgr_local[DEBAYER_LOCAL_WORKSIZE * DEBAYER_LOCAL_WORKSIZE];
+  __local uint hist_local[256];
 
-    // perform debayer
-    float r;
-    float g;
-    float b;
-
-    if (x_global % 2 == 0) {
-      if (y_global % 2 == 0) { // G1
-        r = (cached[localOffset - 1] + cached[localOffset + 1]) / 2.0f;
-        g = (cached[localOffset] + cached[localOffset + localRowLen + 1]) / 2.0f;
-        b = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen]) / 2.0f;
-      } else { // B
-        r = (cached[localOffset - localRowLen - 1] + cached[localOffset - localRowLen + 1] + cached[localOffset + localRowLen - 1] + cached[localOffset + localRowLen + 1]) / 4.0f;
-        g = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen] + cached[localOffset - 1] + cached[localOffset + 1]) / 4.0f;
-        b = cached[localOffset];
-      }
-    } else {
-      if (y_global % 2 == 0) { // R
-        r = cached[localOffset];
-        g = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen] + cached[localOffset - 1] + cached[localOffset + 1]) / 4.0f;
-        b = (cached[localOffset - localRowLen - 1] + cached[localOffset - localRowLen + 1] + cached[localOffset + localRowLen - 1] + cached[localOffset + localRowLen + 1]) / 4.0f;
-      } else { // G2
-        r = (cached[localOffset - localRowLen] + cached[localOffset + localRowLen]) / 2.0f;
-        g = (cached[localOffset] + cached[localOffset - localRowLen - 1]) / 2.0f;
-        b = (cached[localOffset - 1] + cached[localOffset + 1]) / 2.0f;
-      }
+  const int x_global = get_global_id(0);
+  const int y_global = get_global_id(1);
+  const int x_local = get_local_id(0);
+  const int y_local = get_local_id(1);
+  const int local_idx = y_local * get_local_size(0) + x_local;
+  const int local_items = get_local_size(0) * get_local_size(1);
+  for (int i = local_idx; i < 256; i += local_items) hist_local[i] = 0;
+
+  float3 rgb;
+  uchar4 bgr = (uchar4)(0, 0, 0, 0);
+  if (debayer_pixel(in, cached, &rgb)) {
+    bgr = (uchar4)((uchar)(255.0f * rgb.z), (uchar)(255.0f * rgb.y), (uchar)(255.0f * rgb.x), 0);
+    if (write_rgb) {
+      vstore3(bgr.xyz, 0, out + 3 * x_global + 3 * y_global * RGB_WIDTH);
     }
+  }
+  bgr_local[local_idx] = bgr;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  const uchar y = RGB_TO_Y((int)bgr.z, (int)bgr.y, (int)bgr.x);
+  out_yuv[y_global * RGB_WIDTH + x_global] = y;
 
-    float3 rgb = color_correct(r, g, b);
-    // rgb = srgb_gamma(rgb); 
+  // binned per work group first, so the global atomics are one per bin
+  if (x_global >= ae_rect.x && x_global < ae_rect.z && (x_global - ae_rect.x) % ae_skip.x == 0 &&
+      y_global >= ae_rect.y && y_global < ae_rect.w && (y_global - ae_rect.y) % ae_skip.y == 0) {
+    atomic_inc(&hist_local[y]);
+  }
+
+  // the work groups are even sized, so each 2x2 block is in one
+  if ((x_global & 1) == 0 && (y_global & 1) == 0) {
+    const int4 p0 = convert_int4(bgr);
+    const int4 p1 = convert_int4(bgr_local[local_idx + 1]);
+    const int4 p2 = convert_int4(bgr_local[local_idx + get_local_size(0)]);
+    const int4 p3 = convert_int4(bgr_local[local_idx + get_local_size(0) + 1]);
+    const int4 a = (p0 + p1 + p2 + p3 + 1) >> 1;
+    const int uv_idx = (y_global / 2) * UV_WIDTH + x_global / 2;
+    out_yuv[RGB_WIDTH * RGB_HEIGHT + uv_idx] = RGB_TO_U(a.z, a.y, a.x);
+    out_yuv[RGB_WIDTH * RGB_HEIGHT + UV_WIDTH * UV_HEIGHT + uv_idx] = RGB_TO_V(a.z, a.y, a.x);
+  }
 
-    // BGR output
-    out[3 * x_global + 3 * y_global * RGB_WIDTH + 0] = (uchar)(255.0f * rgb.z);
-    out[3 * x_global + 3 * y_global * RGB_WIDTH + 1] = (uchar)(255.0f * rgb.y);
-    out[3 * x_global + 3 * y_global * RGB_WIDTH + 2] = (uchar)(255.0f * rgb.x);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int i = local_idx; i < 256; i += local_items) {
+    if (hist_local[i]) atomic_add(&ae_hist[i], hist_local[i]);
   }
 }
@@ -0,0 +1,173 @@
+#include "v4l2_capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <utility>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include <jpeglib.h>
+
+#include "common/swaglog.h"
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int ret;
+  do {
+    ret = ioctl(fd, request, arg);
+  } while (ret == -1 && errno == EINTR);
+  return ret;
+}
+
+V4L2Capture::~V4L2Capture() {
+  if (fd < 0) return;
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  xioctl(fd, VIDIOC_STREAMOFF, &type);
+  for (size_t i = 0; i < addrs.size(); i++) {
+    munmap(addrs[i], lens[i]);
+  }
+  close(fd);
+}
+
+bool V4L2Capture::open(const char *device, int req_width, int req_height, int fps) {
+  fd = ::open(device, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    LOGE("can't open %s: %s", device, strerror(errno));
+    return false;
+  }
+
+  struct v4l2_format fmt = {};
+  fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  fmt.fmt.pix.width = req_width;
+  fmt.fmt.pix.height = req_height;
+  fmt.fmt.pix.field = V4L2_FIELD_ANY;
+  for (uint32_t pixfmt : {V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_YUYV}) {
+    fmt.fmt.pix.pixelformat = pixfmt;
+    if (xioctl(fd, VIDIOC_S_FMT, &fmt) == 0 && fmt.fmt.pix.pixelformat == pixfmt) break;
+  }
+  if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG && fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+    LOGE("%s supports neither MJPEG nor YUYV", device);
+    return false;
+  }
+  mjpeg = fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG;
+  width = fmt.fmt.pix.width;
+  height = fmt.fmt.pix.height;
+
+  struct v4l2_streamparm parm = {};
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  parm.parm.capture.timeperframe.numerator = 1;
+  parm.parm.capture.timeperframe.denominator = fps;
+  xioctl(fd, VIDIOC_S_PARM, &parm);
+
+  struct v4l2_requestbuffers req = {};
+  req.count = V4L2_CAPTURE_BUF_COUNT;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(fd, VIDIOC_REQBUFS, &req) != 0 || req.count < 2) {
+    LOGE("%s has no mmap streaming: %s", device, strerror(errno));
+    return false;
+  }
+
+  for (uint32_t i = 0; i < req.count; i++) {
+    struct v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if (xioctl(fd, VIDIOC_QUERYBUF, &buf) != 0) return false;
+
+    void *addr = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+    if (addr == MAP_FAILED) return false;
+    addrs.push_back(addr);
+    lens.push_back(buf.length);
+    requeue(i);
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_STREAMON, &type) != 0) {
+    LOGE("%s won't stream: %s", device, strerror(errno));
+    return false;
+  }
+  LOG("%s streaming %dx%d %s at %d fps", device, width, height, mjpeg ? "MJPEG" : "YUYV", fps);
+  return true;
+}
+
+bool V4L2Capture::dequeue(V4L2Frame *frame, int timeout_ms) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+
+  struct v4l2_buffer buf = {};
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(fd, VIDIOC_DQBUF, &buf) != 0) return false;
+
+  frame->index = buf.index;
+  frame->data = (const uint8_t *)addrs[buf.index];
+  frame->len = buf.bytesused;
+  frame->sequence = buf.sequence;
+  frame->mjpeg = mjpeg;
+  return true;
+}
+
+void V4L2Capture::requeue(int index) {
+  struct v4l2_buffer buf = {};
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  buf.index = index;
+  if (xioctl(fd, VIDIOC_QBUF, &buf) != 0) {
+    LOGE("VIDIOC_QBUF %d failed: %s", index, strerror(errno));
+  }
+}
+
+struct JpegError {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  // webcams send the odd truncated frame, drop it instead of exiting
+  longjmp(((JpegError *)cinfo->err)->jump, 1);
+}
+
+bool decode_mjpeg_bgr(const uint8_t *data, size_t len, uint8_t *bgr, int width, int height) {
+  struct jpeg_decompress_struct cinfo;
+  JpegError err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_error_exit;
+  err.mgr.output_message = [](j_common_ptr) {};
+  jpeg_create_decompress(&cinfo);
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_mem_src(&cinfo, (unsigned char *)data, len);
+  jpeg_read_header(&cinfo, true);
+  if ((int)cinfo.image_width != width || (int)cinfo.image_height != height) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+#ifdef JCS_EXTENSIONS
+  // libjpeg-turbo writes bgr directly
+  cinfo.out_color_space = JCS_EXT_BGR;
+#else
+  cinfo.out_color_space = JCS_RGB;
+#endif
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = bgr + cinfo.output_scanline * width * 3;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+#ifndef JCS_EXTENSIONS
+    for (int x = 0; x < width; x++) std::swap(row[x*3], row[x*3+2]);
+#endif
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define V4L2_CAPTURE_BUF_COUNT 4
+
+struct V4L2Frame {
+  int index;             // the driver's buffer, hand it back with requeue
+  const uint8_t *data;
+  size_t len;
+  uint32_t sequence;
+  bool mjpeg;
+};
+
+// Streams a V4L2 capture device through mmaped driver buffers, no copy on the way out. Prefers
+// MJPEG, which usb webcams deliver at higher resolutions and rates, and falls back to YUYV
+class V4L2Capture {
+public:
+  ~V4L2Capture();
+  bool open(const char *device, int width, int height, int fps);
+  // Blocks up to timeout_ms for the next filled buffer
+  bool dequeue(V4L2Frame *frame, int timeout_ms);
+  void requeue(int index);
+
+  int width = 0, height = 0;
+
+private:
+  int fd = -1;
+  bool mjpeg = false;
+  std::vector<void *> addrs;
+  std::vector<size_t> lens;
+};
+
+// MJPEG frame to packed BGR, false if the frame is corrupt
+bool decode_mjpeg_bgr(const uint8_t *data, size_t len, uint8_t *bgr, int width, int height);
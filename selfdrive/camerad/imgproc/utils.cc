@@ -5,33 +5,30 @@
 // calculate score based on laplacians in one area
 uint16_t get_lapmap_one(const int16_t *lap, int x_pitch, int y_pitch) {
   const int size = x_pitch * y_pitch;
-  // avg and max of roi
+  // avg, max and sum of squares of roi in one pass, plain loops the compiler vectorizes
   int16_t max = 0;
-  int sum = 0;
+  int64_t sum = 0;
+  int64_t sum_sq = 0;
   for (int i = 0; i < size; ++i) {
-    const int16_t v = lap[i % x_pitch + (i / x_pitch) * x_pitch];
+    const int32_t v = lap[i];
     sum += v;
-    if (v > max) max = v;
+    sum_sq += v * v;
+    max = std::max(max, (int16_t)v);
   }
 
   const int16_t mean = sum / size;
 
-  // var of roi
-  int var = 0;
-  for (int i = 0; i < size; ++i) {
-    var += std::pow(lap[i % x_pitch + (i / x_pitch) * x_pitch] - mean, 2);
-  }
+  // var of roi, sum((v - mean)^2) expanded
+  const int64_t var = sum_sq - 2 * mean * sum + (int64_t)size * mean * mean;
 
   const float fvar = (float)var / size;
   return std::min(5 * fvar + max, (float)65535);
 }
 
 bool is_blur(const uint16_t *lapmap, const size_t size) {
-  float bad_sum = 0;
-  for (int i = 0; i < size; i++) {
-    if (lapmap[i] < LM_THRESH) {
-      bad_sum += 1 / (float)size;
-    }
+  size_t bad = 0;
+  for (size_t i = 0; i < size; i++) {
+    bad += lapmap[i] < LM_THRESH;
   }
-  return (bad_sum > LM_PREC_THRESH);
+  return (bad > LM_PREC_THRESH * size);
 }
\ No newline at end of file
@@ -32,32 +32,26 @@ void party(cl_device_id device_id, cl_context context) {
   cameras_init(&vipc_server, &cameras, device_id, context);
   cameras_open(&cameras);
 
+  size_t total = 0;
+  for (const auto &[stream, mem] : vipc_server.memory_usage()) {
+    LOG("vipc %s: %zu buffers of at most %zu, %.1f MB", stream.c_str(), mem.buffers, mem.max_buffers, mem.bytes / 1e6);
+    total += mem.bytes;
+  }
+  LOG("vipc buffers %.1f MB", total / 1e6);
+
   vipc_server.start_listener();
 
+  notify_ready("camerad");
   cameras_run(&cameras);
 }
 
-#ifdef QCOM
-#include "CL/cl_ext_qcom.h"
-#endif
-
 int main(int argc, char *argv[]) {
-  set_realtime_priority(53);
-#if defined(QCOM)
-  set_core_affinity(2);
-#elif defined(QCOM2)
-  set_core_affinity(6);
-#endif
+  set_sched_profile("camerad");
 
   cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
 
-   // TODO: do this for QCOM2 too
-#if defined(QCOM)
-  const cl_context_properties props[] = {CL_CONTEXT_PRIORITY_HINT_QCOM, CL_PRIORITY_HINT_HIGH_QCOM, 0};
-  cl_context context = CL_CHECK_ERR(clCreateContext(props, 1, &device_id, NULL, NULL, &err));
-#else
-  cl_context context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
-#endif
+  // above the models', see cl_gpu_priority
+  cl_context context = cl_create_context(device_id, cl_gpu_priority_from_env("CAMERAD_GPU_PRIORITY", CL_GPU_PRIORITY_HIGH));
 
   party(device_id, context);
 
@@ -0,0 +1,190 @@
+// Times the OpenCL kernels of the vision pipeline on synthetic frames at the EON and tici sizes:
+// the debayer, rgb_to_yuv and the model warp into its tensor. Each runs the way the pipeline queues it,
+// and then over a grid of local work sizes. Run from selfdrive/camerad
+//   test/vision_kernel_bench [iterations, default 100]
+// Prints the median us/frame and the GB/s of the bytes read and written
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/clutil.h"
+#include "transforms/rgb_to_yuv.h"
+#include "models/commonmodel.h"
+
+namespace {
+
+struct Resolution {
+  const char *name;
+  int frame_width, frame_height, frame_stride;
+  // the tici debayers at full resolution, the EON to half
+  bool full_res_debayer;
+};
+
+const Resolution resolutions[] = {
+  {"eon", 2328, 1748, 2912, false},
+  {"tici", 1928, 1208, 2416, true},
+};
+
+const size_t local_sizes_1d[][2] = {{16, 1}, {32, 1}, {64, 1}, {128, 1}, {256, 1}};
+const size_t local_sizes_2d[][2] = {{4, 4}, {8, 8}, {16, 16}, {32, 4}, {32, 8}, {64, 4}, {8, 32}};
+
+int iterations = 100;
+
+double median_us(cl_command_queue q, const std::function<void()> &queue) {
+  for (int i = 0; i < 5; i++) queue();
+  CL_CHECK(clFinish(q));
+
+  std::vector<double> us;
+  for (int i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    queue();
+    CL_CHECK(clFinish(q));
+    us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::nth_element(us.begin(), us.begin() + us.size() / 2, us.end());
+  return us[us.size() / 2];
+}
+
+void report(const char *res, const char *kernel, const std::string &local, size_t bytes, double us) {
+  printf("%-6s %-14s %-10s %10.1f %8.2f\n", res, kernel, local.c_str(), us, bytes / (us * 1e3));
+}
+
+// The kernel, with its arguments set, over the local sizes that divide global and fit the device.
+// rounds_up kernels check their bounds, global is rounded up to the local size for them
+void local_grid(cl_command_queue q, cl_device_id device_id, const char *res, const char *name, cl_kernel krnl,
+                cl_uint dims, const size_t *global, size_t bytes, bool rounds_up = false,
+                const std::function<void(const size_t *)> &set_local = nullptr) {
+  size_t max_group = 0;
+  CL_CHECK(clGetKernelWorkGroupInfo(krnl, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL));
+
+  const size_t (*sizes)[2] = dims == 1 ? local_sizes_1d : local_sizes_2d;
+  const size_t num_sizes = dims == 1 ? std::size(local_sizes_1d) : std::size(local_sizes_2d);
+  for (size_t i = 0; i < num_sizes; i++) {
+    const size_t *local = sizes[i];
+    size_t g[2] = {global[0], dims == 2 ? global[1] : 1};
+    if (local[0] * local[1] > max_group) continue;
+    if (rounds_up) {
+      for (int d = 0; d < 2; d++) g[d] = (g[d] + local[d] - 1) / local[d] * local[d];
+    } else if (g[0] % local[0] != 0 || g[1] % local[1] != 0) {
+      continue;
+    }
+
+    if (set_local) set_local(local);
+    const double us = median_us(q, [&]() {
+      CL_CHECK(clEnqueueNDRangeKernel(q, krnl, dims, NULL, g, local, 0, NULL, NULL));
+    });
+    report(res, name, dims == 1 ? std::to_string(local[0]) : std::to_string(local[0]) + "x" + std::to_string(local[1]), bytes, us);
+  }
+}
+
+cl_mem random_buffer(cl_context ctx, cl_command_queue q, size_t size) {
+  std::vector<uint8_t> dat(size);
+  std::mt19937 gen(size);
+  for (auto &b : dat) b = gen();
+  cl_mem buf = CL_CHECK_ERR(clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, NULL, &err));
+  CL_CHECK(clEnqueueWriteBuffer(q, buf, CL_TRUE, 0, size, dat.data(), 0, NULL, NULL));
+  return buf;
+}
+
+void bench(cl_device_id device_id, cl_context ctx, cl_command_queue q, const Resolution &r) {
+  const int rgb_width = r.full_res_debayer ? r.frame_width : r.frame_width / 2;
+  const int rgb_height = r.full_res_debayer ? r.frame_height : r.frame_height / 2;
+  const int rgb_stride = rgb_width * 3;
+  const size_t frame_size = (size_t)r.frame_stride * r.frame_height;
+  const size_t rgb_size = (size_t)rgb_stride * rgb_height;
+  const size_t yuv_size = (size_t)rgb_width * rgb_height * 3 / 2;
+
+  cl_mem frame_cl = random_buffer(ctx, q, frame_size);
+  cl_mem rgb_cl = random_buffer(ctx, q, rgb_size);
+  cl_mem yuv_cl = random_buffer(ctx, q, yuv_size);
+
+  // debayer, like camerad builds it
+  char args[4096];
+  snprintf(args, sizeof(args),
+           "-cl-fast-relaxed-math -cl-denorms-are-zero "
+           "-DFRAME_WIDTH=%d -DFRAME_HEIGHT=%d -DFRAME_STRIDE=%d "
+           "-DRGB_WIDTH=%d -DRGB_HEIGHT=%d -DRGB_STRIDE=%d "
+           "-DBAYER_FLIP=0 -DHDR=0 -DDEBAYER_LOCAL_WORKSIZE=16",
+           r.frame_width, r.frame_height, r.frame_stride, rgb_width, rgb_height, rgb_stride);
+  cl_program prg = cl_program_from_file(ctx, device_id, r.full_res_debayer ? "cameras/real_debayer.cl" : "cameras/debayer.cl", args);
+  cl_kernel debayer = CL_CHECK_ERR(clCreateKernel(prg, "debayer10", &err));
+  CL_CHECK(clReleaseProgram(prg));
+  CL_CHECK(clSetKernelArg(debayer, 0, sizeof(cl_mem), &frame_cl));
+  CL_CHECK(clSetKernelArg(debayer, 1, sizeof(cl_mem), &rgb_cl));
+  if (r.full_res_debayer) {
+    // a work group's pixels and a border of one in local memory
+    const size_t global[] = {(size_t)r.frame_width, (size_t)r.frame_height};
+    local_grid(q, device_id, r.name, "debayer", debayer, 2, global, frame_size + rgb_size, false, [&](const size_t *local) {
+      CL_CHECK(clSetKernelArg(debayer, 2, (local[0] + 2) * (local[1] + 2) * sizeof(float), NULL));
+    });
+  } else {
+    const float gain = 1.0;
+    CL_CHECK(clSetKernelArg(debayer, 2, sizeof(float), &gain));
+    const size_t global[] = {(size_t)rgb_height};
+    report(r.name, "debayer", "driver", frame_size + rgb_size, median_us(q, [&]() {
+      CL_CHECK(clEnqueueNDRangeKernel(q, debayer, 1, NULL, global, NULL, 0, NULL, NULL));
+    }));
+    local_grid(q, device_id, r.name, "debayer", debayer, 1, global, frame_size + rgb_size, true);
+  }
+  CL_CHECK(clReleaseKernel(debayer));
+
+  // rgb_to_yuv, its arguments stay set from the pipeline's call
+  RGBToYUVState rgb_to_yuv;
+  rgb_to_yuv_init(&rgb_to_yuv, ctx, device_id, rgb_width, rgb_height, rgb_stride);
+  report(r.name, "rgb_to_yuv", "driver", rgb_size + yuv_size, median_us(q, [&]() {
+    rgb_to_yuv_queue(&rgb_to_yuv, q, rgb_cl, yuv_cl);
+  }));
+  const size_t rgb_to_yuv_global[] = {(size_t)(rgb_width + 3) / 4, (size_t)(rgb_height + 3) / 4};
+  local_grid(q, device_id, r.name, "rgb_to_yuv", rgb_to_yuv.rgb_to_yuv_krnl, 2, rgb_to_yuv_global, rgb_size + yuv_size);
+  rgb_to_yuv_destroy(&rgb_to_yuv);
+
+  // the model warp of the middle of the frame, straight into the model tensor
+  ModelFrame frame;
+  frame_init(&frame, DRIVING_MODEL_WIDTH, DRIVING_MODEL_HEIGHT, device_id, ctx);
+  const float scale = 0.5 * rgb_width / DRIVING_MODEL_WIDTH;
+  const mat3 projection = {{
+    scale, 0.0, rgb_width / 4.0f,
+    0.0, scale, rgb_height / 4.0f,
+    0.0, 0.0, 1.0,
+  }};
+  // roughly a sample read per float written
+  const size_t model_bytes = (size_t)DRIVING_MODEL_WIDTH * DRIVING_MODEL_HEIGHT * 3 / 2 * (1 + sizeof(float));
+  report(r.name, "warp tensor", "driver", model_bytes, median_us(q, [&]() {
+    transform_queue_tensor(&frame.transform, q, yuv_cl, rgb_width, rgb_height, frame.net_input,
+                           frame.width, frame.height, projection);
+  }));
+  const size_t tensor_global[] = {(size_t)frame.width / 2, (size_t)frame.height / 2};
+  local_grid(q, device_id, r.name, "warp tensor", frame.transform.tensor_krnl, 2, tensor_global, model_bytes, true);
+  frame_free(&frame);
+
+  CL_CHECK(clReleaseMemObject(yuv_cl));
+  CL_CHECK(clReleaseMemObject(rgb_cl));
+  CL_CHECK(clReleaseMemObject(frame_cl));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc > 1) iterations = std::max(1, atoi(argv[1]));
+
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context ctx = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  cl_command_queue q = CL_CHECK_ERR(clCreateCommandQueue(ctx, device_id, 0, &err));
+
+  printf("%-6s %-14s %-10s %10s %8s\n", "res", "kernel", "local", "us/frame", "GB/s");
+  for (const auto &r : resolutions) {
+    bench(device_id, ctx, q, r);
+  }
+
+  CL_CHECK(clReleaseCommandQueue(q));
+  CL_CHECK(clReleaseContext(ctx));
+  return 0;
+}
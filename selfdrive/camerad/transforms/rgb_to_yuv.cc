@@ -31,15 +31,19 @@ void rgb_to_yuv_destroy(RGBToYUVState* s) {
   CL_CHECK(clReleaseKernel(s->rgb_to_yuv_krnl));
 }
 
-void rgb_to_yuv_queue(RGBToYUVState* s, cl_command_queue q, cl_mem rgb_cl, cl_mem yuv_cl) {
+void rgb_to_yuv_queue(RGBToYUVState* s, cl_command_queue q, cl_mem rgb_cl, cl_mem yuv_cl, cl_event *event) {
   CL_CHECK(clSetKernelArg(s->rgb_to_yuv_krnl, 0, sizeof(cl_mem), &rgb_cl));
   CL_CHECK(clSetKernelArg(s->rgb_to_yuv_krnl, 1, sizeof(cl_mem), &yuv_cl));
   const size_t work_size[2] = {
     (size_t)(s->width + (s->width % 4 == 0 ? 0 : (4 - s->width % 4))) / 4,
     (size_t)(s->height + (s->height % 4 == 0 ? 0 : (4 - s->height % 4))) / 4
   };
-  cl_event event;
-  CL_CHECK(clEnqueueNDRangeKernel(q, s->rgb_to_yuv_krnl, 2, NULL, &work_size[0], NULL, 0, 0, &event));
-  CL_CHECK(clWaitForEvents(1, &event));
-  CL_CHECK(clReleaseEvent(event));
+  cl_event done;
+  CL_CHECK(clEnqueueNDRangeKernel(q, s->rgb_to_yuv_krnl, 2, NULL, &work_size[0], NULL, 0, 0, &done));
+  if (event) {
+    *event = done;
+    return;
+  }
+  CL_CHECK(clWaitForEvents(1, &done));
+  CL_CHECK(clReleaseEvent(done));
 }
@@ -18,4 +18,5 @@ void rgb_to_yuv_init(RGBToYUVState* s, cl_context ctx, cl_device_id device_id, i
 
 void rgb_to_yuv_destroy(RGBToYUVState* s);
 
-void rgb_to_yuv_queue(RGBToYUVState* s, cl_command_queue q, cl_mem rgb_cl, cl_mem yuv_cl);
+// Blocks until done unless the caller takes the completion event
+void rgb_to_yuv_queue(RGBToYUVState* s, cl_command_queue q, cl_mem rgb_cl, cl_mem yuv_cl, cl_event *event=nullptr);
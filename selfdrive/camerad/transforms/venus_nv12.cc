@@ -0,0 +1,44 @@
+#include <string.h>
+#include <assert.h>
+
+#include "clutil.h"
+
+#include "venus_nv12.h"
+
+void venus_nv12_init(VenusNV12State* s, cl_context ctx, cl_device_id device_id, int width, int height, int y_stride, int uv_offset) {
+  memset(s, 0, sizeof(*s));
+  assert(width % 2 == 0);
+  assert(height % 2 == 0);
+  assert(y_stride >= width);
+  s->width = width;
+  s->height = height;
+  char args[1024];
+  snprintf(args, sizeof(args),
+           "-cl-fast-relaxed-math -cl-denorms-are-zero "
+           "-DWIDTH=%d -DHEIGHT=%d -DY_STRIDE=%d -DUV_OFFSET=%d",
+           width, height, y_stride, uv_offset);
+  cl_program prg = cl_program_from_file(ctx, device_id, "transforms/venus_nv12.cl", args);
+
+  s->venus_nv12_krnl = CL_CHECK_ERR(clCreateKernel(prg, "venus_nv12", &err));
+  // done with this
+  CL_CHECK(clReleaseProgram(prg));
+}
+
+void venus_nv12_destroy(VenusNV12State* s) {
+  CL_CHECK(clReleaseKernel(s->venus_nv12_krnl));
+}
+
+void venus_nv12_queue(VenusNV12State* s, cl_command_queue q, cl_mem yuv_cl, cl_mem nv12_cl, cl_event *event) {
+  CL_CHECK(clSetKernelArg(s->venus_nv12_krnl, 0, sizeof(cl_mem), &yuv_cl));
+  CL_CHECK(clSetKernelArg(s->venus_nv12_krnl, 1, sizeof(cl_mem), &nv12_cl));
+  // One work item per chroma pixel
+  const size_t work_size[2] = {(size_t)s->width / 2, (size_t)s->height / 2};
+  cl_event done;
+  CL_CHECK(clEnqueueNDRangeKernel(q, s->venus_nv12_krnl, 2, NULL, &work_size[0], NULL, 0, 0, &done));
+  if (event) {
+    *event = done;
+    return;
+  }
+  CL_CHECK(clWaitForEvents(1, &done));
+  CL_CHECK(clReleaseEvent(done));
+}
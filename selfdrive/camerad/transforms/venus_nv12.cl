@@ -0,0 +1,21 @@
+#define Y_SIZE (WIDTH * HEIGHT)
+#define UV_WIDTH (WIDTH / 2)
+#define UV_SIZE (UV_WIDTH * (HEIGHT / 2))
+
+// Every work item copies a 2x2 block of luma and interleaves the chroma pixel under it. The padding
+// of the rows and planes is left as it is, the encoder doesn't read it
+__kernel void venus_nv12(__global uchar const * const yuv,
+                         __global uchar * nv12)
+{
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+
+  for (int dy = 0; dy < 2; dy++) {
+    const uchar2 yy = vload2(0, yuv + mad24(2 * y + dy, WIDTH, 2 * x));
+    vstore2(yy, 0, nv12 + mad24(2 * y + dy, Y_STRIDE, 2 * x));
+  }
+
+  const int uvi = mad24(y, UV_WIDTH, x);
+  const uchar2 uv = (uchar2)(yuv[Y_SIZE + uvi], yuv[Y_SIZE + UV_SIZE + uvi]);
+  vstore2(uv, 0, nv12 + UV_OFFSET + mad24(y, Y_STRIDE, 2 * x));
+}
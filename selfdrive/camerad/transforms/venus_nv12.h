@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+typedef struct {
+  int width, height;
+  cl_kernel venus_nv12_krnl;
+} VenusNV12State;
+
+// y_stride and uv_offset of the output buffers, see VISIONBUF_FORMAT_NV12_VENUS
+void venus_nv12_init(VenusNV12State* s, cl_context ctx, cl_device_id device_id, int width, int height, int y_stride, int uv_offset);
+
+void venus_nv12_destroy(VenusNV12State* s);
+
+// Repacks a yuv buffer into the NV12 layout the hardware encoder reads, so it can take the buffer as is.
+// Passing event hands the completion event to the caller instead of waiting for it
+void venus_nv12_queue(VenusNV12State* s, cl_command_queue q, cl_mem yuv_cl, cl_mem nv12_cl, cl_event *event=nullptr);
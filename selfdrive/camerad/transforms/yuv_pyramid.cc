@@ -0,0 +1,48 @@
+#include <string.h>
+#include <assert.h>
+
+#include "clutil.h"
+
+#include "yuv_pyramid.h"
+
+void yuv_pyramid_init(YUVPyramidState* s, cl_context ctx, cl_device_id device_id, int width, int height) {
+  memset(s, 0, sizeof(*s));
+  assert(width % 2 == 0);
+  assert(height % 2 == 0);
+  s->width = width;
+  s->height = height;
+  char args[1024];
+  snprintf(args, sizeof(args),
+           "-cl-fast-relaxed-math -cl-denorms-are-zero "
+           "-DWIDTH=%d -DHEIGHT=%d -DHALF_WIDTH=%d -DHALF_HEIGHT=%d -DQUARTER_WIDTH=%d -DQUARTER_HEIGHT=%d",
+           width, height, YUV_PYRAMID_HALF(width), YUV_PYRAMID_HALF(height),
+           YUV_PYRAMID_QUARTER(width), YUV_PYRAMID_QUARTER(height));
+  cl_program prg = cl_program_from_file(ctx, device_id, "transforms/yuv_pyramid.cl", args);
+
+  s->yuv_pyramid_krnl = CL_CHECK_ERR(clCreateKernel(prg, "yuv_pyramid", &err));
+  // done with this
+  CL_CHECK(clReleaseProgram(prg));
+}
+
+void yuv_pyramid_destroy(YUVPyramidState* s) {
+  CL_CHECK(clReleaseKernel(s->yuv_pyramid_krnl));
+}
+
+void yuv_pyramid_queue(YUVPyramidState* s, cl_command_queue q, cl_mem yuv_cl, cl_mem half_cl, cl_mem quarter_cl, cl_event *event) {
+  CL_CHECK(clSetKernelArg(s->yuv_pyramid_krnl, 0, sizeof(cl_mem), &yuv_cl));
+  CL_CHECK(clSetKernelArg(s->yuv_pyramid_krnl, 1, sizeof(cl_mem), &half_cl));
+  CL_CHECK(clSetKernelArg(s->yuv_pyramid_krnl, 2, sizeof(cl_mem), &quarter_cl));
+  // One work item per half resolution chroma pixel
+  const size_t work_size[2] = {
+    (size_t)YUV_PYRAMID_HALF(s->width) / 2,
+    (size_t)YUV_PYRAMID_HALF(s->height) / 2
+  };
+  cl_event done;
+  CL_CHECK(clEnqueueNDRangeKernel(q, s->yuv_pyramid_krnl, 2, NULL, &work_size[0], NULL, 0, 0, &done));
+  if (event) {
+    *event = done;
+    return;
+  }
+  CL_CHECK(clWaitForEvents(1, &done));
+  CL_CHECK(clReleaseEvent(done));
+}
@@ -0,0 +1,57 @@
+#define Y_SIZE (WIDTH * HEIGHT)
+#define UV_WIDTH (WIDTH / 2)
+#define UV_SIZE (UV_WIDTH * (HEIGHT / 2))
+
+#define HALF_Y_SIZE (HALF_WIDTH * HALF_HEIGHT)
+#define HALF_UV_WIDTH (HALF_WIDTH / 2)
+#define HALF_UV_SIZE (HALF_UV_WIDTH * (HALF_HEIGHT / 2))
+
+#define QUARTER_Y_SIZE (QUARTER_WIDTH * QUARTER_HEIGHT)
+#define QUARTER_UV_WIDTH (QUARTER_WIDTH / 2)
+#define QUARTER_UV_SIZE (QUARTER_UV_WIDTH * (QUARTER_HEIGHT / 2))
+
+// Box filter over a n x n block of a plane
+inline uchar box(__global uchar const * const plane, int stride, int x, int y, int n) {
+  uint sum = 0;
+  for (int dy = 0; dy < n; dy++) {
+    const int row = mad24(y + dy, stride, x);
+    for (int dx = 0; dx < n; dx++) {
+      sum += plane[row + dx];
+    }
+  }
+  return (sum + (n * n) / 2) / (n * n);
+}
+
+// Every work item covers a 4x4 block of the full resolution luma: 2x2 half resolution luma pixels, one
+// half resolution chroma pixel and one quarter resolution luma pixel. Every second work item in both
+// directions also writes a quarter resolution chroma pixel.
+__kernel void yuv_pyramid(__global uchar const * const yuv,
+                          __global uchar * half_yuv,
+                          __global uchar * quarter_yuv)
+{
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+
+  __global uchar const * const in_y = yuv;
+  __global uchar const * const in_u = yuv + Y_SIZE;
+  __global uchar const * const in_v = yuv + Y_SIZE + UV_SIZE;
+
+  for (int dy = 0; dy < 2; dy++) {
+    for (int dx = 0; dx < 2; dx++) {
+      half_yuv[mad24(2 * y + dy, HALF_WIDTH, 2 * x + dx)] = box(in_y, WIDTH, 4 * x + 2 * dx, 4 * y + 2 * dy, 2);
+    }
+  }
+  const int half_uvi = mad24(y, HALF_UV_WIDTH, x);
+  half_yuv[HALF_Y_SIZE + half_uvi] = box(in_u, UV_WIDTH, 2 * x, 2 * y, 2);
+  half_yuv[HALF_Y_SIZE + HALF_UV_SIZE + half_uvi] = box(in_v, UV_WIDTH, 2 * x, 2 * y, 2);
+
+  if (x < QUARTER_WIDTH && y < QUARTER_HEIGHT) {
+    quarter_yuv[mad24(y, QUARTER_WIDTH, x)] = box(in_y, WIDTH, 4 * x, 4 * y, 4);
+
+    if (x % 2 == 0 && y % 2 == 0) {
+      const int quarter_uvi = mad24(y / 2, QUARTER_UV_WIDTH, x / 2);
+      quarter_yuv[QUARTER_Y_SIZE + quarter_uvi] = box(in_u, UV_WIDTH, 2 * x, 2 * y, 4);
+      quarter_yuv[QUARTER_Y_SIZE + QUARTER_UV_SIZE + quarter_uvi] = box(in_v, UV_WIDTH, 2 * x, 2 * y, 4);
+    }
+  }
+}
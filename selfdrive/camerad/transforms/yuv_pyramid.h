@@ -0,0 +1,27 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// Half and quarter resolution sizes, rounded down to even
+#define YUV_PYRAMID_HALF(x) ((x) / 4 * 2)
+#define YUV_PYRAMID_QUARTER(x) ((x) / 8 * 2)
+
+typedef struct {
+  int width, height;
+  cl_kernel yuv_pyramid_krnl;
+} YUVPyramidState;
+
+void yuv_pyramid_init(YUVPyramidState* s, cl_context ctx, cl_device_id device_id, int width, int height);
+
+void yuv_pyramid_destroy(YUVPyramidState* s);
+
+// Downscales a full resolution yuv buffer into a half and a quarter resolution buffer in a single pass.
+// Passing event hands the completion event to the caller instead of waiting for it
+void yuv_pyramid_queue(YUVPyramidState* s, cl_command_queue q, cl_mem yuv_cl, cl_mem half_cl, cl_mem quarter_cl, cl_event *event=nullptr);
@@ -6,6 +6,7 @@ from cereal import car
 from common.kalman.simple_kalman import KF1D
 from common.params import Params
 from common.realtime import DT_CTRL
+from opendbc.can.parser import CANParserGroup
 from selfdrive.car import gen_empty_fingerprint
 from selfdrive.config import Conversions as CV
 from selfdrive.controls.lib.drive_helpers import V_CRUISE_MAX
@@ -32,6 +33,8 @@ class CarInterfaceBase():
       self.cp = self.CS.get_can_parser(CP)
       self.cp_cam = self.CS.get_cam_can_parser(CP)
       self.cp_body = self.CS.get_body_can_parser(CP)
+      # reads each can string once for all of them
+      self.can_parsers = CANParserGroup(p for p in (self.cp, self.cp_cam, self.cp_body) if p is not None)
 
     self.CC = None
     if CarController is not None:
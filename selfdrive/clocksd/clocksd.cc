@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <sys/resource.h>
 #include <sys/time.h>
 
 // Apple doesn't have timerfd
@@ -31,7 +30,7 @@ namespace {
 #endif
 
 int main() {
-  setpriority(PRIO_PROCESS, 0, -13);
+  set_sched_profile("clocksd");
   PubMaster pm({"clocks"});
 
 #ifndef __APPLE__
@@ -0,0 +1,79 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+// Counts the allocations of each thread, see alloc_tracker.h. It's linked into the program
+// itself, whose malloc then takes the place of libc's for every library, and forwards to
+// glibc's own. Other libcs have no counts.
+
+#ifdef __GLIBC__
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+// in the program's static TLS, so counting never allocates
+static thread_local uint64_t alloc_counter;
+static thread_local uint64_t alloc_byte_counter;
+
+static inline void count(size_t size) {
+  alloc_counter++;
+  alloc_byte_counter += size;
+}
+
+extern "C" {
+
+uint64_t alloc_tracker_count() {
+  return alloc_counter;
+}
+
+uint64_t alloc_tracker_bytes() {
+  return alloc_byte_counter;
+}
+
+void *malloc(size_t size) {
+  count(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  count(n * size);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  // freeing doesn't count
+  if (!ptr || size > 0) count(size);
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  count(size);
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  count(size);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+  count(size);
+  void *p = __libc_memalign(alignment, size);
+  if (!p) return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+// Heap allocations per thread, for finding the ones in loops that should have none. Counted
+// only in programs that link alloc_tracker.o, built with scons --alloc-tracker, everywhere else
+// the counts are 0. Trace spans record how many allocations they made, see trace.h.
+//
+//   AllocLoop loop("can_recv");
+//   while (!do_exit) {
+//     loop.iteration();
+//     ...
+//   }
+//
+// Iterations after the first ALLOC_LOOP_WARMUP that allocate are the steady state ones. With
+// ALLOC_TRACKER_STRICT=1 the first of them aborts, for CI. The totals are printed when the loop
+// ends, and written to $ALLOC_TRACKER_REPORT/<name>.json if it's set
+
+#define ALLOC_LOOP_WARMUP 100
+
+extern "C" uint64_t alloc_tracker_count() __attribute__((weak));
+extern "C" uint64_t alloc_tracker_bytes() __attribute__((weak));
+
+// The allocations of the calling thread so far
+inline uint64_t alloc_count() {
+  return alloc_tracker_count ? alloc_tracker_count() : 0;
+}
+
+inline uint64_t alloc_bytes() {
+  return alloc_tracker_bytes ? alloc_tracker_bytes() : 0;
+}
+
+class AllocLoop {
+public:
+  explicit AllocLoop(const char *name, uint64_t warmup = ALLOC_LOOP_WARMUP) : name(name), warmup(warmup) {
+    const char *strict_env = getenv("ALLOC_TRACKER_STRICT");
+    strict = strict_env && strcmp(strict_env, "1") == 0;
+    last_count = alloc_count();
+    last_bytes = alloc_bytes();
+  }
+
+  ~AllocLoop() {
+    if (!alloc_tracker_count) return;
+
+    fprintf(stderr, "alloc tracker %s: %llu iterations, %llu allocating %llu times in steady state, %llu bytes, at most %llu in one\n",
+            name, (unsigned long long)iterations, (unsigned long long)steady_iterations, (unsigned long long)steady_allocs,
+            (unsigned long long)steady_bytes, (unsigned long long)max_allocs);
+
+    const char *dir = getenv("ALLOC_TRACKER_REPORT");
+    if (!dir) return;
+    std::string path = std::string(dir) + "/" + name + ".json";
+    if (FILE *f = fopen(path.c_str(), "w")) {
+      fprintf(f, "{\"iterations\": %llu, \"warmup\": %llu, \"allocatingIterations\": %llu, \"allocs\": %llu, \"bytes\": %llu, \"maxAllocs\": %llu}\n",
+              (unsigned long long)iterations, (unsigned long long)warmup, (unsigned long long)steady_iterations,
+              (unsigned long long)steady_allocs, (unsigned long long)steady_bytes, (unsigned long long)max_allocs);
+      fclose(f);
+    }
+  }
+
+  // Call at the start of each iteration, it counts what the one before allocated
+  void iteration() {
+    const uint64_t count = alloc_count(), bytes = alloc_bytes();
+    const uint64_t allocs = count - last_count, nbytes = bytes - last_bytes;
+    last_count = count;
+    last_bytes = bytes;
+
+    if (iterations++ <= warmup || allocs == 0) return;
+    steady_iterations++;
+    steady_allocs += allocs;
+    steady_bytes += nbytes;
+    max_allocs = std::max(max_allocs, allocs);
+    if (strict) {
+      fprintf(stderr, "alloc tracker %s: iteration %llu allocated %llu times, %llu bytes\n",
+              name, (unsigned long long)iterations - 1, (unsigned long long)allocs, (unsigned long long)nbytes);
+      abort();
+    }
+  }
+
+private:
+  const char *name;
+  const uint64_t warmup;
+  bool strict;
+  uint64_t last_count, last_bytes;
+  uint64_t iterations = 0;
+  uint64_t steady_iterations = 0, steady_allocs = 0, steady_bytes = 0, max_allocs = 0;
+};
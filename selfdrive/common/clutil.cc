@@ -2,12 +2,22 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <chrono>
 #include <memory>
 #include <iostream>
 #include <vector>
 #include "util.h"
 
+// from CL/cl_ext_qcom.h, not in the include path of every device
+#ifndef CL_CONTEXT_PRIORITY_HINT_QCOM
+#define CL_CONTEXT_PRIORITY_HINT_QCOM 0x40C9
+#define CL_PRIORITY_HINT_HIGH_QCOM 0x40CA
+#define CL_PRIORITY_HINT_NORMAL_QCOM 0x40CB
+#define CL_PRIORITY_HINT_LOW_QCOM 0x40CC
+#endif
+
 namespace {  // helper functions
 
 template <typename Func, typename Id, typename Name>
@@ -54,6 +64,77 @@ void cl_print_build_errors(cl_program program, cl_device_id device) {
   std::cout << "build failed; status=" << status << ", log:" << std::endl << log << std::endl; 
 }
 
+// *********** program binary cache ***********
+
+#define CL_CACHE_MAGIC 0x48434c43  // "CLCH"
+#define CL_CACHE_VERSION 1
+
+struct ClCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint64_t binary_size;
+};
+
+uint64_t fnv1a(uint64_t h, const std::string &s) {
+  // the terminating 0 too, so "a" + "bc" and "ab" + "c" differ
+  for (size_t i = 0; i <= s.size(); i++) {
+    h = (h ^ (uint8_t)s.c_str()[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+uint64_t cl_cache_key(cl_device_id device_id, const std::string &src, const char *args) {
+  uint64_t h = fnv1a(0xcbf29ce484222325ULL, src);
+  h = fnv1a(h, args ? args : "");
+  h = fnv1a(h, get_device_info(device_id, CL_DEVICE_NAME));
+  return fnv1a(h, get_device_info(device_id, CL_DRIVER_VERSION));
+}
+
+std::string cl_cache_path(uint64_t key) {
+  const char *dir = getenv("CL_CACHE_DIR");
+  return util::string_format("%s/%016llx.bin", dir ? dir : CL_CACHE_DIR, (unsigned long long)key);
+}
+
+// empty if there's no binary for key
+std::string cl_cache_read(uint64_t key) {
+  std::string dat = util::read_file(cl_cache_path(key));
+  ClCacheHeader hdr;
+  if (dat.size() < sizeof(hdr)) return "";
+  memcpy(&hdr, dat.data(), sizeof(hdr));
+  if (hdr.magic != CL_CACHE_MAGIC || hdr.version != CL_CACHE_VERSION || hdr.key != key ||
+      hdr.binary_size != dat.size() - sizeof(hdr)) {
+    return "";
+  }
+  return dat.substr(sizeof(hdr));
+}
+
+void cl_cache_write(uint64_t key, cl_program prg) {
+  size_t size = 0;
+  CL_CHECK(clGetProgramInfo(prg, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL));
+  if (size == 0) return;
+  std::string binary(size, '\0');
+  unsigned char *binaries[] = {(unsigned char *)binary.data()};
+  CL_CHECK(clGetProgramInfo(prg, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL));
+
+  const char *dir = getenv("CL_CACHE_DIR");
+  mkdir(dir ? dir : CL_CACHE_DIR, 0755);
+
+  // written next to the cache and renamed, so no process ever loads half a binary
+  const std::string path = cl_cache_path(key), tmp_path = path + util::string_format(".%d.tmp", getpid());
+  FILE *f = fopen(tmp_path.c_str(), "wb");
+  if (f == NULL) {
+    std::cout << "can't write program cache " << path << std::endl;
+    return;
+  }
+  ClCacheHeader hdr = {.magic = CL_CACHE_MAGIC, .version = CL_CACHE_VERSION, .key = key, .binary_size = size};
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(binary.data(), size, 1, f) == 1;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
 }  // namespace
 
 cl_device_id cl_get_device_id(cl_device_type device_type) {
@@ -75,14 +156,64 @@ cl_device_id cl_get_device_id(cl_device_type device_type) {
   return nullptr;
 }
 
+cl_gpu_priority cl_gpu_priority_from_env(const char *env, cl_gpu_priority def) {
+  const char *s = getenv(env);
+  if (s == NULL) return def;
+  if (strcmp(s, "high") == 0) return CL_GPU_PRIORITY_HIGH;
+  if (strcmp(s, "normal") == 0) return CL_GPU_PRIORITY_NORMAL;
+  if (strcmp(s, "low") == 0) return CL_GPU_PRIORITY_LOW;
+  std::cout << "unknown gpu priority " << env << "=" << s << std::endl;
+  return def;
+}
+
+int cl_gpu_priority_kgsl(cl_gpu_priority priority) {
+  switch (priority) {
+    case CL_GPU_PRIORITY_HIGH: return 1;
+    case CL_GPU_PRIORITY_NORMAL: return 8;
+    default: return 15;
+  }
+}
+
+cl_context cl_create_context(cl_device_id device_id, cl_gpu_priority priority) {
+  if (get_device_info(device_id, CL_DEVICE_EXTENSIONS).find("cl_qcom_priority_hint") == std::string::npos) {
+    return CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  }
+  const cl_context_properties hints[] = {CL_PRIORITY_HINT_HIGH_QCOM, CL_PRIORITY_HINT_NORMAL_QCOM, CL_PRIORITY_HINT_LOW_QCOM};
+  const cl_context_properties props[] = {CL_CONTEXT_PRIORITY_HINT_QCOM, hints[priority], 0};
+  return CL_CHECK_ERR(clCreateContext(props, 1, &device_id, NULL, NULL, &err));
+}
+
 cl_program cl_program_from_file(cl_context ctx, cl_device_id device_id, const char* path, const char* args) {
+  const auto start = std::chrono::steady_clock::now();
   std::string src = util::read_file(path);
   assert(src.length() > 0);
-  cl_program prg = CL_CHECK_ERR(clCreateProgramWithSource(ctx, 1, (const char*[]){src.c_str()}, NULL, &err));
-  if (int err = clBuildProgram(prg, 1, &device_id, args, NULL, NULL); err != 0) {
-    cl_print_build_errors(prg, device_id);
-    assert(0);
+  const uint64_t key = cl_cache_key(device_id, src, args);
+
+  cl_program prg = NULL;
+  if (std::string binary = cl_cache_read(key); binary.size() > 0) {
+    const size_t size = binary.size();
+    const unsigned char *binaries[] = {(const unsigned char *)binary.data()};
+    cl_int err = CL_SUCCESS, status = CL_SUCCESS;
+    prg = clCreateProgramWithBinary(ctx, 1, &device_id, &size, binaries, &status, &err);
+    if (prg && (err != CL_SUCCESS || status != CL_SUCCESS || clBuildProgram(prg, 1, &device_id, args, NULL, NULL) != CL_SUCCESS)) {
+      std::cout << "cached binary of " << path << " doesn't load, building it" << std::endl;
+      clReleaseProgram(prg);
+      prg = NULL;
+    }
   }
+
+  const bool cached = prg != NULL;
+  if (!cached) {
+    prg = CL_CHECK_ERR(clCreateProgramWithSource(ctx, 1, (const char*[]){src.c_str()}, NULL, &err));
+    if (int err = clBuildProgram(prg, 1, &device_id, args, NULL, NULL); err != 0) {
+      cl_print_build_errors(prg, device_id);
+      assert(0);
+    }
+    cl_cache_write(key, prg);
+  }
+
+  const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  std::cout << path << (cached ? " loaded from the program cache in " : " built in ") << ms << " ms" << std::endl;
   return prg;
 }
 
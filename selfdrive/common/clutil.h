@@ -23,6 +23,27 @@
     _ret;                             \
   })
 
+// the binaries of the programs built by cl_program_from_file, overridden by the CL_CACHE_DIR env var
+#ifndef CL_CACHE_DIR
+#define CL_CACHE_DIR "/data/cl_cache"
+#endif
+
+// The priority the GPU runs a context's work at against the other processes' contexts. camerad's
+// is above the models', so a frame's debayer doesn't wait behind a model run
+typedef enum {
+  CL_GPU_PRIORITY_HIGH,
+  CL_GPU_PRIORITY_NORMAL,
+  CL_GPU_PRIORITY_LOW,
+} cl_gpu_priority;
+
 cl_device_id cl_get_device_id(cl_device_type device_type);
+// The priority in the env var, "high", "normal" or "low", or def when it isn't set
+cl_gpu_priority cl_gpu_priority_from_env(const char *env, cl_gpu_priority def);
+// The KGSL context priority of it, from 1, the highest, to 15
+int cl_gpu_priority_kgsl(cl_gpu_priority priority);
+// A context at the priority, by the cl_qcom_priority_hint extension on the devices with it
+cl_context cl_create_context(cl_device_id device_id, cl_gpu_priority priority);
+// Builds the program from the binary cached for its source, args and the device's driver,
+// or from source, caching the binary, if there's none or it doesn't load
 cl_program cl_program_from_file(cl_context ctx, cl_device_id device_id, const char* path, const char* args);
 const char* cl_get_error_string(int err);
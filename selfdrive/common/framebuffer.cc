@@ -135,6 +135,10 @@ FramebufferState* framebuffer_init(
   success = eglMakeCurrent(s->display, s->surface, s->surface, s->context);
   assert(success);
 
+  // swaps wait for vsync, the ui draws when a camera frame or what it shows changed
+  success = eglSwapInterval(s->display, 1);
+  assert(success);
+
   printf("gl version %s\n", glGetString(GL_VERSION));
 
   set_brightness(BACKLIGHT_LEVEL);
@@ -1,6 +1,8 @@
 #include "gpio.h"
 #include "util.h"
+#include "timing.h"
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -27,3 +29,37 @@ int gpio_set(int pin_nr, bool high){
   }
   return write_file(pin_val_path, (void*)(high ? "1" : "0"), 1);
 }
+
+int gpio_open_edge(int pin_nr, const char *edge){
+  char path[50];
+  if (gpio_init(pin_nr, false) < 0) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/edge", pin_nr);
+  if (write_file(path, (void*)edge, strlen(edge)) < 0) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", pin_nr);
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    // the first poll returns right away unless the value was read once
+    char c;
+    read(fd, &c, 1);
+  }
+  return fd;
+}
+
+int gpio_wait_edge(int fd, int timeout_ms, uint64_t *ts){
+  struct pollfd pfd = {.fd = fd, .events = POLLPRI | POLLERR};
+  int ret = poll(&pfd, 1, timeout_ms);
+  if (ret <= 0) {
+    return ret;
+  }
+  *ts = nanos_since_boot();
+
+  // rearm for the next edge
+  char c;
+  lseek(fd, 0, SEEK_SET);
+  read(fd, &c, 1);
+  return 1;
+}
@@ -10,6 +10,7 @@
   #define GPIO_UBLOX_PWR_EN     34
   #define GPIO_STM_RST_N        124
   #define GPIO_STM_BOOT0        134
+  #define GPIO_LSM_INT          84
 #else
   #define GPIO_HUB_RST_N        0
   #define GPIO_UBLOX_RST_N      0
@@ -17,7 +18,15 @@
   #define GPIO_UBLOX_PWR_EN     0
   #define GPIO_STM_RST_N        0
   #define GPIO_STM_BOOT0        0
+  #define GPIO_LSM_INT          0
 #endif
 
+#include <stdint.h>
+
 int gpio_init(int pin_nr, bool output);
 int gpio_set(int pin_nr, bool high);
+
+// An input pin's value fd that polls on edges, edge is "rising", "falling" or "both"
+int gpio_open_edge(int pin_nr, const char *edge);
+// Blocks up to timeout_ms for an edge, 1 with the time it woke in ts, 0 on timeout
+int gpio_wait_edge(int fd, int timeout_ms, uint64_t *ts);
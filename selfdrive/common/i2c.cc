@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include "common/swaglog.h"
@@ -11,10 +12,9 @@
 #define UNUSED(x) (void)(x)
 
 #ifdef QCOM2
-// TODO: decide if we want to isntall libi2c-dev everywhere
 extern "C" {
+  #include <linux/i2c.h>
   #include <linux/i2c-dev.h>
-  #include <i2c/smbus.h>
 }
 
 I2CBus::I2CBus(uint8_t bus_id){
@@ -32,29 +32,42 @@ I2CBus::~I2CBus(){
 }
 
 int I2CBus::read_register(uint8_t device_address, uint register_address, uint8_t *buffer, uint8_t len){
-  int ret = 0;
-
-  ret = ioctl(i2c_fd, I2C_SLAVE, device_address);
-  if(ret < 0) { goto fail; }
-
-  ret = i2c_smbus_read_i2c_block_data(i2c_fd, register_address, len, buffer);
-  if((ret < 0) || (ret != len)) { goto fail; }
-
-fail:
-  return ret;
+  I2CRegister reg = {device_address, register_address, buffer, len, false};
+  int ret = transfer(&reg, 1);
+  return ret < 0 ? ret : len;
 }
 
 int I2CBus::set_register(uint8_t device_address, uint register_address, uint8_t data){
-  int ret = 0;
-
-  ret = ioctl(i2c_fd, I2C_SLAVE, device_address);
-  if(ret < 0) { goto fail; }
+  I2CRegister reg = {device_address, register_address, &data, 1, true};
+  return transfer(&reg, 1);
+}
 
-  ret = i2c_smbus_write_byte_data(i2c_fd, register_address, data);
-  if(ret < 0) { goto fail; }
+int I2CBus::transfer(I2CRegister *regs, int count){
+  assert(count <= I2C_MAX_BATCH);
+
+  // The address goes with each message, so there's no I2C_SLAVE ioctl. A read is the register
+  // write then the read after a repeated start, a write is the register followed by the data
+  struct i2c_msg msgs[I2C_MAX_BATCH * 2];
+  uint8_t addrs[I2C_MAX_BATCH];
+  uint8_t writes[I2C_MAX_BATCH][1 + UINT8_MAX];
+  int n = 0;
+  for (int i = 0; i < count; i++){
+    const I2CRegister &r = regs[i];
+    if (r.write){
+      writes[i][0] = r.register_address;
+      memcpy(&writes[i][1], r.buffer, r.len);
+      msgs[n++] = {.addr = r.device_address, .flags = 0, .len = (uint16_t)(r.len + 1), .buf = writes[i]};
+    } else {
+      addrs[i] = r.register_address;
+      msgs[n++] = {.addr = r.device_address, .flags = 0, .len = 1, .buf = &addrs[i]};
+      msgs[n++] = {.addr = r.device_address, .flags = I2C_M_RD, .len = r.len, .buf = r.buffer};
+    }
+  }
 
-fail:
-  return ret;
+  struct i2c_rdwr_ioctl_data xfer = {.msgs = msgs, .nmsgs = (uint32_t)n};
+  std::lock_guard<std::mutex> lk(m);
+  int ret = ioctl(i2c_fd, I2C_RDWR, &xfer);
+  return ret == n ? 0 : -1;
 }
 
 #else
@@ -80,4 +93,10 @@ int I2CBus::set_register(uint8_t device_address, uint register_address, uint8_t
   UNUSED(data);
   return -1;
 }
+
+int I2CBus::transfer(I2CRegister *regs, int count){
+  UNUSED(regs);
+  UNUSED(count);
+  return -1;
+}
 #endif
@@ -2,10 +2,26 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <mutex>
 
+// One register access of a batch. A read fills len bytes from the register up, a write sends
+// len bytes starting at the register
+struct I2CRegister {
+  uint8_t device_address;
+  uint register_address;
+  uint8_t *buffer;
+  uint8_t len;
+  bool write;
+};
+
+// Max registers in one transfer, the kernel takes 42 messages and a read needs two
+#define I2C_MAX_BATCH 21
+
+// Shared by the sensor threads, each transaction holds the bus
 class I2CBus {
   private:
     int i2c_fd;
+    std::mutex m;
 
   public:
     I2CBus(uint8_t bus_id);
@@ -13,4 +29,6 @@ class I2CBus {
 
     int read_register(uint8_t device_address, uint register_address, uint8_t *buffer, uint8_t len);
     int set_register(uint8_t device_address, uint register_address, uint8_t data);
+    // Every access in one I2C_RDWR ioctl, 0 when all went through
+    int transfer(I2CRegister *regs, int count);
 };
@@ -8,15 +8,27 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <limits.h>
+#include <sched.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <string>
 #include <iostream>
 #include <csignal>
 #include <string.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #include "common/util.h"
 
 
@@ -78,6 +90,173 @@ static int ensure_dir_exists(std::string path) {
   return mkdir_p(path.c_str());
 }
 
+// A copy of the values in shared memory, so a read is a memory load. It's only changed with
+// the params lock held, by the writes and deletes and by readers adding keys they miss, so
+// it follows every write made through Params. Reads go through a seqlock per key. Waiters
+// sleep on a key's generation, a futex. Values too big for a slot are still read from
+// their files.
+#define PARAMS_INDEX_SLOTS 256
+#define PARAMS_INDEX_KEY_MAX 64
+#define PARAMS_INDEX_VALUE_MAX 4096
+// a reader that keeps seeing a write in progress, from a writer that died, reads the file
+#define PARAMS_INDEX_READ_TRIES 1000
+
+enum ParamsIndexState : uint32_t {
+  PARAMS_INDEX_ABSENT,
+  PARAMS_INDEX_PRESENT,
+  PARAMS_INDEX_TOO_BIG,
+};
+
+struct ParamsIndexSlot {
+  // set once the key is written, never cleared
+  std::atomic<uint32_t> used;
+  // odd while the value is written
+  std::atomic<uint32_t> seq;
+  std::atomic<uint32_t> generation;
+  uint32_t state;
+  uint32_t len;
+  char key[PARAMS_INDEX_KEY_MAX];
+  char value[PARAMS_INDEX_VALUE_MAX];
+};
+
+struct ParamsIndex {
+  ParamsIndexSlot slots[PARAMS_INDEX_SLOTS];
+};
+
+struct ParamsValue {
+  uint32_t state;
+  uint32_t len;
+  char value[PARAMS_INDEX_VALUE_MAX];
+};
+
+#ifndef __APPLE__
+static void params_futex_wake(std::atomic<uint32_t> *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void params_futex_wait(std::atomic<uint32_t> *word, uint32_t val, int timeout_ms) {
+  struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static ParamsIndex *params_index(const std::string &params_path) {
+  // One index per params directory. It's named after where d points, a directory
+  // made with a random name, so params made again at the same path don't get a stale one
+  static std::mutex lock;
+  static std::map<std::string, ParamsIndex *> indexes;
+
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = indexes.find(params_path);
+  if (it != indexes.end()) return it->second;
+
+  char d[PATH_MAX];
+  if (realpath((params_path + "/d").c_str(), d) == NULL) return NULL;
+  std::string name = util::string_format("/dev/shm/params_v1_%zx", std::hash<std::string>{}(d));
+
+  int fd = open(name.c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return NULL;
+  fchmod(fd, 0666);
+
+  ParamsIndex *index = NULL;
+  if (ftruncate(fd, sizeof(ParamsIndex)) == 0) {
+    void *mem = mmap(NULL, sizeof(ParamsIndex), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem != MAP_FAILED) index = (ParamsIndex *)mem;
+  }
+  close(fd);
+
+  if (index) indexes[params_path] = index;
+  return index;
+}
+#else
+static void params_futex_wake(std::atomic<uint32_t> *word) {}
+static void params_futex_wait(std::atomic<uint32_t> *word, uint32_t val, int timeout_ms) {}
+static ParamsIndex *params_index(const std::string &params_path) { return NULL; }
+#endif
+
+static ParamsIndexSlot *params_index_find(ParamsIndex *index, const char *key, bool claim) {
+  if (strlen(key) >= PARAMS_INDEX_KEY_MAX) return NULL;
+
+  size_t start = std::hash<std::string>{}(key) % PARAMS_INDEX_SLOTS;
+  for (size_t n = 0; n < PARAMS_INDEX_SLOTS; n++) {
+    ParamsIndexSlot &slot = index->slots[(start + n) % PARAMS_INDEX_SLOTS];
+    if (!slot.used.load(std::memory_order_acquire)) {
+      // with the lock held, the first unused slot is the key's. It reads as being written
+      // until the caller stores its value
+      if (!claim) return NULL;
+      strcpy(slot.key, key);
+      slot.seq.store(slot.seq.load(std::memory_order_relaxed) | 1, std::memory_order_relaxed);
+      slot.used.store(1, std::memory_order_release);
+      return &slot;
+    }
+    if (strcmp(slot.key, key) == 0) return &slot;
+  }
+  return NULL;
+}
+
+// with the lock held
+static void params_index_store(ParamsIndexSlot *slot, const char *value, size_t value_size) {
+  uint32_t seq = (slot->seq.load(std::memory_order_relaxed) + 2) & ~1u;
+  slot->seq.store(seq - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  // empty files don't read, so an empty value is none
+  if (value == NULL || value_size == 0) {
+    slot->state = PARAMS_INDEX_ABSENT;
+    slot->len = 0;
+  } else if (value_size > PARAMS_INDEX_VALUE_MAX) {
+    slot->state = PARAMS_INDEX_TOO_BIG;
+    slot->len = 0;
+  } else {
+    slot->state = PARAMS_INDEX_PRESENT;
+    slot->len = value_size;
+    memcpy(slot->value, value, value_size);
+  }
+
+  slot->seq.store(seq, std::memory_order_release);
+  slot->generation.fetch_add(1, std::memory_order_release);
+  params_futex_wake(&slot->generation);
+}
+
+static bool params_index_load(ParamsIndexSlot *slot, ParamsValue *out) {
+  for (int i = 0; i < PARAMS_INDEX_READ_TRIES; i++) {
+    uint32_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    out->state = slot->state;
+    out->len = std::min(slot->len, (uint32_t)PARAMS_INDEX_VALUE_MAX);
+    memcpy(out->value, slot->value, out->len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) == seq) return true;
+  }
+  return false;
+}
+
+// The key's slot, added from its file if it isn't there yet. NULL without an index or room in it
+static ParamsIndexSlot *params_index_slot(const std::string &params_path, const char *key) {
+  ParamsIndex *index = params_index(params_path);
+  if (!index) return NULL;
+  ParamsIndexSlot *slot = params_index_find(index, key, false);
+  if (slot) return slot;
+
+  std::string lock_path = params_path + "/.lock";
+  int lock_fd = open(lock_path.c_str(), O_CREAT, 0775);
+  if (lock_fd < 0) return NULL;
+  if (flock(lock_fd, LOCK_EX) == 0) {
+    slot = params_index_find(index, key, false);
+    if (!slot) {
+      size_t value_size = 0;
+      char *value = static_cast<char*>(read_file((params_path + "/d/" + key).c_str(), &value_size));
+      slot = params_index_find(index, key, true);
+      if (slot) params_index_store(slot, value, value_size);
+      free(value);
+    }
+  }
+  close(lock_fd);
+  return slot;
+}
+
 
 Params::Params(bool persistent_param){
   params_path = persistent_param ? persistent_params_path : default_params_path;
@@ -91,25 +270,16 @@ int Params::write_db_value(std::string key, std::string dat){
   return write_db_value(key.c_str(), dat.c_str(), dat.length());
 }
 
-int Params::write_db_value(const char* key, const char* value, size_t value_size) {
-  // Information about safely and atomically writing a file: https://lwn.net/Articles/457667/
-  // 1) Create temp file
-  // 2) Write data to temp file
-  // 3) fsync() the temp file
-  // 4) rename the temp file to the real name
-  // 5) fsync() the containing directory
-
-  int lock_fd = -1;
-  int tmp_fd = -1;
+// Makes the params directory, and d, the symlink to where the values are
+static int ensure_params_dir(const std::string &params_path) {
   int result;
   std::string path;
   std::string tmp_path;
-  ssize_t bytes_written;
 
   // Make sure params path exists
   result = ensure_dir_exists(params_path);
   if (result < 0) {
-    goto cleanup;
+    return result;
   }
 
   // See if the symlink exists, otherwise create it
@@ -121,75 +291,127 @@ int Params::write_db_value(const char* key, const char* value, size_t value_size
 
     char *t = mkdtemp((char*)path.c_str());
     if (t == NULL){
-      goto cleanup;
+      return -1;
     }
     std::string tmp_dir(t);
 
     // Set permissions
     result = chmod(tmp_dir.c_str(), 0777);
     if (result < 0) {
-      goto cleanup;
+      return result;
     }
 
     // Symlink it to temp link
     tmp_path = tmp_dir + ".link";
     result = symlink(tmp_dir.c_str(), tmp_path.c_str());
     if (result < 0) {
-      goto cleanup;
+      return result;
     }
 
     // Move symlink to <params>/d
     path = params_path + "/d";
     result = rename(tmp_path.c_str(), path.c_str());
-    if (result < 0) {
-      goto cleanup;
-    }
   } else {
     // Ensure permissions are correct in case we didn't create the symlink
     result = chmod(path.c_str(), 0777);
+  }
+  return result;
+}
+
+int Params::write_db_value(const char* key, const char* value, size_t value_size) {
+  ParamsTransaction t = transaction();
+  t.put(key, std::string(value, value_size));
+  return t.commit();
+}
+
+ParamsTransaction Params::transaction() {
+  return ParamsTransaction(params_path);
+}
+
+void ParamsTransaction::put(std::string key, std::string value) {
+  writes.emplace_back(std::move(key), std::move(value));
+}
+
+int ParamsTransaction::commit() {
+  // Information about safely and atomically writing a file: https://lwn.net/Articles/457667/
+  // 1) Create temp files
+  // 2) Write data to temp files
+  // 3) fsync() the temp files
+  // 4) rename the temp files to the real names
+  // 5) fsync() the containing directory once
+
+  int lock_fd = -1;
+  int result;
+  std::string path;
+  std::vector<int> tmp_fds;
+  std::vector<std::string> tmp_paths;
+  size_t renamed = 0;
+
+  result = ensure_params_dir(params_path);
+  if (result < 0) {
+    goto cleanup;
+  }
+
+  // Write values to temp. They're private until renamed, so it's done without the lock
+  for (auto &[key, value] : writes) {
+    path = params_path + "/.tmp_value_XXXXXX";
+    int tmp_fd = mkstemp((char*)path.c_str());
+    if (tmp_fd < 0) {
+      result = -1;
+      goto cleanup;
+    }
+    tmp_fds.push_back(tmp_fd);
+    tmp_paths.push_back(path);
+
+    ssize_t bytes_written = write(tmp_fd, value.data(), value.size());
+    if (bytes_written < 0 || (size_t)bytes_written != value.size()) {
+      result = -20;
+      goto cleanup;
+    }
+
+    // change permissions to 0666 for apks
+    result = fchmod(tmp_fd, 0666);
     if (result < 0) {
       goto cleanup;
     }
   }
 
-  // Write value to temp.
-  tmp_path = params_path + "/.tmp_value_XXXXXX";
-  tmp_fd = mkstemp((char*)tmp_path.c_str());
-  bytes_written = write(tmp_fd, value, value_size);
-  if (bytes_written < 0 || (size_t)bytes_written != value_size) {
-    result = -20;
-    goto cleanup;
+  // fsync to force persist the changes, all of them before any is moved into place
+  for (int tmp_fd : tmp_fds) {
+    result = fsync(tmp_fd);
+    if (result < 0) {
+      goto cleanup;
+    }
   }
 
   // Build lock path
   path = params_path + "/.lock";
   lock_fd = open(path.c_str(), O_CREAT, 0775);
 
-  // Build key path
-  path = params_path + "/d/" + std::string(key);
-
   // Take lock.
   result = flock(lock_fd, LOCK_EX);
   if (result < 0) {
     goto cleanup;
   }
 
-  // change permissions to 0666 for apks
-  result = fchmod(tmp_fd, 0666);
-  if (result < 0) {
-    goto cleanup;
-  }
+  // Move temps into place. Each key is replaced atomically, after a crash every key has
+  // either its old value or its new one
+  for (; renamed < writes.size(); renamed++) {
+    const std::string &key = writes[renamed].first;
+    const std::string &value = writes[renamed].second;
 
-  // fsync to force persist the changes.
-  result = fsync(tmp_fd);
-  if (result < 0) {
-    goto cleanup;
-  }
+    path = params_path + "/d/" + key;
+    result = rename(tmp_paths[renamed].c_str(), path.c_str());
+    if (result < 0) {
+      goto cleanup;
+    }
 
-  // Move temp into place.
-  result = rename(tmp_path.c_str(), path.c_str());
-  if (result < 0) {
-    goto cleanup;
+    // Update the index before the lock is released.
+    if (ParamsIndex *index = params_index(params_path)) {
+      if (ParamsIndexSlot *slot = params_index_find(index, key.c_str(), true)) {
+        params_index_store(slot, value.data(), value.size());
+      }
+    }
   }
 
   // fsync parent directory
@@ -204,12 +426,13 @@ cleanup:
   if (lock_fd >= 0) {
     close(lock_fd);
   }
-  if (tmp_fd >= 0) {
-    if (result < 0) {
-      remove(tmp_path.c_str());
+  for (size_t i = 0; i < tmp_fds.size(); i++) {
+    if (i >= renamed) {
+      remove(tmp_paths[i].c_str());
     }
-    close(tmp_fd);
+    close(tmp_fds[i]);
   }
+  writes.clear();
   return result;
 }
 
@@ -231,6 +454,11 @@ int Params::delete_db_value(std::string key) {
   // Delete value.
   path = params_path + "/d/" + key;
   result = remove(path.c_str());
+  if (ParamsIndex *index = params_index(params_path)) {
+    if (ParamsIndexSlot *slot = params_index_find(index, key.c_str(), true)) {
+      params_index_store(slot, NULL, 0);
+    }
+  }
   if (result != 0) {
     result = ERR_NO_VALUE;
     goto cleanup;
@@ -272,6 +500,22 @@ std::string Params::get(std::string key, bool block){
 }
 
 int Params::read_db_value(const char* key, char** value, size_t* value_sz) {
+  if (ParamsIndexSlot *slot = params_index_slot(params_path, key)) {
+    ParamsValue v;
+    if (params_index_load(slot, &v)) {
+      if (v.state == PARAMS_INDEX_ABSENT) {
+        *value = NULL;
+        return -22;
+      } else if (v.state == PARAMS_INDEX_PRESENT) {
+        *value = static_cast<char*>(malloc(v.len + 1));
+        memcpy(*value, v.value, v.len);
+        (*value)[v.len] = '\0';
+        if (value_sz) *value_sz = v.len;
+        return 0;
+      }
+    }
+  }
+
   std::string path = params_path + "/d/" + std::string(key);
   *value = static_cast<char*>(read_file(path.c_str(), value_sz));
   if (*value == NULL) {
@@ -286,11 +530,12 @@ int Params::read_db_value_blocking(const char* key, char** value, size_t* value_
   void (*prev_handler_sigterm)(int) = std::signal(SIGTERM, params_sig_handler);
 
   while (!params_do_exit) {
+    const uint32_t generation = get_generation(key);
     const int result = read_db_value(key, value, value_sz);
     if (result == 0) {
       break;
     } else {
-      util::sleep_for(100); // 0.1 s
+      wait_change(key, generation, 100); // the write, or 0.1 s
     }
   }
 
@@ -351,3 +596,21 @@ bool Params::read_db_bool(const char* param_name) {
   std::vector<char> bytes = read_db_bytes(param_name);
   return bytes.size() > 0 and bytes[0] == '1';
 }
+
+uint32_t Params::get_generation(const char* key) {
+  ParamsIndexSlot *slot = params_index_slot(params_path, key);
+  return slot ? slot->generation.load(std::memory_order_acquire) : 0;
+}
+
+bool Params::wait_change(const char* key, uint32_t generation, int timeout_ms) {
+  ParamsIndexSlot *slot = params_index_slot(params_path, key);
+  if (!slot) {
+    util::sleep_for(timeout_ms);
+    return true;
+  }
+
+  if (slot->generation.load(std::memory_order_acquire) == generation) {
+    params_futex_wait(&slot->generation, generation, timeout_ms);
+  }
+  return slot->generation.load(std::memory_order_acquire) != generation;
+}
@@ -1,11 +1,15 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #define ERR_NO_VALUE -33
 
+class ParamsTransaction;
+
 class Params {
 private:
   std::string params_path;
@@ -17,6 +21,9 @@ public:
   int write_db_value(std::string key, std::string dat);
   int write_db_value(const char* key, const char* value, size_t value_size);
 
+  // Stages writes that commit together, with one lock and one directory fsync.
+  ParamsTransaction transaction();
+
   // Reads a value from the params database.
   // Inputs:
   //  key: The key to read.
@@ -43,4 +50,27 @@ public:
   bool read_db_bool(const char* param_name);
 
   std::string get(std::string key, bool block=false);
+
+  // Counts the writes and deletes of key, 0 if the params have no shared index.
+  uint32_t get_generation(const char* key);
+
+  // Waits up to timeout_ms for key's generation to move on from generation.
+  // Returns false on a timeout. Without the index it sleeps and returns true.
+  bool wait_change(const char* key, uint32_t generation, int timeout_ms);
+};
+
+class ParamsTransaction {
+private:
+  std::string params_path;
+  std::vector<std::pair<std::string, std::string>> writes;
+
+public:
+  ParamsTransaction(std::string path) : params_path(path) {}
+
+  void put(std::string key, std::string value);
+
+  // Writes every staged value, each replaced atomically. Returns negative on failure, with
+  // the keys moved into place before it written, otherwise 0. The staged values are
+  // dropped either way.
+  int commit();
 };
@@ -0,0 +1,83 @@
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifndef __USE_GNU
+#define __USE_GNU
+#endif
+#include <sched.h>
+#endif
+
+#include <string>
+
+#include "json11.hpp"
+
+#include "common/swaglog.h"
+#include "common/util.h"
+
+// Kept out of util.cc, which the installer and the android text and spinner link without json11
+
+#if defined(QCOM)
+#define SCHED_PROFILE_DEVICE "eon"
+#elif defined(QCOM2)
+#define SCHED_PROFILE_DEVICE "tici"
+#else
+#define SCHED_PROFILE_DEVICE "pc"
+#endif
+
+static const json11::Json &sched_profile() {
+  static const json11::Json profile = []() {
+    std::string path = util::getenv_default("BASEDIR", "/selfdrive/hardware/sched_profile.json",
+                                            "/data/openpilot/selfdrive/hardware/sched_profile.json");
+    std::string err;
+    json11::Json j = json11::Json::parse(util::read_file(path), err);
+    if (!err.empty()) {
+      LOGE("failed to load sched profile %s: %s", path.c_str(), err.c_str());
+    }
+    return j[SCHED_PROFILE_DEVICE];
+  }();
+  return profile;
+}
+
+int set_sched_profile(const char* process, const char* thread) {
+#ifdef __linux__
+  const json11::Json &entry = sched_profile()[process][thread];
+  if (!entry.is_object()) return 0;
+
+  long tid = syscall(SYS_gettid);
+  int ret = 0;
+
+  const auto &cpus = entry["cpus"].array_items();
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto &c : cpus) CPU_SET(c.int_value(), &set);
+    if (sched_setaffinity(tid, sizeof(set), &set) != 0) {
+      LOGW("%s %s: setting cpus failed: %s", process, thread, strerror(errno));
+      ret = -1;
+    }
+  }
+
+  const std::string &policy = entry["policy"].string_value();
+  if (policy == "fifo" || policy == "rr") {
+    struct sched_param sa = {};
+    sa.sched_priority = entry["priority"].int_value();
+    if (sched_setscheduler(tid, policy == "fifo" ? SCHED_FIFO : SCHED_RR, &sa) != 0) {
+      LOGW("%s %s: setting %s %d failed: %s", process, thread, policy.c_str(), sa.sched_priority, strerror(errno));
+      ret = -1;
+    }
+  } else if (policy == "other") {
+    struct sched_param sa = {};
+    int nice = entry["nice"].int_value();
+    if (sched_setscheduler(tid, SCHED_OTHER, &sa) != 0 || setpriority(PRIO_PROCESS, tid, nice) != 0) {
+      LOGW("%s %s: setting nice %d failed: %s", process, thread, nice, strerror(errno));
+      ret = -1;
+    }
+  }
+  return ret;
+#else
+  return -1;
+#endif
+}
@@ -4,35 +4,182 @@
 
 #include <string>
 #include <string.h>
+#include <stdarg.h>
 #include <assert.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 #include <zmq.h>
 
 #include "json11.hpp"
 
 #include "common/timing.h"
+#include "common/util.h"
 #include "common/version.h"
 
 #include "swaglog.h"
 
+// Records per thread, a thread that logs faster than they're sent drops the rest
+#define LOG_RING_SIZE 256
+// longer messages are allocated
+#define LOG_MSG_MAX 512
+
+typedef struct LogRecord {
+  int levelnum;
+  int lineno;
+  const char* filename;
+  const char* func;
+  double created;
+  char* long_msg;
+  char msg[LOG_MSG_MAX];
+} LogRecord;
+
+// Written by its thread, read by whoever holds the drain lock
+typedef struct LogRing {
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+  std::atomic<uint32_t> dropped{0};
+  // its thread exited, freed once it's empty
+  std::atomic<bool> closed{false};
+  LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
 typedef struct LogState {
+  std::once_flag init_once;
+
+  // the context
   std::mutex lock;
-  bool inited;
   json11::Json::object ctx_j;
   void *zctx;
   void *sock;
   int print_level;
+
+  // held while the rings are drained to the socket, by the log thread or a thread logging an error
+  std::mutex drain_lock;
+  std::mutex rings_lock;
+  std::vector<std::shared_ptr<LogRing>> rings;
+
+  std::thread thread;
+  std::mutex wake_lock;
+  std::condition_variable wake_cv;
+  std::atomic<bool> waiting{false};
+  std::atomic<bool> stop{false};
+
+  ~LogState() {
+    // what's queued is sent before exit
+    if (thread.joinable()) {
+      stop = true;
+      {
+        std::lock_guard lk(wake_lock);
+        wake_cv.notify_one();
+      }
+      thread.join();
+    }
+  }
 } LogState;
 
-static LogState s = {};
+static LogState s;
 
 static void cloudlog_bind_locked(const char* k, const char* v) {
   s.ctx_j[k] = v;
 }
 
+static void log_send(int levelnum, const char* filename, int lineno, const char* func,
+                     const char* msg, double created) {
+  if (levelnum >= s.print_level) {
+    printf("%s: %s\n", filename, msg);
+    if (levelnum >= CLOUDLOG_ERROR) fflush(stdout);
+  }
+
+  std::string log_s;
+  {
+    std::lock_guard lk(s.lock);
+    json11::Json log_j = json11::Json::object {
+      {"msg", msg},
+      {"ctx", s.ctx_j},
+      {"levelnum", levelnum},
+      {"filename", filename},
+      {"lineno", lineno},
+      {"funcname", func},
+      {"created", created}
+    };
+    log_s = log_j.dump();
+  }
+
+  char levelnum_c = levelnum;
+  zmq_send(s.sock, &levelnum_c, 1, ZMQ_NOBLOCK | ZMQ_SNDMORE);
+  zmq_send(s.sock, log_s.c_str(), log_s.length(), ZMQ_NOBLOCK);
+}
+
+// Sends what the rings have, returns false if they were all empty
+static bool log_drain() {
+  std::lock_guard drain_lk(s.drain_lock);
+  std::vector<std::shared_ptr<LogRing>> rings;
+  {
+    std::lock_guard lk(s.rings_lock);
+    rings = s.rings;
+  }
+
+  bool sent = false;
+  for (auto &ring : rings) {
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    const uint32_t head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      LogRecord &r = ring->records[tail % LOG_RING_SIZE];
+      log_send(r.levelnum, r.filename, r.lineno, r.func, r.long_msg ? r.long_msg : r.msg, r.created);
+      free(r.long_msg);
+      ring->tail.store(tail + 1, std::memory_order_release);
+      sent = true;
+    }
+
+    if (uint32_t dropped = ring->dropped.exchange(0)) {
+      std::string msg = util::string_format("cloudlog: %u messages dropped", dropped);
+      log_send(CLOUDLOG_WARNING, __FILE__, __LINE__, __func__, msg.c_str(), seconds_since_epoch());
+    }
+  }
+
+  // the rings of threads that exited, once everything they logged is out
+  std::lock_guard lk(s.rings_lock);
+  for (auto it = s.rings.begin(); it != s.rings.end();) {
+    auto &ring = *it;
+    bool done = ring->closed && ring->tail.load() == ring->head.load();
+    it = done ? s.rings.erase(it) : std::next(it);
+  }
+  return sent;
+}
+
+static bool log_pending() {
+  std::lock_guard lk(s.rings_lock);
+  for (auto &ring : s.rings) {
+    if (ring->tail.load(std::memory_order_relaxed) != ring->head.load(std::memory_order_acquire)) return true;
+  }
+  return false;
+}
+
+static void log_thread() {
+  set_thread_name("swaglog");
+
+  while (true) {
+    if (log_drain()) continue;
+    if (s.stop) break;
+
+    std::unique_lock lk(s.wake_lock);
+    s.waiting = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!log_pending() && !s.stop) {
+      s.wake_cv.wait_for(lk, std::chrono::milliseconds(100));
+    }
+    s.waiting = false;
+  }
+  log_drain();
+}
+
 static void cloudlog_init() {
-  if (s.inited) return;
   s.ctx_j = json11::Json::object {};
   s.zctx = zmq_ctx_new();
   s.sock = zmq_socket(s.zctx, ZMQ_PUSH);
@@ -58,50 +205,104 @@ static void cloudlog_init() {
   cloudlog_bind_locked("version", COMMA_VERSION);
   s.ctx_j["dirty"] = !getenv("CLEAN");
 
-  s.inited = true;
+  s.thread = std::thread(log_thread);
+}
+
+// The calling thread's ring, registered the first time it logs
+static LogRing *log_ring() {
+  struct RingHolder {
+    std::shared_ptr<LogRing> ring;
+    ~RingHolder() {
+      if (ring) ring->closed = true;
+    }
+  };
+  static thread_local RingHolder holder;
+
+  if (!holder.ring) {
+    std::call_once(s.init_once, cloudlog_init);
+    holder.ring = std::make_shared<LogRing>();
+    std::lock_guard lk(s.rings_lock);
+    s.rings.push_back(holder.ring);
+  }
+  return holder.ring.get();
 }
 
 void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
                 const char* fmt, ...) {
-  std::lock_guard lk(s.lock);
-  cloudlog_init();
+  LogRing *ring = log_ring();
+  // errors are sent before returning, with what was queued ahead of them, an abort often follows
+  const bool now = levelnum >= CLOUDLOG_ERROR;
+
+  const uint32_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+    if (!now) {
+      ring->dropped++;
+      return;
+    }
+    log_drain();
+  }
+  LogRecord &r = ring->records[head % LOG_RING_SIZE];
 
-  char* msg_buf = NULL;
   va_list args;
   va_start(args, fmt);
-  vasprintf(&msg_buf, fmt, args);
+  int len = vsnprintf(r.msg, sizeof(r.msg), fmt, args);
   va_end(args);
-
-  if (!msg_buf) {
+  if (len < 0) {
     return;
   }
 
-  if (levelnum >= s.print_level) {
-    printf("%s: %s\n", filename, msg_buf);
+  r.long_msg = NULL;
+  if (len >= (int)sizeof(r.msg)) {
+    va_start(args, fmt);
+    if (vasprintf(&r.long_msg, fmt, args) < 0) r.long_msg = NULL;
+    va_end(args);
   }
 
-  json11::Json log_j = json11::Json::object {
-    {"msg", msg_buf},
-    {"ctx", s.ctx_j},
-    {"levelnum", levelnum},
-    {"filename", filename},
-    {"lineno", lineno},
-    {"funcname", func},
-    {"created", seconds_since_epoch()}
-  };
+  r.levelnum = levelnum;
+  r.lineno = lineno;
+  r.filename = filename;
+  r.func = func;
+  r.created = seconds_since_epoch();
+  ring->head.store(head + 1, std::memory_order_release);
 
-  std::string log_s = log_j.dump();
-
-  free(msg_buf);
-
-  char levelnum_c = levelnum;
-  zmq_send(s.sock, &levelnum_c, 1, ZMQ_NOBLOCK | ZMQ_SNDMORE);
-  zmq_send(s.sock, log_s.c_str(), log_s.length(), ZMQ_NOBLOCK);
+  if (now) {
+    log_drain();
+    return;
+  }
 
+  // the log thread only needs waking when it's waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (s.waiting) {
+    std::lock_guard lk(s.wake_lock);
+    s.wake_cv.notify_one();
+  }
 }
 
 void cloudlog_bind(const char* k, const char* v) {
+  log_ring();
   std::lock_guard lk(s.lock);
-  cloudlog_init();
   cloudlog_bind_locked(k, v);
 }
+
+bool cloudlog_rl_allow(CloudlogRateLimit *rl, int burst, int millis) {
+  std::lock_guard lk(rl->lock);
+  uint64_t ts = nanos_since_boot();
+
+  if (!rl->begin) rl->begin = ts;
+
+  if (rl->begin + millis*1000000ULL < ts) {
+    if (rl->missed) {
+      cloudlog(CLOUDLOG_WARNING, "cloudlog: %d messages supressed", rl->missed);
+    }
+    rl->begin = 0;
+    rl->printed = 0;
+    rl->missed = 0;
+  }
+
+  if (rl->printed < burst) {
+    rl->printed++;
+    return true;
+  }
+  rl->missed++;
+  return false;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <mutex>
+
 #include "selfdrive/common/timing.h"
 
 #define CLOUDLOG_DEBUG 10
@@ -8,6 +11,8 @@
 #define CLOUDLOG_ERROR 40
 #define CLOUDLOG_CRITICAL 50
 
+// Formats the message into the calling thread's queue, a background thread adds the context,
+// serializes and sends it. filename and func must outlive the process, like __FILE__
 void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
                 const char* fmt, ...) /*__attribute__ ((format (printf, 6, 7)))*/;
 
@@ -17,32 +22,23 @@ void cloudlog_bind(const char* k, const char* v);
                                            __func__, \
                                            fmt, ## __VA_ARGS__)
 
+// The state of one rate limited call site
+struct CloudlogRateLimit {
+  std::mutex lock;
+  uint64_t begin = 0;
+  int printed = 0;
+  int missed = 0;
+};
+
+// Whether a rate limited log goes out. The ones held back are counted in a warning once
+// millis have passed
+bool cloudlog_rl_allow(CloudlogRateLimit *rl, int burst, int millis);
+
 #define cloudlog_rl(burst, millis, lvl, fmt, ...)   \
 {                                                   \
-  static uint64_t __begin = 0;                      \
-  static int __printed = 0;                         \
-  static int __missed = 0;                          \
-                                                    \
-  int __burst = (burst);                            \
-  int __millis = (millis);                          \
-  uint64_t __ts = nanos_since_boot();               \
-                                                    \
-  if (!__begin) __begin = __ts;                     \
-                                                    \
-  if (__begin + __millis*1000000ULL < __ts) {       \
-    if (__missed) {                                 \
-      cloudlog(CLOUDLOG_WARNING, "cloudlog: %d messages supressed", __missed); \
-    }                                               \
-    __begin = 0;                                    \
-    __printed = 0;                                  \
-    __missed = 0;                                   \
-  }                                                 \
-                                                    \
-  if (__printed < __burst) {                        \
+  static CloudlogRateLimit __rl;                    \
+  if (cloudlog_rl_allow(&__rl, (burst), (millis))) { \
     cloudlog(lvl, fmt, ## __VA_ARGS__);             \
-    __printed++;                                    \
-  } else {                                          \
-    __missed++;                                     \
   }                                                 \
 }
 
@@ -1,29 +1,71 @@
 #ifndef COMMON_TIMING_H
 #define COMMON_TIMING_H
 
+#include <fcntl.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 
 #ifdef __APPLE__
 #define CLOCK_BOOTTIME CLOCK_MONOTONIC
 #endif
 
+// With SIMULATED_CLOCK set to a file, the time since boot is the uint64 nanoseconds at its
+// start, which a replay moves forward as fast as it likes. cereal's messaging_nanos_since_boot
+// and common/clock.pyx read the same file. The other clocks are always the real ones
+#define SIMULATED_CLOCK_ENV "SIMULATED_CLOCK"
+
+// NULL when the clock is real, mapped the first time it's asked for
+static inline const volatile uint64_t *simulated_clock() {
+  static const volatile uint64_t *clock = NULL;
+  static int looked_up = 0;
+  if (!__atomic_load_n(&looked_up, __ATOMIC_ACQUIRE)) {
+    const char *path = getenv(SIMULATED_CLOCK_ENV);
+    const volatile uint64_t *c = NULL;
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd >= 0) {
+      void *p = mmap(NULL, sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) c = (const volatile uint64_t *)p;
+      close(fd);
+    }
+    // racing threads each map it, any of them will do
+    __atomic_store_n(&clock, c, __ATOMIC_RELAXED);
+    __atomic_store_n(&looked_up, 1, __ATOMIC_RELEASE);
+  }
+  return __atomic_load_n(&clock, __ATOMIC_RELAXED);
+}
+
 static inline uint64_t nanos_since_boot() {
+  const volatile uint64_t *sim = simulated_clock();
+  if (sim) return __atomic_load_n(sim, __ATOMIC_ACQUIRE);
+
   struct timespec t;
   clock_gettime(CLOCK_BOOTTIME, &t);
   return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
 static inline double millis_since_boot() {
-  struct timespec t;
-  clock_gettime(CLOCK_BOOTTIME, &t);
-  return t.tv_sec * 1000.0 + t.tv_nsec * 1e-6;
+  return nanos_since_boot() * 1e-6;
 }
 
 static inline double seconds_since_boot() {
-  struct timespec t;
-  clock_gettime(CLOCK_BOOTTIME, &t);
-  return (double)t.tv_sec + t.tv_nsec * 1e-9;
+  return nanos_since_boot() * 1e-9;
+}
+
+// Sleeps until nanos_since_boot reaches t, checking a simulated clock every SIMULATED_CLOCK_POLL_US
+#define SIMULATED_CLOCK_POLL_US 200
+static inline void sleep_until_nanos_since_boot(uint64_t t) {
+  if (simulated_clock()) {
+    while (nanos_since_boot() < t) usleep(SIMULATED_CLOCK_POLL_US);
+    return;
+  }
+  const uint64_t now = nanos_since_boot();
+  if (t > now) {
+    struct timespec ts = {(time_t)((t - now) / 1000000000ULL), (long)((t - now) % 1000000000ULL)};
+    nanosleep(&ts, NULL);
+  }
 }
 
 static inline uint64_t nanos_since_epoch() {
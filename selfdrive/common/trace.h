@@ -0,0 +1,196 @@
+#pragma once
+
+// Spans of time on each thread for finding where latency goes. With OPENPILOT_TRACE=1 every
+// process gets /dev/shm/trace_<pid> with a ring of spans per thread, which
+// selfdrive/debug/trace_dump.py turns into Chrome trace JSON for Perfetto or chrome://tracing.
+// Without it a span is a branch. It's all here so cereal can use it without linking common.
+//
+//   void process() {
+//     TRACE_SCOPE("process");
+//     ...
+//   }
+//
+// Names must be string literals. Each thread keeps the last TRACE_RING_SIZE spans it recorded.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "selfdrive/common/alloc_tracker.h"
+#include "selfdrive/common/timing.h"
+
+// the layout is read by trace_dump.py, keep it in sync
+#define TRACE_MAGIC 0x45435254  // "TRCE"
+#define TRACE_VERSION 1
+#define TRACE_MAX_NAMES 256
+#define TRACE_NAME_MAX 48
+#define TRACE_MAX_THREADS 64
+#define TRACE_RING_SIZE 4096
+#define TRACE_HEADER_SIZE 16384
+
+struct TraceRecord {
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint32_t name_id;
+  // heap allocations on the thread during the span, with alloc_tracker.o
+  uint32_t allocs;
+};
+
+struct TraceThread {
+  // spans recorded, the newest TRACE_RING_SIZE are kept
+  std::atomic<uint64_t> head;
+  int32_t tid;
+  char name[16];
+  uint32_t reserved;
+  TraceRecord records[TRACE_RING_SIZE];
+};
+
+struct TraceHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t pid;
+  std::atomic<uint32_t> num_names;
+  std::atomic<uint32_t> num_threads;
+  char comm[16];
+  // name 0 is for spans whose name didn't fit
+  char names[TRACE_MAX_NAMES][TRACE_NAME_MAX];
+};
+
+struct TraceShm {
+  TraceHeader header;
+  char reserved[TRACE_HEADER_SIZE - sizeof(TraceHeader)];
+  TraceThread threads[TRACE_MAX_THREADS];
+};
+
+static_assert(offsetof(TraceShm, threads) == TRACE_HEADER_SIZE, "trace threads must start at TRACE_HEADER_SIZE");
+static_assert(offsetof(TraceThread, records) == 32, "trace records must start at 32");
+static_assert(sizeof(TraceRecord) == 24, "trace records are 24 bytes");
+
+// The process's trace memory, NULL when tracing is off
+inline TraceShm *trace_shm() {
+  static TraceShm *shm = []() -> TraceShm * {
+#ifdef __linux__
+    const char *env = getenv("OPENPILOT_TRACE");
+    if (!env || strcmp(env, "1") != 0) return NULL;
+
+    std::string path = "/dev/shm/trace_" + std::to_string(getpid());
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return NULL;
+
+    TraceShm *mem = NULL;
+    if (ftruncate(fd, sizeof(TraceShm)) == 0) {
+      void *m = mmap(NULL, sizeof(TraceShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (m != MAP_FAILED) mem = (TraceShm *)m;
+    }
+    close(fd);
+    if (!mem) return NULL;
+
+    TraceHeader &h = mem->header;
+    h.version = TRACE_VERSION;
+    h.pid = getpid();
+    int comm_fd = open("/proc/self/comm", O_RDONLY);
+    if (comm_fd >= 0) {
+      ssize_t len = read(comm_fd, h.comm, sizeof(h.comm) - 1);
+      if (len > 0 && h.comm[len - 1] == '\n') h.comm[len - 1] = '\0';
+      close(comm_fd);
+    }
+    strcpy(h.names[0], "?");
+    h.num_names = 1;
+    std::atomic_thread_fence(std::memory_order_release);
+    h.magic = TRACE_MAGIC;
+    return mem;
+#else
+    return NULL;
+#endif
+  }();
+  return shm;
+}
+
+inline uint32_t trace_name_id(const char *name) {
+  TraceShm *shm = trace_shm();
+  if (!shm) return 0;
+
+  static std::mutex lock;
+  std::lock_guard<std::mutex> lk(lock);
+  TraceHeader &h = shm->header;
+  const uint32_t n = h.num_names.load(std::memory_order_relaxed);
+  for (uint32_t i = 1; i < n; i++) {
+    if (strncmp(h.names[i], name, TRACE_NAME_MAX - 1) == 0) return i;
+  }
+  if (n >= TRACE_MAX_NAMES) return 0;
+
+  strncpy(h.names[n], name, TRACE_NAME_MAX - 1);
+  h.num_names.store(n + 1, std::memory_order_release);
+  return n;
+}
+
+// The calling thread's ring, taken the first time it records. NULL when tracing is off or
+// every ring is taken
+inline TraceThread *trace_thread() {
+  static thread_local TraceThread *thread = []() -> TraceThread * {
+#ifdef __linux__
+    TraceShm *shm = trace_shm();
+    if (!shm) return NULL;
+
+    uint32_t i = shm->header.num_threads.fetch_add(1);
+    if (i >= TRACE_MAX_THREADS) return NULL;
+    TraceThread *t = &shm->threads[i];
+    t->tid = syscall(SYS_gettid);
+    prctl(PR_GET_NAME, (unsigned long)t->name, 0, 0, 0);
+    return t;
+#else
+    return NULL;
+#endif
+  }();
+  return thread;
+}
+
+inline void trace_record(TraceThread *t, uint32_t name_id, uint64_t start_ns, uint64_t end_ns, uint32_t allocs) {
+  const uint64_t head = t->head.load(std::memory_order_relaxed);
+  TraceRecord &r = t->records[head % TRACE_RING_SIZE];
+  r.start_ns = start_ns;
+  r.end_ns = end_ns;
+  r.name_id = name_id;
+  r.allocs = allocs;
+  t->head.store(head + 1, std::memory_order_release);
+}
+
+class TraceSpan {
+public:
+  explicit TraceSpan(uint32_t name_id) : name_id(name_id), thread(trace_thread()) {
+    if (thread) {
+      start_allocs = alloc_count();
+      start_ns = nanos_since_boot();
+    }
+  }
+  ~TraceSpan() {
+    if (thread) trace_record(thread, name_id, start_ns, nanos_since_boot(), alloc_count() - start_allocs);
+  }
+
+private:
+  uint32_t name_id;
+  TraceThread *thread;
+  uint64_t start_ns = 0;
+  uint64_t start_allocs = 0;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// A span from here to the end of the scope
+#define TRACE_SCOPE(name)                                                              \
+  static const uint32_t TRACE_CONCAT(__trace_id_, __LINE__) = trace_name_id(name);    \
+  TraceSpan TRACE_CONCAT(__trace_span_, __LINE__)(TRACE_CONCAT(__trace_id_, __LINE__))
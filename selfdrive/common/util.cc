@@ -5,6 +5,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #ifdef __linux__
 #include <sys/prctl.h>
@@ -76,6 +81,13 @@ int set_realtime_priority(int level) {
 #endif
 }
 
+void notify_ready(const char* process) {
+  const char* fd = getenv("READY_FD");
+  if (fd == NULL) return;
+  // a datagram each, it's dropped rather than waited on if the manager isn't reading
+  send(atoi(fd), process, strlen(process), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
 int set_core_affinity(int core) {
 #ifdef __linux__
   long tid = syscall(SYS_gettid);
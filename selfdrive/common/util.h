@@ -32,6 +32,15 @@ void set_thread_name(const char* name);
 int set_realtime_priority(int level);
 int set_core_affinity(int core);
 
+// Sets the calling thread's cpus, policy and priority from this device's entry in
+// selfdrive/hardware/sched_profile.json, "main" being the process's main thread. Returns 0
+// when it's set or the profile has no entry for it, -1 if setting it failed
+int set_sched_profile(const char* process, const char* thread = "main");
+
+// Tells the manager the process is ready, what gates the processes that wait for it and ends up in
+// the startup timeline, see selfdrive/ready.py. Does nothing when it wasn't started by the manager
+void notify_ready(const char* process);
+
 namespace util {
 
 inline bool starts_with(std::string s, std::string prefix) {
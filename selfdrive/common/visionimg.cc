@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cstring>
 #include "common/visionimg.h"
 
 #ifdef QCOM
@@ -49,14 +50,72 @@ EGLImageTexture::~EGLImageTexture() {
 
 #else // ifdef QCOM
 
-EGLImageTexture::EGLImageTexture(const VisionBuf *buf) {
-  glGenTextures(1, &frame_tex);
-  glBindTexture(GL_TEXTURE_2D, frame_tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, buf->width, buf->height, 0, GL_RGB, GL_UNSIGNED_BYTE, buf->addr);
-  glGenerateMipmap(GL_TEXTURE_2D);
+EGLImageTexture::EGLImageTexture(const VisionBuf *buf) : buf(buf) {
+  const int w = buf->width, h = buf->height;
+  switch (buf->format) {
+    case VISIONBUF_FORMAT_RGB:
+      assert((buf->stride % 3) == 0);
+      planes[num_planes++] = {&frame_tex, GL_RGB8, GL_RGB, w, h, (int)buf->stride / 3, 0};
+      size = buf->stride * h;
+      break;
+    case VISIONBUF_FORMAT_I420:
+      planes[num_planes++] = {&frame_tex, GL_R8, GL_RED, w, h, w, 0};
+      planes[num_planes++] = {&chroma_tex[0], GL_R8, GL_RED, w / 2, h / 2, w / 2, (size_t)w * h};
+      planes[num_planes++] = {&chroma_tex[1], GL_R8, GL_RED, w / 2, h / 2, w / 2, (size_t)w * h * 5 / 4};
+      size = (size_t)w * h * 3 / 2;
+      break;
+    case VISIONBUF_FORMAT_NV12:
+      planes[num_planes++] = {&frame_tex, GL_R8, GL_RED, w, h, w, 0};
+      planes[num_planes++] = {&chroma_tex[0], GL_RG8, GL_RG, w / 2, h / 2, w / 2, (size_t)w * h};
+      size = (size_t)w * h * 3 / 2;
+      break;
+    default:
+      assert(false);
+  }
+
+  // the chroma rows are only aligned to 2 bytes
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int i = 0; i < num_planes; i++) {
+    const Plane &p = planes[i];
+    glGenTextures(1, p.tex);
+    glBindTexture(GL_TEXTURE_2D, *p.tex);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, p.row_length);
+    glTexImage2D(GL_TEXTURE_2D, 0, p.internal_format, p.width, p.height, 0, p.format, GL_UNSIGNED_BYTE, (uint8_t *)buf->addr + p.offset);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  glGenBuffers(1, &pbo);
+}
+
+void EGLImageTexture::update() {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+  // orphaned, so the copy doesn't wait for the gpu to be done with the last frame's, and the
+  // upload from it runs on the gpu's time instead of the draw's
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+  void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (dst) {
+    memcpy(dst, buf->addr, size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int i = 0; i < num_planes; i++) {
+      const Plane &p = planes[i];
+      glBindTexture(GL_TEXTURE_2D, *p.tex);
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, p.row_length);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, p.width, p.height, p.format, GL_UNSIGNED_BYTE, (const void *)p.offset);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 EGLImageTexture::~EGLImageTexture() {
+  glDeleteBuffers(1, &pbo);
   glDeleteTextures(1, &frame_tex);
+  glDeleteTextures(2, chroma_tex);
 }
 #endif // ifdef QCOM
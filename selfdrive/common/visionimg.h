@@ -23,5 +23,24 @@ class EGLImageTexture {
 #ifdef QCOM
   void *private_handle = nullptr;
   EGLImageKHR img_khr = 0;
+#else
+  // A yuv buffer's Y is frame_tex, its U and V are these, or NV12's interleaved UV the first
+  GLuint chroma_tex[2] = {};
+
+  // Uploads what's in the buffer now. The ion buffer is the texture on QCOM
+  void update();
+
+ private:
+  struct Plane {
+    GLuint *tex;
+    GLenum internal_format, format;
+    int width, height, row_length;
+    size_t offset;
+  };
+  const VisionBuf *buf;
+  Plane planes[3];
+  int num_planes = 0;
+  size_t size = 0;
+  GLuint pbo = 0;
 #endif
 };
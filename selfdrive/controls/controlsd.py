@@ -21,6 +21,7 @@ from selfdrive.controls.lib.vehicle_model import VehicleModel
 from selfdrive.controls.lib.planner import LON_MPC_STEP
 from selfdrive.locationd.calibrationd import Calibration
 from selfdrive.hardware import HARDWARE
+from selfdrive.ready import notify_ready
 
 LDW_MIN_SPEED = 31 * CV.MPH_TO_MS
 LANE_DEPARTURE_THRESHOLD = 0.1
@@ -29,6 +30,7 @@ STEER_ANGLE_SATURATION_THRESHOLD = 2.5  # Degrees
 
 SIMULATION = "SIMULATION" in os.environ
 NOSENSOR = "NOSENSOR" in os.environ
+CAN_STATS = "CAN_STATS" in os.environ
 
 ThermalStatus = log.ThermalData.ThermalStatus
 State = log.ControlsState.OpenpilotState
@@ -48,7 +50,7 @@ class Controls:
     self.pm = pm
     if self.pm is None:
       self.pm = messaging.PubMaster(['sendcan', 'controlsState', 'carState',
-                                     'carControl', 'carEvents', 'carParams'])
+                                     'carControl', 'carEvents', 'carParams'] + (['canStats'] if CAN_STATS else []))
 
     self.sm = sm
     if self.sm is None:
@@ -69,6 +71,9 @@ class Controls:
     get_one_can(self.can_sock)
 
     self.CI, self.CP = get_car(self.can_sock, self.pm.sock['sendcan'], has_relay)
+    self.stats_parsers = self.CI.can_parsers.parsers if CAN_STATS and hasattr(self.CI, 'can_parsers') else []
+    for p in self.stats_parsers:
+      p.enable_stats()
 
     # read params
     params = Params()
@@ -96,6 +101,8 @@ class Controls:
     put_nonblocking("CarParamsCache", cp_bytes)
 
     self.CC = car.CarControl.new_message()
+    self.can_mono_times = []
+    self.sendcan_mono_time = 0
     self.AM = AlertManager()
     self.events = Events()
 
@@ -245,7 +252,7 @@ class Controls:
           self.events.add(EventName.noGps)
       if not self.sm.all_alive(['frame', 'frontFrame']) and (self.sm.frame > 5 / DT_CTRL):
         self.events.add(EventName.cameraMalfunction)
-      if self.sm['modelV2'].frameDropPerc > 20:
+      if self.sm['modelV2'].frameDropPerc > 20 or self.sm['modelV2'].emergency:
         self.events.add(EventName.modeldLagging)
 
     # Only allow engagement with brake pressed when stopped behind another stopped car
@@ -259,6 +266,7 @@ class Controls:
     # Update carState from CAN
     can_strs = messaging.drain_sock_raw(self.can_sock, wait_for_one=True)
     CS = self.CI.update(self.CC, can_strs)
+    self.can_mono_times = [log.Event.from_bytes(s).logMonoTime for s in can_strs]
 
     self.sm.update(0)
 
@@ -463,7 +471,9 @@ class Controls:
     if not self.read_only:
       # send car controls over can
       can_sends = self.CI.apply(CC)
-      self.pm.send('sendcan', can_list_to_can_capnp(can_sends, msgtype='sendcan', valid=CS.canValid))
+      sendcan = can_list_to_can_capnp(can_sends, msgtype='sendcan', valid=CS.canValid)
+      self.pm.send('sendcan', sendcan)
+      self.sendcan_mono_time = log.Event.from_bytes(sendcan).logMonoTime
 
     force_decel = (self.sm['dMonitoringState'].awarenessStatus < 0.) or \
                   (self.state == State.softDisabling)
@@ -482,9 +492,11 @@ class Controls:
     controlsState.alertType = self.AM.alert_type
     controlsState.alertSound = self.AM.audible_alert
     controlsState.driverMonitoringOn = self.sm['dMonitoringState'].faceDetected
-    controlsState.canMonoTimes = list(CS.canMonoTimes)
+    controlsState.canMonoTimes = self.can_mono_times
     controlsState.planMonoTime = self.sm.logMonoTime['plan']
     controlsState.pathPlanMonoTime = self.sm.logMonoTime['pathPlan']
+    controlsState.frameId = self.sm['pathPlan'].frameId
+    controlsState.sendcanMonoTime = self.sendcan_mono_time
     controlsState.enabled = self.enabled
     controlsState.active = self.active
     controlsState.vEgo = CS.vEgo
@@ -542,6 +554,15 @@ class Controls:
       cp_send.carParams = self.CP
       self.pm.send('carParams', cp_send)
 
+    # canStats - every second, with CAN_STATS set
+    if CAN_STATS and (self.sm.frame % int(1. / DT_CTRL) == 0):
+      stats = [s for p in self.stats_parsers for s in p.stats()]
+      stats_send = messaging.new_message('canStats', len(stats))
+      for i, s in enumerate(stats):
+        for k, v in s.items():
+          setattr(stats_send.canStats[i], k, v)
+      self.pm.send('canStats', stats_send)
+
     # carControl
     cc_send = messaging.new_message('carControl')
     cc_send.valid = CS.canValid
@@ -583,6 +604,8 @@ class Controls:
 
 def main(sm=None, pm=None, logcan=None):
   controls = Controls(sm, pm, logcan)
+  # fingerprinted and with its car interface
+  notify_ready("controlsd")
   controls.controlsd_thread()
 
 
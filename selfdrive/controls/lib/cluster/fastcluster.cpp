@@ -11,6 +11,7 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 
 
 extern "C" {
@@ -180,6 +181,83 @@ extern "C" {
   }
 
 
+}
+
+template <typename T>
+struct Scratch {
+  std::vector<T> cols, row;
+  std::vector<double> pdist, height;
+  std::vector<int> merge;
+};
+
+// reused from call to call, clustering every radar update doesn't allocate once it's grown
+template <typename T>
+static Scratch<T> &scratch() {
+  static thread_local Scratch<T> s;
+  return s;
+}
+
+// Squared euclidean distances of n points of m dimensions, in the condensed layout
+// hclust_fast takes. The points are transposed to a column per dimension, so a row of
+// distances is a few vector ops per dimension. Each distance is summed over the
+// dimensions in order, as a plain loop would, so doubles come out the same
+template <typename T>
+static void pdist_sq(int n, int m, const T* pts, double* out, Scratch<T> &s) {
+  typedef T vec __attribute__((vector_size(16)));
+  const int W = sizeof(vec) / sizeof(T);
+
+  s.cols.resize((size_t)n * m);
+  s.row.resize(n);
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < m; k++) s.cols[(size_t)k * n + i] = pts[(size_t)i * m + k];
+  }
+
+  for (int i = 0; i < n - 1; i++) {
+    // distances to the points after i
+    T *row = s.row.data();
+    const int len = n - i - 1;
+    std::fill(row, row + len, T(0));
+    for (int k = 0; k < m; k++) {
+      const T *col = &s.cols[(size_t)k * n + i + 1];
+      const T ci = s.cols[(size_t)k * n + i];
+      int j = 0;
+      for (; j + W <= len; j += W) {
+        vec cj, d;
+        memcpy(&cj, col + j, sizeof(vec));
+        memcpy(&d, row + j, sizeof(vec));
+        vec error = ci - cj;
+        d += error * error;
+        memcpy(row + j, &d, sizeof(vec));
+      }
+      for (; j < len; j++) {
+        T error = ci - col[j];
+        row[j] += error * error;
+      }
+    }
+    std::copy(row, row + len, out);
+    out += len;
+  }
+}
+
+// centroid linkage cut at dist, all in the scratch memory
+template <typename T>
+static void cluster_points(int n, int m, const T* pts, double dist, int* idx) {
+  if (n < 2) {
+    for (int i = 0; i < n; i++) idx[i] = 0;
+    return;
+  }
+
+  Scratch<T> &s = scratch<T>();
+  s.pdist.resize((size_t)n * (n - 1) / 2);
+  s.merge.resize(2 * (n - 1));
+  s.height.resize(n - 1);
+
+  pdist_sq(n, m, pts, s.pdist.data(), s);
+  hclust_fast(n, s.pdist.data(), HCLUST_METHOD_CENTROID, s.merge.data(), s.height.data());
+  cutree_cdist(n, s.merge.data(), s.height.data(), dist, idx);
+}
+
+extern "C" {
   // Build condensed distance matrix
   // Input arguments:
   //   n  = number of observables
@@ -187,32 +265,14 @@ extern "C" {
   // Output arguments:
   //   out = allocated integer array of size n * (n - 1) / 2 for result
   void hclust_pdist(int n, int m, double* pts, double* out) {
-    int ii = 0;
-    for (int i = 0; i < n; i++){
-      for (int j = i + 1; j < n; j++){
-        // Compute euclidian distance
-        double d = 0;
-        for (int k = 0; k < m; k ++){
-          double error = pts[i * m + k] - pts[j * m + k];
-          d += (error * error);
-        }
-        out[ii] = d;//sqrt(d);
-        ii++;
-      }
-    }
+    pdist_sq(n, m, pts, out, scratch<double>());
   }
 
   void cluster_points_centroid(int n, int m, double* pts, double dist, int* idx) {
-    double* pdist = new double[n * (n - 1) / 2];
-    int* merge = new int[2 * (n - 1)];
-    double* height = new double[n - 1];
-
-    hclust_pdist(n, m, pts, pdist);
-    hclust_fast(n, pdist, HCLUST_METHOD_CENTROID, merge, height);
-    cutree_cdist(n, merge, height, dist, idx);
+    cluster_points(n, m, pts, dist, idx);
+  }
 
-    delete[] pdist;
-    delete[] merge;
-    delete[] height;
+  void cluster_points_centroid_f(int n, int m, const float* pts, float dist, int* idx) {
+    cluster_points(n, m, pts, dist, idx);
   }
 }
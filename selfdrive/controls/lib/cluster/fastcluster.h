@@ -71,7 +71,11 @@ enum hclust_fast_methods {
 };
 
 void hclust_pdist(int n, int m, double* pts, double* out);
+// Centroid linkage of n points of m dimensions cut at squared distance dist, in one call into
+// reused memory. Any n works, fewer than two points are a cluster of their own
 void cluster_points_centroid(int n, int m, double* pts, double dist, int* idx);
+// the same with the distances computed in float32, twice as many at a time
+void cluster_points_centroid_f(int n, int m, const float* pts, float dist, int* idx);
 
 
 #endif
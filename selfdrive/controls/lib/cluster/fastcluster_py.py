@@ -13,16 +13,28 @@ int hclust_fast(int n, double* distmat, int method, int* merge, double* height);
 void cutree_cdist(int n, const int* merge, double* height, double cdist, int* labels);
 void hclust_pdist(int n, int m, double* pts, double* out);
 void cluster_points_centroid(int n, int m, double* pts, double dist, int* idx);
+void cluster_points_centroid_f(int n, int m, const float* pts, float dist, int* idx);
 """)
 
 hclust = ffi.dlopen(cluster_fn)
 
 
-def cluster_points_centroid(pts, dist):
-  pts = np.ascontiguousarray(pts, dtype=np.float64)
-  pts_ptr = ffi.cast("double *", pts.ctypes.data)
+# grown to the most points clustered, the labels are copied out of it
+_labels = np.zeros(0, dtype=np.int32)
+
+
+def cluster_points_centroid(pts, dist, dtype=np.float64):
+  """Labels of the points clustered by centroid linkage, cut at dist. A float32 dtype computes
+  the distances at twice the width, its labels can differ for points right around dist apart"""
+  global _labels
+  pts = np.ascontiguousarray(pts, dtype=dtype)
   n, m = pts.shape
+  if len(_labels) < n:
+    _labels = np.zeros(max(n, 2 * len(_labels)), dtype=np.int32)
+  labels_ptr = ffi.from_buffer("int[]", _labels)
 
-  labels_ptr = ffi.new("int[]", n)
-  hclust.cluster_points_centroid(n, m, pts_ptr, dist**2, labels_ptr)
-  return list(labels_ptr)
+  if dtype == np.float32:
+    hclust.cluster_points_centroid_f(n, m, ffi.from_buffer("float[]", pts), dist**2, labels_ptr)
+  else:
+    hclust.cluster_points_centroid(n, m, ffi.from_buffer("double[]", pts), dist**2, labels_ptr)
+  return _labels[:n].tolist()
@@ -1,6 +1,7 @@
 #include "acado_common.h"
 #include "acado_auxiliary_functions.h"
 #include "common/modeldata.h"
+#include "mpc_common.h"
 #include <stdio.h>
 
 #define NX          ACADO_NX  /* Number of differential state variables.  */
@@ -62,11 +63,14 @@ void init(double pathCost, double headingCost, double steerRateCost){
   init_weights(pathCost, headingCost, steerRateCost);
 }
 
-int run_mpc(state_t * x0, log_t * solution, double v_ego,
-             double curvature_factor, double rotation_radius, double target_y[N+1], double target_psi[N+1]){
+int run_mpc_warm(state_t * x0, log_t * solution, double v_ego,
+                 double curvature_factor, double rotation_radius, double target_y[N+1], double target_psi[N+1],
+                 int warm_start, mpc_stats_t * stats){
 
   int    i;
 
+  mpc_warm_start(warm_start);
+
   for (i = 0; i <= NOD * N; i+= NOD){
     acadoVariables.od[i] = curvature_factor;
     acadoVariables.od[i+1] = v_ego;
@@ -86,8 +90,7 @@ int run_mpc(state_t * x0, log_t * solution, double v_ego,
   acadoVariables.x0[3] = x0->tire_angle;
 
 
-  acado_preparationStep();
-  acado_feedbackStep();
+  mpc_solve(stats);
 
   /* printf("lat its: %d\n", acado_getNWSR());  // n iterations
   printf("Objective: %.6f\n", acado_getObjective());  // solution cost */
@@ -105,8 +108,12 @@ int run_mpc(state_t * x0, log_t * solution, double v_ego,
 
   // Dont shift states here. Current solution is closer to next timestep than if
   // we use the old solution as a starting point
-  //acado_shiftStates(2, 0, 0);
-  //acado_shiftControls( 0 );
+  // unless asked to with WARM_START_SHIFT next time
 
   return acado_getNWSR();
 }
+
+int run_mpc(state_t * x0, log_t * solution, double v_ego,
+             double curvature_factor, double rotation_radius, double target_y[N+1], double target_psi[N+1]){
+  return run_mpc_warm(x0, solution, v_ego, curvature_factor, rotation_radius, target_y, target_psi, WARM_START_KEEP, NULL);
+}
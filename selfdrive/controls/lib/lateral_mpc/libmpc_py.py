@@ -22,11 +22,23 @@ typedef struct {
     double cost;
 } log_t;
 
+// from selfdrive/controls/lib/mpc_common.h
+#define WARM_START_KEEP 0
+#define WARM_START_SHIFT 1
+typedef struct {
+    int qp_iterations;
+    uint64_t solve_time_ns;
+} mpc_stats_t;
+
 void init(double pathCost, double headingCost, double steerRateCost);
 void init_weights(double pathCost, double headingCost, double steerRateCost);
 int run_mpc(state_t * x0, log_t * solution,
              double v_ego, double curvature_factor, double rotation_radius,
              double target_y[N+1], double target_psi[N+1]);
+int run_mpc_warm(state_t * x0, log_t * solution,
+             double v_ego, double curvature_factor, double rotation_radius,
+             double target_y[N+1], double target_psi[N+1],
+             int warm_start, mpc_stats_t * stats);
 """)
 
 libmpc = ffi.dlopen(libmpc_fn)
@@ -46,8 +46,11 @@ class LongitudinalMpc():
     self.libmpc.init(MPC_COST_LONG.TTC, MPC_COST_LONG.DISTANCE,
                      MPC_COST_LONG.ACCELERATION, MPC_COST_LONG.JERK)
 
-    self.mpc_solution = ffi.new("log_t *")
-    self.cur_state = ffi.new("state_t *")
+    # the state and solution live in the request, the solver's state in the library
+    self.request = libmpc_py.requests + (self.mpc_id - 1)
+    self.request.instance = self.mpc_id - 1
+    self.mpc_solution = ffi.addressof(self.request[0], "solution")
+    self.cur_state = ffi.addressof(self.request[0], "x0")
     self.cur_state[0].v_ego = 0
     self.cur_state[0].a_ego = 0
     self.a_lead_tau = _LEAD_ACCEL_TAU
@@ -57,7 +60,23 @@ class LongitudinalMpc():
     self.cur_state[0].a_ego = a
 
   def update(self, pm, CS, lead):
+    LongitudinalMpc.update_batch(pm, CS, [(self, lead)])
+
+  @staticmethod
+  def update_batch(pm, CS, mpcs):
+    """Updates mpcs of consecutive ids, a list of (mpc, lead), with a single call to the solver"""
+    ids = [mpc.mpc_id for mpc, _ in mpcs]
+    assert ids == list(range(ids[0], ids[0] + len(ids)))
+
+    for mpc, lead in mpcs:
+      mpc.prepare(CS, lead)
+    libmpc_py.libmpc.run_mpc_batch(mpcs[0][0].request, len(mpcs))
+    for mpc, _ in mpcs:
+      mpc.check_solution(pm, CS)
+
+  def prepare(self, CS, lead):
     v_ego = CS.vEgo
+    self.request.warm_start = libmpc_py.libmpc.WARM_START_KEEP
 
     # Setup current mpc state
     self.cur_state[0].x_ego = 0.0
@@ -74,7 +93,9 @@ class LongitudinalMpc():
       self.a_lead_tau = lead.aLeadTau
       self.new_lead = False
       if not self.prev_lead_status or abs(x_lead - self.prev_lead_x) > 2.5:
-        self.libmpc.init_with_simulation(self.v_mpc, x_lead, v_lead, a_lead, self.a_lead_tau)
+        # init_with_simulation(self.v_mpc, x_lead, v_lead, a_lead, self.a_lead_tau) before the solve
+        self.request.warm_start = libmpc_py.libmpc.WARM_START_SIMULATE
+        self.request.v_ego_sim = self.v_mpc
         self.new_lead = True
 
       self.prev_lead_status = True
@@ -89,13 +110,15 @@ class LongitudinalMpc():
       a_lead = 0.0
       self.a_lead_tau = _LEAD_ACCEL_TAU
 
-    # Calculate mpc
+    self.request.l = self.a_lead_tau
+    self.request.a_l_0 = a_lead
+
+  def check_solution(self, pm, CS):
+    v_ego = CS.vEgo
     t = sec_since_boot()
-    n_its = self.libmpc.run_mpc(self.cur_state, self.mpc_solution, self.a_lead_tau, a_lead)
-    duration = int((sec_since_boot() - t) * 1e9)
 
     if LOG_MPC:
-      self.send_mpc_solution(pm, n_its, duration)
+      self.send_mpc_solution(pm, self.request.stats.qp_iterations, self.request.stats.solve_time_ns)
 
     # Get solution. MPC timestep is 0.2 s, so interpolation to 0.05 s is needed
     self.v_mpc = self.mpc_solution[0].v_ego[1]
@@ -113,6 +136,7 @@ class LongitudinalMpc():
         cloudlog.warning("Longitudinal mpc %d reset - backwards: %s crashing: %s nan: %s" % (
                           self.mpc_id, backwards, crashing, nans))
 
+      self.libmpc.select_instance(self.request.instance)
       self.libmpc.init(MPC_COST_LONG.TTC, MPC_COST_LONG.DISTANCE,
                        MPC_COST_LONG.ACCELERATION, MPC_COST_LONG.JERK)
       self.cur_state[0].v_ego = v_ego
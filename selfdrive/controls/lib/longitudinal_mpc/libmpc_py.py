@@ -4,38 +4,63 @@ from cffi import FFI
 from common.ffi_wrapper import suffix
 
 mpc_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)))
+libmpc_fn = os.path.join(mpc_dir, "libmpc1"+suffix())
 
-def _get_libmpc(mpc_id):
-    libmpc_fn = os.path.join(mpc_dir, "libmpc%d%s" % (mpc_id, suffix()))
+ffi = FFI()
+ffi.cdef("""
+typedef struct {
+double x_ego, v_ego, a_ego, x_l, v_l, a_l;
+} state_t;
 
-    ffi = FFI()
-    ffi.cdef("""
-    typedef struct {
-    double x_ego, v_ego, a_ego, x_l, v_l, a_l;
-    } state_t;
 
+typedef struct {
+double x_ego[21];
+double v_ego[21];
+double a_ego[21];
+double j_ego[20];
+double x_l[21];
+double v_l[21];
+double a_l[21];
+double t[21];
+double cost;
+} log_t;
 
-    typedef struct {
-    double x_ego[21];
-    double v_ego[21];
-    double a_ego[21];
-    double j_ego[20];
-    double x_l[21];
-    double v_l[21];
-    double a_l[21];
-    double t[21];
-    double cost;
-    } log_t;
+// from selfdrive/controls/lib/mpc_common.h
+#define WARM_START_KEEP 0
+#define WARM_START_SHIFT 1
+typedef struct {
+int qp_iterations;
+uint64_t solve_time_ns;
+} mpc_stats_t;
 
-    void init(double ttcCost, double distanceCost, double accelerationCost, double jerkCost);
-    void init_with_simulation(double v_ego, double x_l, double v_l, double a_l, double l);
-    int run_mpc(state_t * x0, log_t * solution,
-                double l, double a_l_0);
-    """)
+#define WARM_START_SIMULATE 2
+#define MPC_INSTANCES 3
+typedef struct {
+int instance;
+state_t x0;
+double l, a_l_0;
+int warm_start;
+double v_ego_sim;
+log_t solution;
+mpc_stats_t stats;
+} mpc_request_t;
 
-    return (ffi, ffi.dlopen(libmpc_fn))
+void select_instance(int instance);
+void init(double ttcCost, double distanceCost, double accelerationCost, double jerkCost);
+void init_with_simulation(double v_ego, double x_l, double v_l, double a_l, double l);
+int run_mpc(state_t * x0, log_t * solution,
+            double l, double a_l_0);
+int run_mpc_warm(state_t * x0, log_t * solution,
+                 double l, double a_l_0, int warm_start, mpc_stats_t * stats);
+void run_mpc_batch(mpc_request_t * requests, int n);
+""")
+
+libmpc = ffi.dlopen(libmpc_fn)
+# a request per instance, consecutive ones are solved in one run_mpc_batch call
+requests = ffi.new("mpc_request_t[%d]" % libmpc.MPC_INSTANCES)
 
-mpcs = [_get_libmpc(1), _get_libmpc(2)]
 
 def get_libmpc(mpc_id):
-    return mpcs[mpc_id - 1]
+    """The solver for lead mpc_id, its own instance of the one library"""
+    libmpc.select_instance(mpc_id - 1)
+    return (ffi, libmpc)
@@ -1,7 +1,9 @@
 #include "acado_common.h"
 #include "acado_auxiliary_functions.h"
+#include "mpc_common.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 #define NX          ACADO_NX  /* Number of differential state variables.  */
@@ -34,6 +36,38 @@ typedef struct {
   double cost;
 } log_t;
 
+// init_with_simulation first, from the request's v_ego_sim and lead
+#define WARM_START_SIMULATE 2
+
+// A solve of one instance for run_mpc_batch
+typedef struct {
+  int instance;
+  state_t x0;
+  double l, a_l_0;
+  int warm_start;
+  double v_ego_sim;
+  log_t solution;
+  mpc_stats_t stats;
+} mpc_request_t;
+
+// lead 1, lead 2 and a spare, each with its own solver state that stays between solves
+#define MPC_INSTANCES 3
+
+// the ones not selected, the selected one is in acadoVariables and acadoWorkspace
+static ACADOvariables instance_variables[MPC_INSTANCES];
+static ACADOworkspace instance_workspace[MPC_INSTANCES];
+static int current_instance = 0;
+
+// init, init_with_simulation and run_mpc work on the selected instance, 0 to start with
+void select_instance(int instance){
+  if (instance == current_instance || instance < 0 || instance >= MPC_INSTANCES) return;
+  memcpy(&instance_variables[current_instance], &acadoVariables, sizeof(acadoVariables));
+  memcpy(&instance_workspace[current_instance], &acadoWorkspace, sizeof(acadoWorkspace));
+  memcpy(&acadoVariables, &instance_variables[instance], sizeof(acadoVariables));
+  memcpy(&acadoWorkspace, &instance_workspace[instance], sizeof(acadoWorkspace));
+  current_instance = instance;
+}
+
 void init(double ttcCost, double distanceCost, double accelerationCost, double jerkCost){
   acado_initializeSolver();
   int    i;
@@ -112,7 +146,7 @@ void init_with_simulation(double v_ego, double x_l_0, double v_l_0, double a_l_0
   for (i = 0; i < NYN; ++i)  acadoVariables.yN[ i ] = 0.0;
 }
 
-int run_mpc(state_t * x0, log_t * solution, double l, double a_l_0){
+int run_mpc_warm(state_t * x0, log_t * solution, double l, double a_l_0, int warm_start, mpc_stats_t * stats){
   // Calculate lead vehicle predictions
   int i;
   double t = 0.;
@@ -148,12 +182,12 @@ int run_mpc(state_t * x0, log_t * solution, double l, double a_l_0){
     t += dt;
   }
 
+  mpc_warm_start(warm_start);
   acadoVariables.x[0] = acadoVariables.x0[0] = x0->x_ego;
   acadoVariables.x[1] = acadoVariables.x0[1] = x0->v_ego;
   acadoVariables.x[2] = acadoVariables.x0[2] = x0->a_ego;
 
-  acado_preparationStep();
-  acado_feedbackStep();
+  mpc_solve(stats);
 
   for (i = 0; i <= N; i++){
     solution->x_ego[i] = acadoVariables.x[i*NX];
@@ -167,7 +201,24 @@ int run_mpc(state_t * x0, log_t * solution, double l, double a_l_0){
   solution->cost = acado_getObjective();
 
   // Dont shift states here. Current solution is closer to next timestep than if
-  // we shift by 0.2 seconds.
+  // we shift by 0.2 seconds, unless asked to with WARM_START_SHIFT next time.
 
   return acado_getNWSR();
 }
+
+int run_mpc(state_t * x0, log_t * solution, double l, double a_l_0){
+  return run_mpc_warm(x0, solution, l, a_l_0, WARM_START_KEEP, NULL);
+}
+
+// The requests one after another, in a single call from python
+void run_mpc_batch(mpc_request_t * requests, int n){
+  int i;
+  for (i = 0; i < n; i++){
+    mpc_request_t *r = &requests[i];
+    select_instance(r->instance);
+    if (r->warm_start == WARM_START_SIMULATE){
+      init_with_simulation(r->v_ego_sim, r->x0.x_l, r->x0.v_l, r->a_l_0, r->l);
+    }
+    run_mpc_warm(&r->x0, &r->solution, r->l, r->a_l_0, r->warm_start, &r->stats);
+  }
+}
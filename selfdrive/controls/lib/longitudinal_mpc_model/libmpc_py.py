@@ -23,10 +23,19 @@ double j_ego[20];
 double cost;
 } log_t;
 
+// from selfdrive/controls/lib/mpc_common.h
+#define WARM_START_KEEP 0
+#define WARM_START_SHIFT 1
+typedef struct {
+int qp_iterations;
+uint64_t solve_time_ns;
+} mpc_stats_t;
 
 void init(double xCost, double vCost, double aCost, double accelCost, double jerkCost);
 void init_with_simulation(double v_ego);
 int run_mpc(state_t * x0, log_t * solution, double x_poly[4], double v_poly[4], double a_poly[4]);
+int run_mpc_warm(state_t * x0, log_t * solution, double x_poly[4], double v_poly[4], double a_poly[4],
+                 int warm_start, mpc_stats_t * stats);
 """)
 
 libmpc = ffi.dlopen(libmpc_fn)
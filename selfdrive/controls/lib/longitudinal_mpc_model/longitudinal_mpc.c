@@ -1,5 +1,6 @@
 #include "acado_common.h"
 #include "acado_auxiliary_functions.h"
+#include "mpc_common.h"
 
 #include <stdio.h>
 #include <math.h>
@@ -94,10 +95,13 @@ void init_with_simulation(double v_ego){
   for (i = 0; i < NYN; ++i)  acadoVariables.yN[ i ] = 0.0;
 }
 
-int run_mpc(state_t * x0, log_t * solution,
-            double x_poly[4], double v_poly[4], double a_poly[4]){
+int run_mpc_warm(state_t * x0, log_t * solution,
+                 double x_poly[4], double v_poly[4], double a_poly[4],
+                 int warm_start, mpc_stats_t * stats){
   int i;
 
+  mpc_warm_start(warm_start);
+
   for (i = 0; i < N + 1; ++i){
     acadoVariables.od[i*NOD+0] = x_poly[0];
     acadoVariables.od[i*NOD+1] = x_poly[1];
@@ -120,8 +124,7 @@ int run_mpc(state_t * x0, log_t * solution,
   acadoVariables.x[2] = acadoVariables.x0[2] = x0->a_ego;
   acadoVariables.x[3] = acadoVariables.x0[3] = 0;
 
-  acado_preparationStep();
-  acado_feedbackStep();
+  mpc_solve(stats);
 
   for (i = 0; i <= N; i++){
     solution->x_ego[i] = acadoVariables.x[i*NX];
@@ -136,6 +139,11 @@ int run_mpc(state_t * x0, log_t * solution,
   solution->cost = acado_getObjective();
 
   // Dont shift states here. Current solution is closer to next timestep than if
-  // we shift by 0.1 seconds.
+  // we shift by 0.1 seconds, unless asked to with WARM_START_SHIFT next time.
   return acado_getNWSR();
 }
+
+int run_mpc(state_t * x0, log_t * solution,
+            double x_poly[4], double v_poly[4], double a_poly[4]){
+  return run_mpc_warm(x0, solution, x_poly, v_poly, a_poly, WARM_START_KEEP, NULL);
+}
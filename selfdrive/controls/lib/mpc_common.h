@@ -0,0 +1,40 @@
+#pragma once
+// Shared by the C interfaces of the ACADO mpcs, included after their acado_common.h
+
+#include <stdint.h>
+#include <time.h>
+
+// where a solve starts from
+enum {
+  // the last solution as it is, it's closer to the next step than shifted
+  WARM_START_KEEP = 0,
+  // the last solution shifted a node along the horizon, the last node repeated
+  WARM_START_SHIFT = 1,
+};
+
+typedef struct {
+  int qp_iterations;
+  // of the preparation and feedback steps
+  uint64_t solve_time_ns;
+} mpc_stats_t;
+
+static inline void mpc_warm_start(int warm_start) {
+  if (warm_start == WARM_START_SHIFT) {
+    acado_shiftStates(2, 0, 0);
+    acado_shiftControls(0);
+  }
+}
+
+// the preparation and feedback steps, the stats are optional
+static inline void mpc_solve(mpc_stats_t *stats) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  acado_preparationStep();
+  acado_feedbackStep();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (stats) {
+    stats->qp_iterations = acado_getNWSR();
+    stats->solve_time_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+  }
+}
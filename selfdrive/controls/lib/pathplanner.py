@@ -218,6 +218,7 @@ class PathPlanner():
     plan_solution_valid = self.solution_invalid_cnt < 2
     plan_send = messaging.new_message('pathPlan')
     plan_send.valid = sm.all_alive_and_valid(service_list=['carState', 'controlsState', 'liveParameters', 'modelV2'])
+    plan_send.pathPlan.frameId = sm['modelV2'].frameId
     plan_send.pathPlan.laneWidth = float(self.LP.lane_width)
     plan_send.pathPlan.dPathPoints = [float(x) for x in y_pts]
     plan_send.pathPlan.lProb = float(self.LP.lll_prob)
@@ -156,8 +156,7 @@ class Planner():
     self.mpc1.set_cur_state(self.v_acc_start, self.a_acc_start)
     self.mpc2.set_cur_state(self.v_acc_start, self.a_acc_start)
 
-    self.mpc1.update(pm, sm['carState'], lead_1)
-    self.mpc2.update(pm, sm['carState'], lead_2)
+    LongitudinalMpc.update_batch(pm, sm['carState'], [(self.mpc1, lead_1), (self.mpc2, lead_2)])
 
     self.choose_solution(v_cruise_setpoint, enabled)
 
@@ -187,6 +186,7 @@ class Planner():
     plan_send.valid = sm.all_alive_and_valid(service_list=['carState', 'controlsState', 'radarState'])
 
     plan_send.plan.mdMonoTime = sm.logMonoTime['modelV2']
+    plan_send.plan.frameId = sm['modelV2'].frameId
     plan_send.plan.radarStateMonoTime = sm.logMonoTime['radarState']
 
     # longitudal plan
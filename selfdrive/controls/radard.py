@@ -8,6 +8,7 @@ from cereal import car
 from common.numpy_fast import interp
 from common.params import Params
 from common.realtime import Ratekeeper, Priority, config_realtime_process
+from selfdrive.boardd.boardd import can_service
 from selfdrive.config import RADAR_TO_CAMERA
 from selfdrive.controls.lib.cluster.fastcluster_py import cluster_points_centroid
 from selfdrive.controls.lib.radar_helpers import Cluster, Track
@@ -184,16 +185,18 @@ def radard_thread(sm=None, pm=None, can_sock=None):
   cloudlog.info("radard is importing %s", CP.carName)
   RadarInterface = importlib.import_module('selfdrive.car.%s.radar_interface' % CP.carName).RadarInterface
 
+  RI = RadarInterface(CP)
+
   # *** setup messaging
   if can_sock is None:
-    can_sock = messaging.sub_sock('can')
+    # only the radar's bus when boardd publishes it on its own
+    rcp = getattr(RI, 'rcp', None)
+    can_sock = messaging.sub_sock(can_service(rcp.bus) if rcp is not None else 'can')
   if sm is None:
     sm = messaging.SubMaster(['modelV2', 'controlsState'])
   if pm is None:
     pm = messaging.PubMaster(['radarState', 'liveTracks'])
 
-  RI = RadarInterface(CP)
-
   rk = Ratekeeper(1.0 / CP.radarTimeStep, print_delay_threshold=None)
   RD = RadarD(CP.radarTimeStep, RI.delay)
 
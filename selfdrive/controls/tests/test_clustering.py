@@ -110,6 +110,25 @@ class TestClustering(unittest.TestCase):
     labels = cluster_points_centroid(TRACK_PTS, 2.5)
     self.assertTrue(same_clusters(CORRECT_LABELS, labels))
 
+  def test_cpp_wrapper_clustering_float32(self):
+    labels = cluster_points_centroid(TRACK_PTS, 2.5, dtype=np.float32)
+    self.assertTrue(same_clusters(CORRECT_LABELS, labels))
+
+  def test_cpp_wrapper_few_points(self):
+    self.assertEqual(cluster_points_centroid(TRACK_PTS[:1], 2.5), [0])
+    self.assertEqual(cluster_points_centroid(TRACK_PTS[:0].reshape(0, 3), 2.5), [])
+
+  def test_pdist_vector_remainder(self):
+    # odd counts leave points past the vector width
+    np.random.seed(1337)
+    for n in [2, 3, 5, 17, 64]:
+      pts = np.random.uniform(-50, 50, (n, 3))
+      out = np.zeros((n * (n - 1) // 2, ), dtype=np.float64)
+      hclust.hclust_pdist(n, 3, ffi.cast("double *", pts.ctypes.data), ffi.cast("double *", out.ctypes.data))
+      i, j = np.triu_indices(n, 1)
+      d = pts[i] - pts[j]
+      np.testing.assert_allclose(out, np.sum(d * d, axis=1), rtol=1e-12)
+
   def test_random_cluster(self):
     np.random.seed(1337)
     N = 1000
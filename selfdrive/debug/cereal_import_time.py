@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# Time and memory for a python process to get the cereal schemas, over a few starts
+#   ./cereal_import_time.py [runs]
+# A fresh interpreter parses log.capnp and car.capnp itself. The python daemons are forked by the
+# manager once it imported cereal, so they start with the parsed schemas and share their pages
+import os
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+CHILD = """
+import resource, time
+rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+t = time.monotonic()
+from cereal import log
+log.Event.new_message(valid=True)
+print((time.monotonic() - t) * 1000., resource.getrusage(resource.RUSAGE_SELF).ru_maxrss - rss)
+"""
+
+
+def fresh():
+  out = subprocess.check_output([sys.executable, "-c", CHILD], encoding="utf-8")
+  ms, kb = out.split()
+  return float(ms), int(kb)
+
+
+def forked():
+  r, w = os.pipe()
+  pid = os.fork()
+  if pid == 0:
+    os.close(r)
+    t = time.monotonic()
+    from cereal import log
+    log.Event.new_message(valid=True)
+    os.write(w, str((time.monotonic() - t) * 1000.).encode())
+    os._exit(0)
+  os.close(w)
+  ms = float(os.read(r, 64).decode())
+  os.close(r)
+  os.waitpid(pid, 0)
+  return ms
+
+
+if __name__ == "__main__":
+  runs = int(sys.argv[1]) if len(sys.argv) > 1 else 10
+
+  fresh_runs = [fresh() for _ in range(runs)]
+  ms = [f[0] for f in fresh_runs]
+  kb = [f[1] for f in fresh_runs]
+  print(f"fresh interpreter: {np.mean(ms):.1f} ms mean, {np.min(ms):.1f} min, {np.max(ms):.1f} max, {np.mean(kb) / 1024:.1f} MB more rss")
+
+  # what the manager does before it starts the daemons
+  import cereal  # pylint: disable=unused-import
+  ms = [forked() for _ in range(runs)]
+  print(f"forked after the import: {np.mean(ms):.2f} ms mean, {np.min(ms):.2f} min, {np.max(ms):.2f} max")
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+# Glass to actuator and CAN in to CAN out latency over a drive, by their stages
+#   ./e2e_latency.py <route> [segments]
+# A road camera frame is followed by its frameId through modelV2 and pathPlan to the first
+# controlsState that steered with it, a can event by the controlsState that read it. From there
+# the controlsState's sendcan is followed to the panda, whose echo of each frame it sent has the
+# time it went on the bus. The panda's times are per USB packet, its oldest frame's, and without
+# them the last stage is left out. Segments are done one at a time, the chains across a boundary dropped
+import bisect
+import sys
+from collections import defaultdict
+
+from selfdrive.debug.frame_latency import print_latencies
+from tools.lib.logreader import LogReader
+from tools.lib.route import Route
+
+CAN_ECHO_FLAG = 0x80
+
+
+class Segment:
+  def __init__(self, lr):
+    self.glass = {}  # frameId: timestampSof, else timestampEof
+    self.models = {}  # frameId: logMonoTime
+    self.path_plans = {}  # frameId: the first pathPlan's logMonoTime
+    self.controls = []
+    self.sendcan = {}  # logMonoTime: frames
+    self.can_rx = {}  # logMonoTime: the newest panda receive time of its frames
+    self.echoes = defaultdict(list)  # (bus, address, dat): panda send times
+
+    for msg in lr:
+      w = msg.which()
+      if w == 'frame':
+        self.glass[msg.frame.frameId] = msg.frame.timestampSof or msg.frame.timestampEof
+      elif w == 'modelV2':
+        self.models.setdefault(msg.modelV2.frameId, msg.logMonoTime)
+      elif w == 'pathPlan':
+        self.path_plans.setdefault(msg.pathPlan.frameId, msg.logMonoTime)
+      elif w == 'controlsState':
+        cs = msg.controlsState
+        self.controls.append((msg.logMonoTime, cs.frameId, list(cs.canMonoTimes), cs.sendcanMonoTime))
+      elif w == 'sendcan':
+        self.sendcan[msg.logMonoTime] = [(c.src, c.address, bytes(c.dat)) for c in msg.sendcan]
+      elif w == 'can':
+        rx = 0
+        for c in msg.can:
+          if c.src & CAN_ECHO_FLAG:
+            if c.rxTime:
+              self.echoes[(c.src & ~CAN_ECHO_FLAG, c.address, bytes(c.dat))].append(c.rxTime)
+          else:
+            rx = max(rx, c.rxTime)
+        self.can_rx[msg.logMonoTime] = rx
+
+    for times in self.echoes.values():
+      times.sort()
+
+  def on_bus(self, sendcan_time):
+    """When the last of a sendcan's frames was sent by the panda, None if one of them wasn't echoed"""
+    frames = self.sendcan.get(sendcan_time)
+    if not frames:
+      return None
+    sent = 0
+    for key in frames:
+      times = self.echoes.get(key, [])
+      i = bisect.bisect_left(times, sendcan_time)
+      if i == len(times):
+        return None
+      sent = max(sent, times[i])
+    return sent
+
+
+def glass_to_actuator(seg, stages):
+  seen = set()
+  for _, frame_id, _, sendcan_time in seg.controls:
+    if frame_id in seen or frame_id not in seg.glass or frame_id not in seg.models or not sendcan_time:
+      continue
+    seen.add(frame_id)
+    glass, model, path_plan = seg.glass[frame_id], seg.models[frame_id], seg.path_plans.get(frame_id)
+    if path_plan is None:
+      continue
+    stages['glass to modelV2'].append(model - glass)
+    stages['modelV2 to pathPlan'].append(path_plan - model)
+    stages['pathPlan to sendcan'].append(sendcan_time - path_plan)
+    sent = seg.on_bus(sendcan_time)
+    if sent is not None:
+      stages['sendcan to panda tx'].append(sent - sendcan_time)
+      stages['glass to panda tx'].append(sent - glass)
+    stages['glass to sendcan'].append(sendcan_time - glass)
+
+
+def can_to_can(seg, stages):
+  for _, _, can_times, sendcan_time in seg.controls:
+    if not can_times or not sendcan_time:
+      continue
+    # the newest can it read set the step off
+    can_time = max(can_times)
+    rx = seg.can_rx.get(can_time, 0)
+    if rx:
+      stages['panda rx to can'].append(can_time - rx)
+    stages['can to sendcan'].append(sendcan_time - can_time)
+    sent = seg.on_bus(sendcan_time)
+    if sent is not None:
+      stages['sendcan to panda tx'].append(sent - sendcan_time)
+      if rx:
+        stages['panda rx to panda tx'].append(sent - rx)
+
+
+if __name__ == "__main__":
+  if len(sys.argv) < 2:
+    print("Usage: ./e2e_latency.py <route> [segments]")
+    sys.exit(1)
+
+  route = Route(sys.argv[1])
+  log_paths = [p for p in route.log_paths() if p is not None]
+  if len(sys.argv) > 2:
+    log_paths = log_paths[:int(sys.argv[2])]
+
+  glass_stages, can_stages = defaultdict(list), defaultdict(list)
+  for path in log_paths:
+    seg = Segment(LogReader(path))
+    glass_to_actuator(seg, glass_stages)
+    can_to_can(seg, can_stages)
+
+  if glass_stages:
+    print_latencies("glass to actuator", glass_stages)
+  if can_stages:
+    print_latencies("can in to can out", can_stages)
+  if not glass_stages and not can_stages:
+    print("nothing to trace, the route's controlsState has no frameId or sendcanMonoTime")
@@ -31,7 +31,7 @@ if __name__ == "__main__":
   parser.add_argument("socket", type=str, nargs='*', help="socket name")
   args = parser.parse_args()
 
-  sm = messaging.SubMaster(['logMessage', 'androidLog'], addr=args.addr)
+  sm = messaging.SubMaster(['logMessage', 'androidLogBatch'], addr=args.addr)
 
   min_level = LEVELS[args.level]
 
@@ -47,8 +47,10 @@ if __name__ == "__main__":
       except json.decoder.JSONDecodeError:
         print(f"[{t / 1e9:.6f}] decode error: {sm['logMessage']}")
 
-    if sm.updated['androidLog']:
-      t = sm.logMonoTime['androidLog']
-      m = sm['androidLog']
-      source = ANDROID_LOG_SOURCE[m.id]
-      print(f"[{t / 1e9:.6f}] {source} {m.pid} {m.tag} - {m.message}")
+    if sm.updated['androidLogBatch']:
+      t = sm.logMonoTime['androidLogBatch']
+      for m in sm['androidLogBatch'].entries:
+        source = ANDROID_LOG_SOURCE[m.id]
+        print(f"[{t / 1e9:.6f}] {source} {m.pid} {m.tag} - {m.message}")
+      for d in sm['androidLogBatch'].dropped:
+        print(f"[{t / 1e9:.6f}] {d.count} lines of {d.tag} dropped")
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+# Latency of each camera frame through camerad, to the encoder and to the models, from a route
+#   ./frame_latency.py <route> [segments]
+# Glass is the start of frame where the sensor reports it, else the end of frame
+import sys
+from collections import defaultdict
+
+import numpy as np
+
+from tools.lib.route import Route
+from tools.lib.logreader import MultiLogIterator
+
+CAMERAS = {
+  # frame service: (encode index service, model service)
+  'frame': ('encodeIdx', 'modelV2'),
+  'wideFrame': ('wideEncodeIdx', None),
+  'frontFrame': ('frontEncodeIdx', 'driverState'),
+}
+
+
+def collect(lr):
+  frames = defaultdict(dict)
+  encodes = defaultdict(dict)
+  models = defaultdict(dict)
+  encode_cams = {v[0]: k for k, v in CAMERAS.items()}
+  model_cams = {v[1]: k for k, v in CAMERAS.items() if v[1] is not None}
+
+  for msg in lr:
+    w = msg.which()
+    if w in CAMERAS:
+      f = getattr(msg, w)
+      frames[w][f.frameId] = f
+    elif w in encode_cams:
+      e = getattr(msg, w)
+      encodes[encode_cams[w]][e.frameId] = e
+    elif w in model_cams:
+      models[model_cams[w]][getattr(msg, w).frameId] = msg.logMonoTime
+  return frames, encodes, models
+
+
+def stage_latencies(frames, encodes, models):
+  stages = defaultdict(list)
+  for frame_id, f in frames.items():
+    glass = f.timestampSof if f.timestampSof else f.timestampEof
+    if f.timestampSof:
+      stages['sof to eof'].append(f.timestampEof - f.timestampSof)
+    if f.timestampAcquired:
+      stages['eof to acquired'].append(f.timestampAcquired - f.timestampEof)
+    if f.timestampSent:
+      stages['acquired to sent'].append(f.timestampSent - f.timestampAcquired)
+    if f.gpuQueueWait:
+      # us, behind the other processes' gpu work
+      stages['debayer gpu wait'].append(f.gpuQueueWait * 1000)
+
+    e = encodes.get(frame_id)
+    if e is not None and e.timestampEncoded:
+      if f.timestampSent and e.timestampReceived:
+        stages['sent to encoder'].append(e.timestampReceived - f.timestampSent)
+        stages['encode'].append(e.timestampEncoded - e.timestampReceived)
+      stages['glass to encoded'].append(e.timestampEncoded - glass)
+
+    if frame_id in models:
+      stages['glass to model'].append(models[frame_id] - glass)
+  return stages
+
+
+def print_latencies(camera, stages):
+  print(f"\n{camera}")
+  print(f"  {'stage':20s} {'n':>7s} {'mean':>8s} {'p50':>8s} {'p90':>8s} {'p99':>8s} {'max':>8s}  ms")
+  for stage, ns in stages.items():
+    ms = np.array(ns, dtype=np.float64) / 1e6
+    p50, p90, p99 = np.percentile(ms, [50, 90, 99])
+    print(f"  {stage:20s} {len(ms):7d} {ms.mean():8.2f} {p50:8.2f} {p90:8.2f} {p99:8.2f} {ms.max():8.2f}")
+
+
+if __name__ == "__main__":
+  if len(sys.argv) < 2:
+    print("Usage: ./frame_latency.py <route> [segments]")
+    sys.exit(1)
+
+  route = Route(sys.argv[1])
+  segments = int(sys.argv[2]) if len(sys.argv) > 2 else 1
+  lr = MultiLogIterator(route.log_paths()[:segments], wraparound=False)
+
+  frames, encodes, models = collect(lr)
+  for camera in CAMERAS:
+    if frames[camera]:
+      print_latencies(camera, stage_latencies(frames[camera], encodes[camera], models[camera]))
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Writes the spans of the processes run with OPENPILOT_TRACE=1 as Chrome trace JSON,
+open it in https://ui.perfetto.dev or chrome://tracing. See selfdrive/common/trace.h"""
+import argparse
+import glob
+import json
+import mmap
+import os
+import struct
+
+# keep in sync with selfdrive/common/trace.h
+TRACE_MAGIC = 0x45435254
+TRACE_VERSION = 1
+TRACE_MAX_NAMES = 256
+TRACE_NAME_MAX = 48
+TRACE_MAX_THREADS = 64
+TRACE_RING_SIZE = 4096
+TRACE_HEADER_SIZE = 16384
+HEADER = struct.Struct("<IIiII16s")
+THREAD = struct.Struct("<Qi16s")
+THREAD_SIZE = 32 + TRACE_RING_SIZE * 24
+RECORD = struct.Struct("<QQII")
+
+
+def cstr(b):
+  return b.split(b"\0", 1)[0].decode(errors="replace")
+
+
+def live_comm(pid, tid):
+  try:
+    with open(f"/proc/{pid}/task/{tid}/comm") as f:
+      return f.read().strip()
+  except OSError:
+    return None
+
+
+def read_trace(path):
+  with open(path, "rb") as f:
+    mem = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+
+  magic, version, pid, num_names, num_threads, comm = HEADER.unpack_from(mem, 0)
+  if magic != TRACE_MAGIC or version != TRACE_VERSION:
+    return []
+
+  names_off = HEADER.size
+  names = [cstr(mem[names_off + i * TRACE_NAME_MAX:names_off + (i + 1) * TRACE_NAME_MAX])
+           for i in range(min(num_names, TRACE_MAX_NAMES))]
+
+  events = [{"name": "process_name", "ph": "M", "pid": pid, "args": {"name": cstr(comm)}}]
+  for i in range(min(num_threads, TRACE_MAX_THREADS)):
+    off = TRACE_HEADER_SIZE + i * THREAD_SIZE
+    head, tid, tname = THREAD.unpack_from(mem, off)
+    name = live_comm(pid, tid) or cstr(tname)
+    events.append({"name": "thread_name", "ph": "M", "pid": pid, "tid": tid, "args": {"name": name}})
+
+    # the oldest of the ring may be overwritten while it's read, they're left out
+    first = head - TRACE_RING_SIZE + TRACE_RING_SIZE // 8 if head > TRACE_RING_SIZE else 0
+    for n in range(first, head):
+      start, end, name_id, allocs = RECORD.unpack_from(mem, off + 32 + (n % TRACE_RING_SIZE) * RECORD.size)
+      if end < start:
+        continue
+      event = {
+        "name": names[name_id] if name_id < len(names) else "?",
+        "ph": "X",
+        "pid": pid,
+        "tid": tid,
+        "ts": start / 1e3,
+        "dur": (end - start) / 1e3,
+      }
+      # counted in programs built with scons --alloc-tracker
+      if allocs:
+        event["args"] = {"allocs": allocs}
+      events.append(event)
+  return events
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description=__doc__)
+  parser.add_argument("output", nargs="?", default="trace.json")
+  parser.add_argument("--clean", action="store_true", help="remove the traces of processes that exited")
+  args = parser.parse_args()
+
+  events = []
+  for path in sorted(glob.glob("/dev/shm/trace_*")):
+    pid = int(path.rsplit("_", 1)[1])
+    alive = os.path.exists(f"/proc/{pid}")
+    events += read_trace(path)
+    if args.clean and not alive:
+      os.remove(path)
+
+  with open(args.output, "w") as f:
+    json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, f)
+  print(f"wrote {sum(e['ph'] == 'X' for e in events)} spans to {args.output}")
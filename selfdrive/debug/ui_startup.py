@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+# Time from starting the ui to its first frame and its first onroad frame, over a few starts
+#   ./ui_startup.py [runs]
+# Run it onroad, or with camerad and a replay publishing, so there are camera frames to draw
+import os
+import re
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+from common.basedir import BASEDIR
+
+UI_DIR = os.path.join(BASEDIR, "selfdrive/ui")
+STARTUP_RE = re.compile(r"ui startup: (first frame|first onroad frame) ([\d.]+) ms")
+TIMEOUT = 60
+
+
+def measure():
+  env = dict(os.environ, LOGPRINT="debug")
+  # line buffered, it prints the logs through a pipe
+  proc = subprocess.Popen(["stdbuf", "-oL", "./_ui"], cwd=UI_DIR, env=env, stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT, universal_newlines=True)
+  times = {}
+  start = time.monotonic()
+  try:
+    for line in proc.stdout:
+      m = STARTUP_RE.search(line)
+      if m:
+        times[m.group(1)] = float(m.group(2))
+      if "first onroad frame" in times or time.monotonic() - start > TIMEOUT:
+        break
+  finally:
+    proc.terminate()
+    proc.wait()
+  return times
+
+
+if __name__ == "__main__":
+  runs = int(sys.argv[1]) if len(sys.argv) > 1 else 5
+
+  results = {"first frame": [], "first onroad frame": []}
+  for i in range(runs):
+    times = measure()
+    print(f"run {i}: " + ", ".join(f"{k} {v:.1f} ms" for k, v in times.items()))
+    for k, v in times.items():
+      results[k].append(v)
+
+  for k, v in results.items():
+    if v:
+      print(f"{k}: {np.mean(v):.1f} ms mean, {np.min(v):.1f} min, {np.max(v):.1f} max over {len(v)} runs")
+    else:
+      print(f"{k}: not reached")
@@ -0,0 +1,78 @@
+import json
+import os
+
+from selfdrive.hardware import EON, TICI
+
+# the profile the native processes set with set_sched_profile in selfdrive/common/util.h
+PROFILE_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "sched_profile.json")
+DEVICE = "eon" if EON else "tici" if TICI else "pc"
+
+POLICIES = {"fifo": os.SCHED_FIFO, "rr": os.SCHED_RR, "other": os.SCHED_OTHER}
+
+
+def load_profile(device=DEVICE):
+  with open(PROFILE_PATH) as f:
+    return json.load(f).get(device, {})
+
+
+def thread_violations(tid, entry):
+  """What of entry the thread doesn't have, as strings"""
+  violations = []
+
+  cpus = entry.get("cpus")
+  if cpus is not None:
+    allowed = os.sched_getaffinity(tid)
+    if allowed != set(cpus):
+      violations.append(f"cpus {sorted(allowed)} != {sorted(cpus)}")
+
+  policy = entry.get("policy")
+  if policy is not None:
+    cur_policy = os.sched_getscheduler(tid) & ~getattr(os, "SCHED_RESET_ON_FORK", 0)
+    if cur_policy != POLICIES[policy]:
+      cur_name = next((k for k, v in POLICIES.items() if v == cur_policy), cur_policy)
+      violations.append(f"policy {cur_name} != {policy}")
+    elif policy == "other":
+      nice = os.getpriority(os.PRIO_PROCESS, tid)
+      if nice != entry.get("nice", 0):
+        violations.append(f"nice {nice} != {entry.get('nice', 0)}")
+    else:
+      priority = os.sched_getparam(tid).sched_priority
+      if priority != entry.get("priority", 0):
+        violations.append(f"priority {priority} != {entry.get('priority', 0)}")
+  return violations
+
+
+def check_profile(pids, profile):
+  """The threads that don't match the profile, pids is the profile names of the running processes
+  and their pid. Returns {(process, thread, tid): [violation, ...]}"""
+  ret = {}
+  for name, pid in pids.items():
+    threads = profile.get(name)
+    if not threads:
+      continue
+
+    try:
+      tids = [int(t) for t in os.listdir(f"/proc/{pid}/task")]
+    except OSError:
+      continue
+
+    for tid in tids:
+      if tid == pid:
+        thread = "main"
+      else:
+        try:
+          with open(f"/proc/{pid}/task/{tid}/comm") as f:
+            thread = f.read().strip()
+        except OSError:
+          continue
+
+      entry = threads.get(thread)
+      if entry is None:
+        continue
+      try:
+        violations = thread_violations(tid, entry)
+      except OSError:
+        continue
+      if violations:
+        ret[(name, thread, tid)] = violations
+  return ret
@@ -173,6 +173,13 @@ class Localizer():
       cloudlog.error("Error in predict and observe, kalman reset")
       self.reset_kalman()
 
+  def update_kalman_batch(self, time, observations):
+    try:
+      self.kf.predict_and_observe_batch(time, observations)
+    except KalmanError:
+      cloudlog.error("Error in predict and observe, kalman reset")
+      self.reset_kalman()
+
   def handle_gps(self, current_time, log):
     # ignore the message if the fix is invalid
     if log.flags % 2 == 0:
@@ -236,7 +243,8 @@ class Localizer():
                          np.concatenate([trans_device, 10*trans_device_std]))
 
   def handle_sensors(self, current_time, log):
-    # TODO does not yet account for double sensor readings in the log
+    # the readings of the message are fused in one update per kind
+    observations = {ObservationKind.PHONE_GYRO: [], ObservationKind.PHONE_ACCEL: []}
     for sensor_reading in log:
       # TODO: handle messages from two IMUs at the same time
       if sensor_reading.source == SensorSource.lsm6ds3:
@@ -247,7 +255,7 @@ class Localizer():
         self.gyro_counter += 1
         if self.gyro_counter % SENSOR_DECIMATION == 0:
           v = sensor_reading.gyroUncalibrated.v
-          self.update_kalman(current_time, ObservationKind.PHONE_GYRO, [-v[2], -v[1], -v[0]])
+          observations[ObservationKind.PHONE_GYRO].append([-v[2], -v[1], -v[0]])
 
       # Accelerometer
       if sensor_reading.sensor == 1 and sensor_reading.type == 1:
@@ -258,7 +266,9 @@ class Localizer():
         self.acc_counter += 1
         if self.acc_counter % SENSOR_DECIMATION == 0:
           v = sensor_reading.acceleration.v
-          self.update_kalman(current_time, ObservationKind.PHONE_ACCEL, [-v[2], -v[1], -v[0]])
+          observations[ObservationKind.PHONE_ACCEL].append([-v[2], -v[1], -v[0]])
+
+    self.update_kalman_batch(current_time, observations)
 
   def handle_live_calib(self, current_time, log):
     if len(log.rpyCalib):
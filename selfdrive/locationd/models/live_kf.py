@@ -254,34 +254,35 @@ class LiveKalman():
 
     return r
 
+  def predict_and_observe_batch(self, t, observations):
+    """Fuses the measurements of a time in one go, observations is kind -> [meas, ...].
+    Each kind is one update of all its measurements, the prediction to t is only done once"""
+    r = None
+    for kind, meas in observations.items():
+      if len(meas) > 0:
+        r = self.predict_and_observe(t, kind, meas)
+    return r
+
   def get_R(self, kind, n):
-    obs_noise = self.obs_noise[kind]
-    dim = obs_noise.shape[0]
+    return np.repeat(self.obs_noise[kind][None], n, axis=0)
+
+  @staticmethod
+  def diag_R(std):
+    # the covariances of measurements that come with their stds
+    n, dim = std.shape
     R = np.zeros((n, dim, dim))
-    for i in range(n):
-      R[i, :, :] = obs_noise
+    R[:, np.arange(dim), np.arange(dim)] = std**2
     return R
 
   def predict_and_update_odo_speed(self, speed, t, kind):
     z = np.array(speed)
-    R = np.zeros((len(speed), 1, 1))
-    for i, _ in enumerate(z):
-      R[i, :, :] = np.diag([0.2**2])
-    return self.filter.predict_and_update_batch(t, kind, z, R)
+    return self.filter.predict_and_update_batch(t, kind, z, self.get_R(kind, len(z)))
 
   def predict_and_update_odo_trans(self, trans, t, kind):
-    z = trans[:, :3]
-    R = np.zeros((len(trans), 3, 3))
-    for i, _ in enumerate(z):
-        R[i, :, :] = np.diag(trans[i, 3:]**2)
-    return self.filter.predict_and_update_batch(t, kind, z, R)
+    return self.filter.predict_and_update_batch(t, kind, trans[:, :3], self.diag_R(trans[:, 3:]))
 
   def predict_and_update_odo_rot(self, rot, t, kind):
-    z = rot[:, :3]
-    R = np.zeros((len(rot), 3, 3))
-    for i, _ in enumerate(z):
-        R[i, :, :] = np.diag(rot[i, 3:]**2)
-    return self.filter.predict_and_update_batch(t, kind, z, R)
+    return self.filter.predict_and_update_batch(t, kind, rot[:, :3], self.diag_R(rot[:, 3:]))
 
 
 if __name__ == "__main__":
@@ -128,10 +128,15 @@ class EphemerisData {
     bool ionoCoeffsValid;
 };
 
-UbloxMsgParser::UbloxMsgParser() :bytes_in_parse_buf(0) {
+UbloxMsgParser::UbloxMsgParser() :msg(NULL), msg_len(0), bytes_in_parse_buf(0), ck_a(0), ck_b(0) {
   nav_frame_buffer[0U] = std::map<uint8_t, subframes_map>();
   for(int i = 1;i < 33;i++)
     nav_frame_buffer[0U][i] = subframes_map();
+
+  // the builder zeroes what it used of the first segment when it's done, so it starts zeroed once
+  scratch = kj::heapArray<capnp::word>(UBLOX_SCRATCH_WORDS);
+  memset(scratch.begin(), 0, scratch.asBytes().size());
+  out = kj::heapArray<capnp::word>(UBLOX_SCRATCH_WORDS);
 }
 
 inline int UbloxMsgParser::needed_bytes() {
@@ -146,11 +151,6 @@ inline int UbloxMsgParser::needed_bytes() {
 }
 
 inline bool UbloxMsgParser::valid_cheksum() {
-  uint8_t ck_a = 0, ck_b = 0;
-  for(int i = 2; i < bytes_in_parse_buf - UBLOX_CHECKSUM_SIZE;i++) {
-    ck_a = (ck_a + msg_parse_buf[i]) & 0xFF;
-    ck_b = (ck_b + ck_a) & 0xFF;
-  }
   if(ck_a != msg_parse_buf[bytes_in_parse_buf - 2]) {
     LOGD("Checksum a mismtach: %02X, %02X", ck_a, msg_parse_buf[6]);
     return false;
@@ -182,56 +182,91 @@ inline bool UbloxMsgParser::valid_so_far() {
   return true;
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_solution() {
-  nav_pvt_msg *msg = (nav_pvt_msg *)&msg_parse_buf[UBLOX_HEADER_SIZE];
-  MessageBuilder msg_builder;
+// The checksum runs over class, id, length and payload, everything but the preamble and itself
+inline void UbloxMsgParser::append(const uint8_t *data, size_t len) {
+  int start = std::max(bytes_in_parse_buf, 2);
+  memcpy(msg_parse_buf + bytes_in_parse_buf, data, len);
+  bytes_in_parse_buf += len;
+
+  int end = bytes_in_parse_buf;
+  if(end >= UBLOX_HEADER_SIZE)
+    end = std::min(end, UBLOX_MSG_SIZE(msg_parse_buf) + UBLOX_HEADER_SIZE);
+  for(int i = start; i < end; i++) {
+    ck_a = ck_a + msg_parse_buf[i];
+    ck_b = ck_b + ck_a;
+  }
+}
+
+// Corrupted msg, drop a byte and checksum what's left again. Only on bad data
+void UbloxMsgParser::drop_byte() {
+  int remaining = bytes_in_parse_buf - 1;
+  uint8_t tmp[UBLOX_HEADER_SIZE + UBLOX_MAX_MSG_SIZE];
+  memcpy(tmp, &msg_parse_buf[1], remaining);
+  bytes_in_parse_buf = 0;
+  ck_a = ck_b = 0;
+  append(tmp, remaining);
+}
+
+kj::ArrayPtr<const capnp::byte> UbloxMsgParser::serialize(MessageBuilder &msg_builder) {
+  size_t size = capnp::computeSerializedSizeInWords(msg_builder);
+  if(size > out.size()) {
+    out = kj::heapArray<capnp::word>(size);
+  }
+  kj::ArrayOutputStream stream(out.asBytes());
+  capnp::writeMessage(stream, msg_builder);
+  return stream.getArray();
+}
+
+kj::ArrayPtr<const capnp::byte> UbloxMsgParser::gen_solution() {
+  const nav_pvt_msg *pvt = (const nav_pvt_msg *)&msg[UBLOX_HEADER_SIZE];
+  MessageBuilder msg_builder(scratch);
   auto gpsLoc = msg_builder.initEvent().initGpsLocationExternal();
   gpsLoc.setSource(cereal::GpsLocationData::SensorSource::UBLOX);
-  gpsLoc.setFlags(msg->flags);
-  gpsLoc.setLatitude(msg->lat * 1e-07);
-  gpsLoc.setLongitude(msg->lon * 1e-07);
-  gpsLoc.setAltitude(msg->height * 1e-03);
-  gpsLoc.setSpeed(msg->gSpeed * 1e-03);
-  gpsLoc.setBearing(msg->headMot * 1e-5);
-  gpsLoc.setAccuracy(msg->hAcc * 1e-03);
+  gpsLoc.setFlags(pvt->flags);
+  gpsLoc.setLatitude(pvt->lat * 1e-07);
+  gpsLoc.setLongitude(pvt->lon * 1e-07);
+  gpsLoc.setAltitude(pvt->height * 1e-03);
+  gpsLoc.setSpeed(pvt->gSpeed * 1e-03);
+  gpsLoc.setBearing(pvt->headMot * 1e-5);
+  gpsLoc.setAccuracy(pvt->hAcc * 1e-03);
   std::tm timeinfo = std::tm();
-  timeinfo.tm_year = msg->year - 1900;
-  timeinfo.tm_mon = msg->month - 1;
-  timeinfo.tm_mday = msg->day;
-  timeinfo.tm_hour = msg->hour;
-  timeinfo.tm_min = msg->min;
-  timeinfo.tm_sec = msg->sec;
+  timeinfo.tm_year = pvt->year - 1900;
+  timeinfo.tm_mon = pvt->month - 1;
+  timeinfo.tm_mday = pvt->day;
+  timeinfo.tm_hour = pvt->hour;
+  timeinfo.tm_min = pvt->min;
+  timeinfo.tm_sec = pvt->sec;
   std::time_t utc_tt = timegm(&timeinfo);
-  gpsLoc.setTimestamp(utc_tt * 1e+03 + msg->nano * 1e-06);
-  float f[] = { msg->velN * 1e-03f, msg->velE * 1e-03f, msg->velD * 1e-03f };
+  gpsLoc.setTimestamp(utc_tt * 1e+03 + pvt->nano * 1e-06);
+  float f[] = { pvt->velN * 1e-03f, pvt->velE * 1e-03f, pvt->velD * 1e-03f };
   gpsLoc.setVNED(f);
-  gpsLoc.setVerticalAccuracy(msg->vAcc * 1e-03);
-  gpsLoc.setSpeedAccuracy(msg->sAcc * 1e-03);
-  gpsLoc.setBearingAccuracy(msg->headAcc * 1e-05);
-  return capnp::messageToFlatArray(msg_builder);
+  gpsLoc.setVerticalAccuracy(pvt->vAcc * 1e-03);
+  gpsLoc.setSpeedAccuracy(pvt->sAcc * 1e-03);
+  gpsLoc.setBearingAccuracy(pvt->headAcc * 1e-05);
+  return serialize(msg_builder);
 }
 
 inline bool bit_to_bool(uint8_t val, int shifts) {
   return (bool)(val & (1 << shifts));
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_raw() {
-  rxm_raw_msg *msg = (rxm_raw_msg *)&msg_parse_buf[UBLOX_HEADER_SIZE];
-  if(bytes_in_parse_buf != (
-    UBLOX_HEADER_SIZE + sizeof(rxm_raw_msg) + msg->numMeas * sizeof(rxm_raw_msg_extra) + UBLOX_CHECKSUM_SIZE
+kj::ArrayPtr<const capnp::byte> UbloxMsgParser::gen_raw() {
+  const rxm_raw_msg *raw = (const rxm_raw_msg *)&msg[UBLOX_HEADER_SIZE];
+  if(msg_len != (
+    UBLOX_HEADER_SIZE + sizeof(rxm_raw_msg) + raw->numMeas * sizeof(rxm_raw_msg_extra) + UBLOX_CHECKSUM_SIZE
     )) {
-    LOGD("Invalid measurement size %u, %u, %u, %u", msg->numMeas, bytes_in_parse_buf, sizeof(rxm_raw_msg_extra), sizeof(rxm_raw_msg));
-    return kj::Array<capnp::word>();
+    LOGD("Invalid measurement size %u, %u, %u, %u", raw->numMeas, (unsigned)msg_len, sizeof(rxm_raw_msg_extra), sizeof(rxm_raw_msg));
+    return kj::ArrayPtr<const capnp::byte>();
   }
-  rxm_raw_msg_extra *measurements = (rxm_raw_msg_extra *)&msg_parse_buf[UBLOX_HEADER_SIZE + sizeof(rxm_raw_msg)];
-  MessageBuilder msg_builder;
+  const rxm_raw_msg_extra *measurements = (const rxm_raw_msg_extra *)&msg[UBLOX_HEADER_SIZE + sizeof(rxm_raw_msg)];
+  MessageBuilder msg_builder(scratch);
   auto mr = msg_builder.initEvent().initUbloxGnss().initMeasurementReport();
-  mr.setRcvTow(msg->rcvTow);
-  mr.setGpsWeek(msg->week);
-  mr.setLeapSeconds(msg->leapS);
-  mr.setGpsWeek(msg->week);
-  auto mb = mr.initMeasurements(msg->numMeas);
-  for(int8_t i = 0; i < msg->numMeas; i++) {
+  mr.setRcvTow(raw->rcvTow);
+  mr.setGpsWeek(raw->week);
+  mr.setLeapSeconds(raw->leapS);
+  mr.setGpsWeek(raw->week);
+  auto mb = mr.initMeasurements(raw->numMeas);
+  for(int8_t i = 0; i < raw->numMeas; i++) {
     mb[i].setSvId(measurements[i].svId);
     mb[i].setSigId(measurements[i].sigId);
     mb[i].setPseudorange(measurements[i].prMes);
@@ -251,29 +286,29 @@ kj::Array<capnp::word> UbloxMsgParser::gen_raw() {
     ts.setHalfCycleSubtracted(bit_to_bool(measurements[i].trkStat, 3));
   }
 
-  mr.setNumMeas(msg->numMeas);
+  mr.setNumMeas(raw->numMeas);
   auto rs = mr.initReceiverStatus();
-  rs.setLeapSecValid(bit_to_bool(msg->recStat, 0));
-  rs.setClkReset(bit_to_bool(msg->recStat, 2));
-  return capnp::messageToFlatArray(msg_builder);
+  rs.setLeapSecValid(bit_to_bool(raw->recStat, 0));
+  rs.setClkReset(bit_to_bool(raw->recStat, 2));
+  return serialize(msg_builder);
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_nav_data() {
-  rxm_sfrbx_msg *msg = (rxm_sfrbx_msg *)&msg_parse_buf[UBLOX_HEADER_SIZE];
-  if(bytes_in_parse_buf != (
-    UBLOX_HEADER_SIZE + sizeof(rxm_sfrbx_msg) + msg->numWords * sizeof(rxm_sfrbx_msg_extra) + UBLOX_CHECKSUM_SIZE
+kj::ArrayPtr<const capnp::byte> UbloxMsgParser::gen_nav_data() {
+  const rxm_sfrbx_msg *sfrbx = (const rxm_sfrbx_msg *)&msg[UBLOX_HEADER_SIZE];
+  if(msg_len != (
+    UBLOX_HEADER_SIZE + sizeof(rxm_sfrbx_msg) + sfrbx->numWords * sizeof(rxm_sfrbx_msg_extra) + UBLOX_CHECKSUM_SIZE
     )) {
-    LOGD("Invalid sfrbx words size %u, %u, %u, %u", msg->numWords, bytes_in_parse_buf, sizeof(rxm_raw_msg_extra), sizeof(rxm_raw_msg));
-    return kj::Array<capnp::word>();
+    LOGD("Invalid sfrbx words size %u, %u, %u, %u", sfrbx->numWords, (unsigned)msg_len, sizeof(rxm_raw_msg_extra), sizeof(rxm_raw_msg));
+    return kj::ArrayPtr<const capnp::byte>();
   }
-  rxm_sfrbx_msg_extra *measurements = (rxm_sfrbx_msg_extra *)&msg_parse_buf[UBLOX_HEADER_SIZE + sizeof(rxm_sfrbx_msg)];
-  if(msg->gnssId  == 0) {
+  const rxm_sfrbx_msg_extra *measurements = (const rxm_sfrbx_msg_extra *)&msg[UBLOX_HEADER_SIZE + sizeof(rxm_sfrbx_msg)];
+  if(sfrbx->gnssId  == 0) {
     uint8_t subframeId =  GET_FIELD_U(measurements[1].dwrd, 3, 8);
     std::vector<uint32_t> words;
-    for(int i = 0; i < msg->numWords;i++)
+    for(int i = 0; i < sfrbx->numWords;i++)
       words.push_back(measurements[i].dwrd);
 
-    subframes_map &map = nav_frame_buffer[msg->gnssId][msg->svid];
+    subframes_map &map = nav_frame_buffer[sfrbx->gnssId][sfrbx->svid];
     if (subframeId == 1) {
       map = subframes_map();
       map[subframeId] = words;
@@ -281,8 +316,8 @@ kj::Array<capnp::word> UbloxMsgParser::gen_nav_data() {
       map[subframeId] = words;
     }
     if(map.size() == 5) {
-      EphemerisData ephem_data(msg->svid, map);
-      MessageBuilder msg_builder;
+      EphemerisData ephem_data(sfrbx->svid, map);
+      MessageBuilder msg_builder(scratch);
       auto eph = msg_builder.initEvent().initUbloxGnss().initEphemeris();
       eph.setSvId(ephem_data.svId);
       eph.setToc(ephem_data.toc);
@@ -316,47 +351,88 @@ kj::Array<capnp::word> UbloxMsgParser::gen_nav_data() {
         eph.setIonoAlpha(kj::ArrayPtr<const double>());
         eph.setIonoBeta(kj::ArrayPtr<const double>());
       }
-      return capnp::messageToFlatArray(msg_builder);
+      return serialize(msg_builder);
     }
   }
-  return kj::Array<capnp::word>();
+  return kj::ArrayPtr<const capnp::byte>();
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw() {
-  mon_hw_msg *msg = (mon_hw_msg *)&msg_parse_buf[UBLOX_HEADER_SIZE];
+kj::ArrayPtr<const capnp::byte> UbloxMsgParser::gen_mon_hw() {
+  const mon_hw_msg *hw = (const mon_hw_msg *)&msg[UBLOX_HEADER_SIZE];
 
-  MessageBuilder msg_builder;
+  MessageBuilder msg_builder(scratch);
   auto hwStatus = msg_builder.initEvent().initUbloxGnss().initHwStatus();
-  hwStatus.setNoisePerMS(msg->noisePerMS);
-  hwStatus.setAgcCnt(msg->agcCnt);
-  hwStatus.setAStatus((cereal::UbloxGnss::HwStatus::AntennaSupervisorState) msg->aStatus);
-  hwStatus.setAPower((cereal::UbloxGnss::HwStatus::AntennaPowerStatus) msg->aPower);
-  hwStatus.setJamInd(msg->jamInd);
-  return capnp::messageToFlatArray(msg_builder);
+  hwStatus.setNoisePerMS(hw->noisePerMS);
+  hwStatus.setAgcCnt(hw->agcCnt);
+  hwStatus.setAStatus((cereal::UbloxGnss::HwStatus::AntennaSupervisorState) hw->aStatus);
+  hwStatus.setAPower((cereal::UbloxGnss::HwStatus::AntennaPowerStatus) hw->aPower);
+  hwStatus.setJamInd(hw->jamInd);
+  return serialize(msg_builder);
 }
 
-bool UbloxMsgParser::add_data(const uint8_t *incoming_data, uint32_t incoming_data_len, size_t &bytes_consumed) {
+bool UbloxMsgParser::add_buffered(const uint8_t *incoming_data, uint32_t incoming_data_len, size_t &bytes_consumed) {
   int needed = needed_bytes();
   if(needed > 0) {
     bytes_consumed = std::min((uint32_t)needed, incoming_data_len );
     // Add data to buffer
-    memcpy(msg_parse_buf + bytes_in_parse_buf, incoming_data, bytes_consumed);
-    bytes_in_parse_buf += bytes_consumed;
+    append(incoming_data, bytes_consumed);
   } else {
     bytes_consumed = incoming_data_len;
   }
   // Validate msg format, detect invalid header and invalid checksum.
   while(!valid_so_far() && bytes_in_parse_buf != 0) {
     //LOGD("Drop corrupt data, remained in buf: %u", bytes_in_parse_buf);
-    // Corrupted msg, drop a byte.
-    bytes_in_parse_buf -= 1;
-    if(bytes_in_parse_buf > 0)
-      memmove(&msg_parse_buf[0], &msg_parse_buf[1], bytes_in_parse_buf);
+    drop_byte();
   }
   // There is redundant data at the end of buffer, reset the buffer.
   if(needed_bytes() == -1)
-    bytes_in_parse_buf = 0;
-  return valid();
+    reset();
+  if(!valid())
+    return false;
+  msg = msg_parse_buf;
+  msg_len = bytes_in_parse_buf;
+  return true;
+}
+
+bool UbloxMsgParser::add_data(const uint8_t *incoming_data, uint32_t incoming_data_len, size_t &bytes_consumed) {
+  if(bytes_in_parse_buf > 0)
+    return add_buffered(incoming_data, incoming_data_len, bytes_consumed);
+
+  // Scan for a frame in place, skipping a byte at a time past anything that isn't one
+  size_t i = 0;
+  while(i < incoming_data_len) {
+    const uint8_t *d = incoming_data + i;
+    size_t left = incoming_data_len - i;
+    if(d[0] != PREAMBLE1 || (left > 1 && d[1] != PREAMBLE2)) {
+      i++;
+      continue;
+    }
+    if(left < UBLOX_HEADER_SIZE)
+      break;
+    size_t frame_len = UBLOX_MSG_SIZE(d) + UBLOX_HEADER_SIZE + UBLOX_CHECKSUM_SIZE;
+    if(left < frame_len)
+      break;
+
+    uint8_t a = 0, b = 0;
+    for(size_t j = 2; j < frame_len - UBLOX_CHECKSUM_SIZE; j++) {
+      a = a + d[j];
+      b = b + a;
+    }
+    if(a != d[frame_len - 2] || b != d[frame_len - 1]) {
+      i++;
+      continue;
+    }
+    msg = d;
+    msg_len = frame_len;
+    bytes_consumed = i + frame_len;
+    return true;
+  }
+
+  // The frame continues in the next data, buffer its start
+  size_t buffered = 0;
+  bool ret = i < incoming_data_len && add_buffered(incoming_data + i, incoming_data_len - i, buffered);
+  bytes_consumed = i + buffered;
+  return ret;
 }
 
 }
@@ -114,6 +114,7 @@ namespace ublox {
   const uint8_t CLASS_NAV = 0x01;
   const uint8_t CLASS_RXM = 0x02;
   const uint8_t CLASS_MON = 0x0A;
+  const uint8_t CLASS_MGA = 0x13;
 
   // NAV messages
   const uint8_t MSG_NAV_PVT = 0x7;
@@ -125,9 +126,15 @@ namespace ublox {
   // MON messages
   const uint8_t MSG_MON_HW = 0x09;
 
+  // MGA messages
+  const uint8_t MSG_MGA_ACK = 0x60;
+  const uint8_t MSG_MGA_DBD = 0x80;
+
   const int UBLOX_HEADER_SIZE = 6;
   const int UBLOX_CHECKSUM_SIZE = 2;
   const int UBLOX_MAX_MSG_SIZE = 65536;
+  // first segment every event is built on, fits a full measurement report
+  const int UBLOX_SCRATCH_WORDS = 4096;
 
   typedef std::map<uint8_t, std::vector<uint32_t>> subframes_map;
 
@@ -135,21 +142,33 @@ namespace ublox {
     public:
 
       UbloxMsgParser();
-      kj::Array<capnp::word> gen_solution();
-      kj::Array<capnp::word> gen_raw();
-      kj::Array<capnp::word> gen_mon_hw();
-
-      kj::Array<capnp::word> gen_nav_data();
+      // The serialized event of the current frame, empty if it makes none. Events are built on a
+      // reused first segment into a reused buffer, so the bytes are valid until the next gen_*
+      kj::ArrayPtr<const capnp::byte> gen_solution();
+      kj::ArrayPtr<const capnp::byte> gen_raw();
+      kj::ArrayPtr<const capnp::byte> gen_mon_hw();
+
+      kj::ArrayPtr<const capnp::byte> gen_nav_data();
+      // A frame that's all in incoming_data is parsed in place, which stays valid until reset.
+      // Only a frame split across calls is copied
       bool add_data(const uint8_t *incoming_data, uint32_t incoming_data_len, size_t &bytes_consumed);
-      inline void reset() {bytes_in_parse_buf = 0;}
+      inline void reset() {
+        bytes_in_parse_buf = 0;
+        ck_a = ck_b = 0;
+        msg = NULL;
+      }
       inline uint8_t msg_class() {
-        return msg_parse_buf[2];
+        return msg[2];
       }
 
       inline uint8_t msg_id() {
-        return msg_parse_buf[3];
+        return msg[3];
+      }
+
+      // the whole frame, header and checksum included
+      inline kj::ArrayPtr<const uint8_t> frame() {
+        return kj::arrayPtr(msg, msg_len);
       }
-      inline int needed_bytes();
 
       void hexdump(uint8_t *d, int l) {
         for (int i = 0; i < l; i++) {
@@ -159,13 +178,27 @@ namespace ublox {
         printf("\n");
       }
     private:
+      inline int needed_bytes();
       inline bool valid_cheksum();
       inline bool valid();
       inline bool valid_so_far();
+      inline void append(const uint8_t *data, size_t len);
+      void drop_byte();
+      bool add_buffered(const uint8_t *incoming_data, uint32_t incoming_data_len, size_t &bytes_consumed);
+      kj::ArrayPtr<const capnp::byte> serialize(MessageBuilder &msg_builder);
+
+      // the current frame, in the caller's data or msg_parse_buf
+      const uint8_t *msg;
+      size_t msg_len;
 
       uint8_t msg_parse_buf[UBLOX_HEADER_SIZE + UBLOX_MAX_MSG_SIZE];
       int bytes_in_parse_buf;
+      // rolling checksum of the buffered frame
+      uint8_t ck_a, ck_b;
       std::map<uint8_t, std::map<uint8_t, subframes_map>> nav_frame_buffer;
+
+      kj::Array<capnp::word> scratch;
+      kj::Array<capnp::word> out;
   };
 
 }
@@ -0,0 +1,66 @@
+// Parses a raw ublox stream through UbloxMsgParser in ubloxRaw sized pieces and times it
+//   ubloxd_bench <ubloxRaw.stream> [runs]
+// The stream is in test/ubloxRaw.tar.gz
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "common/timing.h"
+#include "common/util.h"
+#include "ublox_msg.h"
+
+using namespace ublox;
+
+// what boardd puts in one ubloxRaw
+#define CHUNK_SIZE 128
+
+int main(int argc, char** argv) {
+  if(argc < 2) {
+    printf("Format: ubloxd_bench stream_file_path [runs]\n");
+    return 0;
+  }
+  size_t len = 0;
+  uint8_t *data = (uint8_t *)read_file(argv[1], &len);
+  if(data == NULL) {
+    printf("Read file %s failed\n", argv[1]);
+    return -1;
+  }
+  int runs = argc > 2 ? atoi(argv[2]) : 10;
+
+  int frames = 0, events = 0;
+  size_t event_bytes = 0;
+  double start = millis_since_boot();
+  for(int run = 0; run < runs; run++) {
+    UbloxMsgParser parser;
+    for(size_t offset = 0; offset < len; offset += CHUNK_SIZE) {
+      size_t chunk = std::min((size_t)CHUNK_SIZE, len - offset);
+      size_t consumed = 0;
+      while(consumed < chunk) {
+        size_t consumed_this_time = 0;
+        if(parser.add_data(data + offset + consumed, chunk - consumed, consumed_this_time)) {
+          kj::ArrayPtr<const capnp::byte> bytes;
+          if(parser.msg_class() == CLASS_NAV && parser.msg_id() == MSG_NAV_PVT) {
+            bytes = parser.gen_solution();
+          } else if(parser.msg_class() == CLASS_RXM && parser.msg_id() == MSG_RXM_RAW) {
+            bytes = parser.gen_raw();
+          } else if(parser.msg_class() == CLASS_RXM && parser.msg_id() == MSG_RXM_SFRBX) {
+            bytes = parser.gen_nav_data();
+          } else if(parser.msg_class() == CLASS_MON && parser.msg_id() == MSG_MON_HW) {
+            bytes = parser.gen_mon_hw();
+          }
+          frames++;
+          events += bytes.size() > 0;
+          event_bytes += bytes.size();
+          parser.reset();
+        }
+        consumed += consumed_this_time;
+      }
+    }
+  }
+  double ms = millis_since_boot() - start;
+
+  printf("%d runs over %zu bytes: %d frames, %d events, %zu event bytes\n", runs, len, frames / runs, events / runs, event_bytes / runs);
+  printf("%.2f ms per run, %.2f us per frame\n", ms / runs, ms * 1000. / std::max(frames, 1));
+  free(data);
+  return 0;
+}
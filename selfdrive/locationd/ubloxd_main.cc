@@ -19,12 +19,66 @@
 
 #include "ublox_msg.h"
 
+// a database dump is done once the ublox sent no more of it for this long
+#define DATABASE_DUMP_NS 1000000000ULL
+// the fix boardd gives the ublox at init, saved this often with a good one
+#define POSITION_SAVE_NS (60 * 1000000000ULL)
+#define POSITION_SAVE_HACC_MM (50 * 1000)
+// NAV-PVT comes at 10 Hz, a gap this long is the ublox restarting
+#define RESTART_GAP_NS 500000000ULL
+
 ExitHandler do_exit;
 using namespace ublox;
+
+// Saves what boardd gives the ublox at the next init to start hot, see Pigeon::init, and logs the time
+// from its first solution after a restart to the first fix
+class GnssAssistance {
+  Params params;
+  std::string database;
+  uint64_t database_last = 0;
+  uint64_t position_saved = 0;
+  uint64_t pvt_last = 0, pvt_first = 0;
+  bool fixed = false;
+
+public:
+  void database_frame(kj::ArrayPtr<const uint8_t> frame, uint64_t t) {
+    database.append((const char *)frame.begin(), frame.size());
+    database_last = t;
+  }
+
+  void any_frame(uint64_t t) {
+    if (!database.empty() && t - database_last > DATABASE_DUMP_NS) {
+      LOGW("gps database of %zu bytes saved", database.size());
+      params.write_db_value("GnssDatabase", database);
+      database.clear();
+    }
+  }
+
+  void solution(const nav_pvt_msg *pvt, uint64_t t) {
+    if (t - pvt_last > RESTART_GAP_NS) {
+      pvt_first = t;
+      fixed = false;
+    }
+    pvt_last = t;
+
+    // gnssFixOK
+    if (!(pvt->flags & 1) || pvt->fixType < 2) return;
+    if (!fixed) {
+      fixed = true;
+      LOGW("gps first fix %.1f s after the receiver started", (t - pvt_first) * 1e-9);
+    }
+    if (pvt->hAcc < POSITION_SAVE_HACC_MM && (position_saved == 0 || t - position_saved > POSITION_SAVE_NS)) {
+      params.write_db_value("LastGpsPosition", util::string_format("%d,%d,%d,%u", pvt->lat, pvt->lon, pvt->height, pvt->hAcc));
+      position_saved = t;
+    }
+  }
+};
+
 int ubloxd_main(poll_ubloxraw_msg_func poll_func, send_gps_event_func send_func) {
   LOGW("starting ubloxd");
 
   UbloxMsgParser parser;
+  GnssAssistance assistance;
 
   Context * context = Context::create();
   SubSocket * subscriber = SubSocket::create(context, "ubloxRaw");
@@ -32,6 +86,8 @@ int ubloxd_main(poll_ubloxraw_msg_func poll_func, send_gps_event_func send_func)
   subscriber->setTimeout(100);
 
   PubMaster pm({"ubloxGnss", "gpsLocationExternal"});
+  // aligned copy of each message, reused
+  kj::Array<capnp::word> amsg;
 
   while (!do_exit) {
     Message * msg = subscriber->receive();
@@ -42,10 +98,13 @@ int ubloxd_main(poll_ubloxraw_msg_func poll_func, send_gps_event_func send_func)
       continue;
     }
 
-    auto amsg = kj::heapArray<capnp::word>((msg->getSize() / sizeof(capnp::word)) + 1);
+    size_t msg_words = (msg->getSize() / sizeof(capnp::word)) + 1;
+    if(amsg.size() < msg_words) {
+      amsg = kj::heapArray<capnp::word>(msg_words * 2);
+    }
     memcpy(amsg.begin(), msg->getData(), msg->getSize());
 
-    capnp::FlatArrayMessageReader cmsg(amsg);
+    capnp::FlatArrayMessageReader cmsg(amsg.slice(0, msg_words));
     cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
     auto ubloxRaw = event.getUbloxRaw();
 
@@ -56,44 +115,52 @@ int ubloxd_main(poll_ubloxraw_msg_func poll_func, send_gps_event_func send_func)
       size_t bytes_consumed_this_time = 0U;
       if(parser.add_data(data + bytes_consumed, (uint32_t)(len - bytes_consumed), bytes_consumed_this_time)) {
         // New message available
+        const uint64_t t = nanos_since_boot();
+        assistance.any_frame(t);
         if(parser.msg_class() == CLASS_NAV) {
           if(parser.msg_id() == MSG_NAV_PVT) {
             //LOGD("MSG_NAV_PVT");
-            auto words = parser.gen_solution();
-            if(words.size() > 0) {
-              auto bytes = words.asBytes();
-              pm.send("gpsLocationExternal", bytes.begin(), bytes.size());
+            if(parser.frame().size() == UBLOX_HEADER_SIZE + sizeof(nav_pvt_msg) + UBLOX_CHECKSUM_SIZE) {
+              assistance.solution((const nav_pvt_msg *)&parser.frame()[UBLOX_HEADER_SIZE], t);
+            }
+            auto bytes = parser.gen_solution();
+            if(bytes.size() > 0) {
+              pm.send("gpsLocationExternal", (capnp::byte *)bytes.begin(), bytes.size());
             }
           } else
             LOGW("Unknown nav msg id: 0x%02X", parser.msg_id());
         } else if(parser.msg_class() == CLASS_RXM) {
           if(parser.msg_id() == MSG_RXM_RAW) {
             //LOGD("MSG_RXM_RAW");
-            auto words = parser.gen_raw();
-            if(words.size() > 0) {
-              auto bytes = words.asBytes();
-              pm.send("ubloxGnss", bytes.begin(), bytes.size());
+            auto bytes = parser.gen_raw();
+            if(bytes.size() > 0) {
+              pm.send("ubloxGnss", (capnp::byte *)bytes.begin(), bytes.size());
             }
           } else if(parser.msg_id() == MSG_RXM_SFRBX) {
             //LOGD("MSG_RXM_SFRBX");
-            auto words = parser.gen_nav_data();
-            if(words.size() > 0) {
-              auto bytes = words.asBytes();
-              pm.send("ubloxGnss", bytes.begin(), bytes.size());
+            auto bytes = parser.gen_nav_data();
+            if(bytes.size() > 0) {
+              pm.send("ubloxGnss", (capnp::byte *)bytes.begin(), bytes.size());
             }
           } else
             LOGW("Unknown rxm msg id: 0x%02X", parser.msg_id());
         } else if(parser.msg_class() == CLASS_MON) {
           if(parser.msg_id() == MSG_MON_HW) {
             //LOGD("MSG_MON_HW");
-            auto words = parser.gen_mon_hw();
-            if(words.size() > 0) {
-              auto bytes = words.asBytes();
-              pm.send("ubloxGnss", bytes.begin(), bytes.size());
+            auto bytes = parser.gen_mon_hw();
+            if(bytes.size() > 0) {
+              pm.send("ubloxGnss", (capnp::byte *)bytes.begin(), bytes.size());
             }
           } else {
             LOGW("Unknown mon msg id: 0x%02X", parser.msg_id());
           }
+        } else if(parser.msg_class() == CLASS_MGA) {
+          // the database boardd asked for, the acks of the assistance it sent aren't enabled
+          if(parser.msg_id() == MSG_MGA_DBD) {
+            assistance.database_frame(parser.frame(), t);
+          } else if(parser.msg_id() != MSG_MGA_ACK) {
+            LOGW("Unknown mga msg id: 0x%02X", parser.msg_id());
+          }
         } else
           LOGW("Unknown msg class: 0x%02X", parser.msg_class());
         parser.reset();
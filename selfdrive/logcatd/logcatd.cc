@@ -0,0 +1,62 @@
+#include "logcatd.h"
+
+#include <algorithm>
+
+LogLine *LogBatch::add(std::string_view tag, uint64_t now_ns) {
+  auto it = tags.find(tag);
+  if (it == tags.end()) {
+    if (tags.size() >= LOG_MAX_TAGS) {
+      for (auto t = tags.begin(); t != tags.end();) {
+        t = t->second.dropped == 0 ? tags.erase(t) : std::next(t);
+      }
+    }
+    it = tags.emplace(tag, Tag{.last_ns = now_ns}).first;
+  }
+
+  Tag &t = it->second;
+  t.tokens = std::min(LOG_BURST, t.tokens + (now_ns - t.last_ns) * 1e-9 * LOG_RATE);
+  t.last_ns = now_ns;
+  if (t.tokens < 1.0) {
+    t.dropped++;
+    return nullptr;
+  }
+  t.tokens -= 1.0;
+
+  if (size == lines.size()) lines.emplace_back();
+  LogLine *line = &lines[size++];
+  line->tag.assign(tag);
+  return line;
+}
+
+void LogBatch::publish() {
+  const size_t num_dropped = std::count_if(tags.begin(), tags.end(), [](const auto &t) { return t.second.dropped > 0; });
+  if (size == 0 && num_dropped == 0) return;
+
+  MessageBuilder msg;
+  auto batch = msg.initEvent().initAndroidLogBatch();
+  auto entries = batch.initEntries(size);
+  for (size_t i = 0; i < size; i++) {
+    const LogLine &line = lines[i];
+    auto e = entries[i];
+    e.setId(line.id);
+    e.setTs(line.ts);
+    e.setPriority(line.priority);
+    e.setPid(line.pid);
+    e.setTid(line.tid);
+    e.setTag(line.tag);
+    e.setMessage(line.message);
+  }
+
+  auto dropped = batch.initDropped(num_dropped);
+  size_t i = 0;
+  for (auto &[tag, t] : tags) {
+    if (t.dropped == 0) continue;
+    dropped[i].setTag(tag);
+    dropped[i].setCount(t.dropped);
+    t.dropped = 0;
+    i++;
+  }
+
+  pm.send("androidLogBatch", msg);
+  size = 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "messaging.hpp"
+
+// Lines go out in androidLogBatch messages of up to LOG_BATCH_MAX, as many as were waiting. Each tag
+// gets LOG_RATE lines a second with bursts of up to LOG_BURST, the lines over that are dropped and
+// counted in the next batch, so a tag spamming doesn't take the others or loggerd down with it
+#define LOG_BATCH_MAX 256
+#define LOG_RATE 50.0
+#define LOG_BURST 500.0
+// tags with no lines dropped are forgotten past this many
+#define LOG_MAX_TAGS 1024
+
+struct LogLine {
+  uint8_t id = 0, priority = 0;
+  int32_t pid = 0, tid = 0;
+  uint64_t ts = 0;
+  std::string tag, message;
+};
+
+class LogBatch {
+public:
+  LogBatch() : pm({"androidLogBatch"}) {}
+  // The line to fill in, with its tag set, or null when the tag is over its rate. The lines are
+  // reused between batches, their strings keep what they allocated
+  LogLine *add(std::string_view tag, uint64_t now_ns);
+  bool full() const { return size == LOG_BATCH_MAX; }
+  // Sends the lines added since the last one and the counts of the dropped ones, if there are any
+  void publish();
+
+private:
+  struct Tag {
+    double tokens = LOG_BURST;
+    uint64_t last_ns = 0;
+    uint32_t dropped = 0;
+  };
+
+  PubMaster pm;
+  std::map<std::string, Tag, std::less<>> tags;
+  std::vector<LogLine> lines;
+  size_t size = 0;
+};
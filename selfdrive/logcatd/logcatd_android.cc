@@ -12,6 +12,7 @@
 #include "common/timing.h"
 #include "common/util.h"
 #include "messaging.hpp"
+#include "logcatd.h"
 
 
 int main() {
@@ -31,36 +32,38 @@ int main() {
   struct logger *kernel_logger = android_logger_open(logger_list, (log_id_t)5); // LOG_ID_KERNEL
   assert(kernel_logger);
 
-  PubMaster pm({"androidLog"});
+  LogBatch batch;
 
   while (!do_exit) {
-    log_msg log_msg;
-    int err = android_logger_list_read(logger_list, &log_msg);
+    // every line that's waiting, in batches
+    int err = 0;
+    while (!batch.full()) {
+      log_msg log_msg;
+      err = android_logger_list_read(logger_list, &log_msg);
+      if (err <= 0) break;
+
+      AndroidLogEntry entry;
+      if (android_log_processLogBuffer(&log_msg.entry_v1, &entry) < 0) {
+        continue;
+      }
+
+      LogLine *line = batch.add(entry.tag, nanos_since_boot());
+      if (line == nullptr) continue;
+
+      line->id = log_msg.id();
+      line->ts = entry.tv_sec * 1000000000ULL + entry.tv_nsec;
+      line->priority = entry.priority;
+      line->pid = entry.pid;
+      line->tid = entry.tid;
+      line->message.assign(entry.message, entry.messageLen);
+    }
+    batch.publish();
 
     if (err == -EAGAIN) {
       util::sleep_for(500);
-      continue;
     } else if (err <= 0) {
       break;
     }
-
-    AndroidLogEntry entry;
-    err = android_log_processLogBuffer(&log_msg.entry_v1, &entry);
-    if (err < 0) {
-      continue;
-    }
-
-    MessageBuilder msg;
-    auto androidEntry = msg.initEvent().initAndroidLog();
-    androidEntry.setId(log_msg.id());
-    androidEntry.setTs(entry.tv_sec * 1000000000ULL + entry.tv_nsec);
-    androidEntry.setPriority(entry.priority);
-    androidEntry.setPid(entry.pid);
-    androidEntry.setTid(entry.tid);
-    androidEntry.setTag(entry.tag);
-    androidEntry.setMessage(entry.message);
-
-    pm.send("androidLog", msg);
   }
 
   android_logger_list_close(logger_list);
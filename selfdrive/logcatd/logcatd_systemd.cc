@@ -1,67 +1,72 @@
-#include <iostream>
 #include <cassert>
-#include <csignal>
-#include <string>
-#include <map>
+#include <charconv>
+#include <string_view>
 
-#include "json11.hpp"
 #include <systemd/sd-journal.h>
 
 #include "common/timing.h"
 #include "common/util.h"
 #include "messaging.hpp"
+#include "logcatd.h"
 
 ExitHandler do_exit;
-int main(int argc, char *argv[]) {
 
-  PubMaster pm({"androidLog"});
+namespace {
+
+// The value of a field of the current entry, pointing into the journal's mapping
+std::string_view field(sd_journal *journal, const char *name, size_t name_len) {
+  const void *data;
+  size_t length;
+  if (sd_journal_get_data(journal, name, &data, &length) < 0 || length <= name_len) return {};
+  return std::string_view((const char *)data + name_len + 1, length - name_len - 1);
+}
+
+template <class T>
+T field_int(sd_journal *journal, const char *name, size_t name_len) {
+  std::string_view value = field(journal, name, name_len);
+  T ret = 0;
+  std::from_chars(value.data(), value.data() + value.size(), ret);
+  return ret;
+}
+
+#define FIELD(journal, name) field(journal, name, sizeof(name) - 1)
+#define FIELD_INT(T, journal, name) field_int<T>(journal, name, sizeof(name) - 1)
+
+}
+
+int main(int argc, char *argv[]) {
+  LogBatch batch;
 
   sd_journal *journal;
   assert(sd_journal_open(&journal, 0) >= 0);
   assert(sd_journal_get_fd(journal) >= 0); // needed so sd_journal_wait() works properly if files rotate
   assert(sd_journal_seek_tail(journal) >= 0);
+  // only the fields logcatd reads are mapped, long ones get cut
+  sd_journal_set_data_threshold(journal, 4096);
 
-  int r;
+  int r = 0;
   while (!do_exit) {
-    r = sd_journal_next(journal);
-    assert(r >= 0);
+    // every entry that's waiting, in batches
+    while (!batch.full() && (r = sd_journal_next(journal)) > 0) {
+      LogLine *line = batch.add(FIELD(journal, "SYSLOG_IDENTIFIER"), nanos_since_boot());
+      if (line == nullptr) continue;
 
-    // Wait for new message if we didn't receive anything
-    if (r == 0){
-      r = sd_journal_wait(journal, 1000 * 1000);
-      assert (r >= 0);
-      continue; // Try again
+      uint64_t timestamp = 0;
+      r = sd_journal_get_realtime_usec(journal, &timestamp);
+      assert(r >= 0);
+      line->ts = timestamp;
+      line->pid = FIELD_INT(int32_t, journal, "_PID");
+      line->priority = FIELD_INT(uint8_t, journal, "PRIORITY");
+      line->message.assign(FIELD(journal, "MESSAGE"));
     }
-
-    uint64_t timestamp = 0;
-    r = sd_journal_get_realtime_usec(journal, &timestamp);
     assert(r >= 0);
+    batch.publish();
 
-    const void *data;
-    size_t length;
-    std::map<std::string, std::string> kv;
-
-    SD_JOURNAL_FOREACH_DATA(journal, data, length){
-      std::string str((char*)data, length);
-
-      // Split "KEY=VALUE"" on "=" and put in map
-      std::size_t found = str.find("=");
-      if (found != std::string::npos){
-        kv[str.substr(0, found)] = str.substr(found + 1, std::string::npos);
-      }
+    // Wait for new entries once they're all read
+    if (r == 0) {
+      r = sd_journal_wait(journal, 1000 * 1000);
+      assert(r >= 0);
     }
-
-    MessageBuilder msg;
-
-    // Build message
-    auto androidEntry = msg.initEvent().initAndroidLog();
-    androidEntry.setTs(timestamp);
-    androidEntry.setMessage(json11::Json(kv).dump());
-    if (kv.count("_PID")) androidEntry.setPid(std::atoi(kv["_PID"].c_str()));
-    if (kv.count("PRIORITY")) androidEntry.setPriority(std::atoi(kv["PRIORITY"].c_str()));
-    if (kv.count("SYSLOG_IDENTIFIER")) androidEntry.setTag(kv["SYSLOG_IDENTIFIER"]);
-
-    pm.send("androidLog", msg);
   }
 
   sd_journal_close(journal);
@@ -0,0 +1,137 @@
+import fcntl
+import json
+import os
+
+# loggerd appends a line for each segment file it finishes, see segment_catalog.h. The uploader and
+# the deleter add what they did, and follow it from where they last read instead of walking the segments
+CATALOG_NAME = ".catalog"
+# the deleter rewrites it once most of its lines are about segments that are gone
+COMPACT_MIN_LINES = 1000
+
+
+class SegmentCatalog():
+  def __init__(self, root):
+    self.path = os.path.join(root, CATALOG_NAME)
+    self.reset()
+
+  def reset(self):
+    self.segments = {}  # segment -> name -> {"size", "sha256", "uploaded"}
+    self.offset = 0
+    self.ino = None
+    self.lines = 0
+
+  def update(self):
+    try:
+      st = os.stat(self.path)
+    except OSError:
+      self.reset()
+      return
+    if st.st_ino != self.ino or st.st_size < self.offset:
+      # rewritten by the deleter
+      self.reset()
+      self.ino = st.st_ino
+    if st.st_size == self.offset:
+      return
+
+    try:
+      with open(self.path, 'rb') as f:
+        f.seek(self.offset)
+        dat = f.read()
+    except OSError:
+      return
+    # a line that's still being appended is read again next time
+    end = dat.rfind(b'\n') + 1
+    self.offset += end
+    for line in dat[:end].splitlines():
+      try:
+        self.apply(json.loads(line))
+      except (ValueError, KeyError, AttributeError):
+        pass
+      self.lines += 1
+
+  def apply(self, rec):
+    if 'file' in rec:
+      segment, name = rec['file'].split('/', 1)
+      self.segments.setdefault(segment, {})[name] = {'size': rec['size'], 'sha256': rec['sha256'], 'uploaded': False}
+    elif 'uploaded' in rec:
+      segment, name = rec['uploaded'].split('/', 1)
+      if name in self.segments.get(segment, {}):
+        self.segments[segment][name]['uploaded'] = True
+    elif 'removed' in rec:
+      segment, name = rec['removed'].split('/', 1)
+      self.segments.get(segment, {}).pop(name, None)
+    elif 'deleted' in rec:
+      self.segments.pop(rec['deleted'], None)
+
+  def files(self, segment):
+    """The finished files of the segment by name, None if loggerd didn't write it"""
+    return self.segments.get(segment)
+
+  def file_info(self, key):
+    segment, name = key.split('/', 1)
+    return self.segments.get(segment, {}).get(name)
+
+  def mark_uploaded(self, key):
+    self.append({'uploaded': key})
+
+  def mark_unuploaded(self, key):
+    self.update()
+    info = self.file_info(key)
+    if info is not None:
+      # the file again, as loggerd had it
+      self.append({'file': key, 'size': info['size'], 'sha256': info['sha256']})
+
+  def mark_removed(self, key):
+    self.append({'removed': key})
+
+  def mark_deleted(self, segment):
+    self.append({'deleted': segment})
+
+  def append(self, rec):
+    line = (json.dumps(rec) + "\n").encode('utf8')
+    # a line for a catalog that was rewritten since it was opened would be lost
+    for _ in range(3):
+      try:
+        fd = os.open(self.path, os.O_WRONLY | os.O_APPEND | os.O_CREAT, 0o666)
+      except OSError:
+        return
+      try:
+        fcntl.flock(fd, fcntl.LOCK_SH)
+        if os.fstat(fd).st_ino == os.stat(self.path).st_ino:
+          os.write(fd, line)
+          return
+      except OSError:
+        return
+      finally:
+        os.close(fd)
+
+  def maybe_compact(self):
+    """Rewrites the catalog with only the segments that are still there, once that's most of it"""
+    self.update()
+    live = sum(2 * len(names) for names in self.segments.values())
+    if self.lines < COMPACT_MIN_LINES or self.lines < 2 * live:
+      return False
+
+    try:
+      fd = os.open(self.path, os.O_RDONLY)
+    except OSError:
+      return False
+    try:
+      fcntl.flock(fd, fcntl.LOCK_EX)
+      # nothing's appended while it's held
+      self.update()
+      tmp_path = self.path + ".tmp"
+      with open(tmp_path, 'w') as f:
+        for segment, names in self.segments.items():
+          for name, info in names.items():
+            key = segment + "/" + name
+            f.write(json.dumps({'file': key, 'size': info['size'], 'sha256': info['sha256']}) + "\n")
+            if info['uploaded']:
+              f.write(json.dumps({'uploaded': key}) + "\n")
+      os.replace(tmp_path, self.path)
+    except OSError:
+      return False
+    finally:
+      os.close(fd)
+    self.reset()
+    return True
@@ -0,0 +1,30 @@
+#include "clip_ring.h"
+
+void ClipRing::push_config(const uint8_t *data, size_t len) {
+  codec_config.assign(data, data + len);
+}
+
+void ClipRing::push(const uint8_t *data, size_t len, bool keyframe, int64_t timestamp) {
+  // what's before the first keyframe doesn't decode
+  if (ring.empty() && !keyframe) return;
+
+  ring.push_back({std::vector<uint8_t>(data, data + len), keyframe, timestamp});
+  ring_bytes += len;
+
+  // past the limits, as long as what's left from the next keyframe on still covers max_us
+  size_t next;
+  while ((next = next_keyframe()) > 0 &&
+         (ring_bytes > max_bytes || timestamp - ring[next].timestamp >= max_us)) {
+    for (size_t i = 0; i < next; i++) {
+      ring_bytes -= ring.front().data.size();
+      ring.pop_front();
+    }
+  }
+}
+
+size_t ClipRing::next_keyframe() const {
+  for (size_t i = 1; i < ring.size(); i++) {
+    if (ring[i].keyframe) return i;
+  }
+  return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// The last stretch of an encoder's output held in memory, so a clip can start before what set it off.
+// It always starts at a keyframe: whole GOPs are dropped off the front once the ring is longer than
+// max_us or bigger than max_bytes, but never the last one. Not thread safe
+class ClipRing {
+public:
+  struct Packet {
+    std::vector<uint8_t> data;
+    bool keyframe;
+    int64_t timestamp;  // timestamp_eof in us
+  };
+
+  ClipRing(size_t max_bytes, int64_t max_us) : max_bytes(max_bytes), max_us(max_us) {}
+
+  // the newest codec config is kept next to the frames, they don't decode without it
+  void push_config(const uint8_t *data, size_t len);
+  void push(const uint8_t *data, size_t len, bool keyframe, int64_t timestamp);
+
+  const std::vector<uint8_t> &config() const { return codec_config; }
+  const std::deque<Packet> &packets() const { return ring; }
+  size_t bytes() const { return ring_bytes; }
+  int64_t newest() const { return ring.empty() ? 0 : ring.back().timestamp; }
+
+private:
+  // the index of the first keyframe after the front one, 0 if there's none
+  size_t next_keyframe() const;
+
+  const size_t max_bytes;
+  const int64_t max_us;
+  std::vector<uint8_t> codec_config;
+  std::deque<Packet> ring;
+  size_t ring_bytes = 0;
+};
@@ -3,6 +3,7 @@ import os
 import shutil
 import threading
 from selfdrive.swaglog import cloudlog
+from selfdrive.loggerd.catalog import SegmentCatalog
 from selfdrive.loggerd.config import ROOT, get_available_bytes, get_available_percent
 from selfdrive.loggerd.uploader import listdir_by_creation
 
@@ -11,6 +12,7 @@ MIN_PERCENT = 10
 
 
 def deleter_thread(exit_event):
+  catalog = SegmentCatalog(ROOT)
   while not exit_event.is_set():
     out_of_bytes = get_available_bytes(default=MIN_BYTES + 1) < MIN_BYTES
     out_of_percent = get_available_percent(default=MIN_PERCENT + 1) < MIN_PERCENT
@@ -27,6 +29,8 @@ def deleter_thread(exit_event):
         try:
           cloudlog.info("deleting %s" % delete_path)
           shutil.rmtree(delete_path)
+          catalog.mark_deleted(delete_dir)
+          catalog.maybe_compact()
           break
         except OSError:
           cloudlog.exception("issue deleting %s" % delete_path)
@@ -1,15 +1,25 @@
 #pragma once
 
+#include <cassert>
 #include <cstdint>
 
 #include "visionipc.h"
 
+class VisionBuf;
+
 class VideoEncoder {
 public:
   virtual ~VideoEncoder() {}
   virtual int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                    int in_width, int in_height,
                    int *frame_segment, VisionIpcBufExtra *extra) = 0;
+  // Encodes one of the buffers the encoder was made with in place, for encoders that can. The
+  // buffer is passed to the encoder's release callback once it's done with it
+  virtual int encode_buf(VisionBuf *buf, int *frame_segment, VisionIpcBufExtra *extra) { assert(false); return -1; }
   virtual void encoder_open(const char* path, int segment) = 0;
   virtual void encoder_close() = 0;
+  // Keeps the output in memory and only writes the clips save_clip asks for, for encoders that can.
+  // False if it can't, then it writes its segments as usual
+  virtual bool enable_clips(int ring_seconds) { return false; }
+  virtual void save_clip(const char *path, int post_seconds) {}
 };
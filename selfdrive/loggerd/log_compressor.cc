@@ -0,0 +1,289 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include <bzlib.h>
+#include <zstd.h>
+#include <lz4frame.h>
+
+#include "common/swaglog.h"
+
+#include "log_compressor.h"
+
+LogCompression log_compression_from_env() {
+  const char *env = getenv("LOG_COMPRESSION");
+  if (env == NULL || strcmp(env, "zstd") == 0) return LogCompression::ZSTD;
+  if (strcmp(env, "lz4") == 0) return LogCompression::LZ4;
+  if (strcmp(env, "bz2") == 0) return LogCompression::BZ2;
+  LOGE("unknown LOG_COMPRESSION %s, using zstd", env);
+  return LogCompression::ZSTD;
+}
+
+bool log_packed_from_env() {
+  const char *env = getenv("LOG_PACKED");
+  return env != NULL && strcmp(env, "1") == 0;
+}
+
+const char *log_compression_ext(LogCompression type) {
+  switch (type) {
+    case LogCompression::BZ2: return ".bz2";
+    case LogCompression::LZ4: return ".lz4";
+    default: return ".zst";
+  }
+}
+
+class Bz2Compressor : public LogCompressor {
+public:
+  Bz2Compressor(SegmentFile *file) : file(file), out(64 * 1024) {}
+  ~Bz2Compressor() {
+    if (started) finish();
+  }
+
+  bool write(const uint8_t *data, size_t size) {
+    if (!started && !begin()) return false;
+    strm.next_in = (char *)data;
+    strm.avail_in = size;
+    while (strm.avail_in > 0) {
+      if (compress(BZ_RUN) != BZ_RUN_OK) return false;
+    }
+    return true;
+  }
+  bool finish() {
+    if (!started && !begin()) return false;
+    int ret;
+    do {
+      ret = compress(BZ_FINISH);
+    } while (ret == BZ_FINISH_OK);
+    BZ2_bzCompressEnd(&strm);
+    started = false;
+    return ret == BZ_STREAM_END;
+  }
+
+private:
+  bool begin() {
+    memset(&strm, 0, sizeof(strm));
+    if (BZ2_bzCompressInit(&strm, 9, 0, 30) != BZ_OK) return false;
+    started = true;
+    return true;
+  }
+  // returns the bzlib result, or BZ_IO_ERROR if the output couldn't be written
+  int compress(int action) {
+    strm.next_out = (char *)out.data();
+    strm.avail_out = out.size();
+    int ret = BZ2_bzCompress(&strm, action);
+    size_t len = out.size() - strm.avail_out;
+    if (!file->write(out.data(), len)) return BZ_IO_ERROR;
+    return ret;
+  }
+
+  SegmentFile *file;
+  bz_stream strm;
+  std::vector<uint8_t> out;
+  bool started = false;
+};
+
+class ZstdCompressor : public LogCompressor {
+public:
+  ZstdCompressor(SegmentFile *file, int level) : file(file), out(ZSTD_CStreamOutSize()) {
+    cctx = ZSTD_createCCtx();
+    if (cctx == NULL) return;
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+  }
+  ~ZstdCompressor() {
+    ZSTD_freeCCtx(cctx);
+  }
+  bool ok() const { return cctx != NULL; }
+
+  bool write(const uint8_t *data, size_t size) {
+    ZSTD_inBuffer in = {data, size, 0};
+    while (in.pos < in.size) {
+      if (!compress(&in, ZSTD_e_continue)) return false;
+    }
+    return true;
+  }
+  bool finish() {
+    ZSTD_inBuffer in = {NULL, 0, 0};
+    bool done = false;
+    while (!done) {
+      if (!compress(&in, ZSTD_e_end, &done)) return false;
+    }
+    return true;
+  }
+
+private:
+  bool compress(ZSTD_inBuffer *in, ZSTD_EndDirective mode, bool *done = NULL) {
+    ZSTD_outBuffer o = {out.data(), out.size(), 0};
+    size_t remaining = ZSTD_compressStream2(cctx, &o, in, mode);
+    if (ZSTD_isError(remaining)) {
+      LOGE("zstd compression failed: %s", ZSTD_getErrorName(remaining));
+      return false;
+    }
+    if (done) *done = remaining == 0;
+    return file->write(out.data(), o.pos);
+  }
+
+  SegmentFile *file;
+  ZSTD_CCtx *cctx;
+  std::vector<uint8_t> out;
+};
+
+class Lz4Compressor : public LogCompressor {
+public:
+  Lz4Compressor(SegmentFile *file) : file(file) {
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.blockSizeID = LZ4F_max256KB;
+    prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION))) {
+      cctx = NULL;
+      return;
+    }
+    out.resize(LZ4F_compressBound(CHUNK_SIZE, &prefs));
+  }
+  ~Lz4Compressor() {
+    if (cctx) LZ4F_freeCompressionContext(cctx);
+  }
+  bool ok() const { return cctx != NULL; }
+
+  bool write(const uint8_t *data, size_t size) {
+    if (!started && !begin()) return false;
+    // the output buffer is sized for one chunk
+    for (size_t pos = 0; pos < size; pos += CHUNK_SIZE) {
+      size_t len = LZ4F_compressUpdate(cctx, out.data(), out.size(), data + pos, std::min(CHUNK_SIZE, size - pos), NULL);
+      if (!flush(len)) return false;
+    }
+    return true;
+  }
+  bool finish() {
+    if (!started && !begin()) return false;
+    started = false;
+    return flush(LZ4F_compressEnd(cctx, out.data(), out.size(), NULL));
+  }
+
+private:
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+  bool begin() {
+    started = true;
+    return flush(LZ4F_compressBegin(cctx, out.data(), out.size(), &prefs));
+  }
+  bool flush(size_t len) {
+    if (LZ4F_isError(len)) {
+      LOGE("lz4 compression failed: %s", LZ4F_getErrorName(len));
+      return false;
+    }
+    return file->write(out.data(), len);
+  }
+
+  SegmentFile *file;
+  LZ4F_cctx *cctx;
+  LZ4F_preferences_t prefs;
+  std::vector<uint8_t> out;
+  bool started = false;
+};
+
+template <class T>
+static LogCompressor *create_checked(T *c) {
+  if (!c->ok()) {
+    delete c;
+    return NULL;
+  }
+  return c;
+}
+
+LogCompressor *LogCompressor::create(LogCompression type, SegmentFile *file) {
+  switch (type) {
+    case LogCompression::BZ2:
+      return new Bz2Compressor(file);
+    case LogCompression::LZ4:
+      return create_checked(new Lz4Compressor(file));
+    default: {
+      const char *level = getenv("LOG_ZSTD_LEVEL");
+      return create_checked(new ZstdCompressor(file, level ? atoi(level) : 10));
+    }
+  }
+}
+
+LogFile *LogFile::open(const char *path, LogCompression type, uint64_t preallocate, bool packed) {
+  SegmentFile *file = SegmentFile::open(path, preallocate, WritePriority::BULK);
+  if (file == NULL) return NULL;
+
+  LogCompressor *compressor = LogCompressor::create(type, file);
+  if (compressor == NULL) {
+    delete file;
+    return NULL;
+  }
+  return new LogFile(file, compressor, type != LogCompression::BZ2, packed);
+}
+
+LogFile::LogFile(SegmentFile *file, LogCompressor *compressor, bool indexed, bool packed)
+  : file(file), compressor(compressor), indexed(indexed), packed(packed) {}
+
+LogFile::~LogFile() {
+  if (file) close();
+}
+
+void LogFile::write(const uint8_t *data, size_t size, uint64_t mono_time, int service) {
+  if (!in_block) {
+    memset(&block, 0, sizeof(block));
+    block.offset = file->tell();
+    in_block = true;
+    if (packed) {
+      compressor->write(LOG_PACKED_MAGIC, sizeof(LOG_PACKED_MAGIC));
+      block.raw_size += sizeof(LOG_PACKED_MAGIC);
+    }
+  }
+
+  if (packed) {
+    pack_buf.clear();
+    log_pack(data, size, pack_buf);
+    data = pack_buf.data();
+    size = pack_buf.size();
+  }
+  compressor->write(data, size);
+  block.raw_size += size;
+  if (mono_time != 0) {
+    if (block.mono_time_start == 0 || mono_time < block.mono_time_start) block.mono_time_start = mono_time;
+    block.mono_time_end = std::max(block.mono_time_end, mono_time);
+  }
+  if (service >= 0 && service < LOG_INDEX_SERVICE_WORDS * 64) {
+    block.services[service / 64] |= 1ULL << (service % 64);
+  }
+
+  if (indexed && block.raw_size >= LOG_BLOCK_SIZE) {
+    end_block();
+  }
+}
+
+bool LogFile::end_block() {
+  in_block = false;
+  bool ok = compressor->finish();
+  block.size = file->tell() - block.offset;
+  blocks.push_back(block);
+  return ok;
+}
+
+bool LogFile::write_index() {
+  const uint32_t header[2] = {LOG_INDEX_FRAME_MAGIC, (uint32_t)(blocks.size() * sizeof(LogIndexEntry) + sizeof(LogIndexFooter))};
+  const LogIndexFooter footer = {LOG_INDEX_MAGIC, LOG_INDEX_VERSION, blocks.size()};
+  return file->write(header, sizeof(header)) &&
+         file->write(blocks.data(), blocks.size() * sizeof(LogIndexEntry)) &&
+         file->write(&footer, sizeof(footer));
+}
+
+bool LogFile::close() {
+  bool ok = true;
+  if (in_block || !indexed) {
+    ok = end_block();
+  }
+  if (indexed) {
+    ok = write_index() && ok;
+  }
+  delete compressor;
+  compressor = NULL;
+  ok = file->close() && ok;
+  delete file;
+  file = NULL;
+  return ok;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "log_index.h"
+#include "log_packing.h"
+#include "segment_file.h"
+
+enum class LogCompression {
+  BZ2,
+  ZSTD,
+  LZ4,
+};
+
+// Compression from LOG_COMPRESSION, "zstd" (default), "lz4" or "bz2"
+LogCompression log_compression_from_env();
+// Events packed before they're compressed, from LOG_PACKED=1, see log_packing.h
+bool log_packed_from_env();
+// File extension including the dot, e.g. ".zst"
+const char *log_compression_ext(LogCompression type);
+
+// Streams log data into a compressed file. Not thread safe
+class LogCompressor {
+public:
+  virtual ~LogCompressor() {}
+  virtual bool write(const uint8_t *data, size_t size) = 0;
+  // Ends the current frame, the next write starts a new one that can be decompressed on its own.
+  // The file is left open for the caller to close
+  virtual bool finish() = 0;
+
+  // zstd compresses at LOG_ZSTD_LEVEL, 10 by default
+  static LogCompressor *create(LogCompression type, SegmentFile *file);
+};
+
+// A compressed log, written in indexed blocks as described in log_index.h.
+// bz2 logs are a single stream without an index, as they always were
+class LogFile {
+public:
+  // NULL if the file can't be created. preallocate is passed on to SegmentFile
+  static LogFile *open(const char *path, LogCompression type, uint64_t preallocate, bool packed = false);
+  ~LogFile();
+
+  // data is one whole event, service is its Event::Which or -1 if unknown, as is a mono_time of 0
+  void write(const uint8_t *data, size_t size, uint64_t mono_time, int service);
+  // Finishes the last block and writes the index
+  bool close();
+
+private:
+  LogFile(SegmentFile *file, LogCompressor *compressor, bool indexed, bool packed);
+  bool end_block();
+  bool write_index();
+
+  SegmentFile *file;
+  LogCompressor *compressor;
+  const bool indexed;
+  const bool packed;
+  std::vector<uint8_t> pack_buf;
+
+  bool in_block = false;
+  LogIndexEntry block;
+  std::vector<LogIndexEntry> blocks;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+// zstd and lz4 logs are written as independently compressed blocks of about LOG_BLOCK_SIZE
+// uncompressed bytes that never split an event. After the last block comes an index of the
+// blocks inside a skippable frame, which the zstd and lz4 decoders step over:
+//
+//   [block]...[block][u32 LOG_INDEX_FRAME_MAGIC][u32 frame size][LogIndexEntry]...[LogIndexFooter]
+//
+// Readers find the index from the footer at the end of the file. All fields are little endian.
+// tools/lib/logreader.py reads this, keep them in sync
+
+const uint64_t LOG_BLOCK_SIZE = 1024 * 1024;
+
+const uint32_t LOG_INDEX_FRAME_MAGIC = 0x184D2A5E;
+const uint32_t LOG_INDEX_MAGIC = 0x58444e49;  // "INDX"
+const uint32_t LOG_INDEX_VERSION = 1;
+
+// enough for every Event union member, bit n is set if the block has an event with which() == n
+const int LOG_INDEX_SERVICE_WORDS = 4;
+
+struct LogIndexEntry {
+  uint64_t offset;  // of the compressed block in the file
+  uint64_t size;
+  uint64_t raw_size;
+  uint64_t mono_time_start;
+  uint64_t mono_time_end;
+  uint64_t services[LOG_INDEX_SERVICE_WORDS];
+};
+
+struct LogIndexFooter {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_blocks;
+};
+
+static_assert(sizeof(LogIndexEntry) == 72, "LogIndexEntry layout changed");
+static_assert(sizeof(LogIndexFooter) == 16, "LogIndexFooter layout changed");
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// With LOG_PACKED=1 each event is written in capnp's packed encoding before it's compressed, which
+// takes out the zero bytes the compressors would otherwise spend their window on. Every block, and
+// a bz2 log once at its start, then begins with LOG_PACKED_MAGIC. No message starts with it, flat or
+// packed, as its first word would be a segment table of billions of segments.
+// tools/lib/logreader.py and tools/clib/LogSegment.cpp read this, keep them in sync
+
+const uint8_t LOG_PACKED_MAGIC[8] = {0xff, 0xff, 0xff, 0xff, 'P', 'A', 'C', 'K'};
+
+inline bool log_packed_magic(const uint8_t *data, size_t size) {
+  return size >= sizeof(LOG_PACKED_MAGIC) && memcmp(data, LOG_PACKED_MAGIC, sizeof(LOG_PACKED_MAGIC)) == 0;
+}
+
+// Appends the packed encoding of one message of size / 8 words
+inline void log_pack(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+  const size_t num_words = size / 8;
+  for (size_t i = 0; i < num_words; i++) {
+    const uint8_t *w = data + i * 8;
+    const size_t tag_pos = out.size();
+    uint8_t tag = 0;
+    out.push_back(0);
+    for (int b = 0; b < 8; b++) {
+      if (w[b]) {
+        tag |= 1 << b;
+        out.push_back(w[b]);
+      }
+    }
+    out[tag_pos] = tag;
+
+    if (tag == 0) {
+      // a run of zero words
+      size_t run = 0;
+      while (run < 255 && i + 1 + run < num_words && memcmp(data + (i + 1 + run) * 8, "\0\0\0\0\0\0\0\0", 8) == 0) run++;
+      out.push_back(run);
+      i += run;
+    } else if (tag == 0xff) {
+      // words with hardly any zeros, as text and pixels are, follow as they are
+      size_t run = 0;
+      while (run < 255 && i + 1 + run < num_words) {
+        const uint8_t *n = data + (i + 1 + run) * 8;
+        int zeros = 0;
+        for (int b = 0; b < 8; b++) zeros += n[b] == 0;
+        if (zeros >= 2) break;
+        run++;
+      }
+      out.push_back(run);
+      out.insert(out.end(), data + (i + 1) * 8, data + (i + 1 + run) * 8);
+      i += run;
+    }
+  }
+}
+
+// Unpacks what log_pack wrote: the messages one after another, the magic at the block starts
+// stepped over. Appends the flat words of every whole message, returns false if the data ends
+// inside one
+inline bool log_unpack(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+  const uint8_t *p = data, *end = data + size;
+
+  // the next word of the message, false past the end
+  size_t zero_run = 0, raw_run = 0;
+  auto next_word = [&](uint8_t w[8]) {
+    if (zero_run > 0) {
+      zero_run--;
+      memset(w, 0, 8);
+      return true;
+    }
+    if (raw_run > 0) {
+      if (end - p < 8) return false;
+      raw_run--;
+      memcpy(w, p, 8);
+      p += 8;
+      return true;
+    }
+    if (p >= end) return false;
+    const uint8_t tag = *p++;
+    for (int b = 0; b < 8; b++) {
+      if (tag & (1 << b)) {
+        if (p >= end) return false;
+        w[b] = *p++;
+      } else {
+        w[b] = 0;
+      }
+    }
+    if (tag == 0 || tag == 0xff) {
+      if (p >= end) return false;
+      (tag == 0 ? zero_run : raw_run) = *p++;
+    }
+    return true;
+  };
+
+  auto unpack_message = [&]() {
+    zero_run = raw_run = 0;
+    uint8_t w[8];
+    if (!next_word(w)) return false;
+    uint32_t num_segments, first_size;
+    memcpy(&num_segments, w, 4);
+    memcpy(&first_size, w + 4, 4);
+    num_segments += 1;
+    if (num_segments > 512) return false;
+    out.insert(out.end(), w, w + 8);
+
+    // the rest of the segment table, padded to a word
+    uint64_t words_left = first_size;
+    for (uint32_t s = 1; s < num_segments; s += 2) {
+      if (!next_word(w)) return false;
+      uint32_t sizes[2];
+      memcpy(sizes, w, 8);
+      words_left += sizes[0];
+      if (s + 1 < num_segments) words_left += sizes[1];
+      out.insert(out.end(), w, w + 8);
+    }
+    for (; words_left > 0; words_left--) {
+      if (!next_word(w)) return false;
+      out.insert(out.end(), w, w + 8);
+    }
+    // runs never go past a message
+    return zero_run == 0 && raw_run == 0;
+  };
+
+  while (p < end) {
+    if (log_packed_magic(p, end - p)) {
+      p += sizeof(LOG_PACKED_MAGIC);
+      continue;
+    }
+    const size_t msg_start = out.size();
+    if (!unpack_message()) {
+      out.resize(msg_start);
+      return false;
+    }
+  }
+  return true;
+}
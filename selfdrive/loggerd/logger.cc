@@ -10,10 +10,13 @@
 #include <sys/stat.h>
 
 #include <pthread.h>
-#include <bzlib.h>
 #include <iostream>
 #include <fstream>
 #include <streambuf>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #ifdef QCOM
 #include <cutils/properties.h>
 #endif
@@ -51,6 +54,106 @@ static int mkpath(char* file_path) {
   return 0;
 }
 
+// ***** log writer *****
+
+// warn when compression falls this far behind
+const size_t LOG_WRITER_BACKLOG_WARN = 32 * 1024 * 1024;
+
+// space reserved for a segment's logs, a bit more than SEGMENT_LENGTH of driving usually compresses to
+const uint64_t RLOG_PREALLOCATE = 24 * 1024 * 1024;
+const uint64_t QLOG_PREALLOCATE = 2 * 1024 * 1024;
+
+typedef struct LogWrite {
+  LoggerHandle *h;
+  kj::Array<uint8_t> data;
+  bool in_qlog;
+  bool close;
+} LogWrite;
+
+struct LogWriter {
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<LogWrite> queue;
+  size_t queued_bytes = 0;
+  bool backlogged = false;
+  bool exit = false;
+  std::thread thread;
+};
+
+static void lh_finish(LoggerHandle* h) {
+  if (!h->log_file->close()) {
+    LOGE("failed to finish %s", h->log_path);
+  }
+  delete h->log_file;
+  h->log_file = NULL;
+
+  if (h->qlog_file) {
+    if (!h->qlog_file->close()) {
+      LOGE("failed to finish %s", h->qlog_path);
+    }
+    delete h->qlog_file;
+    h->qlog_file = NULL;
+  }
+  unlink(h->lock_path);
+  h->open = false;
+}
+
+static void log_writer_thread(LogWriter *w) {
+  set_thread_name("logwriter");
+
+  std::deque<LogWrite> writes;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lk(w->lock);
+      w->cv.wait(lk, [w]{ return w->exit || !w->queue.empty(); });
+      // only exit once everything queued is written
+      if (w->queue.empty()) break;
+      writes.swap(w->queue);
+      w->queued_bytes = 0;
+      w->backlogged = false;
+    }
+
+    for (auto &write : writes) {
+      LoggerHandle *h = write.h;
+      if (write.close) {
+        lh_finish(h);
+        continue;
+      }
+
+      // for the block index
+      uint64_t mono_time = 0;
+      int service = -1;
+      try {
+        capnp::FlatArrayMessageReader msg(kj::arrayPtr((const capnp::word*)write.data.begin(), write.data.size() / sizeof(capnp::word)));
+        cereal::Event::Reader event = msg.getRoot<cereal::Event>();
+        mono_time = event.getLogMonoTime();
+        service = (int)event.which();
+      } catch (const kj::Exception &) {
+        // still logged, just not indexed
+      }
+
+      h->log_file->write(write.data.begin(), write.data.size(), mono_time, service);
+      if (write.in_qlog) {
+        h->qlog_file->write(write.data.begin(), write.data.size(), mono_time, service);
+      }
+    }
+    writes.clear();
+  }
+}
+
+static void log_writer_push(LogWriter *w, LogWrite &&write) {
+  {
+    std::lock_guard<std::mutex> lk(w->lock);
+    w->queued_bytes += write.data.size();
+    w->queue.push_back(std::move(write));
+    if (w->queued_bytes > LOG_WRITER_BACKLOG_WARN && !w->backlogged) {
+      w->backlogged = true;
+      LOGW("log writer is %zu bytes behind", w->queued_bytes);
+    }
+  }
+  w->cv.notify_one();
+}
+
 // ***** log metadata *****
 
 void log_init_data(LoggerState *s) {
@@ -153,6 +256,11 @@ void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
   strftime(s->route_name, sizeof(s->route_name),
            "%Y-%m-%d--%H-%M-%S", &timeinfo);
   snprintf(s->log_name, sizeof(s->log_name), "%s", log_name);
+
+  s->compression = log_compression_from_env();
+  s->packed = log_packed_from_env();
+  s->writer = new LogWriter();
+  s->writer->thread = std::thread(log_writer_thread, s->writer);
 }
 
 static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
@@ -160,18 +268,20 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
 
   LoggerHandle *h = NULL;
   for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
-    if (s->handles[i].refcnt == 0) {
+    if (s->handles[i].refcnt == 0 && !s->handles[i].open) {
       h = &s->handles[i];
       break;
     }
   }
   assert(h);
 
+  h->part = s->part;
   snprintf(h->segment_path, sizeof(h->segment_path),
           "%s/%s--%d", root_path, s->route_name, s->part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
+  const char *ext = log_compression_ext(s->compression);
+  snprintf(h->log_path, sizeof(h->log_path), "%s/%s%s", h->segment_path, s->log_name, ext);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog%s", h->segment_path, ext);
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
 
   err = mkpath(h->log_path);
@@ -181,45 +291,26 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log_file = fopen(h->log_path, "wb");
+  h->log_file = LogFile::open(h->log_path, s->compression, RLOG_PREALLOCATE, s->packed);
   if (h->log_file == NULL) goto fail;
 
   if (s->has_qlog) {
-    h->qlog_file = fopen(h->qlog_path, "wb");
+    h->qlog_file = LogFile::open(h->qlog_path, s->compression, QLOG_PREALLOCATE, s->packed);
     if (h->qlog_file == NULL) goto fail;
   }
 
-  int bzerror;
-  h->bz_file = BZ2_bzWriteOpen(&bzerror, h->log_file, 9, 0, 30);
-  if (bzerror != BZ_OK) goto fail;
-
-  if (s->has_qlog) {
-    h->bz_qlog = BZ2_bzWriteOpen(&bzerror, h->qlog_file, 9, 0, 30);
-    if (bzerror != BZ_OK) goto fail;
-  }
-
   pthread_mutex_init(&h->lock, NULL);
+  h->writer = s->writer;
+  h->open = true;
   h->refcnt++;
   return h;
 
 fail:
   LOGE("logger failed to open files");
-  if (h->bz_file) {
-    BZ2_bzWriteClose(&bzerror, h->bz_file, 0, NULL, NULL);
-    h->bz_file = NULL;
-  }
-  if (h->bz_qlog) {
-    BZ2_bzWriteClose(&bzerror, h->bz_qlog, 0, NULL, NULL);
-    h->bz_qlog = NULL;
-  }
-  if (h->qlog_file) {
-    fclose(h->qlog_file);
-    h->qlog_file = NULL;
-  }
-  if (h->log_file) {
-    fclose(h->log_file);
-    h->log_file = NULL;
-  }
+  delete h->log_file;
+  h->log_file = NULL;
+  delete h->qlog_file;
+  h->qlog_file = NULL;
   return NULL;
 }
 
@@ -278,6 +369,14 @@ void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_unlock(&s->lock);
 }
 
+void logger_log(LoggerState *s, kj::Array<uint8_t> &&data, bool in_qlog) {
+  pthread_mutex_lock(&s->lock);
+  if (s->cur_handle) {
+    lh_log(s->cur_handle, std::move(data), in_qlog);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
 void logger_close(LoggerState *s) {
   log_sentinel(s, cereal::Sentinel::SentinelType::END_OF_ROUTE);
 
@@ -286,18 +385,25 @@ void logger_close(LoggerState *s) {
     lh_close(s->cur_handle);
   }
   pthread_mutex_unlock(&s->lock);
+
+  // wait for everything to be written
+  {
+    std::lock_guard<std::mutex> lk(s->writer->lock);
+    s->writer->exit = true;
+  }
+  s->writer->cv.notify_one();
+  s->writer->thread.join();
+  delete s->writer;
+  s->writer = NULL;
 }
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
-  pthread_mutex_lock(&h->lock);
-  assert(h->refcnt > 0);
-  int bzerror;
-  BZ2_bzWrite(&bzerror, h->bz_file, data, data_size);
+  lh_log(h, kj::heapArray<uint8_t>(data, data_size), in_qlog);
+}
 
-  if (in_qlog && h->bz_qlog != NULL) {
-    BZ2_bzWrite(&bzerror, h->bz_qlog, data, data_size);
-  }
-  pthread_mutex_unlock(&h->lock);
+void lh_log(LoggerHandle* h, kj::Array<uint8_t> &&data, bool in_qlog) {
+  assert(h->refcnt > 0);
+  log_writer_push(h->writer, {h, std::move(data), in_qlog && h->qlog_file != NULL, false});
 }
 
 void lh_close(LoggerHandle* h) {
@@ -305,23 +411,8 @@ void lh_close(LoggerHandle* h) {
   assert(h->refcnt > 0);
   h->refcnt--;
   if (h->refcnt == 0) {
-    if (h->bz_file){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_file, 0, NULL, NULL);
-      h->bz_file = NULL;
-    }
-    if (h->bz_qlog){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_qlog, 0, NULL, NULL);
-      h->bz_qlog = NULL;
-    }
-    if (h->qlog_file) {
-      fclose(h->qlog_file);
-      h->qlog_file = NULL;
-    }
-    fclose(h->log_file);
-    h->log_file = NULL;
-    unlink(h->lock_path);
+    // the writer closes the files once the queued logs are written
+    log_writer_push(h->writer, {h, kj::Array<uint8_t>(), false, true});
     pthread_mutex_unlock(&h->lock);
     pthread_mutex_destroy(&h->lock);
     return;
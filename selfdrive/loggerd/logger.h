@@ -3,10 +3,12 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
-#include <bzlib.h>
+#include <atomic>
 #include <kj/array.h>
 #include <capnp/serialize.h>
 
+#include "log_compressor.h"
+
 #if defined(QCOM) || defined(QCOM2)
 const std::string LOG_ROOT = "/data/media/0/realdata";
 #else
@@ -15,18 +17,22 @@ const std::string LOG_ROOT = util::getenv_default("HOME", "/.comma/media/0/reald
 
 #define LOGGER_MAX_HANDLES 16
 
+struct LogWriter;
+
 typedef struct LoggerHandle {
   pthread_mutex_t lock;
   int refcnt;
+  // set until the writer thread closed the files, the handle can't be reused before
+  std::atomic<bool> open;
+  LogWriter *writer;
+  int part;
   char segment_path[4096];
   char log_path[4096];
   char lock_path[4096];
-  FILE* log_file;
-  BZFILE* bz_file;
+  LogFile* log_file;
 
-  FILE* qlog_file;
+  LogFile* qlog_file;
   char qlog_path[4096];
-  BZFILE* bz_qlog;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -35,6 +41,11 @@ typedef struct LoggerState {
   char route_name[64];
   char log_name[64];
   bool has_qlog;
+  LogCompression compression;
+  bool packed;
+
+  // compresses and writes the logs on its own thread
+  LogWriter *writer;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
@@ -47,6 +58,10 @@ int logger_next(LoggerState *s, const char* root_path,
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+// Takes a message that was already copied out, without copying it again
+void logger_log(LoggerState *s, kj::Array<uint8_t> &&data, bool in_qlog);
 
+// Copies the data to the writer thread's queue
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+void lh_log(LoggerHandle* h, kj::Array<uint8_t> &&data, bool in_qlog);
 void lh_close(LoggerHandle* h);
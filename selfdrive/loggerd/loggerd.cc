@@ -7,16 +7,18 @@
 #include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
-#include <sys/resource.h>
 
 #include <string>
+#include <vector>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <random>
+#include <algorithm>
 
 #include <ftw.h>
+#include <sys/statvfs.h>
 
 #include "common/timing.h"
 #include "common/params.h"
@@ -24,6 +26,8 @@
 #include "common/util.h"
 #include "camerad/cameras/camera_common.h"
 #include "logger.h"
+#include "segment_file.h"
+#include "write_scheduler.h"
 #include "messaging.hpp"
 #include "services.h"
 
@@ -34,9 +38,12 @@
 #if defined(QCOM) || defined(QCOM2)
 #include "omx_encoder.h"
 #define Encoder OmxEncoder
+// the full resolution cameras are encoded from camerad's venus streams in place
+#define ENCODER_ZERO_COPY true
 #else
 #include "raw_logger.h"
 #define Encoder RawLogger
+#define ENCODER_ZERO_COPY false
 #endif
 
 constexpr int MAIN_BITRATE = 5000000;
@@ -50,6 +57,13 @@ constexpr int DCAM_BITRATE = MAIN_BITRATE;
 #endif
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
+#define ENCODER_PATIENCE 5000 // stop an encoder when its frame packets are gone this long
+
+// With RecordClipsOnly, or when the storage is nearly full, the full resolution cameras are kept in
+// memory and only written out as clips around a clipTrigger, a disengagement or an FCW
+#define CLIP_RING_S 15 // of video before the trigger
+#define CLIP_POST_S 10 // and after it, unless the clipTrigger asks for more
+#define CLIP_FREE_PERCENT 15
 
 LogCameraInfo cameras_logged[LOG_CAMERA_ID_MAX] = {
   [LOG_CAMERA_ID_FCAMERA] = {
@@ -82,8 +96,11 @@ LogCameraInfo cameras_logged[LOG_CAMERA_ID_MAX] = {
     .downscale = false,
     .has_qcamera = false
   },
+  // encoded from camerad's half resolution stream, on its own thread
   [LOG_CAMERA_ID_QCAMERA] = {
+    .stream_type = VISION_STREAM_YUV_BACK_HALF,
     .filename = "qcamera.ts",
+    .frame_packet_name = "frame",
     .fps = MAIN_FPS,
     .bitrate = 128000,
     .is_h265 = false,
@@ -99,28 +116,47 @@ LogCameraInfo cameras_logged[LOG_CAMERA_ID_MAX] = {
 
 namespace {
 
-constexpr int SEGMENT_LENGTH = 60;
-
 ExitHandler do_exit;
 
+// Rotation is a lock-free handshake: the main loop opens the next segment in the logger and
+// sets should_rotate, the encoder thread swaps to it on its next frame and clears it.
+// fid_lock only guards the wait for the log thread to catch up with the camera
 class RotateState {
 public:
   SubSocket* fpkt_sock;
-  uint32_t stream_frame_id, log_frame_id, last_rotate_frame_id;
-  bool enabled, should_rotate, initialized;
+  std::atomic<uint32_t> stream_frame_id, last_rotate_frame_id;
+  uint32_t log_frame_id;
+  std::atomic<bool> enabled, should_rotate, initialized;
 
-  RotateState() : fpkt_sock(nullptr), stream_frame_id(0), log_frame_id(0),
-                  last_rotate_frame_id(UINT32_MAX), enabled(false), should_rotate(false), initialized(false) {};
+  RotateState() : fpkt_sock(nullptr), stream_frame_id(0), last_rotate_frame_id(UINT32_MAX),
+                  log_frame_id(0), enabled(false), should_rotate(false), initialized(false) {};
 
   void waitLogThread() {
     std::unique_lock<std::mutex> lk(fid_lock);
     while (stream_frame_id > log_frame_id           // if the log camera is older, wait for it to catch up.
            && (stream_frame_id - log_frame_id) < 8  // but if its too old then there probably was a discontinuity (visiond restarted)
-           && !do_exit) {
+           && enabled && !do_exit) {
       cv.wait(lk);
     }
   }
 
+  // Starts over for a new encoder thread, which joins the current segment if there is one
+  void enable(bool in_segment) {
+    std::unique_lock<std::mutex> lk(fid_lock);
+    stream_frame_id = log_frame_id = 0;
+    last_rotate_frame_id = UINT32_MAX;
+    initialized = false;
+    enabled = true;
+    should_rotate = in_segment;
+  }
+
+  void disable() {
+    fid_lock.lock();
+    enabled = false;
+    fid_lock.unlock();
+    cv.notify_one();
+  }
+
   void cancelWait() {
     cv.notify_one();
   }
@@ -139,16 +175,15 @@ public:
     cv.notify_one();
   }
 
+  // called by the main loop once the logger is on the new segment
   void rotate() {
     if (enabled) {
-      std::unique_lock<std::mutex> lk(fid_lock);
+      last_rotate_frame_id = stream_frame_id.load();
       should_rotate = true;
-      last_rotate_frame_id = stream_frame_id;
     }
   }
 
   void finish_rotate() {
-    std::unique_lock<std::mutex> lk(fid_lock);
     should_rotate = false;
   }
 
@@ -157,54 +192,120 @@ private:
   std::condition_variable cv;
 };
 
+// An encoder thread, started by the main loop when the camera's frame packets show up
+// and stopped when they're gone for ENCODER_PATIENCE
+struct EncoderState {
+  std::thread thread;
+  bool running = false;
+  double last_frame_tms = 0;
+  std::atomic<bool> stop{false};
+  std::atomic<bool> done{false};
+
+  // health, updated by the encoder thread
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> missed{0};  // frames the vipc client didn't get
+  std::atomic<double> encode_ms{0};
+  std::atomic<double> max_encode_ms{0};
+
+  // seconds after the trigger of a clip the main loop asks for, taken by the encoder thread
+  std::atomic<int> clip_post_s{0};
+};
+
+// What sets off a clip: a clipTrigger, controls disengaging and a forward collision warning
+struct ClipTriggers {
+  SubSocket *trigger = nullptr, *controls = nullptr, *plan = nullptr;
+  bool enabled = false, fcw = false;
+
+  bool watches(SubSocket *sock) const { return sock == trigger || sock == controls || sock == plan; }
+
+  // the seconds of video to keep after the message, 0 if it sets nothing off
+  int check(SubSocket *sock, const kj::Array<uint8_t> &msg) {
+    capnp::FlatArrayMessageReader cmsg(kj::arrayPtr((const capnp::word*)msg.begin(), msg.size() / sizeof(capnp::word)));
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    if (sock == trigger) {
+      auto t = event.getClipTrigger();
+      return t.getPostSeconds() > 0 ? t.getPostSeconds() : CLIP_POST_S;
+    } else if (sock == controls) {
+      const bool was_enabled = enabled;
+      enabled = event.getControlsState().getEnabled();
+      return was_enabled && !enabled ? CLIP_POST_S : 0;
+    } else if (sock == plan) {
+      const bool was_fcw = fcw;
+      fcw = event.getPlan().getFcw();
+      return !was_fcw && fcw ? CLIP_POST_S : 0;
+    }
+    return 0;
+  }
+};
+
 struct LoggerdState {
   Context *ctx;
   LoggerState logger;
-  char segment_path[4096];
-  int rotate_segment;
-  pthread_mutex_t rotate_lock;
-  RotateState rotate_state[LOG_CAMERA_ID_MAX-1];
+  RotateState rotate_state[LOG_CAMERA_ID_MAX];
+  EncoderState encoder_state[LOG_CAMERA_ID_MAX];
+  // the full resolution cameras only record clips
+  bool clips = false;
 };
 LoggerdState s;
 
+Encoder *create_encoder(LogCameraInfo &cam_info, VisionIpcClient &vipc_client) {
+  const VisionBuf &buf_info = vipc_client.buffers[0];
+  // downscaling encoders have a fixed output size, the stream already did most of the scaling
+  int width = cam_info.downscale ? cam_info.frame_width : buf_info.width;
+  int height = cam_info.downscale ? cam_info.frame_height : buf_info.height;
+#if ENCODER_ZERO_COPY
+  if (buf_info.format == VISIONBUF_FORMAT_NV12_VENUS) {
+    // the encoder gives the frames back as omx is done with them
+    return new Encoder(cam_info.filename, width, height, cam_info.fps, cam_info.bitrate, cam_info.is_h265, cam_info.downscale,
+                       vipc_client.buffers, vipc_client.num_buffers, [&vipc_client](VisionBuf *buf) { vipc_client.release(buf); });
+  }
+#endif
+  return new Encoder(cam_info.filename, width, height, cam_info.fps, cam_info.bitrate, cam_info.is_h265, cam_info.downscale);
+}
+
 void encoder_thread(int cam_idx) {
-  assert(cam_idx < LOG_CAMERA_ID_MAX-1);
+  assert(cam_idx < LOG_CAMERA_ID_MAX);
 
   LogCameraInfo &cam_info = cameras_logged[cam_idx];
   RotateState &rotate_state = s.rotate_state[cam_idx];
+  EncoderState &encoder_state = s.encoder_state[cam_idx];
 
   set_thread_name(cam_info.filename);
 
   int cnt = 0;
+  uint32_t last_frame_id = 0;
   LoggerHandle *lh = NULL;
-  std::vector<Encoder *> encoders;
-  VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
+  // double buffered: at rotation the standby encoder is opened on the new segment and swapped in,
+  // while the old one is drained and closed on close_thread without holding up this camera.
+  // Recording clips there's one for the whole drive, so its ring goes on across the segments
+  Encoder *encoder = NULL, *standby = NULL;
+  bool clips = false;
+  int clip_count = 0;
+  std::thread close_thread;
+  VisionStreamType stream_type = cam_info.stream_type;
+  if (ENCODER_ZERO_COPY && !cam_info.downscale) {
+    stream_type = (VisionStreamType)(VISION_STREAM_YUV_BACK_VENUS + (stream_type - VISION_STREAM_YUV_BACK));
+  }
+  VisionIpcClient vipc_client = VisionIpcClient("camerad", stream_type, false);
 
-  while (!do_exit) {
+  while (!do_exit && !encoder_state.stop) {
     if (!vipc_client.connect(false)){
       util::sleep_for(100);
       continue;
     }
 
     // init encoders
-    if (encoders.empty()) {
-      VisionBuf buf_info = vipc_client.buffers[0];
+    if (encoder == NULL) {
+      VisionBuf &buf_info = vipc_client.buffers[0];
       LOGD("encoder init %dx%d", buf_info.width, buf_info.height);
-
-      // main encoder
-      encoders.push_back(new Encoder(cam_info.filename, buf_info.width, buf_info.height,
-                                     cam_info.fps, cam_info.bitrate, cam_info.is_h265, cam_info.downscale));
-
-      // qcamera encoder
-      if (cam_info.has_qcamera) {
-        LogCameraInfo &qcam_info = cameras_logged[LOG_CAMERA_ID_QCAMERA];
-        encoders.push_back(new Encoder(qcam_info.filename,
-                                       qcam_info.frame_width, qcam_info.frame_height,
-                                       qcam_info.fps, qcam_info.bitrate, qcam_info.is_h265, qcam_info.downscale));
+      encoder = create_encoder(cam_info, vipc_client);
+      clips = s.clips && cam_idx != LOG_CAMERA_ID_QCAMERA && encoder->enable_clips(CLIP_RING_S);
+      if (!clips) {
+        standby = create_encoder(cam_info, vipc_client);
       }
     }
 
-    while (!do_exit) {
+    while (!do_exit && !encoder_state.stop) {
       VisionIpcBufExtra extra;
       VisionBuf* buf = vipc_client.recv(&extra);
       if (buf == nullptr){
@@ -215,18 +316,13 @@ void encoder_thread(int cam_idx) {
 
       // all the rotation stuff
       {
-        pthread_mutex_lock(&s.rotate_lock);
-        pthread_mutex_unlock(&s.rotate_lock);
-
         // wait if camera pkt id is older than stream
         rotate_state.waitLogThread();
 
-        if (do_exit) break;
+        if (do_exit || encoder_state.stop) break;
 
         // rotate the encoder if the logger is on a newer segment
         if (rotate_state.should_rotate) {
-          LOGW("camera %d rotate encoder to %s", cam_idx, s.segment_path);
-
           if (!rotate_state.initialized) {
             rotate_state.last_rotate_frame_id = extra.frame_id - 1;
             rotate_state.initialized = true;
@@ -236,56 +332,87 @@ void encoder_thread(int cam_idx) {
             lh_close(lh);
           }
           lh = logger_get_handle(&s.logger);
-
-          pthread_mutex_lock(&s.rotate_lock);
-          for (auto &e : encoders) {
-            e->encoder_close();
-            e->encoder_open(s.segment_path, s.rotate_segment);
+          LOGW("camera %d rotate encoder to %s", cam_idx, lh->segment_path);
+
+          if (clips) {
+            // only moves the encoder's frame count on to the new segment
+            encoder->encoder_open(lh->segment_path, lh->part);
+          } else {
+            // the standby encoder was closed on the previous rotation, this only waits if that took a whole segment
+            if (close_thread.joinable()) close_thread.join();
+
+            // opening only creates the files
+            standby->encoder_open(lh->segment_path, lh->part);
+            std::swap(encoder, standby);
+            close_thread = std::thread([closing = standby]() {
+              closing->encoder_close();
+            });
           }
-          pthread_mutex_unlock(&s.rotate_lock);
           rotate_state.finish_rotate();
         }
       }
 
+      const int clip_post_s = encoder_state.clip_post_s.exchange(0);
+      if (clips && lh && clip_post_s > 0) {
+        const std::string clip_path = util::string_format("%s/clip%d_%s", lh->segment_path, clip_count++, cam_info.filename);
+        encoder->save_clip(clip_path.c_str(), clip_post_s);
+      }
+
       rotate_state.setStreamFrameId(extra.frame_id);
 
       // encode a frame
       {
+        double encode_start = millis_since_boot();
         int out_segment = -1;
-        int out_id = encoders[0]->encode_frame(buf->y, buf->u, buf->v,
-                                               buf->width, buf->height,
-                                               &out_segment, &extra);
-        if (encoders.size() > 1) {
-          int out_segment_alt = -1;
-          encoders[1]->encode_frame(buf->y, buf->u, buf->v,
-                                    buf->width, buf->height,
-                                    &out_segment_alt, &extra);
+        int out_id;
+        if (buf->format == VISIONBUF_FORMAT_NV12_VENUS) {
+          // leased until the encoder's done reading it
+          vipc_client.hold(buf);
+          out_id = encoder->encode_buf(buf, &out_segment, &extra);
+        } else {
+          out_id = encoder->encode_frame(buf->y, buf->u, buf->v,
+                                         buf->width, buf->height,
+                                         &out_segment, &extra);
         }
 
-        // publish encode index
-        MessageBuilder msg;
-        // this is really ugly
-        auto eidx = cam_idx == LOG_CAMERA_ID_DCAMERA ? msg.initEvent().initFrontEncodeIdx() :
-                    (cam_idx == LOG_CAMERA_ID_ECAMERA ? msg.initEvent().initWideEncodeIdx() : msg.initEvent().initEncodeIdx());
-        eidx.setFrameId(extra.frame_id);
-        eidx.setTimestampSof(extra.timestamp_sof);
-        eidx.setTimestampEof(extra.timestamp_eof);
+        double encode_ms = millis_since_boot() - encode_start;
+        const uint64_t encoded_time = nanos_since_boot();
+        encoder_state.frames++;
+        encoder_state.missed = vipc_client.stats.missed();
+        encoder_state.encode_ms = encode_ms;
+        if (encode_ms > encoder_state.max_encode_ms) encoder_state.max_encode_ms = encode_ms;
+
+        // publish encode index, the qcamera has none of its own
+        if (lh && cam_idx != LOG_CAMERA_ID_QCAMERA) {
+          MessageBuilder msg;
+          // this is really ugly
+          auto eidx = cam_idx == LOG_CAMERA_ID_DCAMERA ? msg.initEvent().initFrontEncodeIdx() :
+                      (cam_idx == LOG_CAMERA_ID_ECAMERA ? msg.initEvent().initWideEncodeIdx() : msg.initEvent().initEncodeIdx());
+          eidx.setFrameId(extra.frame_id);
+          eidx.setTimestampSof(extra.timestamp_sof);
+          eidx.setTimestampEof(extra.timestamp_eof);
+          eidx.setTimestampSent(extra.timestamp_sent);
+          eidx.setTimestampReceived(extra.timestamp_received);
+          eidx.setTimestampEncoded(encoded_time);
   #ifdef QCOM2
-        eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+          eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
   #else
-        eidx.setType(cam_idx == LOG_CAMERA_ID_DCAMERA ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
+          eidx.setType(cam_idx == LOG_CAMERA_ID_DCAMERA ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
   #endif
-        eidx.setEncodeId(cnt);
-        eidx.setSegmentNum(out_segment);
-        eidx.setSegmentId(out_id);
+          eidx.setEncodeId(cnt);
+          eidx.setSegmentNum(out_segment);
+          eidx.setSegmentId(out_id);
+          if (cnt > 0 && extra.frame_id > last_frame_id + 1) {
+            eidx.setDroppedFrames(extra.frame_id - last_frame_id - 1);
+          }
 
-        if (lh) {
           auto bytes = msg.toBytes();
           lh_log(lh, bytes.begin(), bytes.size(), false);
         }
       }
 
       cnt++;
+      last_frame_id = extra.frame_id;
     }
 
     if (lh) {
@@ -295,12 +422,84 @@ void encoder_thread(int cam_idx) {
   }
 
   LOG("encoder destroy");
-  for(auto &e : encoders) {
-    e->encoder_close();
-    delete e;
+  if (close_thread.joinable()) close_thread.join();
+  if (encoder) {
+    encoder->encoder_close();
+    delete encoder;
+    delete standby;
+  }
+  encoder_state.done = true;
+}
+
+bool encoder_allowed(int cam_idx, bool record_front) {
+  if (cam_idx == LOG_CAMERA_ID_DCAMERA) return record_front;
+  return cam_idx <= MAX_CAM_IDX || cam_idx == LOG_CAMERA_ID_QCAMERA;
+}
+
+bool storage_nearly_full() {
+  struct statvfs st;
+  if (statvfs(LOG_ROOT.c_str(), &st) != 0 || st.f_blocks == 0) return false;
+  return st.f_bavail * 100 < st.f_blocks * CLIP_FREE_PERCENT;
+}
+
+void start_encoder(int cam_idx) {
+  EncoderState &es = s.encoder_state[cam_idx];
+  LOGW("starting encoder for %s", cameras_logged[cam_idx].filename);
+  es.stop = false;
+  es.done = false;
+  es.frames = 0;
+  es.max_encode_ms = 0;
+  es.clip_post_s = 0;
+  s.rotate_state[cam_idx].enable(s.logger.part >= 0);
+  es.thread = std::thread(encoder_thread, cam_idx);
+  es.running = true;
+}
+
+// Closing the encoders can take a while, the thread is joined once it's done
+void stop_encoder(int cam_idx) {
+  s.encoder_state[cam_idx].stop = true;
+  s.rotate_state[cam_idx].disable();
+}
+
+void join_encoder(int cam_idx) {
+  EncoderState &es = s.encoder_state[cam_idx];
+  es.thread.join();
+  es.running = false;
+}
+
+void log_encoder_health() {
+  for (int cid = 0; cid < LOG_CAMERA_ID_MAX; cid++) {
+    EncoderState &es = s.encoder_state[cid];
+    if (!es.running) continue;
+    LOG("encoder %s: %" PRIu64 " frames, %" PRIu64 " missed, encode %.2fms, max %.2fms", cameras_logged[cid].filename,
+        es.frames.load(), es.missed.load(), es.encode_ms.load(), es.max_encode_ms.load());
+    es.max_encode_ms = 0;
   }
 }
 
+void publish_write_stats(PubMaster &pm) {
+  WriteQueueStats stats[WRITE_PRIORITY_COUNT];
+  WriteScheduler::instance().take_stats(stats);
+
+  MessageBuilder msg;
+  auto state = msg.initEvent().initLoggerdState();
+  auto buckets = state.initWriteLatencyBucketsMs(WRITE_LATENCY_BUCKETS - 1);
+  for (int i = 0; i < WRITE_LATENCY_BUCKETS - 1; i++) buckets.set(i, WRITE_LATENCY_BUCKETS_MS[i]);
+
+  auto queues = state.initWriteQueues(WRITE_PRIORITY_COUNT);
+  for (int i = 0; i < WRITE_PRIORITY_COUNT; i++) {
+    auto q = queues[i];
+    q.setPriority(i == (int)WritePriority::REALTIME ? cereal::LoggerdState::Priority::REALTIME : cereal::LoggerdState::Priority::BULK);
+    q.setDepth(stats[i].depth);
+    q.setMaxDepth(stats[i].max_depth);
+    q.setBytes(stats[i].bytes);
+    q.setThrottledUs(stats[i].throttled_us);
+    auto hist = q.initLatencyHistogram(WRITE_LATENCY_BUCKETS);
+    for (int j = 0; j < WRITE_LATENCY_BUCKETS; j++) hist.set(j, stats[i].latency_hist[j]);
+  }
+  pm.send("loggerdState", msg);
+}
+
 }
 
 static int clear_locks_fn(const char* fpath, const struct stat *sb, int tyupeflag) {
@@ -317,7 +516,7 @@ static void clear_locks() {
 
 int main(int argc, char** argv) {
 
-  setpriority(PRIO_PROCESS, 0, -12);
+  set_sched_profile("loggerd");
 
   int segment_length = SEGMENT_LENGTH;
   if (getenv("LOGGERD_TEST")) {
@@ -335,6 +534,7 @@ int main(int argc, char** argv) {
   s.ctx = Context::create();
   Poller * poller = Poller::create();
   std::vector<SubSocket*> socks;
+  ClipTriggers clip_triggers;
 
   // subscribe to all socks
   for (const auto& it : services) {
@@ -351,106 +551,136 @@ int main(int argc, char** argv) {
       }
     }
     qlog_states[sock] = {.counter = 0, .freq = it.decimation};
+
+    const std::string name = it.name;
+    if (name == "clipTrigger") clip_triggers.trigger = sock;
+    if (name == "controlsState") clip_triggers.controls = sock;
+    if (name == "plan") clip_triggers.plan = sock;
   }
 
   // init logger
   logger_init(&s.logger, "rlog", true);
 
-  // init encoders
-  pthread_mutex_init(&s.rotate_lock, NULL);
-
-  // TODO: create these threads dynamically on frame packet presence
-  std::vector<std::thread> encoder_threads;
-  encoder_threads.push_back(std::thread(encoder_thread, LOG_CAMERA_ID_FCAMERA));
-  s.rotate_state[LOG_CAMERA_ID_FCAMERA].enabled = true;
+  PubMaster pm({"loggerdState"});
 
-#if defined(QCOM) || defined(QCOM2)
-  bool record_front = Params().read_db_bool("RecordFront");
-  if (record_front) {
-    encoder_threads.push_back(std::thread(encoder_thread, LOG_CAMERA_ID_DCAMERA));
-    s.rotate_state[LOG_CAMERA_ID_DCAMERA].enabled = true;
+  // encoders are started once their camera's frame packets show up
+  const bool record_front = Params().read_db_bool("RecordFront");
+  s.clips = Params().read_db_bool("RecordClipsOnly") || storage_nearly_full();
+  if (s.clips) {
+    LOGW("recording clips of %d s around the triggers", CLIP_RING_S + CLIP_POST_S);
   }
 
-#ifdef QCOM2
-  encoder_threads.push_back(std::thread(encoder_thread, LOG_CAMERA_ID_ECAMERA));
-  s.rotate_state[LOG_CAMERA_ID_ECAMERA].enabled = true;
-#endif
-#endif
-
   uint64_t msg_count = 0;
   uint64_t bytes_count = 0;
-  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(1024);
 
   double start_ts = seconds_since_boot();
   double last_rotate_tms = millis_since_boot();
+  double last_stats_tms = millis_since_boot();
   double last_camera_seen_tms = millis_since_boot();
+  std::vector<SubSocket*> ready_socks;
   while (!do_exit) {
     // TODO: fix msgs from the first poll getting dropped
     // poll for new messages on all sockets
-    for (auto sock : poller->poll(1000)) {
+    poller->poll(1000, ready_socks);
+    for (auto sock : ready_socks) {
 
-      // drain socket
-      Message * last_msg = nullptr;
+      int fpkt_id = -1;
+      for (int cid = 0; cid <=MAX_CAM_IDX; cid++) {
+        if (sock == s.rotate_state[cid].fpkt_sock) {
+          fpkt_id=cid;
+          break;
+        }
+      }
+
+      // drain socket, copying each message out of the ring once, straight into the logger's queue
+      bool got_frame = false;
+      uint32_t last_frame_id = 0;
       while (!do_exit) {
-        Message * msg = sock->receive(true);
-        if (!msg){
+        char *data;
+        size_t len = sock->receiveView(&data);
+        if (len == 0) {
           break;
         }
-        delete last_msg;
-        last_msg = msg;
+        kj::Array<uint8_t> msg = kj::heapArray<uint8_t>((const uint8_t*)data, len);
+        if (!sock->releaseView()) {
+          // overwritten by the publisher while copying
+          continue;
+        }
+
+        if (fpkt_id >= 0) {
+          // track camera frames to sync to encoder
+          capnp::FlatArrayMessageReader cmsg(kj::arrayPtr((const capnp::word*)msg.begin(), len / sizeof(capnp::word)));
+          cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+          if (fpkt_id == LOG_CAMERA_ID_FCAMERA) {
+            last_frame_id = event.getFrame().getFrameId();
+          } else if (fpkt_id == LOG_CAMERA_ID_DCAMERA) {
+            last_frame_id = event.getFrontFrame().getFrameId();
+          } else if (fpkt_id == LOG_CAMERA_ID_ECAMERA) {
+            last_frame_id = event.getWideFrame().getFrameId();
+          }
+          got_frame = true;
+        }
+
+        if (s.clips && clip_triggers.watches(sock)) {
+          if (int post_s = clip_triggers.check(sock, msg)) {
+            LOGW("clip triggered, %d s after", post_s);
+            for (auto &es : s.encoder_state) es.clip_post_s = std::max(es.clip_post_s.load(), post_s);
+          }
+        }
 
         QlogState& qs = qlog_states[sock];
-        logger_log(&s.logger, (uint8_t*)msg->getData(), msg->getSize(), qs.counter == 0 && qs.freq != -1);
+        logger_log(&s.logger, std::move(msg), qs.counter == 0 && qs.freq != -1);
         if (qs.freq != -1) {
           qs.counter = (qs.counter + 1) % qs.freq;
         }
 
-        bytes_count += msg->getSize();
+        bytes_count += len;
         if ((++msg_count % 1000) == 0) {
           double ts = seconds_since_boot();
           LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count * 1.0 / (ts - start_ts), bytes_count * 0.001 / (ts - start_ts));
         }
       }
 
-      if (last_msg) {
-        int fpkt_id = -1;
-        for (int cid = 0; cid <=MAX_CAM_IDX; cid++) {
-          if (sock == s.rotate_state[cid].fpkt_sock) {
-            fpkt_id=cid;
-            break;
-          }
-        }
-        if (fpkt_id >= 0) {
-          // track camera frames to sync to encoder
-          // only process last frame
-          const uint8_t* data = (uint8_t*)last_msg->getData();
-          const size_t len = last_msg->getSize();
-          const size_t size = len / sizeof(capnp::word) + 1;
-          if (buf.size() < size) {
-            buf = kj::heapArray<capnp::word>(size);
-          }
-          memcpy(buf.begin(), data, len);
+      // only process last frame
+      if (got_frame) {
+        last_camera_seen_tms = millis_since_boot();
 
-          capnp::FlatArrayMessageReader cmsg(buf);
-          cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+        // the qcamera encoder follows its camera's frame packets
+        int cams[2] = {fpkt_id, cameras_logged[fpkt_id].has_qcamera ? LOG_CAMERA_ID_QCAMERA : -1};
+        for (int cid : cams) {
+          if (cid < 0) continue;
+          s.rotate_state[cid].setLogFrameId(last_frame_id);
 
-          if (fpkt_id == LOG_CAMERA_ID_FCAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getFrame().getFrameId());
-          } else if (fpkt_id == LOG_CAMERA_ID_DCAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getFrontFrame().getFrameId());
-          } else if (fpkt_id == LOG_CAMERA_ID_ECAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getWideFrame().getFrameId());
+          EncoderState &es = s.encoder_state[cid];
+          es.last_frame_tms = last_camera_seen_tms;
+          if (!es.running && encoder_allowed(cid, record_front)) {
+            start_encoder(cid);
           }
-          last_camera_seen_tms = millis_since_boot();
         }
       }
-      delete last_msg;
+    }
+
+    // stop encoders of cameras that went away
+    int encoders_running = 0;
+    for (int cid = 0; cid < LOG_CAMERA_ID_MAX; cid++) {
+      EncoderState &es = s.encoder_state[cid];
+      if (!es.running) continue;
+
+      if (!es.stop && millis_since_boot() - es.last_frame_tms > ENCODER_PATIENCE) {
+        LOGW("stopping encoder for %s", cameras_logged[cid].filename);
+        stop_encoder(cid);
+      }
+      if (es.done) {
+        join_encoder(cid);
+      } else {
+        encoders_running += !es.stop;
+      }
     }
 
     bool new_segment = s.logger.part == -1;
     if (s.logger.part > -1) {
       double tms = millis_since_boot();
-      if (tms - last_camera_seen_tms <= NO_CAMERA_PATIENCE && encoder_threads.size() > 0) {
+      if (tms - last_camera_seen_tms <= NO_CAMERA_PATIENCE && encoders_running > 0) {
         new_segment = true;
         for (auto &r : s.rotate_state) {
           // this *should* be redundant on tici since all camera frames are synced
@@ -471,22 +701,30 @@ int main(int argc, char** argv) {
 
     // rotate to new segment
     if (new_segment) {
-      pthread_mutex_lock(&s.rotate_lock);
       last_rotate_tms = millis_since_boot();
 
-      int err = logger_next(&s.logger, LOG_ROOT.c_str(), s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
+      char segment_path[4096];
+      int err = logger_next(&s.logger, LOG_ROOT.c_str(), segment_path, sizeof(segment_path), NULL);
       assert(err == 0);
-      LOGW((s.logger.part == 0) ? "logging to %s" : "rotated to %s", s.segment_path);
+      LOGW((s.logger.part == 0) ? "logging to %s" : "rotated to %s", segment_path);
 
-      // rotate encoders
+      // rotate encoders, they pick up the new segment from the logger
       for (auto &r : s.rotate_state) r.rotate();
-      pthread_mutex_unlock(&s.rotate_lock);
+
+      log_encoder_health();
+    }
+
+    if (millis_since_boot() - last_stats_tms >= 1000) {
+      last_stats_tms = millis_since_boot();
+      publish_write_stats(pm);
     }
   }
 
   LOGW("closing encoders");
   for (auto &r : s.rotate_state) r.cancelWait();
-  for (auto &t : encoder_threads) t.join();
+  for (int cid = 0; cid < LOG_CAMERA_ID_MAX; cid++) {
+    if (s.encoder_state[cid].running) join_encoder(cid);
+  }
 
   LOGW("closing logger");
   logger_close(&s.logger);
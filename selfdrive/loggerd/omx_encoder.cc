@@ -5,9 +5,12 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <algorithm>
+
 #include <pthread.h>
 
 #include <OMX_Component.h>
@@ -22,6 +25,7 @@
 #include "common/swaglog.h"
 
 #include "omx_encoder.h"
+#include "segment_catalog.h"
 
 // Check the OMX error code and assert if an error occurred.
 #define OMX_CHECK(_expr)          \
@@ -75,10 +79,30 @@ OMX_ERRORTYPE OmxEncoder::empty_buffer_done(OMX_HANDLETYPE component, OMX_PTR ap
                                                    OMX_BUFFERHEADERTYPE *buffer) {
   // printf("empty_buffer_done\n");
   OmxEncoder *e = (OmxEncoder*)app_data;
-  queue_push(&e->free_in, (void*)buffer);
+  if (e->in_bufs) {
+    e->in_buf_done(buffer);
+  } else {
+    queue_push(&e->free_in, (void*)buffer);
+  }
   return OMX_ErrorNone;
 }
 
+void OmxEncoder::in_buf_done(OMX_BUFFERHEADERTYPE *in_buf) {
+  const size_t i = (OMX_QCOM_PLATFORM_PRIVATE_PMEM_INFO *)in_buf->pAppPrivate - this->in_pmem.data();
+  assert(i < this->in_buf_headers.size());
+
+  bool held;
+  {
+    std::lock_guard<std::mutex> lk(this->in_lock);
+    held = this->in_held[i];
+    this->in_omx[i] = this->in_held[i] = false;
+  }
+  this->in_cv.notify_all();
+  if (held) {
+    this->release_in(&this->in_bufs[i]);
+  }
+}
+
 OMX_ERRORTYPE OmxEncoder::fill_buffer_done(OMX_HANDLETYPE component, OMX_PTR app_data,
                                                   OMX_BUFFERHEADERTYPE *buffer) {
   // printf("fill_buffer_done\n");
@@ -89,6 +113,8 @@ OMX_ERRORTYPE OmxEncoder::fill_buffer_done(OMX_HANDLETYPE component, OMX_PTR app
 
 #define PORT_INDEX_IN 0
 #define PORT_INDEX_OUT 1
+// warn when the writer falls this far behind
+#define WRITE_QUEUE_WARN_BYTES (16*1024*1024)
 
 static const char* omx_color_fomat_name(uint32_t format) __attribute__((unused));
 static const char* omx_color_fomat_name(uint32_t format) {
@@ -163,12 +189,16 @@ static const char* omx_color_fomat_name(uint32_t format) {
 
 // ***** encoder functions *****
 
-OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale) {
+OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale,
+                       VisionBuf *in_bufs, int num_in_bufs, std::function<void(VisionBuf *)> release,
+                       PacketCallback on_packet) {
   this->filename = filename;
   this->width = width;
   this->height = height;
   this->fps = fps;
-  this->remuxing = !h265;
+  this->on_packet = on_packet;
+  this->remuxing = !h265 && !on_packet;
+  this->preallocate = (uint64_t)bitrate / 8 * SEGMENT_LENGTH;
 
   queue_init(&this->free_in);
   queue_init(&this->done_out);
@@ -177,6 +207,14 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
   pthread_mutex_init(&this->state_lock, NULL);
   pthread_cond_init(&this->state_cv, NULL);
 
+  this->in_bufs = in_bufs;
+  this->release_in = release;
+  if (this->in_bufs) {
+    // the buffers are taken as they are, there's nothing to scale them with
+    assert(!downscale && num_in_bufs > 0 && this->release_in);
+    assert(in_bufs[0].format == VISIONBUF_FORMAT_NV12_VENUS && in_bufs[0].width == (size_t)width && in_bufs[0].height == (size_t)height);
+  }
+
   this->downscale = downscale;
   if (this->downscale) {
     this->y_ptr2 = (uint8_t *)malloc(this->width*this->height);
@@ -209,11 +247,30 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
   in_port.format.video.eCompressionFormat = OMX_VIDEO_CodingUnused;
   // in_port.format.video.eColorFormat = OMX_COLOR_FormatYUV420SemiPlanar;
   in_port.format.video.eColorFormat = (OMX_COLOR_FORMATTYPE)QOMX_COLOR_FORMATYUV420PackedSemiPlanar32m;
+  if (this->in_bufs) {
+    assert(in_bufs[0].len == in_port.nBufferSize);
+    assert((OMX_U32)num_in_bufs >= in_port.nBufferCountMin);
+    in_port.nBufferCountActual = num_in_bufs;
+  }
 
   OMX_CHECK(OMX_SetParameter(this->handle, OMX_IndexParamPortDefinition, (OMX_PTR) &in_port));
   OMX_CHECK(OMX_GetParameter(this->handle, OMX_IndexParamPortDefinition, (OMX_PTR) &in_port));
   this->in_buf_headers.resize(in_port.nBufferCountActual);
 
+  if (this->in_bufs) {
+    assert(this->in_buf_headers.size() == (size_t)num_in_bufs);
+    this->in_pmem.resize(num_in_bufs);
+    this->in_omx.resize(num_in_bufs, false);
+    this->in_held.resize(num_in_bufs, false);
+
+    // the input buffers are ion memory that's passed by fd, it's not copied into the encoder's own
+    OMX_QCOM_PARAM_PORTDEFINITIONTYPE qcom_port = {0};
+    qcom_port.nSize = sizeof(qcom_port);
+    qcom_port.nPortIndex = (OMX_U32) PORT_INDEX_IN;
+    qcom_port.nMemRegion = OMX_QCOM_MemRegionEBI1;
+    OMX_CHECK(OMX_SetParameter(this->handle, (OMX_INDEXTYPE)OMX_QcomIndexPortDefn, (OMX_PTR) &qcom_port));
+  }
+
   // setup output port
 
   OMX_PARAM_PORTDEFINITIONTYPE out_port = {0};
@@ -240,7 +297,8 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
   bitrate_type.nSize = sizeof(bitrate_type);
   bitrate_type.nPortIndex = (OMX_U32) PORT_INDEX_OUT;
   OMX_CHECK(OMX_GetParameter(this->handle, OMX_IndexParamVideoBitrate, (OMX_PTR) &bitrate_type));
-  bitrate_type.eControlRate = OMX_Video_ControlRateVariable;
+  // a stream's frames stay close to the same size, so none waits long in the network's buffers
+  bitrate_type.eControlRate = this->on_packet ? OMX_Video_ControlRateConstant : OMX_Video_ControlRateVariable;
   bitrate_type.nTargetBitrate = bitrate;
 
   OMX_CHECK(OMX_SetParameter(this->handle, OMX_IndexParamVideoBitrate, (OMX_PTR) &bitrate_type));
@@ -281,6 +339,19 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
     OMX_CHECK(OMX_SetParameter(this->handle, OMX_IndexParamVideoAvc, &avc));
   }
 
+  if (this->on_packet) {
+    // a client that joins waits for at most a second, and no frame waits on a later one
+    set_intra_period(this->fps - 1);
+
+    // frames come out as they're done instead of a few at a time, on the newer firmwares that have it
+    QOMX_EXTNINDEX_VIDEO_VENC_LOW_LATENCY_MODE low_latency = {0};
+    low_latency.nSize = sizeof(low_latency);
+    low_latency.bLowLatencyMode = OMX_TRUE;
+    if (OMX_SetParameter(this->handle, (OMX_INDEXTYPE) OMX_QTIIndexParamLowLatencyMode, (OMX_PTR) &low_latency) != OMX_ErrorNone) {
+      LOGW("%s: the encoder has no low latency mode", this->filename);
+    }
+  }
+
 
   // for (int i = 0; ; i++) {
   //   OMX_VIDEO_PARAM_PORTFORMATTYPE video_port_format = {0};
@@ -306,9 +377,20 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
 
   OMX_CHECK(OMX_SendCommand(this->handle, OMX_CommandStateSet, OMX_StateIdle, NULL));
 
-  for (auto &buf : this->in_buf_headers) {
-    OMX_CHECK(OMX_AllocateBuffer(this->handle, &buf, PORT_INDEX_IN, this,
-                             in_port.nBufferSize));
+  if (this->in_bufs) {
+    for (size_t i = 0; i < this->in_buf_headers.size(); i++) {
+      VisionBuf &b = this->in_bufs[i];
+      assert(b.idx == i);
+      this->in_pmem[i] = {.pmem_fd = (unsigned long)b.fd, .offset = 0, .size = (OMX_U32)b.len,
+                          .mapped_size = (OMX_U32)b.mmap_len, .buffer = b.addr};
+      OMX_CHECK(OMX_UseBuffer(this->handle, &this->in_buf_headers[i], PORT_INDEX_IN, &this->in_pmem[i],
+                              in_port.nBufferSize, (OMX_U8 *)b.addr));
+    }
+  } else {
+    for (auto &buf : this->in_buf_headers) {
+      OMX_CHECK(OMX_AllocateBuffer(this->handle, &buf, PORT_INDEX_IN, this,
+                               in_port.nBufferSize));
+    }
   }
 
   for (auto &buf : this->out_buf_headers) {
@@ -329,70 +411,236 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
   }
 
   // fill the input free queue
-  for (auto &buf : this->in_buf_headers) {
-    queue_push(&this->free_in, (void*)buf);
+  if (!this->in_bufs) {
+    for (auto &buf : this->in_buf_headers) {
+      queue_push(&this->free_in, (void*)buf);
+    }
   }
+
+  this->writer = std::thread(&OmxEncoder::writer_thread, this);
 }
 
-void OmxEncoder::handle_out_buf(OmxEncoder *e, OMX_BUFFERHEADERTYPE *out_buf) {
-  int err;
-  uint8_t *buf_data = out_buf->pBuffer + out_buf->nOffset;
+// an IDR every p_frames + 1 frames, without B frames
+void OmxEncoder::set_intra_period(int p_frames) {
+  QOMX_VIDEO_INTRAPERIODTYPE intra_period = {0};
+  intra_period.nSize = sizeof(intra_period);
+  intra_period.nPortIndex = (OMX_U32) PORT_INDEX_OUT;
+  OMX_CHECK(OMX_GetConfig(this->handle, (OMX_INDEXTYPE) QOMX_IndexConfigVideoIntraperiod, (OMX_PTR) &intra_period));
+  intra_period.nIDRPeriod = 1;
+  intra_period.nPFrames = p_frames;
+  intra_period.nBFrames = 0;
+  OMX_CHECK(OMX_SetConfig(this->handle, (OMX_INDEXTYPE) QOMX_IndexConfigVideoIntraperiod, (OMX_PTR) &intra_period));
+}
 
-  if (out_buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
-    if (e->codec_config_len < out_buf->nFilledLen) {
-      e->codec_config = (uint8_t *)realloc(e->codec_config, out_buf->nFilledLen);
+void OmxEncoder::queue_write(const uint8_t *data, size_t len, uint32_t flags, int64_t timestamp) {
+  std::unique_lock<std::mutex> lk(this->writer_lock);
+  this->write_queue.push_back({std::vector<uint8_t>(data, data + len), flags, timestamp});
+  size_t prev_bytes = this->queued_bytes;
+  this->queued_bytes += len;
+  if (prev_bytes < WRITE_QUEUE_WARN_BYTES && this->queued_bytes >= WRITE_QUEUE_WARN_BYTES) {
+    LOGW("%s writer is %zu bytes behind", this->filename, this->queued_bytes);
+  }
+  lk.unlock();
+  this->writer_cv.notify_one();
+}
+
+void OmxEncoder::writer_thread() {
+  std::unique_lock<std::mutex> lk(this->writer_lock);
+  while (true) {
+    this->writer_cv.wait(lk, [&] { return this->writer_exit || !this->write_queue.empty() || !this->clip_requests.empty(); });
+    if (this->write_queue.empty() && this->clip_requests.empty()) break;
+
+    std::deque<OutPacket> packets;
+    packets.swap(this->write_queue);
+    std::deque<ClipRequest> requests;
+    requests.swap(this->clip_requests);
+    this->queued_bytes = 0;
+    this->writing = true;
+    lk.unlock();
+
+    for (auto &req : requests) {
+      start_clip(req);
     }
-    e->codec_config_len = out_buf->nFilledLen;
-    memcpy(e->codec_config, buf_data, out_buf->nFilledLen);
-#ifdef QCOM2
-    out_buf->nTimeStamp = 0;
-#endif
+    for (auto &pkt : packets) {
+      write_packet(pkt);
+    }
+
+    lk.lock();
+    this->writing = false;
+    this->writer_idle_cv.notify_all();
   }
+}
 
-  if (e->of) {
-    //printf("write %d flags 0x%x\n", out_buf->nFilledLen, out_buf->nFlags);
-    fwrite(buf_data, out_buf->nFilledLen, 1, e->of);
+void OmxEncoder::writer_flush() {
+  std::unique_lock<std::mutex> lk(this->writer_lock);
+  this->writer_idle_cv.wait(lk, [&] { return this->write_queue.empty() && this->clip_requests.empty() && !this->writing; });
+}
+
+bool OmxEncoder::enable_clips(int ring_seconds) {
+  if (this->on_packet || this->remuxing || this->is_open) return false;
+  // twice the target bitrate's worth, for the scenes that take more
+  const size_t max_bytes = this->preallocate / SEGMENT_LENGTH * ring_seconds * 2;
+  this->clip_ring = std::make_unique<ClipRing>(max_bytes, ring_seconds * 1000000LL);
+  // otherwise a GOP could be most of the ring
+  set_intra_period(this->fps - 1);
+  return true;
+}
+
+void OmxEncoder::save_clip(const char *path, int post_seconds) {
+  if (!this->clip_ring) return;
+  std::unique_lock<std::mutex> lk(this->writer_lock);
+  this->clip_requests.push_back({path, post_seconds * 1000000LL});
+  lk.unlock();
+  this->writer_cv.notify_one();
+}
+
+void OmxEncoder::start_clip(const ClipRequest &req) {
+  if (this->clip_ring->packets().empty()) {
+    LOGW("%s: no frames for the clip %s yet", this->filename, req.path.c_str());
+    return;
+  }
+  const int64_t end = this->clip_ring->newest() + req.post_us;
+  if (this->clip_of) {
+    this->clip_end = std::max(this->clip_end, end);
+    return;
   }
 
-  if (e->remuxing) {
-    if (!e->wrote_codec_config && e->codec_config_len > 0) {
-      if (e->codec_ctx->extradata_size < e->codec_config_len) {
-        e->codec_ctx->extradata = (uint8_t *)realloc(e->codec_ctx->extradata, e->codec_config_len + AV_INPUT_BUFFER_PADDING_SIZE);
+  this->clip_of = SegmentFile::open(req.path.c_str(), this->clip_ring->bytes() * 2, WritePriority::BULK);
+  if (!this->clip_of) {
+    LOGE("can't open the clip %s", req.path.c_str());
+    return;
+  }
+  // the uploader leaves the segment alone while it's written, like the segment's own videos
+  const std::string lock = req.path + ".lock";
+  int lock_fd = open(lock.c_str(), O_RDWR | O_CREAT, 0777);
+  if (lock_fd >= 0) close(lock_fd);
+
+  this->clip_path = req.path;
+  this->clip_end = end;
+  LOGW("%s: clip %s from %zu frames back", this->filename, req.path.c_str(), this->clip_ring->packets().size());
+  this->clip_of->write(this->clip_ring->config().data(), this->clip_ring->config().size());
+  for (auto &p : this->clip_ring->packets()) {
+    this->clip_of->write(p.data.data(), p.data.size());
+  }
+}
+
+void OmxEncoder::write_clip(const OutPacket &pkt) {
+  if (pkt.flags & OMX_BUFFERFLAG_CODECCONFIG) {
+    this->clip_ring->push_config(pkt.data.data(), pkt.data.size());
+  } else if (pkt.data.size() > 0) {
+    this->clip_ring->push(pkt.data.data(), pkt.data.size(), pkt.flags & OMX_BUFFERFLAG_SYNCFRAME, pkt.timestamp);
+  }
+
+  if (this->clip_of) {
+    if (pkt.timestamp > this->clip_end) {
+      close_clip();
+    } else {
+      this->clip_of->write(pkt.data.data(), pkt.data.size());
+    }
+  }
+}
+
+void OmxEncoder::close_clip() {
+  if (!this->clip_of) return;
+  if (!this->clip_of->close()) {
+    LOGE("failed to close the clip %s", this->clip_path.c_str());
+  }
+  delete this->clip_of;
+  this->clip_of = NULL;
+  unlink((this->clip_path + ".lock").c_str());
+}
+
+void OmxEncoder::write_packet(const OutPacket &pkt) {
+  int err;
+
+  if (this->clip_ring) {
+    write_clip(pkt);
+    return;
+  }
+
+  if (pkt.flags & OMX_BUFFERFLAG_CODECCONFIG) {
+    this->remux_config = pkt.data;
+  }
+
+  if (this->of) {
+    const uint64_t offset = this->of->tell();
+    this->of->write(pkt.data.data(), pkt.data.size());
+
+    if (this->index_of && !(pkt.flags & OMX_BUFFERFLAG_CODECCONFIG)) {
+      // a frame that came out in more than one buffer
+      if (this->has_index_entry && this->index_entry.pts == pkt.timestamp) {
+        this->index_entry.size += pkt.data.size();
+      } else {
+        if (this->has_index_entry) {
+          this->index_of->write(&this->index_entry, sizeof(this->index_entry));
+        }
+        this->index_entry = {.offset = offset, .size = (uint32_t)pkt.data.size(),
+                             .flags = (pkt.flags & OMX_BUFFERFLAG_SYNCFRAME) ? VIDEO_INDEX_KEYFRAME : 0,
+                             .pts = pkt.timestamp};
+        this->has_index_entry = true;
+      }
+    }
+  }
+
+  if (this->remuxing) {
+    if (!this->wrote_codec_config && this->remux_config.size() > 0) {
+      if (this->codec_ctx->extradata_size < this->remux_config.size()) {
+        this->codec_ctx->extradata = (uint8_t *)realloc(this->codec_ctx->extradata, this->remux_config.size() + AV_INPUT_BUFFER_PADDING_SIZE);
       }
-      e->codec_ctx->extradata_size = e->codec_config_len;
-      memcpy(e->codec_ctx->extradata, e->codec_config, e->codec_config_len);
-      memset(e->codec_ctx->extradata + e->codec_ctx->extradata_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+      this->codec_ctx->extradata_size = this->remux_config.size();
+      memcpy(this->codec_ctx->extradata, this->remux_config.data(), this->remux_config.size());
+      memset(this->codec_ctx->extradata + this->codec_ctx->extradata_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
 
-      err = avcodec_parameters_from_context(e->out_stream->codecpar, e->codec_ctx);
+      err = avcodec_parameters_from_context(this->out_stream->codecpar, this->codec_ctx);
       assert(err >= 0);
-      err = avformat_write_header(e->ofmt_ctx, NULL);
+      err = avformat_write_header(this->ofmt_ctx, NULL);
       assert(err >= 0);
 
-      e->wrote_codec_config = true;
+      this->wrote_codec_config = true;
     }
 
-    if (out_buf->nTimeStamp > 0) {
+    if (pkt.timestamp > 0) {
       // input timestamps are in microseconds
       AVRational in_timebase = {1, 1000000};
 
-      AVPacket pkt;
-      av_init_packet(&pkt);
-      pkt.data = buf_data;
-      pkt.size = out_buf->nFilledLen;
+      AVPacket av_pkt;
+      av_init_packet(&av_pkt);
+      av_pkt.data = (uint8_t *)pkt.data.data();
+      av_pkt.size = pkt.data.size();
 
       enum AVRounding rnd = static_cast<enum AVRounding>(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-      pkt.pts = pkt.dts = av_rescale_q_rnd(out_buf->nTimeStamp, in_timebase, e->ofmt_ctx->streams[0]->time_base, rnd);
-      pkt.duration = av_rescale_q(50*1000, in_timebase, e->ofmt_ctx->streams[0]->time_base);
+      av_pkt.pts = av_pkt.dts = av_rescale_q_rnd(pkt.timestamp, in_timebase, this->ofmt_ctx->streams[0]->time_base, rnd);
+      av_pkt.duration = av_rescale_q(50*1000, in_timebase, this->ofmt_ctx->streams[0]->time_base);
 
-      if (out_buf->nFlags & OMX_BUFFERFLAG_SYNCFRAME) {
-        pkt.flags |= AV_PKT_FLAG_KEY;
+      if (pkt.flags & OMX_BUFFERFLAG_SYNCFRAME) {
+        av_pkt.flags |= AV_PKT_FLAG_KEY;
       }
 
-      err = av_write_frame(e->ofmt_ctx, &pkt);
+      err = av_write_frame(this->ofmt_ctx, &av_pkt);
       if (err < 0) { LOGW("ts encoder write issue"); }
+    }
+  }
+}
+
+void OmxEncoder::handle_out_buf(OmxEncoder *e, OMX_BUFFERHEADERTYPE *out_buf) {
+  uint8_t *buf_data = out_buf->pBuffer + out_buf->nOffset;
 
-      av_free_packet(&pkt);
+  if (out_buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+    if (e->codec_config_len < out_buf->nFilledLen) {
+      e->codec_config = (uint8_t *)realloc(e->codec_config, out_buf->nFilledLen);
     }
+    e->codec_config_len = out_buf->nFilledLen;
+    memcpy(e->codec_config, buf_data, out_buf->nFilledLen);
+#ifdef QCOM2
+    out_buf->nTimeStamp = 0;
+#endif
+  }
+
+  if (e->on_packet) {
+    e->on_packet(buf_data, out_buf->nFilledLen, out_buf->nFlags, out_buf->nTimeStamp);
+  } else if (e->of || e->remuxing || e->clip_ring) {
+    //printf("write %d flags 0x%x\n", out_buf->nFilledLen, out_buf->nFlags);
+    e->queue_write(buf_data, out_buf->nFilledLen, out_buf->nFlags, out_buf->nTimeStamp);
   }
 
   // give omx back the buffer
@@ -414,6 +662,7 @@ int OmxEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const u
     pthread_mutex_unlock(&this->lock);
     return -1;
   }
+  assert(!this->in_bufs);
 
   // this sometimes freezes... put it outside the encoder lock so we can still trigger rotates...
   // THIS IS A REALLY BAD IDEA, but apparently the race has to happen 30 times to trigger this
@@ -421,8 +670,6 @@ int OmxEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const u
   OMX_BUFFERHEADERTYPE* in_buf = (OMX_BUFFERHEADERTYPE *)queue_pop(&this->free_in);
   //pthread_mutex_lock(&this->lock);
 
-  int ret = this->counter;
-
   uint8_t *in_buf_ptr = in_buf->pBuffer;
   // printf("in_buf ptr %p\n", in_buf_ptr);
 
@@ -432,7 +679,8 @@ int OmxEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const u
   // uint8_t *in_uv_ptr = in_buf_ptr + (this->width * this->height);
   uint8_t *in_uv_ptr = in_buf_ptr + (in_y_stride * VENUS_Y_SCANLINES(COLOR_FMT_NV12, this->height));
 
-  if (this->downscale) {
+  // nothing to do when the stream is already at the output size
+  if (this->downscale && (in_width != this->width || in_height != this->height)) {
     I420Scale(y_ptr, in_width,
               u_ptr, in_width/2,
               v_ptr, in_width/2,
@@ -454,6 +702,36 @@ int OmxEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const u
                    this->width, this->height);
   assert(err == 0);
 
+  int ret = empty_in_buf(in_buf, frame_segment, extra);
+  pthread_mutex_unlock(&this->lock);
+  return ret;
+}
+
+int OmxEncoder::encode_buf(VisionBuf *buf, int *frame_segment, VisionIpcBufExtra *extra) {
+  pthread_mutex_lock(&this->lock);
+
+  if (!this->is_open) {
+    pthread_mutex_unlock(&this->lock);
+    this->release_in(buf);
+    return -1;
+  }
+
+  assert(this->in_bufs && buf->idx < this->in_buf_headers.size() && buf->fd == this->in_bufs[buf->idx].fd);
+  {
+    // a held buffer isn't sent again, this only waits for an eos that went out in it
+    std::unique_lock<std::mutex> lk(this->in_lock);
+    this->in_cv.wait(lk, [&] { return !this->in_omx[buf->idx]; });
+    this->in_omx[buf->idx] = this->in_held[buf->idx] = true;
+  }
+
+  int ret = empty_in_buf(this->in_buf_headers[buf->idx], frame_segment, extra);
+  pthread_mutex_unlock(&this->lock);
+  return ret;
+}
+
+int OmxEncoder::empty_in_buf(OMX_BUFFERHEADERTYPE *in_buf, int *frame_segment, VisionIpcBufExtra *extra) {
+  int ret = this->counter;
+
   // in_buf->nFilledLen = (this->width*this->height) + (this->width*this->height/2);
   in_buf->nFilledLen = VENUS_BUFFER_SIZE(COLOR_FMT_NV12, this->width, this->height);
   in_buf->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
@@ -463,12 +741,16 @@ int OmxEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const u
 
   OMX_CHECK(OMX_EmptyThisBuffer(this->handle, in_buf));
 
-  // pump output
+  // pump output, a stream waits for this frame's
+  bool waiting = this->on_packet != nullptr;
   while (true) {
-    OMX_BUFFERHEADERTYPE *out_buf = (OMX_BUFFERHEADERTYPE *)queue_try_pop(&this->done_out);
+    OMX_BUFFERHEADERTYPE *out_buf = (OMX_BUFFERHEADERTYPE *)(waiting ? queue_pop(&this->done_out) : queue_try_pop(&this->done_out));
     if (!out_buf) {
       break;
     }
+    if (!(out_buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG) && out_buf->nTimeStamp >= (int64_t)this->last_t) {
+      waiting = false;
+    }
     handle_out_buf(this, out_buf);
   }
 
@@ -480,7 +762,6 @@ int OmxEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const u
     *frame_segment = this->segment;
   }
 
-  pthread_mutex_unlock(&this->lock);
   return ret;
 }
 
@@ -493,6 +774,14 @@ void OmxEncoder::encoder_open(const char* path, int segment) {
   snprintf(this->vid_path, sizeof(this->vid_path), "%s/%s", path, this->filename);
   LOGD("encoder_open %s remuxing:%d", this->vid_path, this->remuxing);
 
+  if (this->on_packet || this->clip_ring) {
+    // nothing to write, the stream's client or the ring keeps the codec config
+    this->is_open = true;
+    this->counter = 0;
+    pthread_mutex_unlock(&this->lock);
+    return;
+  }
+
   if (this->remuxing) {
     avformat_alloc_output_context2(&this->ofmt_ctx, NULL, NULL, this->vid_path);
     assert(this->ofmt_ctx);
@@ -519,11 +808,22 @@ void OmxEncoder::encoder_open(const char* path, int segment) {
 
     this->wrote_codec_config = false;
   } else {
-    this->of = fopen(this->vid_path, "wb");
+    this->of = SegmentFile::open(this->vid_path, this->preallocate, WritePriority::REALTIME);
     assert(this->of);
+
+    char index_path[sizeof(this->vid_path) + 4];
+    snprintf(index_path, sizeof(index_path), "%s.idx", this->vid_path);
+    this->index_of = SegmentFile::open(index_path, 0, WritePriority::REALTIME);
+    if (this->index_of) {
+      const VideoIndexHeader header = {.magic = VIDEO_INDEX_MAGIC, .version = VIDEO_INDEX_VERSION};
+      this->index_of->write(&header, sizeof(header));
+    } else {
+      LOGE("can't open %s, the video's written without an index", index_path);
+    }
+    this->has_index_entry = false;
 #ifndef QCOM2
     if (this->codec_config_len > 0) {
-      fwrite(this->codec_config, this->codec_config_len, 1, this->of);
+      queue_write(this->codec_config, this->codec_config_len, OMX_BUFFERFLAG_CODECCONFIG, 0);
     }
 #endif
   }
@@ -547,7 +847,20 @@ void OmxEncoder::encoder_close() {
     if (this->dirty) {
       // drain output only if there could be frames in the encoder
 
-      OMX_BUFFERHEADERTYPE* in_buf = (OMX_BUFFERHEADERTYPE *)queue_pop(&this->free_in);
+      OMX_BUFFERHEADERTYPE* in_buf = NULL;
+      if (this->in_bufs) {
+        // any of the buffers omx is done with, the eos doesn't read it
+        std::unique_lock<std::mutex> lk(this->in_lock);
+        size_t i = 0;
+        this->in_cv.wait(lk, [&] {
+          for (i = 0; i < this->in_omx.size() && this->in_omx[i]; i++) {}
+          return i < this->in_omx.size();
+        });
+        this->in_omx[i] = true;
+        in_buf = this->in_buf_headers[i];
+      } else {
+        in_buf = (OMX_BUFFERHEADERTYPE *)queue_pop(&this->free_in);
+      }
       in_buf->nFilledLen = 0;
       in_buf->nOffset = 0;
       in_buf->nFlags = OMX_BUFFERFLAG_EOS;
@@ -567,25 +880,63 @@ void OmxEncoder::encoder_close() {
       this->dirty = false;
     }
 
-    if (this->remuxing) {
+    writer_flush();
+    if (this->on_packet) {
+      // a stream has no files
+    } else if (this->clip_ring) {
+      // what's left of the clip is in the encoder's last packets
+      close_clip();
+    } else if (this->remuxing) {
       av_write_trailer(this->ofmt_ctx);
       avcodec_free_context(&this->codec_ctx);
       avio_closep(&this->ofmt_ctx->pb);
       avformat_free_context(this->ofmt_ctx);
+      segment_catalog_add_file(this->vid_path, true);
     } else {
-      fclose(this->of);
-      this->of = nullptr;
+      if (!this->of->close()) {
+        LOGE("failed to close %s", this->vid_path);
+      }
+      delete this->of;
+      this->of = NULL;
+
+      if (this->index_of) {
+        if (this->has_index_entry) {
+          this->index_of->write(&this->index_entry, sizeof(this->index_entry));
+        }
+        if (!this->index_of->close()) {
+          LOGE("failed to close the index of %s", this->vid_path);
+        }
+        delete this->index_of;
+        this->index_of = NULL;
+      }
+    }
+    if (!this->on_packet && !this->clip_ring) {
+      unlink(this->lock_path);
     }
-    unlink(this->lock_path);
   }
   this->is_open = false;
 
   pthread_mutex_unlock(&this->lock);
 }
 
+void OmxEncoder::request_keyframe() {
+  OMX_CONFIG_INTRAREFRESHVOPTYPE vop = {0};
+  vop.nSize = sizeof(vop);
+  vop.nPortIndex = (OMX_U32) PORT_INDEX_OUT;
+  vop.IntraRefreshVOP = OMX_TRUE;
+  OMX_CHECK(OMX_SetConfig(this->handle, OMX_IndexConfigVideoIntraVOPRefresh, (OMX_PTR) &vop));
+}
+
 OmxEncoder::~OmxEncoder() {
   assert(!this->is_open);
 
+  {
+    std::unique_lock<std::mutex> lk(this->writer_lock);
+    this->writer_exit = true;
+  }
+  this->writer_cv.notify_one();
+  this->writer.join();
+
   OMX_CHECK(OMX_SendCommand(this->handle, OMX_CommandStateSet, OMX_StateIdle, NULL));
 
   wait_for_state(OMX_StateIdle);
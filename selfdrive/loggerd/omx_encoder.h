@@ -5,27 +5,58 @@
 #include <stdbool.h>
 
 #include <pthread.h>
+#include <memory>
+#include <string>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
 #include <OMX_Component.h>
+#include <OMX_QCOMExtns.h>
 
 extern "C" {
   #include <libavformat/avformat.h>
 }
 
+#include "clip_ring.h"
 #include "encoder.h"
+#include "segment_file.h"
+#include "video_index.h"
 #include "common/cqueue.h"
 #include "visionipc.h"
+#include "visionbuf.h"
 
 // OmxEncoder, lossey codec using hardware hevc
 class OmxEncoder : public VideoEncoder {
 public:
-  OmxEncoder(const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale);
+  // the encoder's output as it comes out, with the OMX_BUFFERFLAGs and the frame's timestamp_eof in us
+  typedef std::function<void(const uint8_t *data, size_t len, uint32_t flags, int64_t timestamp)> PacketCallback;
+
+  // With in_bufs, VISIONBUF_FORMAT_NV12_VENUS buffers of the encoder's size, they're its input
+  // buffers and it only takes them through encode_buf. Each goes to release once omx is done with it,
+  // from an omx thread.
+  // With on_packet it's a live stream and nothing's written: an IDR a second, no B frames and a
+  // constant rate, and a frame's packets go to on_packet before its encode returns
+  OmxEncoder(const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale,
+             VisionBuf *in_bufs = nullptr, int num_in_bufs = 0, std::function<void(VisionBuf *)> release = nullptr,
+             PacketCallback on_packet = nullptr);
   ~OmxEncoder();
   int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                    int in_width, int in_height,
                    int *frame_segment, VisionIpcBufExtra *extra);
+  int encode_buf(VisionBuf *buf, int *frame_segment, VisionIpcBufExtra *extra);
   void encoder_open(const char* path, int segment);
   void encoder_close();
+  // the next frame is an IDR, for a stream's new client
+  void request_keyframe();
+  // Keeps the last ring_seconds of output in memory, from a keyframe on, with an IDR a second, and
+  // writes no segment files, only the clips save_clip asks for. Before the first encoder_open
+  bool enable_clips(int ring_seconds);
+  // Writes the ring and the next post_seconds to path. One that comes while a clip's being written
+  // makes that one longer instead
+  void save_clip(const char *path, int post_seconds);
 
   // OMX callbacks
   static OMX_ERRORTYPE event_handler(OMX_HANDLETYPE component, OMX_PTR app_data, OMX_EVENTTYPE event,
@@ -36,8 +67,35 @@ public:
                                         OMX_BUFFERHEADERTYPE *buffer);
 
 private:
+  // an output buffer, copied so it can go back to OMX right away
+  struct OutPacket {
+    std::vector<uint8_t> data;
+    uint32_t flags;
+    int64_t timestamp;
+  };
+  struct ClipRequest {
+    std::string path;
+    int64_t post_us;
+  };
+
   void wait_for_state(OMX_STATETYPE state);
   static void handle_out_buf(OmxEncoder *e, OMX_BUFFERHEADERTYPE *out_buf);
+  // with lock held, hands omx a filled input buffer and takes what it's encoded so far
+  int empty_in_buf(OMX_BUFFERHEADERTYPE *in_buf, int *frame_segment, VisionIpcBufExtra *extra);
+  void in_buf_done(OMX_BUFFERHEADERTYPE *in_buf);
+
+  // the output is written on writer_thread, so slow storage doesn't hold up the encoder
+  void queue_write(const uint8_t *data, size_t len, uint32_t flags, int64_t timestamp);
+  void writer_thread();
+  void write_packet(const OutPacket &pkt);
+  // waits for the queue to be written out
+  void writer_flush();
+  void set_intra_period(int p_frames);
+
+  // on the writer thread, once it has the ring
+  void start_clip(const ClipRequest &req);
+  void write_clip(const OutPacket &pkt);
+  void close_clip();
 
   pthread_mutex_t lock;
   int width, height, fps;
@@ -49,7 +107,13 @@ private:
   int segment = -1;
 
   const char* filename;
-  FILE *of;
+  SegmentFile *of = NULL;
+  // the frames of of, see video_index.h. The last entry's held back while a frame can still grow
+  SegmentFile *index_of = NULL;
+  VideoIndexEntry index_entry;
+  bool has_index_entry = false;
+  // a segment's worth of video at the target bitrate
+  uint64_t preallocate;
 
   size_t codec_config_len;
   uint8_t *codec_config = NULL;
@@ -69,6 +133,16 @@ private:
   Queue free_in;
   Queue done_out;
 
+  // zero copy input, in_buf_headers are in_bufs by idx
+  VisionBuf *in_bufs = nullptr;
+  std::vector<OMX_QCOM_PLATFORM_PRIVATE_PMEM_INFO> in_pmem;
+  std::function<void(VisionBuf *)> release_in;
+  PacketCallback on_packet;
+  std::mutex in_lock;
+  std::condition_variable in_cv;
+  // the ones omx has, and of those the ones that go to release_in when it's done
+  std::vector<bool> in_omx, in_held;
+
   AVFormatContext *ofmt_ctx;
   AVCodecContext *codec_ctx;
   AVStream *out_stream;
@@ -76,4 +150,21 @@ private:
 
   bool downscale;
   uint8_t *y_ptr2, *u_ptr2, *v_ptr2;
+
+  std::thread writer;
+  std::mutex writer_lock;
+  std::condition_variable writer_cv, writer_idle_cv;
+  std::deque<OutPacket> write_queue;
+  std::deque<ClipRequest> clip_requests;
+  size_t queued_bytes = 0;
+  bool writing = false;
+  bool writer_exit = false;
+
+  // owned by the writer thread
+  std::vector<uint8_t> remux_config;
+  std::unique_ptr<ClipRing> clip_ring;
+  SegmentFile *clip_of = NULL;
+  std::string clip_path;
+  // the clip's done with the first frame past it
+  int64_t clip_end = 0;
 };
@@ -2,6 +2,7 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 
 #include <fcntl.h>
@@ -11,57 +12,136 @@
 
 extern "C" {
 #include <libavutil/imgutils.h>
+#include <libavutil/hwcontext.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 }
 
+#include <libyuv.h>
+
 #include "common/swaglog.h"
 #include "common/util.h"
 
 #include "raw_logger.h"
+#include "segment_catalog.h"
+
+// frames waiting for or in the encoder, more are dropped
+#define RAW_FRAME_POOL_SIZE 8
 
 RawLogger::RawLogger(const char* filename, int width, int height, int fps,
                      int bitrate, bool h265, bool downscale)
   : filename(filename),
-    fps(fps) {
+    width(width),
+    height(height),
+    fps(fps),
+    bitrate(bitrate) {
 
   int err = 0;
 
   av_register_all();
-  codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
-  // codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
+
+  const char *codec_name = getenv("LOGGERD_RAW_CODEC");
+  if (codec_name) {
+    codec = avcodec_find_encoder_by_name(codec_name);
+    if (codec == NULL) {
+      LOGE("encoder %s not found, using ffvhuff", codec_name);
+    }
+  }
+
+  // vaapi encodes from surfaces on the device, the frames are uploaded to them
+  if (codec && strstr(codec->name, "_vaapi")) {
+    err = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI, getenv("LOGGERD_VAAPI_DEVICE"), NULL, 0);
+    if (err < 0) {
+      LOGE("failed to open vaapi device for %s, using ffvhuff", codec->name);
+      codec = NULL;
+    } else {
+      hw_frame = av_frame_alloc();
+      assert(hw_frame);
+    }
+  }
+
+  if (codec == NULL) {
+    codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
+    // codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
+  }
   assert(codec);
 
+  sw_format = hw_device_ctx ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+  for (int i = 0; i < RAW_FRAME_POOL_SIZE; i++) {
+    AVFrame *frame = av_frame_alloc();
+    assert(frame);
+    frame->format = sw_format;
+    frame->width = width;
+    frame->height = height;
+    err = av_frame_get_buffer(frame, 32);
+    assert(err >= 0);
+    free_frames.push_back(frame);
+  }
+
+  encoder = std::thread(&RawLogger::encode_thread, this);
+}
+
+RawLogger::~RawLogger() {
+  {
+    std::unique_lock<std::mutex> lk(queue_lock);
+    exit = true;
+  }
+  queue_cv.notify_all();
+  encoder.join();
+
+  for (auto &frame : free_frames) {
+    av_frame_free(&frame);
+  }
+  av_frame_free(&hw_frame);
+  av_buffer_unref(&hw_device_ctx);
+}
+
+// Every segment gets a new codec context, so it starts on a key frame and
+// the frames still in the encoder at close are flushed into their own file
+void RawLogger::open_codec() {
+  int err = 0;
+
   codec_ctx = avcodec_alloc_context3(codec);
   assert(codec_ctx);
   codec_ctx->width = width;
   codec_ctx->height = height;
-  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-
-  // codec_ctx->thread_count = 2;
+  codec_ctx->pix_fmt = hw_device_ctx ? AV_PIX_FMT_VAAPI : AV_PIX_FMT_YUV420P;
 
   // ffv1enc doesn't respect AV_PICTURE_TYPE_I. make every frame a key frame for now.
   // codec_ctx->gop_size = 0;
 
   codec_ctx->time_base = (AVRational){ 1, fps };
 
-  err = avcodec_open2(codec_ctx, codec, NULL);
-  assert(err >= 0);
+  if (codec->id != AV_CODEC_ID_FFVHUFF) {
+    codec_ctx->bit_rate = bitrate;
+    codec_ctx->gop_size = fps;
+    codec_ctx->max_b_frames = 0;
+  }
 
-  frame = av_frame_alloc();
-  assert(frame);
-  frame->format = codec_ctx->pix_fmt;
-  frame->width = width;
-  frame->height = height;
-  frame->linesize[0] = width;
-  frame->linesize[1] = width/2;
-  frame->linesize[2] = width/2;
-}
+  const char *threads = getenv("LOGGERD_RAW_THREADS");
+  codec_ctx->thread_count = threads ? atoi(threads) : 0;
+  codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
-RawLogger::~RawLogger() {
-  av_frame_free(&frame);
-  avcodec_close(codec_ctx);
-  av_free(codec_ctx);
+  if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if (hw_device_ctx) {
+    AVBufferRef *frames_ref = av_hwframe_ctx_alloc(hw_device_ctx);
+    assert(frames_ref);
+    AVHWFramesContext *frames_ctx = (AVHWFramesContext *)frames_ref->data;
+    frames_ctx->format = AV_PIX_FMT_VAAPI;
+    frames_ctx->sw_format = sw_format;
+    frames_ctx->width = width;
+    frames_ctx->height = height;
+    frames_ctx->initial_pool_size = RAW_FRAME_POOL_SIZE + 4;
+    err = av_hwframe_ctx_init(frames_ref);
+    assert(err >= 0);
+    codec_ctx->hw_frames_ctx = frames_ref;
+  }
+
+  err = avcodec_open2(codec_ctx, codec, NULL);
+  assert(err >= 0);
 }
 
 void RawLogger::encoder_open(const char* path, int segment) {
@@ -85,12 +165,12 @@ void RawLogger::encoder_open(const char* path, int segment) {
   avformat_alloc_output_context2(&format_ctx, NULL, NULL, vid_path.c_str());
   assert(format_ctx);
 
-  stream = avformat_new_stream(format_ctx, codec);
-  // AVStream *stream = avformat_new_stream(format_ctx, NULL);
+  open_codec();
+
+  stream = avformat_new_stream(format_ctx, NULL);
   assert(stream);
   stream->id = 0;
   stream->time_base = (AVRational){ 1, fps };
-  // codec_ctx->time_base = stream->time_base;
 
   err = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
   assert(err >= 0);
@@ -112,10 +192,13 @@ void RawLogger::encoder_close() {
 
   if (!is_open) return;
 
+  drain();
+  encode(NULL);
+
   err = av_write_trailer(format_ctx);
   assert(err == 0);
 
-  avcodec_close(stream->codec);
+  avcodec_free_context(&codec_ctx);
 
   err = avio_closep(&format_ctx->pb);
   assert(err == 0);
@@ -123,44 +206,122 @@ void RawLogger::encoder_close() {
   avformat_free_context(format_ctx);
   format_ctx = NULL;
 
+  // far too big to read back for a checksum
+  segment_catalog_add_file(vid_path.c_str(), false);
   unlink(lock_path.c_str());
   is_open = false;
 }
 
-int RawLogger::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
-                            int in_width, int in_height,
-                            int *frame_segment, VisionIpcBufExtra *extra) {
+void RawLogger::encode_thread() {
+  set_thread_name("raw_encoder");
+
+  std::unique_lock<std::mutex> lk(queue_lock);
+  while (true) {
+    queue_cv.wait(lk, [&] { return exit || !queue.empty(); });
+    if (queue.empty()) break;
+
+    AVFrame *frame = queue.front();
+    queue.pop_front();
+    encoding = true;
+    lk.unlock();
+
+    encode(frame);
+
+    lk.lock();
+    encoding = false;
+    free_frames.push_back(frame);
+    queue_cv.notify_all();
+  }
+}
+
+void RawLogger::drain() {
+  std::unique_lock<std::mutex> lk(queue_lock);
+  queue_cv.wait(lk, [&] { return queue.empty() && !encoding; });
+}
+
+void RawLogger::encode(AVFrame *frame) {
   int err = 0;
 
+  AVFrame *in = frame;
+  if (frame && hw_device_ctx) {
+    err = av_hwframe_get_buffer(codec_ctx->hw_frames_ctx, hw_frame, 0);
+    if (err >= 0) err = av_hwframe_transfer_data(hw_frame, frame, 0);
+    if (err < 0) {
+      LOGE("failed to upload frame to the encoder\n");
+      av_frame_unref(hw_frame);
+      return;
+    }
+    hw_frame->pts = frame->pts;
+    in = hw_frame;
+  }
+
+  err = avcodec_send_frame(codec_ctx, in);
+  if (hw_device_ctx) av_frame_unref(hw_frame);
+  if (err < 0) {
+    LOGE("encoding error\n");
+    return;
+  }
+
   AVPacket pkt;
   av_init_packet(&pkt);
   pkt.data = NULL;
   pkt.size = 0;
-
-  frame->data[0] = (uint8_t*)y_ptr;
-  frame->data[1] = (uint8_t*)u_ptr;
-  frame->data[2] = (uint8_t*)v_ptr;
-  frame->pts = extra->timestamp_eof;
-
-  int ret = counter;
-
-  int got_output = 0;
-  err = avcodec_encode_video2(codec_ctx, &pkt, frame, &got_output);
-  if (err) {
-    LOGE("encoding error\n");
-    ret = -1;
-  } else if (got_output) {
+  while (avcodec_receive_packet(codec_ctx, &pkt) == 0) {
     av_packet_rescale_ts(&pkt, codec_ctx->time_base, stream->time_base);
     pkt.stream_index = 0;
 
     err = av_interleaved_write_frame(format_ctx, &pkt);
     if (err < 0) {
       LOGE("encoder writer error\n");
-      ret = -1;
-    } else {
-      counter++;
     }
+    av_packet_unref(&pkt);
+  }
+}
+
+int RawLogger::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                            int in_width, int in_height,
+                            int *frame_segment, VisionIpcBufExtra *extra) {
+  int err = 0;
+
+  std::lock_guard<std::recursive_mutex> guard(lock);
+
+  if (!is_open) return -1;
+
+  AVFrame *frame = NULL;
+  {
+    std::unique_lock<std::mutex> lk(queue_lock);
+    if (!free_frames.empty()) {
+      frame = free_frames.back();
+      free_frames.pop_back();
+    }
+  }
+  if (frame == NULL) {
+    LOGW("%s encoder is behind, dropping frame %u", filename, extra->frame_id);
+    return -1;
+  }
+
+  // the encoder may still hold a reference from frame threading
+  err = av_frame_make_writable(frame);
+  assert(err >= 0);
+
+  if (sw_format == AV_PIX_FMT_NV12) {
+    err = libyuv::I420ToNV12(y_ptr, width, u_ptr, width/2, v_ptr, width/2,
+                             frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1],
+                             width, height);
+    assert(err == 0);
+  } else {
+    av_image_copy_plane(frame->data[0], frame->linesize[0], y_ptr, width, width, height);
+    av_image_copy_plane(frame->data[1], frame->linesize[1], u_ptr, width/2, width/2, height/2);
+    av_image_copy_plane(frame->data[2], frame->linesize[2], v_ptr, width/2, width/2, height/2);
+  }
+  frame->pts = extra->timestamp_eof;
+
+  int ret = counter++;
+  {
+    std::unique_lock<std::mutex> lk(queue_lock);
+    queue.push_back(frame);
   }
+  queue_cv.notify_all();
 
   return ret;
 }
@@ -6,6 +6,8 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <thread>
 #include <mutex>
 #include <condition_variable>
 
@@ -17,6 +19,10 @@ extern "C" {
 
 #include "encoder.h"
 
+// Encodes with FFmpeg on its own thread, from a bounded pool of frames copied out of the VisionBuf.
+// LOGGERD_RAW_CODEC picks the encoder: ffvhuff (default), or a hardware one like
+// h264_nvenc, hevc_nvenc, h264_vaapi or hevc_vaapi (LOGGERD_VAAPI_DEVICE, default is the first render node).
+// LOGGERD_RAW_THREADS sets FFmpeg's thread count, 0 (default) lets it decide
 class RawLogger : public VideoEncoder {
 public:
   RawLogger(const char* filename, int width, int height, int fps,
@@ -29,8 +35,15 @@ public:
   void encoder_close();
 
 private:
+  void open_codec();
+  void encode_thread();
+  // sends a frame, or NULL to flush, and writes out the packets that are ready
+  void encode(AVFrame *frame);
+  // waits for the queued frames to be encoded
+  void drain();
+
   const char* filename;
-  int fps;
+  int width, height, fps, bitrate;
   int counter = 0;
   int segment = -1;
   bool is_open = false;
@@ -41,11 +54,20 @@ private:
 
   AVCodec *codec = NULL;
   AVCodecContext *codec_ctx = NULL;
+  AVBufferRef *hw_device_ctx = NULL;
+  AVFrame *hw_frame = NULL;
+  AVPixelFormat sw_format;
 
   AVStream *stream = NULL;
   AVFormatContext *format_ctx = NULL;
 
-  AVFrame *frame = NULL;
+  std::thread encoder;
+  std::mutex queue_lock;
+  std::condition_variable queue_cv;
+  std::deque<AVFrame *> queue;
+  std::vector<AVFrame *> free_frames;
+  bool encoding = false;
+  bool exit = false;
 };
 
 #endif
@@ -0,0 +1,81 @@
+// the SHA256_ functions are deprecated in OpenSSL 3, but they are what boringssl has
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/swaglog.h"
+#include "common/util.h"
+
+#include "segment_catalog.h"
+
+#define SEGMENT_CATALOG_NAME ".catalog"
+
+std::string sha256_final(SHA256_CTX *ctx) {
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256_Final(hash, ctx);
+  return util::tohex(hash, sizeof(hash));
+}
+
+void segment_catalog_add(const char *path, uint64_t size, const std::string &sha256) {
+  const std::string p = path;
+  const size_t name_slash = p.rfind('/');
+  const size_t segment_slash = name_slash == std::string::npos || name_slash == 0 ? std::string::npos : p.rfind('/', name_slash - 1);
+  if (segment_slash == std::string::npos) {
+    LOGE("%s isn't in a segment, it's not in the catalog", path);
+    return;
+  }
+  const std::string catalog_path = p.substr(0, segment_slash + 1) + SEGMENT_CATALOG_NAME;
+
+  char line[4096];
+  const std::string hash = sha256.empty() ? "null" : "\"" + sha256 + "\"";
+  int len = snprintf(line, sizeof(line), "{\"file\": \"%s\", \"size\": %llu, \"sha256\": %s}\n",
+                     path + segment_slash + 1, (unsigned long long)size, hash.c_str());
+  if (len < 0 || len >= (int)sizeof(line)) return;
+
+  // the deleter rewrites it under its exclusive lock, a line in the old one would be lost
+  for (int tries = 0; tries < 3; tries++) {
+    int fd = open(catalog_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) break;
+    struct stat fd_st, path_st;
+    bool current = flock(fd, LOCK_SH) == 0 && fstat(fd, &fd_st) == 0 &&
+                   stat(catalog_path.c_str(), &path_st) == 0 && fd_st.st_ino == path_st.st_ino;
+    bool written = current && write(fd, line, len) == len;
+    close(fd);
+    if (written) return;
+    if (current) break;
+  }
+  LOGE("can't add %s to the catalog: %s", path, strerror(errno));
+}
+
+void segment_catalog_add_file(const char *path, bool checksum) {
+  if (!checksum) {
+    struct stat st;
+    if (stat(path, &st) == 0) segment_catalog_add(path, st.st_size, "");
+    return;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOGE("can't read %s for the catalog", path);
+    return;
+  }
+  uint64_t size = 0;
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  unsigned char buf[64 * 1024];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    SHA256_Update(&ctx, buf, n);
+    size += n;
+  }
+  close(fd);
+  if (n == 0) segment_catalog_add(path, size, sha256_final(&ctx));
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <openssl/sha.h>
+
+// A line of JSON is appended to <log root>/.catalog for each segment file as it's finished:
+//
+//   {"file": "<segment>/<name>", "size": <bytes>, "sha256": <hex of the contents, or null>}
+//
+// so the uploader and the deleter can follow the segments without walking them. They append the
+// "uploaded" and "deleted" lines, selfdrive/loggerd/catalog.py reads it, keep them in sync. The hash
+// is taken as the file's written, so nothing reads a segment back before it's uploaded.
+// Appends hold a shared flock, the deleter's rewrite an exclusive one
+
+// path is <log root>/<segment>/<name>, sha256 is empty when it isn't known
+void segment_catalog_add(const char *path, uint64_t size, const std::string &sha256);
+// for a file that wasn't written through a SegmentFile, read back for the hash when it's small
+// enough to still be in the page cache
+void segment_catalog_add_file(const char *path, bool checksum);
+
+// the hex digest, for segment_catalog_add
+std::string sha256_final(SHA256_CTX *ctx);
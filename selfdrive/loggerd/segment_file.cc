@@ -0,0 +1,106 @@
+// the SHA256_ functions are deprecated in OpenSSL 3, but they are what boringssl has
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common/swaglog.h"
+
+#include "segment_catalog.h"
+#include "segment_file.h"
+
+// writes are this size, and aligned to it in the file
+const size_t SEGMENT_FILE_BLOCK_SIZE = 256 * 1024;
+const size_t SEGMENT_FILE_ALIGN = 4096;
+
+SegmentFile *SegmentFile::open(const char *path, uint64_t preallocate, WritePriority priority) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  bool direct = false;
+#ifdef O_DIRECT
+  const char *direct_io = getenv("LOGGERD_DIRECT_IO");
+  direct = direct_io && atoi(direct_io);
+#endif
+
+  int fd = -1;
+#ifdef O_DIRECT
+  if (direct) {
+    fd = ::open(path, flags | O_DIRECT, 0666);
+    if (fd < 0) {
+      // not every filesystem supports it
+      LOGW("O_DIRECT open failed for %s: %s", path, strerror(errno));
+      direct = false;
+    }
+  }
+#endif
+  if (fd < 0) fd = ::open(path, flags, 0666);
+  if (fd < 0) return NULL;
+
+#ifdef __linux__
+  if (preallocate > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, preallocate) != 0) {
+    LOGD("fallocate failed for %s: %s", path, strerror(errno));
+  }
+#endif
+  return new SegmentFile(path, fd, direct, priority);
+}
+
+SegmentFile::SegmentFile(const char *path, int fd, bool direct, WritePriority priority)
+    : path(path), fd(fd), direct(direct), priority(priority) {
+  SHA256_Init(&sha256);
+  if (posix_memalign((void **)&buf, SEGMENT_FILE_ALIGN, SEGMENT_FILE_BLOCK_SIZE) != 0) {
+    buf = NULL;
+  }
+}
+
+SegmentFile::~SegmentFile() {
+  if (fd >= 0) close();
+  free(buf);
+}
+
+bool SegmentFile::flush(size_t len) {
+  return WriteScheduler::instance().write(fd, buf, len, priority);
+}
+
+bool SegmentFile::write(const void *data, size_t size) {
+  if (buf == NULL) return false;
+
+  bool ok = true;
+  const uint8_t *p = (const uint8_t *)data;
+  SHA256_Update(&sha256, p, size);
+  while (size > 0) {
+    size_t n = std::min(size, SEGMENT_FILE_BLOCK_SIZE - buf_len);
+    memcpy(buf + buf_len, p, n);
+    buf_len += n;
+    p += n;
+    size -= n;
+    if (buf_len == SEGMENT_FILE_BLOCK_SIZE) {
+      ok = flush(buf_len) && ok;
+      offset += buf_len;
+      buf_len = 0;
+    }
+  }
+  return ok;
+}
+
+bool SegmentFile::close() {
+  bool ok = buf != NULL;
+  if (ok && buf_len > 0) {
+    // O_DIRECT only takes whole blocks, the padding is cut off below
+    size_t len = direct ? (buf_len + SEGMENT_FILE_ALIGN - 1) / SEGMENT_FILE_ALIGN * SEGMENT_FILE_ALIGN : buf_len;
+    memset(buf + buf_len, 0, len - buf_len);
+    ok = flush(len);
+  }
+  offset += buf_len;
+  buf_len = 0;
+
+  // drops the padding and the preallocated space past the end
+  ok = ftruncate(fd, offset) == 0 && ok;
+  ok = ::close(fd) == 0 && ok;
+  fd = -1;
+  if (ok) segment_catalog_add(path.c_str(), offset, sha256_final(&sha256));
+  return ok;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include <openssl/sha.h>
+
+#include "write_scheduler.h"
+
+constexpr int SEGMENT_LENGTH = 60;
+
+// A segment output written in whole blocks from a page-aligned buffer. Space for the expected
+// size is reserved up front with fallocate so the file isn't fragmented as it grows, and what
+// wasn't used is released again on close. LOGGERD_DIRECT_IO=1 opens with O_DIRECT to keep
+// segment data out of the page cache. The blocks are written through the WriteScheduler, and
+// once it's closed the file goes in the segment catalog with its hash, taken as it's written.
+// Not thread safe
+class SegmentFile {
+public:
+  // NULL if the file can't be created. preallocate is the expected size in bytes, or 0
+  static SegmentFile *open(const char *path, uint64_t preallocate, WritePriority priority);
+  ~SegmentFile();
+
+  bool write(const void *data, size_t size);
+  // bytes written so far
+  uint64_t tell() const { return offset + buf_len; }
+  // Writes out the buffer and truncates the file to what was written
+  bool close();
+
+private:
+  SegmentFile(const char *path, int fd, bool direct, WritePriority priority);
+  bool flush(size_t len);
+
+  const std::string path;
+  int fd;
+  const bool direct;
+  const WritePriority priority;
+  uint8_t *buf;
+  size_t buf_len = 0;
+  uint64_t offset = 0;
+  SHA256_CTX sha256;
+};
@@ -0,0 +1,274 @@
+// Streams a camera live over TCP, encoded by the hardware encoder for latency instead of size
+//   streamerd [-p port] [-c back|front|wide] [-b bitrate] [-a]
+// camerad's half resolution stream is encoded, always its newest frame and only while there's a client,
+// as hevc or with -a h264. A client gets the codec config and then every packet from an IDR on, each as
+// a StreamHeader followed by its len bytes. One that falls STREAM_MAX_PENDING behind skips to the next
+// IDR. Every STREAM_STATS_S it logs the glass to network latency, from the frame's start of exposure to
+// its last byte going to the kernel, and the encode's share of it
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "omx_encoder.h"
+#include "visionipc_client.h"
+
+#define STREAM_DEFAULT_PORT 8100
+#define STREAM_DEFAULT_BITRATE 2000000
+#define STREAM_FPS 20
+#define STREAM_MAX_PENDING (512*1024)
+#define STREAM_STATS_S 5
+
+#define STREAM_FLAG_KEYFRAME 1
+#define STREAM_FLAG_CONFIG 2
+
+struct __attribute__((packed)) StreamHeader {
+  uint32_t len;
+  uint32_t flags;
+  // of the frame, on the device's boot clock. 0 for the codec config
+  uint64_t timestamp_eof_us;
+};
+
+ExitHandler do_exit;
+
+namespace {
+
+struct Client {
+  int fd;
+  // from an IDR on, anything before doesn't decode
+  bool synced = false;
+  std::vector<uint8_t> pending;
+  size_t sent = 0;
+  // the start of exposure of the frames in pending, by the offset their last packet ends at
+  std::deque<std::pair<size_t, uint64_t>> frame_ends;
+};
+
+class Streamer {
+public:
+  bool listen(int port) {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) return false;
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, 4) != 0) {
+      close(listen_fd);
+      return false;
+    }
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    return true;
+  }
+
+  // true if one joined
+  bool accept_clients() {
+    bool joined = false;
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+      // a frame is a few packets, none of them should wait for the next
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      clients.push_back({.fd = fd});
+      LOGW("stream client %d joined, %zu clients", fd, clients.size());
+      joined = true;
+    }
+    return joined;
+  }
+
+  size_t num_clients() const { return clients.size(); }
+
+  // the frame the next packets are for
+  void set_frame(uint64_t timestamp_sof) { frame_sof = timestamp_sof; }
+
+  void send_packet(const uint8_t *data, size_t len, uint32_t omx_flags, int64_t timestamp) {
+    if (omx_flags & OMX_BUFFERFLAG_CODECCONFIG) {
+      codec_config.assign(data, data + len);
+      return;
+    }
+    const bool keyframe = omx_flags & OMX_BUFFERFLAG_SYNCFRAME;
+    for (Client &c : clients) {
+      if (c.pending.size() - c.sent > STREAM_MAX_PENDING) {
+        // what's there is finished, so the client can keep its framing, and it starts over at an IDR
+        c.synced = false;
+        dropped++;
+        continue;
+      }
+      if (!c.synced) {
+        if (!keyframe || codec_config.empty()) continue;
+        append(c, codec_config.data(), codec_config.size(), STREAM_FLAG_CONFIG, 0);
+        c.synced = true;
+      }
+      append(c, data, len, keyframe ? STREAM_FLAG_KEYFRAME : 0, timestamp);
+      if (!c.frame_ends.empty() && c.frame_ends.back().second == frame_sof) {
+        c.frame_ends.back().first = c.pending.size();
+      } else {
+        c.frame_ends.push_back({c.pending.size(), frame_sof});
+      }
+    }
+  }
+
+  void flush() {
+    for (auto it = clients.begin(); it != clients.end();) {
+      if (flush(*it)) {
+        ++it;
+      } else {
+        LOGW("stream client %d left, %zu clients", it->fd, clients.size() - 1);
+        close(it->fd);
+        it = clients.erase(it);
+      }
+    }
+  }
+
+  std::vector<double> network_ms;
+  uint64_t dropped = 0;
+
+private:
+  int listen_fd = -1;
+  std::vector<Client> clients;
+  std::vector<uint8_t> codec_config;
+  uint64_t frame_sof = 0;
+
+  void append(Client &c, const uint8_t *data, size_t len, uint32_t flags, int64_t timestamp) {
+    const StreamHeader header = {.len = (uint32_t)len, .flags = flags, .timestamp_eof_us = (uint64_t)timestamp};
+    c.pending.insert(c.pending.end(), (const uint8_t *)&header, (const uint8_t *)&header + sizeof(header));
+    c.pending.insert(c.pending.end(), data, data + len);
+  }
+
+  // false once the client's gone
+  bool flush(Client &c) {
+    while (c.sent < c.pending.size()) {
+      ssize_t ret = send(c.fd, c.pending.data() + c.sent, c.pending.size() - c.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return false;
+      }
+      c.sent += ret;
+    }
+
+    const uint64_t now = nanos_since_boot();
+    while (!c.frame_ends.empty() && c.frame_ends.front().first <= c.sent) {
+      network_ms.push_back((now - c.frame_ends.front().second) / 1e6);
+      c.frame_ends.pop_front();
+    }
+    if (c.sent == c.pending.size()) {
+      c.pending.clear();
+      c.sent = 0;
+    }
+    return true;
+  }
+};
+
+double percentile(std::vector<double> &v, double p) {
+  if (v.empty()) return 0;
+  auto it = v.begin() + std::min(v.size() - 1, (size_t)(p * v.size()));
+  std::nth_element(v.begin(), it, v.end());
+  return *it;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int port = STREAM_DEFAULT_PORT, bitrate = STREAM_DEFAULT_BITRATE;
+  bool h265 = true;
+  VisionStreamType stream_type = VISION_STREAM_YUV_BACK_HALF;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:c:b:a")) != -1) {
+    if (opt == 'p') {
+      port = atoi(optarg);
+    } else if (opt == 'b') {
+      bitrate = atoi(optarg);
+    } else if (opt == 'a') {
+      h265 = false;
+    } else if (opt == 'c' && strcmp(optarg, "back") == 0) {
+      stream_type = VISION_STREAM_YUV_BACK_HALF;
+    } else if (opt == 'c' && strcmp(optarg, "front") == 0) {
+      stream_type = VISION_STREAM_YUV_FRONT_HALF;
+    } else if (opt == 'c' && strcmp(optarg, "wide") == 0) {
+      stream_type = VISION_STREAM_YUV_WIDE_HALF;
+    } else {
+      fprintf(stderr, "usage: %s [-p port] [-c back|front|wide] [-b bitrate] [-a]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  set_sched_profile("streamerd");
+
+  Streamer streamer;
+  if (!streamer.listen(port)) {
+    LOGE("streamerd can't listen on %d: %s", port, strerror(errno));
+    return 1;
+  }
+
+  OmxEncoder *encoder = NULL;
+  VisionIpcClient vipc_client = VisionIpcClient("camerad", stream_type, true);
+  std::vector<double> encode_ms;
+  uint64_t frames = 0;
+  double last_stats = millis_since_boot();
+  while (!do_exit) {
+    if (!vipc_client.connect(false)) {
+      util::sleep_for(100);
+      continue;
+    }
+
+    if (encoder == NULL) {
+      // the encoder takes macroblock sized frames, the half stream is scaled down to them
+      const int width = vipc_client.buffers[0].width / 16 * 16, height = vipc_client.buffers[0].height / 16 * 16;
+      LOGW("streamerd encoding %dx%d at %d bps on %d", width, height, bitrate, port);
+      encoder = new OmxEncoder("stream", width, height, STREAM_FPS, bitrate, h265, true,
+                               nullptr, 0, nullptr, [&](const uint8_t *data, size_t len, uint32_t flags, int64_t ts) {
+                                 streamer.send_packet(data, len, flags, ts);
+                               });
+      encoder->encoder_open("", 0);
+    }
+
+    while (!do_exit) {
+      if (streamer.accept_clients()) encoder->request_keyframe();
+      streamer.flush();
+
+      VisionIpcBufExtra extra;
+      VisionBuf *buf = vipc_client.recv_latest(&extra, 1000 / STREAM_FPS);
+      if (buf == nullptr) continue;
+      if (streamer.num_clients() == 0) continue;
+
+      streamer.set_frame(extra.timestamp_sof);
+      encoder->encode_frame(buf->y, buf->u, buf->v, buf->width, buf->height, nullptr, &extra);
+      encode_ms.push_back((nanos_since_boot() - extra.timestamp_sof) / 1e6);
+      frames++;
+      streamer.flush();
+
+      const double now = millis_since_boot();
+      if (now - last_stats > STREAM_STATS_S * 1000.) {
+        LOGW("streamerd %llu frames to %zu clients, glass to network %.1f ms p50 %.1f ms p99, encoded by %.1f ms p50, dropped %llu",
+             (unsigned long long)frames, streamer.num_clients(), percentile(streamer.network_ms, 0.5),
+             percentile(streamer.network_ms, 0.99), percentile(encode_ms, 0.5), (unsigned long long)streamer.dropped);
+        streamer.network_ms.clear();
+        encode_ms.clear();
+        last_stats = now;
+      }
+    }
+  }
+
+  if (encoder != NULL) {
+    encoder->encoder_close();
+    delete encoder;
+  }
+  return 0;
+}
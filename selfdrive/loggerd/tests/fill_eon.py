@@ -16,7 +16,7 @@ if __name__ == "__main__":
     print(seg_path)
 
     create_random_file(os.path.join(seg_path, 'fcamera.hevc'), 36)
-    create_random_file(os.path.join(seg_path, 'rlog.bz2'), 2)
+    create_random_file(os.path.join(seg_path, 'rlog.zst'), 2)
 
     segment_idx += 1
 
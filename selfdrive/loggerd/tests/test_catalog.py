@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+import json
+import os
+import shutil
+import tempfile
+import unittest
+
+import selfdrive.loggerd.catalog as catalog
+from selfdrive.loggerd.catalog import SegmentCatalog
+
+
+class TestCatalog(unittest.TestCase):
+  def setUp(self):
+    self.root = tempfile.mkdtemp()
+    self.path = os.path.join(self.root, catalog.CATALOG_NAME)
+    self.compact_min_lines = catalog.COMPACT_MIN_LINES
+
+  def tearDown(self):
+    catalog.COMPACT_MIN_LINES = self.compact_min_lines
+    shutil.rmtree(self.root)
+
+  def add_file(self, key, size=1, sha256="00"):
+    # like loggerd's segment_catalog_add
+    with open(self.path, 'a') as f:
+      f.write(json.dumps({'file': key, 'size': size, 'sha256': sha256}) + "\n")
+
+  def test_files(self):
+    c = SegmentCatalog(self.root)
+    c.update()
+    self.assertIsNone(c.files("seg--0"))
+
+    self.add_file("seg--0/rlog.zst", 10, "ab12")
+    self.add_file("seg--0/fcamera.hevc", 20, None)
+    c.update()
+    self.assertEqual(c.files("seg--0"), {
+      'rlog.zst': {'size': 10, 'sha256': "ab12", 'uploaded': False},
+      'fcamera.hevc': {'size': 20, 'sha256': None, 'uploaded': False},
+    })
+
+  def test_incremental(self):
+    c = SegmentCatalog(self.root)
+    self.add_file("seg--0/rlog.zst")
+    c.update()
+    offset = c.offset
+
+    # a line still being written is left for the next update
+    with open(self.path, 'a') as f:
+      f.write('{"file": "seg--1/rlog.zst", "si')
+    c.update()
+    self.assertEqual(c.offset, offset)
+    self.assertIsNone(c.files("seg--1"))
+    with open(self.path, 'a') as f:
+      f.write('ze": 1, "sha256": "00"}\n')
+    c.update()
+    self.assertIn('rlog.zst', c.files("seg--1"))
+
+  def test_upload_state(self):
+    c = SegmentCatalog(self.root)
+    self.add_file("seg--0/rlog.zst")
+    self.add_file("seg--0/qlog.zst")
+    c.mark_uploaded("seg--0/rlog.zst")
+    c.mark_removed("seg--0/qlog.zst")
+    c.update()
+    self.assertEqual(list(c.files("seg--0")), ['rlog.zst'])
+    self.assertTrue(c.files("seg--0")['rlog.zst']['uploaded'])
+
+    c.mark_unuploaded("seg--0/rlog.zst")
+    c.update()
+    self.assertFalse(c.files("seg--0")['rlog.zst']['uploaded'])
+
+  def test_compact(self):
+    catalog.COMPACT_MIN_LINES = 10
+    c = SegmentCatalog(self.root)
+    for i in range(20):
+      self.add_file(f"seg--{i}/rlog.zst", i, "%02x" % i)
+      c.mark_uploaded(f"seg--{i}/rlog.zst")
+    for i in range(18):
+      c.mark_deleted(f"seg--{i}")
+    self.assertTrue(c.maybe_compact())
+
+    with open(self.path) as f:
+      self.assertEqual(len(f.readlines()), 4)
+    c.update()
+    self.assertEqual(sorted(c.segments), ["seg--18", "seg--19"])
+    self.assertEqual(c.files("seg--19")['rlog.zst'], {'size': 19, 'sha256': "13", 'uploaded': True})
+
+    # and a reader that was following the old one starts over
+    self.add_file("seg--20/rlog.zst")
+    c2 = SegmentCatalog(self.root)
+    c2.update()
+    self.assertEqual(sorted(c2.segments), ["seg--18", "seg--19", "seg--20"])
+    self.assertFalse(c.maybe_compact())
+
+
+if __name__ == "__main__":
+  unittest.main()
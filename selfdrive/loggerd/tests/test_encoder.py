@@ -105,6 +105,10 @@ class TestEncoder(unittest.TestCase):
 
         self.assertTrue(abs(expected_frames - frame_count) <= frame_tolerance,
                         f"{camera} failed frame count check: expected {expected_frames}, got {frame_count}")
+
+        # a VideoIndexHeader and an entry per frame
+        index_frames = (os.path.getsize(file_path + ".idx") - 8) // 24
+        self.assertEqual(index_frames, frame_count, f"{camera} index has {index_frames} of {frame_count} frames")
       shutil.rmtree(f"{route_prefix_path}--{i}")
 
     def join(ts, timeout):
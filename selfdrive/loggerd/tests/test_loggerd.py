@@ -51,7 +51,7 @@ class TestLoggerd(unittest.TestCase):
 
     # check existence
     d = self._get_log_dir(out)
-    path = Path(os.path.join(d, "bootlog.bz2"))
+    path = Path(os.path.join(d, "bootlog.zst"))
     assert path.is_file(), "failed to create bootlog file"
     return path
 
@@ -101,7 +101,7 @@ class TestLoggerd(unittest.TestCase):
   def test_rotation(self):
     os.environ["LOGGERD_TEST"] = "1"
     Params().put("RecordFront", "1")
-    expected_files = {"rlog.bz2", "qlog.bz2", "qcamera.ts", "fcamera.hevc", "dcamera.hevc"}
+    expected_files = {"rlog.zst", "qlog.zst", "qcamera.ts", "fcamera.hevc", "dcamera.hevc"}
     if TICI:
       expected_files.add("ecamera.hevc")
 
@@ -181,7 +181,7 @@ class TestLoggerd(unittest.TestCase):
     time.sleep(1)
     manager.kill_managed_process("loggerd")
 
-    qlog_path = os.path.join(self._get_latest_log_dir(), "qlog.bz2")
+    qlog_path = os.path.join(self._get_latest_log_dir(), "qlog.zst")
     lr = list(LogReader(qlog_path))
 
     # check initData and sentinel
@@ -204,6 +204,16 @@ class TestLoggerd(unittest.TestCase):
         self.assertEqual(recv_cnt, expected_cnt, f"expected {expected_cnt} msgs for {s}, got {recv_cnt}")
 
   def test_rlog(self):
+    self._check_rlog()
+
+  def test_rlog_packed(self):
+    os.environ["LOG_PACKED"] = "1"
+    try:
+      self._check_rlog()
+    finally:
+      del os.environ["LOG_PACKED"]
+
+  def _check_rlog(self):
     services = random.sample(CEREAL_SERVICES, random.randint(5, 10))
     pm = messaging.PubMaster(services)
 
@@ -226,12 +236,19 @@ class TestLoggerd(unittest.TestCase):
     time.sleep(1)
     manager.kill_managed_process("loggerd")
 
-    lr = list(LogReader(os.path.join(self._get_latest_log_dir(), "rlog.bz2")))
+    rlog_path = os.path.join(self._get_latest_log_dir(), "rlog.zst")
+    lr = list(LogReader(rlog_path))
 
     # check initData and sentinel
     self._check_init_data(lr)
     self._check_sentinel(lr, True)
 
+    # reading through the block index gets the same messages
+    service = services[0]
+    filtered = list(LogReader(rlog_path, services=[service]))
+    self.assertEqual([m.as_builder().to_bytes() for m in lr if m.which() == service],
+                     [m.as_builder().to_bytes() for m in filtered])
+
     # check all messages were logged and in order
     lr = lr[2:-1] # slice off initData and both sentinels
     for m in lr:
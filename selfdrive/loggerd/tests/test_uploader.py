@@ -1,11 +1,15 @@
+import os
 import time
 import threading
 import unittest
 import logging
 import json
 
+from cereal import log
+import cereal.messaging as messaging
 from selfdrive.swaglog import cloudlog
 import selfdrive.loggerd.uploader as uploader
+from selfdrive.loggerd.catalog import SegmentCatalog
 
 from common.xattr import getxattr
 
@@ -50,19 +54,19 @@ class TestUploader(UploaderTestCase):
 
   def gen_files(self, lock=False):
     f_paths = list()
-    for t in ["bootlog.bz2", "qlog.bz2", "rlog.bz2", "dcamera.hevc", "fcamera.hevc"]:
+    for t in ["bootlog.zst", "qlog.zst", "rlog.zst", "dcamera.hevc", "fcamera.hevc"]:
       f_paths.append(self.make_file_with_data(self.seg_dir, t, 1, lock=lock))
     return f_paths
 
   def gen_order(self, seg1, seg2):
-    keys = [f"{self.seg_format.format(i)}/qlog.bz2" for i in seg1]
-    keys += [f"{self.seg_format2.format(i)}/qlog.bz2" for i in seg2]
+    keys = [f"{self.seg_format.format(i)}/qlog.zst" for i in seg1]
+    keys += [f"{self.seg_format2.format(i)}/qlog.zst" for i in seg2]
     for i in seg1:
-      keys += [f"{self.seg_format.format(i)}/{f}" for f in ['rlog.bz2', 'fcamera.hevc', 'dcamera.hevc']]
+      keys += [f"{self.seg_format.format(i)}/{f}" for f in ['rlog.zst', 'fcamera.hevc', 'dcamera.hevc']]
     for i in seg2:
-      keys += [f"{self.seg_format2.format(i)}/{f}" for f in ['rlog.bz2', 'fcamera.hevc', 'dcamera.hevc']]
-    keys += [f"{self.seg_format.format(i)}/bootlog.bz2" for i in seg1]
-    keys += [f"{self.seg_format2.format(i)}/bootlog.bz2" for i in seg2]
+      keys += [f"{self.seg_format2.format(i)}/{f}" for f in ['rlog.zst', 'fcamera.hevc', 'dcamera.hevc']]
+    keys += [f"{self.seg_format.format(i)}/bootlog.zst" for i in seg1]
+    keys += [f"{self.seg_format2.format(i)}/bootlog.zst" for i in seg2]
     return keys
 
   def test_upload(self):
@@ -133,6 +137,37 @@ class TestUploader(UploaderTestCase):
     for f_path in f_paths:
       self.assertFalse(getxattr(f_path, uploader.UPLOAD_ATTR_NAME), "File upload when locked")
 
+  def test_upload_from_catalog(self):
+    f_paths = self.gen_files(lock=False)
+    c = SegmentCatalog(self.root)
+    for f_path in f_paths[1:]:
+      c.append({'file': os.path.relpath(f_path, self.root), 'size': os.path.getsize(f_path), 'sha256': None})
+    # loggerd didn't write it, so it's not looked for
+    self.make_file_with_data(self.seg_dir, "unknown", 1)
+
+    self.start_thread()
+    time.sleep(5)
+    self.join_thread()
+
+    exp_order = [k for k in self.gen_order([self.seg_num], []) if not k.endswith("bootlog.zst")]
+    self.assertEqual(log_handler.upload_order, exp_order, "Files uploaded in wrong order")
+    c.update()
+    self.assertTrue(all(f['uploaded'] for f in c.files(self.seg_dir).values()), "Uploads not in the catalog")
+
+  def test_storage_busy(self):
+    msg = messaging.new_message('loggerdState')
+    state = msg.loggerdState
+    state.writeLatencyBucketsMs = [1, 2, 5, 10, 20, 50, 100]
+    state.init('writeQueues', 2)
+    state.writeQueues[0].priority = log.LoggerdState.Priority.realtime
+    state.writeQueues[0].latencyHistogram = [10, 5, 0, 0, 1, 0, 0, 0]
+    state.writeQueues[1].priority = log.LoggerdState.Priority.bulk
+    state.writeQueues[1].latencyHistogram = [0, 0, 0, 0, 0, 0, 3, 0]
+    self.assertFalse(uploader.storage_busy(state), "Slow log writes shouldn't hold off uploads")
+
+    state.writeQueues[0].latencyHistogram = [10, 5, 0, 0, 1, 0, 1, 0]
+    self.assertTrue(uploader.storage_busy(state), "Slow video writes should hold off uploads")
+
 
 if __name__ == "__main__":
   unittest.main()
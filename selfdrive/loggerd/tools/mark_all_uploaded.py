@@ -1,5 +1,6 @@
 import os
 from common.xattr import setxattr
+from selfdrive.loggerd.catalog import SegmentCatalog
 from selfdrive.loggerd.uploader import UPLOAD_ATTR_NAME, UPLOAD_ATTR_VALUE
 
 from selfdrive.loggerd.config import ROOT
@@ -7,3 +8,10 @@ for folder in os.walk(ROOT):
   for file1 in folder[2]:
     full_path = os.path.join(folder[0], file1)
     setxattr(full_path, UPLOAD_ATTR_NAME, UPLOAD_ATTR_VALUE)
+
+catalog = SegmentCatalog(ROOT)
+catalog.update()
+for segment, names in list(catalog.segments.items()):
+  for name, info in names.items():
+    if not info['uploaded']:
+      catalog.mark_uploaded(os.path.join(segment, name))
@@ -1,8 +1,13 @@
 #!/usr/bin/env python3
+import os
 import sys
 from common.xattr import removexattr
+from selfdrive.loggerd.catalog import SegmentCatalog
+from selfdrive.loggerd.config import ROOT
 from selfdrive.loggerd.uploader import UPLOAD_ATTR_NAME
 
+catalog = SegmentCatalog(ROOT)
 for fn in sys.argv[1:]:
   print("unmarking %s" % fn)
   removexattr(fn, UPLOAD_ATTR_NAME)
+  catalog.mark_unuploaded(os.path.relpath(os.path.abspath(fn), ROOT))
@@ -11,6 +11,7 @@ from cereal import log
 import cereal.messaging as messaging
 from common.api import Api
 from common.params import Params
+from selfdrive.loggerd.catalog import SegmentCatalog
 from selfdrive.loggerd.xattr_cache import getxattr, setxattr
 from selfdrive.loggerd.config import ROOT
 from selfdrive.swaglog import cloudlog
@@ -23,21 +24,35 @@ allow_sleep = bool(os.getenv("UPLOADER_SLEEP", "1"))
 force_wifi = os.getenv("FORCEWIFI") is not None
 fake_upload = os.getenv("FAKEUPLOAD") is not None
 
+# loggerd compresses logs with zstd, lz4 or bz2 depending on LOG_COMPRESSION
+LOG_EXTENSIONS = (".zst", ".lz4", ".bz2")
+
+# hold off while loggerd's video writes are this slow, uploads read from the same storage
+SLOW_WRITE_MS = 50.
+STORAGE_BUSY_BACKOFF = 5.
+
 
 def get_directory_sort(d):
   return list(map(lambda s: s.rjust(10, '0'), d.rsplit('--', 1)))
 
 def listdir_by_creation(d):
   try:
-    paths = os.listdir(d)
+    # without the catalog
+    paths = [p for p in os.listdir(d) if not p.startswith('.')]
     paths = sorted(paths, key=get_directory_sort)
     return paths
   except OSError:
     cloudlog.exception("listdir_by_creation failed")
     return list()
 
+def log_type(name):
+  for ext in LOG_EXTENSIONS:
+    if name.endswith(ext):
+      return name[:-len(ext)]
+  return name
+
 def clear_locks(root):
-  for logname in os.listdir(root):
+  for logname in listdir_by_creation(root):
     path = os.path.join(root, logname)
     try:
       for fname in os.listdir(path):
@@ -52,6 +67,7 @@ class Uploader():
     self.dongle_id = dongle_id
     self.api = Api(dongle_id)
     self.root = root
+    self.catalog = SegmentCatalog(root)
 
     self.upload_thread = None
 
@@ -59,10 +75,11 @@ class Uploader():
     self.last_exc = None
 
     self.immediate_folders = ["crash/"]
-    self.immediate_priority = {"qlog.bz2": 0, "qcamera.ts": 1}
-    self.high_priority = {"rlog.bz2": 0, "fcamera.hevc": 1, "dcamera.hevc": 2, "ecamera.hevc": 3}
+    self.immediate_priority = {"qlog": 0, "qcamera.ts": 1}
+    self.high_priority = {"rlog": 0, "fcamera.hevc": 1, "dcamera.hevc": 2, "ecamera.hevc": 3}
 
   def get_upload_sort(self, name):
+    name = log_type(name)
     if name in self.immediate_priority:
       return self.immediate_priority[name]
     if name in self.high_priority:
@@ -72,8 +89,18 @@ class Uploader():
   def gen_upload_files(self):
     if not os.path.isdir(self.root):
       return
+    self.catalog.update()
     for logname in listdir_by_creation(self.root):
       path = os.path.join(self.root, logname)
+
+      # the files loggerd finished, without looking at the segment
+      files = self.catalog.files(logname)
+      if files is not None:
+        for name in sorted(files, key=self.get_upload_sort):
+          if not files[name]['uploaded']:
+            yield (name, os.path.join(logname, name), os.path.join(path, name))
+        continue
+
       try:
         names = os.listdir(path)
       except OSError:
@@ -99,13 +126,13 @@ class Uploader():
 
     # try to upload qlog files first
     for name, key, fn in upload_files:
-      if name in self.immediate_priority or any(f in fn for f in self.immediate_folders):
+      if log_type(name) in self.immediate_priority or any(f in fn for f in self.immediate_folders):
         return (key, fn)
 
     if with_raw:
       # then upload the full log files, rear and front camera files
       for name, key, fn in upload_files:
-        if name in self.high_priority:
+        if log_type(name) in self.high_priority:
           return (key, fn)
 
       # then upload other files
@@ -158,9 +185,14 @@ class Uploader():
       sz = os.path.getsize(fn)
     except OSError:
       cloudlog.exception("upload: getsize failed")
+      # gone from the catalog, or it'd come up again
+      self.catalog.mark_removed(key)
       return False
 
-    cloudlog.event("upload", key=key, fn=fn, sz=sz)
+    # hashed by loggerd as it wrote the file, there's no reading it an extra time for it
+    info = self.catalog.file_info(key)
+    sha256 = info['sha256'] if info is not None else None
+    cloudlog.event("upload", key=key, fn=fn, sz=sz, sha256=sha256)
 
     cloudlog.info("checking %r with size %r", key, sz)
 
@@ -170,17 +202,19 @@ class Uploader():
         setxattr(fn, UPLOAD_ATTR_NAME, UPLOAD_ATTR_VALUE)
       except OSError:
         cloudlog.event("uploader_setxattr_failed", exc=self.last_exc, key=key, fn=fn, sz=sz)
+      self.catalog.mark_uploaded(key)
       success = True
     else:
       cloudlog.info("uploading %r", fn)
       stat = self.normal_upload(key, fn)
       if stat is not None and stat.status_code in (200, 201, 412):
-        cloudlog.event("upload_success" if stat.status_code != 412 else "upload_ignored", key=key, fn=fn, sz=sz)
+        cloudlog.event("upload_success" if stat.status_code != 412 else "upload_ignored", key=key, fn=fn, sz=sz, sha256=sha256)
         try:
           # tag file as uploaded
           setxattr(fn, UPLOAD_ATTR_NAME, UPLOAD_ATTR_VALUE)
         except OSError:
           cloudlog.event("uploader_setxattr_failed", exc=self.last_exc, key=key, fn=fn, sz=sz)
+        self.catalog.mark_uploaded(key)
         success = True
       else:
         cloudlog.event("upload_failed", stat=stat, exc=self.last_exc, key=key, fn=fn, sz=sz)
@@ -188,6 +222,16 @@ class Uploader():
 
     return success
 
+def storage_busy(loggerd_state):
+  bounds = [0.] + list(loggerd_state.writeLatencyBucketsMs)
+  for q in loggerd_state.writeQueues:
+    if q.priority != log.LoggerdState.Priority.realtime:
+      continue
+    # bucket i holds the writes slower than bounds[i]
+    if any(n > 0 for lower, n in zip(bounds, q.latencyHistogram) if lower >= SLOW_WRITE_MS):
+      return True
+  return False
+
 def uploader_fn(exit_event):
   cloudlog.info("uploader_fn")
 
@@ -198,7 +242,7 @@ def uploader_fn(exit_event):
     cloudlog.info("uploader missing dongle_id")
     raise Exception("uploader can't start without dongle id")
 
-  sm = messaging.SubMaster(['thermal'])
+  sm = messaging.SubMaster(['thermal', 'loggerdState'])
   uploader = Uploader(dongle_id, ROOT)
 
   backoff = 0.1
@@ -208,6 +252,12 @@ def uploader_fn(exit_event):
     offroad = params.get("IsOffroad") == b'1'
     allow_raw_upload = params.get("IsUploadRawEnabled") != b"0"
 
+    if sm.alive['loggerdState'] and storage_busy(sm['loggerdState']):
+      cloudlog.info("storage busy, holding off uploads")
+      if allow_sleep:
+        time.sleep(STORAGE_BUSY_BACKOFF)
+      continue
+
     d = uploader.next_file_to_upload(with_raw=allow_raw_upload and on_wifi and offroad)
     if d is None:  # Nothing to upload
       if allow_sleep:
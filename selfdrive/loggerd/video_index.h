@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+// Each hevc segment video is written with an index of its frames next to it, <video>.idx, so a
+// reader can seek without scanning the stream for its slices:
+//
+//   [VideoIndexHeader][VideoIndexEntry]...
+//
+// An entry per frame in file order, appended as the encoder writes them. What's before the first
+// frame is the codec config. All fields are little endian. tools/lib/framereader.py reads this,
+// keep them in sync
+
+const uint32_t VIDEO_INDEX_MAGIC = 0x58444956;  // "VIDX"
+const uint32_t VIDEO_INDEX_VERSION = 1;
+
+const uint32_t VIDEO_INDEX_KEYFRAME = 1;
+
+struct VideoIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct VideoIndexEntry {
+  uint64_t offset;  // of the frame in the video
+  uint32_t size;
+  uint32_t flags;
+  int64_t pts;  // timestamp_eof in us
+};
+
+static_assert(sizeof(VideoIndexHeader) == 8, "VideoIndexHeader layout changed");
+static_assert(sizeof(VideoIndexEntry) == 24, "VideoIndexEntry layout changed");
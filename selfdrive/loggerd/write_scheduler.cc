@@ -0,0 +1,97 @@
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "common/timing.h"
+#include "common/swaglog.h"
+
+#include "write_scheduler.h"
+
+#define WRITE_BULK_MAX_WAIT_MS 50
+
+WriteScheduler &WriteScheduler::instance() {
+  static WriteScheduler scheduler;
+  return scheduler;
+}
+
+WriteScheduler::WriteScheduler() {
+  const char *rate = getenv("LOGGERD_BULK_WRITE_RATE");
+  bulk_rate = rate ? atof(rate) : 8 * 1024 * 1024;
+  // a second's worth of burst
+  bulk_tokens = bulk_rate;
+  bulk_refill_us = nanos_since_boot() / 1000;
+}
+
+void WriteScheduler::throttle_bulk(std::unique_lock<std::mutex> &lk, size_t size) {
+  uint64_t start_us = nanos_since_boot() / 1000;
+
+  // let realtime writes finish first, but don't starve the logs
+  WriteQueueStats &rt = stats[(int)WritePriority::REALTIME];
+  cv.wait_for(lk, std::chrono::milliseconds(WRITE_BULK_MAX_WAIT_MS), [&] { return rt.depth == 0; });
+
+  // token bucket
+  while (true) {
+    uint64_t now_us = nanos_since_boot() / 1000;
+    bulk_tokens = std::min(bulk_rate, bulk_tokens + (now_us - bulk_refill_us) * bulk_rate / 1e6);
+    bulk_refill_us = now_us;
+    if (bulk_tokens >= size || bulk_tokens >= bulk_rate) break;
+
+    uint64_t wait_us = (size - bulk_tokens) * 1e6 / bulk_rate;
+    cv.wait_for(lk, std::chrono::microseconds(wait_us));
+  }
+  bulk_tokens -= size;
+
+  stats[(int)WritePriority::BULK].throttled_us += nanos_since_boot() / 1000 - start_us;
+}
+
+bool WriteScheduler::write(int fd, const uint8_t *data, size_t size, WritePriority priority) {
+  WriteQueueStats &q = stats[(int)priority];
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    q.depth++;
+    q.max_depth = std::max(q.max_depth, q.depth);
+    if (priority == WritePriority::BULK) {
+      throttle_bulk(lk, size);
+    }
+  }
+
+  double start = millis_since_boot();
+  bool ok = true;
+  size_t written = 0;
+  while (written < size) {
+    ssize_t ret = ::write(fd, data + written, size - written);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      LOGE("segment file write failed: %s", strerror(errno));
+      ok = false;
+      break;
+    }
+    written += ret;
+  }
+  double ms = millis_since_boot() - start;
+
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    q.depth--;
+    q.bytes += written;
+    int bucket = std::upper_bound(WRITE_LATENCY_BUCKETS_MS, WRITE_LATENCY_BUCKETS_MS + WRITE_LATENCY_BUCKETS - 1, ms) - WRITE_LATENCY_BUCKETS_MS;
+    q.latency_hist[bucket]++;
+  }
+  cv.notify_all();
+  return ok;
+}
+
+void WriteScheduler::take_stats(WriteQueueStats out[WRITE_PRIORITY_COUNT]) {
+  std::unique_lock<std::mutex> lk(lock);
+  for (int i = 0; i < WRITE_PRIORITY_COUNT; i++) {
+    out[i] = stats[i];
+    // depth is a gauge, the rest starts over
+    uint32_t depth = stats[i].depth;
+    memset(&stats[i], 0, sizeof(stats[i]));
+    stats[i].depth = stats[i].max_depth = depth;
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <condition_variable>
+
+enum class WritePriority {
+  REALTIME,  // video, dropping frames is the worst outcome
+  BULK,      // logs, which have deep queues in front of them
+};
+const int WRITE_PRIORITY_COUNT = 2;
+
+// write latency histogram buckets, the last one catches everything slower
+const int WRITE_LATENCY_BUCKETS = 8;
+const float WRITE_LATENCY_BUCKETS_MS[WRITE_LATENCY_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100};
+
+struct WriteQueueStats {
+  uint32_t depth;      // writes waiting or in progress
+  uint32_t max_depth;
+  uint64_t bytes;
+  uint64_t throttled_us;  // time bulk writes were held back
+  uint32_t latency_hist[WRITE_LATENCY_BUCKETS];
+};
+
+// Every segment output writes through here, so loggerd's streams don't fight over the storage.
+// Realtime writes go straight through. Bulk writes wait for them, up to WRITE_BULK_MAX_WAIT_MS,
+// and are rate limited to LOGGERD_BULK_WRITE_RATE bytes/sec (8MB/s by default).
+// The counters are published in loggerdState for the uploader to back off
+class WriteScheduler {
+public:
+  static WriteScheduler &instance();
+
+  // Writes all of data to fd, returns false on error
+  bool write(int fd, const uint8_t *data, size_t size, WritePriority priority);
+  // Stats since the last call
+  void take_stats(WriteQueueStats out[WRITE_PRIORITY_COUNT]);
+
+private:
+  WriteScheduler();
+  void throttle_bulk(std::unique_lock<std::mutex> &lk, size_t size);
+
+  std::mutex lock;
+  std::condition_variable cv;
+  WriteQueueStats stats[WRITE_PRIORITY_COUNT] = {};
+
+  double bulk_rate;
+  double bulk_tokens;
+  uint64_t bulk_refill_us;
+};
@@ -21,6 +21,7 @@ from common.text_window import TextWindow
 import selfdrive.crash as crash
 from selfdrive.hardware import HARDWARE, EON, PC
 from selfdrive.hardware.eon.apk import update_apks, pm_apply_packages, start_offroad
+from selfdrive.hardware.sched_profile import load_profile, check_profile
 from selfdrive.swaglog import cloudlog, add_logentries_handler
 from selfdrive.version import version, dirty
 
@@ -142,11 +143,13 @@ def build():
 if __name__ == "__main__" and not PREBUILT:
   build()
 
+# before any process is started, the python ones are forked with the schemas already parsed
 import cereal.messaging as messaging
 
 from common.params import Params
 from selfdrive.registration import register
 from selfdrive.launcher import launcher
+from selfdrive.ready import ReadyListener
 
 
 # comment out anything you don't want to run
@@ -165,6 +168,8 @@ managed_processes = {
   "tombstoned": "selfdrive.tombstoned",
   "logcatd": ("selfdrive/logcatd", ["./logcatd"]),
   "proclogd": ("selfdrive/proclogd", ["./proclogd"]),
+  "threadstatsd": ("selfdrive/proclogd", ["./threadstatsd"]),
+  "servicestatsd": ("selfdrive/proclogd", ["./servicestatsd"]),
   "boardd": ("selfdrive/boardd", ["./boardd"]),   # not used directly
   "pandad": "selfdrive.pandad",
   "ui": ("selfdrive/ui", ["./ui"]),
@@ -178,6 +183,7 @@ managed_processes = {
   "dmonitoringmodeld": ("selfdrive/modeld", ["./dmonitoringmodeld"]),
   "modeld": ("selfdrive/modeld", ["./modeld"]),
   "rtshield": "selfdrive.rtshield",
+  "powerd": "selfdrive.thermald.powerd",
 }
 
 daemon_processes = {
@@ -228,6 +234,8 @@ car_started_processes = [
   'camerad',
   'modeld',
   'proclogd',
+  'threadstatsd',
+  'servicestatsd',
   'locationd',
   'clocksd',
   'logcatd',
@@ -246,6 +254,11 @@ if not PC or WEBCAM:
     'dmonitoringmodeld',
   ]
 
+if not PC:
+  car_started_processes += [
+    'powerd',
+  ]
+
 if EON:
   car_started_processes += [
     'gpsd',
@@ -256,6 +269,29 @@ else:
     'sensord',
   ]
 
+# what a process says when it's ready, if it isn't its name
+ready_names = {
+  'pandad': 'boardd',
+}
+
+# the processes that say when they're ready, the startup timeline ends once they all did
+ready_processes = ['boardd', 'camerad', 'modeld', 'dmonitoringmodeld', 'controlsd']
+
+# started once these are ready, or READY_TIMEOUT after going onroad if one never is. Everything
+# else starts right away, so only what would compete with them for the cpu waits
+startup_dependencies = {
+  'proclogd': ['camerad', 'modeld', 'controlsd'],
+  'threadstatsd': ['camerad', 'modeld', 'controlsd'],
+  'servicestatsd': ['camerad', 'modeld', 'controlsd'],
+  'logcatd': ['camerad', 'modeld', 'controlsd'],
+}
+READY_TIMEOUT = 10.
+# the timeline is logged without the ones that weren't ready by then
+TIMELINE_TIMEOUT = 60.
+
+ready_listener = None
+start_times: Dict[str, float] = {}
+
 def register_managed_process(name, desc, car_started=False):
   global managed_processes, car_started_processes, persistent_processes
   managed_processes[name] = desc
@@ -286,6 +322,9 @@ def start_managed_process(name):
     cwd = os.path.join(BASEDIR, pdir)
     cloudlog.info("starting process %s" % name)
     running[name] = Process(name=name, target=nativelauncher, args=(pargs, cwd))
+  if ready_listener is not None:
+    ready_listener.clear(ready_names.get(name, name))
+  start_times[name] = time.monotonic()
   running[name].start()
 
 def start_daemon_process(name):
@@ -371,6 +410,8 @@ def kill_managed_process(name, retry=True):
   ret = running[name].exitcode
   cloudlog.info(f"{name} is dead with {ret}")
   del running[name]
+  if ready_listener is not None:
+    ready_listener.clear(ready_names.get(name, name))
   return ret
 
 
@@ -419,6 +460,10 @@ def manager_init():
   if not dirty:
     os.environ['CLEAN'] = '1'
 
+  # the gpu's floor is set by powerd, modeld doesn't need the highest clock for each inference
+  if 'powerd' in car_started_processes:
+    os.environ['THNEED_PWR_MAX'] = '0'
+
   cloudlog.bind_global(dongle_id=dongle_id, version=version, dirty=dirty, is_eon=True)
   crash.bind_user(id=dongle_id)
   crash.bind_extra(version=version, dirty=dirty, is_eon=True)
@@ -438,6 +483,10 @@ def manager_thread():
   # save boot log
   subprocess.call("./bootlog", cwd=os.path.join(BASEDIR, "selfdrive/loggerd"))
 
+  # before anything's started, they all get its socket
+  global ready_listener
+  ready_listener = ReadyListener()
+
   # start daemon processes
   for p in daemon_processes:
     start_daemon_process(p)
@@ -459,22 +508,40 @@ def manager_thread():
       del managed_processes[k]
 
   started_prev = False
+  started_time = 0.
+  timeline_logged = True
   logger_dead = False
   params = Params()
   thermal_sock = messaging.sub_sock('thermal')
 
+  sched_profile = load_profile()
+  sched_violations: Dict = {}
+  last_sched_check = 0.
+
   while 1:
     msg = messaging.recv_sock(thermal_sock, wait=True)
+    ready_listener.update()
 
     if msg.thermal.freeSpace < 0.05:
       logger_dead = True
 
     if msg.thermal.started:
+      if not started_prev:
+        started_time = time.monotonic()
+        timeline_logged = False
+      waited = time.monotonic() - started_time
       for p in car_started_processes:
         if p == "loggerd" and logger_dead:
           kill_managed_process(p)
-        else:
+        elif waited > READY_TIMEOUT or all(ready_listener.is_ready(d) for d in startup_dependencies.get(p, [])):
           start_managed_process(p)
+
+      if not timeline_logged:
+        names = [ready_names.get(p, p) for p in running]
+        expected = [p for p in ready_processes if p in names]
+        if all(ready_listener.is_ready(p) for p in expected) or waited > TIMELINE_TIMEOUT:
+          log_startup_timeline(started_time, ready_listener.ready)
+          timeline_logged = True
     else:
       logger_dead = False
       driver_view = params.get("IsDriverViewEnabled") == b"1"
@@ -501,10 +568,28 @@ def manager_thread():
     running_list = ["%s%s\u001b[0m" % ("\u001b[32m" if running[p].is_alive() else "\u001b[31m", p) for p in running]
     cloudlog.debug(' '.join(running_list))
 
+    # do the native processes run where, and how, the profile says? Reported when it changes
+    if time.monotonic() - last_sched_check > 10.:
+      last_sched_check = time.monotonic()
+      # pandad execs boardd
+      pids = {("boardd" if p == "pandad" else p): running[p].pid for p in running if running[p].is_alive()}
+      violations = check_profile(pids, sched_profile)
+      for k, v in violations.items():
+        if sched_violations.get(k) != v:
+          cloudlog.event("sched profile violation", process=k[0], thread=k[1], tid=k[2], violations=v)
+      sched_violations = violations
+
     # Exit main loop when uninstall is needed
     if params.get("DoUninstall", encoding='utf8') == "1":
       break
 
+def log_startup_timeline(started_time, ready):
+  # seconds from going onroad, the persistent processes' are negative
+  started = {p: round(t - started_time, 3) for p, t in start_times.items() if p in running}
+  ready = {p: round(t - started_time, 3) for p, t in ready.items()}
+  cloudlog.event("startup timeline", started=started, ready=ready,
+                 engageable=ready.get('controlsd'))
+
 def manager_prepare():
   # build all processes
   os.chdir(os.path.dirname(os.path.abspath(__file__)))
@@ -538,9 +623,7 @@ def main():
   ]
 
   # set unset params
-  for k, v in default_params:
-    if params.get(k) is None:
-      params.put(k, v)
+  params.put_many([(k, v) for k, v in default_params if params.get(k) is None])
 
   # is this dashcam?
   if os.getenv("PASSIVE") is not None:
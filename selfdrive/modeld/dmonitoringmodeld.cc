@@ -2,12 +2,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <cassert>
-#include <sys/resource.h>
+#include <algorithm>
 
 #include "visionbuf.h"
 #include "visionipc_client.h"
 #include "common/swaglog.h"
 #include "common/util.h"
+#include "common/clutil.h"
 
 #include "models/dmonitoring.h"
 
@@ -15,19 +16,76 @@
 #include <linux/limits.h>
 #endif
 
+// The model runs on every frame while engaged, the rate the monitoring policy was tuned at, and
+// on fewer while the car is parked or disengaged, the face has been confidently in or out of view
+// for a while, or the device is hot. On at least every DMON_MAX_FRAME_INTERVAL-th frame, and the
+// policy steps its timers by the frames each driverState stands for
+#define DMON_MAX_FRAME_INTERVAL 4
+#define DMON_STABLE_SECONDS 3.0
+// the face is confidently detected above, or confidently not below
+#define DMON_FACE_CONFIDENT 0.9
+#define DMON_NO_FACE_CONFIDENT 0.1
 
 ExitHandler do_exit;
 
+namespace {
+
+struct InferenceScheduler {
+  int interval = 1;
+  int frames = 0;
+  // when the face was last neither confidently in nor out of view, or the last change between them
+  double unstable_since = millis_since_boot();
+  bool face_detected = false;
+
+  // a frame came, whether to run the model on it
+  bool run(SubMaster &sm, double t) {
+    int thermal = 0;
+    if (sm.alive("thermal")) thermal = (int)sm["thermal"].getThermal().getThermalStatus();
+    const bool engaged = sm.alive("controlsState") && sm["controlsState"].getControlsState().getEnabled();
+    const bool parked = !sm.alive("carState") || sm["carState"].getCarState().getStandstill();
+
+    if (engaged) {
+      // red disengages
+      interval = thermal >= (int)cereal::ThermalData::ThermalStatus::RED ? 2 : 1;
+    } else {
+      interval = parked ? 2 : 1;
+      if (t - unstable_since > DMON_STABLE_SECONDS * 1000) interval *= 2;
+      if (thermal >= (int)cereal::ThermalData::ThermalStatus::YELLOW) interval *= 2;
+      interval = std::min(interval, DMON_MAX_FRAME_INTERVAL);
+    }
+    return ++frames >= interval;
+  }
+
+  void update(const DMonitoringResult &res, double t) {
+    frames = 0;
+    const bool confident = res.face_prob > DMON_FACE_CONFIDENT || res.face_prob < DMON_NO_FACE_CONFIDENT;
+    if (!confident || (res.face_prob > 0.5) != face_detected) unstable_since = t;
+    face_detected = res.face_prob > 0.5;
+  }
+};
+
+}
+
 int main(int argc, char **argv) {
-  setpriority(PRIO_PROCESS, 0, -15);
+  set_sched_profile("dmonitoringmodeld");
 
   PubMaster pm({"driverState"});
+  SubMaster sm({"controlsState", "carState", "thermal"});
 
   // init the models
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  // below camerad's and modeld's, see cl_gpu_priority
+  const cl_gpu_priority priority = cl_gpu_priority_from_env("DMONITORINGMODELD_GPU_PRIORITY", CL_GPU_PRIORITY_LOW);
+#ifdef USE_THNEED
+  g_kgsl_priority = cl_gpu_priority_kgsl(priority);
+#endif
+  cl_context context = cl_create_context(device_id, priority);
+
   DMonitoringModelState dmonitoringmodel;
-  dmonitoring_init(&dmonitoringmodel);
+  dmonitoring_init(&dmonitoringmodel, device_id, context);
 
-  VisionIpcClient vipc_client = VisionIpcClient("camerad", VISION_STREAM_YUV_FRONT, true);
+  VisionIpcClient vipc_client = VisionIpcClient("camerad", VISION_STREAM_YUV_FRONT, true, device_id, context);
+  vipc_client.lazy_sync = true;
   while (!do_exit){
     if (!vipc_client.connect(false)){
       util::sleep_for(100);
@@ -38,8 +96,10 @@ int main(int argc, char **argv) {
 
   while (!do_exit) {
     LOGW("connected with buffer size: %d", vipc_client.buffers[0].len);
+    notify_ready("dmonitoringmodeld");
 
     double last = 0;
+    InferenceScheduler scheduler;
     while (!do_exit) {
       VisionIpcBufExtra extra = {0};
       VisionBuf *buf = vipc_client.recv(&extra);
@@ -48,12 +108,16 @@ int main(int argc, char **argv) {
       }
 
       double t1 = millis_since_boot();
-      DMonitoringResult res = dmonitoring_eval_frame(&dmonitoringmodel, buf->addr, buf->width, buf->height);
+      sm.update(0);
+      if (!scheduler.run(sm, t1)) continue;
+
+      DMonitoringResult res = dmonitoring_eval_frame(&dmonitoringmodel, buf);
       double t2 = millis_since_boot();
+      scheduler.update(res, t2);
 
       // send dm packet
       const float* raw_pred_ptr = send_raw_pred ? (const float *)dmonitoringmodel.output : nullptr;
-      dmonitoring_publish(pm, extra.frame_id, res, raw_pred_ptr, (t2-t1)/1000.0);
+      dmonitoring_publish(pm, extra.frame_id, scheduler.interval, res, raw_pred_ptr, (t2-t1)/1000.0);
 
       LOGD("dmonitoring process: %.2fms, from last %.2fms", t2-t1, t1-last);
       last = t1;
@@ -61,6 +125,7 @@ int main(int argc, char **argv) {
   }
 
   dmonitoring_free(&dmonitoringmodel);
+  CL_CHECK(clReleaseContext(context));
 
   return 0;
 }
@@ -1,16 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <eigen3/Eigen/Dense>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "visionbuf.h"
 #include "visionipc_client.h"
 #include "common/swaglog.h"
 #include "common/clutil.h"
+#include "common/trace.h"
+#include "common/alloc_tracker.h"
 #include "common/util.h"
 
 #include "models/driving.h"
 #include "messaging.hpp"
+#include "services.h"
 
 ExitHandler do_exit;
 // globals
@@ -20,64 +29,20 @@ pthread_mutex_t transform_lock;
 
 void* live_thread(void *arg) {
   set_thread_name("live");
-  set_realtime_priority(50);
+  set_sched_profile("modeld", "live");
 
   SubMaster sm({"liveCalibration"});
 
-  /*
-     import numpy as np
-     from common.transformations.model import medmodel_frame_from_road_frame
-     medmodel_frame_from_ground = medmodel_frame_from_road_frame[:, (0, 1, 3)]
-     ground_from_medmodel_frame = np.linalg.inv(medmodel_frame_from_ground)
-  */
-  Eigen::Matrix<float, 3, 3> ground_from_medmodel_frame;
-  ground_from_medmodel_frame <<
-    0.00000000e+00, 0.00000000e+00, 1.00000000e+00,
-    -1.09890110e-03, 0.00000000e+00, 2.81318681e-01,
-    -1.84808520e-20, 9.00738606e-04,-4.28751576e-02;
-
-  Eigen::Matrix<float, 3, 3> fcam_intrinsics;
-#ifndef QCOM2
-  fcam_intrinsics <<
-    910.0, 0.0, 582.0,
-    0.0, 910.0, 437.0,
-    0.0,   0.0,   1.0;
-  float db_s = 0.5; // debayering does a 2x downscale
-#else
-  fcam_intrinsics <<
-    2648.0, 0.0, 1928.0/2,
-    0.0, 2648.0, 1208.0/2,
-    0.0,   0.0,   1.0;
-  float db_s = 1.0;
-#endif
-
-  mat3 yuv_transform = transform_scale_buffer((mat3){{
-    1.0, 0.0, 0.0,
-    0.0, 1.0, 0.0,
-    0.0, 0.0, 1.0,
-  }}, db_s);
-
   while (!do_exit) {
     if (sm.update(100) > 0){
 
       auto extrinsic_matrix = sm["liveCalibration"].getLiveCalibration().getExtrinsicMatrix();
-      Eigen::Matrix<float, 3, 4> extrinsic_matrix_eigen;
+      float extrinsic[3*4];
       for (int i = 0; i < 4*3; i++){
-        extrinsic_matrix_eigen(i / 4, i % 4) = extrinsic_matrix[i];
+        extrinsic[i] = extrinsic_matrix[i];
       }
 
-      auto camera_frame_from_road_frame = fcam_intrinsics * extrinsic_matrix_eigen;
-      Eigen::Matrix<float, 3, 3> camera_frame_from_ground;
-      camera_frame_from_ground.col(0) = camera_frame_from_road_frame.col(0);
-      camera_frame_from_ground.col(1) = camera_frame_from_road_frame.col(1);
-      camera_frame_from_ground.col(2) = camera_frame_from_road_frame.col(3);
-
-      auto warp_matrix = camera_frame_from_ground * ground_from_medmodel_frame;
-      mat3 transform = {};
-      for (int i=0; i<3*3; i++) {
-        transform.v[i] = warp_matrix(i / 3, i % 3);
-      }
-      mat3 model_transform = matmul3(yuv_transform, transform);
+      mat3 model_transform = model_camera_transform(extrinsic);
       pthread_mutex_lock(&transform_lock);
       cur_transform = model_transform;
       run_model = true;
@@ -87,16 +52,173 @@ void* live_thread(void *arg) {
   return NULL;
 }
 
+// Picks the model rate. Under thermal load, or when a frame takes longer than the rate allows, it
+// runs every 2nd or 4th camera frame by frame id instead of dropping whichever frames it misses.
+// Red or worse is the emergency mode, the lowest rate with modelV2.emergency set
+struct RatePolicy {
+  static constexpr int MAX_DECIMATION = 4;
+  static constexpr double BUDGET_MS = 1000. / MODEL_FREQ;
+  static constexpr double RECOVER_MS = 5000;  // of wanting a higher rate before going back up
+
+  int decimation = 1;
+  bool emergency = false;
+  std::atomic<float> frame_ms{0};  // filtered prepare and execute time, from the model thread
+  double want_higher_since = 0;
+
+  void update(cereal::ThermalData::ThermalStatus status, double now) {
+    int want = 1;
+    if (status >= cereal::ThermalData::ThermalStatus::RED) {
+      want = MAX_DECIMATION;
+    } else if (status == cereal::ThermalData::ThermalStatus::YELLOW) {
+      want = 2;
+    }
+    // the frames have to fit, with a margin, in the time the rate gives them
+    while (want < MAX_DECIMATION && frame_ms > 0.9 * BUDGET_MS * want) want *= 2;
+    emergency = status >= cereal::ThermalData::ThermalStatus::RED;
+
+    if (want > decimation) {
+      decimation = want;
+      want_higher_since = 0;
+    } else if (want < decimation) {
+      if (want_higher_since == 0) want_higher_since = now;
+      if (now - want_higher_since > RECOVER_MS) {
+        decimation /= 2;
+        want_higher_since = 0;
+      }
+    } else {
+      want_higher_since = 0;
+    }
+  }
+
+  bool run(uint32_t frame_id) const { return frame_id % decimation == 0; }
+};
+
+// A frame in the model input layout, waiting for the model thread
+struct PreparedFrame {
+  int slot;
+  VisionIpcBufExtra extra;
+  uint32_t frame_id;
+  int desire;
+  uint64_t vipc_frames;
+  uint64_t skipped_frames;  // not run on purpose by the rate policy so far, they aren't drops
+  int decimation;
+  bool emergency;
+  FrameTiming timing;
+};
+
+// Hands prepared frames to the model thread. While the model runs on one slot the next frame is
+// prepared into another, and a frame the model didn't get to is replaced by the next one
+struct FramePipeline {
+  static constexpr int SLOTS = 3;
+  std::unique_ptr<float[]> slots[SLOTS];
+
+  std::mutex lock;
+  std::condition_variable cv;
+  bool has_pending = false;
+  PreparedFrame pending;
+  int running = -1;
+
+  FramePipeline() {
+    for (auto &slot : slots) slot = std::make_unique<float[]>(MODEL_FRAME_SIZE);
+  }
+
+  // Neither waiting nor in use by the model, so it's owned by the caller until push
+  int take_free_slot() {
+    std::lock_guard<std::mutex> lk(lock);
+    for (int i = 0; i < SLOTS; i++) {
+      if (i != running && !(has_pending && i == pending.slot)) return i;
+    }
+    assert(false);
+    return -1;
+  }
+
+  void push(const PreparedFrame &frame) {
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      pending = frame;
+      has_pending = true;
+    }
+    cv.notify_one();
+  }
+
+  bool pop(PreparedFrame *frame) {
+    std::unique_lock<std::mutex> lk(lock);
+    running = -1;
+    if (!cv.wait_for(lk, std::chrono::milliseconds(100), [this]{ return has_pending; })) return false;
+    *frame = pending;
+    running = pending.slot;
+    has_pending = false;
+    return true;
+  }
+};
+
+void model_thread(ModelState *model, PubMaster *pm, FramePipeline *pipeline, RatePolicy *policy) {
+  set_thread_name("model");
+
+  // setup filter to track dropped frames
+  const float dt = 1. / MODEL_FREQ;
+  const float ts = 10.0;  // filter time constant (s)
+  const float frame_filter_k = (dt / ts) / (1. + dt / ts);
+  float frames_dropped = 0;
+
+  uint64_t last_vipc_frames = 0;
+  uint64_t last_skipped_frames = 0;
+  double last = 0;
+  uint32_t run_count = 0;
+  double last_publish = 0;
+
+  PreparedFrame frame;
+  AllocLoop alloc_loop("model_thread");
+  while (!do_exit) {
+    alloc_loop.iteration();
+    if (!pipeline->pop(&frame)) continue;
+    run_count++;
+
+    float vec_desire[DESIRE_LEN] = {0};
+    if (frame.desire >= 0 && frame.desire < DESIRE_LEN) {
+      vec_desire[frame.desire] = 1.0;
+    }
+
+    double mt1 = frame.timing.model_start = millis_since_boot();
+    ModelDataRaw model_buf;
+    {
+      TRACE_SCOPE("model_eval");
+      model_buf = model_eval_tensor(model, pipeline->slots[frame.slot].get(), vec_desire);
+    }
+    double mt2 = frame.timing.model_end = millis_since_boot();
+    frame.timing.prev_publish = last_publish;
+    float model_execution_time = (mt2 - mt1) / 1000.0;
+
+    // filtered like the dropped frames, for the rate policy
+    const float frame_ms = frame.timing.model_end - frame.timing.ready;
+    policy->frame_ms = (1. - frame_filter_k) * policy->frame_ms + frame_filter_k * frame_ms;
+
+    // tracked dropped frames, pipeline drops included
+    uint32_t vipc_dropped_frames = frame.vipc_frames - last_vipc_frames - (frame.skipped_frames - last_skipped_frames) - 1;
+    frames_dropped = (1. - frame_filter_k) * frames_dropped + frame_filter_k * (float)std::min(vipc_dropped_frames, 10U);
+    if (run_count < 10) frames_dropped = 0;  // let frame drops warm up
+    float frame_drop_ratio = frames_dropped / (1 + frames_dropped);
+
+    TRACE_SCOPE("model_publish");
+    const float *raw_pred_ptr = send_raw_pred ? &model->output[0] : nullptr;
+    model_publish(*pm, frame.extra.frame_id, frame.frame_id, frame_drop_ratio, model_buf, raw_pred_ptr, frame.extra.timestamp_eof,
+                  model_execution_time, frame.timing, (float)MODEL_FREQ / frame.decimation, frame.emergency);
+    posenet_publish(*pm, frame.extra.frame_id, vipc_dropped_frames, model_buf, frame.extra.timestamp_eof);
+    double mt3 = millis_since_boot();
+    last_publish = mt3 - mt2;
+
+    LOGD("model process: %.2fms, publish %.2fms, prepare %.2fms, from last %.2fms, vipc_frame_id %u, frame_id, %u, frame_drop %.3f",
+         mt2-mt1, mt3-mt2, mt1-frame.timing.ready, mt1-last, frame.extra.frame_id, frame.frame_id, frame_drop_ratio);
+    last = mt1;
+    last_vipc_frames = frame.vipc_frames;
+    last_skipped_frames = frame.skipped_frames;
+  }
+}
+
 int main(int argc, char **argv) {
   int err;
-  set_realtime_priority(54);
-
-#ifdef QCOM
-  set_core_affinity(2);
-#elif QCOM2
   // CPU usage is much lower when pinned to a single big core
-  set_core_affinity(4);
-#endif
+  set_sched_profile("modeld");
 
   pthread_mutex_init(&transform_lock, NULL);
 
@@ -107,18 +229,24 @@ int main(int argc, char **argv) {
 
   // messaging
   PubMaster pm({"modelV2", "cameraOdometry"});
-  SubMaster sm({"pathPlan", "frame"});
+  SubMaster sm({"pathPlan", "frame", "thermal"});
 
   // cl init
   cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
-  cl_context context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  // below camerad's, see cl_gpu_priority
+  const cl_gpu_priority priority = cl_gpu_priority_from_env("MODELD_GPU_PRIORITY", CL_GPU_PRIORITY_NORMAL);
+#ifdef USE_THNEED
+  g_kgsl_priority = cl_gpu_priority_kgsl(priority);
+#endif
+  cl_context context = cl_create_context(device_id, priority);
 
   // init the models
   ModelState model;
   model_init(&model, device_id, context);
   LOGW("models loaded, modeld starting");
 
-  VisionIpcClient vipc_client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, true, device_id, context);
+  VisionIpcClient vipc_client = env_model_tensor ? VisionIpcClient("camerad", MODEL_TENSOR_STREAM, true)
+                                                 : VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, true, device_id, context);
 
   while (!do_exit){
     if (!vipc_client.connect(false)){
@@ -128,28 +256,30 @@ int main(int argc, char **argv) {
     break;
   }
 
-  // loop
+  FramePipeline pipeline;
+  RatePolicy policy;
+  uint64_t skipped_frames = 0;
+  std::thread model_thread_handle(model_thread, &model, &pm, &pipeline, &policy);
+
+  // loop, this thread receives and prepares frames, the model thread runs them
   while (!do_exit) {
     VisionBuf *b = &vipc_client.buffers[0];
     LOGW("connected with buffer size: %d (%d x %d)", b->len, b->width, b->height);
+    notify_ready("modeld");
 
-    // setup filter to track dropped frames
-    const float dt = 1. / MODEL_FREQ;
-    const float ts = 10.0;  // filter time constant (s)
-    const float frame_filter_k = (dt / ts) / (1. + dt / ts);
-    float frames_dropped = 0;
-
-    uint32_t frame_id = 0, last_vipc_frame_id = 0;
-    double last = 0;
+    uint32_t frame_id = 0;
     int desire = -1;
-    uint32_t run_count = 0;
 
+    AllocLoop alloc_loop("model_frames");
     while (!do_exit) {
+      alloc_loop.iteration();
       VisionIpcBufExtra extra;
-      VisionBuf *buf = vipc_client.recv(&extra);
+      // camerad sends frames before the gpu is done with them, wait only once the frame is used
+      VisionBuf *buf = vipc_client.recv(&extra, 100, false);
       if (buf == nullptr){
         continue;
       }
+      const double recv_time = millis_since_boot();
 
       pthread_mutex_lock(&transform_lock);
       mat3 model_transform = cur_transform;
@@ -158,45 +288,54 @@ int main(int argc, char **argv) {
 
       if (sm.update(0) > 0){
         // TODO: path planner timeout?
-        desire = ((int)sm["pathPlan"].getPathPlan().getDesire());
-        frame_id = sm["frame"].getFrame().getFrameId();
+        desire = ((int)sm[ServiceId::pathPlan].getPathPlan().getDesire());
+        frame_id = sm[ServiceId::frame].getFrame().getFrameId();
       }
 
-      double mt1 = 0, mt2 = 0;
-      if (run_model_this_iter) {
-        run_count++;
-
-        float vec_desire[DESIRE_LEN] = {0};
-        if (desire >= 0 && desire < DESIRE_LEN) {
-          vec_desire[desire] = 1.0;
-        }
-
-        mt1 = millis_since_boot();
-
-        ModelDataRaw model_buf =
-            model_eval_frame(&model, buf->buf_cl, buf->width, buf->height,
-                             model_transform, vec_desire);
-        mt2 = millis_since_boot();
-        float model_execution_time = (mt2 - mt1) / 1000.0;
-
-        // tracked dropped frames
-        uint32_t vipc_dropped_frames = extra.frame_id - last_vipc_frame_id - 1;
-        frames_dropped = (1. - frame_filter_k) * frames_dropped + frame_filter_k * (float)std::min(vipc_dropped_frames, 10U);
-        if (run_count < 10) frames_dropped = 0;  // let frame drops warm up
-        float frame_drop_ratio = frames_dropped / (1 + frames_dropped);
+      if (!run_model_this_iter) continue;
 
-        const float *raw_pred_ptr = send_raw_pred ? &model.output[0] : nullptr;
-        model_publish(pm, extra.frame_id, frame_id, frame_drop_ratio, model_buf, raw_pred_ptr, extra.timestamp_eof, model_execution_time);
-        posenet_publish(pm, extra.frame_id, vipc_dropped_frames, model_buf, extra.timestamp_eof);
+      policy.update(sm[ServiceId::thermal].getThermal().getThermalStatus(), recv_time);
+      if (!policy.run(extra.frame_id)) {
+        skipped_frames++;
+        continue;
+      }
 
-        LOGD("model process: %.2fms, from last %.2fms, vipc_frame_id %u, frame_id, %u, frame_drop %.3f", mt2-mt1, mt1-last, extra.frame_id, frame_id, frame_drop_ratio);
-        last = mt1;
-        last_vipc_frame_id = extra.frame_id;
+      if (!vipc_client.wait(buf)) {
+        LOGW("frame %d not ready", extra.frame_id);
+        continue;
       }
 
+      TRACE_SCOPE("model_prepare");
+      PreparedFrame frame;
+      frame.slot = pipeline.take_free_slot();
+      frame.extra = extra;
+      frame.frame_id = frame_id;
+      frame.desire = desire;
+      // every frame the client either got or missed so far, for tracking dropped frames
+      frame.vipc_frames = vipc_client.stats.received + vipc_client.stats.missed();
+      frame.skipped_frames = skipped_frames;
+      frame.decimation = policy.decimation;
+      frame.emergency = policy.emergency;
+      frame.timing = {};
+      frame.timing.recv = recv_time;
+      frame.timing.ready = millis_since_boot();
+
+      float *input = pipeline.slots[frame.slot].get();
+      if (env_model_tensor) {
+        // camerad already warped it, the copy is the whole prepare
+        memcpy(input, buf->addr, MODEL_FRAME_SIZE * sizeof(float));
+        frame.timing.enqueued = frame.timing.ready;
+        frame.timing.prepared = millis_since_boot();
+      } else {
+        model_prepare_frame(&model, buf->buf_cl, buf->width, buf->height, model_transform, input, &frame.timing);
+      }
+      pipeline.push(frame);
     }
   }
 
+  pipeline.cv.notify_all();
+  model_thread_handle.join();
+
   model_free(&model);
 
   LOG("joining live_thread");
@@ -0,0 +1,130 @@
+// Runs the driving model over a route segment offline, as fast as it goes, and writes the modelV2s
+//   _modeld_replay <uncompressed rlog> <fcamera.hevc> <output log>
+// The frames come straight from the video instead of camerad, calibration and desire from the
+// log. The frames run in order through one ModelState, so the recurrent state is carried like in
+// modeld. The output is a log of the modelV2 events, stamped with their frame's logMonoTime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+
+#include "common/clutil.h"
+#include "common/timing.h"
+#include "FrameReader.hpp"
+#include "models/driving.h"
+#include "messaging.hpp"
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s <uncompressed rlog> <fcamera.hevc> <output log>\n", argv[0]);
+    return 1;
+  }
+
+  std::ifstream f(argv[1], std::ios::binary | std::ios::ate);
+  if (!f) {
+    fprintf(stderr, "can't read %s\n", argv[1]);
+    return 1;
+  }
+  size_t size = f.tellg();
+  auto words = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  f.seekg(0);
+  f.read((char *)words.begin(), words.size() * sizeof(capnp::word));
+
+  std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> events;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    auto reader = std::make_unique<capnp::FlatArrayMessageReader>(remaining);
+    remaining = kj::arrayPtr(reader->getEnd(), remaining.end());
+    events.push_back(std::move(reader));
+  }
+
+  FILE *out = fopen(argv[3], "wb");
+  if (!out) {
+    fprintf(stderr, "can't write %s\n", argv[3]);
+    return 1;
+  }
+
+  FrameReader fr(argv[2], true);
+  fr.waitForReady();
+  const int width = fr.getWidth(), height = fr.getHeight();
+
+  int err;
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  ModelState model;
+  model_init(&model, device_id, context);
+  cl_mem yuv_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_ONLY, fr.getYUVSize(), NULL, &err));
+
+  // modeld has a calibration before the first frame, like camera_replay sends it
+  mat3 transform = {};
+  bool calibrated = false;
+  auto update_calibration = [&](cereal::Event::Reader event) {
+    auto extrinsic_matrix = event.getLiveCalibration().getExtrinsicMatrix();
+    float extrinsic[3*4];
+    for (int i = 0; i < 4*3; i++) extrinsic[i] = extrinsic_matrix[i];
+    transform = model_camera_transform(extrinsic);
+    calibrated = true;
+  };
+  for (auto &reader : events) {
+    auto event = reader->getRoot<cereal::Event>();
+    if (event.which() == cereal::Event::LIVE_CALIBRATION) {
+      update_calibration(event);
+      break;
+    }
+  }
+  if (!calibrated) {
+    fprintf(stderr, "no liveCalibration in %s\n", argv[1]);
+    return 1;
+  }
+
+  int desire = -1;
+  int frame_idx = 0;
+  double start = millis_since_boot();
+  for (auto &reader : events) {
+    auto event = reader->getRoot<cereal::Event>();
+    if (event.which() == cereal::Event::LIVE_CALIBRATION) {
+      update_calibration(event);
+    } else if (event.which() == cereal::Event::PATH_PLAN) {
+      desire = (int)event.getPathPlan().getDesire();
+    } else if (event.which() == cereal::Event::FRAME) {
+      uint8_t *yuv = fr.get(frame_idx++);
+      if (yuv == NULL) break;
+
+      float vec_desire[DESIRE_LEN] = {0};
+      if (desire >= 0 && desire < DESIRE_LEN) vec_desire[desire] = 1.0;
+
+      CL_CHECK(clEnqueueWriteBuffer(model.cameras[0].q, yuv_cl, CL_TRUE, 0, fr.getYUVSize(), yuv, 0, NULL, NULL));
+      double mt1 = millis_since_boot();
+      ModelDataRaw net_outputs = model_eval_frame(&model, yuv_cl, width, height, transform, vec_desire);
+      double mt2 = millis_since_boot();
+
+      auto frame = event.getFrame();
+      MessageBuilder msg;
+      auto out_event = msg.initEvent();
+      out_event.setLogMonoTime(event.getLogMonoTime());
+      auto framed = out_event.initModelV2();
+      framed.setFrameId(frame.getFrameId());
+      framed.setTimestampEof(frame.getTimestampEof());
+      framed.setModelExecutionTime((mt2 - mt1) / 1000.0);
+      framed.setFrequency(MODEL_FREQ);
+      if (send_raw_pred) {
+        framed.setRawPred(kj::arrayPtr((const uint8_t *)&model.output[0], model.output_size * sizeof(float)));
+      }
+      fill_model(framed, net_outputs);
+
+      auto bytes = msg.toBytes();
+      fwrite(bytes.begin(), 1, bytes.size(), out);
+    }
+  }
+  fclose(out);
+
+  double ms = millis_since_boot() - start;
+  printf("%d frames in %.1f s, %.1f ms per frame\n", frame_idx, ms / 1000., ms / std::max(frame_idx, 1));
+
+  CL_CHECK(clReleaseMemObject(yuv_cl));
+  model_free(&model);
+  CL_CHECK(clReleaseContext(context));
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <math.h>
+#include <eigen3/Eigen/Dense>
 #include "commonmodel.h"
 #include "common/clutil.h"
 #include "common/mat.h"
@@ -11,26 +12,24 @@ void frame_init(ModelFrame* frame, int width, int height,
   frame->width = width;
   frame->height = height;
 
-  frame->y_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)width*height, NULL, &err));
-  frame->u_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)(width/2)*(height/2), NULL, &err));
-  frame->v_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)(width/2)*(height/2), NULL, &err));
   frame->net_input_size = ((width*height*3)/2)*sizeof(float);
   frame->net_input = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE,
                                 frame->net_input_size, (void*)NULL, &err));
-  loadyuv_init(&frame->loadyuv, context, device_id, width, height);
+}
+
+void frame_queue(ModelFrame* frame, cl_command_queue q,
+                 cl_mem yuv_cl, int width, int height,
+                 const mat3 &transform, cl_mem out_cl) {
+  transform_queue_tensor(&frame->transform, q,
+                         yuv_cl, width, height,
+                         out_cl, frame->width, frame->height,
+                         transform);
 }
 
 float *frame_prepare(ModelFrame* frame, cl_command_queue q,
                            cl_mem yuv_cl, int width, int height,
                            const mat3 &transform) {
-  transform_queue(&frame->transform, q,
-                  yuv_cl, width, height,
-                  frame->y_cl, frame->u_cl, frame->v_cl,
-                  frame->width, frame->height,
-                  transform);
-  loadyuv_queue(&frame->loadyuv, q,
-                frame->y_cl, frame->u_cl, frame->v_cl,
-                frame->net_input);
+  frame_queue(frame, q, yuv_cl, width, height, transform, frame->net_input);
   float *net_input_buf = (float *)CL_CHECK_ERR(clEnqueueMapBuffer(q, frame->net_input, CL_TRUE,
                                             CL_MAP_READ, 0, frame->net_input_size,
                                             0, NULL, NULL, &err));
@@ -40,35 +39,102 @@ float *frame_prepare(ModelFrame* frame, cl_command_queue q,
 
 void frame_free(ModelFrame* frame) {
   transform_destroy(&frame->transform);
-  loadyuv_destroy(&frame->loadyuv);
   CL_CHECK(clReleaseMemObject(frame->net_input));
-  CL_CHECK(clReleaseMemObject(frame->v_cl));
-  CL_CHECK(clReleaseMemObject(frame->u_cl));
-  CL_CHECK(clReleaseMemObject(frame->y_cl));
 }
 
-void softmax(const float* input, float* output, size_t len) {
-  float max_val = -FLT_MAX;
-  for(int i = 0; i < len; i++) {
-    const float v = input[i];
-    if( v > max_val ) {
-      max_val = v;
-    }
+void shared_input_init(SharedInput *in, cl_context context, size_t slot_size, int slots) {
+  // page aligned, for the driver to use it in place
+  const size_t align = 4096;
+  assert((slot_size * sizeof(float)) % align == 0);
+  in->slot_size = slot_size;
+  in->host = (float *)aligned_alloc(align, slot_size * sizeof(float) * slots);
+  assert(in->host != NULL);
+  for (int i = 0; i < slots; i++) {
+    in->slots.push_back(CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                                                    slot_size * sizeof(float), &in->host[i * slot_size], &err)));
   }
+}
+
+float *shared_input_sync(SharedInput *in, cl_command_queue q, int slot) {
+  float *host = &in->host[slot * in->slot_size];
+  // mapping a USE_HOST_PTR buffer hands back its host memory with the GPU's writes in it. It stays
+  // valid after unmapping, until the slot is written again
+  void *mapped = CL_CHECK_ERR(clEnqueueMapBuffer(q, in->slots[slot], CL_TRUE, CL_MAP_READ, 0,
+                                                 in->slot_size * sizeof(float), 0, NULL, NULL, &err));
+  assert(mapped == host);
+  CL_CHECK(clEnqueueUnmapMemObject(q, in->slots[slot], mapped, 0, NULL, NULL));
+  return host;
+}
+
+void shared_input_free(SharedInput *in) {
+  for (auto slot : in->slots) {
+    CL_CHECK(clReleaseMemObject(slot));
+  }
+  in->slots.clear();
+  free(in->host);
+  in->host = NULL;
+}
 
-  float denominator = 0;
-  for(int i = 0; i < len; i++) {
-    float const v = input[i];
-    float const v_exp = expf(v - max_val);
-    denominator += v_exp;
-    output[i] = v_exp;
+mat3 model_transform_from_calibration(const float extrinsic_matrix[3*4]) {
+  /*
+     import numpy as np
+     from common.transformations.model import medmodel_frame_from_road_frame
+     medmodel_frame_from_ground = medmodel_frame_from_road_frame[:, (0, 1, 3)]
+     ground_from_medmodel_frame = np.linalg.inv(medmodel_frame_from_ground)
+  */
+  Eigen::Matrix<float, 3, 3> ground_from_medmodel_frame;
+  ground_from_medmodel_frame <<
+    0.00000000e+00, 0.00000000e+00, 1.00000000e+00,
+    -1.09890110e-03, 0.00000000e+00, 2.81318681e-01,
+    -1.84808520e-20, 9.00738606e-04,-4.28751576e-02;
+
+  Eigen::Matrix<float, 3, 3> fcam_intrinsics;
+#ifndef QCOM2
+  fcam_intrinsics <<
+    910.0, 0.0, 582.0,
+    0.0, 910.0, 437.0,
+    0.0,   0.0,   1.0;
+#else
+  fcam_intrinsics <<
+    2648.0, 0.0, 1928.0/2,
+    0.0, 2648.0, 1208.0/2,
+    0.0,   0.0,   1.0;
+#endif
+
+  Eigen::Matrix<float, 3, 4> extrinsic_matrix_eigen;
+  for (int i = 0; i < 4*3; i++){
+    extrinsic_matrix_eigen(i / 4, i % 4) = extrinsic_matrix[i];
   }
 
-  const float inv_denominator = 1. / denominator;
-  for(int i = 0; i < len; i++) {
-    output[i] *= inv_denominator;
+  auto camera_frame_from_road_frame = fcam_intrinsics * extrinsic_matrix_eigen;
+  Eigen::Matrix<float, 3, 3> camera_frame_from_ground;
+  camera_frame_from_ground.col(0) = camera_frame_from_road_frame.col(0);
+  camera_frame_from_ground.col(1) = camera_frame_from_road_frame.col(1);
+  camera_frame_from_ground.col(2) = camera_frame_from_road_frame.col(3);
+
+  auto warp_matrix = camera_frame_from_ground * ground_from_medmodel_frame;
+  mat3 transform = {};
+  for (int i=0; i<3*3; i++) {
+    transform.v[i] = warp_matrix(i / 3, i % 3);
   }
+  return transform;
+}
+
+// Eigen's exp is the SIMD one, NEON on the device
+void softmax(const float* input, float* output, size_t len) {
+  Eigen::Map<const Eigen::ArrayXf> in(input, len);
+  Eigen::Map<Eigen::ArrayXf> out(output, len);
+  out = (in - in.maxCoeff()).exp();
+  out *= 1.f / out.sum();
+}
+
+void sigmoid_n(const float* input, float* output, size_t len) {
+  Eigen::Map<const Eigen::ArrayXf> in(input, len);
+  Eigen::Map<Eigen::ArrayXf>(output, len) = (1.f + (-in).exp()).inverse();
+}
 
+void exp_n(const float* input, float* output, size_t len) {
+  Eigen::Map<Eigen::ArrayXf>(output, len) = Eigen::Map<const Eigen::ArrayXf>(input, len).exp();
 }
 
 float sigmoid(float input) {
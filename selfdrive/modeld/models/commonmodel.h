@@ -8,28 +8,56 @@
 
 #include <float.h>
 #include <stdlib.h>
+#include <vector>
 #include "common/mat.h"
 #include "transforms/transform.h"
-#include "transforms/loadyuv.h"
 
 const bool send_raw_pred = getenv("SEND_RAW_PRED") != NULL;
 
+// Input frame of the driving model. With CAMERAD_MODEL_TENSOR set camerad publishes it
+// ready to run as a float stream, warped and in the y|y|y|y|u|v layout
+constexpr int DRIVING_MODEL_WIDTH = 512;
+constexpr int DRIVING_MODEL_HEIGHT = 256;
+const bool env_model_tensor = getenv("CAMERAD_MODEL_TENSOR") != NULL;
+#define MODEL_TENSOR_STREAM "model_tensor_back"
+
 void softmax(const float* input, float* output, size_t len);
 float softplus(float input);
 float sigmoid(float input);
+// elementwise over len floats, vectorized. output may be input
+void sigmoid_n(const float* input, float* output, size_t len);
+void exp_n(const float* input, float* output, size_t len);
 
 typedef struct ModelFrame {
   Transform transform;
   int width, height;
-  cl_mem y_cl, u_cl, v_cl;
-  LoadYUVState loadyuv;
   cl_mem net_input;
   size_t net_input_size;
 } ModelFrame;
 
 void frame_init(ModelFrame* frame, int width, int height,
                       cl_device_id device_id, cl_context context);
+void frame_queue(ModelFrame* frame, cl_command_queue q,
+                 cl_mem yuv_cl, int width, int height,
+                 const mat3 &transform, cl_mem out_cl);
 float *frame_prepare(ModelFrame* frame, cl_command_queue q,
                            cl_mem yuv_cl, int width, int height,
                            const mat3 &transform);
 void frame_free(ModelFrame* frame);
+
+// Model input slots in host memory that the GPU writes straight into. Each slot's cl buffer is
+// over its memory with CL_MEM_USE_HOST_PTR, so where the GPU shares memory with the CPU, like
+// the Adreno, the runner gets the GPU's output after a cache flush instead of a copy
+typedef struct SharedInput {
+  float *host;
+  size_t slot_size;  // floats
+  std::vector<cl_mem> slots;
+} SharedInput;
+
+void shared_input_init(SharedInput *in, cl_context context, size_t slot_size, int slots);
+// Waits for the queued writes to slot and makes them visible to the CPU, returns the slot's memory
+float *shared_input_sync(SharedInput *in, cl_command_queue q, int slot);
+void shared_input_free(SharedInput *in);
+
+// Warp from the road camera to the driving model frame, without the debayer scaling
+mat3 model_transform_from_calibration(const float extrinsic_matrix[3*4]);
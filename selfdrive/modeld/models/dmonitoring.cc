@@ -1,22 +1,24 @@
 #include <string.h>
+#include <algorithm>
 #include "dmonitoring.h"
 #include "common/mat.h"
 #include "common/timing.h"
 #include "common/params.h"
-
-#include <libyuv.h>
+#include "common/clutil.h"
 
 #define MODEL_WIDTH 320
 #define MODEL_HEIGHT 640
 #define FULL_W 852 // should get these numbers from camerad
 
 #if defined(QCOM) || defined(QCOM2)
-#define input_lambda(x) (x - 128.f) * 0.0078125f
+#define NORMALIZE_INPUT true
 #else
-#define input_lambda(x) x // for non SNPE running platforms, assume keras model instead has lambda layer
+#define NORMALIZE_INPUT false // for non SNPE running platforms, assume keras model instead has lambda layer
 #endif
 
-void dmonitoring_init(DMonitoringModelState* s) {
+#define NET_INPUT_SIZE ((MODEL_WIDTH/2) * (MODEL_HEIGHT/2) * 6) // Y|u|v -> y|y|y|y|u|v
+
+void dmonitoring_init(DMonitoringModelState* s, cl_device_id device_id, cl_context context) {
 #if defined(QCOM) || defined(QCOM2)
   const char* model_path = "../../models/dmonitoring_model_q.dlc";
 #else
@@ -26,27 +28,15 @@ void dmonitoring_init(DMonitoringModelState* s) {
   int runtime = USE_DSP_RUNTIME;
   s->m = new DefaultRunModel(model_path, (float*)&s->output, OUTPUT_SIZE, runtime);
   s->is_rhd = Params().read_db_bool("IsRHD");
-}
 
-template <class T>
-static inline T *get_buffer(std::vector<T> &buf, const size_t size) {
-  if (buf.size() < size) buf.resize(size);
-  return buf.data();
+  s->device_id = device_id;
+  s->context = context;
+  s->q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+  s->crop_ready = false;
+  shared_input_init(&s->net_input, context, NET_INPUT_SIZE, 1);
 }
 
-static inline auto get_yuv_buf(std::vector<uint8_t> &buf, const int width, int height) {
-  uint8_t *y = get_buffer(buf, width * height * 3 / 2);
-  uint8_t *u = y + width * height;
-  uint8_t *v = u + (width /2) * (height / 2);
-  return std::make_tuple(y, u, v);
-}
-
-DMonitoringResult dmonitoring_eval_frame(DMonitoringModelState* s, void* stream_buf, int width, int height) {
-  uint8_t *raw_buf = (uint8_t*) stream_buf;
-  uint8_t *raw_y_buf = raw_buf;
-  uint8_t *raw_u_buf = raw_y_buf + (width * height);
-  uint8_t *raw_v_buf = raw_u_buf + ((width/2) * (height/2));
-
+static void crop_init(DMonitoringModelState* s, int width, int height) {
 #ifndef QCOM2
   const int cropped_width = height/2;
   const int cropped_height = height;
@@ -67,80 +57,37 @@ DMonitoringResult dmonitoring_eval_frame(DMonitoringModelState* s, void* stream_
   const int crop_y_offset = -196;
 #endif
 
-  int resized_width = MODEL_WIDTH;
-  int resized_height = MODEL_HEIGHT;
-
-  auto [cropped_y_buf, cropped_u_buf, cropped_v_buf] = get_yuv_buf(s->cropped_buf, cropped_width, cropped_height);
-  if (!s->is_rhd) {
-    for (int r = 0; r < cropped_height/2; r++) {
-      memcpy(cropped_y_buf + 2*r*cropped_width, raw_y_buf + (2*r + global_y_offset + crop_y_offset)*width + global_x_offset + crop_x_offset, cropped_width);
-      memcpy(cropped_y_buf + (2*r+1)*cropped_width, raw_y_buf + (2*r + global_y_offset + crop_y_offset + 1)*width + global_x_offset + crop_x_offset, cropped_width);
-      memcpy(cropped_u_buf + r*(cropped_width/2), raw_u_buf + (r + (global_y_offset + crop_y_offset)/2)*width/2 + (global_x_offset + crop_x_offset)/2, cropped_width/2);
-      memcpy(cropped_v_buf + r*(cropped_width/2), raw_v_buf + (r + (global_y_offset + crop_y_offset)/2)*width/2 + (global_x_offset + crop_x_offset)/2, cropped_width/2);
-    }
-  } else {
-    auto [premirror_cropped_y_buf, premirror_cropped_u_buf, premirror_cropped_v_buf] = get_yuv_buf(s->premirror_cropped_buf, cropped_width, cropped_height);
-    for (int r = 0; r < cropped_height/2; r++) {
-      memcpy(premirror_cropped_y_buf + (2*r)*cropped_width, raw_y_buf + (2*r + global_y_offset + crop_y_offset)*width + global_x_offset, cropped_width);
-      memcpy(premirror_cropped_y_buf + (2*r+1)*cropped_width, raw_y_buf + (2*r + global_y_offset + crop_y_offset + 1)*width + global_x_offset, cropped_width);
-      memcpy(premirror_cropped_u_buf + r*(cropped_width/2), raw_u_buf + (r + (global_y_offset + crop_y_offset)/2)*width/2 + global_x_offset/2, cropped_width/2);
-      memcpy(premirror_cropped_v_buf + r*(cropped_width/2), raw_v_buf + (r + (global_y_offset + crop_y_offset)/2)*width/2 + global_x_offset/2, cropped_width/2);
-    }
-    libyuv::I420Mirror(premirror_cropped_y_buf, cropped_width,
-                       premirror_cropped_u_buf, cropped_width/2,
-                       premirror_cropped_v_buf, cropped_width/2,
-                       cropped_y_buf, cropped_width,
-                       cropped_u_buf, cropped_width/2,
-                       cropped_v_buf, cropped_width/2,
-                       cropped_width, cropped_height);
-  }
+  // rhd drivers sit on the other side of the frame, mirrored to look like lhd ones
+  const int crop_x = global_x_offset + (s->is_rhd ? 0 : crop_x_offset);
+  const int crop_y = global_y_offset + crop_y_offset;
+  dmonitoring_crop_init(&s->crop, s->context, s->device_id, width, height,
+                        crop_x, crop_y, cropped_width, cropped_height, s->is_rhd,
+                        MODEL_WIDTH, MODEL_HEIGHT, NORMALIZE_INPUT);
+  s->crop_ready = true;
+}
 
-  auto [resized_y_buf, resized_u_buf, resized_v_buf] = get_yuv_buf(s->resized_buf, resized_width, resized_height);
-  libyuv::FilterMode mode = libyuv::FilterModeEnum::kFilterBilinear;
-  libyuv::I420Scale(cropped_y_buf, cropped_width,
-                    cropped_u_buf, cropped_width/2,
-                    cropped_v_buf, cropped_width/2,
-                    cropped_width, cropped_height,
-                    resized_y_buf, resized_width,
-                    resized_u_buf, resized_width/2,
-                    resized_v_buf, resized_width/2,
-                    resized_width, resized_height,
-                    mode);
-
-  // prerotate to be cache aware
-  auto [resized_buf_rot, resized_u_buf_rot, resized_v_buf_rot] = get_yuv_buf(s->resized_buf_rot, resized_width, resized_height);
-  uint8_t *resized_y_buf_rot = resized_buf_rot;
-  libyuv::I420Rotate(resized_y_buf, resized_width,
-                     resized_u_buf, resized_width/2,
-                     resized_v_buf, resized_width/2,
-                     resized_y_buf_rot, resized_height,
-                     resized_u_buf_rot, resized_height/2,
-                     resized_v_buf_rot, resized_height/2,
-                     // negative height causes a vertical flip to match previous
-                     resized_width, -resized_height, libyuv::kRotate90);
-
-  int yuv_buf_len = (MODEL_WIDTH/2) * (MODEL_HEIGHT/2) * 6; // Y|u|v -> y|y|y|y|u|v
-  float *net_input_buf = get_buffer(s->net_input_buf, yuv_buf_len);
-  // one shot conversion, O(n) anyway
-  // yuvframe2tensor, normalize
-  for (int c = 0; c < MODEL_WIDTH/2; c++) {
-    for (int r = 0; r < MODEL_HEIGHT/2; r++) {
-      // Y_ul
-      net_input_buf[(c*MODEL_HEIGHT/2) + r + (0*(MODEL_WIDTH/2)*(MODEL_HEIGHT/2))] = input_lambda(resized_buf_rot[(2*r) + (2*c)*resized_height]);
-      // Y_dl
-      net_input_buf[(c*MODEL_HEIGHT/2) + r + (1*(MODEL_WIDTH/2)*(MODEL_HEIGHT/2))] = input_lambda(resized_buf_rot[(2*r+1) + (2*c)*resized_height]);
-      // Y_ur
-      net_input_buf[(c*MODEL_HEIGHT/2) + r + (2*(MODEL_WIDTH/2)*(MODEL_HEIGHT/2))] = input_lambda(resized_buf_rot[(2*r) + (2*c+1)*resized_height]);
-      // Y_dr
-      net_input_buf[(c*MODEL_HEIGHT/2) + r + (3*(MODEL_WIDTH/2)*(MODEL_HEIGHT/2))] = input_lambda(resized_buf_rot[(2*r+1) + (2*c+1)*resized_height]);
-      // U
-      net_input_buf[(c*MODEL_HEIGHT/2) + r + (4*(MODEL_WIDTH/2)*(MODEL_HEIGHT/2))] = input_lambda(resized_buf_rot[(resized_width*resized_height) + r + (c*resized_height/2)]);
-      // V
-      net_input_buf[(c*MODEL_HEIGHT/2) + r + (5*(MODEL_WIDTH/2)*(MODEL_HEIGHT/2))] = input_lambda(resized_buf_rot[(resized_width*resized_height) + ((resized_width/2)*(resized_height/2)) + r + (c*resized_height/2)]);
-    }
+DMonitoringResult dmonitoring_eval_frame(DMonitoringModelState* s, VisionBuf *buf) {
+  const int width = buf->width, height = buf->height;
+  if (s->crop_ready && (s->crop.in_width != width || s->crop.in_height != height)) {
+    dmonitoring_crop_destroy(&s->crop);
+    s->crop_ready = false;
+  }
+  if (!s->crop_ready) {
+    crop_init(s, width, height);
   }
 
-  //printf("preprocess completed. %d \n", yuv_buf_len);
+  // the crop's rows of the Y plane and the half as many of U and V
+  const int uv_first = s->crop.crop_y / 2;
+  const int uv_rows = std::min((s->crop.crop_y + s->crop.crop_height + 1) / 2, height / 2) - uv_first;
+  buf->sync_rows(VISIONBUF_SYNC_TO_DEVICE, 0, s->crop.crop_y, s->crop.crop_height);
+  buf->sync_rows(VISIONBUF_SYNC_TO_DEVICE, 1, uv_first, uv_rows);
+  buf->sync_rows(VISIONBUF_SYNC_TO_DEVICE, 2, uv_first, uv_rows);
+
+  // crop, mirror, scale, transpose and normalize in one pass on the gpu
+  dmonitoring_crop_queue(&s->crop, s->q, buf->buf_cl, s->net_input.slots[0]);
+  float *net_input_buf = shared_input_sync(&s->net_input, s->q, 0);
+
+  //printf("preprocess completed. %d \n", NET_INPUT_SIZE);
   //FILE *dump_yuv_file = fopen("/tmp/rawdump.yuv", "wb");
   //fwrite(raw_buf, height*width*3/2, sizeof(uint8_t), dump_yuv_file);
   //fclose(dump_yuv_file);
@@ -154,7 +101,7 @@ DMonitoringResult dmonitoring_eval_frame(DMonitoringModelState* s, void* stream_
   //fclose(dump_yuv_file2);
 
   double t1 = millis_since_boot();
-  s->m->execute(net_input_buf, yuv_buf_len);
+  s->m->execute(net_input_buf, NET_INPUT_SIZE);
   double t2 = millis_since_boot();
 
   DMonitoringResult ret = {0};
@@ -177,11 +124,12 @@ DMonitoringResult dmonitoring_eval_frame(DMonitoringModelState* s, void* stream_
   return ret;
 }
 
-void dmonitoring_publish(PubMaster &pm, uint32_t frame_id, const DMonitoringResult &res, const float* raw_pred, float execution_time){
+void dmonitoring_publish(PubMaster &pm, uint32_t frame_id, int frame_interval, const DMonitoringResult &res, const float* raw_pred, float execution_time){
   // make msg
   MessageBuilder msg;
   auto framed = msg.initEvent().initDriverState();
   framed.setFrameId(frame_id);
+  framed.setFrameInterval(frame_interval);
   framed.setModelExecutionTime(execution_time);
   framed.setDspExecutionTime(res.dsp_execution_time);
 
@@ -204,4 +152,9 @@ void dmonitoring_publish(PubMaster &pm, uint32_t frame_id, const DMonitoringResu
 
 void dmonitoring_free(DMonitoringModelState* s) {
   delete s->m;
+  if (s->crop_ready) {
+    dmonitoring_crop_destroy(&s->crop);
+  }
+  shared_input_free(&s->net_input);
+  CL_CHECK(clReleaseCommandQueue(s->q));
 }
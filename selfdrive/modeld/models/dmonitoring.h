@@ -3,6 +3,8 @@
 #include "common/util.h"
 #include "commonmodel.h"
 #include "runners/run.h"
+#include "transforms/dmonitoring_crop.h"
+#include "visionbuf.h"
 #include "messaging.hpp"
 
 #define OUTPUT_SIZE 34
@@ -25,15 +27,20 @@ typedef struct DMonitoringModelState {
   RunModel *m;
   bool is_rhd;
   float output[OUTPUT_SIZE];
-  std::vector<uint8_t> resized_buf;
-  std::vector<uint8_t> resized_buf_rot;
-  std::vector<uint8_t> cropped_buf;
-  std::vector<uint8_t> premirror_cropped_buf;
-  std::vector<float> net_input_buf;
+
+  cl_device_id device_id;
+  cl_context context;
+  cl_command_queue q;
+  // Set up on the first frame, once the frame size is known
+  bool crop_ready;
+  DMonitoringCropState crop;
+  SharedInput net_input;  // one slot, the crop writes it in place
 } DMonitoringModelState;
 
-void dmonitoring_init(DMonitoringModelState* s);
-DMonitoringResult dmonitoring_eval_frame(DMonitoringModelState* s, void* stream_buf, int width, int height);
-void dmonitoring_publish(PubMaster &pm, uint32_t frame_id, const DMonitoringResult &res, const float* raw_pred, float execution_time);
+void dmonitoring_init(DMonitoringModelState* s, cl_device_id device_id, cl_context context);
+// Syncs only the rows of the frame the crop reads, buf comes from a lazy_sync client
+DMonitoringResult dmonitoring_eval_frame(DMonitoringModelState* s, VisionBuf *buf);
+// frame_interval is the camera frames the result stands for, the model ran on every frame_interval-th
+void dmonitoring_publish(PubMaster &pm, uint32_t frame_id, int frame_interval, const DMonitoringResult &res, const float* raw_pred, float execution_time);
 void dmonitoring_free(DMonitoringModelState* s);
 
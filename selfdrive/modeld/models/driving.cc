@@ -13,9 +13,8 @@
 constexpr int DESIRE_PRED_SIZE = 32;
 constexpr int OTHER_META_SIZE = 4;
 
-constexpr int MODEL_WIDTH = 512;
-constexpr int MODEL_HEIGHT = 256;
-constexpr int MODEL_FRAME_SIZE = MODEL_WIDTH * MODEL_HEIGHT * 3 / 2;
+constexpr int MODEL_WIDTH = DRIVING_MODEL_WIDTH;
+constexpr int MODEL_HEIGHT = DRIVING_MODEL_HEIGHT;
 
 constexpr int PLAN_MHP_N = 5;
 constexpr int PLAN_MHP_COLUMNS = 30;
@@ -30,6 +29,9 @@ constexpr int LEAD_MHP_GROUP_SIZE = (2*LEAD_MHP_VALS + LEAD_MHP_SELECTION);
 
 constexpr int POSE_SIZE = 12;
 
+// modelV2 is built in place in the msgq buffer, this fits it including the raw predictions
+constexpr size_t MODEL_V2_MAX_SIZE = 128 * 1024;
+
 constexpr int PLAN_IDX = 0;
 constexpr int LL_IDX = PLAN_IDX + PLAN_MHP_N*PLAN_MHP_GROUP_SIZE;
 constexpr int LL_PROB_IDX = LL_IDX + 4*2*2*33;
@@ -48,12 +50,18 @@ constexpr int OUTPUT_SIZE =  POSE_IDX + POSE_SIZE;
 
 // #define DUMP_YUV
 
-void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
-  frame_init(&s->frame, MODEL_WIDTH, MODEL_HEIGHT, device_id, context);
-  s->input_frames = std::make_unique<float[]>(MODEL_FRAME_SIZE * 2);
+void model_init(ModelState* s, cl_device_id device_id, cl_context context, int num_cameras) {
+  assert(num_cameras > 0 && num_cameras <= MODEL_MAX_CAMERAS);
+  s->num_cameras = num_cameras;
+  for (int i = 0; i < num_cameras; i++) {
+    frame_init(&s->cameras[i].frame, MODEL_WIDTH, MODEL_HEIGHT, device_id, context);
+    s->cameras[i].q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+  }
+  shared_input_init(&s->input_frames, context, MODEL_FRAME_SIZE, MODEL_INPUT_RING_FRAMES);
 
   constexpr int output_size = OUTPUT_SIZE + TEMPORAL_SIZE;
   s->output = std::make_unique<float[]>(output_size);
+  s->output_size = output_size;
   memset(&s->output[0], 0, output_size*sizeof(float));
 
 #if defined(QCOM) || defined(QCOM2)
@@ -75,12 +83,23 @@ void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
   s->traffic_convention[idx] = 1.0;
   s->m->addTrafficConvention(s->traffic_convention, TRAFFIC_CONVENTION_LEN);
 #endif
+}
 
-  s->q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+// Where the next frame goes. The model window slides forward through the ring instead of shifting
+// the previous frame down, it's only copied back to the start once the ring wraps
+static int model_next_slot(ModelState* s) {
+  if (s->input_frame_idx + 1 == MODEL_INPUT_RING_FRAMES) {
+    memcpy(&s->input_frames.host[0], &s->input_frames.host[s->input_frame_idx * MODEL_FRAME_SIZE], sizeof(float)*MODEL_FRAME_SIZE);
+    s->input_frame_idx = 0;
+  }
+  return s->input_frame_idx + 1;
 }
 
-ModelDataRaw model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int height,
-                           const mat3 &transform, float *desire_in) {
+static float *model_next_frame(ModelState* s) {
+  return &s->input_frames.host[model_next_slot(s) * MODEL_FRAME_SIZE];
+}
+
+static ModelDataRaw model_eval(ModelState* s, const float *new_frame_buf, float *desire_in) {
 #ifdef DESIRE
   if (desire_in != NULL) {
     for (int i = 1; i < DESIRE_LEN; i++) {
@@ -98,10 +117,12 @@ ModelDataRaw model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int heigh
 
   //for (int i = 0; i < OUTPUT_SIZE + TEMPORAL_SIZE; i++) { printf("%f ", s->output[i]); } printf("\n");
 
-  float *new_frame_buf = frame_prepare(&s->frame, s->q, yuv_cl, width, height, transform);
-  memmove(&s->input_frames[0], &s->input_frames[MODEL_FRAME_SIZE], sizeof(float)*MODEL_FRAME_SIZE);
-  memmove(&s->input_frames[MODEL_FRAME_SIZE], new_frame_buf, sizeof(float)*MODEL_FRAME_SIZE);
-  s->m->execute(&s->input_frames[0], MODEL_FRAME_SIZE*2);
+  float *next_frame = model_next_frame(s);
+  if (new_frame_buf != next_frame) {
+    memcpy(next_frame, new_frame_buf, sizeof(float)*MODEL_FRAME_SIZE);
+  }
+  s->m->execute(next_frame - MODEL_FRAME_SIZE, MODEL_FRAME_SIZE*2);
+  s->input_frame_idx++;
 
   #ifdef DUMP_YUV
     FILE *dump_yuv_file = fopen("/sdcard/dump.yuv", "wb");
@@ -110,8 +131,6 @@ ModelDataRaw model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int heigh
     assert(1==2);
   #endif
 
-  clEnqueueUnmapMemObject(s->q, s->frame.net_input, (void*)new_frame_buf, 0, NULL, NULL);
-
   // net outputs
   ModelDataRaw net_outputs;
   net_outputs.plan = &s->output[PLAN_IDX];
@@ -125,9 +144,65 @@ ModelDataRaw model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int heigh
   return net_outputs;
 }
 
+ModelDataRaw model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int height,
+                           const mat3 &transform, float *desire_in) {
+  // warp the frame straight into the model window's next slot, no read back
+  int slot = model_next_slot(s);
+  ModelCamera &road = s->cameras[0];
+  frame_queue(&road.frame, road.q, yuv_cl, width, height, transform, s->input_frames.slots[slot]);
+  return model_eval(s, shared_input_sync(&s->input_frames, road.q, slot), desire_in);
+}
+
+ModelDataRaw model_eval_tensor(ModelState* s, const float *frame, float *desire_in) {
+  return model_eval(s, frame, desire_in);
+}
+
+void model_prepare_frame(ModelState* s, cl_mem yuv_cl, int width, int height, const mat3 &transform, float *out,
+                         FrameTiming *timing) {
+  assert(s->num_cameras == 1);
+  const ModelCameraFrame frame = {yuv_cl, width, height, transform, out};
+  model_prepare_frames(s, &frame, timing);
+}
+
+void model_prepare_frames(ModelState* s, const ModelCameraFrame *frames, FrameTiming *timing) {
+  // every camera is queued and flushed before waiting on any
+  cl_event reads[MODEL_MAX_CAMERAS];
+  for (int i = 0; i < s->num_cameras; i++) {
+    ModelCamera &c = s->cameras[i];
+    const ModelCameraFrame &f = frames[i];
+    frame_queue(&c.frame, c.q, f.yuv_cl, f.width, f.height, f.transform, c.frame.net_input);
+    CL_CHECK(clEnqueueReadBuffer(c.q, c.frame.net_input, CL_FALSE, 0, MODEL_FRAME_SIZE * sizeof(float), f.out, 0, NULL, &reads[i]));
+    CL_CHECK(clFlush(c.q));
+  }
+  if (timing) timing->enqueued = millis_since_boot();
+  CL_CHECK(clWaitForEvents(s->num_cameras, reads));
+  for (int i = 0; i < s->num_cameras; i++) {
+    CL_CHECK(clReleaseEvent(reads[i]));
+  }
+  if (timing) timing->prepared = millis_since_boot();
+}
+
 void model_free(ModelState* s) {
-  frame_free(&s->frame);
-  CL_CHECK(clReleaseCommandQueue(s->q));
+  for (int i = 0; i < s->num_cameras; i++) {
+    frame_free(&s->cameras[i].frame);
+    CL_CHECK(clReleaseCommandQueue(s->cameras[i].q));
+  }
+  shared_input_free(&s->input_frames);
+}
+
+mat3 model_camera_transform(const float extrinsic_matrix[3*4]) {
+#ifndef QCOM2
+  float db_s = 0.5; // debayering does a 2x downscale
+#else
+  float db_s = 1.0;
+#endif
+
+  mat3 yuv_transform = transform_scale_buffer((mat3){{
+    1.0, 0.0, 0.0,
+    0.0, 1.0, 0.0,
+    0.0, 0.0, 1.0,
+  }}, db_s);
+  return matmul3(yuv_transform, model_transform_from_calibration(extrinsic_matrix));
 }
 
 static const float *get_best_data(const float *data, int size, int group_size, int offset) {
@@ -150,17 +225,25 @@ static const float *get_lead_data(const float *lead, int t_offset) {
 }
 
 
+// the index columns as float32, converted once
+struct TrajectoryIdxs {
+  float t[TRAJECTORY_SIZE], x[TRAJECTORY_SIZE];
+  TrajectoryIdxs() {
+    for (int i = 0; i < TRAJECTORY_SIZE; i++) {
+      t[i] = T_IDXS[i];
+      x[i] = X_IDXS[i];
+    }
+  }
+};
+static const TrajectoryIdxs trajectory_idxs;
+
 void fill_lead_v2(cereal::ModelDataV2::LeadDataV2::Builder lead, const float *lead_data, const float *prob, int t_offset, float t) {
   const float *data = get_lead_data(lead_data, t_offset);
   lead.setProb(sigmoid(prob[t_offset]));
   lead.setT(t);
-  float xyva_arr[LEAD_MHP_VALS];
   float xyva_stds_arr[LEAD_MHP_VALS];
-  for (int i=0; i<LEAD_MHP_VALS; i++) {
-    xyva_arr[i] = data[i];
-    xyva_stds_arr[i] = exp(data[LEAD_MHP_VALS + i]);
-  }
-  lead.setXyva(xyva_arr);
+  exp_n(&data[LEAD_MHP_VALS], xyva_stds_arr, LEAD_MHP_VALS);
+  lead.setXyva(kj::arrayPtr(data, LEAD_MHP_VALS));
   lead.setXyvaStd(xyva_stds_arr);
 }
 
@@ -168,54 +251,34 @@ template <class MetaBuilder>
 void fill_meta(MetaBuilder meta, const float *meta_data) {
   float desire_state_softmax[DESIRE_LEN];
   float desire_pred_softmax[4*DESIRE_LEN];
+  float probs[OTHER_META_SIZE];
   softmax(&meta_data[0], desire_state_softmax, DESIRE_LEN);
   for (int i=0; i<4; i++) {
     softmax(&meta_data[DESIRE_LEN + OTHER_META_SIZE + i*DESIRE_LEN],
             &desire_pred_softmax[i*DESIRE_LEN], DESIRE_LEN);
   }
+  sigmoid_n(&meta_data[DESIRE_LEN], probs, OTHER_META_SIZE);
   meta.setDesireState(desire_state_softmax);
-  meta.setEngagedProb(sigmoid(meta_data[DESIRE_LEN]));
-  meta.setGasDisengageProb(sigmoid(meta_data[DESIRE_LEN + 1]));
-  meta.setBrakeDisengageProb(sigmoid(meta_data[DESIRE_LEN + 2]));
-  meta.setSteerOverrideProb(sigmoid(meta_data[DESIRE_LEN + 3]));
+  meta.setEngagedProb(probs[0]);
+  meta.setGasDisengageProb(probs[1]);
+  meta.setBrakeDisengageProb(probs[2]);
+  meta.setSteerOverrideProb(probs[3]);
   meta.setDesirePrediction(desire_pred_softmax);
 }
 
+// Writes straight into the message's lists. The stds aren't published
 void fill_xyzt(cereal::ModelDataV2::XYZTData::Builder xyzt, const float * data,
-               int columns, int column_offset, float * plan_t_arr) {
-  float x_arr[TRAJECTORY_SIZE] = {};
-  float y_arr[TRAJECTORY_SIZE] = {};
-  float z_arr[TRAJECTORY_SIZE] = {};
-  //float x_std_arr[TRAJECTORY_SIZE];
-  //float y_std_arr[TRAJECTORY_SIZE];
-  //float z_std_arr[TRAJECTORY_SIZE];
-  float t_arr[TRAJECTORY_SIZE];
+               int columns, int column_offset, const float * plan_t_arr) {
+  auto x = xyzt.initX(TRAJECTORY_SIZE);
+  auto y = xyzt.initY(TRAJECTORY_SIZE);
+  auto z = xyzt.initZ(TRAJECTORY_SIZE);
   for (int i=0; i<TRAJECTORY_SIZE; i++) {
     // column_offset == -1 means this data is X indexed not T indexed
-    if (column_offset >= 0) {
-      t_arr[i] = T_IDXS[i];
-      x_arr[i] = data[i*columns + 0 + column_offset];
-      //x_std_arr[i] = data[columns*(TRAJECTORY_SIZE + i) + 0 + column_offset];
-    } else {
-      t_arr[i] = plan_t_arr[i];
-      x_arr[i] = X_IDXS[i];
-      //x_std_arr[i] = NAN;
-    }
-    y_arr[i] = data[i*columns + 1 + column_offset];
-    //y_std_arr[i] = data[columns*(TRAJECTORY_SIZE + i) + 1 + column_offset];
-    z_arr[i] = data[i*columns + 2 + column_offset];
-    //z_std_arr[i] = data[columns*(TRAJECTORY_SIZE + i) + 2 + column_offset];
+    x.set(i, column_offset >= 0 ? data[i*columns + 0 + column_offset] : trajectory_idxs.x[i]);
+    y.set(i, data[i*columns + 1 + column_offset]);
+    z.set(i, data[i*columns + 2 + column_offset]);
   }
-  //kj::ArrayPtr<const float> x_std(x_std_arr, TRAJECTORY_SIZE);
-  //kj::ArrayPtr<const float> y_std(y_std_arr, TRAJECTORY_SIZE);
-  //kj::ArrayPtr<const float> z_std(z_std_arr, TRAJECTORY_SIZE);
-  xyzt.setX(x_arr);
-  xyzt.setY(y_arr);
-  xyzt.setZ(z_arr);
-  //xyzt.setXStd(x_std);
-  //xyzt.setYStd(y_std);
-  //xyzt.setZStd(z_std);
-  xyzt.setT(t_arr);
+  xyzt.setT(kj::arrayPtr(column_offset >= 0 ? trajectory_idxs.t : plan_t_arr, TRAJECTORY_SIZE));
 }
 
 void fill_model(cereal::ModelDataV2::Builder &framed, const ModelDataRaw &net_outputs) {
@@ -237,9 +300,10 @@ void fill_model(cereal::ModelDataV2::Builder &framed, const ModelDataRaw &net_ou
   float lane_line_stds_arr[4];
   for (int i = 0; i < 4; i++) {
     fill_xyzt(lane_lines[i], &net_outputs.lane_lines[i*TRAJECTORY_SIZE*2], 2, -1, plan_t_arr);
-    lane_line_probs_arr[i] = sigmoid(net_outputs.lane_lines_prob[i]);
-    lane_line_stds_arr[i] = exp(net_outputs.lane_lines[2*TRAJECTORY_SIZE*(4 + i)]);
+    lane_line_stds_arr[i] = net_outputs.lane_lines[2*TRAJECTORY_SIZE*(4 + i)];
   }
+  sigmoid_n(net_outputs.lane_lines_prob, lane_line_probs_arr, 4);
+  exp_n(lane_line_stds_arr, lane_line_stds_arr, 4);
   framed.setLaneLineProbs(lane_line_probs_arr);
   framed.setLaneLineStds(lane_line_stds_arr);
 
@@ -265,20 +329,35 @@ void fill_model(cereal::ModelDataV2::Builder &framed, const ModelDataRaw &net_ou
 
 void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
                    const ModelDataRaw &net_outputs, const float *raw_pred, uint64_t timestamp_eof,
-                   float model_execution_time) {
+                   float model_execution_time, const FrameTiming &timing, float frequency, bool emergency) {
   const uint32_t frame_age = (frame_id > vipc_frame_id) ? (frame_id - vipc_frame_id) : 0;
-  MessageBuilder msg;
+  InPlaceMessageBuilder msg(pm, "modelV2", MODEL_V2_MAX_SIZE);
   auto framed = msg.initEvent().initModelV2();
   framed.setFrameId(vipc_frame_id);
   framed.setFrameAge(frame_age);
   framed.setFrameDropPerc(frame_drop * 100);
   framed.setTimestampEof(timestamp_eof);
   framed.setModelExecutionTime(model_execution_time);
+  framed.setFrequency(frequency);
+  framed.setEmergency(emergency);
   if (send_raw_pred) {
     framed.setRawPred(kj::arrayPtr((const uint8_t *)raw_pred, (OUTPUT_SIZE + TEMPORAL_SIZE) * sizeof(float)));
   }
   fill_model(framed, net_outputs);
-  pm.send("modelV2", msg);
+
+  const double parsed = millis_since_boot();
+  const double eof = timestamp_eof / 1e6;
+  auto t = framed.initTiming();
+  t.setFrameAge(timing.recv - eof);
+  t.setFrameWait(timing.ready - timing.recv);
+  t.setTransformEnqueue(timing.enqueued - timing.ready);
+  t.setTransformGpu(timing.prepared - timing.enqueued);
+  t.setQueueWait(timing.model_start - timing.prepared);
+  t.setExecute(timing.model_end - timing.model_start);
+  t.setParse(parsed - timing.model_end);
+  t.setPrevPublish(timing.prev_publish);
+  t.setTotal(parsed - eof);
+  msg.commit();
 }
 
 void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_dropped_frames,
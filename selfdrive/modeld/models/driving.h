@@ -18,6 +18,11 @@
 constexpr int DESIRE_LEN = 8;
 constexpr int TRAFFIC_CONVENTION_LEN = 2;
 constexpr int MODEL_FREQ = 20;
+constexpr int MODEL_FRAME_SIZE = DRIVING_MODEL_WIDTH * DRIVING_MODEL_HEIGHT * 3 / 2;
+// The model input is the previous and the new frame, kept in a ring of this many frames
+constexpr int MODEL_INPUT_RING_FRAMES = 8;
+// the road camera and, on tici, the wide one
+constexpr int MODEL_MAX_CAMERAS = 2;
 struct ModelDataRaw {
     float *plan;
     float *lane_lines;
@@ -32,12 +37,29 @@ struct ModelDataRaw {
   };
 
 
-typedef struct ModelState {
+// A camera the model takes, with its own warp and queue so the cameras of a bundle are prepared at once
+struct ModelCamera {
   ModelFrame frame;
+  cl_command_queue q;
+};
+
+// One camera's frame of a frameBundle, warped into out
+struct ModelCameraFrame {
+  cl_mem yuv_cl;
+  int width, height;
+  mat3 transform;
+  float *out;
+};
+
+typedef struct ModelState {
+  // the road camera first
+  ModelCamera cameras[MODEL_MAX_CAMERAS];
+  int num_cameras;
   std::unique_ptr<float[]> output;
-  std::unique_ptr<float[]> input_frames;
+  size_t output_size;  // floats, the outputs and the recurrent state
+  SharedInput input_frames;  // MODEL_INPUT_RING_FRAMES slots, the warp writes frames in place
+  int input_frame_idx = 0;  // slot of the newest frame in input_frames
   std::unique_ptr<RunModel> m;
-  cl_command_queue q;
 #ifdef DESIRE
   float prev_desire[DESIRE_LEN] = {};
   float pulse_desire[DESIRE_LEN] = {};
@@ -47,13 +69,32 @@ typedef struct ModelState {
 #endif
 } ModelState;
 
-void model_init(ModelState* s, cl_device_id device_id, cl_context context);
+// When a frame reached each stage of modeld, millis_since_boot. Published as modelV2.timing
+struct FrameTiming {
+  double recv = 0, ready = 0, enqueued = 0, prepared = 0;
+  double model_start = 0, model_end = 0;
+  double prev_publish = 0;  // ms, sending the previous frame's messages
+};
+
+void model_init(ModelState* s, cl_device_id device_id, cl_context context, int num_cameras = 1);
 ModelDataRaw model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int height,
                            const mat3 &transform, float *desire_in);
+// Runs on a frame that is already in the model input layout, from model_prepare_frame or camerad's MODEL_TENSOR_STREAM
+ModelDataRaw model_eval_tensor(ModelState* s, const float *frame, float *desire_in);
+// Warps a camera frame into the model input layout, MODEL_FRAME_SIZE floats. Uses its own queue, so it can run while the model executes.
+// Sets timing's enqueued and prepared if given
+void model_prepare_frame(ModelState* s, cl_mem yuv_cl, int width, int height, const mat3 &transform, float *out,
+                         FrameTiming *timing = nullptr);
+// The same for the frames of a bundle, one per camera in order. They're warped side by side, each on
+// its camera's queue, so the wait is the slowest camera's rather than all of theirs
+void model_prepare_frames(ModelState* s, const ModelCameraFrame *frames, FrameTiming *timing = nullptr);
 void model_free(ModelState* s);
+// Warp from the camera frame modeld gets over VisionIPC to the model frame, for liveCalibration's extrinsic matrix
+mat3 model_camera_transform(const float extrinsic_matrix[3*4]);
+void fill_model(cereal::ModelDataV2::Builder &framed, const ModelDataRaw &net_outputs);
 void poly_fit(float *in_pts, float *in_stds, float *out);
 void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
                    const ModelDataRaw &net_outputs, const float *raw_pred, uint64_t timestamp_eof,
-                   float model_execution_time);
+                   float model_execution_time, const FrameTiming &timing, float frequency, bool emergency);
 void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_dropped_frames,
                      const ModelDataRaw &net_outputs, uint64_t timestamp_eof);
@@ -0,0 +1,111 @@
+#include "onnxruntimemodel.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include "common/swaglog.h"
+
+static std::vector<int64_t> tensor_shape(const Ort::TypeInfo &info) {
+  std::vector<int64_t> shape = info.GetTensorTypeAndShapeInfo().GetShape();
+  for (auto &d : shape) {
+    if (d < 0) d = 1;  // the batch
+  }
+  return shape;
+}
+
+static size_t shape_size(const std::vector<int64_t> &shape) {
+  size_t size = 1;
+  for (auto d : shape) size *= d;
+  return size;
+}
+
+OnnxRuntimeModel::OnnxRuntimeModel(const char *path, float *_output, size_t _output_size, int runtime)
+    : env(ORT_LOGGING_LEVEL_WARNING, "modeld"),
+      memory_info(Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault)) {
+  output = _output;
+  output_size = _output_size;
+
+  std::string onnx_path = path;
+  onnx_path = onnx_path.substr(0, onnx_path.rfind(".dlc")) + ".onnx";
+
+  Ort::SessionOptions options;
+  options.SetIntraOpNumThreads(4);
+  options.SetInterOpNumThreads(8);
+  options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+
+  const char *provider = getenv("ONNX_PROVIDER");
+  if (provider != NULL && strcmp(provider, "tensorrt") == 0) {
+    OrtTensorRTProviderOptions trt_options{};
+    options.AppendExecutionProvider_TensorRT(trt_options);
+  }
+  if (provider != NULL && (strcmp(provider, "cuda") == 0 || strcmp(provider, "tensorrt") == 0)) {
+    // TensorRT hands what it can't run to CUDA
+    OrtCUDAProviderOptions cuda_options{};
+    options.AppendExecutionProvider_CUDA(cuda_options);
+  }
+  LOGD("loading model %s with %s", onnx_path.c_str(), provider != NULL ? provider : "cpu");
+
+  session = std::make_unique<Ort::Session>(env, onnx_path.c_str(), options);
+  binding = std::make_unique<Ort::IoBinding>(*session);
+
+  Ort::AllocatorWithDefaultOptions allocator;
+  for (size_t i = 0; i < session->GetInputCount(); i++) {
+    input_names.push_back(session->GetInputNameAllocated(i, allocator).get());
+    input_shapes.push_back(tensor_shape(session->GetInputTypeInfo(i)));
+  }
+  assert(input_names.size() <= 4);
+
+  // outputs go one after the other into output, as onnx_runner.py writes them
+  size_t offset = 0;
+  for (size_t i = 0; i < session->GetOutputCount(); i++) {
+    std::vector<int64_t> shape = tensor_shape(session->GetOutputTypeInfo(i));
+    size_t size = shape_size(shape);
+    assert(offset + size <= output_size);
+    values.push_back(Ort::Value::CreateTensor<float>(memory_info, output + offset, size, shape.data(), shape.size()));
+    binding->BindOutput(session->GetOutputNameAllocated(i, allocator).get(), values.back());
+    offset += size;
+  }
+}
+
+void OnnxRuntimeModel::addRecurrent(float *state, int state_size) {
+  inputs[3] = {state, state_size};
+}
+
+void OnnxRuntimeModel::addDesire(float *state, int state_size) {
+  inputs[1] = {state, state_size};
+}
+
+void OnnxRuntimeModel::addTrafficConvention(float *state, int state_size) {
+  inputs[2] = {state, state_size};
+}
+
+Ort::Value OnnxRuntimeModel::bind_input(int idx, float *buf, int size) {
+  assert(idx < input_names.size());
+  const auto &shape = input_shapes[idx];
+  assert(shape_size(shape) == size);
+  Ort::Value value = Ort::Value::CreateTensor<float>(memory_info, buf, size, shape.data(), shape.size());
+  binding->BindInput(input_names[idx].c_str(), value);
+  return value;
+}
+
+void OnnxRuntimeModel::execute(float *net_input_buf, int buf_size) {
+  if (!bound) {
+    // the extra inputs stay where they were added, the present ones are the model's inputs in order
+    int idx = 1;
+    for (int i = 1; i < 4; i++) {
+      if (inputs[i].buf != NULL) {
+        values.push_back(bind_input(idx++, inputs[i].buf, inputs[i].size));
+      }
+    }
+    bound = true;
+  }
+
+  // the frames move through a ring, so they're bound every time
+  if (inputs[0].buf != net_input_buf) {
+    inputs[0] = {net_input_buf, buf_size};
+    imgs_value = bind_input(0, net_input_buf, buf_size);
+  }
+
+  session->Run(Ort::RunOptions{nullptr}, *binding);
+}
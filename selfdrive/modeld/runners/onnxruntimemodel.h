@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <onnxruntime_cxx_api.h>
+
+#include "runmodel.h"
+
+// Runs the .onnx next to the model in process with ONNX Runtime. ONNX_PROVIDER picks the
+// execution provider: cpu (the default), cuda or tensorrt. Inputs and outputs are bound in place,
+// the runtime reads the callers' buffers and writes the output straight to it
+class OnnxRuntimeModel : public RunModel {
+public:
+  OnnxRuntimeModel(const char *path, float *output, size_t output_size, int runtime);
+  void addRecurrent(float *state, int state_size);
+  void addDesire(float *state, int state_size);
+  void addTrafficConvention(float *state, int state_size);
+  void execute(float *net_input_buf, int buf_size);
+
+private:
+  struct Input {
+    float *buf = nullptr;
+    int size = 0;
+  };
+  // in the order onnx_runner.py takes them: frames, desire, traffic convention, recurrent state
+  Input inputs[4];
+
+  float *output;
+  size_t output_size;
+
+  Ort::Env env;
+  std::unique_ptr<Ort::Session> session;
+  std::unique_ptr<Ort::IoBinding> binding;
+  Ort::MemoryInfo memory_info;
+  std::vector<std::string> input_names;
+  std::vector<std::vector<int64_t>> input_shapes;
+  // the tensors wrapping the buffers
+  std::vector<Ort::Value> values;
+  Ort::Value imgs_value{nullptr};
+  bool bound = false;
+
+  Ort::Value bind_input(int idx, float *buf, int size);
+};
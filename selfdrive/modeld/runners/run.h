@@ -7,7 +7,10 @@
   #include "thneedmodel.h"
   #define DefaultRunModel SNPEModel
 #else
-  #ifdef USE_ONNX_MODEL
+  #ifdef USE_ONNXRUNTIME
+    #include "onnxruntimemodel.h"
+    #define DefaultRunModel OnnxRuntimeModel
+  #elif defined(USE_ONNX_MODEL)
     #include "onnxmodel.h"
     #define DefaultRunModel ONNXModel
   #else
@@ -0,0 +1,86 @@
+#include "runmodel.h"
+
+#include <cassert>
+#include <cstring>
+
+RunModel::~RunModel() {
+  if (worker.joinable()) {
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      exit = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
+}
+
+void RunModel::bind(const ModelBinding &binding) {
+  assert(binding.host != nullptr || (binding.cl != nullptr && binding.q != nullptr && binding.name != MODEL_OUTPUT));
+  bound.push_back(Bound{binding, nullptr});
+  Bound &b = bound.back();
+  float *host = binding.host;
+  if (host == nullptr) {
+    b.staging = std::make_unique<float[]>(binding.size);
+    host = b.staging.get();
+  }
+
+  if (binding.name == MODEL_INPUT_DESIRE) {
+    addDesire(host, binding.size);
+  } else if (binding.name == MODEL_INPUT_TRAFFIC_CONVENTION) {
+    addTrafficConvention(host, binding.size);
+  } else if (binding.name == MODEL_INPUT_RECURRENT) {
+    addRecurrent(host, binding.size);
+  }
+
+  // pointers in bound move as it grows
+  imgs = nullptr;
+  for (auto &it : bound) {
+    if (it.binding.name == MODEL_INPUT_IMGS) imgs = &it;
+  }
+}
+
+void RunModel::run() {
+  assert(imgs != nullptr);
+  for (auto &b : bound) {
+    if (b.staging) {
+      cl_int err = clEnqueueReadBuffer(b.binding.q, b.binding.cl, CL_TRUE, 0, b.binding.size * sizeof(float), b.staging.get(), 0, NULL, NULL);
+      assert(err == CL_SUCCESS);
+    }
+  }
+
+  execute(imgs->staging ? imgs->staging.get() : imgs->binding.host, imgs->binding.size);
+
+  for (auto &b : bound) {
+    if (b.binding.name == MODEL_OUTPUT && b.binding.cl != nullptr) {
+      cl_int err = clEnqueueWriteBuffer(b.binding.q, b.binding.cl, CL_TRUE, 0, b.binding.size * sizeof(float), b.binding.host, 0, NULL, NULL);
+      assert(err == CL_SUCCESS);
+    }
+  }
+}
+
+std::shared_future<void> RunModel::execute_async() {
+  std::unique_lock<std::mutex> lk(lock);
+  assert(!pending);
+  if (!worker.joinable()) {
+    worker = std::thread(&RunModel::worker_loop, this);
+  }
+  pending = std::make_unique<std::promise<void>>();
+  std::shared_future<void> done = pending->get_future().share();
+  lk.unlock();
+  cv.notify_one();
+  return done;
+}
+
+void RunModel::worker_loop() {
+  std::unique_lock<std::mutex> lk(lock);
+  while (true) {
+    cv.wait(lk, [&] { return exit || pending; });
+    if (exit) break;
+
+    auto promise = std::move(pending);
+    lk.unlock();
+    run();
+    promise->set_value();
+    lk.lock();
+  }
+}
@@ -1,13 +1,72 @@
 #ifndef RUNMODEL_H
 #define RUNMODEL_H
 
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// names of the bindings, same as the inputs of addRecurrent() and friends, and the output
+#define MODEL_INPUT_IMGS "input_imgs"
+#define MODEL_INPUT_DESIRE "desire"
+#define MODEL_INPUT_TRAFFIC_CONVENTION "traffic_convention"
+#define MODEL_INPUT_RECURRENT "initial_state"
+#define MODEL_OUTPUT "outputs"
+
+// A named model input or output of size floats, read or written in place by every run(). It's in
+// host memory, or an OpenCL buffer that's read through q on backends that need the host. An
+// output is the host buffer the model was made with, it's also written to cl if there is one
+struct ModelBinding {
+  std::string name;
+  size_t size;
+  float *host = nullptr;
+  cl_mem cl = nullptr;
+  cl_command_queue q = nullptr;
+};
+
 class RunModel {
 public:
+  virtual ~RunModel();
   virtual void addRecurrent(float *state, int state_size) {}
   virtual void addDesire(float *state, int state_size) {}
   virtual void addTrafficConvention(float *state, int state_size) {}
   virtual void execute(float *net_input_buf, int buf_size) {}
+
+  // Memory the backend reads input name from, writing the input there instead saves copying it
+  // in. NULL if it has none
+  virtual float *inputBuffer(const char *name) { return NULL; }
+
+  // Bindings are set once, run() executes with whatever they hold
+  void bind(const ModelBinding &binding);
+  void run();
+  // run() on the model's own thread, the future is ready once the outputs are written. One at a
+  // time, the inputs mustn't change until it is
+  std::shared_future<void> execute_async();
+
+private:
+  struct Bound {
+    ModelBinding binding;
+    std::unique_ptr<float[]> staging;  // the host copy of cl inputs
+  };
+  std::vector<Bound> bound;
+  Bound *imgs = nullptr;
+
+  std::thread worker;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::unique_ptr<std::promise<void>> pending;
+  bool exit = false;
+  void worker_loop();
 };
 
 #endif
-
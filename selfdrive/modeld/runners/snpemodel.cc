@@ -16,7 +16,9 @@ SNPEModel::SNPEModel(const char *path, float *loutput, size_t loutput_size, int
   output_size = loutput_size;
 #if defined(QCOM) || defined(QCOM2)
   if (runtime==USE_GPU_RUNTIME) {
-    Runtime = zdl::DlSystem::Runtime_t::GPU;
+    // MODEL_FP16 runs the weights and activations in half precision on the Adreno, the inputs and
+    // outputs stay float32 so nothing around the model changes
+    Runtime = getenv("MODEL_FP16") ? zdl::DlSystem::Runtime_t::GPU_FLOAT16 : zdl::DlSystem::Runtime_t::GPU;
   } else if (runtime==USE_DSP_RUNTIME) {
     Runtime = zdl::DlSystem::Runtime_t::DSP;
   } else {
@@ -137,7 +139,7 @@ std::unique_ptr<zdl::DlSystem::IUserBuffer> SNPEModel::addExtra(float *state, in
 
 void SNPEModel::execute(float *net_input_buf, int buf_size) {
 #ifdef USE_THNEED
-  if (Runtime == zdl::DlSystem::Runtime_t::GPU) {
+  if (Runtime == zdl::DlSystem::Runtime_t::GPU || Runtime == zdl::DlSystem::Runtime_t::GPU_FLOAT16) {
     float *inputs[4] = {recurrent, trafficConvention, desire, net_input_buf};
     if (thneed == NULL) {
       assert(inputBuffer->setBufferAddress(net_input_buf));
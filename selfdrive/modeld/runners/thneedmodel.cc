@@ -1,5 +1,6 @@
 #include "thneedmodel.h"
 #include <assert.h>
+#include <string.h>
 
 ThneedModel::ThneedModel(const char *path, float *loutput, size_t loutput_size, int runtime) {
   thneed = new Thneed(true);
@@ -24,6 +25,15 @@ void ThneedModel::addDesire(float *state, int state_size) {
   desire = state;
 }
 
+float *ThneedModel::inputBuffer(const char *name) {
+  // the same order as the inputs in execute
+  const char *names[4] = {MODEL_INPUT_RECURRENT, MODEL_INPUT_TRAFFIC_CONVENTION, MODEL_INPUT_DESIRE, MODEL_INPUT_IMGS};
+  for (int i = 0; i < 4 && i < thneed->inputs.size(); i++) {
+    if (strcmp(name, names[i]) == 0) return (float *)thneed->inputs[i];
+  }
+  return NULL;
+}
+
 void ThneedModel::execute(float *net_input_buf, int buf_size) {
   float *inputs[4] = {recurrent, trafficConvention, desire, net_input_buf};
   if (!recorded) {
@@ -0,0 +1,217 @@
+// Runs a model through every runner built in, on the same inputs, and compares them. Run from selfdrive/modeld
+//   test/model_bench <supercombo|dmonitoring> [runner ...] [--inputs <file>] [--runs N]
+// The inputs file is the model's input buffers as float32 one after another, like DUMP_YUV writes
+// them, played in a loop. Without one they are random pixels. For each runner it prints the cold
+// start, the time to load the model and run it once, and the p50/p99 of the warm runs back to back
+// and paced at the rate modeld runs them, where the clocks are let down between runs. The
+// outputs of the first runs are compared against the first runner's
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/util.h"
+#include "runners/run.h"
+
+namespace {
+
+// the sizes models/driving.cc and models/dmonitoring.cc run them with
+struct ModelSpec {
+  const char *name;
+  const char *path;  // without the extension, each runner has its own
+  size_t input_size, output_size;
+  int temporal_size, desire_size, traffic_convention_size;
+  int runtime;
+  double freq;
+};
+
+const ModelSpec models[] = {
+  {"supercombo", "../../models/supercombo", 2 * 512 * 256 * 3 / 2, 10815 + 512, 512, 8, 2, USE_GPU_RUNTIME, 20},
+#if defined(QCOM) || defined(QCOM2)
+  {"dmonitoring", "../../models/dmonitoring_model_q", 160 * 320 * 6, 34, 0, 0, 0, USE_DSP_RUNTIME, 10},
+#else
+  {"dmonitoring", "../../models/dmonitoring_model", 160 * 320 * 6, 34, 0, 0, 0, USE_DSP_RUNTIME, 10},
+#endif
+};
+
+struct Runner {
+  const char *name;
+  const char *ext;
+  std::function<RunModel *(const char *path, float *output, size_t output_size, int runtime)> create;
+};
+
+template <class T>
+RunModel *create(const char *path, float *output, size_t output_size, int runtime) {
+  return new T(path, output, output_size, runtime);
+}
+
+const Runner runners[] = {
+#ifndef __APPLE__
+  {"snpe", ".dlc", create<SNPEModel>},
+#endif
+#if defined(QCOM) || defined(QCOM2)
+  {"thneed", ".thneed", create<ThneedModel>},
+#endif
+#ifdef USE_ONNXRUNTIME
+  {"onnxruntime", ".onnx", create<OnnxRuntimeModel>},
+#endif
+#ifdef USE_ONNX_MODEL
+  {"onnx", ".onnx", create<ONNXModel>},
+#endif
+};
+
+// the outputs of this many runs from a cleared state are compared between runners
+constexpr int COMPARED_RUNS = 20;
+
+struct Result {
+  const Runner *runner;
+  double cold_ms;
+  std::vector<double> busy_ms, paced_ms;
+  std::vector<float> outputs;  // of the compared runs
+};
+
+double percentile(std::vector<double> v, double p) {
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+Result bench(const ModelSpec &spec, const Runner &runner, std::vector<float> &inputs, int runs) {
+  Result r = {.runner = &runner};
+  const size_t num_inputs = inputs.size() / spec.input_size;
+  std::vector<float> output(spec.output_size);
+  std::vector<float> desire(spec.desire_size), traffic_convention(spec.traffic_convention_size);
+  int n = 0;
+  auto execute = [&](RunModel *m) {
+    m->execute(&inputs[(n++ % num_inputs) * spec.input_size], spec.input_size);
+  };
+
+  const std::string path = std::string(spec.path) + runner.ext;
+  auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<RunModel> m(runner.create(path.c_str(), output.data(), spec.output_size, spec.runtime));
+  // the recurrent state is fed back from the end of the outputs, like modeld does
+  if (spec.temporal_size) m->addRecurrent(&output[spec.output_size - spec.temporal_size], spec.temporal_size);
+  if (spec.desire_size) m->addDesire(desire.data(), spec.desire_size);
+  if (spec.traffic_convention_size) m->addTrafficConvention(traffic_convention.data(), spec.traffic_convention_size);
+  execute(m.get());
+  r.cold_ms = ms_since(start);
+  r.outputs.insert(r.outputs.end(), output.begin(), output.end());
+
+  for (int i = 1; i < COMPARED_RUNS; i++) {
+    execute(m.get());
+    r.outputs.insert(r.outputs.end(), output.begin(), output.end());
+  }
+
+  for (int i = 0; i < runs; i++) {
+    start = std::chrono::steady_clock::now();
+    execute(m.get());
+    r.busy_ms.push_back(ms_since(start));
+  }
+
+  const auto period = std::chrono::duration<double>(1. / spec.freq);
+  auto next = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++) {
+    std::this_thread::sleep_until(next);
+    start = std::chrono::steady_clock::now();
+    execute(m.get());
+    r.paced_ms.push_back(ms_since(start));
+    next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+  }
+  return r;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const ModelSpec *spec = nullptr;
+  std::vector<const Runner *> selected;
+  const char *inputs_path = nullptr;
+  int runs = 100;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+      inputs_path = argv[++i];
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    } else if (!spec) {
+      for (const auto &m : models) {
+        if (strcmp(m.name, argv[i]) == 0) spec = &m;
+      }
+      if (!spec) break;
+    } else {
+      const Runner *runner = nullptr;
+      for (const auto &r : runners) {
+        if (strcmp(r.name, argv[i]) == 0) runner = &r;
+      }
+      if (!runner) {
+        printf("%s isn't built in\n", argv[i]);
+        return 1;
+      }
+      selected.push_back(runner);
+    }
+  }
+  if (!spec) {
+    printf("usage: %s <supercombo|dmonitoring> [runner ...] [--inputs <file>] [--runs N]\n", argv[0]);
+    return 1;
+  }
+  // every runner built in with a model file for it
+  if (selected.empty()) {
+    for (const auto &r : runners) {
+      if (access((std::string(spec->path) + r.ext).c_str(), R_OK) == 0) selected.push_back(&r);
+    }
+    if (selected.empty()) {
+      printf("no runner has a model file for %s\n", spec->name);
+      return 1;
+    }
+  }
+
+  std::vector<float> inputs;
+  if (inputs_path) {
+    std::string dat = util::read_file(inputs_path);
+    inputs.resize(dat.size() / sizeof(float) / spec->input_size * spec->input_size);
+    memcpy(inputs.data(), dat.data(), inputs.size() * sizeof(float));
+    if (inputs.empty()) {
+      printf("%s doesn't have a whole input of %zu floats\n", inputs_path, spec->input_size);
+      return 1;
+    }
+  } else {
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> pixel(0, 255);
+    inputs.resize(spec->input_size * 4);
+    for (auto &v : inputs) v = pixel(gen);
+  }
+
+  std::vector<Result> results;
+  for (auto runner : selected) {
+    printf("running %s on %s\n", spec->name, runner->name);
+    results.push_back(bench(*spec, *runner, inputs, runs));
+  }
+
+  printf("\n%-12s %10s %10s %10s %10s %10s %12s %12s\n", "runner", "cold ms", "busy p50", "busy p99",
+         "paced p50", "paced p99", "max delta", "mean delta");
+  for (const auto &r : results) {
+    // against the first runner
+    double max_delta = 0, sum_delta = 0;
+    for (size_t i = 0; i < r.outputs.size(); i++) {
+      const double d = std::abs(r.outputs[i] - results[0].outputs[i]);
+      max_delta = std::max(max_delta, d);
+      sum_delta += d;
+    }
+    printf("%-12s %10.1f %10.2f %10.2f %10.2f %10.2f %12.3g %12.3g\n", r.runner->name, r.cold_ms,
+           percentile(r.busy_ms, 0.5), percentile(r.busy_ms, 0.99), percentile(r.paced_ms, 0.5),
+           percentile(r.paced_ms, 0.99), max_delta, sum_delta / r.outputs.size());
+  }
+  return 0;
+}
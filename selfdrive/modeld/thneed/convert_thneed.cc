@@ -0,0 +1,52 @@
+// Converts a json .thneed to the binary one Thneed::load maps
+//   ./convert_thneed supercombo.thneed supercombo.thneed
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "thneed_file.h"
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    printf("usage: %s <json .thneed> <out .thneed>\n", argv[0]);
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("can't open %s\n", argv[1]);
+    return 1;
+  }
+  size_t sz = st.st_size;
+  char *buf = (char *)mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) {
+    printf("can't map %s\n", argv[1]);
+    return 1;
+  }
+
+  if (thneed_file_header(buf, sz) != NULL) {
+    printf("%s is already a binary thneed\n", argv[1]);
+    munmap(buf, sz);
+    return 0;
+  }
+
+  json11::Json jdat;
+  std::vector<std::string> blobs;
+  bool ok = thneed_json_read(buf, sz, jdat, blobs);
+  munmap(buf, sz);
+  if (!ok) {
+    printf("%s isn't a json thneed\n", argv[1]);
+    return 1;
+  }
+
+  // the output may be the input, it's only written once the input's read
+  if (!thneed_file_write(argv[2], jdat, blobs)) {
+    return 1;
+  }
+  printf("converted %zu objects, %zu kernels\n", jdat["objects"].array_items().size(), jdat["kernels"].array_items().size());
+  return 0;
+}
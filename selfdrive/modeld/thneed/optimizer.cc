@@ -0,0 +1,198 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <time.h>
+#include "json11.hpp"
+#include "thneed.h"
+
+using namespace json11;
+
+// runs per candidate local work size when tuning
+#define TUNE_RUNS 5
+
+static inline uint64_t nanos_since_boot() {
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static bool is_mem_arg(const CLQueuedKernel *k, int i) {
+  return k->args[i].size() == 8 && (k->arg_types[i].back() == '*' ||
+    k->arg_types[i] == "image2d_t" || k->arg_types[i] == "image1d_t");
+}
+
+static cl_mem mem_arg(const CLQueuedKernel *k, int i) {
+  return *(cl_mem*)(k->args[i].data());
+}
+
+// SNPE names what a kernel writes "output", sometimes with a suffix
+static bool is_output_arg(const CLQueuedKernel *k, int i) {
+  return k->arg_names[i].compare(0, 6, "output") == 0;
+}
+
+// a kernel that reads what it writes changes its output when rerun
+static bool in_place(const CLQueuedKernel *k) {
+  set<cl_mem> mems;
+  for (int i = 0; i < k->num_args; i++) {
+    if (is_mem_arg(k, i) && !mems.insert(mem_arg(k, i)).second) return true;
+  }
+  return false;
+}
+
+// drop kernels whose outputs nothing later reads and aren't the model output. Walking backwards
+// lets a whole dead chain go in one pass
+static int eliminate_dead_kernels(vector<shared_ptr<CLQueuedKernel> > &kq) {
+  set<cl_mem> live;
+  for (auto &k : kq) {
+    for (int i = 0; i < k->num_args; i++) {
+      if (k->name == "image2d_to_buffer_float" && k->arg_names[i] == "output") live.insert(mem_arg(k.get(), i));
+    }
+  }
+
+  vector<shared_ptr<CLQueuedKernel> > kept;
+  int removed = 0;
+  for (int j = kq.size()-1; j >= 0; j--) {
+    CLQueuedKernel *k = kq[j].get();
+    bool writes = false, needed = false;
+    for (int i = 0; i < k->num_args; i++) {
+      if (!is_mem_arg(k, i) || !is_output_arg(k, i)) continue;
+      writes = true;
+      cl_mem m = mem_arg(k, i);
+      // any later kernel touching the buffer keeps this one
+      if (live.count(m)) needed = true;
+    }
+
+    if (writes && !needed) {
+      removed++;
+      continue;
+    }
+    for (int i = 0; i < k->num_args; i++) {
+      if (is_mem_arg(k, i)) live.insert(mem_arg(k, i));
+    }
+    kept.push_back(kq[j]);
+  }
+
+  reverse(kept.begin(), kept.end());
+  kq = kept;
+  return removed;
+}
+
+// SNPE splits a concat into one copy per input. Back to back copies from the same source into
+// the same destination with the same sizes are the same work twice
+static int merge_duplicate_copies(vector<shared_ptr<CLQueuedKernel> > &kq) {
+  vector<shared_ptr<CLQueuedKernel> > kept;
+  int removed = 0;
+  for (auto &k : kq) {
+    if (!kept.empty() && k->name.find("copy") != string::npos && !in_place(k.get())) {
+      auto &prev = kept.back();
+      if (prev->name == k->name && prev->args == k->args && prev->work_dim == k->work_dim &&
+          equal(prev->global_work_size, prev->global_work_size+3, k->global_work_size)) {
+        removed++;
+        continue;
+      }
+    }
+    kept.push_back(k);
+  }
+  kq = kept;
+  return removed;
+}
+
+// the first run warms up, the rest are averaged
+static double time_kernel(Thneed *thneed, CLQueuedKernel *k) {
+  cl_int ret = k->exec();
+  if (ret != CL_SUCCESS) return -1;
+  clFinish(thneed->command_queue);
+
+  uint64_t tb = nanos_since_boot();
+  for (int i = 0; i < TUNE_RUNS; i++) k->exec();
+  clFinish(thneed->command_queue);
+  return (nanos_since_boot() - tb) / 1000.0 / TUNE_RUNS;
+}
+
+// powers of two dividing each global size, within the kernel's work group limit. The size SNPE
+// picked is kept if nothing beats it
+static void tune_local_work_size(Thneed *thneed, CLQueuedKernel *k) {
+  if (in_place(k)) {
+    k->time_us = time_kernel(thneed, k);
+    return;
+  }
+
+  size_t max_wg = 0;
+  clGetKernelWorkGroupInfo(k->kernel, thneed->device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_wg), &max_wg, NULL);
+
+  size_t best[3];
+  copy(k->local_work_size, k->local_work_size+3, best);
+  double best_us = time_kernel(thneed, k);
+
+  vector<size_t> dims[3];
+  for (int d = 0; d < 3; d++) {
+    dims[d].push_back(1);
+    if (d >= k->work_dim) continue;
+    for (size_t l = 2; l <= max_wg && k->global_work_size[d] % l == 0; l *= 2) dims[d].push_back(l);
+  }
+
+  for (size_t x : dims[0]) for (size_t y : dims[1]) for (size_t z : dims[2]) {
+    if (x*y*z > max_wg) continue;
+    size_t cand[3] = {x, y, z};
+    if (equal(cand, cand+k->work_dim, best)) continue;
+    copy(cand, cand+3, k->local_work_size);
+    double us = time_kernel(thneed, k);
+    if (us >= 0 && (best_us < 0 || us < best_us)) {
+      best_us = us;
+      copy(cand, cand+3, best);
+    }
+  }
+
+  copy(best, best+3, k->local_work_size);
+  k->time_us = best_us;
+}
+
+// THNEED_TRACE=<path> writes the tuned kernels and their times as json
+static void write_trace(const vector<shared_ptr<CLQueuedKernel> > &kq) {
+  const char *path = getenv("THNEED_TRACE");
+  if (path == NULL) return;
+
+  Json::array trace;
+  for (auto &k : kq) {
+    trace.push_back(Json::object {
+      { "name", k->name },
+      { "global_work_size", Json::array { (int)k->global_work_size[0], (int)k->global_work_size[1], (int)k->global_work_size[2] } },
+      { "local_work_size", Json::array { (int)k->local_work_size[0], (int)k->local_work_size[1], (int)k->local_work_size[2] } },
+      { "time_us", k->time_us },
+    });
+  }
+  FILE *f = fopen(path, "w");
+  if (f == NULL) return;
+  string str = Json(trace).dump();
+  fwrite(str.data(), 1, str.length(), f);
+  fclose(f);
+}
+
+// runs on the recorded kernels before they are replayed into the command buffer, so the saved
+// .thneed keeps the pruned queue and the tuned local work sizes
+int Thneed::optimize() {
+  int dead = eliminate_dead_kernels(kq);
+  int copies = merge_duplicate_copies(kq);
+
+  // tuning enqueues for real, none of it can end up in the recording
+  int old_record = record;
+  record = 0;
+  double total_us = 0;
+  for (auto &k : kq) {
+    if (k->time_us == 0) tune_local_work_size(this, k.get());
+    total_us += max(k->time_us, 0.0);
+  }
+  record = old_record;
+
+  if (record & THNEED_DEBUG) {
+    for (auto &k : kq) k->debug_print(false);
+  }
+  printf("Thneed::optimize: removed %d dead kernels and %d duplicate copies, %lu kernels in %.1f us\n",
+    dead, copies, kq.size(), total_us);
+  write_trace(kq);
+  return dead + copies;
+}
@@ -1,22 +1,345 @@
 #include <set>
+#include <map>
 #include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "thneed.h"
+#include "thneed_file.h"
 #include "json11.hpp"
 using namespace json11;
 
 extern map<cl_program, string> g_program_source;
 
+// *********** program binary cache ***********
+
+// Programs that come as source are compiled once per model and GPU driver, the
+// binaries are kept in a cache file named after the model hash
+#define THNEED_CACHE_MAGIC 0x434e4854  // "THNC"
+#define THNEED_CACHE_VERSION 1
+
+struct ThneedCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t model_hash;
+  char driver[256];
+  uint32_t num_programs;
+};
+
+static uint64_t fnv1a(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static string cache_dir() {
+  const char *dir = getenv("THNEED_CACHE_DIR");
+  return dir ? dir : THNEED_CACHE_DIR;
+}
+
+static string cache_path(uint64_t model_hash) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)model_hash);
+  return cache_dir() + name;
+}
+
+static void driver_version(cl_device_id device_id, char *out, size_t len) {
+  char name[128] = {0}, version[128] = {0};
+  clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+  clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(version) - 1, version, NULL);
+  snprintf(out, len, "%s %s", name, version);
+}
+
+// Returns the cached binaries by program name, empty if the cache is missing or was made for another driver
+static map<string, string> cache_read(const string &path, uint64_t model_hash, const char *driver) {
+  map<string, string> ret;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return ret;
+
+  struct stat st;
+  fstat(fd, &st);
+  size_t sz = st.st_size;
+  if (sz < sizeof(ThneedCacheHeader)) {
+    close(fd);
+    return ret;
+  }
+  const char *buf = (const char *)mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) return ret;
+
+  const ThneedCacheHeader *hdr = (const ThneedCacheHeader *)buf;
+  if (hdr->magic == THNEED_CACHE_MAGIC && hdr->version == THNEED_CACHE_VERSION &&
+      hdr->model_hash == model_hash && strncmp(hdr->driver, driver, sizeof(hdr->driver)) == 0) {
+    // [uint32 name length][name][uint32 binary length][binary] per program
+    size_t ptr = sizeof(ThneedCacheHeader);
+    for (uint32_t i = 0; i < hdr->num_programs; i++) {
+      uint32_t name_len, bin_len;
+      if (ptr + sizeof(name_len) > sz) break;
+      memcpy(&name_len, buf + ptr, sizeof(name_len));
+      ptr += sizeof(name_len);
+      if (ptr + name_len + sizeof(bin_len) > sz) break;
+      string name(buf + ptr, name_len);
+      ptr += name_len;
+      memcpy(&bin_len, buf + ptr, sizeof(bin_len));
+      ptr += sizeof(bin_len);
+      if (ptr + bin_len > sz) break;
+      ret[name] = string(buf + ptr, bin_len);
+      ptr += bin_len;
+    }
+    if (ret.size() != hdr->num_programs) {
+      printf("Thneed::load: cache %s is truncated\n", path.c_str());
+      ret.clear();
+    }
+  }
+
+  munmap((void *)buf, sz);
+  return ret;
+}
+
+static void cache_write(const string &path, uint64_t model_hash, const char *driver, const map<string, string> &binaries) {
+  ThneedCacheHeader hdr = {0};
+  hdr.magic = THNEED_CACHE_MAGIC;
+  hdr.version = THNEED_CACHE_VERSION;
+  hdr.model_hash = model_hash;
+  strncpy(hdr.driver, driver, sizeof(hdr.driver) - 1);
+  hdr.num_programs = binaries.size();
+
+  mkdir(cache_dir().c_str(), 0755);
+
+  // written next to the cache and renamed, so a crash never leaves half a cache behind
+  string tmp_path = path + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "wb");
+  if (f == NULL) {
+    printf("Thneed::load: can't write cache %s\n", path.c_str());
+    return;
+  }
+  fwrite(&hdr, 1, sizeof(hdr), f);
+  for (auto &it : binaries) {
+    uint32_t name_len = it.first.size(), bin_len = it.second.size();
+    fwrite(&name_len, 1, sizeof(name_len), f);
+    fwrite(it.first.data(), 1, name_len, f);
+    fwrite(&bin_len, 1, sizeof(bin_len), f);
+    fwrite(it.second.data(), 1, bin_len, f);
+  }
+  bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  fclose(f);
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
+static string program_binary(cl_program program) {
+  size_t binary_size = 0;
+  int err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL);
+  assert(err == 0);
+  assert(binary_size > 0);
+  string sv(binary_size, '\x00');
+
+  uint8_t* bufs[1] = { (uint8_t*)sv.data(), };
+  err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(bufs), &bufs, NULL);
+  assert(err == 0);
+  return sv;
+}
+
+static cl_program program_from_binary(cl_context context, cl_device_id device_id, const string &binary) {
+  const unsigned char *srcs[1] = { (const unsigned char *)binary.data() };
+  size_t length = binary.size();
+  cl_int err;
+  cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &length, srcs, NULL, &err);
+  if (program == NULL || err != CL_SUCCESS) return NULL;
+  if (clBuildProgram(program, 1, &device_id, "", NULL, NULL) != CL_SUCCESS) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  return program;
+}
+
 void Thneed::load(const char *filename) {
   printf("Thneed::load: loading from %s\n", filename);
 
-  FILE *f = fopen(filename, "rb");
-  fseek(f, 0L, SEEK_END);
-  int sz = ftell(f);
-  fseek(f, 0L, SEEK_SET);
-  char *buf = (char*)malloc(sz);
-  fread(buf, 1, sz, f);
-  fclose(f);
+  int fd = open(filename, O_RDONLY);
+  assert(fd >= 0);
+  struct stat st;
+  fstat(fd, &st);
+  size_t sz = st.st_size;
+  char *buf = (char *)mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  assert(buf != MAP_FAILED);
+  close(fd);
+
+  if (const ThneedFileHeader *hdr = thneed_file_header(buf, sz)) {
+    load_binary(buf, sz, hdr);
+  } else {
+    printf("Thneed::load: %s is a json thneed, convert_thneed makes it quicker to load\n", filename);
+    load_json(buf, sz);
+  }
+
+  munmap(buf, sz);
+  clFinish(command_queue);
+}
+
+map<string, cl_program> Thneed::load_programs(const map<string, string> &sources, const map<string, ProgramBinary> &binaries, uint64_t model_hash) {
+  char driver[256];
+  driver_version(device_id, driver, sizeof(driver));
+  string cache = cache_path(model_hash);
+  map<string, string> cached = sources.size() ? cache_read(cache, model_hash, driver) : map<string, string>();
+  bool cache_dirty = false;
+
+  map<string, cl_program> g_programs;
+  for (auto &obj : sources) {
+    if (cached.count(obj.first)) {
+      cl_program program = program_from_binary(context, device_id, cached[obj.first]);
+      if (program != NULL) {
+        g_programs[obj.first] = program;
+        continue;
+      }
+      printf("Thneed::load: cached binary for %s is unusable, rebuilding\n", obj.first.c_str());
+    }
+
+    const char *srcs[1];
+    srcs[0] = (const char *)obj.second.c_str();
+    size_t length = obj.second.size();
+
+    if (record & THNEED_DEBUG) printf("building %s with size %zu\n", obj.first.c_str(), length);
+
+    cl_program program = clCreateProgramWithSource(context, 1, srcs, &length, NULL);
+    int err = clBuildProgram(program, 1, &device_id, "", NULL, NULL);
+    if (err != 0) {
+      printf("got err %d\n", err);
+      size_t length;
+      char buffer[2048];
+      clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &length);
+      buffer[length] = '\0';
+      printf("%s\n", buffer);
+    }
+    assert(err == 0);
+
+    g_programs[obj.first] = program;
+    cached[obj.first] = program_binary(program);
+    cache_dirty = true;
+  }
+
+  if (cache_dirty) {
+    printf("Thneed::load: caching %zu programs in %s\n", cached.size(), cache.c_str());
+    cache_write(cache, model_hash, driver, cached);
+  }
+
+  for (auto &obj : binaries) {
+    size_t length = obj.second.size;
+    const unsigned char *srcs[1] = { obj.second.data };
+
+    if (record & THNEED_DEBUG) printf("binary %s with size %zu\n", obj.first.c_str(), length);
+
+    cl_int err;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &length, srcs, NULL, &err);
+    assert(program != NULL && err == CL_SUCCESS);
+    err = clBuildProgram(program, 1, &device_id, "", NULL, NULL);
+    assert(err == CL_SUCCESS);
 
+    g_programs[obj.first] = program;
+  }
+  return g_programs;
+}
+
+static cl_mem create_image(cl_context context, cl_mem clbuf, bool image2d, size_t width, size_t height, size_t row_pitch) {
+  cl_image_desc desc = {0};
+  desc.image_type = image2d ? CL_MEM_OBJECT_IMAGE2D : CL_MEM_OBJECT_IMAGE1D_BUFFER;
+  desc.image_width = width;
+  desc.image_height = height;
+  desc.image_row_pitch = row_pitch;
+  desc.buffer = clbuf;
+
+  cl_image_format format;
+  format.image_channel_order = CL_RGBA;
+  format.image_channel_data_type = CL_HALF_FLOAT;
+
+  cl_mem image = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, NULL);
+  assert(image != NULL);
+  return image;
+}
+
+void Thneed::load_binary(char *buf, size_t sz, const ThneedFileHeader *hdr) {
+  const ThneedObject *objects = (const ThneedObject *)(buf + sizeof(ThneedFileHeader));
+  const ThneedKernel *kernels = (const ThneedKernel *)(objects + hdr->num_objects);
+  const ThneedArg *args = (const ThneedArg *)(kernels + hdr->num_kernels);
+  const ThneedProgram *programs = (const ThneedProgram *)(args + hdr->num_args);
+  const char *strings = buf + hdr->strings_offset;
+  char *data = buf + hdr->data_offset;
+
+  map<uint64_t, cl_mem> real_mem;
+  real_mem[0] = NULL;
+
+  for (uint32_t i = 0; i < hdr->num_objects; i++) {
+    const ThneedObject &o = objects[i];
+    cl_mem clbuf = NULL;
+    if (o.buffer_id != 0) {
+      // image buffer must already be allocated
+      clbuf = real_mem[o.buffer_id];
+      assert(!o.needs_load);
+    } else if (o.needs_load) {
+      assert(o.data_offset + o.size <= hdr->data_size);
+      clbuf = clCreateBuffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_WRITE, o.size, data + o.data_offset, NULL);
+      // in the gpu's memory now, the file's pages aren't needed twice
+      madvise(data + o.data_offset, (o.size + THNEED_FILE_ALIGN - 1) / THNEED_FILE_ALIGN * THNEED_FILE_ALIGN, MADV_DONTNEED);
+    } else {
+      clbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, o.size, NULL, NULL);
+    }
+    assert(clbuf != NULL);
+
+    if (o.type == THNEED_IMAGE2D || o.type == THNEED_IMAGE1D) {
+      clbuf = create_image(context, clbuf, o.type == THNEED_IMAGE2D, o.width, o.height, o.row_pitch);
+    }
+    real_mem[o.id] = clbuf;
+  }
+
+  map<string, string> sources;
+  map<string, ProgramBinary> binaries;
+  for (uint32_t i = 0; i < hdr->num_programs; i++) {
+    const ThneedProgram &p = programs[i];
+    if (p.is_binary) {
+      assert(p.offset + p.size <= hdr->data_size);
+      binaries[strings + p.name] = {(const unsigned char *)data + p.offset, p.size};
+    } else {
+      assert(p.offset + p.size <= hdr->strings_size);
+      sources[strings + p.name] = string(strings + p.offset, p.size);
+    }
+  }
+  map<string, cl_program> g_programs = load_programs(sources, binaries, fnv1a(buf, sz));
+
+  for (uint32_t i = 0; i < hdr->num_kernels; i++) {
+    const ThneedKernel &k = kernels[i];
+    assert((uint64_t)k.first_arg + k.num_args <= hdr->num_args);
+    auto kk = shared_ptr<CLQueuedKernel>(new CLQueuedKernel(this));
+
+    kk->name = strings + k.name;
+    kk->program = g_programs[kk->name];
+    kk->work_dim = k.work_dim;
+    for (int j = 0; j < 3; j++) {
+      kk->global_work_size[j] = k.global_work_size[j];
+      kk->local_work_size[j] = k.local_work_size[j];
+    }
+    kk->num_args = k.num_args;
+    for (uint32_t j = 0; j < k.num_args; j++) {
+      const ThneedArg &a = args[k.first_arg + j];
+      string arg(strings + a.value, a.value_size);
+      kk->args_size.push_back(a.size);
+      if (a.size == 8 && a.value_size == 8) {
+        uint64_t id;
+        memcpy(&id, arg.data(), sizeof(id));
+        cl_mem val = real_mem[id];
+        kk->args.push_back(string((char*)&val, sizeof(val)));
+      } else {
+        kk->args.push_back(arg);
+      }
+    }
+    kq.push_back(kk);
+  }
+}
+
+void Thneed::load_json(const char *buf, size_t sz) {
   int jsz = *(int *)buf;
   string jj(buf+4, jsz);
   string err;
@@ -25,7 +348,7 @@ void Thneed::load(const char *filename) {
   map<cl_mem, cl_mem> real_mem;
   real_mem[NULL] = NULL;
 
-  int ptr = 4+jsz;
+  size_t ptr = 4+jsz;
   for (auto &obj : jdat["objects"].array_items()) {
     auto mobj = obj.object_items();
     int sz = mobj["size"].int_value();
@@ -38,7 +361,7 @@ void Thneed::load(const char *filename) {
     } else {
       if (mobj["needs_load"].bool_value()) {
         //printf("loading %p %d @ 0x%X\n", clbuf, sz, ptr);
-        clbuf = clCreateBuffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_WRITE, sz, &buf[ptr], NULL);
+        clbuf = clCreateBuffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_WRITE, sz, (void *)&buf[ptr], NULL);
         ptr += sz;
       } else {
         clbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, sz, NULL, NULL);
@@ -47,64 +370,24 @@ void Thneed::load(const char *filename) {
     assert(clbuf != NULL);
 
     if (mobj["arg_type"] == "image2d_t" || mobj["arg_type"] == "image1d_t") {
-      cl_image_desc desc = {0};
-      desc.image_type = (mobj["arg_type"] == "image2d_t") ? CL_MEM_OBJECT_IMAGE2D : CL_MEM_OBJECT_IMAGE1D_BUFFER;
-      desc.image_width = mobj["width"].int_value();
-      desc.image_height = mobj["height"].int_value();
-      desc.image_row_pitch = mobj["row_pitch"].int_value();
-      desc.buffer = clbuf;
-
-      cl_image_format format;
-      format.image_channel_order = CL_RGBA;
-      format.image_channel_data_type = CL_HALF_FLOAT;
-
-      clbuf = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, NULL);
-      assert(clbuf != NULL);
+      clbuf = create_image(context, clbuf, mobj["arg_type"] == "image2d_t", mobj["width"].int_value(),
+                           mobj["height"].int_value(), mobj["row_pitch"].int_value());
     }
 
     real_mem[*(cl_mem*)(mobj["id"].string_value().data())] = clbuf;
   }
 
-  map<string, cl_program> g_programs;
+  map<string, string> sources;
   for (auto &obj : jdat["programs"].object_items()) {
-    const char *srcs[1];
-    srcs[0] = (const char *)obj.second.string_value().c_str();
-    size_t length = obj.second.string_value().size();
-
-    if (record & THNEED_DEBUG) printf("building %s with size %zu\n", obj.first.c_str(), length);
-
-    cl_program program = clCreateProgramWithSource(context, 1, srcs, &length, NULL);
-    int err = clBuildProgram(program, 1, &device_id, "", NULL, NULL);
-    if (err != 0) {
-      printf("got err %d\n", err);
-      size_t length;
-      char buffer[2048];
-      clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &length);
-      buffer[length] = '\0';
-      printf("%s\n", buffer);
-    }
-    assert(err == 0);
-
-    g_programs[obj.first] = program;
+    sources[obj.first] = obj.second.string_value();
   }
-
+  map<string, ProgramBinary> binaries;
   for (auto &obj : jdat["binaries"].array_items()) {
-    string name = obj["name"].string_value();
     size_t length = obj["length"].int_value();
-    const unsigned char *srcs[1];
-    srcs[0] = (const unsigned char *)&buf[ptr];
+    binaries[obj["name"].string_value()] = {(const unsigned char *)&buf[ptr], length};
     ptr += length;
-
-    if (record & THNEED_DEBUG) printf("binary %s with size %zu\n", name.c_str(), length);
-
-    cl_int err;
-    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &length, srcs, NULL, &err);
-    assert(program != NULL && err == CL_SUCCESS);
-    err = clBuildProgram(program, 1, &device_id, "", NULL, NULL);
-    assert(err == CL_SUCCESS);
-
-    g_programs[name] = program;
   }
+  map<string, cl_program> g_programs = load_programs(sources, binaries, fnv1a(buf, sz));
 
   for (auto &obj : jdat["kernels"].array_items()) {
     auto gws = obj["global_work_size"];
@@ -133,9 +416,6 @@ void Thneed::load(const char *filename) {
     }
     kq.push_back(kk);
   }
-
-  free(buf);
-  clFinish(command_queue);
 }
 
 void Thneed::save(const char *filename, bool save_binaries) {
@@ -210,18 +490,7 @@ void Thneed::save(const char *filename, bool save_binaries) {
     }
 
     if (save_binaries) {
-      int err;
-      size_t binary_size = 0;
-      err = clGetProgramInfo(k->program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL);
-      assert(err == 0);
-      assert(binary_size > 0);
-      string sv(binary_size, '\x00');
-
-      uint8_t* bufs[1] = { (uint8_t*)sv.data(), };
-      err = clGetProgramInfo(k->program, CL_PROGRAM_BINARIES, sizeof(bufs), &bufs, NULL);
-      assert(err == 0);
-
-      binaries[k->name] = sv;
+      binaries[k->name] = program_binary(k->program);
     } else {
       programs[k->name] = g_program_source[k->program];
     }
@@ -264,16 +533,8 @@ void Thneed::save(const char *filename, bool save_binaries) {
     {"binaries", jbinaries},
   });
 
-  string str = jdat.dump();
-  int jsz = str.length();
-
-  FILE *f = fopen(filename, "wb");
-  fwrite(&jsz, 1, sizeof(jsz), f);
-  fwrite(str.data(), 1, jsz, f);
-  for (auto &s : saved_buffers) {
-    fwrite(s.data(), 1, s.length(), f);
-  }
-  fclose(f);
+  bool ok = thneed_file_write(filename, jdat, saved_buffers);
+  assert(ok);
 }
 
 Json CLQueuedKernel::to_json() const {
@@ -1,6 +1,7 @@
 #include <cassert>
 #include <sys/mman.h>
 #include <dlfcn.h>
+#include <algorithm>
 #include <map>
 #include <string>
 #include <string.h>
@@ -8,10 +9,10 @@
 #include "thneed.h"
 
 //#define RUN_DISASSEMBLER
-//#define RUN_OPTIMIZER
 
 Thneed *g_thneed = NULL;
 int g_fd = -1;
+int g_kgsl_priority = 1;
 map<pair<cl_kernel, int>, string> g_args;
 map<pair<cl_kernel, int>, int> g_args_size;
 map<cl_program, string> g_program_source;
@@ -50,7 +51,7 @@ int ioctl(int filedes, unsigned long request, void *argp) {
   if (request == IOCTL_KGSL_DRAWCTXT_CREATE) {
     struct kgsl_drawctxt_create *create = (struct kgsl_drawctxt_create *)argp;
     create->flags &= ~KGSL_CONTEXT_PRIORITY_MASK;
-    create->flags |= 1 << KGSL_CONTEXT_PRIORITY_SHIFT;   // priority from 1-15, 1 is max priority
+    create->flags |= g_kgsl_priority << KGSL_CONTEXT_PRIORITY_SHIFT;
     printf("IOCTL_KGSL_DRAWCTXT_CREATE: creating context with flags 0x%x\n", create->flags);
   }
 
@@ -122,7 +123,15 @@ int ioctl(int filedes, unsigned long request, void *argp) {
 
 // *********** GPUMalloc ***********
 
-GPUMalloc::GPUMalloc(int size, int fd) {
+GPUMalloc::GPUMalloc(int size, int fd) : fd(fd), chunk_size(size) {
+  add_chunk(size);
+}
+
+GPUMalloc::~GPUMalloc() {
+  // TODO: free the GPU malloced area
+}
+
+void GPUMalloc::add_chunk(int size) {
   struct kgsl_gpuobj_alloc alloc;
   memset(&alloc, 0, sizeof(alloc));
   alloc.size = size;
@@ -135,19 +144,31 @@ GPUMalloc::GPUMalloc(int size, int fd) {
   remaining = size;
 }
 
-GPUMalloc::~GPUMalloc() {
-  // TODO: free the GPU malloced area
-}
-
 void *GPUMalloc::alloc(int size) {
-  void *ret = (void*)base;
+  lock_guard<mutex> lk(lock);
   size = (size+0xff) & (~0xFF);
-  assert(size <= remaining);
+  if (size > remaining) {
+    // the rest of this chunk is left, commands don't span chunks
+    add_chunk(max(size, chunk_size));
+  }
+  void *ret = (void*)base;
   remaining -= size;
   base += size;
   return ret;
 }
 
+shared_ptr<GPUMalloc> GPUMalloc::shared(int fd) {
+  static mutex shared_lock;
+  static weak_ptr<GPUMalloc> shared_ram;
+  lock_guard<mutex> lk(shared_lock);
+  shared_ptr<GPUMalloc> ram = shared_ram.lock();
+  if (!ram) {
+    ram = make_shared<GPUMalloc>(0x80000, fd);
+    shared_ram = ram;
+  }
+  return ram;
+}
+
 // *********** CachedSync, at the ioctl layer ***********
 
 void CachedSync::exec() {
@@ -221,7 +242,7 @@ Thneed::Thneed(bool do_clinit) {
   if (do_clinit) clinit();
   assert(g_fd != -1);
   fd = g_fd;
-  ram = make_unique<GPUMalloc>(0x80000, fd);
+  ram = GPUMalloc::shared(fd);
   record = THNEED_RECORD;
   timestamp = -1;
   g_thneed = this;
@@ -263,7 +284,8 @@ void Thneed::copy_inputs(float **finputs) {
   //cl_int ret;
   for (int idx = 0; idx < inputs.size(); ++idx) {
     if (record & THNEED_DEBUG) printf("copying %lu -- %p -> %p\n", input_sizes[idx], finputs[idx], inputs[idx]);
-    memcpy(inputs[idx], finputs[idx], input_sizes[idx]);
+    // inputs written in place are already there
+    if (finputs[idx] != inputs[idx]) memcpy(inputs[idx], finputs[idx], input_sizes[idx]);
   }
 }
 
@@ -291,30 +313,40 @@ void Thneed::wait() {
   if (record & THNEED_DEBUG) printf("wait %d after %lu us\n", wret, (te-tb)/1000);
 }
 
-void Thneed::execute(float **finputs, float *foutput, bool slow) {
-  uint64_t tb, te;
-  if (record & THNEED_DEBUG) tb = nanos_since_boot();
-
-  // ****** copy inputs
-  copy_inputs(finputs);
+void Thneed::execute(float **finputs, float *foutput, bool slow, uint64_t deadline) {
+  ThneedScheduler::instance().execute(this, finputs, foutput, slow, deadline);
+}
 
-  // ****** set power constraint
-  int ret;
+void Thneed::set_power_constraint(bool max) {
   struct kgsl_device_constraint_pwrlevel pwrlevel;
   pwrlevel.level = KGSL_CONSTRAINT_PWR_MAX;
 
   struct kgsl_device_constraint constraint;
-  constraint.type = KGSL_CONSTRAINT_PWRLEVEL;
   constraint.context_id = context_id;
-  constraint.data = (void*)&pwrlevel;
-  constraint.size = sizeof(pwrlevel);
+  if (max) {
+    constraint.type = KGSL_CONSTRAINT_PWRLEVEL;
+    constraint.data = (void*)&pwrlevel;
+    constraint.size = sizeof(pwrlevel);
+  } else {
+    constraint.type = KGSL_CONSTRAINT_NONE;
+    constraint.data = NULL;
+    constraint.size = 0;
+  }
 
   struct kgsl_device_getproperty prop;
   prop.type = KGSL_PROP_PWR_CONSTRAINT;
   prop.value = (void*)&constraint;
   prop.sizebytes = sizeof(constraint);
-  ret = ioctl(fd, IOCTL_KGSL_SETPROPERTY, &prop);
+  int ret = ioctl(fd, IOCTL_KGSL_SETPROPERTY, &prop);
   assert(ret == 0);
+}
+
+void Thneed::run(float **finputs, float *foutput, bool slow) {
+  uint64_t tb, te;
+  if (record & THNEED_DEBUG) tb = nanos_since_boot();
+
+  // ****** copy inputs
+  copy_inputs(finputs);
 
   // ****** run commands
   int i = 0;
@@ -328,20 +360,45 @@ void Thneed::execute(float **finputs, float *foutput, bool slow) {
   // ****** copy outputs
   copy_output(foutput);
 
-  // ****** unset power constraint
-  constraint.type = KGSL_CONSTRAINT_NONE;
-  constraint.data = NULL;
-  constraint.size = 0;
-
-  ret = ioctl(fd, IOCTL_KGSL_SETPROPERTY, &prop);
-  assert(ret == 0);
-
   if (record & THNEED_DEBUG) {
     te = nanos_since_boot();
     printf("model exec in %lu us\n", (te-tb)/1000);
   }
 }
 
+// *********** ThneedScheduler ***********
+
+ThneedScheduler &ThneedScheduler::instance() {
+  static ThneedScheduler scheduler;
+  return scheduler;
+}
+
+void ThneedScheduler::execute(Thneed *thneed, float **finputs, float *foutput, bool slow, uint64_t deadline) {
+  unique_lock<mutex> lk(lock);
+  const Ticket ticket = {thneed->priority, deadline == 0 ? UINT64_MAX : deadline, arrivals++};
+  waiting.insert(ticket);
+  cv.wait(lk, [&] { return !busy && *waiting.begin() == ticket; });
+  waiting.erase(waiting.begin());
+  busy = true;
+  if (pwr_max && find(powered.begin(), powered.end(), thneed) == powered.end()) {
+    thneed->set_power_constraint(true);
+    powered.push_back(thneed);
+  }
+  lk.unlock();
+
+  thneed->run(finputs, foutput, slow);
+
+  lk.lock();
+  busy = false;
+  if (waiting.empty()) {
+    // end of the burst
+    for (auto t : powered) t->set_power_constraint(false);
+    powered.clear();
+  }
+  lk.unlock();
+  cv.notify_all();
+}
+
 void Thneed::clinit() {
   cl_int err;
 
@@ -430,9 +487,8 @@ cl_int thneed_clFinish(cl_command_queue command_queue) {
   Thneed *thneed = g_thneed;
 
   if (thneed != NULL && thneed->record & THNEED_RECORD) {
-    #ifdef RUN_OPTIMIZER
-      thneed->optimize();
-    #endif
+    // THNEED_OPTIMIZE=1 prunes and tunes the recorded kernels, see optimizer.cc
+    if (getenv("THNEED_OPTIMIZE") != NULL) thneed->optimize();
     return thneed->clexec();
   } else {
     return clFinish(command_queue);
@@ -556,6 +612,7 @@ void CLQueuedKernel::debug_print(bool verbose) {
   for (int i = 0; i < work_dim; i++) {
     printf("%4zu ", local_work_size[i]);
   }
+  if (time_us > 0) printf(" -- %8.1f us", time_us);
   printf("\n");
 
   if (verbose) {
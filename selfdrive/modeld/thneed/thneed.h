@@ -6,16 +6,26 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "include/msm_kgsl.h"
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <set>
 #include <string>
+#include <tuple>
 #include <CL/cl.h>
 
 #define THNEED_RECORD 1
 #define THNEED_DEBUG 2
 #define THNEED_VERBOSE_DEBUG 4
 
+// compiled programs, overridden by the THNEED_CACHE_DIR env var
+#ifndef THNEED_CACHE_DIR
+#define THNEED_CACHE_DIR "/data/thneed_cache"
+#endif
+
 using namespace std;
 
 namespace json11 {
@@ -23,14 +33,25 @@ namespace json11 {
 }
 class Thneed;
 
+// The KGSL priority, from 1, the highest, to 15, the ioctl interceptor creates every GPU context
+// of the process at. Set before the contexts are, see cl_gpu_priority_kgsl
+extern int g_kgsl_priority;
+
+// GPU memory for the recorded commands, one per process shared by every thneed. It grows in
+// chunks of at least size
 class GPUMalloc {
   public:
     GPUMalloc(int size, int fd);
     ~GPUMalloc();
     void *alloc(int size);
+    static shared_ptr<GPUMalloc> shared(int fd);
   private:
+    void add_chunk(int size);
+    int fd;
+    int chunk_size;
     uint64_t base;
     int remaining;
+    mutex lock;
 };
 
 class CLQueuedKernel {
@@ -57,6 +78,7 @@ class CLQueuedKernel {
     cl_uint work_dim;
     size_t global_work_size[3] = {0};
     size_t local_work_size[3] = {0};
+    double time_us = 0;  // measured by Thneed::optimize
   private:
     Thneed *thneed;
 };
@@ -92,10 +114,16 @@ class Thneed {
   public:
     Thneed(bool do_clinit=false);
     void stop();
-    void execute(float **finputs, float *foutput, bool slow=false);
+    // through the ThneedScheduler, at this thneed's priority
+    void execute(float **finputs, float *foutput, bool slow=false, uint64_t deadline=0);
     void wait();
     int optimize();
 
+    // scheduling, lower runs first like kgsl context priorities
+    int priority = 0;
+    void run(float **finputs, float *foutput, bool slow);
+    void set_power_constraint(bool max);
+
     vector<void *> inputs;
     vector<size_t> input_sizes;
     cl_mem output = NULL;
@@ -108,7 +136,7 @@ class Thneed {
     // protected?
     int record;
     int timestamp;
-    unique_ptr<GPUMalloc> ram;
+    shared_ptr<GPUMalloc> ram;
     vector<unique_ptr<CachedIoctl> > cmds;
     int fd;
 
@@ -127,5 +155,31 @@ class Thneed {
     void save(const char *filename, bool save_binaries=false);
   private:
     void clinit();
+    struct ProgramBinary {
+      const unsigned char *data;
+      size_t size;
+    };
+    // by name, the sources built or taken from the program binary cache
+    map<string, cl_program> load_programs(const map<string, string> &sources, const map<string, ProgramBinary> &binaries, uint64_t model_hash);
+    void load_json(const char *buf, size_t sz);
+    void load_binary(char *buf, size_t sz, const struct ThneedFileHeader *hdr);
 };
 
+// Runs the thneeds of a process one at a time, by priority, then deadline (0 is none, last),
+// then arrival. The GPU power constraint is held across a burst of back to back runs and dropped
+// once nothing is waiting, instead of being set and unset around every model
+class ThneedScheduler {
+  public:
+    static ThneedScheduler &instance();
+    void execute(Thneed *thneed, float **finputs, float *foutput, bool slow, uint64_t deadline);
+  private:
+    typedef tuple<int, uint64_t, uint64_t> Ticket;  // priority, deadline, arrival
+    mutex lock;
+    condition_variable cv;
+    set<Ticket> waiting;
+    uint64_t arrivals = 0;
+    bool busy = false;
+    // THNEED_PWR_MAX=0 leaves the gpu clock to selfdrive/thermald/powerd.py
+    const bool pwr_max = getenv("THNEED_PWR_MAX") == NULL || strcmp(getenv("THNEED_PWR_MAX"), "0") != 0;
+    vector<Thneed *> powered;  // the constraint is per kgsl context
+};
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "thneed_file.h"
+
+using namespace json11;
+using std::string;
+
+static uint64_t mem_id(const string &s) {
+  uint64_t id = 0;
+  memcpy(&id, s.data(), std::min(s.size(), sizeof(id)));
+  return id;
+}
+
+static uint64_t align(uint64_t x) {
+  return (x + THNEED_FILE_ALIGN - 1) / THNEED_FILE_ALIGN * THNEED_FILE_ALIGN;
+}
+
+namespace {
+
+struct Strings {
+  std::string data;
+  uint32_t add(const std::string &s) {
+    uint32_t offset = data.size();
+    data += s;
+    data.push_back('\0');
+    return offset;
+  }
+};
+
+}  // namespace
+
+bool thneed_file_write(const char *filename, const Json &jdat, const std::vector<std::string> &blobs) {
+  Strings strings;
+  std::vector<ThneedObject> objects;
+  std::vector<ThneedKernel> kernels;
+  std::vector<ThneedArg> args;
+  std::vector<ThneedProgram> programs;
+  // data section offsets of the blobs
+  std::vector<uint64_t> blob_offsets;
+  uint64_t data_size = 0;
+  for (auto &b : blobs) {
+    blob_offsets.push_back(data_size);
+    data_size = align(data_size + b.size());
+  }
+
+  size_t blob = 0;
+  for (auto &obj : jdat["objects"].array_items()) {
+    const string &arg_type = obj["arg_type"].string_value();
+    ThneedObject o = {};
+    o.id = mem_id(obj["id"].string_value());
+    o.buffer_id = mem_id(obj["buffer_id"].string_value());
+    o.type = arg_type == "image2d_t" ? THNEED_IMAGE2D : arg_type == "image1d_t" ? THNEED_IMAGE1D :
+             arg_type == "<image buffer>" ? THNEED_IMAGE_BUFFER : THNEED_BUFFER;
+    o.needs_load = obj["needs_load"].bool_value();
+    o.size = obj["size"].int_value();
+    o.width = obj["width"].int_value();
+    o.height = obj["height"].int_value();
+    o.row_pitch = obj["row_pitch"].int_value();
+    if (o.needs_load) {
+      if (blob >= blobs.size() || blobs[blob].size() != o.size) {
+        printf("thneed: weights of object %zu don't match its size\n", objects.size());
+        return false;
+      }
+      o.data_offset = blob_offsets[blob++];
+    }
+    objects.push_back(o);
+  }
+
+  for (auto &obj : jdat["kernels"].array_items()) {
+    ThneedKernel k = {};
+    k.name = strings.add(obj["name"].string_value());
+    k.work_dim = obj["work_dim"].int_value();
+    for (int i = 0; i < 3; i++) {
+      k.global_work_size[i] = obj["global_work_size"][i].int_value();
+      k.local_work_size[i] = obj["local_work_size"][i].int_value();
+    }
+    k.num_args = obj["num_args"].int_value();
+    k.first_arg = args.size();
+    for (uint32_t i = 0; i < k.num_args; i++) {
+      const string &value = obj["args"][i].string_value();
+      ThneedArg a = {};
+      a.size = obj["args_size"][i].int_value();
+      a.value_size = value.size();
+      a.value = strings.add(value);
+      args.push_back(a);
+    }
+    kernels.push_back(k);
+  }
+
+  for (auto &obj : jdat["programs"].object_items()) {
+    ThneedProgram p = {};
+    p.name = strings.add(obj.first);
+    p.size = obj.second.string_value().size();
+    p.offset = strings.add(obj.second.string_value());
+    programs.push_back(p);
+  }
+  for (auto &obj : jdat["binaries"].array_items()) {
+    if (blob >= blobs.size()) {
+      printf("thneed: binary %s is missing\n", obj["name"].string_value().c_str());
+      return false;
+    }
+    ThneedProgram p = {};
+    p.name = strings.add(obj["name"].string_value());
+    p.is_binary = true;
+    p.offset = blob_offsets[blob];
+    p.size = blobs[blob++].size();
+    programs.push_back(p);
+  }
+
+  ThneedFileHeader hdr = {};
+  hdr.magic = THNEED_FILE_MAGIC;
+  hdr.version = THNEED_FILE_VERSION;
+  hdr.num_objects = objects.size();
+  hdr.num_kernels = kernels.size();
+  hdr.num_args = args.size();
+  hdr.num_programs = programs.size();
+  hdr.strings_offset = sizeof(hdr) + objects.size() * sizeof(ThneedObject) + kernels.size() * sizeof(ThneedKernel) +
+                       args.size() * sizeof(ThneedArg) + programs.size() * sizeof(ThneedProgram);
+  hdr.strings_size = strings.data.size();
+  hdr.data_offset = align(hdr.strings_offset + hdr.strings_size);
+  hdr.data_size = data_size;
+
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    printf("thneed: can't write %s\n", filename);
+    return false;
+  }
+  fwrite(&hdr, 1, sizeof(hdr), f);
+  fwrite(objects.data(), sizeof(ThneedObject), objects.size(), f);
+  fwrite(kernels.data(), sizeof(ThneedKernel), kernels.size(), f);
+  fwrite(args.data(), sizeof(ThneedArg), args.size(), f);
+  fwrite(programs.data(), sizeof(ThneedProgram), programs.size(), f);
+  fwrite(strings.data.data(), 1, strings.data.size(), f);
+  for (size_t i = 0; i < blobs.size(); i++) {
+    fseek(f, hdr.data_offset + blob_offsets[i], SEEK_SET);
+    fwrite(blobs[i].data(), 1, blobs[i].size(), f);
+  }
+  // the last blob's padding, so every offset is inside the file
+  if (data_size > 0) {
+    fseek(f, hdr.data_offset + data_size - 1, SEEK_SET);
+    fputc(0, f);
+  }
+  bool ok = ferror(f) == 0;
+  ok = fclose(f) == 0 && ok;
+  return ok;
+}
+
+bool thneed_json_read(const char *data, size_t size, Json &jdat, std::vector<std::string> &blobs) {
+  int jsz;
+  if (size < sizeof(jsz)) return false;
+  memcpy(&jsz, data, sizeof(jsz));
+  if (jsz <= 0 || sizeof(jsz) + jsz > size) return false;
+  string err;
+  jdat = Json::parse(string(data + sizeof(jsz), jsz), err);
+  if (!err.empty()) return false;
+
+  size_t ptr = sizeof(jsz) + jsz;
+  blobs.clear();
+  auto take = [&](size_t len) {
+    if (ptr + len > size) return false;
+    blobs.push_back(string(data + ptr, len));
+    ptr += len;
+    return true;
+  };
+  for (auto &obj : jdat["objects"].array_items()) {
+    if (obj["needs_load"].bool_value() && !take(obj["size"].int_value())) return false;
+  }
+  for (auto &obj : jdat["binaries"].array_items()) {
+    if (!take(obj["length"].int_value())) return false;
+  }
+  return true;
+}
+
+const ThneedFileHeader *thneed_file_header(const char *data, size_t size) {
+  const ThneedFileHeader *hdr = (const ThneedFileHeader *)data;
+  if (size < sizeof(*hdr) || hdr->magic != THNEED_FILE_MAGIC || hdr->version != THNEED_FILE_VERSION) return NULL;
+  const uint64_t tables = sizeof(*hdr) + (uint64_t)hdr->num_objects * sizeof(ThneedObject) +
+                          (uint64_t)hdr->num_kernels * sizeof(ThneedKernel) + (uint64_t)hdr->num_args * sizeof(ThneedArg) +
+                          (uint64_t)hdr->num_programs * sizeof(ThneedProgram);
+  if (hdr->strings_offset != tables || hdr->strings_offset + hdr->strings_size > size ||
+      hdr->data_offset % THNEED_FILE_ALIGN != 0 || hdr->data_offset + hdr->data_size > size) {
+    return NULL;
+  }
+  return hdr;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "json11.hpp"
+
+// The binary .thneed, what Thneed::save writes and Thneed::load maps:
+//
+//   [ThneedFileHeader][ThneedObject]...[ThneedKernel]...[ThneedArg]...[ThneedProgram]...[strings]
+//   [padding][weights and program binaries, each at a THNEED_FILE_ALIGN aligned offset]...
+//
+// The weights are uploaded to the gpu straight from the mapping, one object at a time, and their
+// pages dropped once they are. The strings hold the names, program sources and kernel arg values.
+// Older .thneed files are a json header followed by the blobs, convert_thneed turns them into this
+#define THNEED_FILE_MAGIC 0x424e4854  // "THNB"
+#define THNEED_FILE_VERSION 1
+#define THNEED_FILE_ALIGN 4096
+
+enum ThneedObjectType : uint32_t {
+  THNEED_BUFFER,
+  THNEED_IMAGE2D,
+  THNEED_IMAGE1D,
+  THNEED_IMAGE_BUFFER,  // the buffer behind an image
+};
+
+struct ThneedFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_objects, num_kernels, num_args, num_programs;
+  uint64_t strings_offset, strings_size;
+  uint64_t data_offset, data_size;
+  uint64_t reserved;
+};
+
+struct ThneedObject {
+  uint64_t id;  // the cl_mem it was saved from, the kernel args refer to it by that
+  uint64_t buffer_id;  // an image's buffer, 0 for none
+  uint32_t type;
+  uint32_t needs_load;
+  uint64_t size;
+  uint32_t width, height, row_pitch;
+  uint32_t reserved;
+  uint64_t data_offset;  // from the data section, if needs_load
+};
+
+struct ThneedKernel {
+  uint32_t name;  // offsets into the strings, the names are NUL terminated
+  uint32_t work_dim;
+  uint64_t global_work_size[3];
+  uint64_t local_work_size[3];
+  uint32_t num_args, first_arg;
+};
+
+struct ThneedArg {
+  uint32_t size;
+  uint32_t value_size;  // 0 for a __local arg
+  uint64_t value;
+};
+
+struct ThneedProgram {
+  uint32_t name;
+  uint32_t is_binary;
+  uint64_t offset;  // a source's from the strings, a binary's from the data section
+  uint64_t size;
+};
+
+static_assert(sizeof(ThneedFileHeader) == 64 && sizeof(ThneedObject) == 56 && sizeof(ThneedKernel) == 64);
+static_assert(sizeof(ThneedArg) == 16 && sizeof(ThneedProgram) == 24);
+
+// Writes the model described the way the json .thneed did: jdat has its "objects", "kernels",
+// "programs" and "binaries", blobs are the weights of the objects that need loading and then the
+// binaries, in that order. False if it couldn't be written
+bool thneed_file_write(const char *filename, const json11::Json &jdat, const std::vector<std::string> &blobs);
+
+// Splits a json .thneed into what thneed_file_write takes, false if it isn't one or it's cut short
+bool thneed_json_read(const char *data, size_t size, json11::Json &jdat, std::vector<std::string> &blobs);
+
+// The header of a binary .thneed of size bytes, NULL if it isn't one or it's cut short
+const ThneedFileHeader *thneed_file_header(const char *data, size_t size);
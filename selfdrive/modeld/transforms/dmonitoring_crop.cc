@@ -0,0 +1,44 @@
+#include <string.h>
+#include <assert.h>
+#include "dmonitoring_crop.h"
+
+void dmonitoring_crop_init(DMonitoringCropState* s, cl_context ctx, cl_device_id device_id,
+                           int in_width, int in_height,
+                           int crop_x, int crop_y, int crop_width, int crop_height, bool mirror,
+                           int out_width, int out_height, bool normalize) {
+  memset(s, 0, sizeof(*s));
+  assert(crop_x >= 0 && crop_y >= 0);
+  assert(crop_x + crop_width <= in_width && crop_y + crop_height <= in_height);
+
+  s->in_width = in_width;
+  s->in_height = in_height;
+  s->crop_y = crop_y;
+  s->crop_height = crop_height;
+  s->out_width = out_width;
+  s->out_height = out_height;
+
+  char args[1024];
+  snprintf(args, sizeof(args),
+           "-cl-fast-relaxed-math -cl-denorms-are-zero "
+           "-DIN_WIDTH=%d -DIN_HEIGHT=%d -DCROP_X=%d -DCROP_Y=%d -DCROP_WIDTH=%d -DCROP_HEIGHT=%d "
+           "-DOUT_WIDTH=%d -DOUT_HEIGHT=%d%s%s",
+           in_width, in_height, crop_x, crop_y, crop_width, crop_height,
+           out_width, out_height, mirror ? " -DMIRROR" : "", normalize ? " -DNORMALIZE" : "");
+  cl_program prg = cl_program_from_file(ctx, device_id, "transforms/dmonitoring_crop.cl", args);
+
+  s->krnl = CL_CHECK_ERR(clCreateKernel(prg, "dmonitoring_crop", &err));
+
+  // done with this
+  CL_CHECK(clReleaseProgram(prg));
+}
+
+void dmonitoring_crop_destroy(DMonitoringCropState* s) {
+  CL_CHECK(clReleaseKernel(s->krnl));
+}
+
+void dmonitoring_crop_queue(DMonitoringCropState* s, cl_command_queue q, cl_mem yuv_cl, cl_mem out_cl) {
+  CL_CHECK(clSetKernelArg(s->krnl, 0, sizeof(cl_mem), &yuv_cl));
+  CL_CHECK(clSetKernelArg(s->krnl, 1, sizeof(cl_mem), &out_cl));
+  const size_t work_size[2] = {(size_t)s->out_width / 2, (size_t)s->out_height / 2};
+  CL_CHECK(clEnqueueNDRangeKernel(q, s->krnl, 2, NULL, &work_size[0], NULL, 0, 0, NULL));
+}
@@ -0,0 +1,58 @@
+#define UV_WIDTH (IN_WIDTH / 2)
+#define U_OFFSET (IN_WIDTH * IN_HEIGHT)
+#define V_OFFSET (U_OFFSET + UV_WIDTH * (IN_HEIGHT / 2))
+
+#define OUT_PLANE ((OUT_WIDTH / 2) * (OUT_HEIGHT / 2))
+
+#ifdef NORMALIZE
+#define input_lambda(x) (((x) - 128.f) * 0.0078125f)
+#else
+#define input_lambda(x) (x)
+#endif
+
+// Bilinear sample of the crop, scaled to out_w x out_h and optionally mirrored.
+// Coordinates are in output pixels of one plane, chroma planes pass the halved sizes
+inline float sample(__global uchar const * const plane, int stride,
+                    int crop_x, int crop_y, int crop_w, int crop_h,
+                    int out_w, int out_h, int x, int y) {
+  float sx = (x + 0.5f) * crop_w / out_w - 0.5f;
+  float sy = (y + 0.5f) * crop_h / out_h - 0.5f;
+#ifdef MIRROR
+  sx = crop_w - 1 - sx;
+#endif
+  sx = clamp(sx, 0.f, (float)(crop_w - 1));
+  sy = clamp(sy, 0.f, (float)(crop_h - 1));
+
+  const int x0 = (int)sx, y0 = (int)sy;
+  const int x1 = min(x0 + 1, crop_w - 1), y1 = min(y0 + 1, crop_h - 1);
+  const float fx = sx - x0, fy = sy - y0;
+
+  __global uchar const * const row0 = plane + mad24(crop_y + y0, stride, crop_x);
+  __global uchar const * const row1 = plane + mad24(crop_y + y1, stride, crop_x);
+  const float top = mix((float)row0[x0], (float)row0[x1], fx);
+  const float bottom = mix((float)row1[x0], (float)row1[x1], fx);
+  return mix(top, bottom, fy);
+}
+
+// One work item per output chroma pixel. The tensor is transposed, c runs along the
+// frame width and r along its height, and laid out as y_ul|y_dl|y_ur|y_dr|u|v
+__kernel void dmonitoring_crop(__global uchar const * const in_yuv,
+                               __global float * out)
+{
+  const int c = get_global_id(0);
+  const int r = get_global_id(1);
+  const int o = c * (OUT_HEIGHT / 2) + r;
+
+  __global uchar const * const y = in_yuv;
+  #define Y(dx, dy) sample(y, IN_WIDTH, CROP_X, CROP_Y, CROP_WIDTH, CROP_HEIGHT, OUT_WIDTH, OUT_HEIGHT, 2*c + (dx), 2*r + (dy))
+  out[o + 0 * OUT_PLANE] = input_lambda(Y(0, 0));
+  out[o + 1 * OUT_PLANE] = input_lambda(Y(0, 1));
+  out[o + 2 * OUT_PLANE] = input_lambda(Y(1, 0));
+  out[o + 3 * OUT_PLANE] = input_lambda(Y(1, 1));
+  #undef Y
+
+  #define UV(offset) sample(in_yuv + (offset), UV_WIDTH, CROP_X / 2, CROP_Y / 2, CROP_WIDTH / 2, CROP_HEIGHT / 2, OUT_WIDTH / 2, OUT_HEIGHT / 2, c, r)
+  out[o + 4 * OUT_PLANE] = input_lambda(UV(U_OFFSET));
+  out[o + 5 * OUT_PLANE] = input_lambda(UV(V_OFFSET));
+  #undef UV
+}
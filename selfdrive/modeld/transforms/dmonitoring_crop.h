@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "clutil.h"
+
+typedef struct {
+  int in_width, in_height;
+  int crop_y, crop_height;
+  int out_width, out_height;
+  cl_kernel krnl;
+} DMonitoringCropState;
+
+// Crops a crop_width x crop_height region at crop_x, crop_y out of an in_width x in_height I420 frame,
+// mirrors it if asked and scales it to out_width x out_height
+void dmonitoring_crop_init(DMonitoringCropState* s, cl_context ctx, cl_device_id device_id,
+                           int in_width, int in_height,
+                           int crop_x, int crop_y, int crop_width, int crop_height, bool mirror,
+                           int out_width, int out_height, bool normalize);
+
+void dmonitoring_crop_destroy(DMonitoringCropState* s);
+
+// Writes the float tensor the driver monitoring model takes, (out_width/2) * (out_height/2) * 6 floats
+void dmonitoring_crop_queue(DMonitoringCropState* s, cl_command_queue q, cl_mem yuv_cl, cl_mem out_cl);
@@ -5,11 +5,16 @@
 
 #include "transform.h"
 
+#ifndef TRANSFORMS_DIR
+#define TRANSFORMS_DIR "transforms/"
+#endif
+
 void transform_init(Transform* s, cl_context ctx, cl_device_id device_id) {
   memset(s, 0, sizeof(*s));
 
-  cl_program prg = cl_program_from_file(ctx, device_id, "transforms/transform.cl", "");
+  cl_program prg = cl_program_from_file(ctx, device_id, TRANSFORMS_DIR "transform.cl", "");
   s->krnl = CL_CHECK_ERR(clCreateKernel(prg, "warpPerspective", &err));
+  s->tensor_krnl = CL_CHECK_ERR(clCreateKernel(prg, "warpPerspectiveTensor", &err));
   // done with this
   CL_CHECK(clReleaseProgram(prg));
 
@@ -21,6 +26,7 @@ void transform_destroy(Transform* s) {
   CL_CHECK(clReleaseMemObject(s->m_y_cl));
   CL_CHECK(clReleaseMemObject(s->m_uv_cl));
   CL_CHECK(clReleaseKernel(s->krnl));
+  CL_CHECK(clReleaseKernel(s->tensor_krnl));
 }
 
 void transform_queue(Transform* s,
@@ -93,3 +99,25 @@ void transform_queue(Transform* s,
   CL_CHECK(clEnqueueNDRangeKernel(q, s->krnl, 2, NULL,
                               (const size_t*)&work_size_uv, NULL, 0, 0, NULL));
 }
+
+void transform_queue_tensor(Transform* s, cl_command_queue q,
+                            cl_mem in_yuv, int in_width, int in_height,
+                            cl_mem out_tensor, int out_width, int out_height,
+                            mat3 projection) {
+  mat3 projection_uv = transform_scale_buffer(projection, 0.5);
+  CL_CHECK(clEnqueueWriteBuffer(q, s->m_y_cl, CL_TRUE, 0, 3*3*sizeof(float), (void*)projection.v, 0, NULL, NULL));
+  CL_CHECK(clEnqueueWriteBuffer(q, s->m_uv_cl, CL_TRUE, 0, 3*3*sizeof(float), (void*)projection_uv.v, 0, NULL, NULL));
+
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 0, sizeof(cl_mem), &in_yuv));
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 1, sizeof(cl_int), &in_width));
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 2, sizeof(cl_int), &in_height));
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 3, sizeof(cl_mem), &out_tensor));
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 4, sizeof(cl_int), &out_width));
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 5, sizeof(cl_int), &out_height));
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 6, sizeof(cl_mem), &s->m_y_cl));
+  CL_CHECK(clSetKernelArg(s->tensor_krnl, 7, sizeof(cl_mem), &s->m_uv_cl));
+
+  // a work item per uv pixel
+  const size_t work_size[2] = {(size_t)out_width/2, (size_t)out_height/2};
+  CL_CHECK(clEnqueueNDRangeKernel(q, s->tensor_krnl, 2, NULL, (const size_t*)&work_size, NULL, 0, 0, NULL));
+}
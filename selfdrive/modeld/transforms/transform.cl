@@ -5,6 +5,43 @@
 #define INTER_REMAP_COEF_BITS 15
 #define INTER_REMAP_COEF_SCALE (1 << INTER_REMAP_COEF_BITS)
 
+// the bilinear sample of the plane at src_offset for the pixel (dx, dy) of the warped one
+inline uchar warp_sample(__global const uchar * src, int src_step, int src_offset, int src_rows, int src_cols,
+                         __constant float * M, int dx, int dy)
+{
+    float X0 = M[0] * dx + M[1] * dy + M[2];
+    float Y0 = M[3] * dx + M[4] * dy + M[5];
+    float W = M[6] * dx + M[7] * dy + M[8];
+    W = W != 0.0f ? INTER_TAB_SIZE / W : 0.0f;
+    int X = rint(X0 * W), Y = rint(Y0 * W);
+
+    short sx = convert_short_sat(X >> INTER_BITS);
+    short sy = convert_short_sat(Y >> INTER_BITS);
+    short ay = (short)(Y & (INTER_TAB_SIZE - 1));
+    short ax = (short)(X & (INTER_TAB_SIZE - 1));
+
+    int v0 = (sx >= 0 && sx < src_cols && sy >= 0 && sy < src_rows) ?
+        convert_int(src[mad24(sy, src_step, src_offset + sx)]) : 0;
+    int v1 = (sx+1 >= 0 && sx+1 < src_cols && sy >= 0 && sy < src_rows) ?
+        convert_int(src[mad24(sy, src_step, src_offset + (sx+1))]) : 0;
+    int v2 = (sx >= 0 && sx < src_cols && sy+1 >= 0 && sy+1 < src_rows) ?
+        convert_int(src[mad24(sy+1, src_step, src_offset + sx)]) : 0;
+    int v3 = (sx+1 >= 0 && sx+1 < src_cols && sy+1 >= 0 && sy+1 < src_rows) ?
+        convert_int(src[mad24(sy+1, src_step, src_offset + (sx+1))]) : 0;
+
+    float taby = 1.f/INTER_TAB_SIZE*ay;
+    float tabx = 1.f/INTER_TAB_SIZE*ax;
+
+    int itab0 = convert_short_sat_rte( (1.0f-taby)*(1.0f-tabx) * INTER_REMAP_COEF_SCALE );
+    int itab1 = convert_short_sat_rte( (1.0f-taby)*tabx * INTER_REMAP_COEF_SCALE );
+    int itab2 = convert_short_sat_rte( taby*(1.0f-tabx) * INTER_REMAP_COEF_SCALE );
+    int itab3 = convert_short_sat_rte( taby*tabx * INTER_REMAP_COEF_SCALE );
+
+    int val = v0 * itab0 +  v1 * itab1 + v2 * itab2 + v3 * itab3;
+
+    return convert_uchar_sat((val + (1 << (INTER_REMAP_COEF_BITS-1))) >> INTER_REMAP_COEF_BITS);
+}
+
 __kernel void warpPerspective(__global const uchar * src,
                               int src_step, int src_offset, int src_rows, int src_cols,
                               __global uchar * dst,
@@ -16,39 +53,36 @@ __kernel void warpPerspective(__global const uchar * src,
 
     if (dx < dst_cols && dy < dst_rows)
     {
-        float X0 = M[0] * dx + M[1] * dy + M[2];
-        float Y0 = M[3] * dx + M[4] * dy + M[5];
-        float W = M[6] * dx + M[7] * dy + M[8];
-        W = W != 0.0f ? INTER_TAB_SIZE / W : 0.0f;
-        int X = rint(X0 * W), Y = rint(Y0 * W);
-
-        short sx = convert_short_sat(X >> INTER_BITS);
-        short sy = convert_short_sat(Y >> INTER_BITS);
-        short ay = (short)(Y & (INTER_TAB_SIZE - 1));
-        short ax = (short)(X & (INTER_TAB_SIZE - 1));
-
-        int v0 = (sx >= 0 && sx < src_cols && sy >= 0 && sy < src_rows) ?
-            convert_int(src[mad24(sy, src_step, src_offset + sx)]) : 0;
-        int v1 = (sx+1 >= 0 && sx+1 < src_cols && sy >= 0 && sy < src_rows) ?
-            convert_int(src[mad24(sy, src_step, src_offset + (sx+1))]) : 0;
-        int v2 = (sx >= 0 && sx < src_cols && sy+1 >= 0 && sy+1 < src_rows) ?
-            convert_int(src[mad24(sy+1, src_step, src_offset + sx)]) : 0;
-        int v3 = (sx+1 >= 0 && sx+1 < src_cols && sy+1 >= 0 && sy+1 < src_rows) ?
-            convert_int(src[mad24(sy+1, src_step, src_offset + (sx+1))]) : 0;
-
-        float taby = 1.f/INTER_TAB_SIZE*ay;
-        float tabx = 1.f/INTER_TAB_SIZE*ax;
-
-        int dst_index = mad24(dy, dst_step, dst_offset + dx);
-
-        int itab0 = convert_short_sat_rte( (1.0f-taby)*(1.0f-tabx) * INTER_REMAP_COEF_SCALE );
-        int itab1 = convert_short_sat_rte( (1.0f-taby)*tabx * INTER_REMAP_COEF_SCALE );
-        int itab2 = convert_short_sat_rte( taby*(1.0f-tabx) * INTER_REMAP_COEF_SCALE );
-        int itab3 = convert_short_sat_rte( taby*tabx * INTER_REMAP_COEF_SCALE );
-
-        int val = v0 * itab0 +  v1 * itab1 + v2 * itab2 + v3 * itab3;
-
-        uchar pix = convert_uchar_sat((val + (1 << (INTER_REMAP_COEF_BITS-1))) >> INTER_REMAP_COEF_BITS);
-        dst[dst_index] = pix;
+        dst[mad24(dy, dst_step, dst_offset + dx)] = warp_sample(src, src_step, src_offset, src_rows, src_cols, M, dx, dy);
+    }
+}
+
+// warpPerspective of the y, u and v planes of a yuv frame straight into the model's float tensor,
+// in its y|y|y|y|u|v layout: the 2x2 ys of each uv pixel by row and then column parity, then u and v.
+// One work item per uv pixel of the output
+__kernel void warpPerspectiveTensor(__global const uchar * src, int src_width, int src_height,
+                                    __global float * out, int out_width, int out_height,
+                                    __constant float * M_y, __constant float * M_uv)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int uv_width = out_width / 2;
+    const int uv_height = out_height / 2;
+
+    if (x < uv_width && y < uv_height)
+    {
+        const int src_uv_width = src_width / 2;
+        const int src_uv_height = src_height / 2;
+        const int src_u_offset = src_width * src_height;
+        const int src_v_offset = src_u_offset + src_uv_width * src_uv_height;
+
+        const int uv_size = uv_width * uv_height;
+        const int i = mad24(y, uv_width, x);
+        out[i] = convert_float(warp_sample(src, src_width, 0, src_height, src_width, M_y, 2*x, 2*y));
+        out[uv_size + i] = convert_float(warp_sample(src, src_width, 0, src_height, src_width, M_y, 2*x, 2*y + 1));
+        out[2*uv_size + i] = convert_float(warp_sample(src, src_width, 0, src_height, src_width, M_y, 2*x + 1, 2*y));
+        out[3*uv_size + i] = convert_float(warp_sample(src, src_width, 0, src_height, src_width, M_y, 2*x + 1, 2*y + 1));
+        out[4*uv_size + i] = convert_float(warp_sample(src, src_uv_width, src_u_offset, src_uv_height, src_uv_width, M_uv, x, y));
+        out[5*uv_size + i] = convert_float(warp_sample(src, src_uv_width, src_v_offset, src_uv_height, src_uv_width, M_uv, x, y));
     }
 }
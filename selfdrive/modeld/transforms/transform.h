@@ -13,7 +13,7 @@
 #include "common/mat.h"
 
 typedef struct {
-  cl_kernel krnl;
+  cl_kernel krnl, tensor_krnl;
   cl_mem m_y_cl, m_uv_cl;
 } Transform;
 
@@ -26,3 +26,10 @@ void transform_queue(Transform* s, cl_command_queue q,
                      cl_mem out_y, cl_mem out_u, cl_mem out_v,
                      int out_width, int out_height,
                      mat3 projection);
+
+// The warp straight into a model input tensor of out_width*out_height*3/2 floats, in the y|y|y|y|u|v
+// layout, in one pass
+void transform_queue_tensor(Transform* s, cl_command_queue q,
+                            cl_mem yuv, int in_width, int in_height,
+                            cl_mem out_tensor, int out_width, int out_height,
+                            mat3 projection);
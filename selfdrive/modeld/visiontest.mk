@@ -49,7 +49,6 @@ all: visiontest
 
 libvisiontest_inputs := visiontest.c \
                         transforms/transform.cc \
-                        transforms/loadyuv.cc \
                         ../common/clutil.cc \
                         $(BASEDIR)/selfdrive/common/util.c \
                         $(CEREAL_OBJS)
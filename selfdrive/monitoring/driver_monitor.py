@@ -116,13 +116,26 @@ class DriverStatus():
     self.hi_stds = 0
     self.hi_std_alert_enabled = True
     self.threshold_prompt = _DISTRACTED_PROMPT_TIME_TILL_TERMINAL / _DISTRACTED_TIME
+    # camera frames per driverState, the timers step by the time one stands for
+    self.frame_interval = 1
+    self.dt = DT_DMON
 
     self._set_timers(active_monitoring=True)
 
+  def set_frame_interval(self, frame_interval):
+    # dmonitoringmodeld runs the model on every frame_interval-th frame when it can
+    frame_interval = max(int(frame_interval), 1)
+    if frame_interval == self.frame_interval:
+      return
+    self.step_change *= frame_interval / self.frame_interval
+    self.frame_interval = frame_interval
+    self.dt = DT_DMON * frame_interval
+    self.driver_distraction_filter = FirstOrderFilter(self.driver_distraction_filter.x, _DISTRACTED_FILTER_TS, self.dt)
+
   def _set_timers(self, active_monitoring):
     if self.active_monitoring_mode and self.awareness <= self.threshold_prompt:
       if active_monitoring:
-        self.step_change = DT_DMON / _DISTRACTED_TIME
+        self.step_change = self.dt / _DISTRACTED_TIME
       else:
         self.step_change = 0.
       return  # no exploit after orange alert
@@ -137,7 +150,7 @@ class DriverStatus():
 
       self.threshold_pre = _DISTRACTED_PRE_TIME_TILL_TERMINAL / _DISTRACTED_TIME
       self.threshold_prompt = _DISTRACTED_PROMPT_TIME_TILL_TERMINAL / _DISTRACTED_TIME
-      self.step_change = DT_DMON / _DISTRACTED_TIME
+      self.step_change = self.dt / _DISTRACTED_TIME
       self.active_monitoring_mode = True
     else:
       if self.active_monitoring_mode:
@@ -146,7 +159,7 @@ class DriverStatus():
 
       self.threshold_pre = _AWARENESS_PRE_TIME_TILL_TERMINAL / _AWARENESS_TIME
       self.threshold_prompt = _AWARENESS_PROMPT_TIME_TILL_TERMINAL / _AWARENESS_TIME
-      self.step_change = DT_DMON / _AWARENESS_TIME
+      self.step_change = self.dt / _AWARENESS_TIME
       self.active_monitoring_mode = False
 
   def _is_driver_distracted(self, pose, blink):
@@ -209,7 +222,8 @@ class DriverStatus():
     if self.face_detected and not self.pose.low_std:
       if not is_model_uncertain:
         self.step_change *= min(1.0, max(0.6, 1.6*(model_std_max-0.5)*(model_std_max-2)))
-      self.hi_stds += 1
+      # counted in frames
+      self.hi_stds += self.frame_interval
     elif self.face_detected and self.pose.low_std:
       self.hi_stds = 0
 
@@ -247,7 +261,7 @@ class DriverStatus():
       # terminal red alert: disengagement required
       alert = EventName.driverDistracted if self.active_monitoring_mode else EventName.driverUnresponsive
       self.hi_std_alert_enabled = True
-      self.terminal_time += 1
+      self.terminal_time += self.frame_interval
       if awareness_prev > 0.:
         self.terminal_alert_cnt += 1
     elif self.awareness <= self.threshold_prompt:
@@ -55,11 +55,12 @@ always_false = [False] * int(_TEST_TIMESPAN/DT_DMON)
 
 # TODO: this only tests DriverStatus
 class TestMonitoring(unittest.TestCase):
-  def _run_seq(self, msgs, interaction, engaged, standstill):
+  def _run_seq(self, msgs, interaction, engaged, standstill, frame_interval=1):
     DS = DriverStatus()
     events = []
     for idx in range(len(msgs)):
       e = Events()
+      DS.set_frame_interval(frame_interval)
       DS.get_pose(msgs[idx], [0, 0, 0], 0, engaged[idx])
       # cal_rpy and car_speed don't matter here
 
@@ -89,6 +90,19 @@ class TestMonitoring(unittest.TestCase):
                       ((_TEST_TIMESPAN-10-_DISTRACTED_TIME)/2))/DT_DMON)].names[0], EventName.driverDistracted)
     self.assertIs(type(d_status.awareness), float)
 
+  # engaged, driver is distracted and does nothing, the model runs on every other frame
+  #  - the alerts come at the same times
+  def test_fully_distracted_driver_every_other_frame(self):
+    dt = 2 * DT_DMON
+    events = self._run_seq(always_distracted[::2], always_false[::2], always_true[::2], always_false[::2], frame_interval=2)[0]
+    self.assertEqual(len(events[int((_DISTRACTED_TIME-_DISTRACTED_PRE_TIME_TILL_TERMINAL)/2/dt)]), 0)
+    self.assertEqual(events[int((_DISTRACTED_TIME-_DISTRACTED_PRE_TIME_TILL_TERMINAL +
+                      ((_DISTRACTED_PRE_TIME_TILL_TERMINAL-_DISTRACTED_PROMPT_TIME_TILL_TERMINAL)/2))/dt)].names[0], EventName.preDriverDistracted)
+    self.assertEqual(events[int((_DISTRACTED_TIME-_DISTRACTED_PROMPT_TIME_TILL_TERMINAL +
+                      ((_DISTRACTED_PROMPT_TIME_TILL_TERMINAL)/2))/dt)].names[0], EventName.promptDriverDistracted)
+    self.assertEqual(events[int((_DISTRACTED_TIME +
+                      ((_TEST_TIMESPAN-10-_DISTRACTED_TIME)/2))/dt)].names[0], EventName.driverDistracted)
+
   # engaged, no face detected the whole time, no action
   def test_fully_invisible_driver(self):
     events = self._run_seq(always_no_face, always_false, always_true, always_false)[0]
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A /proc file kept open between cycles. Each read is a pread from the start, which
+// regenerates the file, into the caller's buffer
+class ProcFile {
+public:
+  ProcFile() {}
+  explicit ProcFile(const char *path) : fd(open(path, O_RDONLY | O_CLOEXEC)) {}
+  ProcFile(ProcFile &&other) : fd(other.fd) { other.fd = -1; }
+  ProcFile &operator=(ProcFile &&other) {
+    std::swap(fd, other.fd);
+    return *this;
+  }
+  ~ProcFile() {
+    if (fd >= 0) close(fd);
+  }
+
+  // The contents, NUL terminated, or NULL if it's gone
+  const char *read(std::vector<char> &buf) {
+    if (fd < 0) return NULL;
+    if (buf.size() < 4096) buf.resize(4096);
+
+    size_t len = 0;
+    while (true) {
+      ssize_t ret = pread(fd, &buf[len], buf.size() - len - 1, len);
+      if (ret < 0) return NULL;
+      if (ret == 0) break;
+      len += ret;
+      if (len == buf.size() - 1) buf.resize(buf.size() * 2);
+    }
+    buf[len] = '\0';
+    return buf.data();
+  }
+
+private:
+  int fd = -1;
+};
+
+// Walks the space separated numbers of a /proc file. Past the end every field is 0 and ok is false
+struct Parser {
+  const char *p;
+  bool ok = true;
+
+  void skip_space() {
+    while (*p == ' ' || *p == '\t') p++;
+  }
+  uint64_t u64() {
+    skip_space();
+    if (*p < '0' || *p > '9') {
+      ok = false;
+      return 0;
+    }
+    uint64_t v = 0;
+    while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    return v;
+  }
+  int64_t i64() {
+    skip_space();
+    bool neg = *p == '-';
+    if (neg) p++;
+    int64_t v = u64();
+    return neg ? -v : v;
+  }
+  void skip(int fields) {
+    for (int i = 0; i < fields; i++) i64();
+  }
+};
+
+// The fields of /proc/<pid>/stat and /proc/<pid>/task/<tid>/stat that are logged
+struct ProcStat {
+  std::string name;
+  char state;
+  int ppid;
+  unsigned long utime, stime;
+  long cutime, cstime, priority, nice, num_threads;
+  unsigned long long starttime;
+  unsigned long vms, rss;
+  int processor;
+  unsigned int rt_priority, policy;
+};
+
+inline bool parse_stat(const char *s, ProcStat &st) {
+  // the name is in parentheses and may have any of them itself, it ends at the last one
+  const char *open = strchr(s, '(');
+  const char *close = strrchr(s, ')');
+  if (!open || !close || close < open || close[1] != ' ') return false;
+  st.name.assign(open + 1, close - open - 1);
+
+  Parser ps = {close + 2};
+  st.state = *ps.p++;
+  st.ppid = ps.i64();
+  ps.skip(9);  // pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt
+  st.utime = ps.u64();
+  st.stime = ps.u64();
+  st.cutime = ps.i64();
+  st.cstime = ps.i64();
+  st.priority = ps.i64();
+  st.nice = ps.i64();
+  st.num_threads = ps.i64();
+  ps.skip(1);  // itrealvalue
+  st.starttime = ps.u64();
+  st.vms = ps.u64();
+  st.rss = ps.u64();
+  ps.skip(14);  // rsslim to exit_signal
+  st.processor = ps.i64();
+  st.rt_priority = ps.u64();
+  st.policy = ps.u64();
+  return ps.ok;
+}
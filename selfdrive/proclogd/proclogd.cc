@@ -3,14 +3,12 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <climits>
 #include <cassert>
 #include <memory>
 #include <utility>
-#include <sstream>
-#include <fstream>
 #include <algorithm>
-#include <functional>
 #include <unordered_map>
 
 #include "messaging.hpp"
@@ -18,13 +16,59 @@
 #include "common/timing.h"
 #include "common/util.h"
 
+#include "procfs.h"
+
 ExitHandler do_exit;
 
 namespace {
+
 struct ProcCache {
   std::string name;
   std::vector<std::string> cmdline;
   std::string exe;
+  ProcFile stat;
+  // run from the openpilot tree, the only ones whose threads are logged
+  bool ours = false;
+  std::unordered_map<pid_t, ProcFile> tasks;
+  uint64_t seen = 0;
+};
+
+std::vector<std::string> read_cmdline(pid_t pid) {
+  // null-delimited cmdline arguments to vector
+  std::string cmdline_s = util::read_file(util::string_format("/proc/%d/cmdline", pid));
+  const char* cmdline_p = cmdline_s.c_str();
+  const char* cmdline_ep = cmdline_p + cmdline_s.size();
+
+  // strip trailing null bytes
+  while ((cmdline_ep-1) > cmdline_p && *(cmdline_ep-1) == 0) {
+    cmdline_ep--;
+  }
+
+  std::vector<std::string> cmdline;
+  while (cmdline_p < cmdline_ep) {
+    std::string arg(cmdline_p);
+    cmdline.push_back(arg);
+    cmdline_p += arg.size() + 1;
+  }
+  return cmdline;
+}
+
+struct CPUTimes {
+  int id;
+  unsigned long utime, ntime, stime, itime;
+  unsigned long iowtime, irqtime, sirqtime;
+};
+
+struct ProcEntry {
+  pid_t pid;
+  ProcStat stat;
+  ProcCache *cache;
+  size_t first_thread, num_threads;
+};
+
+struct ThreadEntry {
+  pid_t tid;
+  ProcStat stat;
 };
 
 }
@@ -35,75 +79,82 @@ int main() {
   double jiffy = sysconf(_SC_CLK_TCK);
   size_t page_size = sysconf(_SC_PAGE_SIZE);
 
+  // PROCLOGD_THREADS=1 also logs the threads of the processes run from BASEDIR
+  const char *basedir = getenv("BASEDIR");
+  const char *threads_env = getenv("PROCLOGD_THREADS");
+  const bool log_threads = threads_env && strcmp(threads_env, "1") == 0 && basedir && basedir[0];
+
+  ProcFile proc_stat("/proc/stat"), proc_meminfo("/proc/meminfo");
+  std::vector<char> buf;
   std::unordered_map<pid_t, ProcCache> proc_cache;
+  std::vector<CPUTimes> cpu_times;
+  std::vector<ProcEntry> procs;
+  std::vector<ThreadEntry> threads;
+  uint64_t cycle = 0;
 
   while (!do_exit) {
+    cycle++;
 
     MessageBuilder msg;
     auto procLog = msg.initEvent().initProcLog();
-    auto orphanage = msg.getOrphanage();
 
     // stat
-    {
-      std::vector<capnp::Orphan<cereal::ProcLog::CPUTimes>> otimes;
-
-      std::ifstream sstat("/proc/stat");
-      std::string stat_line;
-      while (std::getline(sstat, stat_line)) {
-        if (util::starts_with(stat_line, "cpu ")) {
-          // cpu total
-        } else if (util::starts_with(stat_line, "cpu")) {
-          // specific cpu
-          int id;
-          unsigned long utime, ntime, stime, itime;
-          unsigned long iowtime, irqtime, sirqtime;
-
-          sscanf(stat_line.data(), "cpu%d %lu %lu %lu %lu %lu %lu %lu",
-                 &id, &utime, &ntime, &stime, &itime, &iowtime, &irqtime, &sirqtime);
-
-          auto ltimeo = orphanage.newOrphan<cereal::ProcLog::CPUTimes>();
-          auto ltime = ltimeo.get();
-          ltime.setCpuNum(id);
-          ltime.setUser(utime / jiffy);
-          ltime.setNice(ntime / jiffy);
-          ltime.setSystem(stime / jiffy);
-          ltime.setIdle(itime / jiffy);
-          ltime.setIowait(iowtime / jiffy);
-          ltime.setIrq(irqtime / jiffy);
-          ltime.setSoftirq(irqtime / jiffy);
-
-          otimes.push_back(std::move(ltimeo));
-
-        } else {
-          break;
-        }
+    cpu_times.clear();
+    if (const char *s = proc_stat.read(buf)) {
+      // the cpu total, then one line per cpu
+      for (const char *line = strchr(s, '\n'); line && strncmp(line + 1, "cpu", 3) == 0; line = strchr(line + 1, '\n')) {
+        Parser ps = {line + 4};
+        CPUTimes t;
+        t.id = ps.u64();
+        t.utime = ps.u64();
+        t.ntime = ps.u64();
+        t.stime = ps.u64();
+        t.itime = ps.u64();
+        t.iowtime = ps.u64();
+        t.irqtime = ps.u64();
+        t.sirqtime = ps.u64();
+        if (ps.ok) cpu_times.push_back(t);
       }
+    }
 
-      auto ltimes = procLog.initCpuTimes(otimes.size());
-      for (size_t i = 0; i < otimes.size(); i++) {
-        ltimes.adoptWithCaveats(i, std::move(otimes[i]));
-      }
+    auto ltimes = procLog.initCpuTimes(cpu_times.size());
+    for (size_t i = 0; i < cpu_times.size(); i++) {
+      const CPUTimes &t = cpu_times[i];
+      auto ltime = ltimes[i];
+      ltime.setCpuNum(t.id);
+      ltime.setUser(t.utime / jiffy);
+      ltime.setNice(t.ntime / jiffy);
+      ltime.setSystem(t.stime / jiffy);
+      ltime.setIdle(t.itime / jiffy);
+      ltime.setIowait(t.iowtime / jiffy);
+      ltime.setIrq(t.irqtime / jiffy);
+      ltime.setSoftirq(t.sirqtime / jiffy);
     }
 
     // meminfo
     {
       auto mem = procLog.initMem();
 
-      std::ifstream smem("/proc/meminfo");
-      std::string mem_line;
-
       uint64_t mem_total = 0, mem_free = 0, mem_available = 0, mem_buffers = 0;
       uint64_t mem_cached = 0, mem_active = 0, mem_inactive = 0, mem_shared = 0;
-
-      while (std::getline(smem, mem_line)) {
-        if (util::starts_with(mem_line, "MemTotal:")) sscanf(mem_line.data(), "MemTotal: %" SCNu64 " kB", &mem_total);
-        else if (util::starts_with(mem_line, "MemFree:")) sscanf(mem_line.data(), "MemFree: %" SCNu64 " kB", &mem_free);
-        else if (util::starts_with(mem_line, "MemAvailable:")) sscanf(mem_line.data(), "MemAvailable: %" SCNu64 " kB", &mem_available);
-        else if (util::starts_with(mem_line, "Buffers:")) sscanf(mem_line.data(), "Buffers: %" SCNu64 " kB", &mem_buffers);
-        else if (util::starts_with(mem_line, "Cached:")) sscanf(mem_line.data(), "Cached: %" SCNu64 " kB", &mem_cached);
-        else if (util::starts_with(mem_line, "Active:")) sscanf(mem_line.data(), "Active: %" SCNu64 " kB", &mem_active);
-        else if (util::starts_with(mem_line, "Inactive:")) sscanf(mem_line.data(), "Inactive: %" SCNu64 " kB", &mem_inactive);
-        else if (util::starts_with(mem_line, "Shmem:")) sscanf(mem_line.data(), "Shmem: %" SCNu64 " kB", &mem_shared);
+      const std::pair<const char *, uint64_t *> fields[] = {
+        {"MemTotal:", &mem_total}, {"MemFree:", &mem_free}, {"MemAvailable:", &mem_available},
+        {"Buffers:", &mem_buffers}, {"Cached:", &mem_cached}, {"Active:", &mem_active},
+        {"Inactive:", &mem_inactive}, {"Shmem:", &mem_shared},
+      };
+
+      const char *line = proc_meminfo.read(buf);
+      while (line && *line) {
+        for (auto &[key, value] : fields) {
+          size_t key_len = strlen(key);
+          if (strncmp(line, key, key_len) == 0) {
+            Parser ps = {line + key_len};
+            *value = ps.u64();
+            break;
+          }
+        }
+        line = strchr(line, '\n');
+        if (line) line++;
       }
 
       mem.setTotal(mem_total * 1024);
@@ -118,7 +169,8 @@ int main() {
 
     // processes
     {
-      std::vector<capnp::Orphan<cereal::ProcLog::Process>> oprocs;
+      procs.clear();
+      threads.clear();
       struct dirent *de = NULL;
       DIR *d = opendir("/proc");
       assert(d);
@@ -126,99 +178,116 @@ int main() {
         if (!isdigit(de->d_name[0])) continue;
         pid_t pid = atoi(de->d_name);
 
-
-        auto lproco = orphanage.newOrphan<cereal::ProcLog::Process>();
-        auto lproc = lproco.get();
-
-        lproc.setPid(pid);
-
-        char tcomm[PATH_MAX] = {0};
-
-        {
-          std::string stat = util::read_file(util::string_format("/proc/%d/stat", pid));
-
-          char state;
-
-          int ppid;
-          unsigned long utime, stime;
-          long cutime, cstime, priority, nice, num_threads;
-          unsigned long long starttime;
-          unsigned long vms, rss;
-          int processor;
-
-          int count = sscanf(stat.data(),
-            "%*d (%1024[^)]) %c %d %*d %*d %*d %*d %*d %*d %*d %*d %*d "
-             "%lu %lu %ld %ld %ld %ld %ld %*d %lld "
-             "%lu %lu %*d %*d %*d %*d %*d %*d %*d "
-             "%*d %*d %*d %*d %*d %*d %*d %d",
-            tcomm, &state, &ppid,
-            &utime, &stime, &cutime, &cstime, &priority, &nice, &num_threads, &starttime,
-            &vms, &rss, &processor);
-
-          if (count != 14) continue;
-
-          lproc.setState(state);
-          lproc.setPpid(ppid);
-          lproc.setCpuUser(utime / jiffy);
-          lproc.setCpuSystem(stime / jiffy);
-          lproc.setCpuChildrenUser(cutime / jiffy);
-          lproc.setCpuChildrenSystem(cstime / jiffy);
-          lproc.setPriority(priority);
-          lproc.setNice(nice);
-          lproc.setNumThreads(num_threads);
-          lproc.setStartTime(starttime / jiffy);
-          lproc.setMemVms(vms);
-          lproc.setMemRss((uint64_t)rss * page_size);
-          lproc.setProcessor(processor);
-        }
-
-        std::string name(tcomm);
-        lproc.setName(name);
-
-        // populate other things from cache
+        // a cached stat of a pid that exited and was reused fails to read, it's opened again
+        ProcEntry entry = {.pid = pid};
+        const char *s = NULL;
         auto cache_it = proc_cache.find(pid);
-        ProcCache cache;
         if (cache_it != proc_cache.end()) {
-          cache = cache_it->second;
-        }
-        if (cache_it == proc_cache.end() || cache.name != name) {
-          cache = (ProcCache){
-            .name = name,
-            .exe = util::readlink(util::string_format("/proc/%d/exe", pid)),
-          };
-
-          // null-delimited cmdline arguments to vector
-          std::string cmdline_s = util::read_file(util::string_format("/proc/%d/cmdline", pid));
-          const char* cmdline_p = cmdline_s.c_str();
-          const char* cmdline_ep = cmdline_p + cmdline_s.size();
-
-          // strip trailing null bytes
-          while ((cmdline_ep-1) > cmdline_p && *(cmdline_ep-1) == 0) {
-            cmdline_ep--;
+          s = cache_it->second.stat.read(buf);
+          if (!s || !parse_stat(s, entry.stat)) {
+            proc_cache.erase(cache_it);
+            cache_it = proc_cache.end();
           }
-
-          while (cmdline_p < cmdline_ep) {
-            std::string arg(cmdline_p);
-            cache.cmdline.push_back(arg);
-            cmdline_p += arg.size() + 1;
+        }
+        if (cache_it == proc_cache.end()) {
+          ProcFile stat(util::string_format("/proc/%d/stat", pid).c_str());
+          s = stat.read(buf);
+          if (!s || !parse_stat(s, entry.stat)) continue;
+          cache_it = proc_cache.emplace(pid, ProcCache()).first;
+          cache_it->second.stat = std::move(stat);
+          if (log_threads) {
+            std::string cwd = util::readlink(util::string_format("/proc/%d/cwd", pid));
+            cache_it->second.ours = util::starts_with(cwd, basedir);
           }
-
-          proc_cache[pid] = cache;
         }
 
-        auto lcmdline = lproc.initCmdline(cache.cmdline.size());
-        for (size_t i = 0; i < lcmdline.size(); i++) {
-          lcmdline.set(i, cache.cmdline[i]);
+        // populate other things from cache, the cmdline and exe only change on exec
+        ProcCache &cache = cache_it->second;
+        cache.seen = cycle;
+        if (cache.name != entry.stat.name) {
+          cache.name = entry.stat.name;
+          cache.exe = util::readlink(util::string_format("/proc/%d/exe", pid));
+          cache.cmdline = read_cmdline(pid);
         }
-        lproc.setExe(cache.exe);
+        entry.cache = &cache;
+
+        entry.first_thread = threads.size();
+        if (log_threads && cache.ours) {
+          std::string task_dir = util::string_format("/proc/%d/task", pid);
+          std::unordered_map<pid_t, ProcFile> tasks;
+          if (DIR *td = opendir(task_dir.c_str())) {
+            while ((de = readdir(td))) {
+              if (!isdigit(de->d_name[0])) continue;
+              pid_t tid = atoi(de->d_name);
+
+              auto task_it = cache.tasks.find(tid);
+              ProcFile tstat = task_it != cache.tasks.end() ? std::move(task_it->second)
+                             : ProcFile((task_dir + "/" + de->d_name + "/stat").c_str());
+              ThreadEntry thread = {.tid = tid};
+              const char *ts = tstat.read(buf);
+              if (ts && parse_stat(ts, thread.stat)) {
+                threads.push_back(std::move(thread));
+                tasks.emplace(tid, std::move(tstat));
+              }
+            }
+            closedir(td);
+          }
+          cache.tasks.swap(tasks);
+        }
+        entry.num_threads = threads.size() - entry.first_thread;
 
-        oprocs.push_back(std::move(lproco));
+        procs.push_back(std::move(entry));
       }
       closedir(d);
 
-      auto lprocs = procLog.initProcs(oprocs.size());
-      for (size_t i = 0; i < oprocs.size(); i++) {
-        lprocs.adoptWithCaveats(i, std::move(oprocs[i]));
+      // the pids that weren't there, with the files they held open
+      for (auto it = proc_cache.begin(); it != proc_cache.end();) {
+        it = it->second.seen == cycle ? std::next(it) : proc_cache.erase(it);
+      }
+
+      auto lprocs = procLog.initProcs(procs.size());
+      for (size_t i = 0; i < procs.size(); i++) {
+        const ProcEntry &p = procs[i];
+        const ProcStat &st = p.stat;
+        auto lproc = lprocs[i];
+
+        lproc.setPid(p.pid);
+        lproc.setName(st.name);
+        lproc.setState(st.state);
+        lproc.setPpid(st.ppid);
+        lproc.setCpuUser(st.utime / jiffy);
+        lproc.setCpuSystem(st.stime / jiffy);
+        lproc.setCpuChildrenUser(st.cutime / jiffy);
+        lproc.setCpuChildrenSystem(st.cstime / jiffy);
+        lproc.setPriority(st.priority);
+        lproc.setNice(st.nice);
+        lproc.setNumThreads(st.num_threads);
+        lproc.setStartTime(st.starttime / jiffy);
+        lproc.setMemVms(st.vms);
+        lproc.setMemRss((uint64_t)st.rss * page_size);
+        lproc.setProcessor(st.processor);
+
+        auto lcmdline = lproc.initCmdline(p.cache->cmdline.size());
+        for (size_t j = 0; j < lcmdline.size(); j++) {
+          lcmdline.set(j, p.cache->cmdline[j]);
+        }
+        lproc.setExe(p.cache->exe);
+
+        if (p.num_threads > 0) {
+          auto lthreads = lproc.initThreads(p.num_threads);
+          for (size_t j = 0; j < p.num_threads; j++) {
+            const ThreadEntry &t = threads[p.first_thread + j];
+            auto lthread = lthreads[j];
+            lthread.setTid(t.tid);
+            lthread.setName(t.stat.name);
+            lthread.setState(t.stat.state);
+            lthread.setCpuUser(t.stat.utime / jiffy);
+            lthread.setCpuSystem(t.stat.stime / jiffy);
+            lthread.setPriority(t.stat.priority);
+            lthread.setNice(t.stat.nice);
+            lthread.setProcessor(t.stat.processor);
+          }
+        }
       }
     }
 
@@ -0,0 +1,165 @@
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "messaging.hpp"
+#include "services.h"
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/util.h"
+
+// Watches every service against its frequency in service_list.yaml and publishes, once a second,
+// the rate, the jitter between messages and, when msgq numbers and times its messages
+// (MSGQ_FRAME_HEADER), the transport latency and drops. The reads are conflated views, no message
+// is copied or parsed. A service falling short of its SLO, or recovering, is logged
+
+#define PERIOD_NS 1000000000ULL
+// below this share of the expected rate, for services with at least SLO_MIN_MESSAGES a period
+#define SLO_RATE 0.8
+#define SLO_MIN_MESSAGES 5
+// more periods of the expected rate than this between two messages
+#define SLO_INTERVAL_PERIODS 3.0
+// a p99 publish to receive latency longer than this
+#define SLO_LATENCY_US 10000
+
+ExitHandler do_exit;
+
+namespace {
+
+struct WatchedService {
+  const service *serv;
+  SubSocket *sock;
+  bool seen = false, violating = false;
+
+  // the current period
+  uint64_t count = 0, intervals = 0, last_rcv = 0;
+  double sum_interval = 0, sum_interval2 = 0, max_interval = 0;
+  // the transport's counters at its start
+  TransportStats last_stats;
+};
+
+// the upper bound of the bucket with the p share of the latencies since last
+double latency_percentile(const TransportStats &stats, const TransportStats &last, double p) {
+  uint64_t total = 0;
+  for (int i = 0; i < TRANSPORT_LATENCY_BUCKETS; i++) total += stats.latency_us[i] - last.latency_us[i];
+  if (total == 0) return 0;
+
+  uint64_t n = 0;
+  for (int i = 0; i < TRANSPORT_LATENCY_BUCKETS; i++) {
+    n += stats.latency_us[i] - last.latency_us[i];
+    if (n >= p * total) return 1ULL << i;
+  }
+  return 1ULL << (TRANSPORT_LATENCY_BUCKETS - 1);
+}
+
+}
+
+int main() {
+  Context *ctx = Context::create();
+  Poller *poller = Poller::create();
+  PubMaster pm({"serviceStats"});
+
+  std::vector<WatchedService> watched;
+  for (const auto &it : services) {
+    // the reader slots of these are sized for their subscribers, one more would take one away
+    if (!messaging_use_zmq() && it.readers > 0) continue;
+
+    SubSocket *sock = SubSocket::create(ctx, it.name, "127.0.0.1", true);
+    if (sock == NULL) {
+      LOGE("servicestatsd can't subscribe to %s", it.name);
+      continue;
+    }
+    poller->registerSocket(sock);
+    watched.push_back({.serv = &it, .sock = sock});
+  }
+
+  std::vector<SubSocket *> ready;
+  uint64_t period_start = nanos_since_boot();
+  while (!do_exit) {
+    poller->poll(100, ready);
+    const uint64_t now = nanos_since_boot();
+    for (auto s : ready) {
+      auto w = std::find_if(watched.begin(), watched.end(), [&](const WatchedService &w) { return w.sock == s; });
+      char *data = nullptr;
+      if (s->receiveView(&data) == 0 || !s->releaseView()) continue;
+
+      if (w->last_rcv) {
+        const double interval = (now - w->last_rcv) * 1e-6;
+        w->sum_interval += interval;
+        w->sum_interval2 += interval * interval;
+        w->max_interval = std::max(w->max_interval, interval);
+        w->intervals++;
+      }
+      w->last_rcv = now;
+      w->count++;
+      w->seen = true;
+    }
+
+    if (now - period_start < PERIOD_NS) continue;
+    const double seconds = (now - period_start) * 1e-9;
+    period_start = now;
+
+    const size_t num_seen = std::count_if(watched.begin(), watched.end(), [](const WatchedService &w) { return w.seen; });
+    MessageBuilder msg;
+    auto lservices = msg.initEvent().initServiceStats().initServices(num_seen);
+    size_t i = 0;
+    for (auto &w : watched) {
+      if (!w.seen) continue;
+
+      // every message published, conflate passes those over, when the transport counts them
+      uint64_t messages = w.count, dropped = 0;
+      double latency_p50 = 0, latency_p99 = 0;
+      if (const TransportStats *stats = w.sock->getStats()) {
+        messages = (stats->received - w.last_stats.received) + (stats->dropped - w.last_stats.dropped);
+        dropped = stats->dropped - w.last_stats.dropped;
+        latency_p50 = latency_percentile(*stats, w.last_stats, 0.5);
+        latency_p99 = latency_percentile(*stats, w.last_stats, 0.99);
+        w.last_stats = *stats;
+      }
+
+      // no message this period is the whole period without one
+      const double max_interval = std::max(w.max_interval, (now - w.last_rcv) * 1e-6);
+      double jitter = 0;
+      if (w.intervals > 0) {
+        const double mean = w.sum_interval / w.intervals;
+        jitter = std::sqrt(std::max(0.0, w.sum_interval2 / w.intervals - mean * mean));
+      }
+
+      const double frequency = messages / seconds;
+      const double expected = w.serv->frequency;
+      const bool violating = expected > 1e-5 && ((expected * seconds >= SLO_MIN_MESSAGES && frequency < SLO_RATE * expected) ||
+                                                 max_interval > SLO_INTERVAL_PERIODS * 1e3 / expected ||
+                                                 latency_p99 > SLO_LATENCY_US);
+      if (violating != w.violating) {
+        if (violating) {
+          LOGW("%s is under its SLO: %.1f of %.1f hz, %.1f ms between messages at most, %.0f us p99 latency",
+               w.serv->name, frequency, expected, max_interval, latency_p99);
+        } else {
+          LOGW("%s is back within its SLO", w.serv->name);
+        }
+        w.violating = violating;
+      }
+
+      auto l = lservices[i++];
+      l.setName(w.serv->name);
+      l.setExpectedFrequency(expected);
+      l.setFrequency(frequency);
+      l.setJitter(jitter);
+      l.setMaxInterval(max_interval);
+      l.setLatencyP50(latency_p50);
+      l.setLatencyP99(latency_p99);
+      l.setDropped(dropped);
+      l.setSloViolated(violating);
+
+      w.count = w.intervals = 0;
+      w.sum_interval = w.sum_interval2 = w.max_interval = 0;
+    }
+    pm.send("serviceStats", msg);
+  }
+
+  for (auto &w : watched) delete w.sock;
+  delete poller;
+  delete ctx;
+  return 0;
+}
@@ -0,0 +1,227 @@
+#include <unistd.h>
+#include <dirent.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "messaging.hpp"
+
+#include "common/timing.h"
+#include "common/util.h"
+
+#include "procfs.h"
+
+// The threads of a few processes, their cpu time, run queue delay from schedstat, context
+// switches and scheduling. THREADSTATSD_PROCS is the comma separated process names,
+// THREADSTATSD_HZ the sample rate
+
+#define DEFAULT_PROCS "boardd,modeld,camerad"
+#define DEFAULT_HZ 1.0
+// how often the process names are looked up again, for ones that started or restarted
+#define RESCAN_NS 2000000000ULL
+
+ExitHandler do_exit;
+
+namespace {
+
+struct TaskFiles {
+  ProcFile stat, schedstat, status;
+};
+
+struct TrackedProc {
+  pid_t pid;
+  std::string name;
+  std::unordered_map<pid_t, TaskFiles> tasks;
+};
+
+struct ThreadSample {
+  pid_t tid;
+  ProcStat stat;
+  uint64_t run_ns, delay_ns, timeslices;
+  uint64_t voluntary, nonvoluntary;
+};
+
+uint64_t status_field(const char *status, const char *key) {
+  // keys start a line, which keeps voluntary_ctxt_switches from matching nonvoluntary_
+  const char *p = strstr(status, key);
+  if (!p) return 0;
+  Parser ps = {p + strlen(key)};
+  return ps.u64();
+}
+
+bool sample_task(TaskFiles &files, std::vector<char> &buf, ThreadSample &s) {
+  const char *stat = files.stat.read(buf);
+  if (!stat || !parse_stat(stat, s.stat)) return false;
+
+  // run time and run queue wait in ns, and timeslices run. Kernels without schedstats have none
+  s.run_ns = s.delay_ns = s.timeslices = 0;
+  if (const char *schedstat = files.schedstat.read(buf)) {
+    Parser ps = {schedstat};
+    s.run_ns = ps.u64();
+    s.delay_ns = ps.u64();
+    s.timeslices = ps.u64();
+  }
+
+  s.voluntary = s.nonvoluntary = 0;
+  if (const char *status = files.status.read(buf)) {
+    s.voluntary = status_field(status, "\nvoluntary_ctxt_switches:");
+    s.nonvoluntary = status_field(status, "\nnonvoluntary_ctxt_switches:");
+  }
+  return true;
+}
+
+std::vector<TrackedProc> find_procs(const std::vector<std::string> &names, std::vector<TrackedProc> &old) {
+  std::vector<TrackedProc> procs;
+  std::vector<char> buf;
+  DIR *d = opendir("/proc");
+  if (!d) return procs;
+
+  struct dirent *de = NULL;
+  while ((de = readdir(d))) {
+    if (!isdigit(de->d_name[0])) continue;
+    pid_t pid = atoi(de->d_name);
+
+    ProcFile comm_file(util::string_format("/proc/%d/comm", pid).c_str());
+    const char *comm = comm_file.read(buf);
+    if (!comm) continue;
+    std::string comm_s(comm, strcspn(comm, "\n"));
+
+    for (auto &name : names) {
+      // comm is cut at 15 characters
+      if (name.compare(0, 15, comm_s) != 0) continue;
+
+      TrackedProc p = {.pid = pid, .name = name};
+      for (auto &o : old) {
+        if (o.pid == pid) p.tasks = std::move(o.tasks);
+      }
+      procs.push_back(std::move(p));
+      break;
+    }
+  }
+  closedir(d);
+  return procs;
+}
+
+}
+
+int main() {
+  std::vector<std::string> names;
+  {
+    std::string procs_env = util::getenv_default("THREADSTATSD_PROCS", "", DEFAULT_PROCS);
+    size_t start = 0;
+    while (start <= procs_env.size()) {
+      size_t end = procs_env.find(',', start);
+      if (end == std::string::npos) end = procs_env.size();
+      if (end > start) names.push_back(procs_env.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+  const char *hz_env = getenv("THREADSTATSD_HZ");
+  double hz = hz_env ? atof(hz_env) : DEFAULT_HZ;
+  if (hz <= 0) hz = DEFAULT_HZ;
+  const uint64_t period_ns = 1e9 / hz;
+
+  PubMaster publisher({"threadStats"});
+
+  const double jiffy = sysconf(_SC_CLK_TCK);
+  std::vector<char> buf;
+  std::vector<TrackedProc> procs;
+  std::vector<ThreadSample> samples;
+  std::vector<size_t> proc_first;
+  uint64_t last_scan = 0;
+
+  uint64_t next = nanos_since_boot();
+  while (!do_exit) {
+    uint64_t now = nanos_since_boot();
+    if (last_scan == 0 || now - last_scan > RESCAN_NS) {
+      procs = find_procs(names, procs);
+      last_scan = now;
+    }
+
+    // the tasks of each, their files kept open between samples
+    samples.clear();
+    proc_first.clear();
+    for (auto &p : procs) {
+      proc_first.push_back(samples.size());
+
+      std::string task_dir = util::string_format("/proc/%d/task", p.pid);
+      std::unordered_map<pid_t, TaskFiles> tasks;
+      if (DIR *td = opendir(task_dir.c_str())) {
+        struct dirent *de = NULL;
+        while ((de = readdir(td))) {
+          if (!isdigit(de->d_name[0])) continue;
+          pid_t tid = atoi(de->d_name);
+
+          auto it = p.tasks.find(tid);
+          TaskFiles files;
+          if (it != p.tasks.end()) {
+            files = std::move(it->second);
+          } else {
+            std::string dir = task_dir + "/" + de->d_name;
+            files.stat = ProcFile((dir + "/stat").c_str());
+            files.schedstat = ProcFile((dir + "/schedstat").c_str());
+            files.status = ProcFile((dir + "/status").c_str());
+          }
+
+          ThreadSample s = {.tid = tid};
+          if (sample_task(files, buf, s)) {
+            samples.push_back(std::move(s));
+            tasks.emplace(tid, std::move(files));
+          }
+        }
+        closedir(td);
+      } else {
+        // gone, found again at the next scan if it restarts
+        last_scan = 0;
+      }
+      p.tasks.swap(tasks);
+    }
+    proc_first.push_back(samples.size());
+
+    MessageBuilder msg;
+    auto lprocs = msg.initEvent().initThreadStats().initProcs(procs.size());
+    for (size_t i = 0; i < procs.size(); i++) {
+      auto lproc = lprocs[i];
+      lproc.setPid(procs[i].pid);
+      lproc.setName(procs[i].name);
+
+      auto lthreads = lproc.initThreads(proc_first[i + 1] - proc_first[i]);
+      for (size_t j = 0; j < lthreads.size(); j++) {
+        const ThreadSample &s = samples[proc_first[i] + j];
+        auto lthread = lthreads[j];
+        lthread.setTid(s.tid);
+        lthread.setName(s.stat.name);
+        lthread.setState(s.stat.state);
+        lthread.setCpuUser(s.stat.utime / jiffy);
+        lthread.setCpuSystem(s.stat.stime / jiffy);
+        lthread.setRunTime(s.run_ns);
+        lthread.setRunDelay(s.delay_ns);
+        lthread.setTimeslices(s.timeslices);
+        lthread.setVoluntaryCtxtSwitches(s.voluntary);
+        lthread.setNonvoluntaryCtxtSwitches(s.nonvoluntary);
+        lthread.setPriority(s.stat.priority);
+        lthread.setNice(s.stat.nice);
+        lthread.setRtPriority(s.stat.rt_priority);
+        lthread.setPolicy(s.stat.policy);
+        lthread.setProcessor(s.stat.processor);
+      }
+    }
+    publisher.send("threadStats", msg);
+
+    next += period_ns;
+    now = nanos_since_boot();
+    if (next > now) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+    } else {
+      next = now;
+    }
+  }
+
+  return 0;
+}
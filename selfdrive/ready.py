@@ -0,0 +1,46 @@
+import os
+import socket
+import time
+
+# The processes the manager starts tell it once they're ready over a datagram socket it leaves
+# open for them, its fd is in READY_FD. notify_ready in selfdrive/common/util.h is the C++ side
+READY_FD = "READY_FD"
+
+
+def notify_ready(name):
+  fd = os.getenv(READY_FD)
+  if fd is None:
+    return
+  try:
+    s = socket.socket(fileno=os.dup(int(fd)))
+    try:
+      s.send(name.encode('utf8'), socket.MSG_DONTWAIT)
+    finally:
+      s.close()
+  except OSError:
+    pass
+
+
+class ReadyListener():
+  """The manager's end, when each process last said it was ready"""
+  def __init__(self):
+    self.sock, self.child_sock = socket.socketpair(socket.AF_UNIX, socket.SOCK_DGRAM)
+    self.sock.setblocking(False)
+    self.child_sock.set_inheritable(True)
+    # for everything started from now on, forked or exec'd
+    os.environ[READY_FD] = str(self.child_sock.fileno())
+    self.ready = {}
+
+  def update(self):
+    while True:
+      try:
+        name = self.sock.recv(256).decode('utf8', 'replace')
+      except (BlockingIOError, InterruptedError):
+        break
+      self.ready[name] = time.monotonic()
+
+  def clear(self, name):
+    self.ready.pop(name, None)
+
+  def is_ready(self, name):
+    return name in self.ready
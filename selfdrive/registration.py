@@ -17,14 +17,16 @@ from selfdrive.version import version, terms_version, training_version, get_git_
 
 def register(spinner=None):
   params = Params()
-  params.put("Version", version)
-  params.put("TermsVersion", terms_version)
-  params.put("TrainingVersion", training_version)
-
-  params.put("GitCommit", get_git_commit(default=""))
-  params.put("GitBranch", get_git_branch(default=""))
-  params.put("GitRemote", get_git_remote(default=""))
-  params.put("SubscriberInfo", HARDWARE.get_subscriber_info())
+  params.put_many([
+    ("Version", version),
+    ("TermsVersion", terms_version),
+    ("TrainingVersion", training_version),
+
+    ("GitCommit", get_git_commit(default="")),
+    ("GitBranch", get_git_branch(default="")),
+    ("GitRemote", get_git_remote(default="")),
+    ("SubscriberInfo", HARDWARE.get_subscriber_info()),
+  ])
 
   IMEI = params.get("IMEI", encoding='utf8')
   HardwareSerial = params.get("HardwareSerial", encoding='utf8')
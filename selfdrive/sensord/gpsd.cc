@@ -6,7 +6,6 @@
 #include <sys/time.h>
 #include <sys/cdefs.h>
 #include <sys/types.h>
-#include <sys/resource.h>
 
 #include <pthread.h>
 
@@ -143,7 +142,7 @@ void gps_destroy() {
 }
 
 int main() {
-  setpriority(PRIO_PROCESS, 0, -13);
+  set_sched_profile("gpsd");
 
   gps_init();
 
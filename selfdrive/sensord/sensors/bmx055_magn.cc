@@ -77,8 +77,18 @@ void BMX055_Magn::get_event(cereal::SensorEventData::Builder &event){
   uint64_t start_time = nanos_since_boot();
   uint8_t buffer[8];
 
-  int len = read_register(BMX055_MAGN_I2C_REG_DATAX_LSB, buffer, sizeof(buffer));
-  assert(len == sizeof(buffer));
+  // The BMX055 Magnetometer has no FIFO mode. Self running mode only goes
+  // up to 30 Hz. Therefore we put in forced mode, and request measurements
+  // at a 100 Hz. When reading the registers we have to check the ready bit
+  // To verify the measurement was comleted this cycle.
+  // The read and the next request go in one transaction.
+  uint8_t forced = BMX055_MAGN_FORCED;
+  I2CRegister regs[] = {
+    read_op(BMX055_MAGN_I2C_REG_DATAX_LSB, buffer, sizeof(buffer)),
+    write_op(BMX055_MAGN_I2C_REG_MAG, &forced),
+  };
+  int ret = transfer(regs, 2);
+  assert(ret == 0);
 
   bool ready = buffer[6] & 0x1;
   if (ready){
@@ -101,10 +111,4 @@ void BMX055_Magn::get_event(cereal::SensorEventData::Builder &event){
     svec.setV(xyz);
     svec.setStatus(true);
   }
-
-  // The BMX055 Magnetometer has no FIFO mode. Self running mode only goes
-  // up to 30 Hz. Therefore we put in forced mode, and request measurements
-  // at a 100 Hz. When reading the registers we have to check the ready bit
-  // To verify the measurement was comleted this cycle.
-  set_register(BMX055_MAGN_I2C_REG_MAG, BMX055_MAGN_FORCED);
 }
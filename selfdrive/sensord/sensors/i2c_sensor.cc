@@ -22,3 +22,15 @@ int I2CSensor::read_register(uint register_address, uint8_t *buffer, uint8_t len
 int I2CSensor::set_register(uint register_address, uint8_t data){
   return bus->set_register(get_device_address(), register_address, data);
 }
+
+I2CRegister I2CSensor::read_op(uint register_address, uint8_t *buffer, uint8_t len){
+  return {get_device_address(), register_address, buffer, len, false};
+}
+
+I2CRegister I2CSensor::write_op(uint register_address, uint8_t *data){
+  return {get_device_address(), register_address, data, 1, true};
+}
+
+int I2CSensor::transfer(I2CRegister *regs, int count){
+  return bus->transfer(regs, count);
+}
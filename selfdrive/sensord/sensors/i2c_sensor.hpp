@@ -19,6 +19,10 @@ public:
   I2CSensor(I2CBus *bus);
   int read_register(uint register_address, uint8_t *buffer, uint8_t len);
   int set_register(uint register_address, uint8_t data);
+  // Batch entries for this chip, see I2CBus::transfer
+  I2CRegister read_op(uint register_address, uint8_t *buffer, uint8_t len);
+  I2CRegister write_op(uint register_address, uint8_t *data);
+  int transfer(I2CRegister *regs, int count);
   virtual int init() = 0;
   virtual void get_event(cereal::SensorEventData::Builder &event) = 0;
 };
@@ -0,0 +1,149 @@
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include "common/swaglog.h"
+#include "common/timing.h"
+
+#include "lsm6ds3_fifo.hpp"
+
+#define DEG2RAD(x) ((x) * M_PI / 180.0)
+
+// sample sets per burst, one transaction stays within the 8 bit i2c length
+#define LSM6DS3_FIFO_BURST_SETS 20
+
+
+LSM6DS3_Fifo::LSM6DS3_Fifo(I2CBus *bus) : I2CSensor(bus) {}
+
+int LSM6DS3_Fifo::init(){
+  int ret = 0;
+  uint8_t buffer[1];
+  const int threshold = LSM6DS3_FIFO_WATERMARK * LSM6DS3_FIFO_SET_WORDS;
+
+  ret = read_register(LSM6DS3_FIFO_I2C_REG_ID, buffer, 1);
+  if(ret < 0){
+    LOGE("Reading chip ID failed: %d", ret);
+    goto fail;
+  }
+
+  if(buffer[0] != LSM6DS3_FIFO_CHIP_ID){
+    LOGE("Chip ID wrong. Got: %d, Expected %d", buffer[0], LSM6DS3_FIFO_CHIP_ID);
+    ret = -1;
+    goto fail;
+  }
+
+  {
+    // Default scales, +- 2G and +- 250 deg/s. Then the threshold in words, and both sensors into
+    // a continuous FIFO. The whole setup is one transaction
+    uint8_t config[] = {
+      LSM6DS3_FIFO_CTRL3_BDU_INC,
+      LSM6DS3_FIFO_ODR_416HZ,
+      LSM6DS3_FIFO_ODR_416HZ,
+      (uint8_t)(threshold & 0xFF),
+      (uint8_t)((threshold >> 8) & 0x0F),
+      LSM6DS3_FIFO_CTRL3_NO_DEC,
+      LSM6DS3_FIFO_CTRL5_416HZ_CONTINUOUS,
+      LSM6DS3_FIFO_INT1_FTH,
+    };
+    I2CRegister regs[] = {
+      write_op(LSM6DS3_FIFO_I2C_REG_CTRL3_C, &config[0]),
+      write_op(LSM6DS3_FIFO_I2C_REG_CTRL1_XL, &config[1]),
+      write_op(LSM6DS3_FIFO_I2C_REG_CTRL2_G, &config[2]),
+      write_op(LSM6DS3_FIFO_I2C_REG_FIFO_CTRL1, &config[3]),
+      write_op(LSM6DS3_FIFO_I2C_REG_FIFO_CTRL2, &config[4]),
+      write_op(LSM6DS3_FIFO_I2C_REG_FIFO_CTRL3, &config[5]),
+      write_op(LSM6DS3_FIFO_I2C_REG_FIFO_CTRL5, &config[6]),
+      write_op(LSM6DS3_FIFO_I2C_REG_INT1_CTRL, &config[7]),
+    };
+    ret = transfer(regs, sizeof(regs) / sizeof(regs[0]));
+  }
+
+fail:
+  return ret;
+}
+
+int LSM6DS3_Fifo::read_samples(std::vector<LSM6DS3_Sample> &samples, uint64_t ts, bool at_watermark){
+  uint8_t status[4];
+  int ret = read_register(LSM6DS3_FIFO_I2C_REG_FIFO_STATUS1, status, sizeof(status));
+  if (ret < 0){
+    return ret;
+  }
+  int words = status[0] | ((status[1] & 0x0F) << 8);
+  int pattern = status[2] | ((status[3] & 0x03) << 8);
+  if (status[1] & LSM6DS3_FIFO_STATUS2_OVER_RUN){
+    LOGW("LSM6DS3 FIFO overrun");
+  }
+
+  // The pattern is the next word's place in a set, realign to the start of one. Reads past
+  // DATA_OUT_H roll back to DATA_OUT_L, so a burst walks the FIFO. The realign and every burst
+  // go in one transaction, up to the batch limit
+  const int skip = pattern != 0 ? LSM6DS3_FIFO_SET_WORDS - pattern : 0;
+  if (words < skip){
+    return 0;
+  }
+  const int sets = std::min((words - skip) / LSM6DS3_FIFO_SET_WORDS, (I2C_MAX_BATCH - 1) * LSM6DS3_FIFO_BURST_SETS);
+  const size_t buffer_len = (skip + sets * LSM6DS3_FIFO_SET_WORDS) * 2;
+  std::vector<uint8_t> buffer(buffer_len);
+
+  I2CRegister regs[I2C_MAX_BATCH];
+  int count = 0;
+  if (skip > 0){
+    regs[count++] = read_op(LSM6DS3_FIFO_I2C_REG_DATA_OUT_L, buffer.data(), skip * 2);
+  }
+  for (int done = 0; done < sets;){
+    int n = std::min(sets - done, LSM6DS3_FIFO_BURST_SETS);
+    regs[count++] = read_op(LSM6DS3_FIFO_I2C_REG_DATA_OUT_L, &buffer[(skip + done * LSM6DS3_FIFO_SET_WORDS) * 2], n * LSM6DS3_FIFO_SET_WORDS * 2);
+    done += n;
+  }
+  if (count > 0){
+    ret = transfer(regs, count);
+    if (ret < 0){
+      return ret;
+    }
+  }
+
+  const size_t first = samples.size();
+  const float accel_scale = 9.81 * 2.0f / (1 << 15);
+  const float gyro_scale = 250.0f / (1 << 15);
+  for (int i = 0; i < sets; i++){
+    const uint8_t *b = &buffer[(skip + i * LSM6DS3_FIFO_SET_WORDS) * 2];
+    LSM6DS3_Sample sample;
+    for (int j = 0; j < 3; j++){
+      sample.gyro[j] = DEG2RAD(read_16_bit(b[j*2], b[j*2+1]) * gyro_scale);
+      sample.accel[j] = read_16_bit(b[6+j*2], b[6+j*2+1]) * accel_scale;
+    }
+    samples.push_back(sample);
+  }
+
+  const int anchor = (at_watermark ? std::min(sets, LSM6DS3_FIFO_WATERMARK) : sets) - 1;
+  const int64_t period_ns = 1000000000LL / LSM6DS3_FIFO_RATE_HZ;
+  for (int i = 0; i < sets; i++){
+    samples[first + i].timestamp = ts + (i - anchor) * period_ns;
+  }
+  return sets;
+}
+
+void lsm6ds3_fill_accel(cereal::SensorEventData::Builder &event, const LSM6DS3_Sample &sample){
+  event.setSource(cereal::SensorEventData::SensorSource::LSM6DS3);
+  event.setVersion(1);
+  event.setSensor(SENSOR_ACCELEROMETER);
+  event.setType(SENSOR_TYPE_ACCELEROMETER);
+  event.setTimestamp(sample.timestamp);
+
+  float xyz[] = {sample.accel[1], -sample.accel[0], sample.accel[2]};
+  auto svec = event.initAcceleration();
+  svec.setV(xyz);
+  svec.setStatus(true);
+}
+
+void lsm6ds3_fill_gyro(cereal::SensorEventData::Builder &event, const LSM6DS3_Sample &sample){
+  event.setSource(cereal::SensorEventData::SensorSource::LSM6DS3);
+  event.setVersion(1);
+  event.setSensor(SENSOR_GYRO_UNCALIBRATED);
+  event.setType(SENSOR_TYPE_GYROSCOPE_UNCALIBRATED);
+  event.setTimestamp(sample.timestamp);
+
+  float xyz[] = {sample.gyro[1], -sample.gyro[0], sample.gyro[2]};
+  auto svec = event.initGyroUncalibrated();
+  svec.setV(xyz);
+  svec.setStatus(true);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+
+#include "sensors/i2c_sensor.hpp"
+
+// Address of the chip on the bus
+#define LSM6DS3_FIFO_I2C_ADDR       0x6A
+
+// Registers of the chip
+#define LSM6DS3_FIFO_I2C_REG_FIFO_CTRL1   0x06
+#define LSM6DS3_FIFO_I2C_REG_FIFO_CTRL2   0x07
+#define LSM6DS3_FIFO_I2C_REG_FIFO_CTRL3   0x08
+#define LSM6DS3_FIFO_I2C_REG_FIFO_CTRL5   0x0A
+#define LSM6DS3_FIFO_I2C_REG_INT1_CTRL    0x0D
+#define LSM6DS3_FIFO_I2C_REG_ID           0x0F
+#define LSM6DS3_FIFO_I2C_REG_CTRL1_XL     0x10
+#define LSM6DS3_FIFO_I2C_REG_CTRL2_G      0x11
+#define LSM6DS3_FIFO_I2C_REG_CTRL3_C      0x12
+#define LSM6DS3_FIFO_I2C_REG_FIFO_STATUS1 0x3A
+#define LSM6DS3_FIFO_I2C_REG_DATA_OUT_L   0x3E
+
+// Constants
+#define LSM6DS3_FIFO_CHIP_ID        0x69
+#define LSM6DS3_FIFO_ODR_416HZ      (0b0110 << 4)
+#define LSM6DS3_FIFO_CTRL3_NO_DEC   ((0b001 << 3) | 0b001) // gyro and accel, every sample
+#define LSM6DS3_FIFO_CTRL5_416HZ_CONTINUOUS ((0b0110 << 3) | 0b110)
+#define LSM6DS3_FIFO_INT1_FTH       (1 << 3)
+#define LSM6DS3_FIFO_CTRL3_BDU_INC  ((1 << 6) | (1 << 2))
+#define LSM6DS3_FIFO_STATUS2_OVER_RUN (1 << 6)
+
+#define LSM6DS3_FIFO_RATE_HZ        416
+// sample sets before the threshold interrupt, about one per sensord cycle
+#define LSM6DS3_FIFO_WATERMARK      4
+// a set is gyro xyz then accel xyz, 16 bit words
+#define LSM6DS3_FIFO_SET_WORDS      6
+
+struct LSM6DS3_Sample {
+  uint64_t timestamp;
+  float accel[3];
+  float gyro[3];
+};
+
+// Accel and gyro at 416 Hz through the chip's FIFO, replaces LSM6DS3_Accel and LSM6DS3_Gyro
+// when it initializes. INT1 rises at the watermark, the reads are burst transactions
+class LSM6DS3_Fifo : public I2CSensor {
+  uint8_t get_device_address() {return LSM6DS3_FIFO_I2C_ADDR;}
+public:
+  LSM6DS3_Fifo(I2CBus *bus);
+  int init();
+  // Appends every set in the FIFO. With at_watermark, ts is when the threshold interrupt fired,
+  // else when the newest set came out, the other sets are spaced at the output rate from it
+  int read_samples(std::vector<LSM6DS3_Sample> &samples, uint64_t ts, bool at_watermark);
+  // not polled, the samples come from read_samples
+  void get_event(cereal::SensorEventData::Builder &event) {}
+};
+
+void lsm6ds3_fill_accel(cereal::SensorEventData::Builder &event, const LSM6DS3_Sample &sample);
+void lsm6ds3_fill_gyro(cereal::SensorEventData::Builder &event, const LSM6DS3_Sample &sample);
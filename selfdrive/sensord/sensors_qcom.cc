@@ -7,16 +7,18 @@
 #include <sys/time.h>
 #include <sys/cdefs.h>
 #include <sys/types.h>
-#include <sys/resource.h>
 
+#include <algorithm>
 #include <map>
 #include <set>
+#include <vector>
 
 #include <cutils/log.h>
 #include <hardware/sensors.h>
 #include <utils/Timers.h>
 
 #include "messaging.hpp"
+#include "services.h"
 #include "common/timing.h"
 #include "common/util.h"
 #include "common/swaglog.h"
@@ -32,6 +34,11 @@
 #define SENSOR_PROXIMITY 6
 #define SENSOR_LIGHT 7
 
+// The HAL holds the samples in its FIFO for up to a publish period and hands them over together,
+// so the loop wakes about once a period instead of for every sample. They're sent as one
+// sensorEvents at its service_list rate, each with its own timestamp
+#define POLL_EVENTS 128
+
 ExitHandler do_exit;
 volatile sig_atomic_t re_init_sensors = 0;
 
@@ -42,9 +49,74 @@ void sigpipe_handler(int sig) {
   re_init_sensors = true;
 }
 
+// Sampled every period_ns, held for up to max_latency_ns by a HAL that batches
+void enable_sensor(struct sensors_poll_device_1 *device, int handle, int64_t period_ns, int64_t max_latency_ns) {
+  if (device->common.version >= SENSORS_DEVICE_API_VERSION_1_1) {
+    device->batch(device, handle, 0, period_ns, max_latency_ns);
+  } else {
+    device->setDelay(&device->v0, handle, period_ns);
+  }
+  device->activate(&device->v0, handle, 1);
+}
+
+void fill_event(cereal::SensorEventData::Builder log_event, const sensors_event_t &data) {
+  log_event.setSource(cereal::SensorEventData::SensorSource::ANDROID);
+  log_event.setVersion(data.version);
+  log_event.setSensor(data.sensor);
+  log_event.setType(data.type);
+  log_event.setTimestamp(data.timestamp);
+
+  switch (data.type) {
+  case SENSOR_TYPE_ACCELEROMETER: {
+    auto svec = log_event.initAcceleration();
+    svec.setV(data.acceleration.v);
+    svec.setStatus(data.acceleration.status);
+    break;
+  }
+  case SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED: {
+    auto svec = log_event.initMagneticUncalibrated();
+    // assuming the uncalib and bias floats are contiguous in memory
+    kj::ArrayPtr<const float> vs(&data.uncalibrated_magnetic.uncalib[0], 6);
+    svec.setV(vs);
+    break;
+  }
+  case SENSOR_TYPE_MAGNETIC_FIELD: {
+    auto svec = log_event.initMagnetic();
+    svec.setV(data.magnetic.v);
+    svec.setStatus(data.magnetic.status);
+    break;
+  }
+  case SENSOR_TYPE_GYROSCOPE_UNCALIBRATED: {
+    auto svec = log_event.initGyroUncalibrated();
+    // assuming the uncalib and bias floats are contiguous in memory
+    kj::ArrayPtr<const float> vs(&data.uncalibrated_gyro.uncalib[0], 6);
+    svec.setV(vs);
+    break;
+  }
+  case SENSOR_TYPE_GYROSCOPE: {
+    auto svec = log_event.initGyro();
+    svec.setV(data.gyro.v);
+    svec.setStatus(data.gyro.status);
+    break;
+  }
+  case SENSOR_TYPE_PROXIMITY: {
+    log_event.setProximity(data.distance);
+    break;
+  }
+  case SENSOR_TYPE_LIGHT:
+    log_event.setLight(data.light);
+    break;
+  }
+}
+
 void sensor_loop() {
   LOG("*** sensor loop");
 
+  const float publish_freq = services[(int)ServiceId::sensorEvents].frequency;
+  const int64_t publish_period = 1e9 / publish_freq;
+  // the thermal check, at 5Hz
+  const uint64_t thermal_check_frames = std::max(1, (int)(publish_freq / 5));
+
   uint64_t frame = 0;
   bool low_power_mode = false;
 
@@ -52,11 +124,11 @@ void sensor_loop() {
     SubMaster sm({"thermal"});
     PubMaster pm({"sensorEvents"});
 
-    struct sensors_poll_device_t* device;
+    struct sensors_poll_device_1* device;
     struct sensors_module_t* module;
 
     hw_get_module(SENSORS_HARDWARE_MODULE_ID, (hw_module_t const**)&module);
-    sensors_open(&module->common, &device);
+    sensors_open_1(&module->common, &device);
 
     // required
     struct sensor_t const* list;
@@ -68,8 +140,11 @@ void sensor_loop() {
     }
 
     for (int i = 0; i < count; i++) {
-      LOGD("sensor %4d: %4d %60s  %d-%ld us", i, list[i].handle, list[i].name, list[i].minDelay, list[i].maxDelay);
+      LOGD("sensor %4d: %4d %60s  %d-%ld us, fifo %d", i, list[i].handle, list[i].name, list[i].minDelay, list[i].maxDelay,
+           list[i].fifoMaxEventCount);
     }
+    LOG("sensor hal version %x, %s", device->common.version,
+        device->common.version >= SENSORS_DEVICE_API_VERSION_1_1 ? "batching" : "no batching");
 
     std::set<int> sensor_types = {
       SENSOR_TYPE_ACCELEROMETER,
@@ -100,95 +175,40 @@ void sensor_loop() {
 
     // init all the sensors
     for (auto &s : sensors) {
-      device->activate(device, s.first, 0);
-      device->activate(device, s.first, 1);
-      device->setDelay(device, s.first, s.second);
+      device->activate(&device->v0, s.first, 0);
+      enable_sensor(device, s.first, s.second, publish_period);
     }
 
-    // TODO: why is this 16?
-    static const size_t numEvents = 16;
-    sensors_event_t buffer[numEvents];
+    sensors_event_t buffer[POLL_EVENTS];
+    std::vector<sensors_event_t> pending;
+    uint64_t next_publish = nanos_since_boot() + publish_period;
 
     while (!do_exit) {
-      int n = device->poll(device, buffer, numEvents);
-      if (n == 0) continue;
+      int n = device->poll(&device->v0, buffer, POLL_EVENTS);
       if (n < 0) {
         LOG("sensor_loop poll failed: %d", n);
         continue;
       }
-
-      int log_events = 0;
-      for (int i=0; i < n; i++) {
+      for (int i = 0; i < n; i++) {
         if (sensor_types.find(buffer[i].type) != sensor_types.end()) {
-          log_events++;
+          pending.push_back(buffer[i]);
         }
       }
 
-      MessageBuilder msg;
-      auto sensor_events = msg.initEvent().initSensorEvents(log_events);
-
-      int log_i = 0;
-      for (int i = 0; i < n; i++) {
-
-        const sensors_event_t& data = buffer[i];
-
-        if (sensor_types.find(data.type) == sensor_types.end()) {
-          continue;
-        }
-
-        auto log_event = sensor_events[log_i];
-        log_event.setSource(cereal::SensorEventData::SensorSource::ANDROID);
-        log_event.setVersion(data.version);
-        log_event.setSensor(data.sensor);
-        log_event.setType(data.type);
-        log_event.setTimestamp(data.timestamp);
-
-        switch (data.type) {
-        case SENSOR_TYPE_ACCELEROMETER: {
-          auto svec = log_event.initAcceleration();
-          svec.setV(data.acceleration.v);
-          svec.setStatus(data.acceleration.status);
-          break;
-        }
-        case SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED: {
-          auto svec = log_event.initMagneticUncalibrated();
-          // assuming the uncalib and bias floats are contiguous in memory
-          kj::ArrayPtr<const float> vs(&data.uncalibrated_magnetic.uncalib[0], 6);
-          svec.setV(vs);
-          break;
-        }
-        case SENSOR_TYPE_MAGNETIC_FIELD: {
-          auto svec = log_event.initMagnetic();
-          svec.setV(data.magnetic.v);
-          svec.setStatus(data.magnetic.status);
-          break;
-        }
-        case SENSOR_TYPE_GYROSCOPE_UNCALIBRATED: {
-          auto svec = log_event.initGyroUncalibrated();
-          // assuming the uncalib and bias floats are contiguous in memory
-          kj::ArrayPtr<const float> vs(&data.uncalibrated_gyro.uncalib[0], 6);
-          svec.setV(vs);
-          break;
-        }
-        case SENSOR_TYPE_GYROSCOPE: {
-          auto svec = log_event.initGyro();
-          svec.setV(data.gyro.v);
-          svec.setStatus(data.gyro.status);
-          break;
-        }
-        case SENSOR_TYPE_PROXIMITY: {
-          log_event.setProximity(data.distance);
-          break;
-        }
-        case SENSOR_TYPE_LIGHT:
-          log_event.setLight(data.light);
-          break;
-        }
+      // a FIFO's flush can come over a few polls, they go out together
+      const uint64_t now = nanos_since_boot();
+      if (now < next_publish) continue;
+      next_publish += publish_period;
+      if (next_publish < now) next_publish = now + publish_period;
+      if (pending.empty()) continue;
 
-        log_i++;
+      MessageBuilder msg;
+      auto sensor_events = msg.initEvent().initSensorEvents(pending.size());
+      for (int i = 0; i < pending.size(); i++) {
+        fill_event(sensor_events[i], pending[i]);
       }
-
       pm.send("sensorEvents", msg);
+      pending.clear();
 
       if (re_init_sensors){
         LOGE("Resetting sensors");
@@ -196,14 +216,14 @@ void sensor_loop() {
         break;
       }
 
-      // Check whether to go into low power mode at 5Hz
-      if (frame % 20 == 0 && sm.update(0) > 0) {
+      // Check whether to go into low power mode
+      if (frame % thermal_check_frames == 0 && sm.update(0) > 0) {
         bool offroad = !sm["thermal"].getThermal().getStarted();
         if (low_power_mode != offroad) {
           for (auto &s : sensors) {
-            device->activate(device, s.first, 0);
+            device->activate(&device->v0, s.first, 0);
             if (!offroad || offroad_sensors.find(s.first) != offroad_sensors.end()) {
-              device->activate(device, s.first, 1);
+              enable_sensor(device, s.first, s.second, publish_period);
             }
           }
           low_power_mode = offroad;
@@ -212,14 +232,14 @@ void sensor_loop() {
 
       frame++;
     }
-    sensors_close(device);
+    sensors_close_1(device);
   }
 }
 
 }// Namespace end
 
 int main(int argc, char *argv[]) {
-  setpriority(PRIO_PROCESS, 0, -13);
+  set_sched_profile("sensord");
   signal(SIGPIPE, (sighandler_t)sigpipe_handler);
 
   sensor_loop();
@@ -1,10 +1,14 @@
 #include <vector>
+#include <algorithm>
 #include <chrono>
+#include <memory>
+#include <mutex>
 #include <thread>
-#include <sys/resource.h>
+#include <unistd.h>
 
 #include "messaging.hpp"
 #include "common/i2c.h"
+#include "common/gpio.h"
 #include "common/timing.h"
 #include "common/util.h"
 #include "common/swaglog.h"
@@ -18,15 +22,91 @@
 #include "sensors/bmx055_temp.hpp"
 
 #include "sensors/lsm6ds3_accel.hpp"
+#include "sensors/lsm6ds3_fifo.hpp"
 #include "sensors/lsm6ds3_gyro.hpp"
 #include "sensors/lsm6ds3_temp.hpp"
 
 #include "sensors/light_sensor.hpp"
 
 #define I2C_BUS_IMU 1
+#define SENSOR_CYCLE_NS 10000000ULL
 
 ExitHandler do_exit;
 
+// Events from every sensor thread, sent together once a cycle so no reader misses one between
+// conflated sensorEvents. Each event keeps the timestamp of its own read
+class SensorEventQueue {
+public:
+  void push(std::unique_ptr<capnp::MallocMessageBuilder> event) {
+    std::lock_guard<std::mutex> lk(lock);
+    events.push_back(std::move(event));
+  }
+  std::vector<std::unique_ptr<capnp::MallocMessageBuilder>> take() {
+    std::vector<std::unique_ptr<capnp::MallocMessageBuilder>> taken;
+    std::lock_guard<std::mutex> lk(lock);
+    taken.swap(events);
+    return taken;
+  }
+
+private:
+  std::mutex lock;
+  std::vector<std::unique_ptr<capnp::MallocMessageBuilder>> events;
+};
+
+template <class F>
+void push_event(SensorEventQueue *queue, F fill) {
+  auto msg = std::make_unique<capnp::MallocMessageBuilder>();
+  auto event = msg->initRoot<cereal::SensorEventData>();
+  fill(event);
+  queue->push(std::move(msg));
+}
+
+// A polled sensor on its own schedule, so a slow one doesn't hold up the others
+void sensor_thread(Sensor *sensor, int rate_hz, SensorEventQueue *queue) {
+  const uint64_t period = 1000000000ULL / rate_hz;
+  uint64_t next = nanos_since_boot();
+  while (!do_exit) {
+    push_event(queue, [&](cereal::SensorEventData::Builder &event) { sensor->get_event(event); });
+
+    next += period;
+    uint64_t now = nanos_since_boot();
+    if (next > now) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+    } else {
+      next = now;
+    }
+  }
+}
+
+// Between cycles the watermark interrupts drain the FIFO, each burst timestamped from its
+// interrupt, and whatever is left is drained at the cycle
+void imu_fifo_thread(LSM6DS3_Fifo *fifo, int irq_fd, SensorEventQueue *queue) {
+  std::vector<LSM6DS3_Sample> samples;
+  uint64_t next_cycle = nanos_since_boot() + SENSOR_CYCLE_NS;
+  while (!do_exit) {
+    uint64_t now = nanos_since_boot();
+    while (now < next_cycle) {
+      int timeout_ms = (next_cycle - now + 999999) / 1000000;
+      uint64_t irq_ts;
+      int ret = irq_fd >= 0 ? gpio_wait_edge(irq_fd, timeout_ms, &irq_ts) : -1;
+      if (ret > 0) {
+        fifo->read_samples(samples, irq_ts, true);
+      } else if (ret < 0) {
+        util::sleep_for(timeout_ms);
+      }
+      now = nanos_since_boot();
+    }
+    next_cycle = std::max(next_cycle + SENSOR_CYCLE_NS, now);
+    fifo->read_samples(samples, nanos_since_boot(), false);
+
+    for (auto &sample : samples) {
+      push_event(queue, [&](cereal::SensorEventData::Builder &event) { lsm6ds3_fill_accel(event, sample); });
+      push_event(queue, [&](cereal::SensorEventData::Builder &event) { lsm6ds3_fill_gyro(event, sample); });
+    }
+    samples.clear();
+  }
+}
+
 int sensor_loop() {
   I2CBus *i2c_bus_imu;
 
@@ -44,25 +124,39 @@ int sensor_loop() {
 
   LSM6DS3_Accel lsm6ds3_accel(i2c_bus_imu);
   LSM6DS3_Gyro lsm6ds3_gyro(i2c_bus_imu);
+  LSM6DS3_Fifo lsm6ds3_fifo(i2c_bus_imu);
   LSM6DS3_Temp lsm6ds3_temp(i2c_bus_imu);
 
   LightSensor light("/sys/class/i2c-adapter/i2c-2/2-0038/iio:device1/in_intensity_both_raw");
 
-  // Sensor init
-  std::vector<Sensor *> sensors;
-  sensors.push_back(&bmx055_accel);
-  sensors.push_back(&bmx055_gyro);
-  sensors.push_back(&bmx055_magn);
-  sensors.push_back(&bmx055_temp);
-
-  sensors.push_back(&lsm6ds3_accel);
-  sensors.push_back(&lsm6ds3_gyro);
-  sensors.push_back(&lsm6ds3_temp);
+  // Sensor init, with the rate each is read at
+  std::vector<std::pair<Sensor *, int>> sensors;
+  sensors.push_back({&bmx055_accel, 100});
+  sensors.push_back({&bmx055_gyro, 100});
+  // forced mode, a measurement is requested every read
+  sensors.push_back({&bmx055_magn, 100});
+  sensors.push_back({&bmx055_temp, 10});
+
+  // The FIFO runs the LSM6DS3 accel and gyro at 416 Hz, polled at 104 Hz if it won't set up
+  const bool imu_fifo = lsm6ds3_fifo.init() >= 0;
+  int imu_irq_fd = -1;
+  if (imu_fifo) {
+    imu_irq_fd = gpio_open_edge(GPIO_LSM_INT, "rising");
+    if (imu_irq_fd < 0) {
+      LOGW("LSM6DS3 interrupt unavailable, draining the FIFO every cycle");
+    }
+  } else {
+    LOGW("LSM6DS3 FIFO init failed, polling");
+    sensors.push_back({&lsm6ds3_accel, 100});
+    sensors.push_back({&lsm6ds3_gyro, 100});
+  }
+  sensors.push_back({&lsm6ds3_temp, 10});
 
-  sensors.push_back(&light);
+  // a sysfs read, the slowest of them
+  sensors.push_back({&light, 10});
 
 
-  for (Sensor * sensor : sensors){
+  for (auto &[sensor, rate] : sensors){
     int err = sensor->init();
     if (err < 0){
       LOGE("Error initializing sensors");
@@ -70,29 +164,45 @@ int sensor_loop() {
     }
   }
 
+  SensorEventQueue queue;
+  std::vector<std::thread> threads;
+  for (auto &[sensor, rate] : sensors){
+    threads.push_back(std::thread(sensor_thread, sensor, rate, &queue));
+  }
+  if (imu_fifo) {
+    threads.push_back(std::thread(imu_fifo_thread, &lsm6ds3_fifo, imu_irq_fd, &queue));
+  }
+
   PubMaster pm({"sensorEvents"});
 
+  uint64_t next_cycle = nanos_since_boot();
   while (!do_exit){
-    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    next_cycle += SENSOR_CYCLE_NS;
+    uint64_t now = nanos_since_boot();
+    if (next_cycle > now) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next_cycle - now));
+    } else {
+      next_cycle = now;
+    }
 
-    const int num_events = sensors.size();
-    MessageBuilder msg;
-    auto sensor_events = msg.initEvent().initSensorEvents(num_events);
+    auto events = queue.take();
+    if (events.empty()) continue;
 
-    for (int i = 0; i < num_events; i++){
-      auto event = sensor_events[i];
-      sensors[i]->get_event(event);
+    MessageBuilder msg;
+    auto sensor_events = msg.initEvent().initSensorEvents(events.size());
+    for (int i = 0; i < events.size(); i++){
+      sensor_events.setWithCaveats(i, events[i]->getRoot<cereal::SensorEventData>().asReader());
     }
 
     pm.send("sensorEvents", msg);
-
-    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-    std::this_thread::sleep_for(std::chrono::milliseconds(10) - (end - begin));
   }
+
+  for (auto &t : threads) t.join();
+  if (imu_irq_fd >= 0) close(imu_irq_fd);
   return 0;
 }
 
 int main(int argc, char *argv[]) {
-  setpriority(PRIO_PROCESS, 0, -13);
+  set_sched_profile("sensord");
   return sensor_loop();
 }
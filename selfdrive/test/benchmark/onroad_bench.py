@@ -0,0 +1,344 @@
+#!/usr/bin/env python3
+"""Replays a segment through the onroad daemons on a simulated clock and checks their cpu, memory
+and latencies against budgets.yaml
+  ./onroad_bench.py [--video] [--scale 1] [--report report.json] [segment]
+What the car, the sensors and the daemons that aren't run sent is published at its logMonoTime
+with the clock following along, so the daemons' messages are on the log's timeline and the
+latencies are differences of logMonoTimes. proclogd and servicestatsd run alongside for the cpu,
+rss and messaging health, and the daemons record trace spans. With --video camerad replays the
+road camera into modeld, without it the logged modelV2 is published and frame to modelV2 isn't measured"""
+import argparse
+import bisect
+import bz2
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from collections import defaultdict
+
+import numpy as np
+import yaml
+
+import cereal.messaging as messaging
+from common.basedir import BASEDIR
+from common.params import Params
+from common.simulated_clock import SimulatedClock
+from selfdrive.debug.trace_dump import read_trace
+from selfdrive.manager import managed_processes
+from selfdrive.test.openpilotci import get_url
+from selfdrive.test.process_replay.process_replay import CONFIGS
+from tools.lib.logreader import LogReader
+from tools.lib.url_file import URLFile
+
+BUDGETS = os.path.join(os.path.dirname(os.path.abspath(__file__)), "budgets.yaml")
+SEGMENT = "0982d79ebb0de295|2021-01-04--17-13-21--13"
+# of the segment, while the daemons start and fingerprint, left out of the numbers
+WARMUP_NS = int(10e9)
+# after the last message, for the daemons to finish with it
+TAIL_NS = int(1e9)
+# how often the clock moves while there's nothing to publish
+CLOCK_STEP = 0.0005
+
+# the daemons process replay has configs for, what they subscribe to and publish
+DAEMONS = {cfg.proc_name: cfg.pub_sub for cfg in CONFIGS}
+MONITORS = ["proclogd", "servicestatsd"]
+# with --video their messages take the place of the logged ones
+VISION_DAEMONS = ["camerad", "modeld"]
+VISION_OUTPUTS = ["frame", "modelV2", "cameraOdometry"]
+RECORDED = ["carState", "controlsState", "sendcan", "procLog", "serviceStats"]
+
+
+def download(url, path):
+  with URLFile(url) as f, open(path, "wb") as out:
+    out.write(f.read())
+
+
+def start_daemon(name, env):
+  proc = managed_processes[name]
+  if isinstance(proc, str):
+    return subprocess.Popen([sys.executable, "-m", proc], cwd=BASEDIR, env=env)
+  d, cmd = proc
+  return subprocess.Popen(cmd, cwd=os.path.join(BASEDIR, d), env=env)
+
+
+class Recorder(threading.Thread):
+  """Keeps the times and the few fields the numbers need of the daemons' messages"""
+  def __init__(self, services):
+    super().__init__(daemon=True)
+    self.poller = messaging.Poller()
+    self.socks = [messaging.sub_sock(s, poller=self.poller) for s in services]
+    self.msgs = defaultdict(list)
+    self.done = threading.Event()
+
+  def run(self):
+    while not self.done.is_set():
+      for sock in self.poller.poll(100):
+        for m in messaging.drain_sock(sock):
+          self.keep(m)
+
+  def keep(self, m):
+    w, t = m.which(), m.logMonoTime
+    if w == "controlsState":
+      self.msgs[w].append((t, m.controlsState.planMonoTime))
+    elif w == "modelV2":
+      self.msgs[w].append((t, m.modelV2.timestampEof))
+    elif w == "procLog":
+      procs = {p.pid: (p.cpuUser + p.cpuSystem + p.cpuChildrenUser + p.cpuChildrenSystem, p.memRss) for p in m.procLog.procs}
+      self.msgs[w].append((t, procs))
+    elif w == "serviceStats":
+      self.msgs[w].append((t, [(s.name, s.dropped, s.sloViolated) for s in m.serviceStats.services]))
+    else:
+      self.msgs[w].append((t, None))
+
+
+def publish(inputs, clock):
+  """Sends each input once the clock reaches its logMonoTime, the clock going at real time.
+  Returns how late each went out, in ns"""
+  pm = messaging.PubMaster({which for _, which, _ in inputs})
+  start_ns, t0 = inputs[0][0], time.monotonic_ns()
+
+  def run_clock(until):
+    while True:
+      now = start_ns + time.monotonic_ns() - t0
+      clock.set(max(now, clock.nanos))
+      if now >= until:
+        return now
+      time.sleep(min(CLOCK_STEP, (until - now) / 1e9))
+
+  lag = []
+  for t, which, dat in inputs:
+    lag.append(run_clock(t) - t)
+    pm.send(which, dat)
+  run_clock(inputs[-1][0] + TAIL_NS)
+  return lag
+
+
+def percentiles(v_ns):
+  if not len(v_ns):
+    return None
+  ms = np.array(v_ns) / 1e6
+  return {"p50": float(np.percentile(ms, 50)), "p99": float(np.percentile(ms, 99)), "count": len(ms)}
+
+
+def latencies(msgs, can_times, since, video):
+  ret = {}
+  # controlsd drains the can that piled up, the newest before its carState is the one it acted on
+  lat = []
+  for t, _ in msgs["carState"]:
+    i = bisect.bisect_right(can_times, t)
+    if t >= since and i > 0:
+      lat.append(t - can_times[i - 1])
+  ret["can_to_carstate"] = percentiles(lat)
+
+  sendcan = [t for t, _ in msgs["sendcan"]]
+  lat, last_plan = [], None
+  for t, plan_t in msgs["controlsState"]:
+    if t >= since and plan_t > 0 and plan_t != last_plan:
+      # a step's sendcan goes out before its controlsState
+      i = bisect.bisect_right(sendcan, t)
+      if i > 0 and sendcan[i - 1] >= plan_t:
+        lat.append(sendcan[i - 1] - plan_t)
+    last_plan = plan_t
+  ret["plan_to_sendcan"] = percentiles(lat)
+
+  if video:
+    ret["frame_to_modelv2"] = percentiles([t - eof for t, eof in msgs["modelV2"] if t >= since and eof > 0])
+  return ret
+
+
+def process_usage(msgs, pids, since):
+  ret = {}
+  logs = [(t, procs) for t, procs in msgs["procLog"] if t >= since]
+  for name, pid in pids.items():
+    seen = [(t, procs[pid]) for t, procs in logs if pid in procs]
+    if len(seen) < 2:
+      ret[name] = None
+      continue
+    (first_t, (first_cpu, _)), (last_t, (last_cpu, _)) = seen[0], seen[-1]
+    ret[name] = {
+      "cpu": (last_cpu - first_cpu) / ((last_t - first_t) / 1e9) * 100.,
+      "rss_mb": max(rss for _, (_, rss) in seen) / 2**20,
+    }
+  return ret
+
+
+def messaging_health(msgs, services, since):
+  dropped, violations = defaultdict(int), defaultdict(int)
+  for t, stats in msgs["serviceStats"]:
+    for name, d, slo_violated in stats:
+      if t >= since and name in services:
+        dropped[name] += d
+        violations[name] += slo_violated
+  bad = sorted(n for n in dropped if dropped[n] or violations[n])
+  return {
+    "dropped": sum(dropped.values()),
+    "slo_violations": sum(violations.values()),
+    "services": {n: {"dropped": dropped[n], "slo_violations": violations[n]} for n in bad},
+  }
+
+
+def trace_spans(pids):
+  """The durations of each process' spans, the newest ones each of its threads' ring kept"""
+  ret = {}
+  for name, pid in pids.items():
+    path = f"/dev/shm/trace_{pid}"
+    if not os.path.isfile(path):
+      continue
+    durs = defaultdict(list)
+    for e in read_trace(path):
+      if e["ph"] == "X":
+        durs[e["name"]].append(e["dur"] * 1e3)
+    os.remove(path)
+    ret[name] = {span: percentiles(d) for span, d in sorted(durs.items())}
+  return ret
+
+
+def check(report, budgets, scale):
+  over = []
+  for name, usage in report["processes"].items():
+    b = budgets["processes"].get(name)
+    if usage is None:
+      over.append(f"{name} isn't in procLog")
+      continue
+    if b is not None and usage["cpu"] > b["cpu"] * scale:
+      over.append(f"{name} used {usage['cpu']:.2f}% cpu, its budget is {b['cpu'] * scale:.2f}%")
+    if b is not None and usage["rss_mb"] > b["rss_mb"]:
+      over.append(f"{name} had {usage['rss_mb']:.1f} MB resident, its budget is {b['rss_mb']} MB")
+  for name in report["exited"]:
+    over.append(f"{name} exited during the replay")
+
+  for name, lat in report["latency"].items():
+    b = budgets["latency"][name]
+    if lat is None:
+      over.append(f"{name} had nothing to measure")
+      continue
+    for p in ("p50", "p99"):
+      if lat[p] > b[p] * scale:
+        over.append(f"{name} {p} is {lat[p]:.2f} ms, its budget is {b[p] * scale:.2f} ms")
+
+  for name, spans in budgets["spans"].items():
+    for span, ms in spans.items():
+      s = report["spans"].get(name, {}).get(span)
+      if s is not None and s["p99"] > ms * scale:
+        over.append(f"{name} {span} p99 is {s['p99']:.2f} ms, its budget is {ms * scale:.2f} ms")
+
+  for k in ("dropped", "slo_violations"):
+    if report["messaging"][k] > budgets["messaging"][k]:
+      over.append(f"{report['messaging'][k]} {k.replace('_', ' ')} in {', '.join(report['messaging']['services'])}")
+  return over
+
+
+def print_report(report, budgets, scale):
+  print(f"{report['segment']}: {report['seconds']:.1f} s measured, publish lag p99 {report['publish_lag']['p99']:.2f} ms")
+  print(f"{'process':<16} {'cpu %':>8} {'budget':>8} {'rss MB':>8} {'budget':>8}")
+  for name, usage in report["processes"].items():
+    b = budgets["processes"].get(name, {"cpu": float("nan"), "rss_mb": float("nan")})
+    if usage is None:
+      print(f"{name:<16} {'no procLog':>8}")
+    else:
+      print(f"{name:<16} {usage['cpu']:8.2f} {b['cpu'] * scale:8.2f} {usage['rss_mb']:8.1f} {b['rss_mb']:8.0f}")
+  print(f"{'latency ms':<16} {'p50':>8} {'budget':>8} {'p99':>8} {'budget':>8}")
+  for name, lat in report["latency"].items():
+    b = budgets["latency"][name]
+    if lat is None:
+      print(f"{name:<16} {'n/a':>8}")
+    else:
+      print(f"{name:<16} {lat['p50']:8.2f} {b['p50'] * scale:8.2f} {lat['p99']:8.2f} {b['p99'] * scale:8.2f}")
+  m = report["messaging"]
+  print(f"messaging: {m['dropped']} dropped, {m['slo_violations']} slo violations")
+  for name, spans in report["spans"].items():
+    print(f"{name} spans ms (p50 / p99): " + ", ".join(f"{s} {v['p50']:.2f} / {v['p99']:.2f}" for s, v in spans.items()))
+
+
+def main():
+  parser = argparse.ArgumentParser(description="check the onroad daemons' cpu, memory and latencies on a replayed segment")
+  parser.add_argument("segment", nargs="?", default=SEGMENT)
+  parser.add_argument("--video", action="store_true", help="run camerad and modeld on the segment's road camera")
+  parser.add_argument("--scale", type=float, default=1., help="of the cpu and latency budgets, for machines other than the device")
+  parser.add_argument("--report", help="write the numbers to this json file")
+  args = parser.parse_args()
+  with open(BUDGETS) as f:
+    budgets = yaml.safe_load(f)
+
+  daemons = list(DAEMONS) + (VISION_DAEMONS if args.video else [])
+  outputs = {s for pub_sub in DAEMONS.values() for subs in pub_sub.values() for s in subs}
+  published = {s for pub_sub in DAEMONS.values() for s in pub_sub} - outputs
+  if args.video:
+    published -= set(VISION_OUTPUTS)
+    outputs |= set(VISION_OUTPUTS)
+
+  route, num = args.segment.rsplit("--", 1)
+  with tempfile.TemporaryDirectory() as d:
+    rlog = os.path.join(d, "rlog.bz2")
+    download(get_url(route, num), rlog)
+    msgs = sorted(LogReader(rlog), key=lambda m: m.logMonoTime)
+    inputs = [(m.logMonoTime, m.which(), m.as_builder().to_bytes()) for m in msgs if m.which() in published]
+    can_times = [t for t, which, _ in inputs if which == "can"]
+    car_params = [m.carParams for m in msgs if m.which() == "carParams"]
+
+    env = dict(os.environ, MSGQ_FRAME_HEADER="1", OPENPILOT_TRACE="1", SKIP_FW_QUERY="1",
+               FINGERPRINT=car_params[0].carFingerprint if car_params else "")
+    if args.video:
+      video = os.path.join(d, "fcamera.hevc")
+      download(get_url(route, num, "fcamera"), video)
+      with open(rlog, "rb") as f, open(os.path.join(d, "rlog"), "wb") as out:
+        out.write(bz2.decompress(f.read()))
+      env.update(FRAME_STREAM_LOG=os.path.join(d, "rlog"), FRAME_STREAM_VIDEO=video)
+    del msgs
+
+    params = Params()
+    params.clear_all()
+    params.manager_start()
+    params.put("OpenpilotEnabledToggle", "1")
+    params.put("Passive", "0")
+    params.put("CommunityFeaturesToggle", "1")
+
+    # the bench's own sockets are framed like the daemons'
+    os.environ["MSGQ_FRAME_HEADER"] = "1"
+    with SimulatedClock(inputs[0][0]) as clock:
+      # subscribed before the daemons start, so none of what they send is missed
+      recorder = Recorder(RECORDED + (["modelV2"] if args.video else []))
+      recorder.start()
+      procs = {name: start_daemon(name, clock.env(env)) for name in daemons + MONITORS}
+      try:
+        lag = publish(inputs, clock)
+      finally:
+        recorder.done.set()
+        exited = [name for name, p in procs.items() if p.poll() is not None]
+        for p in procs.values():
+          p.terminate()
+        for p in procs.values():
+          try:
+            p.wait(10)
+          except subprocess.TimeoutExpired:
+            p.kill()
+      recorder.join()
+
+  since = inputs[0][0] + WARMUP_NS
+  pids = {name: p.pid for name, p in procs.items()}
+  report = {
+    "segment": args.segment,
+    "seconds": (inputs[-1][0] - since) / 1e9,
+    "publish_lag": percentiles(lag),
+    "processes": process_usage(recorder.msgs, pids, since),
+    "exited": exited,
+    "latency": latencies(recorder.msgs, can_times, since, args.video),
+    "messaging": messaging_health(recorder.msgs, outputs, since),
+    "spans": trace_spans(pids),
+  }
+  print_report(report, budgets, args.scale)
+  if args.report:
+    with open(args.report, "w") as f:
+      json.dump(report, f, indent=2)
+
+  over = check(report, budgets, args.scale)
+  for o in over:
+    print(o)
+  return 1 if over else 0
+
+
+if __name__ == "__main__":
+  sys.exit(main())
@@ -1,12 +1,15 @@
 #!/usr/bin/env python3
 import os
+import subprocess
 import sys
+import tempfile
 import time
 from typing import Any
 from tqdm import tqdm
 
 os.environ['QCOM_REPLAY'] = '1'
 
+from common.basedir import BASEDIR
 from common.spinner import Spinner
 from common.timeout import Timeout
 import selfdrive.manager as manager
@@ -23,6 +26,9 @@ from common.transformations.camera import get_view_frame_from_road_frame
 
 TEST_ROUTE = "99c94dc769b5d96e|2019-08-03--14-19-59"
 
+# --fp16 runs the model in half precision and checks it against the float32 refs within this
+FP16_TOLERANCE = 5e-2
+
 def replace_calib(msg, calib):
   msg = msg.as_builder()
   if calib is not None:
@@ -90,17 +96,36 @@ def camera_replay(lr, fr, desire=None, calib=None):
   manager.kill_managed_process('camerad')
   return log_msgs
 
+def offline_camera_replay(lr, fcamera_path):
+  """Same as camera_replay, through _modeld_replay instead of camerad and a live modeld. It decodes
+  the frames itself and runs them back to back, calibration and desire come from the log"""
+  modeld_replay = os.path.join(BASEDIR, "selfdrive/modeld/_modeld_replay")
+  with tempfile.TemporaryDirectory() as tmp:
+    rlog_fn, out_fn = os.path.join(tmp, "rlog"), os.path.join(tmp, "model")
+    with open(rlog_fn, "wb") as f:
+      f.write(b"".join(msg.as_builder().to_bytes() for msg in lr))
+    subprocess.check_call([modeld_replay, rlog_fn, fcamera_path, out_fn], cwd=os.path.dirname(modeld_replay))
+    return list(LogReader(out_fn))
+
 if __name__ == "__main__":
 
   update = "--update" in sys.argv
+  fp16 = "--fp16" in sys.argv
+  offline = "--offline" in sys.argv
+  if fp16:
+    assert not update, "refs come from the float32 model"
+    os.environ['MODEL_FP16'] = '1'
 
   replay_dir = os.path.dirname(os.path.abspath(__file__))
   ref_commit_fn = os.path.join(replay_dir, "model_replay_ref_commit")
 
   lr = LogReader(get_url(TEST_ROUTE, 0))
-  fr = FrameReader(get_url(TEST_ROUTE, 0, log_type="fcamera"))
+  fcamera_url = get_url(TEST_ROUTE, 0, log_type="fcamera")
 
-  log_msgs = camera_replay(list(lr), fr)
+  if offline:
+    log_msgs = offline_camera_replay(list(lr), fcamera_url)
+  else:
+    log_msgs = camera_replay(list(lr), FrameReader(fcamera_url))
 
   failed = False
   if not update:
@@ -111,15 +136,17 @@ if __name__ == "__main__":
     ignore = ['logMonoTime', 'valid',
               'modelV2.frameDropPerc',
               'modelV2.modelExecutionTime']
+    ignore += ['modelV2.timing.' + f for f in log.ModelDataV2.StageTiming.schema.fields]
     results: Any = {TEST_ROUTE: {}}
-    results[TEST_ROUTE]["modeld"] = compare_logs(cmp_log, log_msgs, ignore_fields=ignore)
+    tolerance = FP16_TOLERANCE if fp16 else None
+    results[TEST_ROUTE]["modeld"] = compare_logs(cmp_log, log_msgs, ignore_fields=ignore, tolerance=tolerance)
     diff1, diff2, failed = format_diff(results, ref_commit)
 
     print(diff1)
     with open("model_diff.txt", "w") as f:
       f.write(diff2)
 
-  if update or failed:
+  if update or (failed and not fp16):
     from selfdrive.test.openpilotci import upload_file
 
     print("Uploading new refs")
@@ -3,6 +3,7 @@ import bz2
 import os
 import sys
 import numbers
+import capnp
 import dictdiffer
 
 if "CI" in os.environ:
@@ -36,7 +37,7 @@ def remove_ignored_fields(msg, ignore):
 
     for k in keys[:-1]:
       try:
-        attr = getattr(msg, k)
+        attr = getattr(attr, k)
       except AttributeError:
         break
     else:
@@ -45,6 +46,9 @@ def remove_ignored_fields(msg, ignore):
         val = False
       elif isinstance(v, numbers.Number):
         val = 0
+      elif isinstance(v, capnp.lib.capnp._DynamicListBuilder):
+        attr.init(keys[-1], 0)
+        continue
       else:
         raise NotImplementedError
       setattr(attr, keys[-1], val)
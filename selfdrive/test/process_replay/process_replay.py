@@ -4,6 +4,9 @@ import os
 import sys
 import threading
 import importlib
+import struct
+import subprocess
+import tempfile
 import time
 
 if "CI" in os.environ:
@@ -18,10 +21,13 @@ import selfdrive.manager as manager
 import cereal.messaging as messaging
 from common.params import Params
 from cereal.services import service_list
-from collections import namedtuple
+from collections import deque, namedtuple
 from selfdrive.manager import managed_processes
 # Numpy gives different results based on CPU features after version 19
 NUMPY_TOLERANCE = 1e-7
+# runs these C++ processes in process against fake sockets, in lockstep with the log
+REPLAY_RUNNER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "replay_runner")
+REPLAY_RUNNER_PROCS = {"ubloxd"}
 
 ProcessConfig = namedtuple('ProcessConfig', ['proc_name', 'pub_sub', 'ignore', 'init_callback', 'should_recv_callback', 'tolerance'])
 
@@ -228,7 +234,9 @@ CONFIGS = [
       "thermal": [], "health": [], "liveCalibration": [], "dMonitoringState": [], "plan": [], "pathPlan": [], "gpsLocation": [], "liveLocationKalman": [],
       "modelV2": [], "frontFrame": [], "frame": [], "ubloxRaw": [],
     },
-    ignore=["logMonoTime", "valid", "controlsState.startMonoTime", "controlsState.cumLagMs"],
+    # TODO: frameId and canMonoTimes aren't in the refs yet, stop ignoring them on the next update_refs.py
+    ignore=["logMonoTime", "valid", "controlsState.startMonoTime", "controlsState.cumLagMs", "controlsState.sendcanMonoTime",
+            "controlsState.frameId", "controlsState.canMonoTimes"],
     init_callback=fingerprint,
     should_recv_callback=None,
     tolerance=NUMPY_TOLERANCE,
@@ -250,7 +258,8 @@ CONFIGS = [
       "modelV2": ["pathPlan"], "radarState": ["plan"],
       "carState": [], "controlsState": [], "liveParameters": [],
     },
-    ignore=["logMonoTime", "valid", "plan.processingDelay"],
+    # TODO: frameId isn't in the refs yet, stop ignoring it on the next update_refs.py
+    ignore=["logMonoTime", "valid", "plan.processingDelay", "plan.frameId", "pathPlan.frameId"],
     init_callback=get_car_params,
     should_recv_callback=None,
     tolerance=None,
@@ -397,7 +406,45 @@ def python_replay_process(cfg, lr):
         recv_cnt -= m.which() in recv_socks
   return log_msgs
 
+def runner_replay_process(cfg, lr):
+  sub_sockets = [s for _, sub in cfg.pub_sub.items() for s in sub]
+  all_msgs = sorted(lr, key=lambda msg: msg.logMonoTime)
+  pub_msgs = [msg for msg in all_msgs if msg.which() in list(cfg.pub_sub.keys())]
+
+  with tempfile.TemporaryDirectory() as tmp:
+    in_fn, out_fn = os.path.join(tmp, "in"), os.path.join(tmp, "out")
+    with open(in_fn, "wb") as f:
+      for msg in pub_msgs:
+        f.write(msg.as_builder().to_bytes())
+    subprocess.check_call([REPLAY_RUNNER, cfg.proc_name, in_fn, out_fn] + sub_sockets, stdout=subprocess.DEVNULL)
+    with open(out_fn, "rb") as f:
+      out = f.read()
+
+  # what each input was followed by, in the order it was sent
+  outputs = [[] for _ in pub_msgs]
+  pos = 0
+  while pos < len(out):
+    idx, size = struct.unpack_from("<II", out, pos)
+    outputs[idx].append(log.Event.from_bytes(out[pos + 8:pos + 8 + size]))
+    pos += 8 + size
+
+  # read like from sockets, a message per socket the callback expects one from
+  queues = {s: deque() for s in sub_sockets}
+  log_msgs = []
+  for msg, responses in zip(pub_msgs, outputs):
+    for r in responses:
+      queues[r.which()].append(r)
+    resp_sockets = sub_sockets if cfg.should_recv_callback is None else cfg.should_recv_callback(msg)
+    for s in resp_sockets:
+      if queues[s]:
+        log_msgs.append(queues[s].popleft())
+  return log_msgs
+
+
 def cpp_replay_process(cfg, lr):
+  if cfg.proc_name in REPLAY_RUNNER_PROCS and os.path.isfile(REPLAY_RUNNER):
+    return runner_replay_process(cfg, lr)
+
   sub_sockets = [s for _, sub in cfg.pub_sub.items() for s in sub]  # We get responses here
   pm = messaging.PubMaster(cfg.pub_sub.keys())
   sockets = {s : messaging.sub_sock(s, timeout=1000) for s in sub_sockets}
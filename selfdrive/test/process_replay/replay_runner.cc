@@ -0,0 +1,126 @@
+// Runs a C++ process in this one against FAKE_MSGQ sockets and feeds it a log in lockstep: an
+// event is only published once the process is waiting with nothing left from the one before.
+//   replay_runner <process> <input log> <output> <service> [<service> ...]
+// The input log is uncompressed events one after another. For each event of the services
+// written, the output has the index of the input it followed, its size and its bytes,
+// as uint32s and then as logged
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <capnp/schema.h>
+
+#include "messaging.hpp"
+#include "impl_fake.hpp"
+#include "common/util.h"
+
+#include "selfdrive/locationd/ublox_msg.h"
+
+struct ReplayProcess {
+  const char *name;
+  std::function<void()> main;
+  // how many of its threads wait on sockets
+  int threads;
+};
+
+static const ReplayProcess processes[] = {
+  {"ubloxd", []() { ubloxd_main(nullptr, nullptr); }, 1},
+};
+
+static bool write_output(FILE *f, uint32_t input, Message *msg) {
+  const uint32_t size = msg->getSize();
+  return fwrite(&input, sizeof(input), 1, f) == 1 && fwrite(&size, sizeof(size), 1, f) == 1 &&
+         fwrite(msg->getData(), 1, size, f) == size;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 5) {
+    printf("usage: %s <process> <input log> <output> <service> [<service> ...]\n", argv[0]);
+    return 1;
+  }
+  setenv("FAKE_MSGQ", "1", 1);
+
+  const ReplayProcess *proc = nullptr;
+  for (const auto &p : processes) {
+    if (strcmp(p.name, argv[1]) == 0) proc = &p;
+  }
+  if (!proc) {
+    printf("%s can't be replayed in process\n", argv[1]);
+    return 2;
+  }
+
+  std::string log = util::read_file(argv[2]);
+  // word aligned for the readers
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(log.size() / sizeof(capnp::word));
+  memcpy(words.begin(), log.data(), words.size() * sizeof(capnp::word));
+  log.clear();
+
+  FILE *out = fopen(argv[3], "wb");
+  if (!out) {
+    printf("can't open %s\n", argv[3]);
+    return 1;
+  }
+
+  Context *ctx = Context::create();
+  // subscribed before the process starts, so none of what it sends is missed
+  std::vector<SubSocket *> outputs;
+  for (int i = 4; i < argc; i++) {
+    outputs.push_back(SubSocket::create(ctx, argv[i]));
+  }
+  // by Event::Which
+  std::map<uint16_t, std::string> names;
+  for (auto field : capnp::Schema::from<cereal::Event>().getUnionFields()) {
+    names[field.getProto().getDiscriminantValue()] = field.getProto().getName().cStr();
+  }
+  std::map<uint16_t, PubSocket *> inputs;
+
+  std::thread thread(proc->main);
+  // it's subscribed once it waits
+  fake_msgq_wait_idle(proc->threads);
+
+  bool ok = true;
+  uint32_t n = 0;
+  kj::ArrayPtr<const capnp::word> amsg = words.asPtr();
+  while (ok && amsg.size() > 0) {
+    capnp::FlatArrayMessageReader reader(amsg);
+    const capnp::word *end = reader.getEnd();
+    const uint16_t which = reader.getRoot<cereal::Event>().which();
+
+    PubSocket *&sock = inputs[which];
+    if (!sock) {
+      sock = PubSocket::create(ctx, names[which], false);
+    }
+    sock->send((char *)amsg.begin(), (end - amsg.begin()) * sizeof(capnp::word));
+    fake_msgq_wait_idle(proc->threads);
+
+    for (auto s : outputs) {
+      while (Message *msg = s->receive(true)) {
+        ok = ok && write_output(out, n, msg);
+        delete msg;
+      }
+    }
+    amsg = kj::arrayPtr(end, amsg.end());
+    n++;
+  }
+
+  fake_msgq_shutdown();
+  thread.join();
+
+  for (auto &[which, sock] : inputs) delete sock;
+  for (auto s : outputs) delete s;
+  delete ctx;
+
+  if (fclose(out) != 0 || !ok) {
+    printf("writing %s failed\n", argv[3]);
+    return 1;
+  }
+  printf("replayed %u events through %s\n", n, proc->name);
+  return 0;
+}
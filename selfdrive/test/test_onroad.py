@@ -101,7 +101,7 @@ class TestOnroad(unittest.TestCase):
 
     segments = [p for p in new_segments if len(list(p.iterdir())) > 1]
     cls.segment = [s for s in segments if str(s).endswith("--0")][0]
-    cls.lr = list(LogReader(os.path.join(str(cls.segment), "rlog.bz2")))
+    cls.lr = list(LogReader(os.path.join(str(cls.segment), "rlog.zst")))
 
   def test_cpu_usage(self):
     proclogs = [m for m in self.lr if m.which() == 'procLog']
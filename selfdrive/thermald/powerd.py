@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+# Sets the gpu and cpu frequency floors from how close modeld and controlsd are to their deadlines,
+# instead of modeld running the gpu at its highest clock for every inference. A floor goes up a step
+# when the slow end of a window gets near the deadline and back down after a few windows with plenty
+# of room, so the clocks are only as high as the pipeline needs. Above yellow the floors are let go,
+# the thermal policy in modeld and thermald has the say then
+import glob
+import os
+
+import cereal.messaging as messaging
+from cereal import log
+from selfdrive.swaglog import cloudlog
+
+ThermalStatus = log.ThermalData.ThermalStatus
+
+GPU_DEVFREQ = "/sys/class/kgsl/kgsl-3d0/devfreq"
+CPUFREQ = "/sys/devices/system/cpu/cpu[0-9]*/cpufreq"
+
+MODEL_DEADLINE_MS = 50.
+CONTROLS_DEADLINE_MS = 10.
+# frames of modelV2 a decision is made over
+WINDOW = 20
+# a step up past this share of the deadline, a step down under LOWER for LOWER_WINDOWS in a row
+RAISE = 0.8
+LOWER = 0.5
+LOWER_WINDOWS = 5
+
+
+def percentile(v, p):
+  v = sorted(v)
+  return v[min(len(v) - 1, int(p * len(v)))]
+
+
+class FloorController():
+  """The index into a domain's ascending frequencies its floor should be at"""
+  def __init__(self, num_levels):
+    self.num_levels = num_levels
+    self.level = 0
+    self.slack_windows = 0
+
+  def update(self, load):
+    # load is the window's slow end over its deadline
+    if load > 1.:
+      self.level = min(self.num_levels - 1, self.level + 2)
+      self.slack_windows = 0
+    elif load > RAISE:
+      self.level = min(self.num_levels - 1, self.level + 1)
+      self.slack_windows = 0
+    elif load < LOWER:
+      self.slack_windows += 1
+      if self.slack_windows >= LOWER_WINDOWS:
+        self.level = max(0, self.level - 1)
+        self.slack_windows = 0
+    else:
+      self.slack_windows = 0
+    return self.level
+
+  def release(self):
+    self.level = 0
+    self.slack_windows = 0
+
+
+class FreqDomain():
+  def __init__(self, name, min_paths, available_path):
+    self.name = name
+    self.min_paths = min_paths
+    with open(available_path) as f:
+      self.freqs = sorted(int(x) for x in f.read().split())
+    self.controller = FloorController(len(self.freqs))
+    self.written = None
+
+  def set_level(self, level):
+    freq = self.freqs[level]
+    if freq == self.written:
+      return
+    for p in self.min_paths:
+      try:
+        with open(p, 'w') as f:
+          f.write(str(freq))
+      except OSError:
+        cloudlog.exception(f"powerd can't set the {self.name} floor at {p}")
+    cloudlog.event("powerd floor", domain=self.name, freq=freq)
+    self.written = freq
+
+
+def gpu_domain():
+  available = os.path.join(GPU_DEVFREQ, "available_frequencies")
+  if not os.path.isfile(available):
+    return None
+  return FreqDomain("gpu", [os.path.join(GPU_DEVFREQ, "min_freq")], available)
+
+
+def cpu_domain():
+  # the big cluster's, if the cpus differ it's the one with the highest clocks
+  domains = []
+  for d in sorted(glob.glob(CPUFREQ)):
+    available = os.path.join(d, "scaling_available_frequencies")
+    if os.path.isfile(available):
+      domains.append(FreqDomain("cpu", [os.path.join(d, "scaling_min_freq")], available))
+  if not domains:
+    return None
+  top = max(dom.freqs[-1] for dom in domains)
+  big = [dom for dom in domains if dom.freqs[-1] == top]
+  big[0].min_paths = [p for dom in big for p in dom.min_paths]
+  return big[0]
+
+
+def powerd_thread(sm=None):
+  gpu, cpu = gpu_domain(), cpu_domain()
+  if gpu is None and cpu is None:
+    cloudlog.warning("powerd has no frequencies to set")
+    return
+
+  if sm is None:
+    sm = messaging.SubMaster(['modelV2', 'controlsState', 'thermal'], poll=['modelV2'])
+
+  gpu_ms, cpu_ms, controls_ms = [], [], []
+  while True:
+    sm.update()
+    if not sm.updated['modelV2']:
+      continue
+
+    timing = sm['modelV2'].timing
+    # the gpu's stages, the rest of the frame's time is on the cpu
+    gpu_ms.append(timing.frameWait + timing.transformGpu + timing.execute)
+    cpu_ms.append(timing.total - gpu_ms[-1])
+    if sm.updated['controlsState']:
+      # cumLagMs is how late the step finished, negative while there was time left to sleep
+      controls_ms.append(CONTROLS_DEADLINE_MS + sm['controlsState'].cumLagMs)
+    if len(gpu_ms) < WINDOW:
+      continue
+
+    loads = {gpu: percentile(gpu_ms, 0.9) / MODEL_DEADLINE_MS, cpu: percentile(cpu_ms, 0.9) / MODEL_DEADLINE_MS}
+    if controls_ms:
+      loads[cpu] = max(loads[cpu], percentile(controls_ms, 0.9) / CONTROLS_DEADLINE_MS)
+    hot = sm['thermal'].thermalStatus > ThermalStatus.yellow
+    for dom in (gpu, cpu):
+      if dom is None:
+        continue
+      if hot:
+        dom.controller.release()
+        dom.set_level(0)
+      else:
+        dom.set_level(dom.controller.update(loads[dom]))
+    gpu_ms, cpu_ms, controls_ms = [], [], []
+
+
+def main(sm=None):
+  try:
+    powerd_thread(sm)
+  finally:
+    # the floors outlive the process, offroad they're the lowest again
+    for dom in (gpu_domain(), cpu_domain()):
+      if dom is not None:
+        dom.set_level(0)
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+import unittest
+
+from selfdrive.thermald.powerd import FloorController, LOWER_WINDOWS
+
+
+class TestPowerd(unittest.TestCase):
+  def test_raise(self):
+    c = FloorController(5)
+    self.assertEqual(c.update(0.7), 0)
+    self.assertEqual(c.update(0.9), 1)
+    # past the deadline it's two steps
+    self.assertEqual(c.update(1.2), 3)
+    self.assertEqual(c.update(1.2), 4)
+    self.assertEqual(c.update(1.2), 4)
+
+  def test_lower(self):
+    c = FloorController(5)
+    c.update(1.2)
+    for _ in range(LOWER_WINDOWS - 1):
+      self.assertEqual(c.update(0.3), 2)
+    self.assertEqual(c.update(0.3), 1)
+
+    # a window in between starts the count over
+    for _ in range(LOWER_WINDOWS - 1):
+      c.update(0.3)
+    c.update(0.6)
+    self.assertEqual(c.update(0.3), 1)
+
+  def test_release(self):
+    c = FloorController(5)
+    c.update(1.2)
+    c.release()
+    self.assertEqual(c.update(0.6), 0)
+
+
+if __name__ == "__main__":
+  unittest.main()
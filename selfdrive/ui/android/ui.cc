@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include <sys/resource.h>
 
 #include <algorithm>
 
@@ -57,6 +56,7 @@ static void handle_display_state(UIState *s, bool user_input) {
 
     if (s->awake) {
       system("service call window 18 i32 1");
+      s->redraw = true;
     }
   }
 }
@@ -108,7 +108,7 @@ static void update_offroad_layout_state(UIState *s, PubMaster *pm) {
 }
 
 int main(int argc, char* argv[]) {
-  setpriority(PRIO_PROCESS, 0, -14);
+  set_sched_profile("ui");
   SLSound sound;
 
   UIState uistate = {};
@@ -154,6 +154,7 @@ int main(int argc, char* argv[]) {
     if (touched == 1) {
       handle_sidebar_touch(s, touch_x, touch_y);
       handle_vision_touch(s, touch_x, touch_y);
+      s->redraw = true;
     }
 
     // Don't waste resources on drawing in case screen is off
@@ -172,6 +173,15 @@ int main(int argc, char* argv[]) {
 
     update_offroad_layout_state(s, pm);
 
+    // The last frame stays up until something changed. With vision the loop waits for the camera
+    // frames, without it it's paced here
+    if (!ui_needs_draw(s)) {
+      if (s->started && !s->vision_connected) {
+        util::sleep_for(1000 / UI_FREQ);
+      }
+      continue;
+    }
+
     ui_draw(s);
     double u2 = millis_since_boot();
     if (!s->scene.frontview && (u2-u1 > 66)) {
@@ -179,6 +189,7 @@ int main(int argc, char* argv[]) {
       LOGW("slow frame(%llu) time: %.2f", (s->sm)->frame, u2-u1);
     }
     framebuffer_swap(s->fb);
+    ui_presented(s);
   }
 
   handle_display_state(s, true);
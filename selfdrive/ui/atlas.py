@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""Packs the ui's images into one texture, so drawing them doesn't switch textures,
+and writes where each one is as a header for paint.cc. Run by the SConscript"""
+import os
+import sys
+
+from PIL import Image
+
+ASSETS = os.path.join(os.path.dirname(os.path.abspath(__file__)), "../assets")
+
+# name as drawn by ui_draw_image, and its file in selfdrive/assets
+IMAGES = [
+  ("wheel", "img_chffr_wheel.png"),
+  ("trafficSign_turn", "img_trafficSign_turn.png"),
+  ("driver_face", "img_driver_face.png"),
+  ("button_settings", "images/button_settings.png"),
+  ("button_home", "images/button_home.png"),
+  ("battery", "images/battery.png"),
+  ("battery_charging", "images/battery_charging.png"),
+  ("network_0", "images/network_0.png"),
+  ("network_1", "images/network_1.png"),
+  ("network_2", "images/network_2.png"),
+  ("network_3", "images/network_3.png"),
+  ("network_4", "images/network_4.png"),
+  ("network_5", "images/network_5.png"),
+]
+
+ATLAS_WIDTH = 1024
+# transparent between images, so the mipmaps of one don't bleed into its neighbours
+PADDING = 8
+
+
+def pack(sizes, width=ATLAS_WIDTH, padding=PADDING):
+  """Shelves of the tallest first, returns each size's position and the atlas height"""
+  order = sorted(range(len(sizes)), key=lambda i: (-sizes[i][1], -sizes[i][0]))
+  pos = [None] * len(sizes)
+  x, y, shelf_h = padding, padding, 0
+  for i in order:
+    w, h = sizes[i]
+    assert w + 2 * padding <= width, f"image {i} is wider than the atlas"
+    if x + w + padding > width:
+      x, y, shelf_h = padding, y + shelf_h + padding, 0
+    pos[i] = (x, y)
+    x += w + padding
+    shelf_h = max(shelf_h, h)
+  return pos, y + shelf_h + padding
+
+
+def write_header(path, png_name, width, height, rects):
+  with open(path, "w") as f:
+    f.write("// generated by selfdrive/ui/atlas.py, don't edit\n")
+    f.write("#pragma once\n\n")
+    f.write(f"#define UI_ATLAS_PATH \"../assets/{png_name}\"\n")
+    f.write(f"#define UI_ATLAS_WIDTH {width}\n")
+    f.write(f"#define UI_ATLAS_HEIGHT {height}\n\n")
+    f.write("static const struct {\n  const char *name;\n  int x, y, w, h;\n} ui_atlas_images[] = {\n")
+    for name, (x, y, w, h) in rects:
+      f.write(f"  {{\"{name}\", {x}, {y}, {w}, {h}}},\n")
+    f.write("};\n")
+
+
+def main(png_path, header_path):
+  images = [(name, Image.open(os.path.join(ASSETS, fn)).convert("RGBA")) for name, fn in IMAGES]
+  pos, height = pack([img.size for _, img in images])
+
+  atlas = Image.new("RGBA", (ATLAS_WIDTH, height), (0, 0, 0, 0))
+  for (_, img), p in zip(images, pos):
+    atlas.paste(img, p)
+  atlas.save(png_path, optimize=True)
+
+  rects = [(name, p + img.size) for (name, img), p in zip(images, pos)]
+  write_header(header_path, os.path.basename(png_path), ATLAS_WIDTH, height, rects)
+
+
+if __name__ == "__main__":
+  if len(sys.argv) != 3:
+    sys.exit(f"usage: {sys.argv[0]} <atlas png> <header>")
+  main(sys.argv[1], sys.argv[2])
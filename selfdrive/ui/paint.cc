@@ -13,6 +13,7 @@
 #include "nanovg_gl_utils.h"
 #include "paint.hpp"
 #include "sidebar.hpp"
+#include "ui_atlas.h"
 
 
 // TODO: this is also hardcoded in common/transformations/camera.py
@@ -126,21 +127,63 @@ static void draw_lead(UIState *s, const cereal::RadarState::LeadData::Reader &le
   draw_chevron(s, d_rel, lead.getYRel(), 25, nvgRGBA(201, 34, 49, fillAlpha), COLOR_YELLOW);
 }
 
-static void ui_draw_line(UIState *s, const vertex_data *v, const int cnt, NVGcolor *color, NVGpaint *paint) {
-  if (cnt == 0) return;
+// Car space to clip space, car_space_to_full_frame as one matrix. The projection's divide is
+// the w, so the gpu clips what's behind the camera
+static mat4 world_transform(const UIState *s) {
+  // the extrinsics' last row is 0
+  mat4 KE = {};
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 4; c++) {
+      for (int k = 0; k < 3; k++) {
+        KE.v[r*4 + c] += intrinsic_matrix.v[r*3 + k] * s->scene.extrinsic_matrix.v[k*4 + c];
+      }
+    }
+  }
 
-  nvgBeginPath(s->vg);
-  nvgMoveTo(s->vg, v[0].x, v[0].y);
-  for (int i = 1; i < cnt; i++) {
-    nvgLineTo(s->vg, v[i].x, v[i].y);
+  // then the frame's nanovg transform, and pixels to normalized device coordinates
+  const float *t = s->car_space_transform;
+  const float sx = 2.0 / s->fb_w, sy = -2.0 / s->fb_h;
+  const float A[2][3] = {
+    {sx * t[0], sx * t[2], sx * t[4] - 1.0f},
+    {sy * t[1], sy * t[3], sy * t[5] + 1.0f},
+  };
+
+  mat4 ret = {};
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 2; r++) {
+      ret.v[r*4 + c] = A[r][0] * KE.v[c] + A[r][1] * KE.v[4 + c] + A[r][2] * KE.v[8 + c];
+    }
+    ret.v[12 + c] = KE.v[8 + c];
   }
-  nvgClosePath(s->vg);
-  if (color) {
-    nvgFillColor(s->vg, *color);
-  } else if (paint) {
-    nvgFillPaint(s->vg, *paint);
+  return ret;
+}
+
+static void ui_draw_line(UIState *s, const world_line &line, const NVGcolor &color, float fade_height = 0) {
+  if (line.cnt == 0) return;
+
+  glUniform4f(s->world_shader->getUniformLocation("uColor"), color.r, color.g, color.b, color.a);
+  glUniform1f(s->world_shader->getUniformLocation("uFadeHeight"), fade_height);
+  glDrawArrays(GL_TRIANGLE_STRIP, line.start, line.cnt);
+}
+
+// The textures of vipc_client's buffers, made again when it connected
+static void ui_init_textures(UIState *s) {
+  for (int i = 0; i < s->vipc_client->num_buffers; i++) {
+    s->texture[i].reset(new EGLImageTexture(&s->vipc_client->buffers[i]));
+
+    if (!s->vipc_client->buffers[i].rgb) continue;
+
+    glBindTexture(GL_TEXTURE_2D, s->texture[i]->frame_tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+    // BGR
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, GL_BLUE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_GREEN);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
   }
-  nvgFill(s->vg);
+  assert(glGetError() == GL_NO_ERROR);
+  s->texture_generation = s->vipc_generation;
 }
 
 static void draw_frame(UIState *s) {
@@ -154,17 +197,34 @@ static void draw_frame(UIState *s) {
   }
   glActiveTexture(GL_TEXTURE0);
 
+  // a frame in a buffer the stream grew by since
+  if (s->texture_generation != s->vipc_generation || (s->last_frame && !s->texture[s->last_frame->idx])) {
+    ui_init_textures(s);
+  }
   if (s->last_frame) {
-    glBindTexture(GL_TEXTURE_2D, s->texture[s->last_frame->idx]->frame_tex);
 #ifndef QCOM
-    // this is handled in ion on QCOM
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, s->last_frame->width, s->last_frame->height,
-                 0, GL_RGB, GL_UNSIGNED_BYTE, s->last_frame->addr);
+    // this is handled in ion on QCOM. Redraws of the same frame don't upload it again
+    if (s->frame_pending) {
+      s->texture[s->last_frame->idx]->update();
+      s->frame_pending = false;
+    }
+#endif
+    const EGLImageTexture *tex = s->texture[s->last_frame->idx].get();
+    glBindTexture(GL_TEXTURE_2D, tex->frame_tex);
+#ifndef QCOM
+    for (int i = 0; i < std::size(tex->chroma_tex); i++) {
+      glActiveTexture(GL_TEXTURE1 + i);
+      glBindTexture(GL_TEXTURE_2D, tex->chroma_tex[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
 #endif
   }
 
   glUseProgram(s->gl_shader->prog);
   glUniform1i(s->gl_shader->getUniformLocation("uTexture"), 0);
+  glUniform1i(s->gl_shader->getUniformLocation("uTextureU"), 1);
+  glUniform1i(s->gl_shader->getUniformLocation("uTextureV"), 2);
+  glUniform1i(s->gl_shader->getUniformLocation("uFormat"), s->last_frame ? s->last_frame->format : VISIONBUF_FORMAT_RGB);
   glUniformMatrix4fv(s->gl_shader->getUniformLocation("uTransform"), 1, GL_TRUE, out_mat->v);
 
   assert(glGetError() == GL_NO_ERROR);
@@ -174,24 +234,42 @@ static void draw_frame(UIState *s) {
   glBindVertexArray(0);
 }
 
+// With GL, before the nanovg frame. The vertices are uploaded once per model, redraws only
+// set the transform
 static void ui_draw_vision_lane_lines(UIState *s) {
-  const UIScene &scene = s->scene;
+  UIScene &scene = s->scene;
+  glBindVertexArray(s->world_vao);
+  if (scene.world_vertices_pending) {
+    glBindBuffer(GL_ARRAY_BUFFER, s->world_vbo);
+    glBufferData(GL_ARRAY_BUFFER, scene.world_vertices_cnt * sizeof(world_vertex), scene.world_vertices, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    scene.world_vertices_pending = false;
+  }
+
+  // Don't draw on top of sidebar
+  const Rect &r = scene.viz_rect;
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(r.x, s->fb_h - r.bottom(), r.w, r.h);
+
+  glUseProgram(s->world_shader->prog);
+  const mat4 transform = world_transform(s);
+  glUniformMatrix4fv(s->world_shader->getUniformLocation("uTransform"), 1, GL_TRUE, transform.v);
+
   // paint lanelines
-  for (int i = 0; i < std::size(scene.lane_line_vertices); i++) {
-    NVGcolor color = nvgRGBAf(1.0, 1.0, 1.0, scene.lane_line_probs[i]);
-    ui_draw_line(s, scene.lane_line_vertices[i].v, scene.lane_line_vertices[i].cnt, &color, nullptr);
+  for (int i = 0; i < std::size(scene.lane_lines); i++) {
+    ui_draw_line(s, scene.lane_lines[i], nvgRGBAf(1.0, 1.0, 1.0, scene.lane_line_probs[i]));
   }
 
   // paint road edges
-  for (int i = 0; i < std::size(scene.road_edge_vertices); i++) {
-    NVGcolor color = nvgRGBAf(1.0, 0.0, 0.0, std::clamp<float>(1.0 - scene.road_edge_stds[i], 0.0, 1.0));
-    ui_draw_line(s, scene.road_edge_vertices[i].v, scene.road_edge_vertices[i].cnt, &color, nullptr);
+  for (int i = 0; i < std::size(scene.road_edges); i++) {
+    ui_draw_line(s, scene.road_edges[i], nvgRGBAf(1.0, 0.0, 0.0, std::clamp<float>(1.0 - scene.road_edge_stds[i], 0.0, 1.0)));
   }
 
-  // paint path
-  NVGpaint track_bg = nvgLinearGradient(s->vg, s->fb_w, s->fb_h, s->fb_w, s->fb_h * .4,
-                                        COLOR_WHITE, COLOR_WHITE_ALPHA(0));
-  ui_draw_line(s, scene.track_vertices.v, scene.track_vertices.cnt, nullptr, &track_bg);
+  // paint path, faded out from the bottom to 40% of the way down
+  ui_draw_line(s, scene.track, COLOR_WHITE, s->fb_h * .6);
+
+  glDisable(GL_SCISSOR_TEST);
+  glBindVertexArray(0);
 }
 
 // Draw all world space objects.
@@ -200,9 +278,6 @@ static void ui_draw_world(UIState *s) {
   // Don't draw on top of sidebar
   nvgScissor(s->vg, scene->viz_rect.x, scene->viz_rect.y, scene->viz_rect.w, scene->viz_rect.h);
 
-  // Draw lane edges and vision/mpc tracks
-  ui_draw_vision_lane_lines(s);
-
   // Draw lead indicators if openpilot is handling longitudinal
   if (s->longitudinal_control) {
     if (scene->lead_data[0].getStatus()) {
@@ -215,10 +290,35 @@ static void ui_draw_world(UIState *s) {
   nvgResetScissor(s->vg);
 }
 
-static void ui_draw_vision_maxspeed(UIState *s) {
+// The set speed in the ui's units, -1 when it isn't set
+static int vision_maxspeed(const UIState *s) {
   float maxspeed = s->scene.controls_state.getVCruise();
-  const bool is_cruise_set = maxspeed != 0 && maxspeed != SET_SPEED_NA;
-  if (is_cruise_set && !s->is_metric) { maxspeed *= 0.6225; }
+  if (maxspeed == 0 || maxspeed == SET_SPEED_NA) return -1;
+  if (!s->is_metric) { maxspeed *= 0.6225; }
+  return std::nearbyint(maxspeed);
+}
+
+static int vision_speed(const UIState *s) {
+  const float speed = std::max(0.0, s->scene.controls_state.getVEgo() * (s->is_metric ? 3.6 : 2.2369363));
+  return std::nearbyint(speed);
+}
+
+typedef enum VisionEvent {
+  EVENT_NONE,
+  EVENT_TURN,
+  EVENT_WHEEL,
+} VisionEvent;
+
+static VisionEvent vision_event(const UIState *s) {
+  if (s->scene.controls_state.getDecelForModel() && s->scene.controls_state.getEnabled()) {
+    return EVENT_TURN;
+  }
+  return s->scene.controls_state.getEngageable() ? EVENT_WHEEL : EVENT_NONE;
+}
+
+static void ui_draw_vision_maxspeed(UIState *s) {
+  const int maxspeed = vision_maxspeed(s);
+  const bool is_cruise_set = maxspeed >= 0;
 
   const Rect rect = {s->scene.viz_rect.x + (bdr_s * 2), int(s->scene.viz_rect.y + (bdr_s * 1.5)), 184, 202};
   ui_fill_rect(s->vg, rect, COLOR_BLACK_ALPHA(100), 30.);
@@ -227,7 +327,7 @@ static void ui_draw_vision_maxspeed(UIState *s) {
   nvgTextAlign(s->vg, NVG_ALIGN_CENTER | NVG_ALIGN_BASELINE);
   ui_draw_text(s, rect.centerX(), 148, "MAX", 26 * 2.5, COLOR_WHITE_ALPHA(is_cruise_set ? 200 : 100), "sans-regular");
   if (is_cruise_set) {
-    const std::string maxspeed_str = std::to_string((int)std::nearbyint(maxspeed));
+    const std::string maxspeed_str = std::to_string(maxspeed);
     ui_draw_text(s, rect.centerX(), 242, maxspeed_str.c_str(), 48 * 2.5, COLOR_WHITE, "sans-bold");
   } else {
     ui_draw_text(s, rect.centerX(), 242, "N/A", 42 * 2.5, COLOR_WHITE_ALPHA(100), "sans-semibold");
@@ -235,8 +335,7 @@ static void ui_draw_vision_maxspeed(UIState *s) {
 }
 
 static void ui_draw_vision_speed(UIState *s) {
-  const float speed = std::max(0.0, s->scene.controls_state.getVEgo() * (s->is_metric ? 3.6 : 2.2369363));
-  const std::string speed_str = std::to_string((int)std::nearbyint(speed));
+  const std::string speed_str = std::to_string(vision_speed(s));
   nvgTextAlign(s->vg, NVG_ALIGN_CENTER | NVG_ALIGN_BASELINE);
   ui_draw_text(s, s->scene.viz_rect.centerX(), 240, speed_str.c_str(), 96 * 2.5, COLOR_WHITE, "sans-bold");
   ui_draw_text(s, s->scene.viz_rect.centerX(), 320, s->is_metric ? "km/h" : "mph", 36 * 2.5, COLOR_WHITE_ALPHA(200), "sans-regular");
@@ -246,12 +345,13 @@ static void ui_draw_vision_event(UIState *s) {
   const int viz_event_w = 220;
   const int viz_event_x = s->scene.viz_rect.right() - (viz_event_w + bdr_s*2);
   const int viz_event_y = s->scene.viz_rect.y + (bdr_s*1.5);
-  if (s->scene.controls_state.getDecelForModel() && s->scene.controls_state.getEnabled()) {
+  const VisionEvent event = vision_event(s);
+  if (event == EVENT_TURN) {
     // draw winding road sign
     const int img_turn_size = 160*1.5;
     const Rect rect = {viz_event_x - (img_turn_size / 4), viz_event_y + bdr_s - 25, img_turn_size, img_turn_size};
     ui_draw_image(s, rect, "trafficSign_turn", 1.0f);
-  } else if (s->scene.controls_state.getEngageable()) {
+  } else if (event == EVENT_WHEEL) {
     // draw steering wheel
     const int bg_wheel_size = 96;
     const int bg_wheel_x = viz_event_x + (viz_event_w-bg_wheel_size);
@@ -310,6 +410,12 @@ static void ui_draw_driver_view(UIState *s) {
   ui_draw_circle_image(s, icon_x, icon_y, face_size, "driver_face", s->scene.dmonitoring_state.getIsActiveMode());
 }
 
+// What the header layer shows
+static std::string vision_header_state(const UIState *s) {
+  return util::string_format("%d %d %d %d %d", vision_maxspeed(s), vision_speed(s), s->is_metric,
+                             vision_event(s), vision_event(s) == EVENT_WHEEL ? s->status : 0);
+}
+
 static void ui_draw_vision_header(UIState *s) {
   const Rect &viz_rect = s->scene.viz_rect;
   NVGpaint gradient = nvgLinearGradient(s->vg, viz_rect.x,
@@ -386,19 +492,89 @@ static void ui_draw_vision_frame(UIState *s) {
   glViewport(0, 0, s->fb_w, s->fb_h);
 }
 
+// Adds the time until it goes out of scope to a stage of s->paint_stats, if it's set. A gl stage's
+// gpu time is from a glFinish, with one before it so the earlier stages' work isn't counted
+class PaintTimer {
+public:
+  PaintTimer(UIState *s, UIPaintStage stage, bool gl = false) : stats(s->paint_stats), stage(stage), gl(gl) {
+    if (!stats) return;
+    if (gl) glFinish();
+    start = nanos_since_boot();
+  }
+  ~PaintTimer() {
+    if (!stats) return;
+    const uint64_t cpu_end = nanos_since_boot();
+    stats->cpu_ms[stage] += (cpu_end - start) / 1e6;
+    if (gl) {
+      glFinish();
+      stats->gpu_ms[stage] += (nanos_since_boot() - cpu_end) / 1e6;
+    }
+  }
+
+private:
+  UIPaintStats *stats;
+  UIPaintStage stage;
+  bool gl;
+  uint64_t start;
+};
+
+// Redraws the layer into its framebuffer when its inputs were updated and what it shows
+// changed. It's before the nanovg frame, which it can't be drawn in
+static void ui_update_layer(UIState *s, UILayer &layer, const Rect &rect, void (*draw)(UIState *s),
+                            std::string (*get_state)(const UIState *s)) {
+  const bool resized = !layer.fb || layer.rect.w != rect.w || layer.rect.h != rect.h;
+  if (resized) {
+    if (layer.fb) nvgluDeleteFramebuffer(layer.fb);
+    layer.fb = nvgluCreateFramebuffer(s->vg, rect.w, rect.h, 0);
+    assert(layer.fb);
+  }
+  const bool moved = resized || layer.rect.x != rect.x || layer.rect.y != rect.y;
+  if (!moved && !layer.dirty) return;
+
+  layer.dirty = false;
+  std::string state = get_state(s);
+  if (!moved && state == layer.state) return;
+  layer.rect = rect;
+  layer.state = std::move(state);
+
+  GLint default_fbo = 0;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &default_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, layer.fb->fbo);
+  glViewport(0, 0, rect.w, rect.h);
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  glClear(GL_STENCIL_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+
+  nvgBeginFrame(s->vg, rect.w, rect.h, 1.0f);
+  nvgTranslate(s->vg, -rect.x, -rect.y);
+  draw(s);
+  nvgEndFrame(s->vg);
+  glBindFramebuffer(GL_FRAMEBUFFER, default_fbo);
+}
+
+static void ui_draw_layer(UIState *s, const UILayer &layer) {
+  const Rect &r = layer.rect;
+  nvgBeginPath(s->vg);
+  nvgRect(s->vg, r.x, r.y, r.w, r.h);
+  nvgFillPaint(s->vg, nvgImagePattern(s->vg, r.x, r.y, r.w, r.h, 0, layer.fb->image, 1.0f));
+  nvgFill(s->vg);
+}
+
 static void ui_draw_vision(UIState *s) {
   const UIScene *scene = &s->scene;
   if (!scene->frontview) {
     // Draw augmented elements
     if (scene->world_objects_visible) {
+      PaintTimer timer(s, PAINT_WORLD);
       ui_draw_world(s);
     }
+    PaintTimer timer(s, PAINT_HUD);
     // Set Speed, Current Speed, Status/Events
-    ui_draw_vision_header(s);
+    ui_draw_layer(s, s->header_layer);
     if (scene->alert_size == cereal::ControlsState::AlertSize::NONE) {
       ui_draw_vision_footer(s);
     }
   } else {
+    PaintTimer timer(s, PAINT_HUD);
     ui_draw_driver_view(s);
   }
 }
@@ -418,34 +594,67 @@ void ui_draw(UIState *s) {
 
   const bool draw_alerts = s->started && s->status != STATUS_OFFROAD &&
                            s->active_app == cereal::UiLayoutState::App::NONE;
-  const bool draw_vision = draw_alerts && s->vipc_client->connected;
+  const bool draw_vision = draw_alerts && s->vision_connected;
+  if (s->paint_stats) *s->paint_stats = {};
+
+  // the text is only drawn when it changed, the layers are composited each frame
+  if (!s->scene.sidebar_collapsed) {
+    PaintTimer timer(s, PAINT_SIDEBAR, true);
+    ui_update_layer(s, s->sidebar_layer, {0, 0, sbr_w, s->fb_h}, ui_draw_sidebar, ui_sidebar_state);
+  }
+  if (draw_vision && !s->scene.frontview) {
+    PaintTimer timer(s, PAINT_HEADER, true);
+    const Rect &viz_rect = s->scene.viz_rect;
+    ui_update_layer(s, s->header_layer, {viz_rect.x, viz_rect.y, viz_rect.w, header_h}, ui_draw_vision_header, vision_header_state);
+  }
 
   // GL drawing functions
   ui_draw_background(s);
   if (draw_vision) {
+    PaintTimer timer(s, PAINT_FRAME, true);
     ui_draw_vision_frame(s);
   }
   glEnable(GL_BLEND);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   glViewport(0, 0, s->fb_w, s->fb_h);
 
+  // Draw lane edges and vision/mpc tracks
+  if (draw_vision && !s->scene.frontview && s->scene.world_objects_visible) {
+    PaintTimer timer(s, PAINT_LANE_LINES, true);
+    ui_draw_vision_lane_lines(s);
+  }
+
   // NVG drawing functions - should be no GL inside NVG frame
   nvgBeginFrame(s->vg, s->fb_w, s->fb_h, 1.0f);
-  ui_draw_sidebar(s);
+  if (!s->scene.sidebar_collapsed) {
+    PaintTimer timer(s, PAINT_SIDEBAR);
+    ui_draw_layer(s, s->sidebar_layer);
+  }
   if (draw_vision) {
     ui_draw_vision(s);
   }
 
   if (draw_alerts && s->scene.alert_size != cereal::ControlsState::AlertSize::NONE) {
+    PaintTimer timer(s, PAINT_ALERTS);
     ui_draw_vision_alert(s);
   }
-  nvgEndFrame(s->vg);
+  {
+    PaintTimer timer(s, PAINT_NVG_FLUSH, true);
+    nvgEndFrame(s->vg);
+  }
   glDisable(GL_BLEND);
+
+  s->drawn_frame_eof = draw_vision && s->last_frame ? s->last_frame_eof : 0;
+  s->redraw = false;
 }
 
 void ui_draw_image(const UIState *s, const Rect &r, const char *name, float alpha){
+  // the atlas scaled so the image's region covers r
+  const Rect &img = s->images.at(name);
+  const float sx = (float)r.w / img.w, sy = (float)r.h / img.h;
   nvgBeginPath(s->vg);
-  NVGpaint imgPaint = nvgImagePattern(s->vg, r.x, r.y, r.w, r.h, 0, s->images.at(name), alpha);
+  NVGpaint imgPaint = nvgImagePattern(s->vg, r.x - img.x * sx, r.y - img.y * sy, UI_ATLAS_WIDTH * sx, UI_ATLAS_HEIGHT * sy,
+                                      0, s->atlas_image, alpha);
   nvgRect(s->vg, r.x, r.y, r.w, r.h);
   nvgFillPaint(s->vg, imgPaint);
   nvgFill(s->vg);
@@ -495,11 +704,54 @@ static const char frame_fragment_shader[] =
   "#version 300 es\n"
 #endif
   "precision mediump float;\n"
+  // VisionBufFormat, rgb, I420 or NV12. Y is in uTexture, NV12's UV in uTextureU
+  "uniform int uFormat;\n"
   "uniform sampler2D uTexture;\n"
+  "uniform sampler2D uTextureU;\n"
+  "uniform sampler2D uTextureV;\n"
   "in vec4 vTexCoord;\n"
   "out vec4 colorOut;\n"
   "void main() {\n"
-  "  colorOut = texture(uTexture, vTexCoord.xy);\n"
+  "  if (uFormat == 0) {\n"
+  "    colorOut = texture(uTexture, vTexCoord.xy);\n"
+  "    return;\n"
+  "  }\n"
+  "  float y = texture(uTexture, vTexCoord.xy).r;\n"
+  "  vec2 uv = uFormat == 2 ? texture(uTextureU, vTexCoord.xy).rg\n"
+  "                         : vec2(texture(uTextureU, vTexCoord.xy).r, texture(uTextureV, vTexCoord.xy).r);\n"
+  // the limited range BT.601 of camerad's rgb_to_yuv
+  "  y = 1.164 * (y - 0.0625);\n"
+  "  uv -= 0.5;\n"
+  "  colorOut = vec4(y + 1.596 * uv.y, y - 0.392 * uv.x - 0.813 * uv.y, y + 2.017 * uv.x, 1.0);\n"
+  "}\n";
+
+static const char world_vertex_shader[] =
+#ifdef NANOVG_GL3_IMPLEMENTATION
+  "#version 150 core\n"
+#else
+  "#version 300 es\n"
+#endif
+  "in vec3 aPosition;\n"
+  "uniform mat4 uTransform;\n"
+  "void main() {\n"
+  "  gl_Position = uTransform * vec4(aPosition, 1.0);\n"
+  "}\n";
+
+static const char world_fragment_shader[] =
+#ifdef NANOVG_GL3_IMPLEMENTATION
+  "#version 150 core\n"
+#else
+  "#version 300 es\n"
+#endif
+  "precision mediump float;\n"
+  "uniform vec4 uColor;\n"
+  // faded out from the bottom of the screen to this high, 0 doesn't fade
+  "uniform float uFadeHeight;\n"
+  "out vec4 colorOut;\n"
+  "void main() {\n"
+  "  float a = uColor.a;\n"
+  "  if (uFadeHeight > 0.0) a *= clamp(1.0 - gl_FragCoord.y / uFadeHeight, 0.0, 1.0);\n"
+  "  colorOut = vec4(uColor.rgb, a);\n"
   "}\n";
 
 static const mat4 device_transform = {{
@@ -517,6 +769,41 @@ static const mat4 full_to_wide_frame_transform = {{
   0.0,  0.0, 0.0, 1.0,
 }};
 
+// The strings that are always drawn, at their sizes. nanovg rasterizes a glyph into its font atlas
+// the first time it's drawn, and when the atlas is full it grows it, dropping what was in it
+static const struct {
+  const char *font;
+  float size;
+  const char *text;
+} fixed_glyphs[] = {
+  {"sans-regular", 26 * 2.5, "MAX"},
+  {"sans-bold", 48 * 2.5, "0123456789"},
+  {"sans-semibold", 42 * 2.5, "N/A"},
+  {"sans-bold", 96 * 2.5, "0123456789"},
+  {"sans-regular", 36 * 2.5, "km/h mph"},
+  {"sans-regular", 48, "-- WiFi 2G 3G 4G 5G TEMP"},
+  {"sans-bold", 78, "-0123456789°C"},
+  {"sans-bold", 48, "VEHICLE ONLINE NO PANDA CONNECT ERROR OFFLINE"},
+};
+
+// Rasterizes the fixed glyphs up front, so the first frames don't and the atlas has grown to fit
+// them before driving
+static void ui_nvg_init_glyphs(UIState *s) {
+  // a pass that grows the atlas drops the glyphs before it, the second puts them back
+  for (int pass = 0; pass < 2; pass++) {
+    nvgBeginFrame(s->vg, s->fb_w, s->fb_h, 1.0f);
+    for (auto &g : fixed_glyphs) {
+      nvgFontFace(s->vg, g.font);
+      nvgFontSize(s->vg, g.size);
+      nvgText(s->vg, 0, 0, g.text, NULL);
+    }
+    nvgCancelFrame(s->vg);
+    // nothing's drawn, ending a frame frees the atlases it outgrew
+    nvgBeginFrame(s->vg, s->fb_w, s->fb_h, 1.0f);
+    nvgEndFrame(s->vg);
+  }
+}
+
 void ui_nvg_init(UIState *s) {
   // init drawing
 #ifdef QCOM
@@ -538,25 +825,13 @@ void ui_nvg_init(UIState *s) {
     assert(font_id >= 0);
   }
 
-  // init images
-  std::vector<std::pair<const char *, const char *>> images = {
-      {"wheel", "../assets/img_chffr_wheel.png"},
-      {"trafficSign_turn", "../assets/img_trafficSign_turn.png"},
-      {"driver_face", "../assets/img_driver_face.png"},
-      {"button_settings", "../assets/images/button_settings.png"},
-      {"button_home", "../assets/images/button_home.png"},
-      {"battery", "../assets/images/battery.png"},
-      {"battery_charging", "../assets/images/battery_charging.png"},
-      {"network_0", "../assets/images/network_0.png"},
-      {"network_1", "../assets/images/network_1.png"},
-      {"network_2", "../assets/images/network_2.png"},
-      {"network_3", "../assets/images/network_3.png"},
-      {"network_4", "../assets/images/network_4.png"},
-      {"network_5", "../assets/images/network_5.png"},
-  };
-  for (auto [name, file] : images) {
-    s->images[name] = nvgCreateImage(s->vg, file, 1);
-    assert(s->images[name] != 0);
+  ui_nvg_init_glyphs(s);
+
+  // init images, packed into one texture by atlas.py
+  s->atlas_image = nvgCreateImage(s->vg, UI_ATLAS_PATH, NVG_IMAGE_GENERATE_MIPMAPS);
+  assert(s->atlas_image != 0);
+  for (auto &img : ui_atlas_images) {
+    s->images[img.name] = Rect{img.x, img.y, img.w, img.h};
   }
 
   // init gl
@@ -610,6 +885,17 @@ void ui_nvg_init(UIState *s) {
     glBindVertexArray(0);
   }
 
+  s->world_shader = std::make_unique<GLShader>(world_vertex_shader, world_fragment_shader);
+  GLint world_pos_loc = glGetAttribLocation(s->world_shader->prog, "aPosition");
+  glGenVertexArrays(1, &s->world_vao);
+  glBindVertexArray(s->world_vao);
+  glGenBuffers(1, &s->world_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, s->world_vbo);
+  glEnableVertexAttribArray(world_pos_loc);
+  glVertexAttribPointer(world_pos_loc, 3, GL_FLOAT, GL_FALSE, sizeof(world_vertex), (const void *)0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindVertexArray(0);
+
   s->video_rect = Rect{bdr_s, bdr_s, s->fb_w - 2 * bdr_s, s->fb_h - 2 * bdr_s};
   float zx = zoom * 2 * intrinsic_matrix.v[2] / s->video_rect.w;
   float zy = zoom * 2 * intrinsic_matrix.v[5] / s->video_rect.h;
@@ -12,6 +12,8 @@
 #include <QWidget>
 
 #include "common/params.h"
+#include "common/swaglog.h"
+#include "common/timing.h"
 
 #include "home.hpp"
 #include "paint.hpp"
@@ -22,6 +24,9 @@
 #define BACKLIGHT_DT 0.25
 #define BACKLIGHT_TS 2.00
 
+// for the time to the first frames, see selfdrive/debug/ui_startup.py
+static const uint64_t start_ns = nanos_since_boot();
+
 OffroadHome::OffroadHome(QWidget* parent) : QWidget(parent) {
   QVBoxLayout* main_layout = new QVBoxLayout();
   main_layout->setContentsMargins(sbr_w + 50, 50, 50, 50);
@@ -166,7 +171,7 @@ void HomeWindow::mousePressEvent(QMouseEvent* e) {
 
   // Vision click
   if (ui_state->started && (e->x() >= ui_state->scene.viz_rect.x - bdr_s)) {
-    ui_state->scene.sidebar_collapsed = !ui_state->scene.sidebar_collapsed;
+    glWindow->ui_thread->toggleSidebar();
   }
 }
 
@@ -194,6 +199,9 @@ GLWindow::GLWindow(QWidget* parent) : QOpenGLWidget(parent) {
   timer = new QTimer(this);
   QObject::connect(timer, SIGNAL(timeout()), this, SLOT(timerUpdate()));
 
+  // camera to display latency, once it's on screen
+  QObject::connect(this, &QOpenGLWidget::frameSwapped, [=]() { ui_presented(&ui_state); });
+
   backlight_timer = new QTimer(this);
   QObject::connect(backlight_timer, SIGNAL(timeout()), this, SLOT(backlightUpdate()));
 
@@ -207,6 +215,7 @@ GLWindow::GLWindow(QWidget* parent) : QOpenGLWidget(parent) {
 }
 
 GLWindow::~GLWindow() {
+  ui_thread.reset();
   makeCurrent();
   doneCurrent();
 }
@@ -218,8 +227,11 @@ void GLWindow::initializeGL() {
   std::cout << "OpenGL renderer: " << glGetString(GL_RENDERER) << std::endl;
   std::cout << "OpenGL language version: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
 
-  ui_state.sound = &sound;
-  ui_init(&ui_state);
+  ui_init_draw(&ui_state);
+
+  // repainted for each snapshot, update() from another thread is queued to this one
+  ui_thread = std::make_unique<UIThread>(this, &sound);
+  ui_thread->start([=]() { QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection); });
 
   wake();
 
@@ -243,24 +255,16 @@ void GLWindow::backlightUpdate() {
 }
 
 void GLWindow::timerUpdate() {
-  // Connecting to visionIPC requires opengl to be current
-  if (!ui_state.vipc_client->connected){
-    makeCurrent();
-  }
-
   if (ui_state.started != onroad) {
     onroad = ui_state.started;
     emit offroadTransition(!onroad);
-
-    // Change timeout to 0 when onroad, this will call timerUpdate continously.
-    // This puts visionIPC in charge of update frequency, reducing video latency
-    timer->start(onroad ? 0 : 1000 / UI_FREQ);
   }
 
+  const bool awake = ui_state.awake;
   handle_display_state(&ui_state, false);
-
-  ui_update(&ui_state);
-  repaint();
+  if (ui_state.awake && !awake) {
+    update();
+  }
 }
 
 void GLWindow::resizeGL(int w, int h) {
@@ -268,13 +272,32 @@ void GLWindow::resizeGL(int w, int h) {
 }
 
 void GLWindow::paintGL() {
-  if(GLWindow::ui_state.awake){
+  const uint64_t start = nanos_since_boot();
+  ui_thread->apply(&ui_state);
+  if (!ui_state.awake) return;
+
+  {
+    std::lock_guard lk(ui_thread->vision_lock);
+    if (!ui_thread->visionCurrent(&ui_state)) {
+      ui_state.last_frame = nullptr;
+    }
     ui_draw(&ui_state);
   }
+  ui_thread->drawn(start);
+
+  if (!first_paint) {
+    first_paint = true;
+    LOG("ui startup: first frame %.1f ms", (nanos_since_boot() - start_ns) / 1e6);
+  }
+  if (!first_onroad_frame && ui_state.drawn_frame_eof) {
+    first_onroad_frame = true;
+    LOG("ui startup: first onroad frame %.1f ms", (nanos_since_boot() - start_ns) / 1e6);
+  }
 }
 
 void GLWindow::wake() {
   handle_display_state(&ui_state, true);
+  update();
 }
 
 FramebufferState* framebuffer_init(const char* name, int32_t layer, int alpha,
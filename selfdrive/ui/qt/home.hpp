@@ -12,6 +12,7 @@
 
 #include "qt_sound.hpp"
 #include "ui/ui.hpp"
+#include "ui_thread.hpp"
 #include "widgets/offroad_alerts.hpp"
 
 // container window for onroad NVG UI
@@ -24,7 +25,9 @@ public:
   void wake();
   ~GLWindow();
 
+  // what's drawn, from the newest of ui_thread's snapshots
   inline static UIState ui_state = {0};
+  std::unique_ptr<UIThread> ui_thread;
 
 signals:
   void offroadTransition(bool offroad);
@@ -41,6 +44,7 @@ private:
   QtSound sound;
 
   bool onroad = true;
+  bool first_paint = false, first_onroad_frame = false;
 
   // TODO: this shouldn't be here
   float brightness_b = 0;
@@ -206,7 +206,12 @@ QWidget * network_panel(QWidget * parent) {
 
 void SettingsWindow::setActivePanel() {
   auto *btn = qobject_cast<QPushButton *>(nav_btns->checkedButton());
-  panel_layout->setCurrentWidget(panels[btn->text()]);
+  const QString name = btn->text();
+  if (!panels.count(name)) {
+    panels[name] = panel_builders[name]();
+    panel_layout->addWidget(panels[name]);
+  }
+  panel_layout->setCurrentWidget(panels[name]);
 }
 
 SettingsWindow::SettingsWindow(QWidget *parent) : QFrame(parent) {
@@ -229,17 +234,17 @@ SettingsWindow::SettingsWindow(QWidget *parent) : QFrame(parent) {
   sidebar_layout->addWidget(close_btn, 0, Qt::AlignLeft);
   QObject::connect(close_btn, SIGNAL(released()), this, SIGNAL(closeSettings()));
 
-  // setup panels
-  panels = {
-    {"Developer", developer_panel()},
-    {"Device", device_panel()},
-    {"Network", network_panel(this)},
-    {"Toggles", toggles_panel()},
+  // setup panels, each is built the first time it's shown
+  panel_builders = {
+    {"Developer", developer_panel},
+    {"Device", device_panel},
+    {"Network", [=]() { return network_panel(this); }},
+    {"Toggles", toggles_panel},
   };
 
   sidebar_layout->addSpacing(45);
   nav_btns = new QButtonGroup();
-  for (auto &panel : panels) {
+  for (auto &panel : panel_builders) {
     QPushButton *btn = new QPushButton(panel.first);
     btn->setCheckable(true);
     btn->setStyleSheet(R"(
@@ -259,10 +264,10 @@ SettingsWindow::SettingsWindow(QWidget *parent) : QFrame(parent) {
 
     nav_btns->addButton(btn);
     sidebar_layout->addWidget(btn, 0, Qt::AlignRight | Qt::AlignTop);
-    panel_layout->addWidget(panel.second);
     QObject::connect(btn, SIGNAL(released()), this, SLOT(setActivePanel()));
   }
   qobject_cast<QPushButton *>(nav_btns->buttons()[0])->setChecked(true);
+  setActivePanel();
   sidebar_layout->addStretch();
 
   // main settings layout, sidebar + main panel
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <functional>
+
 #include <QWidget>
 #include <QFrame>
 #include <QTimer>
@@ -40,6 +42,7 @@ signals:
 private:
   QPushButton *sidebar_alert_widget;
   QWidget *sidebar_widget;
+  std::map<QString, std::function<QWidget *()>> panel_builders;
   std::map<QString, QWidget *> panels;
   QButtonGroup *nav_btns;
   QStackedLayout *panel_layout;
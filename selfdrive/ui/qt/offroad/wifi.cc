@@ -90,18 +90,37 @@ WifiUI::WifiUI(QWidget *parent, int page_length) : QWidget(parent), networks_per
   vlayout->addWidget(scanning, 0, Qt::AlignCenter);
   vlayout->setSpacing(25);
 
-  wifi->request_scan();
-  refresh();
   page = 0;
+  refresh();
+}
+
+WifiUI::~WifiUI() {
+  if (scan_thread.joinable()) scan_thread.join();
 }
 
+// Scans off the gui thread, the list is updated when it's done
 void WifiUI::refresh() {
-  if (!this->isVisible()) {
+  if (!this->isVisible() || scanning) {
     return;
   }
 
-  wifi->request_scan();
-  wifi->refreshNetworks();
+  if (scan_thread.joinable()) scan_thread.join();
+  scanning = true;
+  const QString connecting = wifi->connectingTo();
+  const unsigned int adapter_state = wifi->adapterState();
+  scan_thread = std::thread([=]() {
+    wifi->request_scan();
+    WifiScan scan = wifi->scan(connecting, adapter_state);
+    // dropped if this is gone by then
+    QMetaObject::invokeMethod(this, [=]() {
+      scanning = false;
+      wifi->refreshNetworks(scan);
+      updateNetworks();
+    }, Qt::QueuedConnection);
+  });
+}
+
+void WifiUI::updateNetworks() {
   ipv4->setText(wifi->ipv4_address);
   clearLayout(vlayout);
 
@@ -254,9 +273,9 @@ void WifiUI::wrongPassword(QString ssid) {
 
 void WifiUI::prevPage() {
   page--;
-  refresh();
+  updateNetworks();
 }
 void WifiUI::nextPage() {
   page++;
-  refresh();
+  updateNetworks();
 }
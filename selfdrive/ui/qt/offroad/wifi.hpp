@@ -6,6 +6,8 @@
 #include <QStackedWidget>
 #include <QTimer>
 
+#include <thread>
+
 #include "wifiManager.hpp"
 #include "widgets/input_field.hpp"
 
@@ -16,9 +18,13 @@ class WifiUI : public QWidget {
 public:
   int page;
   explicit WifiUI(QWidget *parent = 0, int page_length = 5);
+  ~WifiUI();
 
 private:
   WifiManager *wifi = nullptr;
+  // the scans block on DBus, they're run here
+  std::thread scan_thread;
+  bool scanning = false;
   const int networks_per_page;
 
   QStackedWidget *swidget;
@@ -40,6 +46,7 @@ private slots:
   void handleButton(QAbstractButton* m_button);
   void toggleTethering(int enable);
   void refresh();
+  void updateNetworks();
   void receiveText(QString text);
   void wrongPassword(QString ssid);
 
@@ -84,22 +84,28 @@ WifiManager::WifiManager() {
   }
 }
 
-void WifiManager::refreshNetworks() {
-  bus = QDBusConnection::systemBus();
-  seen_networks.clear();
-  seen_ssids.clear();
-  ipv4_address = get_ipv4_address();
-  for (Network &network : get_networks()) {
+WifiScan WifiManager::scan(QString connecting, unsigned int adapter_state) {
+  WifiScan scan;
+  scan.ipv4_address = get_ipv4_address(adapter_state);
+
+  QVector<QByteArray> seen_ssids;
+  for (Network &network : get_networks(connecting)) {
     if (seen_ssids.count(network.ssid)) {
       continue;
     }
     seen_ssids.push_back(network.ssid);
-    seen_networks.push_back(network);
+    scan.networks.push_back(network);
   }
+  return scan;
+}
+
+void WifiManager::refreshNetworks(const WifiScan &scan) {
+  seen_networks = scan.networks;
+  ipv4_address = scan.ipv4_address;
 }
 
-QString WifiManager::get_ipv4_address(){
-  if (raw_adapter_state != state_connected){
+QString WifiManager::get_ipv4_address(unsigned int adapter_state){
+  if (adapter_state != state_connected){
     return "";
   }
   QVector<QDBusObjectPath> conns = get_active_connections();
@@ -124,7 +130,7 @@ QString WifiManager::get_ipv4_address(){
   return "";
 }
 
-QList<Network> WifiManager::get_networks() {
+QList<Network> WifiManager::get_networks(QString connecting) {
   QList<Network> r;
   QDBusInterface nm(nm_service, adapter, wireless_device_iface, bus);
   QDBusMessage response = nm.call("GetAllAccessPoints");
@@ -144,7 +150,7 @@ QList<Network> WifiManager::get_networks() {
     if (path.path() != active_ap) {
       ctype = ConnectedType::DISCONNECTED;
     } else {
-      if (ssid == connecting_to_network) {
+      if (ssid == connecting) {
         ctype = ConnectedType::CONNECTING;
       } else {
         ctype = ConnectedType::CONNECTED;
@@ -25,6 +25,12 @@ struct Network {
   SecurityType security_type;
 };
 
+// What NetworkManager has seen
+struct WifiScan {
+  QVector<Network> networks;
+  QString ipv4_address;
+};
+
 class WifiManager : public QWidget {
   Q_OBJECT
 public:
@@ -34,7 +40,13 @@ public:
   QVector<Network> seen_networks;
   QString ipv4_address;
 
-  void refreshNetworks();
+  // Asks NetworkManager, blocking on DBus. It only uses what's set on construction and what's
+  // passed, so it can run off the gui thread
+  WifiScan scan(QString connecting, unsigned int adapter_state);
+  // Takes a scan's networks
+  void refreshNetworks(const WifiScan &scan);
+  QString connectingTo() const { return connecting_to_network; }
+  unsigned int adapterState() const { return raw_adapter_state; }
   void connect(Network ssid);
   void connect(Network ssid, QString password);
   void connect(Network ssid, QString username, QString password);
@@ -45,7 +57,6 @@ public:
   bool tetheringEnabled();
 
 private:
-  QVector<QByteArray> seen_ssids;
   QString adapter;//Path to network manager wifi-device
   QDBusConnection bus = QDBusConnection::systemBus();
   unsigned int raw_adapter_state;//Connection status https://developer.gnome.org/NetworkManager/1.26/nm-dbus-types.html#NMDeviceState
@@ -53,8 +64,8 @@ private:
   QString tethering_ssid;
 
   QString get_adapter();
-  QString get_ipv4_address();
-  QList<Network> get_networks();
+  QString get_ipv4_address(unsigned int adapter_state);
+  QList<Network> get_networks(QString connecting);
   void connect(QByteArray ssid, QString username, QString password, SecurityType security_type);
   QString get_active_ap();
   void deactivate_connections(QString ssid);
@@ -12,6 +12,8 @@ int main(int argc, char *argv[]) {
 #else
   fmt.setRenderableType(QSurfaceFormat::OpenGLES);
 #endif
+  // presented at vsync
+  fmt.setSwapInterval(1);
   QSurfaceFormat::setDefaultFormat(fmt);
 
   QApplication a(argc, argv);
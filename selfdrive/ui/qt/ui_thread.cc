@@ -0,0 +1,211 @@
+#include "ui_thread.hpp"
+
+#include <algorithm>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/util.h"
+
+#define UI_STATS_PERIOD 10
+
+namespace {
+
+// Plays on ctx's thread, which the sound effects belong to
+class QueuedSound : public Sound {
+public:
+  QueuedSound(QObject *ctx, Sound *sound) : ctx(ctx), sound(sound) {}
+  bool play(AudibleAlert alert) {
+    QMetaObject::invokeMethod(ctx, [=]() { sound->play(alert); }, Qt::QueuedConnection);
+    return true;
+  }
+  void stop() {
+    QMetaObject::invokeMethod(ctx, [=]() { sound->stop(); }, Qt::QueuedConnection);
+  }
+  void setVolume(int volume) {
+    QMetaObject::invokeMethod(ctx, [=]() { sound->setVolume(volume); }, Qt::QueuedConnection);
+  }
+
+private:
+  QObject *ctx;
+  Sound *sound;
+};
+
+// The reader from the snapshot's copy, copied again when a newer one was received
+template <class T>
+typename T::Reader snapshot_reader(SnapshotMessage &m, uint64_t rcv_frame, typename T::Reader src) {
+  // not received yet, it's a default reader
+  if (rcv_frame == 0) return src;
+
+  if (!m.msg || m.rcv_frame != rcv_frame) {
+    m.msg = std::make_unique<capnp::MallocMessageBuilder>();
+    m.msg->setRoot(src);
+    m.rcv_frame = rcv_frame;
+  }
+  return m.msg->getRoot<T>().asReader();
+}
+
+}
+
+void UIFrameStats::Stat::add(double v) {
+  cnt++;
+  sum += v;
+  max = std::max(max, v);
+}
+
+UIThread::UIThread(QObject *ctx, Sound *gui_sound) : sound(new QueuedSound(ctx, gui_sound)) {
+  s.sound = sound.get();
+  s.vision_lock = &vision_lock;
+  ui_init_update(&s);
+}
+
+UIThread::~UIThread() {
+  stop = true;
+  if (thread.joinable()) thread.join();
+  delete s.sm;
+}
+
+void UIThread::start(std::function<void()> callback) {
+  on_publish = callback;
+  thread = std::thread(&UIThread::run, this);
+}
+
+void UIThread::run() {
+  set_thread_name("ui_update");
+
+  while (!stop) {
+    // connected, recv waits for the next frame and that sets the pace
+    const bool connected = s.vipc_client->connected;
+    ui_update(&s);
+
+    if (toggle_sidebar.exchange(false)) {
+      s.scene.sidebar_collapsed = !s.scene.sidebar_collapsed;
+      s.sidebar_layer.dirty = true;
+      s.redraw = true;
+    }
+    if (ui_needs_draw(&s)) {
+      publish();
+      s.redraw = false;
+      on_publish();
+    }
+
+    if (!connected) {
+      util::sleep_for(1000 / UI_FREQ);
+    }
+  }
+}
+
+void UIThread::publish() {
+  if (s.frame_pending) {
+    frames++;
+    s.frame_pending = false;
+  }
+  if (s.scene.world_vertices_pending) {
+    models++;
+    s.scene.world_vertices_pending = false;
+  }
+  if (s.sidebar_layer.dirty) {
+    sidebar_updates++;
+    s.sidebar_layer.dirty = false;
+  }
+  if (s.header_layer.dirty) {
+    header_updates++;
+    s.header_layer.dirty = false;
+  }
+
+  UISnapshot &snap = snapshots.back();
+  snap.scene = s.scene;
+  snap.status = s.status;
+  snap.active_app = s.active_app;
+  snap.started = s.started;
+  snap.ignition = s.ignition;
+  snap.is_metric = s.is_metric;
+  snap.longitudinal_control = s.longitudinal_control;
+  snap.vision_connected = s.vision_connected;
+  snap.light_sensor = s.light_sensor;
+  snap.accel_sensor = s.accel_sensor;
+  snap.gyro_sensor = s.gyro_sensor;
+  snap.vipc_client = s.vipc_client;
+  snap.last_frame = s.last_frame;
+  snap.last_frame_eof = s.last_frame_eof;
+  snap.vipc_generation = s.vipc_generation;
+  snap.frames = frames;
+  snap.models = models;
+  snap.sidebar_updates = sidebar_updates;
+  snap.header_updates = header_updates;
+
+  // the scene's readers point into the SubMaster's buffers, which the next updates reuse
+  const SubMaster &sm = *s.sm;
+  UIScene &scene = snap.scene;
+  scene.thermal = snapshot_reader<cereal::ThermalData>(snap.thermal, sm.rcv_frame(ServiceId::thermal), s.scene.thermal);
+  for (int i = 0; i < std::size(scene.lead_data); i++) {
+    scene.lead_data[i] = snapshot_reader<cereal::RadarState::LeadData>(snap.lead_data[i], sm.rcv_frame(ServiceId::radarState), s.scene.lead_data[i]);
+  }
+  scene.controls_state = snapshot_reader<cereal::ControlsState>(snap.controls_state, sm.rcv_frame(ServiceId::controlsState), s.scene.controls_state);
+  scene.driver_state = snapshot_reader<cereal::DriverState>(snap.driver_state, sm.rcv_frame(ServiceId::driverState), s.scene.driver_state);
+  scene.dmonitoring_state = snapshot_reader<cereal::DMonitoringState>(snap.dmonitoring_state, sm.rcv_frame(ServiceId::dMonitoringState), s.scene.dmonitoring_state);
+
+  snap.seq = ++published;
+  snap.published_ns = nanos_since_boot();
+  snapshots.publish();
+}
+
+bool UIThread::apply(UIState *gs) {
+  if (!snapshots.consume()) return false;
+  const UISnapshot &snap = snapshots.front();
+  if (applied && snap.seq > applied + 1) {
+    stats.skipped += snap.seq - applied - 1;
+  }
+  applied = snap.seq;
+  applied_ns = snap.published_ns;
+
+  // the layout is the gui's, and what's pending stays until it's drawn
+  const Rect viz_rect = gs->scene.viz_rect;
+  const bool vertices_pending = gs->scene.world_vertices_pending;
+  gs->scene = snap.scene;
+  gs->scene.viz_rect = viz_rect;
+  gs->scene.world_vertices_pending = vertices_pending || snap.models != applied_models;
+  gs->frame_pending = gs->frame_pending || snap.frames != applied_frames;
+  gs->sidebar_layer.dirty = gs->sidebar_layer.dirty || snap.sidebar_updates != applied_sidebar;
+  gs->header_layer.dirty = gs->header_layer.dirty || snap.header_updates != applied_header;
+  applied_models = snap.models;
+  applied_frames = snap.frames;
+  applied_sidebar = snap.sidebar_updates;
+  applied_header = snap.header_updates;
+
+  gs->status = snap.status;
+  gs->active_app = snap.active_app;
+  gs->started = snap.started;
+  gs->ignition = snap.ignition;
+  gs->is_metric = snap.is_metric;
+  gs->longitudinal_control = snap.longitudinal_control;
+  gs->vision_connected = snap.vision_connected;
+  gs->light_sensor = snap.light_sensor;
+  gs->accel_sensor = snap.accel_sensor;
+  gs->gyro_sensor = snap.gyro_sensor;
+  gs->vipc_client = snap.vipc_client;
+  gs->last_frame = snap.last_frame;
+  gs->last_frame_eof = snap.last_frame_eof;
+  gs->vipc_generation = snap.vipc_generation;
+  return true;
+}
+
+void UIThread::drawn(uint64_t start_ns) {
+  const uint64_t now = nanos_since_boot();
+  stats.draw_ms.add((now - start_ns) / 1e6);
+  if (last_drawn_ns) stats.interval_ms.add((now - last_drawn_ns) / 1e6);
+  if (applied_ns) {
+    stats.latency_ms.add((start_ns - applied_ns) / 1e6);
+    applied_ns = 0;
+  }
+  last_drawn_ns = now;
+
+  if (!stats_start_ns) stats_start_ns = now;
+  if (now - stats_start_ns > UI_STATS_PERIOD * 1e9) {
+    LOG("ui frames: %llu, draw %.2f/%.2f ms, interval %.2f/%.2f ms, latency %.2f/%.2f ms (mean/max), %llu skipped",
+        stats.draw_ms.cnt, stats.draw_ms.mean(), stats.draw_ms.max, stats.interval_ms.mean(), stats.interval_ms.max,
+        stats.latency_ms.mean(), stats.latency_ms.max, stats.skipped);
+    last_stats = stats;
+    stats = {};
+    stats_start_ns = now;
+  }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <QObject>
+
+#include "ui/ui.hpp"
+
+// Three slots, so the writer always has one to fill without waiting on the reader, and the
+// reader always gets the newest
+template <class T>
+class TripleBuffer {
+public:
+  T &back() { return slots[back_idx]; }
+  const T &front() const { return slots[front_idx]; }
+
+  void publish() {
+    back_idx = latest.exchange(back_idx | FRESH) & ~FRESH;
+  }
+  // Moves front to the newest published, false if there's none since the last
+  bool consume() {
+    if (!(latest.load() & FRESH)) return false;
+    front_idx = latest.exchange(front_idx) & ~FRESH;
+    return true;
+  }
+
+private:
+  static const int FRESH = 4;
+  T slots[3];
+  int back_idx = 0, front_idx = 1;
+  std::atomic<int> latest = 2;
+};
+
+// A copy of a message a UIScene reader points into, so a snapshot outlives the SubMaster's buffers
+struct SnapshotMessage {
+  std::unique_ptr<capnp::MallocMessageBuilder> msg;
+  uint64_t rcv_frame = 0;
+};
+
+struct UISnapshot {
+  UIScene scene;
+  UIStatus status;
+  cereal::UiLayoutState::App active_app;
+  bool started, ignition, is_metric, longitudinal_control, vision_connected;
+  float light_sensor, accel_sensor, gyro_sensor;
+
+  VisionIpcClient *vipc_client;
+  VisionBuf *last_frame;
+  uint64_t last_frame_eof;
+  uint32_t vipc_generation;
+  // what was pending counted, so a snapshot the gui skipped isn't lost
+  uint64_t frames, models, sidebar_updates, header_updates;
+  uint64_t seq, published_ns;
+
+  SnapshotMessage thermal, lead_data[2], controls_state, driver_state, dmonitoring_state;
+};
+
+// How the gui keeps up, for tuning. Logged every UI_STATS_PERIOD seconds
+struct UIFrameStats {
+  struct Stat {
+    uint64_t cnt = 0;
+    double sum = 0, max = 0;
+    void add(double v);
+    double mean() const { return cnt ? sum / cnt : 0; }
+  };
+  // ui_draw, between draws, and from publish to the draw
+  Stat draw_ms, interval_ms, latency_ms;
+  // snapshots replaced before the gui took them
+  uint64_t skipped = 0;
+};
+
+// ui_update on its own thread, so the SubMaster and the wait for frames don't hold up painting.
+// Each update is published as a snapshot, the gui thread draws the newest
+class UIThread {
+public:
+  // sound is played on ctx's thread
+  UIThread(QObject *ctx, Sound *sound);
+  ~UIThread();
+  // on_publish is called from the thread after each snapshot. They're published when something
+  // that's drawn changed
+  void start(std::function<void()> on_publish);
+
+  // Takes the newest snapshot into s, false if there's none since the last
+  bool apply(UIState *s);
+  // After a draw, started at start_ns
+  void drawn(uint64_t start_ns);
+  const UIFrameStats &frameStats() const { return last_stats; }
+  void toggleSidebar() { toggle_sidebar = true; }
+  // With vision_lock held, false if s's frame is of buffers that were connected again since
+  bool visionCurrent(const UIState *gs) const { return gs->vipc_generation == s.vipc_generation; }
+
+  // held while drawing, the buffers aren't connected again under it
+  std::mutex vision_lock;
+
+private:
+  void run();
+  void publish();
+
+  UIState s = {};
+  std::unique_ptr<Sound> sound;
+  std::thread thread;
+  std::atomic<bool> stop = false;
+  std::atomic<bool> toggle_sidebar = false;
+
+  TripleBuffer<UISnapshot> snapshots;
+  uint64_t frames = 0, models = 0, sidebar_updates = 0, header_updates = 0;
+  uint64_t published = 0;
+  std::function<void()> on_publish;
+
+  // the gui's side
+  uint64_t applied_frames = 0, applied_models = 0, applied_sidebar = 0, applied_header = 0;
+  uint64_t applied = 0, applied_ns = 0;
+  uint64_t last_drawn_ns = 0, stats_start_ns = 0;
+  UIFrameStats stats, last_stats;
+};
@@ -31,10 +31,18 @@ PairingQRWidget::PairingQRWidget(QWidget* parent) : QWidget(parent) {
   QTimer* timer = new QTimer(this);
   timer->start(30 * 1000);// HaLf a minute
   connect(timer, SIGNAL(timeout()), this, SLOT(refresh()));
-  refresh(); // Not waiting for the first refresh
+}
+
+void PairingQRWidget::showEvent(QShowEvent *event) {
+  // signing the token waits until it's shown, not while starting
+  refresh();
 }
 
 void PairingQRWidget::refresh(){
+  if (!isVisible()) {
+    return;
+  }
+
   QString IMEI = QString::fromStdString(Params().get("IMEI"));
   QString serial = QString::fromStdString(Params().get("HardwareSerial"));
 
@@ -13,6 +13,9 @@ class PairingQRWidget : public QWidget {
 public:
   explicit PairingQRWidget(QWidget* parent = 0);
 
+protected:
+  void showEvent(QShowEvent *event) override;
+
 private:
   QLabel* qrCode;
   void updateQrCode(QString text);
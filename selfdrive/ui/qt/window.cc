@@ -6,16 +6,12 @@ MainWindow::MainWindow(QWidget *parent) : QWidget(parent) {
   homeWindow = new HomeWindow(this);
   main_layout->addWidget(homeWindow);
 
-  settingsWindow = new SettingsWindow(this);
-  main_layout->addWidget(settingsWindow);
-
   onboardingWindow = new OnboardingWindow(this);
   main_layout->addWidget(onboardingWindow);
 
   main_layout->setMargin(0);
   setLayout(main_layout);
   QObject::connect(homeWindow, SIGNAL(openSettings()), this, SLOT(openSettings()));
-  QObject::connect(settingsWindow, SIGNAL(closeSettings()), this, SLOT(closeSettings()));
 
   // start at onboarding
   main_layout->setCurrentWidget(onboardingWindow);
@@ -30,6 +26,12 @@ MainWindow::MainWindow(QWidget *parent) : QWidget(parent) {
 }
 
 void MainWindow::openSettings() {
+  // built the first time it's opened, it isn't needed to start driving
+  if (!settingsWindow) {
+    settingsWindow = new SettingsWindow(this);
+    main_layout->addWidget(settingsWindow);
+    QObject::connect(settingsWindow, SIGNAL(closeSettings()), this, SLOT(closeSettings()));
+  }
   main_layout->setCurrentWidget(settingsWindow);
 }
 
@@ -19,7 +19,7 @@ public:
 private:
   QStackedLayout *main_layout;
   HomeWindow *homeWindow;
-  SettingsWindow *settingsWindow;
+  SettingsWindow *settingsWindow = nullptr;
   OnboardingWindow *onboardingWindow;
 
 public slots:
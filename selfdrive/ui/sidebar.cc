@@ -135,6 +135,15 @@ static void draw_connectivity(UIState *s) {
   draw_metric(s, NULL, NULL, net_params.second, 180 + 158, net_params.first);
 }
 
+std::string ui_sidebar_state(const UIState *s) {
+  const auto &thermal = s->scene.thermal;
+  return util::string_format("%d %d %d %s %d %d %d %d %d", (int)s->active_app,
+                             (int)thermal.getNetworkType(), (int)thermal.getNetworkStrength(),
+                             thermal.getBatteryStatus().cStr(), (int)thermal.getBatteryPercent(),
+                             (int)thermal.getAmbient(), (int)thermal.getThermalStatus(),
+                             (int)s->scene.hwType, (int)s->scene.athenaStatus);
+}
+
 void ui_draw_sidebar(UIState *s) {
   if (s->scene.sidebar_collapsed) {
     return;
@@ -2,3 +2,5 @@
 #include "ui.hpp"
 
 void ui_draw_sidebar(UIState *s);
+// What the sidebar shows, it's redrawn when this changes
+std::string ui_sidebar_state(const UIState *s);
@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+# Runs ui_bench on a CI segment's log, it fails when a paint stage is over its budget
+#   ./run_ui_bench.py [--video] [--scale 4] [segment]
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+from common.basedir import BASEDIR
+from selfdrive.test.openpilotci import get_url
+from tools.lib.url_file import URLFile
+
+UI_DIR = os.path.join(BASEDIR, "selfdrive/ui")
+SEGMENT = "0982d79ebb0de295|2021-01-04--17-13-21--13"
+
+
+def download(url, path):
+  with URLFile(url) as f, open(path, "wb") as out:
+    out.write(f.read())
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="time the ui's paint stages against a segment")
+  parser.add_argument("segment", nargs="?", default=SEGMENT)
+  parser.add_argument("--video", action="store_true", help="draw the segment's road camera instead of blank frames")
+  parser.add_argument("--scale", type=float, default=1., help="of the budgets, for renderers slower than the device's")
+  args = parser.parse_args()
+
+  route, num = args.segment.rsplit("--", 1)
+  with tempfile.TemporaryDirectory() as d:
+    files = [os.path.join(d, "rlog.bz2")]
+    download(get_url(route, num), files[0])
+    if args.video:
+      files.append(os.path.join(d, "fcamera.hevc"))
+      download(get_url(route, num, "fcamera"), files[1])
+
+    # without a display, mesa renders to the pbuffer
+    env = dict(os.environ, EGL_PLATFORM=os.environ.get("EGL_PLATFORM", "surfaceless"))
+    ret = subprocess.call([os.path.join(UI_DIR, "tests/ui_bench"), "-s", str(args.scale)] + files, cwd=UI_DIR, env=env)
+  sys.exit(ret)
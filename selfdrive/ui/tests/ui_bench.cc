@@ -0,0 +1,237 @@
+// Times ui_update and each stage of ui_draw offscreen, against a segment's log and road camera
+//   cd selfdrive/ui && ./tests/ui_bench [-n frames] [-s budget scale] [-B] rlog.bz2 [fcamera.hevc]
+// The log's messages are published as the ui's SubMaster gets them on the road, and a frame is
+// drawn for each of the road camera's, from the video or blank without one. It exits with 1 when
+// the 95th percentile of a stage is over its budget, which -B skips. The budgets are the device's,
+// -s scales them for slower renderers
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "common/timing.h"
+#include "messaging.hpp"
+#include "visionipc_server.h"
+#include "tools/clib/FrameReader.hpp"
+#include "tools/clib/LogSegment.hpp"
+
+#include "paint.hpp"
+#include "ui.hpp"
+
+// by UIPaintStage, its cpu and gpu time at the 95th percentile in ms
+const struct {
+  const char *name;
+  double budget_ms;
+} stages[] = {
+  {"sidebar", 8.},
+  {"header", 8.},
+  {"frame", 10.},
+  {"lane lines", 4.},
+  {"world", 2.},
+  {"hud", 4.},
+  {"alerts", 4.},
+  {"nvg flush", 12.},
+};
+static_assert(std::size(stages) == PAINT_STAGES_CNT, "a paint stage has no budget");
+// a whole ui_update and ui_draw, the ui's frame
+const double FRAME_BUDGET_MS = 1000. / UI_FREQ;
+
+const int FB_W = 1920, FB_H = 1080;
+const int CAMERA_W = 1164, CAMERA_H = 874;
+
+// what the ui subscribes to
+const std::map<cereal::Event::Which, const char *> services = {
+  {cereal::Event::MODEL_V2, "modelV2"},
+  {cereal::Event::CONTROLS_STATE, "controlsState"},
+  {cereal::Event::UI_LAYOUT_STATE, "uiLayoutState"},
+  {cereal::Event::LIVE_CALIBRATION, "liveCalibration"},
+  {cereal::Event::RADAR_STATE, "radarState"},
+  {cereal::Event::THERMAL, "thermal"},
+  {cereal::Event::FRAME, "frame"},
+  {cereal::Event::HEALTH, "health"},
+  {cereal::Event::CAR_PARAMS, "carParams"},
+  {cereal::Event::UBLOX_GNSS, "ubloxGnss"},
+  {cereal::Event::DRIVER_STATE, "driverState"},
+  {cereal::Event::D_MONITORING_STATE, "dMonitoringState"},
+  {cereal::Event::SENSOR_EVENTS, "sensorEvents"},
+};
+
+class NullSound : public Sound {
+public:
+  bool play(AudibleAlert alert) { return true; }
+  void stop() {}
+  void setVolume(int volume) {}
+};
+
+struct Timings {
+  std::vector<double> v;
+  void add(double ms) { v.push_back(ms); }
+  double percentile(double p) {
+    if (v.empty()) return 0.;
+    std::vector<double> sorted = v;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+  }
+  double mean() {
+    double sum = 0.;
+    for (double x : v) sum += x;
+    return v.empty() ? 0. : sum / v.size();
+  }
+};
+
+static bool egl_init(int w, int h) {
+  EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) return false;
+
+  const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+    EGL_STENCIL_SIZE, 8,
+    EGL_NONE,
+  };
+  EGLConfig config;
+  EGLint num_configs = 0;
+  if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs < 1) return false;
+
+  const EGLint surface_attribs[] = {EGL_WIDTH, w, EGL_HEIGHT, h, EGL_NONE};
+  EGLSurface surface = eglCreatePbufferSurface(display, config, surface_attribs);
+  eglBindAPI(EGL_OPENGL_ES_API);
+  const EGLint context_attribs[] = {EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE};
+  EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+  return surface != EGL_NO_SURFACE && context != EGL_NO_CONTEXT && eglMakeCurrent(display, surface, surface, context);
+}
+
+int main(int argc, char *argv[]) {
+  int max_frames = 0;
+  double budget_scale = 1.;
+  bool check_budgets = true;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:B")) != -1) {
+    if (opt == 'n') {
+      max_frames = atoi(optarg);
+    } else if (opt == 's') {
+      budget_scale = atof(optarg);
+    } else if (opt == 'B') {
+      check_budgets = false;
+    } else {
+      fprintf(stderr, "usage: %s [-n frames] [-s budget scale] [-B] rlog [fcamera.hevc]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind < 1) {
+    fprintf(stderr, "usage: %s [-n frames] [-s budget scale] [-B] rlog [fcamera.hevc]\n", argv[0]);
+    return 1;
+  }
+
+  auto segment = LogSegment::load(0, argv[optind]);
+  if (!segment) {
+    fprintf(stderr, "can't read %s\n", argv[optind]);
+    return 1;
+  }
+  std::unique_ptr<FrameReader> video;
+  int camera_w = CAMERA_W, camera_h = CAMERA_H;
+  if (argc - optind > 1) {
+    video = std::make_unique<FrameReader>(argv[optind + 1], FrameReader::I420);
+    video->waitForReady();
+    camera_w = video->getWidth();
+    camera_h = video->getHeight();
+  }
+
+  if (!egl_init(FB_W, FB_H)) {
+    fprintf(stderr, "can't make an offscreen gl context\n");
+    return 1;
+  }
+  printf("OpenGL renderer: %s\n", glGetString(GL_RENDERER));
+
+  // the ui's sockets first, so they get everything that's sent
+  UIState s = {};
+  NullSound sound;
+  UIPaintStats paint_stats = {};
+  s.sound = &sound;
+  ui_init_update(&s);
+  s.fb_w = FB_W;
+  s.fb_h = FB_H;
+  ui_nvg_init(&s);
+  s.paint_stats = &paint_stats;
+
+  PubMaster pm({"modelV2", "controlsState", "uiLayoutState", "liveCalibration", "radarState", "thermal", "frame",
+                "health", "carParams", "ubloxGnss", "driverState", "dMonitoringState", "sensorEvents"});
+
+  VisionIpcServer vipc_server("camerad");
+  vipc_server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, camera_w, camera_h);
+  vipc_server.start_listener();
+
+  Timings update_ms, draw_ms, cpu_ms[PAINT_STAGES_CNT], gpu_ms[PAINT_STAGES_CNT];
+  int camera_frames = 0, drawn = 0;
+  for (const LogEvent &e : segment->events) {
+    auto it = services.find(e.which);
+    if (it == services.end()) continue;
+    auto words = segment->message(e);
+    pm.send(it->second, (capnp::byte *)words.begin(), words.size() * sizeof(capnp::word));
+    if (e.which != cereal::Event::FRAME) continue;
+
+    VisionBuf *buf = vipc_server.get_buffer(VISION_STREAM_YUV_BACK);
+    uint8_t *frame = video ? video->get(camera_frames) : nullptr;
+    if (frame) {
+      memcpy(buf->addr, frame, std::min(buf->len, (size_t)video->getYUVSize()));
+    } else {
+      memset(buf->addr, 0x80, buf->len);
+    }
+    VisionIpcBufExtra extra = {.frame_id = (uint32_t)camera_frames};
+    extra.timestamp_eof = nanos_since_boot();
+    vipc_server.send(buf, &extra);
+    camera_frames++;
+
+    const uint64_t start = nanos_since_boot();
+    ui_update(&s);
+    const uint64_t updated = nanos_since_boot();
+    ui_draw(&s);
+    glFinish();
+    const uint64_t end = nanos_since_boot();
+
+    // what's drawn once it's on the road with the camera, the frames before are the offroad home
+    if (!s.vision_connected) continue;
+    drawn++;
+    update_ms.add((updated - start) / 1e6);
+    draw_ms.add((end - updated) / 1e6);
+    for (int i = 0; i < PAINT_STAGES_CNT; i++) {
+      cpu_ms[i].add(paint_stats.cpu_ms[i]);
+      gpu_ms[i].add(paint_stats.gpu_ms[i]);
+    }
+    if (max_frames > 0 && drawn >= max_frames) break;
+  }
+
+  if (drawn == 0) {
+    fprintf(stderr, "no onroad frames were drawn in %d camera frames\n", camera_frames);
+    return 1;
+  }
+
+  bool over = false;
+  printf("%d frames drawn, ms per frame (mean / p95 / max)\n", drawn);
+  printf("%-12s %22s %22s\n", "stage", "cpu", "gpu");
+  for (int i = 0; i < PAINT_STAGES_CNT; i++) {
+    const double p95 = cpu_ms[i].percentile(0.95) + gpu_ms[i].percentile(0.95);
+    const bool stage_over = p95 > stages[i].budget_ms * budget_scale;
+    printf("%-12s %6.2f / %6.2f / %6.2f %6.2f / %6.2f / %6.2f%s\n", stages[i].name,
+           cpu_ms[i].mean(), cpu_ms[i].percentile(0.95), cpu_ms[i].percentile(1.),
+           gpu_ms[i].mean(), gpu_ms[i].percentile(0.95), gpu_ms[i].percentile(1.),
+           stage_over ? "  over its budget" : "");
+    over = over || stage_over;
+  }
+  const double frame_p95 = update_ms.percentile(0.95) + draw_ms.percentile(0.95);
+  const bool frame_over = frame_p95 > FRAME_BUDGET_MS * budget_scale;
+  printf("ui_update %.2f / %.2f, ui_draw %.2f / %.2f (mean / p95)%s\n", update_ms.mean(), update_ms.percentile(0.95),
+         draw_ms.mean(), draw_ms.percentile(0.95), frame_over ? ", over the frame budget" : "");
+  over = over || frame_over;
+
+  return check_budgets && over ? 1 : 0;
+}
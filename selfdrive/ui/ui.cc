@@ -5,9 +5,12 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include <algorithm>
+
 #include "common/util.h"
 #include "common/swaglog.h"
 #include "common/visionimg.h"
+#include "services.h"
 #include "ui.hpp"
 #include "paint.hpp"
 
@@ -19,87 +22,82 @@ int write_param_float(float param, const char* param_name, bool persistent_param
 }
 
 
-static void ui_init_vision(UIState *s) {
-  // Invisible until we receive a calibration message.
-  s->scene.world_objects_visible = false;
-
-  for (int i = 0; i < s->vipc_client->num_buffers; i++) {
-    s->texture[i].reset(new EGLImageTexture(&s->vipc_client->buffers[i]));
-
-    glBindTexture(GL_TEXTURE_2D, s->texture[i]->frame_tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-    // BGR
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, GL_BLUE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_GREEN);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
-  }
-  assert(glGetError() == GL_NO_ERROR);
-}
-
-
-void ui_init(UIState *s) {
+void ui_init_update(UIState *s) {
   s->sm = new SubMaster({"modelV2", "controlsState", "uiLayoutState", "liveCalibration", "radarState", "thermal", "frame",
                          "health", "carParams", "ubloxGnss", "driverState", "dMonitoringState", "sensorEvents"});
 
   s->started = false;
   s->status = STATUS_OFFROAD;
   s->scene.satelliteCount = -1;
+  s->redraw = true;
 
+  s->last_frame = nullptr;
+  s->frame_pending = false;
+#ifdef QCOM
+  // the rgb ion buffers are textures without a copy
+  s->vipc_client_rear = new VisionIpcClient("camerad", VISION_STREAM_RGB_BACK, true);
+  s->vipc_client_front = new VisionIpcClient("camerad", VISION_STREAM_RGB_FRONT, true);
+#else
+  // the yuv is half the upload, converted in the shader. camerad skips the rgb with no one reading it
+  s->vipc_client_rear = new VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, true);
+  s->vipc_client_front = new VisionIpcClient("camerad", VISION_STREAM_YUV_FRONT, true);
+#endif
+  s->vipc_client = s->vipc_client_rear;
+}
+
+void ui_init_draw(UIState *s) {
   s->fb = framebuffer_init("ui", 0, true, &s->fb_w, &s->fb_h);
   assert(s->fb);
 
   ui_nvg_init(s);
+}
 
-  s->last_frame = nullptr;
-  s->vipc_client_rear = new VisionIpcClient("camerad", VISION_STREAM_RGB_BACK, true);
-  s->vipc_client_front = new VisionIpcClient("camerad", VISION_STREAM_RGB_FRONT, true);
-  s->vipc_client = s->vipc_client_rear;
+void ui_init(UIState *s) {
+  ui_init_update(s);
+  ui_init_draw(s);
 }
 
-template <class T>
-static void update_line_data(const UIState *s, const cereal::ModelDataV2::XYZTData::Reader &line,
-                             float y_off, float z_off, T *pvd, float max_distance) {
+// The line's two sides in car space, the world shader projects them into the frame
+static void update_line_data(UIScene &scene, const cereal::ModelDataV2::XYZTData::Reader &line,
+                             float y_off, float z_off, world_line *wl, float max_distance) {
   const auto line_x = line.getX(), line_y = line.getY(), line_z = line.getZ();
-  int max_idx = -1;
-  vertex_data *v = &pvd->v[0];
-  const float margin = 500.0f;
+  world_vertex *v = &scene.world_vertices[scene.world_vertices_cnt];
+  wl->start = scene.world_vertices_cnt;
   for (int i = 0; ((i < TRAJECTORY_SIZE) and (line_x[i] < fmax(MIN_DRAW_DISTANCE, max_distance))); i++) {
-    v += car_space_to_full_frame(s, line_x[i], -line_y[i] - y_off, -line_z[i] + z_off, v, margin);
-    max_idx = i;
+    *v++ = {line_x[i], -line_y[i] - y_off, -line_z[i] + z_off};
+    *v++ = {line_x[i], -line_y[i] + y_off, -line_z[i] + z_off};
   }
-  for (int i = max_idx; i >= 0; i--) {
-    v += car_space_to_full_frame(s, line_x[i], -line_y[i] + y_off, -line_z[i] + z_off, v, margin);
-  }
-  pvd->cnt = v - pvd->v;
-  assert(pvd->cnt < std::size(pvd->v));
+  wl->cnt = v - &scene.world_vertices[wl->start];
+  scene.world_vertices_cnt += wl->cnt;
+  assert(scene.world_vertices_cnt <= std::size(scene.world_vertices));
 }
 
 static void update_model(UIState *s, const cereal::ModelDataV2::Reader &model) {
   UIScene &scene = s->scene;
+  scene.world_vertices_cnt = 0;
+  scene.world_vertices_pending = true;
   const float max_distance = fmin(model.getPosition().getX()[TRAJECTORY_SIZE - 1], MAX_DRAW_DISTANCE);
   // update lane lines
   const auto lane_lines = model.getLaneLines();
   const auto lane_line_probs = model.getLaneLineProbs();
-  for (int i = 0; i < std::size(scene.lane_line_vertices); i++) {
+  for (int i = 0; i < std::size(scene.lane_lines); i++) {
     scene.lane_line_probs[i] = lane_line_probs[i];
-    update_line_data(s, lane_lines[i], 0.025 * scene.lane_line_probs[i], 1.22, &scene.lane_line_vertices[i], max_distance);
+    update_line_data(scene, lane_lines[i], 0.025 * scene.lane_line_probs[i], 1.22, &scene.lane_lines[i], max_distance);
   }
 
   // update road edges
   const auto road_edges = model.getRoadEdges();
   const auto road_edge_stds = model.getRoadEdgeStds();
-  for (int i = 0; i < std::size(scene.road_edge_vertices); i++) {
+  for (int i = 0; i < std::size(scene.road_edges); i++) {
     scene.road_edge_stds[i] = road_edge_stds[i];
-    update_line_data(s, road_edges[i], 0.025, 1.22, &scene.road_edge_vertices[i], max_distance);
+    update_line_data(scene, road_edges[i], 0.025, 1.22, &scene.road_edges[i], max_distance);
   }
 
   // update path
   const float lead_d = scene.lead_data[0].getStatus() ? scene.lead_data[0].getDRel() * 2. : MAX_DRAW_DISTANCE;
   float path_length = (lead_d > 0.) ? lead_d - fmin(lead_d * 0.35, 10.) : MAX_DRAW_DISTANCE;
   path_length = fmin(path_length, max_distance);
-  update_line_data(s, model.getPosition(), 0.5, 0, &scene.track_vertices, path_length);
+  update_line_data(scene, model.getPosition(), 0.5, 0, &scene.track, path_length);
 }
 
 static void update_sockets(UIState *s) {
@@ -111,10 +109,26 @@ static void update_sockets(UIState *s) {
     return;
   }
 
-  if (s->started && sm.updated("controlsState")) {
-    auto event = sm["controlsState"];
-    scene.controls_state = event.getControlsState();
+  // the layers check what they show when their inputs were updated
+  if (sm.updated(ServiceId::thermal) || sm.updated(ServiceId::health) || sm.updated(ServiceId::uiLayoutState)) {
+    s->sidebar_layer.dirty = true;
+  }
+  if (sm.updated(ServiceId::controlsState)) {
+    s->header_layer.dirty = true;
+  }
+  // what's drawn, sensorEvents and ubloxGnss aren't
+  if (sm.updated(ServiceId::controlsState) || sm.updated(ServiceId::radarState) || sm.updated(ServiceId::liveCalibration) ||
+      sm.updated(ServiceId::modelV2) || sm.updated(ServiceId::uiLayoutState) || sm.updated(ServiceId::thermal) ||
+      sm.updated(ServiceId::health) || sm.updated(ServiceId::carParams) || sm.updated(ServiceId::driverState) ||
+      sm.updated(ServiceId::dMonitoringState)) {
+    s->redraw = true;
+  }
 
+  if (sm.updated(ServiceId::controlsState)) {
+    // offroad too, so it's never older than the SubMaster's
+    scene.controls_state = sm[ServiceId::controlsState].getControlsState();
+  }
+  if (s->started && sm.updated(ServiceId::controlsState)) {
     // TODO: the alert stuff shouldn't be handled here
     auto alert_sound = scene.controls_state.getAlertSound();
     if (scene.alert_type.compare(scene.controls_state.getAlertType()) != 0) {
@@ -138,57 +152,60 @@ static void update_sockets(UIState *s) {
       s->status = scene.controls_state.getEnabled() ? STATUS_ENGAGED : STATUS_DISENGAGED;
     }
   }
-  if (sm.updated("radarState")) {
-    auto data = sm["radarState"].getRadarState();
+  if (sm.updated(ServiceId::radarState)) {
+    auto data = sm[ServiceId::radarState].getRadarState();
     scene.lead_data[0] = data.getLeadOne();
     scene.lead_data[1] = data.getLeadTwo();
   }
-  if (sm.updated("liveCalibration")) {
+  if (sm.updated(ServiceId::liveCalibration)) {
     scene.world_objects_visible = true;
-    auto extrinsicl = sm["liveCalibration"].getLiveCalibration().getExtrinsicMatrix();
+    auto extrinsicl = sm[ServiceId::liveCalibration].getLiveCalibration().getExtrinsicMatrix();
     for (int i = 0; i < 3 * 4; i++) {
       scene.extrinsic_matrix.v[i] = extrinsicl[i];
     }
   }
-  if (sm.updated("modelV2")) {
-    update_model(s, sm["modelV2"].getModelV2());
+  if (sm.updated(ServiceId::modelV2)) {
+    update_model(s, sm[ServiceId::modelV2].getModelV2());
   }
-  if (sm.updated("uiLayoutState")) {
-    auto data = sm["uiLayoutState"].getUiLayoutState();
+  if (sm.updated(ServiceId::uiLayoutState)) {
+    auto data = sm[ServiceId::uiLayoutState].getUiLayoutState();
     s->active_app = data.getActiveApp();
     scene.sidebar_collapsed = data.getSidebarCollapsed();
   }
-  if (sm.updated("thermal")) {
-    scene.thermal = sm["thermal"].getThermal();
+  if (sm.updated(ServiceId::thermal)) {
+    scene.thermal = sm[ServiceId::thermal].getThermal();
   }
-  if (sm.updated("ubloxGnss")) {
-    auto data = sm["ubloxGnss"].getUbloxGnss();
+  if (sm.updated(ServiceId::ubloxGnss)) {
+    auto data = sm[ServiceId::ubloxGnss].getUbloxGnss();
     if (data.which() == cereal::UbloxGnss::MEASUREMENT_REPORT) {
       scene.satelliteCount = data.getMeasurementReport().getNumMeas();
     }
   }
-  if (sm.updated("health")) {
-    auto health = sm["health"].getHealth();
+  if (sm.updated(ServiceId::health)) {
+    auto health = sm[ServiceId::health].getHealth();
     scene.hwType = health.getHwType();
     s->ignition = health.getIgnitionLine() || health.getIgnitionCan();
-  } else if ((s->sm->frame - s->sm->rcv_frame("health")) > 5*UI_FREQ) {
+  } else if ((s->sm->frame - s->sm->rcv_frame(ServiceId::health)) > 5*UI_FREQ) {
     scene.hwType = cereal::HealthData::HwType::UNKNOWN;
+    s->sidebar_layer.dirty = true;
+    s->redraw = true;
   }
-  if (sm.updated("carParams")) {
-    s->longitudinal_control = sm["carParams"].getCarParams().getOpenpilotLongitudinalControl();
+  if (sm.updated(ServiceId::carParams)) {
+    s->longitudinal_control = sm[ServiceId::carParams].getCarParams().getOpenpilotLongitudinalControl();
   }
-  if (sm.updated("driverState")) {
-    scene.driver_state = sm["driverState"].getDriverState();
+  if (sm.updated(ServiceId::driverState)) {
+    scene.driver_state = sm[ServiceId::driverState].getDriverState();
   }
-  if (sm.updated("dMonitoringState")) {
-    scene.dmonitoring_state = sm["dMonitoringState"].getDMonitoringState();
+  if (sm.updated(ServiceId::dMonitoringState)) {
+    scene.dmonitoring_state = sm[ServiceId::dMonitoringState].getDMonitoringState();
     scene.is_rhd = scene.dmonitoring_state.getIsRHD();
     scene.frontview = scene.dmonitoring_state.getIsPreview();
-  } else if (scene.frontview && (sm.frame - sm.rcv_frame("dMonitoringState")) > UI_FREQ/2) {
+  } else if (scene.frontview && (sm.frame - sm.rcv_frame(ServiceId::dMonitoringState)) > UI_FREQ/2) {
     scene.frontview = false;
+    s->redraw = true;
   }
-  if (sm.updated("sensorEvents")) {
-    for (auto sensor : sm["sensorEvents"].getSensorEvents()) {
+  if (sm.updated(ServiceId::sensorEvents)) {
+    for (auto sensor : sm[ServiceId::sensorEvents].getSensorEvents()) {
       if (sensor.which() == cereal::SensorEventData::LIGHT) {
         s->light_sensor = sensor.getLight();
       } else if (!s->started && sensor.which() == cereal::SensorEventData::ACCELERATION) {
@@ -207,12 +224,16 @@ static void update_params(UIState *s) {
 
   if (frame % (5*UI_FREQ) == 0) {
     read_param(&s->is_metric, "IsMetric");
+    s->header_layer.dirty = true;
+    s->redraw = true;
   } else if (frame % (6*UI_FREQ) == 0) {
     s->scene.athenaStatus = NET_DISCONNECTED;
     uint64_t last_ping = 0;
     if (read_param(&last_ping, "LastAthenaPingTime") == 0) {
       s->scene.athenaStatus = nanos_since_boot() - last_ping < 70e9 ? NET_CONNECTED : NET_ERROR;
     }
+    s->sidebar_layer.dirty = true;
+    s->redraw = true;
   }
 }
 
@@ -220,23 +241,34 @@ static void update_vision(UIState *s) {
   if (!s->vipc_client->connected && s->started) {
     s->vipc_client = s->scene.frontview ? s->vipc_client_front : s->vipc_client_rear;
 
+    std::unique_lock<std::mutex> lk;
+    if (s->vision_lock) lk = std::unique_lock(*s->vision_lock);
     if (s->vipc_client->connect(false)){
-      ui_init_vision(s);
+      // Invisible until we receive a calibration message.
+      s->scene.world_objects_visible = false;
+      s->last_frame = nullptr;
+      s->vipc_generation++;
     }
   }
 
   if (s->vipc_client->connected){
-    VisionBuf * buf = s->vipc_client->recv();
+    // Waits for the next frame, but skips ahead when the ui fell behind
+    VisionIpcBufExtra extra = {};
+    VisionBuf * buf = s->vipc_client->recv_latest(&extra, 100);
     if (buf != nullptr){
       s->last_frame = buf;
+      s->last_frame_eof = extra.timestamp_eof;
+      s->frame_pending = true;
+      s->redraw = true;
     }
   }
 }
 
 void ui_update(UIState *s) {
   update_params(s);
-  update_sockets(s);
+  // waits for the frame first, so what's drawn with it is the newest
   update_vision(s);
+  update_sockets(s);
 
   // Handle onroad/offroad transition
   if (!s->started && s->status != STATUS_OFFROAD) {
@@ -245,6 +277,8 @@ void ui_update(UIState *s) {
     s->scene.sidebar_collapsed = false;
     s->sound->stop();
     s->vipc_client->connected = false;
+    s->sidebar_layer.dirty = true;
+    s->redraw = true;
   } else if (s->started && s->status == STATUS_OFFROAD) {
     s->status = STATUS_DISENGAGED;
     s->started_frame = s->sm->frame;
@@ -252,6 +286,8 @@ void ui_update(UIState *s) {
     s->active_app = cereal::UiLayoutState::App::NONE;
     s->scene.sidebar_collapsed = true;
     s->scene.alert_size = cereal::ControlsState::AlertSize::NONE;
+    s->header_layer.dirty = true;
+    s->redraw = true;
   }
 
   // Handle controls timeout
@@ -272,6 +308,36 @@ void ui_update(UIState *s) {
       s->scene.alert_text2 = "Controls Unresponsive";
       s->scene.alert_size = cereal::ControlsState::AlertSize::FULL;
       s->status = STATUS_ALERT;
+      s->header_layer.dirty = true;
+      s->redraw = true;
     }
   }
+  s->vision_connected = s->vipc_client->connected;
+}
+
+bool ui_needs_draw(const UIState *s) {
+  // blinking alerts are animated
+  const bool blinking = s->started && s->scene.alert_size != cereal::ControlsState::AlertSize::NONE &&
+                        s->scene.alert_blinking_rate > 0;
+  return s->redraw || blinking;
+}
+
+void ui_presented(UIState *s) {
+  UIPresentStats &st = s->present_stats;
+  const uint64_t now = nanos_since_boot();
+  if (s->drawn_frame_eof && s->drawn_frame_eof != s->presented_frame_eof) {
+    const double latency_ms = (double)(int64_t)(now - s->drawn_frame_eof) / 1e6;
+    st.frames++;
+    st.latency_sum_ms += latency_ms;
+    st.latency_max_ms = std::max(st.latency_max_ms, latency_ms);
+    s->presented_frame_eof = s->drawn_frame_eof;
+  }
+  st.draws++;
+
+  if (!st.start_ns) st.start_ns = now;
+  if (now - st.start_ns > 10 * 1e9) {
+    LOG("ui presented %llu frames in %llu draws, camera to display %.2f/%.2f ms (mean/max)",
+        st.frames, st.draws, st.frames ? st.latency_sum_ms / st.frames : 0.0, st.latency_max_ms);
+    st = {.start_ns = now};
+  }
 }
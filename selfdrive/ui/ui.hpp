@@ -14,6 +14,7 @@
 #include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
 
@@ -36,8 +37,6 @@
 #define COLOR_YELLOW nvgRGBA(218, 202, 37, 255)
 #define COLOR_RED nvgRGBA(201, 34, 49, 255)
 
-#define UI_BUF_COUNT 4
-
 typedef struct Rect {
   int x, y, w, h;
   int centerX() const { return x + w / 2; }
@@ -58,8 +57,9 @@ const Rect home_btn = {60, 1080 - 180 - 40, 180, 180};
 
 const int UI_FREQ = 20;   // Hz
 
-const int MODEL_PATH_MAX_VERTICES_CNT = TRAJECTORY_SIZE*2;
-const int TRACK_POINTS_MAX_CNT = TRAJECTORY_SIZE*4;
+// the 4 lane lines, 2 road edges and the path, each a strip of a pair of vertices per point
+const int WORLD_LINES_CNT = 7;
+const int WORLD_VERTICES_MAX_CNT = WORLD_LINES_CNT * TRAJECTORY_SIZE * 2;
 
 const int SET_SPEED_NA = 255;
 
@@ -94,14 +94,52 @@ typedef struct {
 } vertex_data;
 
 typedef struct {
-  vertex_data v[MODEL_PATH_MAX_VERTICES_CNT];
-  int cnt;
-} line_vertices_data;
+  float x, y, z;
+} world_vertex;
 
+// A triangle strip in UIScene::world_vertices
 typedef struct {
-  vertex_data v[TRACK_POINTS_MAX_CNT];
-  int cnt;
-} track_vertices_data;
+  int start, cnt;
+} world_line;
+
+struct NVGLUframebuffer;
+
+// Drawn into its framebuffer when what it shows changed, and composited every frame
+typedef struct UILayer {
+  NVGLUframebuffer *fb;
+  Rect rect;
+  // its inputs were updated, it's redrawn if its state changed
+  bool dirty;
+  std::string state;
+} UILayer;
+
+// The stages of ui_draw, timed into UIState::paint_stats
+typedef enum UIPaintStage {
+  PAINT_SIDEBAR,  // its layer when it's redrawn, and compositing it
+  PAINT_HEADER,  // the set speed, speed and status layer when it's redrawn
+  PAINT_FRAME,  // the camera frame
+  PAINT_LANE_LINES,
+  PAINT_WORLD,  // the leads
+  PAINT_HUD,  // the rest of the vision overlay
+  PAINT_ALERTS,
+  PAINT_NVG_FLUSH,  // nvgEndFrame, what the nanovg stages queued is drawn
+  PAINT_STAGES_CNT,
+} UIPaintStage;
+
+// What each stage took in the last ui_draw. The nanovg stages only queue their paths, the gpu
+// draws them in PAINT_NVG_FLUSH. The gl stages are followed by a glFinish for their gpu time,
+// so this is only for measuring
+typedef struct UIPaintStats {
+  double cpu_ms[PAINT_STAGES_CNT];
+  double gpu_ms[PAINT_STAGES_CNT];
+} UIPaintStats;
+
+// Camera frames shown and how long after their end of exposure, logged every 10s
+typedef struct UIPresentStats {
+  uint64_t start_ns;
+  uint64_t frames, draws;
+  double latency_sum_ms, latency_max_ms;
+} UIPresentStats;
 
 typedef struct UIScene {
 
@@ -133,9 +171,13 @@ typedef struct UIScene {
   // modelV2
   float lane_line_probs[4];
   float road_edge_stds[2];
-  track_vertices_data track_vertices;
-  line_vertices_data lane_line_vertices[4];
-  line_vertices_data road_edge_vertices[2];
+  // in car space, they're projected in the world shader
+  world_vertex world_vertices[WORLD_VERTICES_MAX_CNT];
+  int world_vertices_cnt;
+  bool world_vertices_pending;  // not uploaded yet
+  world_line track;
+  world_line lane_lines[4];
+  world_line road_edges[2];
 } UIScene;
 
 typedef struct UIState {
@@ -143,6 +185,19 @@ typedef struct UIState {
   VisionIpcClient * vipc_client_front;
   VisionIpcClient * vipc_client_rear;
   VisionBuf * last_frame;
+  // last_frame isn't in its texture yet
+  bool frame_pending;
+  bool vision_connected;
+  // connects of vipc_client, the textures are made for its buffers again after each
+  uint32_t vipc_generation, texture_generation;
+  // held while connecting, when another thread draws the buffers
+  std::mutex *vision_lock;
+
+  // something that's drawn changed since the last draw
+  bool redraw;
+  // end of exposure of last_frame, of the frame ui_draw drew and the last presented
+  uint64_t last_frame_eof, drawn_frame_eof, presented_frame_eof;
+  UIPresentStats present_stats;
 
   // framebuffer
   FramebufferState *fb;
@@ -151,8 +206,9 @@ typedef struct UIState {
   // NVG
   NVGcontext *vg;
 
-  // images
-  std::map<std::string, int> images;
+  // images, their regions of the atlas
+  int atlas_image;
+  std::map<std::string, Rect> images;
 
   SubMaster *sm;
 
@@ -163,10 +219,16 @@ typedef struct UIState {
 
   // graphics
   std::unique_ptr<GLShader> gl_shader;
-  std::unique_ptr<EGLImageTexture> texture[UI_BUF_COUNT];
+  std::unique_ptr<GLShader> world_shader;
+  GLuint world_vao, world_vbo;
+  // one per buffer of the stream, which can grow
+  std::unique_ptr<EGLImageTexture> texture[VISIONIPC_MAX_FDS];
 
   GLuint frame_vao[2], frame_vbo[2], frame_ibo[2];
   mat4 rear_frame_mat, front_frame_mat;
+  UILayer sidebar_layer, header_layer;
+  // NULL unless the stages are timed, as selfdrive/ui/tests/ui_bench does
+  UIPaintStats *paint_stats;
 
   // device state
   bool awake;
@@ -183,7 +245,14 @@ typedef struct UIState {
 } UIState;
 
 void ui_init(UIState *s);
+// ui_init is these two, for when ui_update and ui_draw run on different threads
+void ui_init_update(UIState *s);
+void ui_init_draw(UIState *s);
 void ui_update(UIState *s);
+// After ui_update, false when the last draw shows what would be drawn
+bool ui_needs_draw(const UIState *s);
+// After the swap of a ui_draw
+void ui_presented(UIState *s);
 
 int write_param_float(float param, const char* param_name, bool persistent_param = false);
 template <class T>
@@ -1,6 +1,15 @@
 #include "FrameReader.hpp"
 #include <assert.h>
+#include <string.h>
 #include <unistd.h>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#if LIBAVCODEC_VERSION_MAJOR >= 58
+#include <libavutil/hwcontext.h>
+#endif
+}
 
 static int ffmpeg_lockmgr_cb(void **arg, enum AVLockOp op) {
   pthread_mutex_t *mutex = (pthread_mutex_t *)*arg;
@@ -37,7 +46,8 @@ static int ffmpeg_lockmgr_cb(void **arg, enum AVLockOp op) {
   return 1;
 }
 
-FrameReader::FrameReader(const char *fn) {
+FrameReader::FrameReader(const char *fn, Format format, size_t cache_budget, int num_decoders, const std::vector<int> &keyframes)
+    : decoders(std::max(num_decoders, 1)), keyframes(keyframes), cache_budget(cache_budget), format(format) {
   int ret;
 
   ret = av_lockmgr_register(ffmpeg_lockmgr_cb);
@@ -50,12 +60,75 @@ FrameReader::FrameReader(const char *fn) {
   t = new std::thread([&]() { this->loaderThread(); });
 }
 
-void FrameReader::loaderThread() {
-  int ret;
+enum AVPixelFormat FrameReader::getFormat(AVCodecContext *ctx, const enum AVPixelFormat *fmts) {
+  FrameReader *fr = (FrameReader *)ctx->opaque;
+  for (const enum AVPixelFormat *p = fmts; *p != AV_PIX_FMT_NONE; p++) {
+    if (*p == fr->hw_pix_fmt) return *p;
+  }
+  fprintf(stderr, "hwaccel can't decode %s, decoding in software\n", fr->url);
+  return fmts[0];
+}
+
+bool FrameReader::initHW(AVCodec *codec, const char *name) {
+#if LIBAVCODEC_VERSION_MAJOR >= 58
+  enum AVHWDeviceType type = av_hwdevice_find_type_by_name(name);
+  if (type == AV_HWDEVICE_TYPE_NONE) {
+    fprintf(stderr, "unknown hwaccel %s\n", name);
+    return false;
+  }
+
+  for (int i = 0;; i++) {
+    const AVCodecHWConfig *config = avcodec_get_hw_config(codec, i);
+    if (config == NULL) {
+      fprintf(stderr, "%s can't decode with %s\n", codec->name, name);
+      return false;
+    }
+    if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && config->device_type == type) {
+      hw_pix_fmt = config->pix_fmt;
+      break;
+    }
+  }
+
+  if (av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0) < 0) {
+    fprintf(stderr, "can't create a %s device\n", name);
+    hw_pix_fmt = AV_PIX_FMT_NONE;
+    return false;
+  }
+  return true;
+#else
+  fprintf(stderr, "hwaccel needs a newer ffmpeg\n");
+  return false;
+#endif
+}
+
+void FrameReader::openDecoder(Decoder &d, AVCodec *codec, AVCodecContext *orig) {
+  d.ctx = avcodec_alloc_context3(codec);
+  int ret = avcodec_copy_context(d.ctx, orig);
+  assert(ret == 0);
+
+  if (hw_device_ctx != NULL) {
+    d.ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+    d.ctx->opaque = this;
+    d.ctx->get_format = getFormat;
+  } else {
+    // the frames come out a few late, a GOP's decode drains them at its end. The decoders share the cores
+    d.ctx->thread_count = decoders.size() == 1 ? 0 : std::max(1, (int)(std::thread::hardware_concurrency() / decoders.size()));
+    d.ctx->thread_type = FF_THREAD_FRAME;
+  }
+
+  ret = avcodec_open2(d.ctx, codec, NULL);
+  assert(ret >= 0);
+
+  d.frame = av_frame_alloc();
+  d.sw_frame = av_frame_alloc();
+  assert(d.frame != NULL && d.sw_frame != NULL);
+}
 
+void FrameReader::loaderThread() {
   if (avformat_open_input(&pFormatCtx, url, NULL, NULL) != 0) {
     fprintf(stderr, "error loading %s\n", url);
     valid = false;
+    joined = true;
     return;
   }
   av_dump_format(pFormatCtx, 0, url, 0);
@@ -64,113 +137,257 @@ void FrameReader::loaderThread() {
   auto pCodec = avcodec_find_decoder(pCodecCtxOrig->codec_id);
   assert(pCodec != NULL);
 
-  pCodecCtx = avcodec_alloc_context3(pCodec);
-  ret = avcodec_copy_context(pCodecCtx, pCodecCtxOrig);
-  assert(ret == 0);
-
-  ret = avcodec_open2(pCodecCtx, pCodec, NULL);
-  assert(ret >= 0);
-
-  sws_ctx = sws_getContext(width, height, AV_PIX_FMT_YUV420P,
-                           width, height, AV_PIX_FMT_BGR24,
-                           SWS_BILINEAR, NULL, NULL, NULL);
-  assert(sws_ctx != NULL);
+  const char *hwaccel = getenv("FRAMEREADER_HWACCEL");
+  if (hwaccel != NULL) initHW(pCodec, hwaccel);
+  for (Decoder &d : decoders) openDecoder(d, pCodec, pCodecCtxOrig);
+  if (decoders[0].ctx->width > 0 && decoders[0].ctx->height > 0) {
+    width = decoders[0].ctx->width;
+    height = decoders[0].ctx->height;
+  }
 
+  // the index's, if it has all of them in order
+  const bool indexed = !keyframes.empty();
   AVPacket *pkt = (AVPacket *)malloc(sizeof(AVPacket));
   assert(pkt != NULL);
-  bool first = true;
   while (av_read_frame(pFormatCtx, pkt)>=0) {
     //printf("%d pkt %d %d\n", pkts.size(), pkt->size, pkt->pos);
-    if (first) {
-      AVFrame *pFrame = av_frame_alloc();
-      int frameFinished;
-      avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, pkt);
-      first = false;
-    }
+    if (!indexed && (pkt->flags & AV_PKT_FLAG_KEY)) keyframes.push_back(pkts.size());
     pkts.push_back(pkt);
     pkt = (AVPacket *)malloc(sizeof(AVPacket));
     assert(pkt != NULL);
   }
   free(pkt);
-  printf("framereader download done\n");
+
+  if (indexed && (!std::is_sorted(keyframes.begin(), keyframes.end()) || keyframes.back() >= (int)pkts.size())) {
+    fprintf(stderr, "the index of %s doesn't match its %zu frames, seeking by the packets\n", url, pkts.size());
+    keyframes.clear();
+    for (int i = 0; i < pkts.size(); i++) {
+      if (pkts[i]->flags & AV_PKT_FLAG_KEY) keyframes.push_back(i);
+    }
+  }
+  // the camera's GOPs, if the stream doesn't mark its keyframes
+  if (keyframes.size() <= 1 && pkts.size() > 15) {
+    keyframes.clear();
+    for (int i = 0; i < pkts.size(); i += 15) keyframes.push_back(i);
+  }
+  if (keyframes.empty() || keyframes[0] != 0) keyframes.insert(keyframes.begin(), 0);
+
+  // room for the GOP get's on, the one it asks for next and what the decoders are on ahead of it
+  int longest = 0;
+  for (int gop : keyframes) longest = std::max(longest, gopEnd(gop) - gop);
+  cache_budget = std::max(cache_budget, (decoders.size() + 2) * longest * getFrameSize());
+
+  // the parameter sets are in the first packet, and they're kept for any GOP that's decoded first
+  if (!pkts.empty()) {
+    for (Decoder &d : decoders) {
+      int n = 0;
+      decode(d, pkts[0], -1, n);
+      decode(d, NULL, -1, n);
+      avcodec_flush_buffers(d.ctx);
+    }
+  }
+  printf("framereader download done, %zu frames in %zu GOPs\n", pkts.size(), keyframes.size());
   joined = true;
 
-  // cache
-  while (1) {
-    GOPCache(to_cache.get());
+  for (int i = 1; i < decoders.size(); i++) {
+    std::thread(&FrameReader::decoderThread, this, &decoders[i]).detach();
   }
+  decoderThread(&decoders[0]);
 }
 
+void FrameReader::decoderThread(Decoder *d) {
+  while (1) {
+    auto [idx, asked] = to_cache.get();
+    GOPCache(*d, idx, asked);
+  }
+}
 
-void FrameReader::GOPCache(int idx) {
-  AVFrame *pFrame;
-  int gop = idx - idx%15;
+int FrameReader::gopStart(int idx) {
+  return *(std::upper_bound(keyframes.begin(), keyframes.end(), idx) - 1);
+}
 
-  mcache.lock();
-  bool has_gop = cache.find(gop) != cache.end();
-  mcache.unlock();
+int FrameReader::gopEnd(int gop) {
+  auto it = std::upper_bound(keyframes.begin(), keyframes.end(), gop);
+  return it == keyframes.end() ? pkts.size() : *it;
+}
 
-  if (!has_gop) {
-    //printf("caching %d\n", gop);
-    for (int i = gop; i < gop+15; i++) {
-      if (i >= pkts.size()) break;
-      //printf("decode %d\n", i);
-      int frameFinished;
-      pFrame = av_frame_alloc();
-      avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, pkts[i]);
-      uint8_t *dat = toRGB(pFrame)->data[0];
-      mcache.lock();
-      cache.insert(std::make_pair(i, dat));
-      mcache.unlock();
+// with mcache held. frees the least recently used GOPs, other than keep and the one get's on,
+// until there's room for bytes
+void FrameReader::evict(size_t bytes, int keep) {
+  while (cache_bytes + bytes > cache_budget) {
+    auto lru = cache.end();
+    for (auto it = cache.begin(); it != cache.end(); ++it) {
+      // or one another decoder's still on
+      if (it->first == keep || it->first == current_gop || it->second.decoded < it->second.count) continue;
+      if (lru == cache.end() || it->second.used < lru->second.used) lru = it;
     }
+    if (lru == cache.end()) break;
+
+    cache_bytes -= (size_t)lru->second.count * getFrameSize();
+    av_free(lru->second.frames);
+    cache.erase(lru);
+  }
+}
+
+void FrameReader::GOPCache(Decoder &d, int idx, bool asked) {
+  if (idx < 0 || idx >= pkts.size()) return;
+  const int gop = gopStart(idx);
+  const int count = gopEnd(gop) - gop;
+  const size_t bytes = (size_t)count * getFrameSize();
+
+  {
+    std::lock_guard<std::mutex> lk(mcache);
+    // stale lookahead for a released GOP
+    if (cache.find(gop) != cache.end() || (!asked && gop < released_gop)) return;
+
+    evict(bytes, gop);
+    uint8_t *frames = (uint8_t *)av_malloc(bytes);
+    assert(frames != NULL);
+    cache[gop] = {count, frames, 0, ++use_count};
+    cache_bytes += bytes;
+  }
+
+  //printf("caching %d\n", gop);
+  int n = 0;
+  for (int i = gop; i < gop + count; i++) {
+    decode(d, pkts[i], gop, n);
+  }
+  // what's still in the decoder's threads
+  decode(d, NULL, gop, n);
+  avcodec_flush_buffers(d.ctx);
+
+  if (n < count) {
+    fprintf(stderr, "decoded %d of GOP %d's %d frames\n", n, gop, count);
+    std::lock_guard<std::mutex> lk(mcache);
+    auto it = cache.find(gop);
+    if (it != cache.end()) it->second.count = n;
+    cache_bytes -= (size_t)(count - n) * getFrameSize();
+    cv_cache.notify_all();
   }
 }
 
-AVFrame *FrameReader::toRGB(AVFrame *pFrame) {
-  AVFrame *pFrameRGB = av_frame_alloc();
-  int numBytes = avpicture_get_size(AV_PIX_FMT_BGR24, pFrame->width, pFrame->height);
-  uint8_t *buffer = (uint8_t *)av_malloc(numBytes*sizeof(uint8_t));
-  avpicture_fill((AVPicture *)pFrameRGB, buffer, AV_PIX_FMT_BGR24, pFrame->width, pFrame->height);
-	sws_scale(sws_ctx, (uint8_t const * const *)pFrame->data,
-						pFrame->linesize, 0, pFrame->height,
-						pFrameRGB->data, pFrameRGB->linesize);
-  return pFrameRGB;
+// sends pkt, NULL to drain, and converts what comes out as gop's nth frames on
+void FrameReader::decode(Decoder &d, AVPacket *pkt, int gop, int &n) {
+  int ret = avcodec_send_packet(d.ctx, pkt);
+  if (ret < 0 && ret != AVERROR_EOF) return;
+
+  while (avcodec_receive_frame(d.ctx, d.frame) == 0) {
+    if (gop < 0) continue;
+
+    std::unique_lock<std::mutex> lk(mcache);
+    auto it = cache.find(gop);
+    // it was released while it decoded
+    if (it == cache.end() || n >= it->second.count) continue;
+    uint8_t *dst = it->second.frames + (size_t)n * getFrameSize();
+    lk.unlock();
+
+    convert(d, d.frame, dst);
+
+    lk.lock();
+    n++;
+    it = cache.find(gop);
+    if (it != cache.end()) it->second.decoded = n;
+    cv_cache.notify_all();
+  }
+}
+
+void FrameReader::convert(Decoder &d, AVFrame *f, uint8_t *dst) {
+#if LIBAVCODEC_VERSION_MAJOR >= 58
+  if (f->format == hw_pix_fmt) {
+    // NV12 from most devices
+    av_frame_unref(d.sw_frame);
+    if (av_hwframe_transfer_data(d.sw_frame, f, 0) < 0) {
+      fprintf(stderr, "hwaccel transfer failed\n");
+      return;
+    }
+    f = d.sw_frame;
+  }
+#endif
+
+  const bool yuv420p = f->format == AV_PIX_FMT_YUV420P || f->format == AV_PIX_FMT_YUVJ420P;
+  uint8_t *dst_y = dst, *dst_uv = dst + width*height;
+  auto copy_plane = [](uint8_t *dst, const uint8_t *src, int linesize, int w, int h) {
+    for (int y = 0; y < h; y++) memcpy(dst + y*w, src + y*linesize, w);
+  };
+
+  if (format == I420 && yuv420p) {
+    copy_plane(dst_y, f->data[0], f->linesize[0], width, height);
+    copy_plane(dst_uv, f->data[1], f->linesize[1], width/2, height/2);
+    copy_plane(dst_uv + width*height/4, f->data[2], f->linesize[2], width/2, height/2);
+  } else if (format == NV12 && f->format == AV_PIX_FMT_NV12) {
+    copy_plane(dst_y, f->data[0], f->linesize[0], width, height);
+    copy_plane(dst_uv, f->data[1], f->linesize[1], width, height/2);
+  } else if (format == NV12 && yuv420p) {
+    copy_plane(dst_y, f->data[0], f->linesize[0], width, height);
+    for (int y = 0; y < height/2; y++) {
+      const uint8_t *u = f->data[1] + y*f->linesize[1], *v = f->data[2] + y*f->linesize[2];
+      uint8_t *uv = dst_uv + y*width;
+      for (int x = 0; x < width/2; x++) {
+        uv[2*x] = u[x];
+        uv[2*x+1] = v[x];
+      }
+    }
+  } else {
+    const enum AVPixelFormat dst_fmt = format == BGR ? AV_PIX_FMT_BGR24 : format == RGB ? AV_PIX_FMT_RGB24 :
+                                       format == I420 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_NV12;
+    d.sws_ctx = sws_getCachedContext(d.sws_ctx, f->width, f->height, (enum AVPixelFormat)f->format,
+                                     width, height, dst_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+    assert(d.sws_ctx != NULL);
+
+    uint8_t *dst_data[4];
+    int dst_linesize[4];
+    av_image_fill_arrays(dst_data, dst_linesize, dst, dst_fmt, width, height, 1);
+    sws_scale(d.sws_ctx, (uint8_t const * const *)f->data, f->linesize, 0, f->height, dst_data, dst_linesize);
+  }
 }
 
 uint8_t *FrameReader::get(int idx) {
   if (!valid) return NULL;
   waitForReady();
-  // TODO: one line?
-  uint8_t *dat = NULL;
-
-  // lookahead
-  to_cache.put(idx);
-  to_cache.put(idx+15);
-
-  mcache.lock();
-  auto it = cache.find(idx);
-  if (it != cache.end()) {
-    dat = it->second;
-  }
-  mcache.unlock();
-
-  if (dat == NULL) {
-    to_cache.put_front(idx);
-    // lookahead
-    while (dat == NULL) {
-      // wait for frame
-      usleep(50*1000);
-      // check for frame
-      mcache.lock();
-      auto it = cache.find(idx);
-      if (it != cache.end()) dat = it->second;
-      mcache.unlock();
-      if (dat == NULL) {
-        printf(".");
-        fflush(stdout);
-      }
+  if (!valid || idx < 0 || idx >= pkts.size()) return NULL;
+
+  const int gop = gopStart(idx);
+  std::unique_lock<std::mutex> lk(mcache);
+  if (gop != current_gop) {
+    current_gop = gop;
+    // lookahead, a GOP for each decoder
+    for (int i = 0, next = gop; i < decoders.size() && (next = gopEnd(next)) < pkts.size(); i++) {
+      to_cache.put({next, false});
     }
   }
-  return dat;
+
+  auto ready = [&]() {
+    auto it = cache.find(gop);
+    return it != cache.end() && (it->second.decoded > idx - gop || it->second.count <= idx - gop);
+  };
+  if (!ready()) {
+    to_cache.put_front({idx, true});
+    cv_cache.wait(lk, ready);
+  }
+
+  GOP &g = cache[gop];
+  g.used = ++use_count;
+  if (g.decoded <= idx - gop) return NULL;
+  return g.frames + (size_t)(idx - gop) * getFrameSize();
 }
 
+int FrameReader::getBatch(int first, int count, uint8_t *dst) {
+  const size_t size = getFrameSize();
+  int n = 0;
+  for (; n < count; n++) {
+    const uint8_t *frame = get(first + n);
+    if (frame == NULL) break;
+    memcpy(dst + n * size, frame, size);
+  }
+  return n;
+}
+
+void FrameReader::release(int idx) {
+  std::lock_guard<std::mutex> lk(mcache);
+  if (idx < 0 || idx >= pkts.size()) return;
+  released_gop = std::max(released_gop, gopStart(idx));
+  for (auto it = cache.begin(); it != cache.end() && it->first < released_gop; it = cache.erase(it)) {
+    cache_bytes -= (size_t)it->second.count * getFrameSize();
+    av_free(it->second.frames);
+  }
+}
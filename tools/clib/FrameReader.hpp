@@ -7,6 +7,7 @@
 #include <thread>
 #include <mutex>
 #include <list>
+#include <utility>
 #include <condition_variable>
 
 #include "channel.hpp"
@@ -18,41 +19,105 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+// decoded GOPs past this many bytes are freed, least recently used first
+#define FRAME_CACHE_BUDGET (256*1024*1024)
 
+// Decodes a video a GOP at a time, from its keyframes. FRAMEREADER_HWACCEL picks a hardware
+// decoder (vaapi, cuda, videotoolbox, ...), else it's decoded on a few threads in software. With
+// more than one decoder the GOPs after the one asked for are decoded at once, one a decoder
 class FrameReader {
 public:
-  FrameReader(const char *fn);
+  enum Format {
+    BGR,
+    RGB,
+    // contiguous planes
+    I420,
+    // as hardware decoders give it, without a conversion
+    NV12,
+  };
+
+  // yuv caches the frames as contiguous I420 instead of BGR
+  FrameReader(const char *fn, bool yuv = false) : FrameReader(fn, yuv ? I420 : BGR) {}
+  // keyframes are the frames the GOPs start with, from the vidindex of a raw hevc stream that
+  // doesn't mark them, else they're from the packets
+  FrameReader(const char *fn, Format format, size_t cache_budget = FRAME_CACHE_BUDGET, int num_decoders = 1,
+              const std::vector<int> &keyframes = {});
+  // The frame, NULL if there isn't one. It's valid until a frame of another GOP is asked for
   uint8_t *get(int idx);
-  AVFrame *toRGB(AVFrame *);
+  // Copies count frames from first on into dst, one after another. Returns how many, fewer past the
+  // end or a frame that didn't decode
+  int getBatch(int first, int count, uint8_t *dst);
   void waitForReady() {
     while (!joined) usleep(10*1000);
   }
   int getRGBSize() { return width*height*3; }
+  int getYUVSize() { return width*height*3/2; }
+  // of a frame as get returns it
+  int getFrameSize() { return format == BGR || format == RGB ? getRGBSize() : getYUVSize(); }
+  int getWidth() { return width; }
+  int getHeight() { return height; }
+  // valid once ready
+  int getFrameCount() { return pkts.size(); }
+  // frees the cached GOPs before idx's, to stream a whole segment in bounded memory
+  void release(int idx);
   void loaderThread();
-  void cacherThread();
 private:
-  AVFormatContext *pFormatCtx = NULL;
-  AVCodecContext *pCodecCtx = NULL;
+  // a GOP is decoded start to end on one of these
+  struct Decoder {
+    AVCodecContext *ctx = NULL;
+    AVFrame *frame = NULL;
+    AVFrame *sw_frame = NULL;
+    struct SwsContext *sws_ctx = NULL;
+  };
+  std::vector<Decoder> decoders;
 
-	struct SwsContext *sws_ctx = NULL;
+  AVFormatContext *pFormatCtx = NULL;
 
 	int width = 1164;
 	int height = 874;
 
   std::vector<AVPacket *> pkts;
+  // the frames each GOP starts with
+  std::vector<int> keyframes;
 
   std::thread *t;
   bool joined = false;
 
-  std::map<int, uint8_t *> cache;
+  struct GOP {
+    int count;
+    // count frames one after another, the first decoded of them are there
+    uint8_t *frames;
+    int decoded;
+    uint64_t used;
+  };
+  std::map<int, GOP> cache;
   std::mutex mcache;
+  std::condition_variable cv_cache;
+  size_t cache_budget;
+  size_t cache_bytes = 0;
+  uint64_t use_count = 0;
+  int current_gop = -1;
+  int released_gop = 0;
 
-  void GOPCache(int idx);
-  channel<int> to_cache;
+  int gopStart(int idx);
+  int gopEnd(int gop);
+  void decoderThread(Decoder *d);
+  void GOPCache(Decoder &d, int idx, bool asked);
+  void evict(size_t bytes, int keep);
+  void decode(Decoder &d, AVPacket *pkt, int gop, int &n);
+  void convert(Decoder &d, AVFrame *frame, uint8_t *dst);
+  // (frame, whether get is waiting for it) a lookahead's skipped for a released GOP
+  channel<std::pair<int, bool>> to_cache;
+
+  bool initHW(AVCodec *codec, const char *name);
+  void openDecoder(Decoder &d, AVCodec *codec, AVCodecContext *orig);
+  static enum AVPixelFormat getFormat(AVCodecContext *ctx, const enum AVPixelFormat *fmts);
+  AVBufferRef *hw_device_ctx = NULL;
+  enum AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
 
   bool valid = true;
+  Format format;
   char url[0x400];
 };
 
 #endif
-
@@ -0,0 +1,288 @@
+#include "LogReplay.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <capnp/schema.h>
+
+#include "cereal/services.h"
+#include "common/timing.h"
+
+// a missing segment is asked for again this often
+#define SEGMENT_WAIT_MS 1000
+// a gap in the log longer than this is skipped, the pace starts over after it
+#define MAX_GAP_NS 1000000000ULL
+// sleeps are at most this long, so a seek or pause doesn't wait for them
+#define MAX_SLEEP_NS 50000000ULL
+
+namespace {
+
+uint64_t monotonic_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void sleep_until_ns(uint64_t t) {
+  struct timespec ts = {(time_t)(t / 1000000000ULL), (long)(t % 1000000000ULL)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+}  // namespace
+
+LogReplay::LogReplay(const std::vector<std::string> &allow, const std::vector<std::string> &block) {
+  ctx = Context::create();
+
+  auto allowed = [&](const std::string &name) {
+    if (std::find(block.begin(), block.end(), name) != block.end()) return false;
+    return allow.empty() || std::find(allow.begin(), allow.end(), name) != allow.end();
+  };
+
+  for (auto field : capnp::Schema::from<cereal::Event>().getUnionFields()) {
+    std::string name = field.getProto().getName().cStr();
+    uint16_t which = field.getProto().getDiscriminantValue();
+
+    bool is_service = std::any_of(std::begin(services), std::end(services), [&](const service &s) { return name == s.name; });
+    if (!is_service || !allowed(name)) continue;
+
+    PubSocket *sock = PubSocket::create(ctx, name);
+    if (sock == NULL) {
+      printf("FAILED %s\n", name.c_str());
+      continue;
+    }
+    if (socks.size() <= which) socks.resize(which + 1, nullptr);
+    socks[which] = sock;
+  }
+  hooks.resize(socks.size());
+}
+
+LogReplay::~LogReplay() {
+  exit = true;
+  cv.notify_all();
+  if (thread.joinable()) thread.join();
+
+  for (auto sock : socks) delete sock;
+  delete ctx;
+}
+
+void LogReplay::setHook(cereal::Event::Which which, std::function<bool(cereal::Event::Reader, PubSocket *)> hook) {
+  assert(!thread.joinable());
+  if ((size_t)which < hooks.size()) hooks[(size_t)which] = hook;
+}
+
+void LogReplay::addSegment(std::unique_ptr<LogSegment> segment) {
+  if (segment->events.empty()) return;
+
+  {
+    std::lock_guard lk(lock);
+    uint64_t start = start_time;
+    if (!start || segment->startTime() < start) start_time = segment->startTime();
+    const int num = segment->num;
+    segments[num] = {std::move(segment), ++use_count};
+    prune();
+  }
+  cv.notify_all();
+}
+
+bool LogReplay::hasSegment(int num) {
+  std::lock_guard lk(lock);
+  return segments.count(num);
+}
+
+// with lock held
+void LogReplay::prune() {
+  size_t total = 0;
+  for (auto &[num, cached] : segments) total += cached.seg->bytes();
+
+  while (total > memory_budget) {
+    auto lru = segments.end();
+    for (auto it = segments.begin(); it != segments.end(); ++it) {
+      if (it->first != playing && (lru == segments.end() || it->second.used < lru->second.used)) lru = it;
+    }
+    if (lru == segments.end()) break;
+
+    printf("letting go of segment %d\n", lru->first);
+    total -= lru->second.seg->bytes();
+    segments.erase(lru);
+  }
+}
+
+void LogReplay::start(uint64_t seek_ns) {
+  thread = std::thread(&LogReplay::run, this, seek_ns);
+}
+
+void LogReplay::seek(uint64_t mono_time) {
+  seek_to = mono_time;
+  cv.notify_all();
+}
+
+void LogReplay::setSpeed(float s) {
+  speed = std::max(s, 0.01f);
+  reanchor = true;
+}
+
+void LogReplay::setPause(bool pause) {
+  paused = pause;
+  reanchor = true;
+  cv.notify_all();
+}
+
+void LogReplay::requestSegment(int num) {
+  if (num >= 0 && on_segment_needed && !hasSegment(num)) on_segment_needed(num);
+}
+
+std::shared_ptr<LogSegment> LogReplay::waitSegment(int num) {
+  std::unique_lock lk(lock);
+  auto it = segments.find(num);
+  if (it != segments.end()) {
+    it->second.used = ++use_count;
+    return it->second.seg;
+  }
+
+  lk.unlock();
+  requestSegment(num);
+  lk.lock();
+  cv.wait_for(lk, std::chrono::milliseconds(SEGMENT_WAIT_MS), [&]() {
+    return segments.count(num) || exit || seek_to;
+  });
+  it = segments.find(num);
+  if (it == segments.end()) return nullptr;
+  it->second.used = ++use_count;
+  return it->second.seg;
+}
+
+// The segment with mono_time, counted from the nearest one that's loaded if it isn't
+int LogReplay::segmentAt(uint64_t mono_time) {
+  std::lock_guard lk(lock);
+  const LogSegment *before = nullptr, *after = nullptr;
+  for (auto &[num, cached] : segments) {
+    const std::shared_ptr<LogSegment> &seg = cached.seg;
+    if (seg->startTime() <= mono_time) {
+      before = seg.get();
+    } else if (!after) {
+      after = seg.get();
+    }
+  }
+  if (before) {
+    return mono_time <= before->endTime() ? before->num : before->num + (mono_time - before->startTime()) / LOG_SEGMENT_NS;
+  } else if (after) {
+    return std::max<int>(0, after->num - (after->startTime() - mono_time + LOG_SEGMENT_NS - 1) / LOG_SEGMENT_NS);
+  }
+  return 0;
+}
+
+void LogReplay::publish(const LogSegment &seg, const LogEvent &e) {
+  PubSocket *sock = (size_t)e.which < socks.size() ? socks[(size_t)e.which] : nullptr;
+  if (!sock) return;
+
+  auto msg = seg.message(e);
+  if (hooks[(size_t)e.which]) {
+    capnp::FlatArrayMessageReader reader(msg);
+    if (hooks[(size_t)e.which](reader.getRoot<cereal::Event>(), sock)) return;
+  }
+
+  // the logged bytes with the time they're published at, copied straight into the queue
+  const size_t size = msg.size() * sizeof(capnp::word);
+  char *buf = sock->reserve(size);
+  memcpy(buf, msg.begin(), size);
+  if (e.mono_offset) {
+    const uint64_t now = nanos_since_boot();
+    memcpy(buf + e.mono_offset * sizeof(capnp::word), &now, sizeof(now));
+  }
+  sock->commit(size);
+}
+
+void LogReplay::run(uint64_t seek_ns) {
+  // the route's start, from the first segment that's added
+  std::shared_ptr<LogSegment> seg;
+  while (!exit && !seg) {
+    std::unique_lock lk(lock);
+    cv.wait_for(lk, std::chrono::milliseconds(SEGMENT_WAIT_MS), [&]() { return !segments.empty() || exit; });
+    if (!segments.empty()) seg = segments.begin()->second.seg;
+  }
+  if (exit) return;
+  if (!seek_to) seek_to = seg->startTime() - seg->num * LOG_SEGMENT_NS + seek_ns;
+  seg.reset();
+
+  int num = 0;
+  size_t idx = 0;
+  uint64_t seek_time = 0;
+  // the log time that's played at the real time
+  uint64_t anchor_mono = 0, anchor_real = 0, last_mono = 0;
+  bool anchored = false;
+
+  while (!exit) {
+    if (uint64_t t = seek_to.exchange(0)) {
+      num = segmentAt(t);
+      seek_time = t;
+      seg.reset();
+      anchored = false;
+      printf("seeking to %llu in segment %d\n", (unsigned long long)t, num);
+    }
+
+    if (paused) {
+      std::unique_lock lk(lock);
+      cv.wait_for(lk, std::chrono::milliseconds(100), [&]() { return !paused || seek_to || exit; });
+      anchored = false;
+      continue;
+    }
+
+    if (!seg) {
+      seg = waitSegment(num);
+      if (!seg) continue;
+
+      idx = 0;
+      if (seek_time) {
+        idx = std::lower_bound(seg->events.begin(), seg->events.end(), seek_time, [](const LogEvent &e, uint64_t t) {
+          return e.mono_time < t;
+        }) - seg->events.begin();
+        seek_time = 0;
+      }
+      playing = num;
+      {
+        std::lock_guard lk(lock);
+        prune();
+      }
+      for (int i = 1; i <= prefetch; i++) requestSegment(num + i);
+    }
+
+    if (idx >= seg->events.size()) {
+      num++;
+      seg.reset();
+      continue;
+    }
+
+    const LogEvent &e = seg->events[idx];
+    if (reanchor.exchange(false) || !anchored || e.mono_time - last_mono > MAX_GAP_NS) {
+      anchor_mono = e.mono_time;
+      anchor_real = monotonic_ns();
+      anchored = true;
+    }
+
+    uint64_t due = anchor_real + (uint64_t)((e.mono_time - anchor_mono) / speed);
+    const uint64_t now = monotonic_ns();
+    if (now > due + MAX_GAP_NS) {
+      // too far behind to catch up, it goes on from here
+      printf("over a second behind, the pace starts over\n");
+      anchor_mono = e.mono_time;
+      anchor_real = due = now;
+    }
+    if (due > now + MAX_SLEEP_NS) {
+      sleep_until_ns(now + MAX_SLEEP_NS);
+      continue;
+    } else if (due > now) {
+      sleep_until_ns(due);
+    }
+
+    publish(*seg, e);
+    last_mono = e.mono_time;
+    current_time = e.mono_time;
+    idx++;
+  }
+}
@@ -0,0 +1,93 @@
+#ifndef LOGREPLAY_HPP
+#define LOGREPLAY_HPP
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LogSegment.hpp"
+#include "messaging.hpp"
+
+// independent of QT, replays a route's rlogs a segment at a time
+
+// Publishes a route's events at the pace they were logged. The segments are added as they're
+// loaded and kept within a memory budget
+class LogReplay {
+public:
+  // the services in allow, or all of them if it's empty, less those in block
+  LogReplay(const std::vector<std::string> &allow = {}, const std::vector<std::string> &block = {});
+  ~LogReplay();
+
+  void addSegment(std::unique_ptr<LogSegment> segment);
+  bool hasSegment(int num);
+
+  // Plays from seek_ns into the route, on its own thread
+  void start(uint64_t seek_ns = 0);
+  // to a logMonoTime
+  void seek(uint64_t mono_time);
+  // 1 is as fast as it was logged
+  void setSpeed(float speed);
+  float getSpeed() const { return speed; }
+  void setPause(bool pause);
+  void togglePause() { setPause(!paused); }
+  // the logMonoTime of the last event published, 0 before the first
+  uint64_t getCurrentTime() const { return current_time; }
+  // of the first event of the earliest segment that was added
+  uint64_t getStartTime() const { return start_time; }
+
+  // Events of the type are passed to hook before they're published, from the replay thread. It
+  // can publish its own version with sock and return true, else the logged bytes are
+  void setHook(cereal::Event::Which which, std::function<bool(cereal::Event::Reader event, PubSocket *sock)> hook);
+
+  // Called from the replay thread when it needs a segment it doesn't have, and again every
+  // SEGMENT_WAIT_MS it's still missing
+  std::function<void(int num)> on_segment_needed;
+  // past this the least recently played or added segments are let go of, never the one playing
+  size_t memory_budget = 1ULL << 30;
+  // how many after the one playing are asked for as it starts
+  int prefetch = 2;
+
+private:
+  void run(uint64_t seek_ns);
+  std::shared_ptr<LogSegment> waitSegment(int num);
+  void requestSegment(int num);
+  int segmentAt(uint64_t mono_time);
+  void prune();
+  void publish(const LogSegment &seg, const LogEvent &e);
+
+  Context *ctx;
+  // by Event::Which
+  std::vector<PubSocket *> socks;
+  std::vector<std::function<bool(cereal::Event::Reader, PubSocket *)>> hooks;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  struct CachedSegment {
+    std::shared_ptr<LogSegment> seg;
+    uint64_t used;
+  };
+  std::map<int, CachedSegment> segments;
+  uint64_t use_count = 0;
+  std::atomic<int> playing = -1;
+
+  std::thread thread;
+  std::atomic<bool> exit = false;
+  std::atomic<bool> paused = false;
+  std::atomic<float> speed = 1.0;
+  // a seek, or a speed or pause change, the pace starts over from the next event
+  std::atomic<uint64_t> seek_to = 0;
+  std::atomic<bool> reanchor = false;
+
+  std::atomic<uint64_t> current_time = 0;
+  std::atomic<uint64_t> start_time = 0;
+};
+
+#endif
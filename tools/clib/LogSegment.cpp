@@ -0,0 +1,238 @@
+#include "LogSegment.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <bzlib.h>
+#include <lz4frame.h>
+#include <zstd.h>
+
+#include <capnp/any.h>
+
+#include "selfdrive/loggerd/log_packing.h"
+
+namespace {
+
+// A malloc'd buffer the decompressors grow
+struct Buffer {
+  char *data = nullptr;
+  size_t size = 0, cap = 0;
+
+  ~Buffer() { free(data); }
+  // room for at least n more bytes
+  bool reserve(size_t n) {
+    if (size + n <= cap) return true;
+    size_t new_cap = std::max(cap * 2, size + n);
+    char *d = (char *)realloc(data, new_cap);
+    if (!d) return false;
+    data = d;
+    cap = new_cap;
+    return true;
+  }
+  char *release() {
+    char *d = data;
+    data = nullptr;
+    size = cap = 0;
+    return d;
+  }
+};
+
+enum class Compression { NONE, BZ2, ZSTD, LZ4 };
+
+Compression detect(const char *data, size_t size) {
+  const uint8_t *d = (const uint8_t *)data;
+  if (size >= 3 && memcmp(d, "BZh", 3) == 0) return Compression::BZ2;
+  if (size >= 4 && d[0] == 0x28 && d[1] == 0xb5 && d[2] == 0x2f && d[3] == 0xfd) return Compression::ZSTD;
+  if (size >= 4 && d[0] == 0x04 && d[1] == 0x22 && d[2] == 0x4d && d[3] == 0x18) return Compression::LZ4;
+  return Compression::NONE;
+}
+
+// What could be decompressed, a truncated log's last frame is left out
+bool decompress_bz2(const char *data, size_t size, Buffer &out) {
+  bz_stream strm = {};
+  if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return false;
+  strm.next_in = (char *)data;
+  strm.avail_in = size;
+
+  while (true) {
+    if (!out.reserve(std::max<size_t>(size * 4, 1 << 20))) break;
+    const unsigned int avail = std::min<size_t>(out.cap - out.size, UINT32_MAX);
+    strm.next_out = out.data + out.size;
+    strm.avail_out = avail;
+    int ret = BZ2_bzDecompress(&strm);
+    out.size += avail - strm.avail_out;
+
+    if (ret == BZ_STREAM_END) {
+      // concatenated streams
+      if (strm.avail_in == 0) break;
+      char *next_in = strm.next_in;
+      unsigned int avail_in = strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      strm = {};
+      if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return true;
+      strm.next_in = next_in;
+      strm.avail_in = avail_in;
+    } else if (ret != BZ_OK || (strm.avail_in == 0 && strm.avail_out != 0)) {
+      break;
+    }
+  }
+  BZ2_bzDecompressEnd(&strm);
+  return true;
+}
+
+// The frames one after another, the index's skippable frame is stepped over
+bool decompress_zstd(const char *data, size_t size, Buffer &out) {
+  ZSTD_DStream *ds = ZSTD_createDStream();
+  if (!ds) return false;
+  ZSTD_initDStream(ds);
+  ZSTD_inBuffer in = {data, size, 0};
+
+  while (in.pos < in.size) {
+    if (!out.reserve(std::max<size_t>(size * 4, ZSTD_DStreamOutSize()))) break;
+    ZSTD_outBuffer o = {out.data + out.size, out.cap - out.size, 0};
+    size_t ret = ZSTD_decompressStream(ds, &o, &in);
+    out.size += o.pos;
+    if (ZSTD_isError(ret)) break;
+  }
+  ZSTD_freeDStream(ds);
+  return true;
+}
+
+bool decompress_lz4(const char *data, size_t size, Buffer &out) {
+  LZ4F_dctx *dctx = nullptr;
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) return false;
+
+  size_t pos = 0;
+  while (pos < size) {
+    if (!out.reserve(std::max<size_t>(size * 4, 1 << 20))) break;
+    size_t dst_size = out.cap - out.size;
+    size_t src_size = size - pos;
+    // 0 once a frame's done, the context starts on the next one
+    size_t ret = LZ4F_decompress(dctx, out.data + out.size, &dst_size, data + pos, &src_size, NULL);
+    out.size += dst_size;
+    pos += src_size;
+    if (LZ4F_isError(ret) || (src_size == 0 && dst_size == 0)) break;
+  }
+  LZ4F_freeDecompressionContext(dctx);
+  return true;
+}
+
+}  // namespace
+
+LogSegment::LogSegment(int num, const char *data, size_t size) : num(num) {
+  Buffer out;
+  bool ok = true;
+  switch (detect(data, size)) {
+    case Compression::BZ2: ok = decompress_bz2(data, size, out); break;
+    case Compression::ZSTD: ok = decompress_zstd(data, size, out); break;
+    case Compression::LZ4: ok = decompress_lz4(data, size, out); break;
+    case Compression::NONE:
+      ok = out.reserve(size);
+      if (ok) {
+        memcpy(out.data, data, size);
+        out.size = size;
+      }
+      break;
+  }
+  if (!ok) {
+    printf("segment %d: decompressing failed\n", num);
+    return;
+  }
+
+  if (log_packed_magic((const uint8_t *)out.data, out.size)) {
+    std::vector<uint8_t> flat;
+    if (!log_unpack((const uint8_t *)out.data, out.size, flat)) {
+      printf("segment %d: unpacking stopped at a partial event\n", num);
+    }
+    out.size = 0;
+    if (!out.reserve(flat.size())) return;
+    memcpy(out.data, flat.data(), flat.size());
+    out.size = flat.size();
+  }
+
+  num_words = out.size / sizeof(capnp::word);
+  words = (capnp::word *)out.release();
+  index();
+}
+
+std::unique_ptr<LogSegment> LogSegment::load(int num, const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+
+  struct stat st;
+  void *mem = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mem == MAP_FAILED) return nullptr;
+
+  if (detect((const char *)mem, st.st_size) != Compression::NONE) {
+    madvise(mem, st.st_size, MADV_SEQUENTIAL);
+    std::unique_ptr<LogSegment> seg(new LogSegment(num, (const char *)mem, st.st_size));
+    munmap(mem, st.st_size);
+    return seg;
+  }
+
+  // published straight from the mapping
+  std::unique_ptr<LogSegment> seg(new LogSegment(num));
+  seg->words = (capnp::word *)mem;
+  seg->num_words = st.st_size / sizeof(capnp::word);
+  seg->mapped_size = st.st_size;
+  seg->index();
+  return seg;
+}
+
+LogSegment::~LogSegment() {
+  if (mapped_size) {
+    munmap(words, mapped_size);
+  } else {
+    free(words);
+  }
+}
+
+void LogSegment::index() {
+  kj::ArrayPtr<const capnp::word> amsg = kj::arrayPtr((const capnp::word *)words, num_words);
+  events.reserve(num_words / 32);
+
+  while (amsg.size() > 0) {
+    try {
+      // on the stack, it's only read for where things are
+      capnp::FlatArrayMessageReader reader(amsg);
+      const capnp::word *end = reader.getEnd();
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+
+      LogEvent e = {};
+      e.mono_time = event.getLogMonoTime();
+      e.offset = amsg.begin() - words;
+      e.size = end - amsg.begin();
+      e.which = event.which();
+
+      // logMonoTime is the first field of the root struct's data
+      capnp::Data::Reader data = capnp::AnyStruct::Reader(event).getDataSection();
+      if (data.size() >= sizeof(uint64_t)) {
+        size_t mono_offset = (const capnp::word *)data.begin() - amsg.begin();
+        if (mono_offset < UINT16_MAX) e.mono_offset = mono_offset;
+      }
+      events.push_back(e);
+
+      amsg = kj::arrayPtr(end, amsg.end());
+    } catch (const kj::Exception &e) {
+      // the rest is a partial message
+      break;
+    }
+  }
+
+  std::stable_sort(events.begin(), events.end(), [](const LogEvent &a, const LogEvent &b) {
+    return a.mono_time < b.mono_time;
+  });
+  events.shrink_to_fit();
+  printf("segment %d: %zu events\n", num, events.size());
+}
@@ -0,0 +1,59 @@
+#ifndef LOGSEGMENT_HPP
+#define LOGSEGMENT_HPP
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// independent of QT and messaging, reads rlogs for the replay and the converters
+
+// segments are this long, for finding the one a time is in before it's loaded
+#define LOG_SEGMENT_NS (60 * 1000000000ULL)
+
+// Where an event is in its segment's buffer, 24 bytes so a segment's index is a few MB
+struct LogEvent {
+  uint64_t mono_time;
+  // in words, of the message and of its logMonoTime from the message's start, 0 if it has none
+  uint32_t offset;
+  uint32_t size;
+  uint16_t mono_offset;
+  cereal::Event::Which which;
+};
+
+// One segment's log decompressed into one buffer, with its events sorted by time
+class LogSegment {
+public:
+  // An rlog's bytes, bz2, zstd or lz4 compressed or not
+  LogSegment(int num, const char *data, size_t size);
+  // An rlog file, mapped if it isn't compressed. nullptr if it can't be read
+  static std::unique_ptr<LogSegment> load(int num, const std::string &path);
+  ~LogSegment();
+
+  kj::ArrayPtr<const capnp::word> message(const LogEvent &e) const {
+    return kj::arrayPtr(words + e.offset, e.size);
+  }
+  uint64_t startTime() const { return events.empty() ? 0 : events.front().mono_time; }
+  uint64_t endTime() const { return events.empty() ? 0 : events.back().mono_time; }
+  // what it holds in memory
+  size_t bytes() const { return num_words * sizeof(capnp::word) + events.capacity() * sizeof(LogEvent); }
+
+  const int num;
+  std::vector<LogEvent> events;
+
+private:
+  LogSegment(int num) : num(num) {}
+  void index();
+
+  capnp::word *words = nullptr;
+  size_t num_words = 0;
+  // the file's mapping, else words is malloc'd
+  size_t mapped_size = 0;
+};
+
+#endif
@@ -1,20 +1,102 @@
 # distutils: language = c++
 # cython: language_level=3
 
+from libc.stdint cimport uint8_t
+from libcpp.vector cimport vector
+
+import numpy as np
+cimport numpy as cnp
+
+cnp.import_array()
+
+HEVC_SLICE_I = 2
+FRAME_CACHE_BUDGET = 256*1024*1024
+
 cdef extern from "FrameReader.hpp":
+  cdef enum Format "FrameReader::Format":
+    BGR "FrameReader::BGR"
+    RGB "FrameReader::RGB"
+    I420 "FrameReader::I420"
+    NV12 "FrameReader::NV12"
+
   cdef cppclass CFrameReader "FrameReader":
-    CFrameReader(const char *)
-    char *get(int)
+    CFrameReader(const char *, Format, size_t, int, const vector[int] &)
+    uint8_t *get(int) nogil
+    int getBatch(int, int, uint8_t *) nogil
+    void waitForReady() nogil
+    int getFrameSize()
+    int getWidth()
+    int getHeight()
+    int getFrameCount()
+    void release(int)
+
+PIX_FMTS = {
+  "bgr24": BGR,
+  "rgb24": RGB,
+  "yuv420p": I420,
+  "nv12": NV12,
+}
 
 cdef class FrameReader():
   cdef CFrameReader *fr
+  cdef readonly str pix_fmt
+
+  # index is the vidindex of a raw hevc stream, its I slices are where the GOPs start. With threads
+  # the GOPs ahead of the one read are decoded at once, one a thread
+  def __cinit__(self, fn, pix_fmt="bgr24", threads=1, index=None, cache_budget=FRAME_CACHE_BUDGET):
+    if pix_fmt not in PIX_FMTS:
+      raise ValueError("pix_fmt %s isn't one of %s" % (pix_fmt, ", ".join(PIX_FMTS)))
+    self.pix_fmt = pix_fmt
 
-  def __cinit__(self, fn):
-    self.fr = new CFrameReader(fn)
+    cdef vector[int] keyframes
+    if index is not None:
+      # without the sentinel row at the end
+      for i in np.nonzero(np.asarray(index)[:-1, 0] == HEVC_SLICE_I)[0]:
+        keyframes.push_back(i)
+
+    self.fr = new CFrameReader(fn.encode(), PIX_FMTS[pix_fmt], cache_budget, threads, keyframes)
+    with nogil:
+      self.fr.waitForReady()
 
   def __dealloc__(self):
     del self.fr
 
-  def get(self, idx):
-    self.fr.get(idx)
+  @property
+  def frame_count(self):
+    return self.fr.getFrameCount()
+
+  @property
+  def w(self):
+    return self.fr.getWidth()
+
+  @property
+  def h(self):
+    return self.fr.getHeight()
+
+  def _frames(self, flat):
+    # like tools/lib/framereader.py returns them
+    if self.pix_fmt in ("bgr24", "rgb24"):
+      return flat.reshape(-1, self.h, self.w, 3)
+    return flat.reshape(-1, self.h*self.w*3//2)
+
+  def get(self, int idx):
+    cdef uint8_t *frame
+    with nogil:
+      frame = self.fr.get(idx)
+    if frame == NULL:
+      return None
+    return self._frames(np.asarray(<uint8_t[:self.fr.getFrameSize()]>frame).copy())[0]
+
+  # (n, h, w, 3) or (n, h*w*3/2) frames from first on, fewer than count past the end
+  def get_batch(self, int first, int count):
+    count = max(0, min(count, self.frame_count - first))
+    cdef cnp.ndarray[cnp.uint8_t, ndim=2, mode="c"] out = np.empty((max(count, 1), self.fr.getFrameSize()), dtype=np.uint8)
+    cdef int n = 0
+    if count > 0:
+      with nogil:
+        n = self.fr.getBatch(first, count, <uint8_t *>out.data)
+    return self._frames(out[:n])
 
+  # frees the GOPs before idx's, to read a segment front to back in bounded memory
+  def release(self, idx):
+    self.fr.release(idx)
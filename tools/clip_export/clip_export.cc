@@ -0,0 +1,276 @@
+// Cuts a clip out of raw hevc segment videos into an mp4, without decoding them
+//   ./clip_export [-s start] [-t duration] out.mp4 fcamera.hevc [fcamera.hevc ...]
+// The videos are joined in the order they're given, the segments of one route or of several, and
+// start is in seconds from the beginning of the first. The clip starts at the keyframe at or
+// before start: every segment video starts with one, and with loggerd's index next to it, <video>.idx,
+// so can any of its GOPs. The encoders don't make B frames, so it can end on any frame
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+
+#include "selfdrive/loggerd/video_index.h"
+
+// for the videos without an index, which are coded without their timestamps
+const int64_t FRAME_US = 50000;
+const AVRational US_TIME_BASE = {1, 1000000};
+
+struct Frame {
+  uint64_t offset;
+  uint32_t size;
+  bool keyframe;
+  int64_t pts;  // us
+};
+
+struct Video {
+  std::string path;
+  std::vector<Frame> frames;
+  // before the first frame, the codec config on the EON
+  std::string prefix;
+  AVCodecParameters *par = NULL;
+};
+
+static bool read_file(const std::string &path, std::string &out) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == NULL) return false;
+  char buf[1 << 16];
+  size_t n;
+  out.clear();
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) out.append(buf, n);
+  bool ok = ferror(f) == 0;
+  fclose(f);
+  return ok;
+}
+
+// The frames from loggerd's index, false if the video has none or it doesn't match
+static bool index_frames(Video &v, uint64_t video_size) {
+  std::string idx;
+  if (!read_file(v.path + ".idx", idx) || idx.size() < sizeof(VideoIndexHeader)) return false;
+  const VideoIndexHeader *header = (const VideoIndexHeader *)idx.data();
+  if (header->magic != VIDEO_INDEX_MAGIC || header->version != VIDEO_INDEX_VERSION) return false;
+
+  const VideoIndexEntry *entries = (const VideoIndexEntry *)(idx.data() + sizeof(VideoIndexHeader));
+  const size_t count = (idx.size() - sizeof(VideoIndexHeader)) / sizeof(VideoIndexEntry);
+  for (size_t i = 0; i < count; i++) {
+    const VideoIndexEntry &e = entries[i];
+    // the frames past the end of a video that was cut short
+    if (e.offset + e.size > video_size) break;
+    v.frames.push_back({e.offset, e.size, (e.flags & VIDEO_INDEX_KEYFRAME) != 0, e.pts});
+  }
+  return !v.frames.empty();
+}
+
+static bool open_video(Video &v) {
+  AVFormatContext *ic = NULL;
+  if (avformat_open_input(&ic, v.path.c_str(), av_find_input_format("hevc"), NULL) != 0) {
+    fprintf(stderr, "can't open %s\n", v.path.c_str());
+    return false;
+  }
+  // the size from the sps
+  if (avformat_find_stream_info(ic, NULL) < 0 || ic->nb_streams != 1) {
+    fprintf(stderr, "%s isn't an hevc video\n", v.path.c_str());
+    avformat_close_input(&ic);
+    return false;
+  }
+  v.par = avcodec_parameters_alloc();
+  avcodec_parameters_copy(v.par, ic->streams[0]->codecpar);
+
+  const int64_t video_size = avio_size(ic->pb);
+  if (!index_frames(v, video_size)) {
+    // the packets, only the first frame is known to be a keyframe
+    AVPacket pkt;
+    while (av_read_frame(ic, &pkt) >= 0) {
+      v.frames.push_back({(uint64_t)pkt.pos, (uint32_t)pkt.size, v.frames.empty(), (int64_t)v.frames.size() * FRAME_US});
+      av_packet_unref(&pkt);
+    }
+  }
+  avformat_close_input(&ic);
+  if (v.frames.empty()) {
+    fprintf(stderr, "%s has no frames\n", v.path.c_str());
+    return false;
+  }
+
+  if (v.frames[0].offset > 0) {
+    FILE *f = fopen(v.path.c_str(), "rb");
+    v.prefix.resize(v.frames[0].offset);
+    bool ok = f != NULL && fread(&v.prefix[0], 1, v.prefix.size(), f) == v.prefix.size();
+    if (f != NULL) fclose(f);
+    if (!ok) return false;
+  }
+  return true;
+}
+
+// The VPS, SPS and PPS of an annex b stream, with their start codes
+static std::string parameter_sets(const std::string &data) {
+  std::string ret;
+  size_t pos = data.find(std::string("\0\0\1", 3));
+  while (pos != std::string::npos) {
+    const size_t start = pos + 3;
+    size_t next = data.find(std::string("\0\0\1", 3), start);
+    size_t end = next == std::string::npos ? data.size() : next;
+    // a 4 byte start code's leading zero
+    if (next != std::string::npos && end > start && data[end - 1] == 0) end--;
+    if (start < data.size()) {
+      const int nal_type = (data[start] >> 1) & 0x3f;
+      if (nal_type >= 32 && nal_type <= 34) {
+        ret += std::string("\0\0\0\1", 4) + data.substr(start, end - start);
+      }
+    }
+    pos = next;
+  }
+  return ret;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-s start] [-t duration] out.mp4 video.hevc [video.hevc ...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  double start = 0., duration = -1.;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+    if (opt == 's') {
+      start = atof(optarg);
+    } else if (opt == 't') {
+      duration = atof(optarg);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *out_path = argv[optind];
+
+  std::vector<Video> videos(argc - optind - 1);
+  for (size_t i = 0; i < videos.size(); i++) {
+    videos[i].path = argv[optind + 1 + i];
+    if (!open_video(videos[i])) return 1;
+    if (videos[i].par->width != videos[0].par->width || videos[i].par->height != videos[0].par->height) {
+      fprintf(stderr, "%s isn't the size of %s, they can't be in one clip\n", videos[i].path.c_str(), videos[0].path.c_str());
+      return 1;
+    }
+  }
+
+  // the clip's frames, on one timeline: each video goes on where the last left off, a frame later
+  struct ClipFrame {
+    const Video *video;
+    const Frame *frame;
+    int64_t t;
+  };
+  std::vector<ClipFrame> frames;
+  int64_t video_start = 0;
+  for (const Video &v : videos) {
+    for (const Frame &f : v.frames) {
+      frames.push_back({&v, &f, video_start + f.pts - v.frames[0].pts});
+    }
+    const int64_t last = frames.back().t;
+    video_start = last + (v.frames.size() > 1 ? (last - frames[frames.size() - v.frames.size()].t) / (int64_t)(v.frames.size() - 1) : FRAME_US);
+  }
+
+  const int64_t start_us = start * 1e6;
+  const int64_t end_us = duration < 0 ? INT64_MAX : start_us + (int64_t)(duration * 1e6);
+  size_t first = 0;
+  for (size_t i = 0; i < frames.size() && frames[i].t <= start_us; i++) {
+    if (frames[i].frame->keyframe) first = i;
+  }
+  size_t last = first;
+  while (last + 1 < frames.size() && frames[last + 1].t < end_us) last++;
+
+  // the clip shares a sample description, which has the first video's parameter sets
+  const Video &first_video = *frames[first].video;
+  std::string first_frame(frames[first].frame->size, '\0');
+  {
+    FILE *f = fopen(first_video.path.c_str(), "rb");
+    bool ok = f != NULL && fseek(f, frames[first].frame->offset, SEEK_SET) == 0 &&
+              fread(&first_frame[0], 1, first_frame.size(), f) == first_frame.size();
+    if (f != NULL) fclose(f);
+    if (!ok) {
+      fprintf(stderr, "can't read %s\n", first_video.path.c_str());
+      return 1;
+    }
+  }
+  const std::string extradata = parameter_sets(first_video.prefix + first_frame);
+  if (extradata.empty()) {
+    fprintf(stderr, "no parameter sets in %s\n", first_video.path.c_str());
+    return 1;
+  }
+
+  AVFormatContext *oc = NULL;
+  if (avformat_alloc_output_context2(&oc, NULL, "mp4", out_path) < 0) {
+    fprintf(stderr, "can't make %s\n", out_path);
+    return 1;
+  }
+  AVStream *st = avformat_new_stream(oc, NULL);
+  avcodec_parameters_copy(st->codecpar, first_video.par);
+  st->codecpar->codec_tag = 0;
+  av_freep(&st->codecpar->extradata);
+  st->codecpar->extradata = (uint8_t *)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+  memcpy(st->codecpar->extradata, extradata.data(), extradata.size());
+  st->codecpar->extradata_size = extradata.size();
+  st->time_base = US_TIME_BASE;
+
+  if (avio_open(&oc->pb, out_path, AVIO_FLAG_WRITE) < 0 || avformat_write_header(oc, NULL) < 0) {
+    fprintf(stderr, "can't write %s\n", out_path);
+    return 1;
+  }
+
+  FILE *in = NULL;
+  const Video *in_video = NULL;
+  std::string buf;
+  bool ok = true;
+  for (size_t i = first; i <= last && ok; i++) {
+    const ClipFrame &cf = frames[i];
+    if (cf.video != in_video) {
+      if (in != NULL) fclose(in);
+      in = fopen(cf.video->path.c_str(), "rb");
+      in_video = cf.video;
+      if (in == NULL) {
+        fprintf(stderr, "can't open %s\n", cf.video->path.c_str());
+        ok = false;
+        break;
+      }
+    }
+    buf.resize(cf.frame->size);
+    if (fseek(in, cf.frame->offset, SEEK_SET) != 0 || fread(&buf[0], 1, buf.size(), in) != buf.size()) {
+      fprintf(stderr, "can't read frame %zu of %s\n", (size_t)(cf.frame - cf.video->frames.data()), cf.video->path.c_str());
+      ok = false;
+      break;
+    }
+
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = (uint8_t *)buf.data();
+    pkt.size = buf.size();
+    pkt.stream_index = st->index;
+    pkt.flags = cf.frame->keyframe ? AV_PKT_FLAG_KEY : 0;
+    pkt.pts = pkt.dts = cf.t - frames[first].t;
+    pkt.duration = i < last ? frames[i + 1].t - cf.t : (i > first ? cf.t - frames[i - 1].t : FRAME_US);
+    av_packet_rescale_ts(&pkt, US_TIME_BASE, st->time_base);
+    if (av_write_frame(oc, &pkt) < 0) {
+      fprintf(stderr, "can't write %s\n", out_path);
+      ok = false;
+    }
+  }
+  if (in != NULL) fclose(in);
+
+  ok = av_write_trailer(oc) == 0 && ok;
+  avio_closep(&oc->pb);
+  avformat_free_context(oc);
+  for (Video &v : videos) avcodec_parameters_free(&v.par);
+  if (!ok) return 1;
+
+  printf("%s: %zu frames, %.2f s from %.2f s\n", out_path, last - first + 1,
+         (frames[last].t - frames[first].t + FRAME_US) / 1e6, frames[first].t / 1e6);
+  return 0;
+}
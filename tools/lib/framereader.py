@@ -17,6 +17,7 @@ import _io
 from tools.lib.cache import cache_path_for_file_path
 from tools.lib.exceptions import DataUnreadableError
 from tools.lib.file_helpers import atomic_write_in_dir
+from tools.lib.vidindex import encoder_index, vidindex as _vidindex
 
 try:
   from xx.chffr.lib.filereader import FileReader
@@ -81,23 +82,13 @@ def ffprobe(fn, fmt=None):
 
 
 def vidindex(fn, typ):
-  vidindex_dir = os.path.join(os.path.dirname(os.path.realpath(__file__)), "vidindex")
-  vidindex = os.path.join(vidindex_dir, "vidindex")
-
-  subprocess.check_call(["make"], cwd=vidindex_dir, stdout=open("/dev/null", "w"))
-
-  with tempfile.NamedTemporaryFile() as prefix_f, \
-       tempfile.NamedTemporaryFile() as index_f:
-    try:
-      subprocess.check_call([vidindex, typ, fn, prefix_f.name, index_f.name])
-    except subprocess.CalledProcessError:
-      raise DataUnreadableError("vidindex failed on file %s" % fn)
-    with open(index_f.name, "rb") as f:
-      index = f.read()
-    with open(prefix_f.name, "rb") as f:
-      prefix = f.read()
-
-  index = np.frombuffer(index, np.uint32).reshape(-1, 2)
+  # loggerd's videos come with their index
+  ret = encoder_index(fn) if typ == "hevc" else None
+  if ret is None:
+    ret = _vidindex(fn, typ)
+  if ret is None:
+    raise DataUnreadableError("vidindex failed on file %s" % fn)
+  index, prefix = ret
 
   assert index[-1, 0] == 0xFFFFFFFF
   assert index[-1, 1] == os.path.getsize(fn)
@@ -279,6 +270,40 @@ def FrameReader(fn, cache_prefix=None, readahead=False, readbehind=False, index_
     raise NotImplementedError(frame_type)
 
 
+class NativeFrameReader(BaseFrameReader):
+  # Decodes in process with tools/clib's cframereader instead of an ffmpeg per GOP, the GOPs ahead
+  # of a read on threads at once. A reader per pix_fmt, seeking by the vidindex of an hevc stream
+  def __init__(self, fn, threads=4, cache_prefix=None, index_data=None):
+    self.fn = fn
+    self.threads = threads
+    self.frame_type = fingerprint_video(fn)
+    self.index = None
+    if self.frame_type == FrameType.h265_stream:
+      if not index_data:
+        index_data = get_video_index(fn, self.frame_type, cache_prefix)
+      self.index = index_data['index'] if index_data else None
+
+    self.readers = {}
+    fr = self.reader("yuv420p")
+    if fr.frame_count == 0:
+      raise DataUnreadableError("can't decode %s" % fn)
+    self.frame_count, self.w, self.h = fr.frame_count, fr.w, fr.h
+
+  def reader(self, pix_fmt):
+    from tools.clib.cframereader import FrameReader as CFrameReader
+    if pix_fmt not in self.readers:
+      self.readers[pix_fmt] = CFrameReader(self.fn, pix_fmt, self.threads, self.index)
+    return self.readers[pix_fmt]
+
+  def close(self):
+    self.readers = {}
+
+  def get(self, num, count=1, pix_fmt="yuv420p"):
+    assert self.frame_count is not None
+    assert num+count <= self.frame_count
+    return self.reader(pix_fmt).get_batch(num, count)
+
+
 class RawData:
   def __init__(self, f):
     self.f = _io.FileIO(f, 'rb')
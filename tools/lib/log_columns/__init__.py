@@ -0,0 +1,74 @@
+"""Columnar exports of rlogs and qlogs, written by the log_columns binary in this directory
+(built by scons). A service's table is a directory of .npy files, one per scalar field:
+
+  python -m tools.lib.log_columns <out_dir> <log>... [-s service,...] [-j threads]
+
+  export(out_dir, route.log_paths())
+  cols = load(out_dir, "controlsState")  # {"logMonoTime": array, "vEgo": array, ...}
+"""
+import glob
+import os
+import subprocess
+import sys
+
+import numpy as np
+
+LOG_COLUMNS = os.path.join(os.path.dirname(os.path.realpath(__file__)), "log_columns")
+
+
+def export(out_dir, log_paths, services=None, threads=0):
+  """Reads the logs on threads, their rows go in the order they're given"""
+  if not os.path.exists(LOG_COLUMNS):
+    raise FileNotFoundError(f"{LOG_COLUMNS} isn't built, run scons")
+  cmd = [LOG_COLUMNS]
+  if threads:
+    cmd += ["-j", str(threads)]
+  if services:
+    cmd += ["-s", ",".join(services)]
+  subprocess.check_call(cmd + [out_dir] + [p for p in log_paths if p is not None], stdout=subprocess.DEVNULL)
+
+
+def services(out_dir):
+  return sorted(os.path.basename(os.path.dirname(p)) for p in glob.glob(os.path.join(out_dir, "*", "logMonoTime.npy")))
+
+
+def load(out_dir, service, mmap=True):
+  """The service's columns by field name, mapped rather than read unless mmap is False"""
+  cols = {}
+  for fn in sorted(glob.glob(os.path.join(out_dir, service, "*.npy"))):
+    cols[os.path.basename(fn)[:-len(".npy")]] = np.load(fn, mmap_mode="r" if mmap else None)
+  return cols
+
+
+def to_pandas(out_dir, service):
+  import pandas as pd
+  return pd.DataFrame(load(out_dir, service, mmap=False))
+
+
+def to_parquet(out_dir, parquet_dir):
+  """A parquet file per service, needs pyarrow"""
+  import pyarrow as pa
+  import pyarrow.parquet as pq
+  os.makedirs(parquet_dir, exist_ok=True)
+  for service in services(out_dir):
+    table = pa.table(load(out_dir, service, mmap=False))
+    pq.write_table(table, os.path.join(parquet_dir, f"{service}.parquet"))
+
+
+def main(argv):
+  import argparse
+  parser = argparse.ArgumentParser(description="Export logs as a column per field of each service")
+  parser.add_argument("out_dir")
+  parser.add_argument("logs", nargs="+")
+  parser.add_argument("-s", "--services", help="comma separated, all of them if it's left out")
+  parser.add_argument("-j", "--threads", type=int, default=0)
+  parser.add_argument("--parquet", help="also write a parquet file per service to this directory")
+  args = parser.parse_args(argv)
+
+  export(args.out_dir, args.logs, args.services.split(",") if args.services else None, args.threads)
+  if args.parquet:
+    to_parquet(args.out_dir, args.parquet)
+
+
+if __name__ == "__main__":
+  main(sys.argv[1:])
@@ -0,0 +1,5 @@
+import sys
+
+from tools.lib.log_columns import main
+
+main(sys.argv[1:])
@@ -0,0 +1,267 @@
+// Flattens rlogs and qlogs into a column per scalar field of each service, as .npy files
+//   log_columns [-j threads] [-s service,...] <out_dir> <log>...
+// The logs are read on threads and their rows appended in the order they're given, to
+// out_dir/<service>/<field.subfield>.npy, with logMonoTime as a column of each
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <capnp/dynamic.h>
+#include <capnp/schema.h>
+
+#include "LogSegment.hpp"
+
+// nested structs past this are left out, the schema has a few that refer to themselves
+#define MAX_DEPTH 4
+
+struct Column {
+  // dotted, from the service's struct
+  std::string name;
+  std::vector<capnp::StructSchema::Field> path;
+  capnp::schema::Type::Which type;
+  size_t size;
+  const char *descr;
+};
+
+struct Service {
+  std::string name;
+  capnp::StructSchema::Field field;
+  std::vector<Column> columns;
+};
+
+// a log's rows of one service, a buffer per column
+struct Table {
+  size_t rows = 0;
+  std::vector<std::vector<uint8_t>> data;
+};
+
+static bool scalar_type(capnp::schema::Type::Which type, size_t *size, const char **descr) {
+  switch (type) {
+    case capnp::schema::Type::BOOL: *size = 1; *descr = "|b1"; return true;
+    case capnp::schema::Type::INT8: *size = 1; *descr = "|i1"; return true;
+    case capnp::schema::Type::INT16: *size = 2; *descr = "<i2"; return true;
+    case capnp::schema::Type::INT32: *size = 4; *descr = "<i4"; return true;
+    case capnp::schema::Type::INT64: *size = 8; *descr = "<i8"; return true;
+    case capnp::schema::Type::UINT8: *size = 1; *descr = "|u1"; return true;
+    case capnp::schema::Type::UINT16: *size = 2; *descr = "<u2"; return true;
+    case capnp::schema::Type::UINT32: *size = 4; *descr = "<u4"; return true;
+    case capnp::schema::Type::UINT64: *size = 8; *descr = "<u8"; return true;
+    case capnp::schema::Type::FLOAT32: *size = 4; *descr = "<f4"; return true;
+    case capnp::schema::Type::FLOAT64: *size = 8; *descr = "<f8"; return true;
+    // the raw value
+    case capnp::schema::Type::ENUM: *size = 2; *descr = "<u2"; return true;
+    default: return false;
+  }
+}
+
+static void add_columns(capnp::StructSchema schema, const std::string &prefix,
+                        std::vector<capnp::StructSchema::Field> &path, std::vector<Column> &columns) {
+  for (auto field : schema.getFields()) {
+    std::string name = prefix + field.getProto().getName().cStr();
+    auto type = field.getType();
+    path.push_back(field);
+
+    size_t size;
+    const char *descr;
+    if (type.isStruct()) {
+      if (path.size() < MAX_DEPTH) add_columns(type.asStruct(), name + ".", path, columns);
+    } else if (scalar_type(type.which(), &size, &descr)) {
+      columns.push_back({name, path, type.which(), size, descr});
+    }
+    path.pop_back();
+  }
+}
+
+static std::vector<Service> get_services(const std::vector<std::string> &only) {
+  std::vector<Service> services;
+  for (auto field : capnp::Schema::from<cereal::Event>().getUnionFields()) {
+    std::string name = field.getProto().getName().cStr();
+    if (!field.getType().isStruct()) continue;
+    if (!only.empty() && std::find(only.begin(), only.end(), name) == only.end()) continue;
+
+    Service s = {name, field, {}};
+    std::vector<capnp::StructSchema::Field> path;
+    add_columns(field.getType().asStruct(), "", path, s.columns);
+    services.push_back(std::move(s));
+  }
+  return services;
+}
+
+// a union's other fields aren't there to be read
+static bool is_set(capnp::DynamicStruct::Reader s, capnp::StructSchema::Field field) {
+  if (field.getProto().getDiscriminantValue() == capnp::schema::Field::NO_DISCRIMINANT) return true;
+  KJ_IF_MAYBE(which, s.which()) {
+    return *which == field;
+  }
+  return false;
+}
+
+static void append_value(const Column &col, capnp::DynamicValue::Reader v, uint8_t *dst) {
+  switch (col.type) {
+    case capnp::schema::Type::BOOL: {
+      uint8_t b = v.as<bool>();
+      memcpy(dst, &b, 1);
+      break;
+    }
+    case capnp::schema::Type::INT8: { int8_t x = v.as<int8_t>(); memcpy(dst, &x, 1); break; }
+    case capnp::schema::Type::INT16: { int16_t x = v.as<int16_t>(); memcpy(dst, &x, 2); break; }
+    case capnp::schema::Type::INT32: { int32_t x = v.as<int32_t>(); memcpy(dst, &x, 4); break; }
+    case capnp::schema::Type::INT64: { int64_t x = v.as<int64_t>(); memcpy(dst, &x, 8); break; }
+    case capnp::schema::Type::UINT8: { uint8_t x = v.as<uint8_t>(); memcpy(dst, &x, 1); break; }
+    case capnp::schema::Type::UINT16: { uint16_t x = v.as<uint16_t>(); memcpy(dst, &x, 2); break; }
+    case capnp::schema::Type::UINT32: { uint32_t x = v.as<uint32_t>(); memcpy(dst, &x, 4); break; }
+    case capnp::schema::Type::UINT64: { uint64_t x = v.as<uint64_t>(); memcpy(dst, &x, 8); break; }
+    case capnp::schema::Type::FLOAT32: { float x = v.as<float>(); memcpy(dst, &x, 4); break; }
+    case capnp::schema::Type::FLOAT64: { double x = v.as<double>(); memcpy(dst, &x, 8); break; }
+    case capnp::schema::Type::ENUM: { uint16_t x = v.as<capnp::DynamicEnum>().getRaw(); memcpy(dst, &x, 2); break; }
+    default: break;
+  }
+}
+
+static void append_row(const Service &s, Table &t, uint64_t mono_time, capnp::DynamicStruct::Reader event) {
+  // logMonoTime first
+  t.data[0].resize(t.data[0].size() + sizeof(mono_time));
+  memcpy(t.data[0].data() + t.data[0].size() - sizeof(mono_time), &mono_time, sizeof(mono_time));
+
+  auto root = event.get(s.field).as<capnp::DynamicStruct>();
+  for (size_t i = 0; i < s.columns.size(); i++) {
+    const Column &col = s.columns[i];
+    std::vector<uint8_t> &data = t.data[i + 1];
+    data.resize(data.size() + col.size, 0);
+    uint8_t *dst = data.data() + data.size() - col.size;
+
+    // zero for what isn't set in a union
+    capnp::DynamicStruct::Reader st = root;
+    bool set = true;
+    for (size_t j = 0; set && j + 1 < col.path.size(); j++) {
+      set = is_set(st, col.path[j]);
+      if (set) st = st.get(col.path[j]).as<capnp::DynamicStruct>();
+    }
+    if (set && is_set(st, col.path.back())) append_value(col, st.get(col.path.back()), dst);
+  }
+  t.rows++;
+}
+
+static std::vector<Table> read_log(const std::vector<Service> &services, const std::string &path, int num) {
+  std::vector<Table> tables(services.size());
+  for (size_t i = 0; i < services.size(); i++) tables[i].data.resize(services[i].columns.size() + 1);
+
+  auto seg = LogSegment::load(num, path);
+  if (!seg) {
+    fprintf(stderr, "can't read %s\n", path.c_str());
+    return tables;
+  }
+
+  // by Event::Which
+  std::vector<int> service_idx;
+  for (size_t i = 0; i < services.size(); i++) {
+    uint16_t which = services[i].field.getProto().getDiscriminantValue();
+    if (service_idx.size() <= which) service_idx.resize(which + 1, -1);
+    service_idx[which] = i;
+  }
+
+  for (auto &e : seg->events) {
+    if ((size_t)e.which >= service_idx.size() || service_idx[(size_t)e.which] < 0) continue;
+    const int i = service_idx[(size_t)e.which];
+    try {
+      capnp::FlatArrayMessageReader reader(seg->message(e));
+      capnp::DynamicStruct::Reader event = reader.getRoot<cereal::Event>();
+      append_row(services[i], tables[i], e.mono_time, event);
+    } catch (const kj::Exception &exc) {
+      fprintf(stderr, "%s: skipping a %s, %s\n", path.c_str(), services[i].name.c_str(), exc.getDescription().cStr());
+    }
+  }
+  return tables;
+}
+
+// version 1.0 of the format, the header's padded so the data is 64 byte aligned
+static bool write_npy(const std::string &path, const char *descr, size_t rows, const std::vector<const std::vector<uint8_t> *> &parts) {
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f) return false;
+
+  char dict[256];
+  int len = snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%zu,), }", descr, rows);
+  std::string header(dict, len);
+  const size_t total = 10 + header.size() + 1;
+  header.append((64 - total % 64) % 64, ' ');
+  header += '\n';
+
+  uint16_t header_len = header.size();
+  bool ok = fwrite("\x93NUMPY\x01\x00", 1, 8, f) == 8 && fwrite(&header_len, 2, 1, f) == 1 &&
+            fwrite(header.data(), 1, header.size(), f) == header.size();
+  for (auto part : parts) {
+    if (ok && !part->empty()) ok = fwrite(part->data(), 1, part->size(), f) == part->size();
+  }
+  return fclose(f) == 0 && ok;
+}
+
+int main(int argc, char **argv) {
+  int threads = std::thread::hardware_concurrency();
+  std::vector<std::string> only;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+    if (opt == 'j') {
+      threads = atoi(optarg);
+    } else if (opt == 's') {
+      for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) only.push_back(tok);
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "usage: %s [-j threads] [-s service,...] <out_dir> <log>...\n", argv[0]);
+    return 1;
+  }
+  const std::string out_dir = argv[optind];
+  std::vector<std::string> logs(argv + optind + 1, argv + argc);
+
+  const std::vector<Service> services = get_services(only);
+  if (services.empty()) {
+    fprintf(stderr, "no services to export\n");
+    return 1;
+  }
+
+  // a log a thread at a time, they're put back in order after
+  std::vector<std::vector<Table>> tables(logs.size());
+  std::atomic<size_t> next = 0;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < std::max(1, std::min<int>(threads, logs.size())); t++) {
+    workers.emplace_back([&]() {
+      for (size_t i; (i = next++) < logs.size();) tables[i] = read_log(services, logs[i], i);
+    });
+  }
+  for (auto &w : workers) w.join();
+
+  mkdir(out_dir.c_str(), 0775);
+  int failed = 0;
+  for (size_t s = 0; s < services.size(); s++) {
+    size_t rows = 0;
+    for (auto &log_tables : tables) rows += log_tables[s].rows;
+    if (rows == 0) continue;
+
+    const std::string dir = out_dir + "/" + services[s].name;
+    mkdir(dir.c_str(), 0775);
+    for (size_t c = 0; c <= services[s].columns.size(); c++) {
+      std::vector<const std::vector<uint8_t> *> parts;
+      for (auto &log_tables : tables) parts.push_back(&log_tables[s].data[c]);
+
+      const std::string name = c == 0 ? "logMonoTime" : services[s].columns[c - 1].name;
+      const char *descr = c == 0 ? "<u8" : services[s].columns[c - 1].descr;
+      if (!write_npy(dir + "/" + name + ".npy", descr, rows, parts)) {
+        fprintf(stderr, "can't write %s/%s.npy\n", dir.c_str(), name.c_str());
+        failed++;
+      }
+    }
+    printf("%s: %zu rows, %zu columns\n", services[s].name.c_str(), rows, services[s].columns.size() + 1);
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""Per segment summaries of a few fields, so a search only decodes the segments that can match.
+
+  segment_index.py build <index.jsonl> <service.field,...> <log>...
+  segment_index.py query <index.jsonl> "controlsState.enabled and controlsState.vEgo > 30" [--verify]
+
+An index is a line of json per log: its path and each field's row count, min, max, and for the
+integer fields a bitmap of the values under 64 it has. Building skips the logs already in it, so
+it can be added to as routes come in. A query prints the logs whose summaries admit every
+condition, --verify decodes those and keeps the ones with rows that match
+"""
+import json
+import operator
+import os
+import re
+import sys
+import tempfile
+from multiprocessing import Pool
+
+import numpy as np
+
+from tools.lib.log_columns import export, load
+
+BITMAP_VALUES = 64
+OPS = {
+  "==": operator.eq,
+  "!=": operator.ne,
+  ">=": operator.ge,
+  "<=": operator.le,
+  ">": operator.gt,
+  "<": operator.lt,
+}
+CONDITION_RE = re.compile(r"^\s*(not\s+)?([A-Za-z0-9_]+)\.([A-Za-z0-9_.]+)\s*(?:(==|!=|>=|<=|>|<)\s*(\S+))?\s*$")
+
+
+def summarize(col):
+  s = {"n": int(len(col))}
+  if len(col) == 0:
+    return s
+  s["min"] = col.min().item()
+  s["max"] = col.max().item()
+  if col.dtype.kind in "biu":
+    vals = np.unique(col[(col >= 0) & (col < BITMAP_VALUES)].astype(np.int64))
+    s["bitmap"] = int(sum(1 << int(v) for v in vals))
+  return s
+
+
+def summarize_log(args):
+  log_path, fields = args
+  services = sorted({f.split(".", 1)[0] for f in fields})
+  with tempfile.TemporaryDirectory() as tmp:
+    export(tmp, [log_path], services=services, threads=1)
+    summary = {}
+    for service in services:
+      cols = load(tmp, service, mmap=False)
+      for f in fields:
+        svc, name = f.split(".", 1)
+        if svc == service and name in cols:
+          summary[f] = summarize(cols[name])
+  return {"path": log_path, "fields": summary}
+
+
+def read_index(index_path):
+  if not os.path.exists(index_path):
+    return []
+  with open(index_path) as f:
+    return [json.loads(l) for l in f if l.strip()]
+
+
+def build(index_path, fields, log_paths, processes=None):
+  done = {e["path"] for e in read_index(index_path)}
+  todo = [(p, fields) for p in log_paths if p not in done]
+  with Pool(processes) as pool, open(index_path, "a") as f:
+    # written as they finish, so an interrupted build picks up where it stopped
+    for entry in pool.imap_unordered(summarize_log, todo):
+      f.write(json.dumps(entry) + "\n")
+      f.flush()
+
+
+def parse_value(v):
+  if v in ("True", "true"):
+    return 1
+  if v in ("False", "false"):
+    return 0
+  return float(v)
+
+
+def parse_query(query):
+  """A list of (negated, field, op, value), anded together"""
+  conditions = []
+  for part in re.split(r"\s+and\s+", query.strip()):
+    m = CONDITION_RE.match(part)
+    if m is None:
+      raise ValueError(f"can't parse condition '{part}'")
+    negated, service, name, op, value = m.groups()
+    if negated and op:
+      raise ValueError(f"'not' only goes before a field alone, in '{part}'")
+    conditions.append((bool(negated), f"{service}.{name}", op, parse_value(value) if op else None))
+  return conditions
+
+
+def may_match(summary, condition):
+  """Whether a field with the summary can have a row that meets the condition"""
+  negated, _, op, value = condition
+  if summary is None or summary.get("n", 0) == 0:
+    return False
+  lo, hi, bitmap = summary["min"], summary["max"], summary.get("bitmap")
+
+  def has(v):
+    if not lo <= v <= hi:
+      return False
+    if bitmap is not None and float(v).is_integer() and 0 <= v < BITMAP_VALUES:
+      return bool(bitmap >> int(v) & 1)
+    return True
+
+  if op is None:
+    # truthy, or with not, zero
+    return has(0) if negated else not (lo == 0 and hi == 0)
+  if op == "==":
+    return has(value)
+  if op == "!=":
+    return not (lo == hi == value)
+  if op in (">", ">="):
+    return OPS[op](hi, value)
+  return OPS[op](lo, value)
+
+
+def candidates(index, conditions):
+  return [e["path"] for e in index if all(may_match(e["fields"].get(c[1]), c) for c in conditions)]
+
+
+def row_mask(cols, conditions):
+  mask = None
+  for negated, field, op, value in conditions:
+    col = cols[field.split(".", 1)[1]]
+    if op is None:
+      m = (col == 0) if negated else (col != 0)
+    else:
+      m = OPS[op](col, value)
+    mask = m if mask is None else mask & m
+  return mask
+
+
+def verify(log_path, conditions):
+  """Whether each service's conditions hold together on one of its rows"""
+  by_service = {}
+  for c in conditions:
+    by_service.setdefault(c[1].split(".", 1)[0], []).append(c)
+  with tempfile.TemporaryDirectory() as tmp:
+    export(tmp, [log_path], services=sorted(by_service), threads=1)
+    for service, conds in by_service.items():
+      cols = load(tmp, service, mmap=False)
+      if not all(c[1].split(".", 1)[1] in cols for c in conds) or not row_mask(cols, conds).any():
+        return False
+  return True
+
+
+def query(index_path, query_str, do_verify=False):
+  conditions = parse_query(query_str)
+  index = read_index(index_path)
+  paths = candidates(index, conditions)
+  print(f"{len(paths)} of {len(index)} segments can match", file=sys.stderr)
+  if do_verify:
+    paths = [p for p in paths if verify(p, conditions)]
+  return paths
+
+
+if __name__ == "__main__":
+  import argparse
+  parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+  sub = parser.add_subparsers(dest="cmd", required=True)
+  b = sub.add_parser("build")
+  b.add_argument("index")
+  b.add_argument("fields", help="comma separated service.field")
+  b.add_argument("logs", nargs="+")
+  b.add_argument("-j", "--processes", type=int, default=None)
+  q = sub.add_parser("query")
+  q.add_argument("index")
+  q.add_argument("query")
+  q.add_argument("--verify", action="store_true", help="decode the candidates and check their rows")
+  args = parser.parse_args()
+
+  if args.cmd == "build":
+    build(args.index, args.fields.split(","), args.logs, args.processes)
+  else:
+    for p in query(args.index, args.query, args.verify):
+      print(p)
@@ -2,11 +2,13 @@
 import os
 import sys
 import bz2
+import struct
 import tempfile
 import subprocess
 import urllib.parse
 import capnp
 import numpy as np
+from collections import namedtuple
 
 from tools.lib.exceptions import DataUnreadableError
 try:
@@ -17,6 +19,80 @@ from cereal import log as capnp_log
 
 OP_PATH = os.path.dirname(os.path.dirname(capnp_log.__file__))
 
+# zstd and lz4 logs end in an index of their blocks, see selfdrive/loggerd/log_index.h
+LOG_INDEX_MAGIC = 0x58444e49
+LOG_INDEX_VERSION = 1
+LOG_INDEX_ENTRY = struct.Struct("<9Q")
+LOG_INDEX_FOOTER = struct.Struct("<IIQ")
+
+# with LOG_PACKED=1 the events are packed, each block starts with this, see selfdrive/loggerd/log_packing.h
+LOG_PACKED_MAGIC = b"\xff\xff\xff\xffPACK"
+
+# services is a bitmask of the Event union discriminants in the block
+LogBlock = namedtuple("LogBlock", ["offset", "size", "raw_size", "mono_time_start", "mono_time_end", "services"])
+
+def service_discriminants():
+  return {f.name: f.discriminantValue for f in capnp_log.Event.schema.node.struct.fields if f.discriminantValue != 0xffff}
+
+def _file_length(f):
+  return f.get_length() if hasattr(f, "get_length") else os.fstat(f.fileno()).st_size
+
+def read_log_index(f):
+  length = _file_length(f)
+  if length < LOG_INDEX_FOOTER.size:
+    return None
+
+  f.seek(length - LOG_INDEX_FOOTER.size)
+  magic, version, num_blocks = LOG_INDEX_FOOTER.unpack(f.read(LOG_INDEX_FOOTER.size))
+  index_size = num_blocks * LOG_INDEX_ENTRY.size
+  if magic != LOG_INDEX_MAGIC or version != LOG_INDEX_VERSION or index_size + LOG_INDEX_FOOTER.size > length:
+    return None
+
+  f.seek(length - LOG_INDEX_FOOTER.size - index_size)
+  dat = f.read(index_size)
+  blocks = []
+  for e in LOG_INDEX_ENTRY.iter_unpack(dat):
+    services = e[5] | (e[6] << 64) | (e[7] << 128) | (e[8] << 192)
+    blocks.append(LogBlock(*e[:5], services))
+  return blocks
+
+def decompress_log(ext, dat):
+  return b"".join(decompress_frames(ext, dat))
+
+def decompress_frames(ext, dat):
+  if ext == ".bz2":
+    return [bz2.decompress(dat)]
+
+  if ext == ".zst":
+    import zstandard
+    new_decompressor = zstandard.ZstdDecompressor().decompressobj
+  elif ext == ".lz4":
+    import lz4.frame
+    new_decompressor = lz4.frame.LZ4FrameDecompressor
+  else:
+    raise Exception(f"unknown extension {ext}")
+
+  # a log without its index, e.g. from a crashed loggerd, is several frames and a truncated one
+  out = []
+  while len(dat):
+    d = new_decompressor()
+    out.append(d.decompress(dat))
+    if len(d.unused_data) == len(dat):
+      break
+    dat = d.unused_data
+  return out
+
+def event_read_multiple_packed(frames):
+  dat = b"".join(f[len(LOG_PACKED_MAGIC):] if f.startswith(LOG_PACKED_MAGIC) else f for f in frames)
+  ents = []
+  try:
+    for e in capnp_log.Event.read_multiple_bytes_packed(dat):
+      ents.append(e)
+  except capnp.lib.capnp.KjException:
+    # the rest is a partial event
+    pass
+  return ents
+
 def index_log(fn):
   index_log_dir = os.path.join(os.path.dirname(os.path.realpath(__file__)), "index_log")
   index_log = os.path.join(index_log_dir, "index_log")
@@ -109,26 +185,71 @@ class MultiLogIterator(object):
 
 
 class LogReader(object):
-  def __init__(self, fn, canonicalize=True, only_union_types=False):
+  # services and the logMonoTime range [start_time, end_time] filter the events. For indexed logs
+  # only the blocks that can have matching events are read and decompressed
+  def __init__(self, fn, canonicalize=True, only_union_types=False, services=None, start_time=None, end_time=None):
     data_version = None
     _, ext = os.path.splitext(urllib.parse.urlparse(fn).path)
     with FileReader(fn) as f:
-      dat = f.read()
+      blocks = read_log_index(f) if ext in (".zst", ".lz4") else None
+      if blocks is None:
+        f.seek(0)
+        frames = [f.read()]
+        if ext != "":
+          # old rlogs weren't compressed
+          frames = decompress_frames(ext, frames[0])
+      else:
+        frames = [d for b in self._read_blocks(f, blocks, services, start_time, end_time) for d in decompress_frames(ext, b)]
+    frames = [d for d in frames if len(d)]
 
-    if ext == "":
-      # old rlogs weren't bz2 compressed
-      ents = event_read_multiple_bytes(dat)
-    elif ext == ".bz2":
-      dat = bz2.decompress(dat)
-      ents = event_read_multiple_bytes(dat)
+    if len(frames) and frames[0].startswith(LOG_PACKED_MAGIC):
+      ents = event_read_multiple_packed(frames)
     else:
-      raise Exception(f"unknown extension {ext}")
+      dat = b"".join(frames)
+      ents = event_read_multiple_bytes(dat) if len(dat) else []
+    if services is not None:
+      ents = [e for e in ents if self._which(e) in services]
+    if start_time is not None or end_time is not None:
+      ents = [e for e in ents if (start_time is None or e.logMonoTime >= start_time) and
+                                 (end_time is None or e.logMonoTime <= end_time)]
 
     self._ts = [x.logMonoTime for x in ents]
     self.data_version = data_version
     self._only_union_types = only_union_types
     self._ents = ents
 
+  @staticmethod
+  def _which(ent):
+    try:
+      return ent.which()
+    except capnp.lib.capnp.KjException:
+      return None
+
+  @staticmethod
+  def _read_blocks(f, blocks, services, start_time, end_time):
+    if services is None and start_time is None and end_time is None:
+      f.seek(0)
+      dat = f.read()
+      return [dat[b.offset:b.offset + b.size] for b in blocks]
+
+    mask = 0
+    if services is not None:
+      discriminants = service_discriminants()
+      for s in services:
+        mask |= 1 << discriminants[s]
+
+    ret = []
+    for b in blocks:
+      if services is not None and not (b.services & mask):
+        continue
+      # blocks of events without a logMonoTime have no time range
+      if b.mono_time_end != 0 and ((start_time is not None and b.mono_time_end < start_time) or
+                                   (end_time is not None and b.mono_time_start > end_time)):
+        continue
+      f.seek(b.offset)
+      ret.append(f.read(b.size))
+    return ret
+
   def __iter__(self):
     for ent in self._ents:
       if self._only_union_types:
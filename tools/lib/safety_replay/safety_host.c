@@ -0,0 +1,118 @@
+#include "safety_host.h"
+
+#include <string.h>
+
+// what the board code gives the safety code on the panda
+typedef struct {
+  uint32_t RIR;
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+} CAN_FIFOMailBox_TypeDef;
+
+typedef struct {
+  uint32_t CNT;
+} TIM_TypeDef;
+
+static TIM_TypeDef timer;
+#define TIM2 (&timer)
+
+#define UNUSED(x) ((void)(x))
+
+#define MIN(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a < _b) ? _a : _b; })
+
+#define MAX(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a > _b) ? _a : _b; })
+
+#define ABS(a) \
+ ({ __typeof__ (a) _a = (a); \
+   (_a > 0) ? _a : (-_a); })
+
+// from drivers/llcan.h
+#define GET_BUS(msg) (((msg)->RDTR >> 4) & 0xFF)
+#define GET_LEN(msg) ((msg)->RDTR & 0xF)
+#define GET_ADDR(msg) ((((msg)->RIR & 4) != 0) ? ((msg)->RIR >> 3) : ((msg)->RIR >> 21))
+#define GET_BYTE(msg, b) (((int)(b) > 3) ? (((msg)->RDHR >> (8U * ((unsigned int)(b) % 4U))) & 0xFFU) : (((msg)->RDLR >> (8U * (unsigned int)(b))) & 0xFFU))
+#define GET_BYTES_04(msg) ((msg)->RDLR)
+#define GET_BYTES_48(msg) ((msg)->RDHR)
+#define GET_FLAG(value, mask) (((__typeof__(mask))param & mask) == mask)
+
+// the logs are from cars with a harness
+bool board_has_relay(void) {
+  return true;
+}
+
+// faults.h, without the uart
+#define FAULT_RELAY_MALFUNCTION (1U << 0)
+uint32_t faults = 0U;
+
+void fault_occurred(uint32_t fault) {
+  faults |= fault;
+}
+
+void fault_recovered(uint32_t fault) {
+  faults &= ~fault;
+}
+
+#define ALLOW_DEBUG
+#include "safety.h"
+
+// the gmlan switch tesla drives
+void set_gmlan_digital_output(int to_set) {
+  UNUSED(to_set);
+}
+
+void reset_gmlan_switch_timeout(void) {
+}
+
+void gmlan_switch_init(int timeout_enable) {
+  UNUSED(timeout_enable);
+}
+
+int safety_host_set_mode(uint16_t mode, int16_t param) {
+  return set_safety_hooks(mode, param);
+}
+
+void safety_host_set_timer(uint32_t us) {
+  timer.CNT = us;
+}
+
+void safety_host_tick(void) {
+  safety_mode_cnt += 1U;
+  safety_tick(current_hooks);
+}
+
+// like the panda has them in its mailboxes, extended addresses are the ones past 11 bits
+static CAN_FIFOMailBox_TypeDef mailbox(uint32_t addr, int bus, const uint8_t *dat, int len) {
+  CAN_FIFOMailBox_TypeDef msg = {0};
+  msg.RIR = (addr >= 0x800U) ? ((addr << 3) | 5U) : ((addr << 21) | 1U);
+  msg.RDTR = ((uint32_t)bus << 4) | (uint32_t)MIN(len, 8);
+  uint8_t data[8] = {0};
+  memcpy(data, dat, MIN(len, 8));
+  memcpy(&msg.RDLR, &data[0], 4);
+  memcpy(&msg.RDHR, &data[4], 4);
+  return msg;
+}
+
+int safety_host_rx(uint32_t addr, int bus, const uint8_t *dat, int len) {
+  CAN_FIFOMailBox_TypeDef msg = mailbox(addr, bus, dat, len);
+  return safety_rx_hook(&msg);
+}
+
+int safety_host_tx(uint32_t addr, int bus, const uint8_t *dat, int len) {
+  CAN_FIFOMailBox_TypeDef msg = mailbox(addr, bus, dat, len);
+  return safety_tx_hook(&msg);
+}
+
+bool safety_host_controls_allowed(void) {
+  return controls_allowed;
+}
+
+bool safety_host_relay_malfunction(void) {
+  return relay_malfunction;
+}
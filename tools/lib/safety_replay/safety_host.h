@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The panda's safety hooks, built for the host from panda/board/safety.h. Its state is global like
+// on the panda, a process replays one safety mode at a time
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 0 if the mode is built in, which is every mode, the debug ones too
+int safety_host_set_mode(uint16_t mode, int16_t param);
+// the panda's microsecond timer, it wraps like the panda's does
+void safety_host_set_timer(uint32_t us);
+// what the main loop does once a second
+void safety_host_tick(void);
+
+// 1 if allowed, len is up to 8
+int safety_host_rx(uint32_t addr, int bus, const uint8_t *dat, int len);
+int safety_host_tx(uint32_t addr, int bus, const uint8_t *dat, int len);
+bool safety_host_controls_allowed(void);
+bool safety_host_relay_malfunction(void);
+
+#ifdef __cplusplus
+}
+#endif
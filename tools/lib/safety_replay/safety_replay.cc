@@ -0,0 +1,304 @@
+// Replays the can and sendcan of logs through the panda's safety hooks, natively and a run per process
+//   safety_replay [-j jobs] [-m mode[:param],...] <route>...
+// A route is an rlog, or a directory of numbered segment directories with an rlog each, replayed in
+// order. Each route runs in the safety mode of its carParams, or once in each -m mode, named like
+// CarParams.SafetyModel or by number. Received frames go through the rx hook and sent ones through the
+// tx hook with the panda's timer at their log time, ticking once a second of log. A line per run has
+// the frames the hooks rejected and blocked, the blocks while controls were allowed and the addresses
+// blocked most
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <capnp/schema.h>
+
+#include "cereal/gen/cpp/car.capnp.h"
+#include "LogSegment.hpp"
+#include "safety_host.h"
+
+// past these the frames are a tx echo or another panda's
+#define PANDA_BUS_CNT 4
+#define TOP_BLOCKED 4
+
+struct Mode {
+  int model = -1;  // the carParams' when -1
+  int param = 0;
+};
+
+struct Run {
+  std::string route;
+  std::vector<std::string> logs;
+  Mode mode;
+};
+
+// written to the parent through a pipe, so plain data
+struct Result {
+  bool ok;
+  int model, param;
+  uint64_t rx, rx_invalid, tx, tx_blocked;
+  // blocked while controls were allowed, what a regression in the limits shows up as
+  uint64_t tx_blocked_allowed;
+  uint64_t log_ns, allowed_ns;
+  double wall_s;
+  int num_top;
+  struct {
+    uint32_t addr;
+    uint32_t bus;
+    uint64_t count;
+  } top[TOP_BLOCKED];
+};
+
+static std::map<std::string, int> safety_models() {
+  std::map<std::string, int> ret;
+  for (auto e : capnp::Schema::from<cereal::CarParams::SafetyModel>().getEnumerants()) {
+    ret[e.getProto().getName().cStr()] = e.getOrdinal();
+  }
+  return ret;
+}
+
+static std::string model_name(int model) {
+  for (auto &it : safety_models()) {
+    if (it.second == model) return it.first;
+  }
+  return std::to_string(model);
+}
+
+static std::vector<std::string> route_logs(const std::string &route) {
+  struct stat st;
+  if (stat(route.c_str(), &st) != 0) return {};
+  if (!S_ISDIR(st.st_mode)) return {route};
+
+  std::vector<std::pair<int, std::string>> segments;
+  DIR *dir = opendir(route.c_str());
+  if (!dir) return {};
+  while (struct dirent *de = readdir(dir)) {
+    const std::string name = de->d_name;
+    if (name.empty() || name.find_first_not_of("0123456789") != std::string::npos) continue;
+    for (const char *log : {"rlog", "rlog.bz2", "rlog.zst"}) {
+      const std::string path = route + "/" + name + "/" + log;
+      if (access(path.c_str(), R_OK) == 0) {
+        segments.push_back({atoi(name.c_str()), path});
+        break;
+      }
+    }
+  }
+  closedir(dir);
+  std::sort(segments.begin(), segments.end());
+
+  std::vector<std::string> ret;
+  for (auto &s : segments) ret.push_back(s.second);
+  return ret;
+}
+
+static bool set_mode(Result &r, int model, int param) {
+  r.model = model;
+  r.param = param;
+  if (safety_host_set_mode(model, param) != 0) {
+    fprintf(stderr, "safety mode %d isn't built in\n", model);
+    return false;
+  }
+  return true;
+}
+
+static Result replay(const Run &run) {
+  Result r = {.ok = true, .model = run.mode.model, .param = run.mode.param};
+  bool mode_set = run.mode.model >= 0;
+  if (mode_set && !set_mode(r, run.mode.model, run.mode.param)) return {};
+
+  // addr << 8 | bus
+  std::unordered_map<uint64_t, uint64_t> blocked;
+  uint64_t last_tick = 0, last_time = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < run.logs.size(); i++) {
+    auto seg = LogSegment::load(i, run.logs[i]);
+    if (!seg) {
+      fprintf(stderr, "can't read %s\n", run.logs[i].c_str());
+      continue;
+    }
+
+    for (auto &e : seg->events) {
+      if (e.which != cereal::Event::CAN && e.which != cereal::Event::SENDCAN && e.which != cereal::Event::CAR_PARAMS) continue;
+      try {
+        capnp::FlatArrayMessageReader reader(seg->message(e));
+        cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+        if (e.which == cereal::Event::CAR_PARAMS) {
+          if (!mode_set) {
+            auto cp = event.getCarParams();
+            if (!set_mode(r, (int)cp.getSafetyModel(), cp.getSafetyParam())) return {};
+            mode_set = true;
+          }
+          continue;
+        }
+        // the frames before the carParams went to a panda with no mode yet
+        if (!mode_set) continue;
+
+        if (last_time == 0) last_tick = last_time = e.mono_time;
+        for (; e.mono_time - last_tick >= 1000000000ULL; last_tick += 1000000000ULL) safety_host_tick();
+        if (safety_host_controls_allowed()) r.allowed_ns += e.mono_time - last_time;
+        r.log_ns += e.mono_time - last_time;
+        last_time = e.mono_time;
+        safety_host_set_timer(e.mono_time / 1000);
+
+        const bool sent = e.which == cereal::Event::SENDCAN;
+        for (auto c : sent ? event.getSendcan() : event.getCan()) {
+          if (c.getSrc() >= PANDA_BUS_CNT) continue;
+          auto dat = c.getDat();
+          if (!sent) {
+            r.rx++;
+            if (!safety_host_rx(c.getAddress(), c.getSrc(), dat.begin(), dat.size())) r.rx_invalid++;
+            continue;
+          }
+          const bool allowed = safety_host_controls_allowed();
+          r.tx++;
+          if (!safety_host_tx(c.getAddress(), c.getSrc(), dat.begin(), dat.size())) {
+            r.tx_blocked++;
+            if (allowed) r.tx_blocked_allowed++;
+            blocked[((uint64_t)c.getAddress() << 8) | c.getSrc()]++;
+          }
+        }
+      } catch (const kj::Exception &exc) {
+        fprintf(stderr, "%s: skipping an event, %s\n", run.logs[i].c_str(), exc.getDescription().cStr());
+      }
+    }
+  }
+  r.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<std::pair<uint64_t, uint64_t>> most(blocked.begin(), blocked.end());
+  r.num_top = std::min<int>(TOP_BLOCKED, most.size());
+  std::partial_sort(most.begin(), most.begin() + r.num_top, most.end(), [](auto &a, auto &b) { return a.second > b.second; });
+  for (int i = 0; i < r.num_top; i++) {
+    r.top[i] = {.addr = (uint32_t)(most[i].first >> 8), .bus = (uint32_t)(most[i].first & 0xff), .count = most[i].second};
+  }
+  return r;
+}
+
+static bool parse_modes(char *arg, std::vector<Mode> &modes) {
+  const auto names = safety_models();
+  for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+    Mode m;
+    if (char *param = strchr(tok, ':')) {
+      *param = '\0';
+      m.param = strtol(param + 1, NULL, 0);
+    }
+    auto it = names.find(tok);
+    if (it != names.end()) {
+      m.model = it->second;
+    } else if (tok[0] && strspn(tok, "0123456789") == strlen(tok)) {
+      m.model = atoi(tok);
+    } else {
+      fprintf(stderr, "no safety mode %s\n", tok);
+      return false;
+    }
+    modes.push_back(m);
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<Mode> modes;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:m:")) != -1) {
+    if (opt == 'j') {
+      jobs = std::max(1, atoi(optarg));
+    } else if (opt == 'm') {
+      if (!parse_modes(optarg, modes)) return 1;
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-j jobs] [-m mode[:param],...] <route>...\n", argv[0]);
+    return 1;
+  }
+  if (modes.empty()) modes.push_back(Mode());
+
+  std::vector<Run> runs;
+  for (int i = optind; i < argc; i++) {
+    std::vector<std::string> logs = route_logs(argv[i]);
+    if (logs.empty()) {
+      fprintf(stderr, "no rlogs in %s\n", argv[i]);
+      return 1;
+    }
+    for (auto &m : modes) runs.push_back({argv[i], logs, m});
+  }
+
+  // the safety state is global, a process a run
+  std::vector<Result> results(runs.size());
+  std::map<pid_t, std::pair<size_t, int>> running;  // pid -> run, pipe
+  size_t next = 0;
+  while (next < runs.size() || !running.empty()) {
+    if (next < runs.size() && running.size() < (size_t)jobs) {
+      int fds[2];
+      if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+      }
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(fds[0]);
+        const Result r = replay(runs[next]);
+        // smaller than the pipe's buffer, it's there for the parent after the exit
+        bool written = write(fds[1], &r, sizeof(r)) == sizeof(r);
+        _exit(written ? 0 : 1);
+      }
+      close(fds[1]);
+      if (pid < 0) {
+        perror("fork");
+        return 1;
+      }
+      running[pid] = {next++, fds[0]};
+      continue;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    auto it = running.find(pid);
+    if (it == running.end()) continue;
+    auto [i, fd] = it->second;
+    if (read(fd, &results[i], sizeof(Result)) != sizeof(Result)) results[i] = {};
+    close(fd);
+    running.erase(it);
+  }
+
+  printf("%-32s %-22s %10s %8s %9s %9s %9s %8s %9s  %s\n", "route", "mode:param", "rx", "!valid%", "tx",
+         "blocked", "!allowed", "allowed%", "Mframes/s", "blocked most, addr@bus:count");
+  int failed = 0;
+  for (size_t i = 0; i < runs.size(); i++) {
+    const Result &r = results[i];
+    std::string route = runs[i].route;
+    while (route.size() > 1 && route.back() == '/') route.pop_back();
+    route = route.substr(route.find_last_of('/') + 1);
+    if (!r.ok) {
+      printf("%-32s failed\n", route.c_str());
+      failed++;
+      continue;
+    }
+
+    std::string most;
+    for (int j = 0; j < r.num_top; j++) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%s0x%x@%u:%llu", j ? " " : "", r.top[j].addr, r.top[j].bus, (unsigned long long)r.top[j].count);
+      most += buf;
+    }
+    const std::string mode = r.model < 0 ? "no carParams" : model_name(r.model) + ":" + std::to_string(r.param);
+    printf("%-32s %-22s %10llu %8.3f %9llu %9llu %9llu %8.1f %9.2f  %s\n", route.c_str(), mode.c_str(),
+           (unsigned long long)r.rx, r.rx ? 100. * r.rx_invalid / r.rx : 0., (unsigned long long)r.tx,
+           (unsigned long long)r.tx_blocked, (unsigned long long)r.tx_blocked_allowed,
+           r.log_ns ? 100. * r.allowed_ns / r.log_ns : 0., r.wall_s > 0 ? (r.rx + r.tx) / r.wall_s / 1e6 : 0.,
+           most.c_str());
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+import unittest
+
+from tools.lib.log_columns.segment_index import candidates, parse_query
+
+INDEX = [
+  {"path": "parked", "fields": {
+    "controlsState.enabled": {"n": 1200, "min": 0, "max": 0, "bitmap": 0b1},
+    "controlsState.vEgo": {"n": 1200, "min": 0.0, "max": 0.0}}},
+  {"path": "highway", "fields": {
+    "controlsState.enabled": {"n": 1200, "min": 0, "max": 1, "bitmap": 0b11},
+    "controlsState.vEgo": {"n": 1200, "min": 25.0, "max": 34.5}}},
+  {"path": "city", "fields": {
+    "controlsState.enabled": {"n": 1200, "min": 1, "max": 1, "bitmap": 0b10},
+    "controlsState.vEgo": {"n": 1200, "min": 0.0, "max": 15.0}}},
+  {"path": "no_controls", "fields": {}},
+]
+
+
+class TestSegmentIndex(unittest.TestCase):
+  def test_parse(self):
+    self.assertEqual(parse_query("controlsState.enabled and controlsState.vEgo > 30"),
+                     [(False, "controlsState.enabled", None, None), (False, "controlsState.vEgo", ">", 30.0)])
+    self.assertEqual(parse_query("not carState.gas.pressed"), [(True, "carState.gas.pressed", None, None)])
+    with self.assertRaises(ValueError):
+      parse_query("vEgo > 30")
+
+  def test_prune(self):
+    def q(s):
+      return candidates(INDEX, parse_query(s))
+    self.assertEqual(q("controlsState.enabled and controlsState.vEgo > 30"), ["highway"])
+    self.assertEqual(q("controlsState.enabled"), ["highway", "city"])
+    self.assertEqual(q("not controlsState.enabled"), ["parked", "highway"])
+    self.assertEqual(q("controlsState.enabled == True"), ["highway", "city"])
+    self.assertEqual(q("controlsState.vEgo <= 0"), ["parked", "city"])
+    self.assertEqual(q("controlsState.vEgo != 0"), ["highway", "city"])
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+import os
+import random
+import tempfile
+import unittest
+
+import numpy as np
+
+from tools.lib.vidindex import HEVC_SLICE_I, VIDEO_INDEX_ENTRY, VIDEO_INDEX_HEADER, VIDEO_INDEX_MAGIC, \
+                               VIDEO_INDEX_VERSION, encoder_index, vidindex
+
+
+def hevc_stream(frames, seed=0):
+  """A stream of IDRs every 15 frames and trailing slices, with random payloads without zeros
+  so there are no stray start codes"""
+  rng = random.Random(seed)
+  out = bytearray(b"\x00")
+  for nal_type in (32, 33, 34):
+    out += b"\x00\x00\x01" + bytes([nal_type << 1, 1]) + b"\x11" * 16
+  for i in range(frames):
+    nal_type = 19 if i % 15 == 0 else 1
+    # the pps before the first ends at its start code
+    start_code = b"\x00\x00\x00\x01" if i > 0 and rng.random() < 0.5 else b"\x00\x00\x01"
+    payload = os.urandom(rng.randrange(100, 60000)).replace(b"\x00", b"\x02")
+    out += start_code + bytes([nal_type << 1, 1, 0x80]) + payload
+  return bytes(out)
+
+
+class TestVidIndex(unittest.TestCase):
+  def test_threaded_matches_single(self):
+    with tempfile.NamedTemporaryFile() as f:
+      # big enough to be searched in a few chunks
+      f.write(hevc_stream(1000))
+      f.flush()
+
+      index, prefix = vidindex(f.name, "hevc", threads=1)
+      self.assertEqual(index.shape, (1001, 2))
+      self.assertEqual(index[-1, 0], 0xFFFFFFFF)
+      self.assertEqual(index[-1, 1], os.path.getsize(f.name))
+      self.assertEqual(len(prefix), 3 * (3 + 2 + 16))
+
+      for threads in (2, 3, 0):
+        index_mt, prefix_mt = vidindex(f.name, "hevc", threads=threads)
+        self.assertTrue((index == index_mt).all())
+        self.assertEqual(prefix, prefix_mt)
+
+  def test_encoder_index(self):
+    with tempfile.TemporaryDirectory() as d:
+      fn = os.path.join(d, "fcamera.hevc")
+      with open(fn, "wb") as f:
+        f.write(hevc_stream(100))
+      self.assertIsNone(encoder_index(fn))
+
+      # as the encoder would've written it
+      index, _ = vidindex(fn, "hevc")
+      entries = np.zeros(len(index) - 1, dtype=VIDEO_INDEX_ENTRY)
+      entries["offset"] = index[:-1, 1]
+      entries["size"] = np.diff(index[:, 1].astype(np.int64))
+      entries["flags"] = index[:-1, 0] == HEVC_SLICE_I
+      entries["pts"] = np.arange(len(entries)) * 50000
+      with open(fn + ".idx", "wb") as f:
+        f.write(VIDEO_INDEX_HEADER.pack(VIDEO_INDEX_MAGIC, VIDEO_INDEX_VERSION) + entries.tobytes())
+
+      enc_index, enc_prefix = encoder_index(fn)
+      self.assertTrue((enc_index[:, 1] == index[:, 1]).all())
+      self.assertTrue(((enc_index[:-1, 0] == HEVC_SLICE_I) == (index[:-1, 0] == HEVC_SLICE_I)).all())
+      self.assertEqual(enc_index[-1, 0], 0xFFFFFFFF)
+      with open(fn, "rb") as f:
+        self.assertEqual(enc_prefix, f.read(int(index[0, 1])))
+
+      # the frames past the end of a video cut short are dropped
+      os.truncate(fn, int(index[50, 1]))
+      enc_index, _ = encoder_index(fn)
+      self.assertEqual(enc_index.shape, (51, 2))
+      self.assertEqual(enc_index[-1, 1], index[50, 1])
+
+  def test_unreadable(self):
+    self.assertIsNone(vidindex("/nonexistent.hevc", "hevc"))
+    with tempfile.NamedTemporaryFile() as f:
+      f.write(b"\x01\x02\x03\x04\x05\x06")
+      f.flush()
+      self.assertIsNone(vidindex(f.name, "hevc"))
+
+
+if __name__ == "__main__":
+  unittest.main()
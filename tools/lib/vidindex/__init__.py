@@ -0,0 +1,104 @@
+"""ctypes bindings for libvidindex, which indexes the frames of raw h264 and hevc files"""
+import ctypes
+import os
+import struct
+import subprocess
+import threading
+
+import numpy as np
+
+VIDINDEX_DIR = os.path.dirname(os.path.realpath(__file__))
+TYPES = {"h264": 0, "hevc": 1}
+
+# the index loggerd writes next to a video, see selfdrive/loggerd/video_index.h
+VIDEO_INDEX_HEADER = struct.Struct("<II")
+VIDEO_INDEX_MAGIC = 0x58444956
+VIDEO_INDEX_VERSION = 1
+VIDEO_INDEX_KEYFRAME = 1
+VIDEO_INDEX_ENTRY = np.dtype([("offset", "<u8"), ("size", "<u4"), ("flags", "<u4"), ("pts", "<i8")])
+HEVC_SLICE_P = 1
+HEVC_SLICE_I = 2
+
+
+class _VidIndex(ctypes.Structure):
+  _fields_ = [
+    ("index", ctypes.POINTER(ctypes.c_uint32)),
+    ("index_len", ctypes.c_size_t),
+    ("prefix", ctypes.POINTER(ctypes.c_uint8)),
+    ("prefix_len", ctypes.c_size_t),
+  ]
+
+
+_lib = None
+_lib_lock = threading.Lock()
+
+
+def _load():
+  global _lib
+  with _lib_lock:
+    if _lib is None:
+      subprocess.check_call(["make", "libvidindex.so"], cwd=VIDINDEX_DIR, stdout=open("/dev/null", "w"))
+      lib = ctypes.CDLL(os.path.join(VIDINDEX_DIR, "libvidindex.so"))
+      lib.vidindex_file.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.c_int, ctypes.POINTER(_VidIndex)]
+      lib.vidindex_file.restype = ctypes.c_int
+      lib.vidindex_free.argtypes = [ctypes.POINTER(_VidIndex)]
+      lib.vidindex_free.restype = None
+      strs = ctypes.POINTER(ctypes.c_char_p)
+      lib.vidindex_batch.argtypes = [ctypes.c_int, ctypes.c_int, strs, strs, strs, ctypes.c_int]
+      lib.vidindex_batch.restype = ctypes.c_int
+      _lib = lib
+  return _lib
+
+
+def vidindex(fn, typ, threads=0):
+  """The (slice type, offset) index of a file's frames ending with (0xFFFFFFFF, file size), and its
+  parameter sets. The file's searched on all of the cores if threads is 0. None if it can't be read"""
+  lib = _load()
+  vi = _VidIndex()
+  # ctypes lets go of the GIL for the call, so files can be indexed from a few python threads
+  if lib.vidindex_file(TYPES[typ], fn.encode(), threads, ctypes.byref(vi)) != 0:
+    return None
+  try:
+    index = np.ctypeslib.as_array(vi.index, shape=(vi.index_len, 2)).copy()
+    prefix = ctypes.string_at(vi.prefix, vi.prefix_len)
+  finally:
+    lib.vidindex_free(ctypes.byref(vi))
+  return index, prefix
+
+
+def encoder_index(fn):
+  """vidindex's index and prefix from the <fn>.idx the encoder wrote with the file, without reading
+  the frames. Keyframes are I slices and the rest P. None if there's no index or it's not the file's"""
+  try:
+    with open(fn + ".idx", "rb") as f:
+      dat = f.read()
+    size = os.path.getsize(fn)
+  except OSError:
+    return None
+  if len(dat) < VIDEO_INDEX_HEADER.size or VIDEO_INDEX_HEADER.unpack_from(dat) != (VIDEO_INDEX_MAGIC, VIDEO_INDEX_VERSION):
+    return None
+
+  count = (len(dat) - VIDEO_INDEX_HEADER.size) // VIDEO_INDEX_ENTRY.itemsize
+  entries = np.frombuffer(dat, dtype=VIDEO_INDEX_ENTRY, count=count, offset=VIDEO_INDEX_HEADER.size)
+  # the frames that made it into a video cut short
+  entries = entries[entries["offset"] + entries["size"] <= size]
+  if len(entries) == 0 or (np.diff(entries["offset"].astype(np.int64)) <= 0).any():
+    return None
+
+  index = np.empty((len(entries) + 1, 2), dtype=np.uint32)
+  index[:-1, 0] = np.where(entries["flags"] & VIDEO_INDEX_KEYFRAME, HEVC_SLICE_I, HEVC_SLICE_P)
+  index[:-1, 1] = entries["offset"]
+  index[-1] = (0xFFFFFFFF, size)
+  with open(fn, "rb") as f:
+    prefix = f.read(int(entries["offset"][0]))
+  return index, prefix
+
+
+def vidindex_batch(fns, typ, out_prefixes, out_indexes, threads=0):
+  """Writes each file's prefix and index as the vidindex binary does, a file per thread. The number
+  that failed"""
+  lib = _load()
+  n = len(fns)
+  arr = ctypes.c_char_p * n
+  to_c = lambda l: arr(*[f.encode() for f in l])
+  return lib.vidindex_batch(TYPES[typ], n, to_c(fns), to_c(out_prefixes), to_c(out_indexes), threads)
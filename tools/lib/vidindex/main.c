@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vidindex.h"
+
+#define MAX_LINE 4096
+
+static int write_file(const char *path, const void *data, size_t size) {
+  FILE *f = fopen(path, "wb");
+  if (!f) return -1;
+  size_t written = fwrite(data, 1, size, f);
+  return fclose(f) == 0 && written == size ? 0 : -1;
+}
+
+// "file_path out_prefix out_index" lines from stdin, indexed a few files at a time
+static int batch(int type) {
+  int n = 0, cap = 0;
+  char **files[3] = {NULL, NULL, NULL};
+  char line[MAX_LINE];
+  while (fgets(line, sizeof(line), stdin)) {
+    char *fields[3];
+    int nf = 0;
+    for (char *tok = strtok(line, " \t\r\n"); tok && nf < 3; tok = strtok(NULL, " \t\r\n")) fields[nf++] = tok;
+    if (nf == 0) continue;
+    if (nf != 3) {
+      fprintf(stderr, "error: expected file_path out_prefix out_index, got %s\n", fields[0]);
+      return 1;
+    }
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      for (int i = 0; i < 3; i++) {
+        files[i] = realloc(files[i], cap * sizeof(char *));
+        if (!files[i]) return 1;
+      }
+    }
+    for (int i = 0; i < 3; i++) files[i][n] = strdup(fields[i]);
+    n++;
+  }
+
+  const char *threads = getenv("VIDINDEX_THREADS");
+  int failed = vidindex_batch(type, n, (const char *const *)files[0], (const char *const *)files[1],
+                              (const char *const *)files[2], threads ? atoi(threads) : 0);
+  if (failed) fprintf(stderr, "error: %d of %d files failed\n", failed, n);
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 5 && !(argc == 3 && strcmp(argv[2], "-") == 0)) {
+    fprintf(stderr, "usage: %s h264|hevc file_path out_prefix out_index\n", argv[0]);
+    fprintf(stderr, "       %s h264|hevc - < lines of file_path out_prefix out_index\n", argv[0]);
+    exit(1);
+  }
+
+  int type = vidindex_parse_type(argv[1]);
+  if (type < 0) {
+    fprintf(stderr, "error: unknown type %s\n", argv[1]);
+    exit(1);
+  }
+  if (argc == 3) return batch(type);
+
+  const char *threads = getenv("VIDINDEX_THREADS");
+  struct vidindex vi;
+  if (vidindex_file(type, argv[2], threads ? atoi(threads) : 0, &vi) != 0) exit(1);
+
+  int ret = write_file(argv[3], vi.prefix, vi.prefix_len) || write_file(argv[4], vi.index, vi.index_len * 2 * sizeof(uint32_t));
+  if (ret) fprintf(stderr, "error: couldn't write the index of %s\n", argv[2]);
+  vidindex_free(&vi);
+  return ret;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -6,21 +7,139 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "bitstream.h"
+#include "vidindex.h"
 
 #define START_CODE 0x000001
+// chunks of a file searched on a thread are at least this big
+#define MIN_CHUNK_SIZE (8 << 20)
+
+struct buffer {
+  uint8_t *data;
+  size_t len, cap;
+  // a write didn't fit
+  bool failed;
+};
+
+static bool buffer_write(struct buffer *b, const void *src, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n) cap *= 2;
+    uint8_t *data = realloc(b->data, cap);
+    if (!data) {
+      b->failed = true;
+      return false;
+    }
+    b->data = data;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, src, n);
+  b->len += n;
+  return true;
+}
 
 static uint32_t read24be(const uint8_t* ptr) {
     return (ptr[0] << 16) | (ptr[1] << 8) | ptr[2];
 }
-static void write32le(FILE *of, uint32_t v) {
+static void write32le(struct buffer *of, uint32_t v) {
   uint8_t va[4] = {
     v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff
   };
-  fwrite(va, 1, sizeof(va), of);
+  buffer_write(of, va, sizeof(va));
+}
+
+// Where each start code is, found ahead of the parse since looking for them is most of the work
+struct start_codes {
+  size_t *pos;
+  size_t len, cap;
+  // the parse's place in them
+  size_t cur;
+};
+
+static bool start_codes_push(struct start_codes *sc, size_t pos) {
+  if (sc->len == sc->cap) {
+    size_t cap = sc->cap ? sc->cap * 2 : 1024;
+    size_t *p = realloc(sc->pos, cap * sizeof(size_t));
+    if (!p) return false;
+    sc->pos = p;
+    sc->cap = cap;
+  }
+  sc->pos[sc->len++] = pos;
+  return true;
+}
+
+// Each 00 00 01 that starts in [lo, hi). The 01s are looked for with memchr, which is vectorized,
+// and are rare in compressed data. There are 2 bytes past hi
+static bool find_start_codes(const uint8_t *data, size_t lo, size_t hi, struct start_codes *out) {
+  const uint8_t *p = data + lo + 2, *end = data + hi + 2;
+  while (p < end && (p = memchr(p, 1, end - p)) != NULL) {
+    if (p[-1] == 0 && p[-2] == 0 && !start_codes_push(out, p - 2 - data)) return false;
+    p++;
+  }
+  return true;
+}
+
+struct chunk {
+  const uint8_t *data;
+  size_t lo, hi;
+  struct start_codes codes;
+  bool ok;
+};
+
+static void *chunk_thread(void *arg) {
+  struct chunk *c = arg;
+  c->ok = find_start_codes(c->data, c->lo, c->hi, &c->codes);
+  return NULL;
+}
+
+// All of the start codes after the first byte, up to where the last NAL's cut off
+static bool find_all_start_codes(const uint8_t *data, size_t size, int threads, struct start_codes *out) {
+  const size_t lo = 1, hi = size - 4;
+  if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((size_t)threads > (hi - lo) / MIN_CHUNK_SIZE) threads = (hi - lo) / MIN_CHUNK_SIZE;
+  if (threads <= 1) return find_start_codes(data, lo, hi, out);
+
+  struct chunk *chunks = calloc(threads, sizeof(struct chunk));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  bool ok = chunks && tids;
+  int started = 0;
+  for (int i = 0; ok && i < threads; i++) {
+    chunks[i].data = data;
+    chunks[i].lo = lo + (hi - lo) * i / threads;
+    chunks[i].hi = lo + (hi - lo) * (i + 1) / threads;
+    if (pthread_create(&tids[i], NULL, chunk_thread, &chunks[i]) != 0) {
+      // the rest on this one
+      chunks[i].hi = hi;
+      chunk_thread(&chunks[i]);
+      threads = i + 1;
+      break;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+  // in order, the chunks are
+  for (int i = 0; ok && i < threads; i++) {
+    ok = chunks[i].ok;
+    for (size_t j = 0; ok && j < chunks[i].codes.len; j++) ok = start_codes_push(out, chunks[i].codes.pos[j]);
+  }
+  if (chunks) {
+    for (int i = 0; i < threads; i++) free(chunks[i].codes.pos);
+  }
+  free(chunks);
+  free(tids);
+  return ok;
+}
+
+// The NAL at ptr ends where the next start code is, or 4 bytes short of the end for the last
+static const uint8_t *next_start_code(struct start_codes *sc, const uint8_t *data, const uint8_t *ptr, const uint8_t *ptr_end) {
+  while (sc->cur < sc->len && data + sc->pos[sc->cur] <= ptr) sc->cur++;
+  if (sc->cur < sc->len) return data + sc->pos[sc->cur];
+  return ptr+1 < ptr_end-4 ? ptr_end-4 : ptr+1;
 }
 
 // Table 7-1
@@ -60,23 +179,19 @@ enum hevc_slice_type {
   HEVC_SLICE_I = 2,
 };
 
-static void hevc_index(const uint8_t *data, size_t file_size, FILE *of_prefix, FILE *of_index) {
+static bool hevc_index(const uint8_t *data, size_t file_size, struct start_codes *sc, struct buffer *of_prefix, struct buffer *of_index) {
   const uint8_t* ptr = data;
   const uint8_t* ptr_end = data + file_size;
 
-  assert(ptr[0] == 0);
+  if (ptr[0] != 0 || read24be(ptr+1) != START_CODE) return false;
   ptr++;
-  assert(read24be(ptr) == START_CODE);
 
   // pps. ignore for now
   uint32_t num_extra_slice_header_bits = 0;
   uint32_t dependent_slice_segments_enabled_flag = 0;
 
   while (ptr < ptr_end) {
-    const uint8_t* next = ptr+1;
-    for (; next < ptr_end-4; next++) {
-      if (read24be(next) == START_CODE) break;
-    }
+    const uint8_t* next = next_start_code(sc, data, ptr, ptr_end);
     size_t nal_size = next - ptr;
     if (nal_size < 6) {
       break;
@@ -101,7 +216,7 @@ static void hevc_index(const uint8_t *data, size_t file_size, FILE *of_prefix, F
       case HEVC_NAL_TYPE_VPS_NUT:
       case HEVC_NAL_TYPE_SPS_NUT:
       case HEVC_NAL_TYPE_PPS_NUT:
-        fwrite(ptr, 1, nal_size, of_prefix);
+        buffer_write(of_prefix, ptr, nal_size);
         break;
       case HEVC_NAL_TYPE_TRAIL_N:
       case HEVC_NAL_TYPE_TRAIL_R:
@@ -156,6 +271,7 @@ static void hevc_index(const uint8_t *data, size_t file_size, FILE *of_prefix, F
 
   write32le(of_index, -1);
   write32le(of_index, file_size);
+  return true;
 }
 
 // Table 7-1
@@ -183,13 +299,12 @@ enum h264_slice_type {
   // ...
 };
 
-static void h264_index(const uint8_t *data, size_t file_size, FILE *of_prefix, FILE *of_index) {
+static bool h264_index(const uint8_t *data, size_t file_size, struct start_codes *sc, struct buffer *of_prefix, struct buffer *of_index) {
   const uint8_t* ptr = data;
   const uint8_t* ptr_end = data + file_size;
 
-  assert(ptr[0] == 0);
+  if (ptr[0] != 0 || read24be(ptr+1) != START_CODE) return false;
   ptr++;
-  assert(read24be(ptr) == START_CODE);
 
 
   uint32_t sps_log2_max_frame_num_minus4;
@@ -198,10 +313,7 @@ static void h264_index(const uint8_t *data, size_t file_size, FILE *of_prefix, F
   int last_frame_num = -1;
 
   while (ptr < ptr_end) {
-    const uint8_t* next = ptr+1;
-    for (; next < ptr_end-4; next++) {
-      if (read24be(next) == START_CODE) break;
-    }
+    const uint8_t* next = next_start_code(sc, data, ptr, ptr_end);
     size_t nal_size = next - ptr;
     if (nal_size < 5) {
       break;
@@ -233,7 +345,7 @@ static void h264_index(const uint8_t *data, size_t file_size, FILE *of_prefix, F
 
         // fallthrough
       case H264_NAL_PPS:
-        fwrite(ptr, 1, nal_size, of_prefix);
+        buffer_write(of_prefix, ptr, nal_size);
         break;
 
       case H264_NAL_SLICE:
@@ -262,46 +374,130 @@ static void h264_index(const uint8_t *data, size_t file_size, FILE *of_prefix, F
 
   write32le(of_index, -1);
   write32le(of_index, file_size);
+  return true;
 }
 
-int main(int argc, char** argv) {
-  if (argc != 5) {
-    fprintf(stderr, "usage: %s h264|hevc file_path out_prefix out_index\n", argv[0]);
-    exit(1);
+int vidindex_parse_type(const char *name) {
+  if (strcmp(name, "hevc") == 0) return VIDINDEX_HEVC;
+  if (strcmp(name, "h264") == 0) return VIDINDEX_H264;
+  return -1;
+}
+
+int vidindex_data(int type, const uint8_t *data, size_t size, int threads, struct vidindex *out) {
+  memset(out, 0, sizeof(*out));
+  if (size <= 4 || (type != VIDINDEX_HEVC && type != VIDINDEX_H264)) return -1;
+
+  struct start_codes sc = {0};
+  struct buffer prefix = {0}, index = {0};
+  bool ok = find_all_start_codes(data, size, threads, &sc);
+  if (ok) {
+    if (type == VIDINDEX_HEVC) {
+      ok = hevc_index(data, size, &sc, &prefix, &index);
+    } else {
+      ok = h264_index(data, size, &sc, &prefix, &index);
+    }
   }
+  free(sc.pos);
 
-  const char* file_type = argv[1];
-  const char* file_path = argv[2];
+  if (!ok || prefix.failed || index.failed) {
+    free(prefix.data);
+    free(index.data);
+    return -1;
+  }
+  out->index = (uint32_t *)index.data;
+  out->index_len = index.len / 8;
+  out->prefix = prefix.data;
+  out->prefix_len = prefix.len;
+  return 0;
+}
 
-  int fd = open(file_path, O_RDONLY, 0);
+int vidindex_file(int type, const char *path, int threads, struct vidindex *out) {
+  memset(out, 0, sizeof(*out));
+  int fd = open(path, O_RDONLY, 0);
   if (fd < 0) {
-    fprintf(stderr, "error: couldn't open %s\n", file_path);
-    exit(1);
+    fprintf(stderr, "error: couldn't open %s\n", path);
+    return -1;
   }
 
-  FILE *of_prefix = fopen(argv[3], "wb");
-  assert(of_prefix);
-  FILE *of_index = fopen(argv[4], "wb");
-  assert(of_index);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 4) {
+    fprintf(stderr, "error: %s is too short\n", path);
+    close(fd);
+    return -1;
+  }
 
-  off_t file_size = lseek(fd, 0, SEEK_END);
-  lseek(fd, 0, SEEK_SET);
+  const uint8_t* data = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "error: couldn't map %s\n", path);
+    return -1;
+  }
+  madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
 
-  assert(file_size > 4);
+  int ret = vidindex_data(type, data, st.st_size, threads, out);
+  if (ret != 0) fprintf(stderr, "error: couldn't index %s\n", path);
+  munmap((void*)data, st.st_size);
+  return ret;
+}
 
-  const uint8_t* data = (const uint8_t*)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  assert(data != MAP_FAILED);
+void vidindex_free(struct vidindex *vi) {
+  free(vi->index);
+  free(vi->prefix);
+  memset(vi, 0, sizeof(*vi));
+}
 
-  if (strcmp(file_type, "hevc") == 0) {
-    hevc_index(data, file_size, of_prefix, of_index);
-  } else if (strcmp(file_type, "h264") == 0) {
-    h264_index(data, file_size, of_prefix, of_index);
-  } else {
-    assert(false);
-  }
+static bool write_file(const char *path, const void *data, size_t size) {
+  FILE *f = fopen(path, "wb");
+  if (!f) return false;
+  bool ok = fwrite(data, 1, size, f) == size;
+  return fclose(f) == 0 && ok;
+}
 
-  munmap((void*)data, file_size);
-  close(fd);
+struct batch {
+  int type, n;
+  const char *const *paths, *const *out_prefixes, *const *out_indexes;
+  pthread_mutex_t lock;
+  int next, failed;
+};
 
-  return 0;
+static void *batch_thread(void *arg) {
+  struct batch *b = arg;
+  while (true) {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->n) break;
+
+    // the files are the parallelism, each on one thread
+    struct vidindex vi;
+    bool ok = vidindex_file(b->type, b->paths[i], 1, &vi) == 0 &&
+              write_file(b->out_prefixes[i], vi.prefix, vi.prefix_len) &&
+              write_file(b->out_indexes[i], vi.index, vi.index_len * 2 * sizeof(uint32_t));
+    vidindex_free(&vi);
+    if (!ok) {
+      pthread_mutex_lock(&b->lock);
+      b->failed++;
+      pthread_mutex_unlock(&b->lock);
+    }
+  }
+  return NULL;
+}
+
+int vidindex_batch(int type, int n, const char *const *paths, const char *const *out_prefixes,
+                   const char *const *out_indexes, int threads) {
+  struct batch b = {type, n, paths, out_prefixes, out_indexes, PTHREAD_MUTEX_INITIALIZER, 0, 0};
+  if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > n) threads = n;
+
+  pthread_t *tids = calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+  int started = 0;
+  for (int i = 0; tids && i < threads; i++) {
+    if (pthread_create(&tids[i], NULL, batch_thread, &b) != 0) break;
+    started++;
+  }
+  // what's left, if no threads could be started
+  if (started == 0) batch_thread(&b);
+  for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+  free(tids);
+  return b.failed;
 }
@@ -0,0 +1,43 @@
+#ifndef vidindex_H
+#define vidindex_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum vidindex_type {
+  VIDINDEX_H264,
+  VIDINDEX_HEVC,
+};
+
+struct vidindex {
+  // (slice type, offset) of each frame's first slice, the last is (-1, file size)
+  uint32_t *index;
+  size_t index_len;
+  // the parameter sets, one after another
+  uint8_t *prefix;
+  size_t prefix_len;
+};
+
+// "h264" or "hevc", -1 for anything else
+int vidindex_parse_type(const char *name);
+
+// Index a stream in memory. The start codes are searched for on threads, all of the cores
+// if it's 0. 0 on success, else -1 and out is left empty
+int vidindex_data(int type, const uint8_t *data, size_t size, int threads, struct vidindex *out);
+// Index a file, it's mapped rather than read
+int vidindex_file(int type, const char *path, int threads, struct vidindex *out);
+void vidindex_free(struct vidindex *vi);
+
+// Index files and write each's prefix and index, a file per thread at a time. The number that failed
+int vidindex_batch(int type, int n, const char *const *paths, const char *const *out_prefixes,
+                   const char *const *out_indexes, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
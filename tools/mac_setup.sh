@@ -16,10 +16,12 @@ brew "libarchive"
 brew "libusb"
 brew "libtool"
 brew "llvm"
+brew "lz4"
 brew "openssl"
 brew "pyenv"
 brew "qt5"
 brew "zeromq"
+brew "zstd"
 EOS
 
 if [[ $SHELL == "/bin/zsh" ]]; then
@@ -0,0 +1,111 @@
+#include "SegmentLoader.hpp"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QUrl>
+#include <QtNetwork>
+
+namespace {
+
+class LoadTask : public QRunnable {
+public:
+  LoadTask(std::function<void()> f) : f(f) {}
+  void run() override { f(); }
+
+private:
+  std::function<void()> f;
+};
+
+}
+
+SegmentLoader::SegmentLoader(int workers, std::function<void(std::unique_ptr<LogSegment>)> on_loaded_) : on_loaded(on_loaded_) {
+  pool.setMaxThreadCount(workers);
+
+  cache_dir = getenv("NUI_CACHE") ? getenv("NUI_CACHE") : QDir::homePath() + "/.comma/nui_cache";
+  QDir().mkpath(cache_dir);
+}
+
+SegmentLoader::~SegmentLoader() {
+  pool.clear();
+  pool.waitForDone();
+}
+
+bool SegmentLoader::load(int num, const QString &url, int priority) {
+  {
+    QMutexLocker lk(&lock);
+    if (loading.contains(num)) return false;
+    loading.insert(num);
+  }
+  pool.start(new LoadTask([=]() { run(num, url); }), priority);
+  return true;
+}
+
+QString SegmentLoader::cachePath(const QString &url) const {
+  QByteArray key = QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha1).toHex();
+  return cache_dir + "/" + key;
+}
+
+// on the worker, which has its own network access and waits for it
+bool SegmentLoader::download(const QString &url, const QString &path) {
+  QNetworkAccessManager qnam;
+  QNetworkRequest request((QUrl(url)));
+  request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+  QNetworkReply *reply = qnam.get(request);
+
+  // written as it comes in, only there once it's all been
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly)) return false;
+  QObject::connect(reply, &QIODevice::readyRead, [&]() { file.write(reply->readAll()); });
+
+  QEventLoop loop;
+  QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+  loop.exec();
+
+  bool ok = reply->error() == QNetworkReply::NoError;
+  if (ok) {
+    file.write(reply->readAll());
+    ok = file.commit();
+  } else {
+    qWarning() << url << reply->errorString();
+    file.cancelWriting();
+  }
+  delete reply;
+  return ok;
+}
+
+void SegmentLoader::run(int num, const QString &url) {
+  QElapsedTimer timer;
+  timer.start();
+
+  QString str = url.simplified();
+  str.replace(" ", "");
+  QUrl qurl(str);
+
+  // local files are read where they are
+  QString path = str;
+  if (!qurl.scheme().isEmpty()) path = qurl.isLocalFile() ? qurl.toLocalFile() : cachePath(str);
+
+  bool ok = QFile::exists(path);
+  if (!ok) {
+    ok = download(str, path);
+    qDebug() << "downloaded" << num << "in" << timer.elapsed() << "ms";
+  }
+
+  std::unique_ptr<LogSegment> seg;
+  if (ok) seg = LogSegment::load(num, path.toStdString());
+  int events = seg ? seg->events.size() : 0;
+  qDebug() << "loaded" << num << "with" << events << "events in" << timer.elapsed() << "ms";
+
+  if (seg) on_loaded(std::move(seg));
+  {
+    QMutexLocker lk(&lock);
+    loading.remove(num);
+  }
+  emit loaded(num, events);
+}
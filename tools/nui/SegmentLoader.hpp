@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+#include <functional>
+#include <memory>
+
+#include "LogReplay.hpp"
+
+// Downloads and decompresses segments' rlogs on a pool of workers. What's downloaded is kept in
+// a disk cache by url, so a segment that's let go of and needed again is only read back
+class SegmentLoader : public QObject {
+Q_OBJECT
+public:
+  // on_loaded is called from the workers
+  SegmentLoader(int workers, std::function<void(std::unique_ptr<LogSegment>)> on_loaded);
+  ~SegmentLoader();
+
+  // urls or local paths, the higher priorities are started first. false if it's already loading
+  bool load(int num, const QString &url, int priority = 0);
+
+signals:
+  // with how many events it had, 0 if it couldn't be read
+  void loaded(int num, int events);
+
+private:
+  void run(int num, const QString &url);
+  QString cachePath(const QString &url) const;
+  bool download(const QString &url, const QString &path);
+
+  QThreadPool pool;
+  QString cache_dir;
+  std::function<void(std::unique_ptr<LogSegment>)> on_loaded;
+
+  QMutex lock;
+  QSet<int> loading;
+};
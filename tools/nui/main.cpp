@@ -7,7 +7,7 @@
 #include <QPainter>
 #include <QThread>
 #include <QMouseEvent>
-#include <QReadWriteLock>
+#include <QMutex>
 #include <QLineEdit>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -15,15 +15,22 @@
 #include <QDebug>
 #include <stdlib.h>
 #include <QTextStream>
+#include <QSet>
 
-#include "FileReader.hpp"
-#include "Unlogger.hpp"
+#include <memory>
+
+#include "common/timing.h"
+
+#include "LogReplay.hpp"
+#include "SegmentLoader.hpp"
 #include "FrameReader.hpp"
 
 class Window : public QWidget {
   public:
     Window(QString route_, int seek, int use_api);
-    bool addSegment(int i);
+    // the loader's workers and the replay's thread go first, they use the rest
+    ~Window() { loader.reset(); replay.reset(); }
+    bool addSegment(int i, int priority = 0);
     QJsonArray camera_paths;
     QJsonArray log_paths;
     int use_api;
@@ -31,19 +38,27 @@ class Window : public QWidget {
     void keyPressEvent(QKeyEvent *event) override;
     void mousePressEvent(QMouseEvent *event) override;
     void paintEvent(QPaintEvent *event) override;
-    uint64_t ct;
-    Unlogger *unlogger;
+    std::unique_ptr<LogReplay> replay;
+    std::unique_ptr<SegmentLoader> loader;
   private:
     int timeToPixel(uint64_t ns);
     uint64_t pixelToTime(int px);
+    void segmentLoaded(const LogSegment &seg);
+    bool publishFrame(cereal::Event::Reader event, PubSocket *sock);
     QString route;
 
-    QReadWriteLock events_lock;
-    Events events;
-    int last_event_size = 0;
-
-    QMap<int, LogReader*> lrs;
+    // what the loaded segments have, from the loader's workers and the replay's thread
+    QMutex lock;
+    QSet<int> parsed;
+    // controlsState's vEgo and whether it's enabled, by logMonoTime
+    QMap<uint64_t, QPair<float, bool> > timeline;
+    // encodeIdx's frameId to its camera segment and frame
+    QMap<int, QPair<int, int> > eidx;
     QMap<int, FrameReader*> frs;
+    int last_timeline_size = 0;
+
+    // those the replay asked for, the rest are only loaded for the timeline
+    QSet<int> wanted;
 
 
     // cache the bar
@@ -58,12 +73,47 @@ Window::Window(QString route_, int seek, int use_api_) : route(route_), use_api(
   timeLE->setPlaceholderText("Placeholder Text");
   timeLE->move(50, 650);
 
-  QThread* thread = new QThread;
-  unlogger = new Unlogger(&events, &events_lock, &frs, seek);
-  unlogger->moveToThread(thread);
-  connect(thread, SIGNAL (started()), unlogger, SLOT (process()));
-  connect(unlogger, SIGNAL (elapsed()), this, SLOT (update()));
-  thread->start();
+  auto env_list = [](const char *name) {
+    std::vector<std::string> ret;
+    for (auto &s : QString(getenv(name)).split(",", QString::SkipEmptyParts)) ret.push_back(s.toStdString());
+    return ret;
+  };
+  replay.reset(new LogReplay(env_list("ALLOW"), env_list("BLOCK")));
+  replay->setHook(cereal::Event::FRAME, [=](cereal::Event::Reader event, PubSocket *sock) {
+    return publishFrame(event, sock);
+  });
+  replay->on_segment_needed = [=](int num) {
+    QMetaObject::invokeMethod(this, [=]() {
+      {
+        QMutexLocker lk(&lock);
+        wanted.insert(num);
+      }
+      // ahead of the timeline's
+      addSegment(num, 1);
+    }, Qt::QueuedConnection);
+  };
+
+  // the prefetched ones, the one playing and the timeline's
+  loader.reset(new SegmentLoader(replay->prefetch + 2, [=](std::unique_ptr<LogSegment> seg) {
+    segmentLoaded(*seg);
+    QMutexLocker lk(&lock);
+    bool want = wanted.contains(seg->num);
+    lk.unlock();
+    if (want) replay->addSegment(std::move(seg));
+  }));
+  // the timeline's loaded one at a time, until a segment's missing
+  connect(loader.get(), &SegmentLoader::loaded, this, [=](int num, int events) {
+    if (num != seg_add || events == 0) return;
+    QMutexLocker lk(&lock);
+    while (parsed.contains(seg_add)) seg_add++;
+    lk.unlock();
+    addSegment(seg_add);
+  });
+  replay->start(seek*1e9);
+
+  QTimer *timer = new QTimer(this);
+  connect(timer, &QTimer::timeout, this, QOverload<>::of(&Window::update));
+  timer->start(50);
 
   if (use_api) {
     QString settings;
@@ -83,42 +133,84 @@ Window::Window(QString route_, int seek, int use_api_) : route(route_), use_api(
 
   this->setFocusPolicy(Qt::StrongFocus);
 
-  // add the first segment
-  addSegment(seek/60);
+  // add the first segment, the rest follow it one at a time
+  seg_add = seek/60;
+  wanted.insert(seg_add);
+  addSegment(seg_add, 1);
 }
 
-bool Window::addSegment(int i) {
-  if (lrs.find(i) == lrs.end()) {
-    QString fn = QString("http://data.comma.life/%1/%2/rlog.bz2").arg(route).arg(i);
+bool Window::addSegment(int i, int priority) {
+  if (i < 0 || (use_api && i >= log_paths.size())) return false;
 
+  QString fn = QString("http://data.comma.life/%1/%2/rlog.bz2").arg(route).arg(i);
+  if (use_api) fn = this->log_paths.at(i).toString();
+  if (!loader->load(i, fn, priority)) return false;
 
-    QThread* thread = new QThread;
-    if (!use_api) {
-      lrs.insert(i, new LogReader(fn, &events, &events_lock, &unlogger->eidx));
-    } else {
-      QString log_fn = this->log_paths.at(i).toString();
-      lrs.insert(i, new LogReader(log_fn, &events, &events_lock, &unlogger->eidx));
+  QMutexLocker lk(&lock);
+  if (!frs.contains(i)) {
+    QString frn = QString("http://data.comma.life/%1/%2/fcamera.hevc").arg(route).arg(i);
+    if (use_api) frn = this->camera_paths.at(i).toString();
+    frs.insert(i, new FrameReader(qPrintable(frn)));
+  }
+  return true;
+}
 
-    }
+void Window::segmentLoaded(const LogSegment &seg) {
+  {
+    // it's loaded again when it's needed again
+    QMutexLocker lk(&lock);
+    if (parsed.contains(seg.num)) return;
+  }
 
-    lrs[i]->moveToThread(thread);
-    connect(thread, SIGNAL (started()), lrs[i], SLOT (process()));
-    thread->start();
-    //connect(lrs[i], SIGNAL (finished()), this, SLOT (update()));
+  QMap<uint64_t, QPair<float, bool> > timeline_local;
+  QMap<int, QPair<int, int> > eidx_local;
 
-    QString frn = QString("http://data.comma.life/%1/%2/fcamera.hevc").arg(route).arg(i);
+  for (auto &e : seg.events) {
+    if (e.which != cereal::Event::CONTROLS_STATE && e.which != cereal::Event::ENCODE_IDX) continue;
 
-    if (!use_api) {
-      frs.insert(i, new FrameReader(qPrintable(frn)));
+    capnp::FlatArrayMessageReader reader(seg.message(e));
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    if (e.which == cereal::Event::CONTROLS_STATE) {
+      auto controlsState = event.getControlsState();
+      bool enabled = controlsState.getState() == cereal::ControlsState::OpenpilotState::ENABLED;
+      timeline_local.insert(e.mono_time, qMakePair(controlsState.getVEgo(), enabled));
     } else {
-      QString camera_fn = this->camera_paths.at(i).toString();
-      frs.insert(i, new FrameReader(qPrintable(camera_fn)));
+      auto ee = event.getEncodeIdx();
+      eidx_local.insert(ee.getFrameId(), qMakePair(ee.getSegmentNum(), ee.getSegmentId()));
     }
+  }
 
+  QMutexLocker lk(&lock);
+  parsed.insert(seg.num);
+  timeline.unite(timeline_local);
+  eidx.unite(eidx_local);
+}
 
-    return true;
+// the logged frame with its image from the camera, from the replay's thread
+bool Window::publishFrame(cereal::Event::Reader event, PubSocket *sock) {
+  FrameReader *frm = NULL;
+  int idx = 0;
+  {
+    QMutexLocker lk(&lock);
+    auto it = eidx.find(event.getFrame().getFrameId());
+    if (it == eidx.end() || !frs.contains(it->first)) return false;
+    frm = frs[it->first];
+    idx = it->second;
   }
-  return false;
+
+  auto data = frm->get(idx);
+  if (data == NULL) return false;
+
+  capnp::MallocMessageBuilder msg;
+  msg.setRoot(event);
+  auto ee = msg.getRoot<cereal::Event>();
+  ee.setLogMonoTime(nanos_since_boot());
+  ee.getFrame().setImage(kj::arrayPtr(data, frm->getRGBSize()));
+
+  auto words = capnp::messageToFlatArray(msg);
+  auto bytes = words.asBytes();
+  sock->send((char*)bytes.begin(), bytes.size());
+  return true;
 }
 
 #define PIXELS_PER_SEC 0.5
@@ -136,37 +228,34 @@ uint64_t Window::pixelToTime(int px) {
 
 void Window::keyPressEvent(QKeyEvent *event) {
   printf("keypress: %x\n", event->key());
-  if (event->key() == Qt::Key_Space) unlogger->togglePause();
+  if (event->key() == Qt::Key_Space) replay->togglePause();
+  if (event->key() == Qt::Key_Plus) replay->setSpeed(std::min(replay->getSpeed()*2, 16.f));
+  if (event->key() == Qt::Key_Minus) replay->setSpeed(std::max(replay->getSpeed()/2, 1/16.f));
 }
 
 void Window::mousePressEvent(QMouseEvent *event) {
   //printf("mouse event\n");
   if (event->button() == Qt::LeftButton) {
-    uint64_t t0 = events.begin().key();
+    uint64_t t0 = replay->getStartTime();
+    if (t0 == 0) return;
     uint64_t tt = pixelToTime(event->x());
-    int seg = int((tt*1e-9)/60);
-    printf("segment %d\n", seg);
-    addSegment(seg);
 
-    //printf("seek to %lu\n", t0+tt);
-    unlogger->setSeekRequest(t0+tt);
+    // the replay asks for the segment
+    replay->seek(t0+tt);
   }
   this->update();
 }
 
 void Window::paintEvent(QPaintEvent *event) {
-  if (events.size() == 0) return;
+  uint64_t t0 = replay->getStartTime();
+  if (t0 == 0) return;
 
   QElapsedTimer timer;
   timer.start();
 
-  uint64_t t0 = events.begin().key();
-
-  //p.drawRect(0, 0, 600, 100);
-
-  // TODO: we really don't have to redraw this every time, only on updates to events
-  int this_event_size = events.size();
-  if (last_event_size != this_event_size) {
+  QMutexLocker lk(&lock);
+  int this_timeline_size = timeline.size();
+  if (last_timeline_size != this_timeline_size) {
     if (px != NULL) delete px;
     px = new QPixmap(1920, 600);
     px->fill(QColor(0xd8, 0xd8, 0xd8));
@@ -176,53 +265,45 @@ void Window::paintEvent(QPaintEvent *event) {
 
     int lt = -1;
     int lvv = 0;
-    for (auto e : events) {
-      auto type = e.which();
-      //printf("%lld %d\n", e.getLogMonoTime()-t0, type);
-      if (type == cereal::Event::CONTROLS_STATE) {
-        auto controlsState = e.getControlsState();
-        uint64_t t = (e.getLogMonoTime()-t0);
-        float vEgo = controlsState.getVEgo();
-        int enabled = controlsState.getState() == cereal::ControlsState::OpenpilotState::ENABLED;
-        int rt = timeToPixel(t); // 250 ms per pixel
-        if (rt != lt) {
-          int vv = vEgo*8.0;
-          if (lt != -1) {
-            tt.setPen(Qt::red);
-            tt.drawLine(lt, 300-lvv, rt, 300-vv);
-
-            if (enabled) {
-              tt.setPen(Qt::green);
-            } else {
-              tt.setPen(Qt::blue);
-            }
-
-            tt.drawLine(rt, 300, rt, 600);
+    for (auto it = timeline.begin(); it != timeline.end(); ++it) {
+      uint64_t t = (it.key()-t0);
+      float vEgo = it->first;
+      bool enabled = it->second;
+      int rt = timeToPixel(t); // 250 ms per pixel
+      if (rt != lt) {
+        int vv = vEgo*8.0;
+        if (lt != -1) {
+          tt.setPen(Qt::red);
+          tt.drawLine(lt, 300-lvv, rt, 300-vv);
+
+          if (enabled) {
+            tt.setPen(Qt::green);
+          } else {
+            tt.setPen(Qt::blue);
           }
-          lt = rt;
-          lvv = vv;
+
+          tt.drawLine(rt, 300, rt, 600);
         }
+        lt = rt;
+        lvv = vv;
       }
     }
     tt.end();
-    last_event_size = this_event_size;
-    if (lrs.find(seg_add) != lrs.end() && lrs[seg_add]->is_done) {
-      while (!addSegment(++seg_add));
-    }
+    last_timeline_size = this_timeline_size;
   }
+  lk.unlock();
 
   QPainter p(this);
   if (px != NULL) p.drawPixmap(0, 0, 1920, 600, *px);
 
   p.setBrush(Qt::cyan);
 
-  uint64_t ct = unlogger->getCurrentTime();
+  uint64_t ct = replay->getCurrentTime();
   if (ct != 0) {
-    addSegment((((ct-t0)*1e-9)/60)+1);
     int rrt = timeToPixel(ct-t0);
     p.drawRect(rrt-1, 0, 2, 600);
 
-    timeLE->setText(QString("%1").arg((ct-t0)*1e-9, '8', 'f', 2));
+    timeLE->setText(QString("%1 x%2").arg((ct-t0)*1e-9, '8', 'f', 2).arg(replay->getSpeed()));
   }
 
   p.end();
@@ -8,8 +8,9 @@ import numpy as np
 import threading
 import cereal.messaging as messaging
 import argparse
+from cereal.visionipc import VisionIpcServer, VisionStreamType
 from common.params import Params
-from common.realtime import Ratekeeper, DT_DMON
+from common.realtime import Ratekeeper, DT_DMON, sec_since_boot
 from lib.can import can_function
 from selfdrive.car.honda.values import CruiseButtons
 from selfdrive.test.helpers import set_params_enabled
@@ -52,21 +53,51 @@ def steer_rate_limit(old, new):
   else:
     return new
 
-frame_id = 0
-def cam_callback(image):
-  global frame_id
-  img = np.frombuffer(image.raw_data, dtype=np.dtype("uint8"))
-  img = np.reshape(img, (H, W, 4))
-  img = img[:, :, [0, 1, 2]].copy()
-
-  dat = messaging.new_message('frame')
-  dat.frame = {
-    "frameId": image.frame,
-    "image": img.tostring(),
-    "transform": [1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0]
-  }
-  pm.send('frame', dat)
-  frame_id += 1
+def bgr_to_yuv(bgr, buf):
+  # I420 with camerad's rgb_to_yuv.cl integer math, the U and V of each 2x2 block from its average
+  b, g, r = (bgr[:, :, i].astype(np.int32) for i in range(3))
+  y = ((b * 13 + g * 65 + r * 33 + 64) >> 7) + 16
+  ab, ag, ar = ((c[0::2, 0::2] + c[0::2, 1::2] + c[1::2, 0::2] + c[1::2, 1::2] + 1) >> 1 for c in (b, g, r))
+  u = (ab * 56 - ag * 37 - ar * 19 + 0x8080) >> 8
+  v = (ar * 56 - ag * 47 - ab * 9 + 0x8080) >> 8
+
+  data = np.asarray(buf.data)
+  for i, p in enumerate((y, u, v)):
+    offset, stride, rows = buf.plane(i)
+    data[offset:offset + stride * rows].reshape(rows, stride)[:, :p.shape[1]] = p
+
+class Camerad:
+  # Serves the frames over VisionIPC the way camerad does, so it doesn't run in the sim and the
+  # frames skip a capnp message and the copy out of it
+  def __init__(self):
+    self.frame_id = 0
+    self.vipc_server = VisionIpcServer("camerad")
+    self.vipc_server.create_buffers(VisionStreamType.VISION_STREAM_RGB_BACK, 4, True, W, H)
+    self.vipc_server.create_buffers(VisionStreamType.VISION_STREAM_YUV_BACK, 4, False, W, H)
+    self.vipc_server.start_listener()
+
+  def cam_callback(self, image):
+    bgr = np.frombuffer(image.raw_data, dtype=np.dtype("uint8")).reshape((H, W, 4))[:, :, :3]
+    eof = int(sec_since_boot() * 1e9)
+
+    buf = self.vipc_server.get_buffer(VisionStreamType.VISION_STREAM_RGB_BACK)
+    offset, stride, rows = buf.plane(0)
+    np.asarray(buf.data)[offset:offset + stride * rows].reshape(rows, stride)[:, :W * 3] = bgr.reshape(H, W * 3)
+    self.vipc_server.send(buf, self.frame_id, eof, eof)
+
+    buf = self.vipc_server.get_buffer(VisionStreamType.VISION_STREAM_YUV_BACK)
+    bgr_to_yuv(bgr, buf)
+    self.vipc_server.send(buf, self.frame_id, eof, eof)
+
+    # the metadata camerad publishes with each frame
+    dat = messaging.new_message('frame')
+    dat.frame = {
+      "frameId": self.frame_id,
+      "timestampEof": eof,
+      "transform": [1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0]
+    }
+    pm.send('frame', dat)
+    self.frame_id += 1
 
 def imu_callback(imu):
   dat = messaging.new_message('sensorEvents', 2)
@@ -169,7 +200,8 @@ def go(q):
   blueprint.set_attribute('sensor_tick', '0.05')
   transform = carla.Transform(carla.Location(x=0.8, z=1.45))
   camera = world.spawn_actor(blueprint, transform, attach_to=vehicle)
-  camera.listen(cam_callback)
+  camerad = Camerad()
+  camera.listen(camerad.cam_callback)
 
   world.set_weather(carla.WeatherParameters(
     cloudyness=args.cloudyness,
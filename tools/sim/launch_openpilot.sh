@@ -3,6 +3,8 @@
 export PASSIVE="0"
 export NOBOARD="1"
 export SIMULATION="1"
+# the bridge serves the camera frames over VisionIPC itself
+export BLOCK="camerad"
 
 DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null && pwd )"
 cd ../../selfdrive && ./manager.py
@@ -23,6 +23,7 @@ sudo apt-get update && sudo apt-get install -y \
     libgles2-mesa-dev \
     libglfw3-dev \
     libglib2.0-0 \
+    liblz4-dev \
     liblzma-dev \
     libmysqlclient-dev \
     libomp-dev \
@@ -34,6 +35,7 @@ sudo apt-get update && sudo apt-get install -y \
     libtool \
     libusb-1.0-0-dev \
     libzmq3-dev \
+    libzstd-dev \
     libsdl-image1.2-dev libsdl-mixer1.2-dev libsdl-ttf2.0-dev libsmpeg-dev \
     libsdl1.2-dev  libportmidi-dev libswscale-dev libavformat-dev libavcodec-dev libfreetype6-dev \
     libsystemd-dev \